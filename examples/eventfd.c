@@ -16,8 +16,6 @@
  * more details.
  */
 
-#include <sys/eventfd.h>
-
 #include <vfn/nvme.h>
 
 #include <nvme/types.h>
@@ -45,8 +43,8 @@ static struct opt_table opts[] = {
 int main(int argc, char **argv)
 {
 	void *vaddr;
-	uint64_t iova, v;
-	int ret, efd, efds[2] = {-1, -1};
+	uint64_t iova;
+	int ret;
 
 	struct nvme_ctrl ctrl = {};
 	struct nvme_rq *rq;
@@ -66,16 +64,12 @@ int main(int argc, char **argv)
 	if (nvme_init(&ctrl, bdf, &ctrl_opts))
 		err(1, "failed to init nvme controller");
 
-	efds[1] = efd = eventfd(0, EFD_CLOEXEC);
-	if (efd < 0)
-		err(1, "failed to create eventfd");
-
-	if (vfio_set_irq(&ctrl.pci.dev, efds, 2))
-		err(1, "failed to set irqs");
-
 	if (nvme_create_ioqpair(&ctrl, 1, 64, 1, 0x0))
 		err(1, "could not create io queue pair");
 
+	if (nvme_cq_get_fd(&ctrl.cq[1]) < 0)
+		errx(1, "no eventfd associated with the completion queue");
+
 	vaddr = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
 
 	if (iommu_map_vaddr(__iommu_ctx(&ctrl), vaddr, 0x1000, &iova, 0x0))
@@ -92,10 +86,9 @@ int main(int argc, char **argv)
 
 	nvme_rq_exec(rq, &cmd);
 
-	/* wait for eventfd (interrupt) */
-	ret = read(efd, &v, sizeof(v));
-	if (ret < 0)
-		err(1, "error reading eventfd");
+	/* block on the eventfd (interrupt) without spinning */
+	if (nvme_cq_wait_hybrid(&ctrl.cq[1], 0, NULL))
+		err(1, "error waiting for interrupt");
 
 	/* consume cqe */
 	nvme_rq_spin(rq, NULL);
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <vfn/support.h>
+
+#include "histogram.h"
+
+static uint64_t histogram_value(unsigned int idx)
+{
+	unsigned int group = idx / HISTOGRAM_SUB_BUCKETS;
+	uint64_t sub = idx % HISTOGRAM_SUB_BUCKETS;
+	uint64_t lower;
+
+	if (!group)
+		return sub;
+
+	lower = (HISTOGRAM_SUB_BUCKETS + sub) << (group - 1);
+
+	/* report the midpoint of the bucket */
+	return lower + ((1ULL << (group - 1)) >> 1);
+}
+
+void histogram_merge(struct histogram *dst, struct histogram *src)
+{
+	for (int i = 0; i < HISTOGRAM_NBUCKETS; i++)
+		dst->buckets[i] += LOAD(src->buckets[i]);
+
+	dst->sum += LOAD(src->sum);
+	dst->count += LOAD(src->count);
+}
+
+void histogram_sub(struct histogram *dst, const struct histogram *src)
+{
+	uint64_t count = 0;
+
+	for (int i = 0; i < HISTOGRAM_NBUCKETS; i++) {
+		dst->buckets[i] -= src->buckets[i];
+		count += dst->buckets[i];
+	}
+
+	dst->sum -= src->sum;
+
+	/* count and buckets are sampled separately; keep them consistent */
+	dst->count = count;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+	uint64_t count = 0, target;
+	double t;
+
+	for (int i = 0; i < HISTOGRAM_NBUCKETS; i++)
+		count += h->buckets[i];
+
+	if (!count)
+		return 0;
+
+	t = p / 100 * (double)count;
+
+	/* round up */
+	target = (uint64_t)t;
+	if ((double)target < t || !target)
+		target++;
+
+	count = 0;
+
+	for (unsigned int i = 0; i < HISTOGRAM_NBUCKETS; i++) {
+		count += h->buckets[i];
+
+		if (count >= target)
+			return histogram_value(i);
+	}
+
+	return histogram_value(HISTOGRAM_NBUCKETS - 1);
+}
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef LIBVFN_EXAMPLES_HISTOGRAM_H
+#define LIBVFN_EXAMPLES_HISTOGRAM_H
+
+/*
+ * Log-linear histogram; each power of two is split into 2^HISTOGRAM_SUB_BITS
+ * linear sub-buckets, bounding the relative error of a recorded value to
+ * 1/2^HISTOGRAM_SUB_BITS (~3%).
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NBUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * A histogram has a single writer (histogram_record()), but may be read
+ * concurrently by others (histogram_merge()).
+ */
+struct histogram {
+	uint64_t count, sum;
+	uint64_t buckets[HISTOGRAM_NBUCKETS];
+};
+
+static inline unsigned int histogram_index(uint64_t v)
+{
+	unsigned int msb, shift;
+
+	if (v < HISTOGRAM_SUB_BUCKETS)
+		return (unsigned int)v;
+
+	msb = 63 - (unsigned int)__builtin_clzll(v);
+	shift = msb - HISTOGRAM_SUB_BITS;
+
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+		(unsigned int)((v >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+static inline void histogram_record(struct histogram *h, uint64_t v)
+{
+	unsigned int idx = histogram_index(v);
+
+	STORE(h->buckets[idx], h->buckets[idx] + 1);
+	STORE(h->sum, h->sum + v);
+	STORE(h->count, h->count + 1);
+}
+
+/* add the (possibly concurrently updated) counts of @src to @dst */
+void histogram_merge(struct histogram *dst, struct histogram *src);
+
+/* subtract the counts of @src from @dst; @src must be an earlier snapshot */
+void histogram_sub(struct histogram *dst, const struct histogram *src);
+
+/* value at percentile @p (0 < @p <= 100); 0 if the histogram is empty */
+uint64_t histogram_percentile(const struct histogram *h, double p);
+
+#endif /* LIBVFN_EXAMPLES_HISTOGRAM_H */
@@ -16,247 +16,1390 @@
  * more details.
  */
 
+#include <pthread.h>
+#include <sched.h>
+
 #include <vfn/nvme.h>
+#include <vfn/pci.h>
 
 #include <nvme/types.h>
 
 #include "ccan/err/err.h"
 #include "ccan/likely/likely.h"
+#include "ccan/minmax/minmax.h"
 #include "ccan/opt/opt.h"
 #include "ccan/str/str.h"
 
 #include "common.h"
-
-static char *io_pattern = "read";
-static unsigned long nsid, runtime_in_seconds = 10, warmup_in_seconds, update_stats_interval = 1;
-static int io_depth = 1, io_qsize = -1;
+#include "histogram.h"
+
+#define MAX_DEVICES 32
+#define MAX_NAMESPACES 16
+#define MAX_PERCENTILES 16
+
+static char *io_pattern = "read", *nsids = "", *cpus = "";
+static char *percentiles_list = "50,90,99,99.9,99.99", *output_format = "text";
+static char *arrival_dist = "constant", *iommu_context = "shared";
+static char *export_dir;
+static unsigned long rate;
+static unsigned int burst_size = 16, profile;
+static bool verify;
+static unsigned long runtime_in_seconds = 10, warmup_in_seconds, update_stats_interval = 1;
+static unsigned int block_size, rwmix_read = 50;
+static int io_depth = 1, io_qsize = -1, nthreads = 1;
 
 static struct opt_table opts[] = {
 	OPT_SUBTABLE(opts_base, NULL),
-	OPT_WITH_ARG("-N|--nsid NSID", opt_set_ulongval, opt_show_ulongval, &nsid,
-		     "namespace identifier"),
+	OPT_WITH_ARG("-I|--iommu-context MODE", opt_set_charp, opt_show_charp, &iommu_context,
+		     "iommu context for multiple devices (shared or device)"),
+	OPT_WITH_ARG("-N|--nsid NSID[,NSID...]", opt_set_charp, opt_show_charp, &nsids,
+		     "namespace identifier(s)"),
 	OPT_WITH_ARG("-t|--runtime SECONDS", opt_set_ulongval, opt_show_ulongval,
 		     &runtime_in_seconds, "runtime in seconds"),
 	OPT_WITH_ARG("-w|--warmup SECONDS", opt_set_ulongval, opt_show_ulongval,
 		     &warmup_in_seconds, "warmup time in seconds"),
 	OPT_WITH_ARG("-u|--update-stats-interval SECONDS", opt_set_ulongval, opt_show_ulongval,
 		     &update_stats_interval, "update stats interval in seconds"),
-	OPT_WITH_ARG("-p|--io-pattern", opt_set_charp, opt_show_charp, &io_pattern, "i/o pattern"),
-	OPT_WITH_ARG("-q|--io-depth", opt_set_intval, opt_show_intval, &io_depth, "i/o depth"),
+	OPT_WITH_ARG("-p|--io-pattern", opt_set_charp, opt_show_charp, &io_pattern,
+		     "i/o pattern ([rand]read, [rand]write, [rand]rw, [rand]trim or flush)"),
+	OPT_WITHOUT_ARG("-V|--verify", opt_set_bool, &verify,
+			"read back and verify written data"),
+	OPT_WITH_ARG("-M|--rwmix-read PERCENT", opt_set_uintval, opt_show_uintval, &rwmix_read,
+		     "percentage of reads for the rw i/o patterns"),
+	OPT_WITH_ARG("-b|--block-size BYTES", opt_set_uintval, opt_show_uintval, &block_size,
+		     "i/o size in bytes (default: logical block size)"),
+	OPT_WITH_ARG("-q|--io-depth", opt_set_intval, opt_show_intval, &io_depth,
+		     "i/o depth per thread (outstanding i/o limit in open-loop mode)"),
 	OPT_WITH_ARG("-n|--io-qsize", opt_set_intval, opt_show_intval, &io_qsize, "i/o queue size"),
+	OPT_WITH_ARG("-j|--threads N", opt_set_intval, opt_show_intval, &nthreads,
+		     "number of worker threads (one i/o queue pair each)"),
+	OPT_WITH_ARG("-c|--cpus CPU[,CPU...]", opt_set_charp, opt_show_charp, &cpus,
+		     "cpus to pin worker threads to (default: device local cpus)"),
+	OPT_WITH_ARG("-r|--rate IOPS", opt_set_ulongval, opt_show_ulongval, &rate,
+		     "open-loop target iops across all threads (default: closed-loop)"),
+	OPT_WITH_ARG("-a|--arrival DIST", opt_set_charp, opt_show_charp, &arrival_dist,
+		     "open-loop arrival distribution (constant, poisson or bursty)"),
+	OPT_WITH_ARG("-B|--burst-size N", opt_set_uintval, opt_show_uintval, &burst_size,
+		     "number of i/os per burst for the bursty arrival distribution"),
+	OPT_WITH_ARG("-P|--percentiles P[,P...]", opt_set_charp, opt_show_charp,
+		     &percentiles_list, "latency percentiles to report"),
+	OPT_WITH_ARG("-o|--output-format FORMAT", opt_set_charp, opt_show_charp, &output_format,
+		     "output format (text, json or csv)"),
+	OPT_WITH_ARG("-S|--profile N", opt_set_uintval, opt_show_uintval, &profile,
+		     "break down ticks per i/o by phase, timing one in N poll loop iterations"),
+	OPT_WITH_ARG("-E|--export-stats DIR", opt_set_charp, opt_show_charp, &export_dir,
+		     "export per-queue counters in DIR/vfn-<bdf> (see nvme_stats_export())"),
 	OPT_ENDTABLE,
 };
 
-static struct nvme_ctrl ctrl;
+struct ns {
+	uint32_t nsid;
+	uint64_t nsze;
+	unsigned int lbads;
+	uint32_t max_nlb;
+};
 
-static struct nvme_sq *sq;
-static struct nvme_cq *cq;
+/*
+ * Multiple controllers may be given as a comma separated list of BDFs; each
+ * worker stripes i/o across all of them (the same namespaces are used on
+ * each controller).
+ */
+static struct dev {
+	char *bdf;
+	struct nvme_ctrl ctrl;
+	struct ns ns[MAX_NAMESPACES];
+} devs[MAX_DEVICES];
+
+static int ndevs, nnamespaces;
 
-static bool draining;
 static bool random_io;
-static unsigned int queued;
-static uint64_t nsze, slba;
 
-static struct {
-	unsigned long completed, completed_quantum;
+static double percentiles[MAX_PERCENTILES];
+static int npercentiles;
+
+enum output {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_CSV,
+};
+
+static enum output output;
+
+enum arrival {
+	ARRIVAL_CONSTANT,
+	ARRIVAL_POISSON,
+	ARRIVAL_BURSTY,
+};
+
+static enum arrival arrival;
+
+enum op {
+	OP_READ,
+	OP_WRITE,
+	OP_TRIM,
+	OP_FLUSH,
+
+	NR_OPS,
+};
+
+static const char *op_names[NR_OPS] = {
+	[OP_READ] = "read",
+	[OP_WRITE] = "write",
+	[OP_TRIM] = "trim",
+	[OP_FLUSH] = "flush",
+};
+
+static const uint8_t op_opcodes[NR_OPS] = {
+	[OP_READ] = nvme_cmd_read,
+	[OP_WRITE] = nvme_cmd_write,
+	[OP_TRIM] = nvme_cmd_dsm,
+	[OP_FLUSH] = nvme_cmd_flush,
+};
+
+/* NR_OPS picks reads or writes according to --rwmix-read */
+static enum op pattern_op = NR_OPS;
+
+enum phase {
+	PHASE_WARMUP,
+	PHASE_RUN,
+	PHASE_DRAIN,
+};
+
+static enum phase phase;
+
+struct stats {
+	unsigned long completed, errors, miscompares;
 	uint64_t ttotal, tmin, tmax;
-} stats;
+};
 
 struct iod {
+	/* intended issue time; differs from the actual in open-loop mode */
 	uint64_t tsubmit;
 	union nvme_cmd cmd;
+
+	enum op op;
+
+	int dev;
+	struct ns *ns;
+	uint64_t slba, nblocks;
+
+	/* verify mode; set for the read back of a completed write */
+	bool verifying;
+	uint64_t seq;
+};
+
+/*
+ * In verify mode, every logical block written is stamped with its lba and a
+ * per-worker sequence number, and a crc64 of the block is stored at the end.
+ */
+struct dev_stats {
+	unsigned long completed, errors;
+	uint64_t bytes, ttotal;
+};
+
+/*
+ * Profiling (--profile) timestamps the phases of one in N iterations of the
+ * worker poll loop; the ticks per i/o of a phase is the time spent in it
+ * during the sampled iterations over the number of i/os completed in them.
+ * Completion handling excludes the resubmission (build and post) done from
+ * the callback and polling excludes the completion callbacks.
+ */
+enum prof_phase {
+	PROF_BUILD,
+	PROF_POST,
+	PROF_DOORBELL,
+	PROF_POLL,
+	PROF_REAP,
+	PROF_COMPLETE,
+
+	NR_PROF,
+};
+
+static const char *prof_names[NR_PROF] = {
+	[PROF_BUILD] = "build",
+	[PROF_POST] = "post",
+	[PROF_DOORBELL] = "doorbell",
+	[PROF_POLL] = "poll",
+	[PROF_REAP] = "reap",
+	[PROF_COMPLETE] = "complete",
+};
+
+struct prof {
+	uint64_t ticks[NR_PROF];
+
+	/* ticks spent in completion callbacks, including resubmission */
+	uint64_t tcallbacks;
+
+	/* i/os completed in the sampled iterations */
+	unsigned long sampled;
+
+	/* all iterations; nvme_cq_process() calls and those finding nothing */
+	unsigned long iters, polls, empty_polls;
+
+	/* doorbell writes and posted entries (only counted with -Dqstats=true) */
+	uint64_t doorbells, posted;
+};
+
+struct verify_hdr {
+	leint64_t lba;
+	leint64_t seq;
 };
 
-static void io_issue(struct nvme_rq *rq)
+struct worker {
+	pthread_t thread;
+	int id, cpu;
+
+	/* one i/o queue pair on each controller */
+	struct nvme_sq **sqs;
+	struct nvme_cq **cqs;
+	int dev_next;
+
+	uint64_t rng;
+	unsigned int queued;
+
+	/* per device and namespace lba range used by the worker and sequential cursor */
+	uint64_t *lba_first, *lba_nr, *slba;
+
+	uint64_t seq;
+
+	enum phase phase;
+
+	struct iod *iods;
+
+	/* open-loop mode */
+	struct iod **iods_free;
+	int niods_free;
+	double tnext, mean;
+	unsigned int burst;
+
+	/* written by the worker, read by the main thread */
+	struct stats stats[NR_OPS];
+	struct dev_stats *dev_stats;
+	struct histogram hist[NR_OPS];
+
+	/* --export-stats; the counter block of each queue pair */
+	struct nvme_stats_queue **xstats;
+
+	/* --profile; whether the current poll loop iteration is timed */
+	bool profiling;
+	struct prof prof;
+} __attribute__((aligned(64)));
+
+static struct worker *workers;
+
+/* xorshift64* */
+static inline uint64_t prng(struct worker *w)
+{
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+
+	return w->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniformly distributed in (0, 1] */
+static inline double prng_double(struct worker *w)
+{
+	return (double)((prng(w) >> 11) + 1) * 0x1.0p-53;
+}
+
+/* advance the intended issue time of the next i/o (open-loop mode) */
+static void next_arrival(struct worker *w)
+{
+	switch (arrival) {
+	case ARRIVAL_CONSTANT:
+		w->tnext += w->mean;
+		break;
+	case ARRIVAL_POISSON:
+		/* exponential inter-arrival times; math.h clashes with vfn/support/log.h */
+		w->tnext += -__builtin_log(prng_double(w)) * w->mean;
+		break;
+	case ARRIVAL_BURSTY:
+		/* bursts share an issue time and are spaced to keep the mean rate */
+		if (++w->burst == burst_size) {
+			w->burst = 0;
+			w->tnext += w->mean * burst_size;
+		}
+		break;
+	}
+}
+
+static void stats_reset(struct stats *stats)
+{
+	for (int i = 0; i < NR_OPS; i++) {
+		memset(&stats[i], 0x0, sizeof(*stats));
+		stats[i].tmin = UINT64_MAX;
+	}
+}
+
+static void verify_stamp(struct worker *w, struct iod *iod, void *buf)
+{
+	size_t lbasz = 1ULL << iod->ns->lbads;
+
+	iod->seq = ++w->seq;
+
+	for (uint64_t i = 0; i < iod->nblocks; i++) {
+		unsigned char *block = (unsigned char *)buf + i * lbasz;
+		struct verify_hdr *hdr = (struct verify_hdr *)block;
+		uint64_t *payload = (uint64_t *)(hdr + 1);
+		leint64_t *crc = (leint64_t *)(block + lbasz - sizeof(uint64_t));
+
+		hdr->lba = cpu_to_le64(iod->slba + i);
+		hdr->seq = cpu_to_le64(iod->seq);
+
+		while ((void *)payload < (void *)crc)
+			*payload++ = prng(w);
+
+		*crc = cpu_to_le64(nvme_crc64(~0ULL, block, lbasz - sizeof(uint64_t)));
+	}
+}
+
+/*
+ * Check the stamps of a read back. Overlapping writes in flight from the same
+ * worker may legitimately replace the data, so the sequence number is only
+ * required to match exactly at an i/o depth of one.
+ */
+static unsigned long verify_check(struct worker *w, struct iod *iod, void *buf)
+{
+	size_t lbasz = 1ULL << iod->ns->lbads;
+	unsigned long miscompares = 0;
+
+	for (uint64_t i = 0; i < iod->nblocks; i++) {
+		unsigned char *block = (unsigned char *)buf + i * lbasz;
+		struct verify_hdr *hdr = (struct verify_hdr *)block;
+		leint64_t *crc = (leint64_t *)(block + lbasz - sizeof(uint64_t));
+		uint64_t seq = le64_to_cpu(hdr->seq);
+
+		if (le64_to_cpu(hdr->lba) != iod->slba + i ||
+		    le64_to_cpu(*crc) != nvme_crc64(~0ULL, block, lbasz - sizeof(uint64_t)) ||
+		    seq > w->seq || (io_depth == 1 && seq != iod->seq)) {
+			if (!miscompares)
+				warnx("worker %d: miscompare at nsid %u lba 0x%"PRIx64, w->id,
+				      iod->ns->nsid, iod->slba + i);
+
+			miscompares++;
+		}
+	}
+
+	return miscompares;
+}
+
+static inline enum op io_op(struct worker *w)
+{
+	if (pattern_op != NR_OPS)
+		return pattern_op;
+
+	if (rwmix_read < 100 && prng(w) % 100 >= rwmix_read)
+		return OP_WRITE;
+
+	return OP_READ;
+}
+
+static void io_complete(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg);
+
+static void io_submit(struct worker *w, struct nvme_rq *rq, struct iod *iod, size_t len)
+{
+	uint64_t t = 0;
+
+	if (unlikely(w->profiling))
+		t = get_ticks();
+
+	if (len && nvme_rq_map_own_buf(&devs[iod->dev].ctrl, rq, &iod->cmd, len))
+		err(1, "nvme_rq_map_own_buf");
+
+	nvme_rq_submit(rq, &iod->cmd, io_complete, w);
+
+	if (unlikely(w->xstats))
+		nvme_stats_submitted(w->xstats[iod->dev], 1);
+
+	w->queued++;
+
+	if (unlikely(w->profiling))
+		w->prof.ticks[PROF_POST] += get_ticks() - t;
+}
+
+static void io_issue(struct worker *w, struct nvme_rq *rq, uint64_t tsubmit)
 {
 	struct iod *iod = rq->opaque;
+	struct nvme_dsm_range *range;
+	struct ns *ns;
+	uint64_t slba, t = 0;
+	int idx = 0;
+	size_t len = 0;
+
+	if (unlikely(w->profiling))
+		t = get_ticks();
+
+	if (nnamespaces > 1)
+		idx = (int)(prng(w) % (uint64_t)nnamespaces);
+
+	ns = &devs[iod->dev].ns[idx];
+
+	/* index into the per device and namespace ranges */
+	idx += iod->dev * nnamespaces;
+
+	memset(&iod->cmd, 0x0, sizeof(iod->cmd));
+
+	iod->op = io_op(w);
+	iod->ns = ns;
+	iod->nblocks = block_size >> ns->lbads;
+	iod->verifying = false;
+	iod->tsubmit = tsubmit;
+
+	iod->cmd.opcode = op_opcodes[iod->op];
+	iod->cmd.nsid = cpu_to_le32(ns->nsid);
+
+	if (iod->op == OP_FLUSH)
+		goto submit;
 
 	if (random_io) {
-		slba = rand() % nsze;
+		slba = w->lba_first[idx] +
+			(prng(w) % (w->lba_nr[idx] / iod->nblocks)) * iod->nblocks;
 	} else {
-		if (unlikely(++slba == nsze))
-			slba = 0;
+		slba = w->slba[idx];
+
+		w->slba[idx] += iod->nblocks;
+		if (unlikely(w->slba[idx] + iod->nblocks > w->lba_first[idx] + w->lba_nr[idx]))
+			w->slba[idx] = w->lba_first[idx];
 	}
 
-	iod->cmd.rw.slba = cpu_to_le64(slba);
+	iod->slba = slba;
 
-	iod->tsubmit = get_ticks();
+	switch (iod->op) {
+	case OP_READ:
+	case OP_WRITE:
+		iod->cmd.rw.slba = cpu_to_le64(slba);
+		iod->cmd.rw.nlb = cpu_to_le16((uint16_t)(iod->nblocks - 1));
+
+		if (verify && iod->op == OP_WRITE)
+			verify_stamp(w, iod, rq->buf.vaddr);
+
+		len = block_size;
+		break;
+
+	case OP_TRIM:
+		range = rq->buf.vaddr;
+
+		range->cattr = 0;
+		range->nlb = cpu_to_le32((uint32_t)iod->nblocks);
+		range->slba = cpu_to_le64(slba);
+
+		/* a single range (0's based) to deallocate */
+		iod->cmd.cdw10 = 0;
+		iod->cmd.cdw11 = cpu_to_le32(NVME_DSMGMT_AD);
+
+		len = sizeof(*range);
+		break;
+
+	default:
+		break;
+	}
+
+submit:
+	if (unlikely(w->profiling))
+		w->prof.ticks[PROF_BUILD] += get_ticks() - t;
+
+	io_submit(w, rq, iod, len);
+}
+
+/*
+ * Issue @iod on the next controller (round-robin striping). The request
+ * tracker @rq of a just completed command is reused when it belongs to the
+ * same controller.
+ */
+static void io_start(struct worker *w, struct iod *iod, struct nvme_rq *rq, uint64_t tsubmit)
+{
+	int dev = w->dev_next;
+
+	if (++w->dev_next == ndevs)
+		w->dev_next = 0;
+
+	if (!rq || iod->dev != dev) {
+		rq = nvme_rq_acquire(w->sqs[dev]);
+		rq->opaque = iod;
+	}
+
+	iod->dev = dev;
+
+	io_issue(w, rq, tsubmit);
+}
+
+static void sq_update_tails(struct worker *w)
+{
+	uint64_t t = 0;
+
+	if (unlikely(w->profiling))
+		t = get_ticks();
+
+	for (int i = 0; i < ndevs; i++)
+		nvme_sq_update_tail(w->sqs[i]);
+
+	if (unlikely(w->profiling))
+		w->prof.ticks[PROF_DOORBELL] += get_ticks() - t;
+}
 
-	nvme_sq_post(rq->sq, &iod->cmd);
+/* read back the data of a completed write (verify mode) */
+static void io_readback(struct worker *w, struct nvme_rq *rq, struct iod *iod)
+{
+	iod->op = OP_READ;
+	iod->cmd.opcode = nvme_cmd_read;
+	iod->verifying = true;
+	iod->tsubmit = get_ticks();
 
-	queued++;
+	io_submit(w, rq, iod, block_size);
 }
 
-static void io_complete(struct nvme_rq *rq)
+static void __io_complete(struct worker *w, struct nvme_rq *rq, struct nvme_cqe *cqe)
 {
 	struct iod *iod = rq->opaque;
+	struct stats *stats = &w->stats[iod->op];
+	struct dev_stats *dev_stats = &w->dev_stats[iod->dev];
 	uint64_t diff;
 
-	stats.completed_quantum++;
-	queued--;
+	w->queued--;
 
 	diff = get_ticks() - iod->tsubmit;
-	stats.ttotal += diff;
 
-	if (unlikely(diff < stats.tmin))
-		stats.tmin = diff;
+	dev_stats->completed++;
+	dev_stats->ttotal += diff;
+
+	if (unlikely(w->xstats))
+		nvme_stats_completed(w->xstats[iod->dev], cqe, diff);
+
+	if (iod->op == OP_READ || iod->op == OP_WRITE)
+		dev_stats->bytes += block_size;
+
+	stats->completed++;
+	stats->ttotal += diff;
+
+	if (unlikely(diff < stats->tmin))
+		stats->tmin = diff;
+
+	if (unlikely(diff > stats->tmax))
+		stats->tmax = diff;
+
+	histogram_record(&w->hist[iod->op], diff);
+
+	if (unlikely(!nvme_cqe_ok(cqe))) {
+		stats->errors++;
+		dev_stats->errors++;
+	} else if (verify) {
+		if (iod->verifying)
+			stats->miscompares += verify_check(w, iod, rq->buf.vaddr);
+		else if (iod->op == OP_WRITE) {
+			io_readback(w, rq, iod);
+			return;
+		}
+	}
+
+	/* the request tracker is released unless it is resubmitted */
+	if (rate) {
+		w->iods_free[w->niods_free++] = iod;
+		return;
+	}
+
+	if (unlikely(w->phase == PHASE_DRAIN))
+		return;
 
-	if (unlikely(diff > stats.tmax))
-		stats.tmax = diff;
+	io_start(w, iod, rq, get_ticks());
+}
+
+static void io_complete(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg)
+{
+	struct worker *w = arg;
+	uint64_t t, nested;
 
-	if (unlikely(draining)) {
-		nvme_rq_release(rq);
+	if (likely(!w->profiling)) {
+		__io_complete(w, rq, cqe);
 		return;
 	}
 
-	io_issue(rq);
+	nested = w->prof.ticks[PROF_BUILD] + w->prof.ticks[PROF_POST];
+	t = get_ticks();
+
+	__io_complete(w, rq, cqe);
+
+	t = get_ticks() - t;
+	nested = w->prof.ticks[PROF_BUILD] + w->prof.ticks[PROF_POST] - nested;
+
+	w->prof.ticks[PROF_COMPLETE] += t - nested;
+	w->prof.tcallbacks += t;
 }
 
-static void update_and_print_stats(bool warmup)
+static void cq_process(struct worker *w)
 {
-	float iops, mbps;
+	uint64_t t = 0, tcallbacks = 0;
+	int n, processed = 0;
 
-	if (!isatty(STDOUT_FILENO))
-		goto out;
+	if (unlikely(w->xstats)) {
+		for (int i = 0; i < ndevs; i++)
+			nvme_stats_sync_queue(w->xstats[i], w->sqs[i]);
+	}
 
-	iops = (float)stats.completed_quantum / update_stats_interval;
-	mbps = iops * 512 / (1024 * 1024);
+	if (!profile) {
+		for (int i = 0; i < ndevs; i++)
+			nvme_cq_process(w->cqs[i], io_depth);
 
-	printf("%10s iops %10.2f mbps %10.2f\r", warmup ? "(warmup)" : "", iops, mbps);
-	fflush(stdout);
+		return;
+	}
+
+	if (w->profiling) {
+		tcallbacks = w->prof.tcallbacks;
+		t = get_ticks();
+	}
+
+	for (int i = 0; i < ndevs; i++) {
+		n = nvme_cq_process(w->cqs[i], io_depth);
 
-out:
-	stats.completed += stats.completed_quantum;
-	stats.completed_quantum = 0;
+		w->prof.polls++;
+
+		if (!n)
+			w->prof.empty_polls++;
+
+		processed += n;
+	}
+
+	if (w->profiling) {
+		t = get_ticks() - t - (w->prof.tcallbacks - tcallbacks);
+
+		/* an iteration finding nothing is spinning */
+		w->prof.ticks[processed ? PROF_REAP : PROF_POLL] += t;
+		w->prof.sampled += (unsigned long)processed;
+	}
 }
 
-static int reap(void)
+/*
+ * Issue all i/os whose intended issue time has passed. If the queue depth
+ * limit is hit, the backlog is issued as soon as slots free up, and their
+ * latency is still accounted from the intended issue time to avoid
+ * coordinated omission.
+ */
+static void io_issue_open_loop(struct worker *w)
 {
-	struct nvme_cqe *cqe;
-	int reaped = 0;
+	uint64_t now = get_ticks();
+	bool issued = false;
 
-	do {
-		cqe = nvme_cq_get_cqe(cq);
-		if (!cqe)
-			break;
+	while (w->niods_free && w->tnext <= (double)now) {
+		io_start(w, w->iods_free[--w->niods_free], NULL, (uint64_t)w->tnext);
+		next_arrival(w);
 
-		reaped++;
+		issued = true;
+	}
 
-		io_complete(__nvme_rq_from_cqe(sq, cqe));
-	} while (1);
+	if (issued)
+		sq_update_tails(w);
+}
 
-	if (reaped)
-		nvme_cq_update_head(cq);
+static void qstats_read(struct worker *w, uint64_t *doorbells, uint64_t *posted)
+{
+	struct nvme_sq_stats sq_stats;
+	struct nvme_cq_stats cq_stats;
 
-	return reaped;
+	*doorbells = *posted = 0;
+
+	for (int i = 0; i < ndevs; i++) {
+		nvme_sq_get_stats(w->sqs[i], &sq_stats);
+		nvme_cq_get_stats(w->cqs[i], &cq_stats);
+
+		*doorbells += sq_stats.doorbells + cq_stats.doorbells;
+		*posted += sq_stats.posted;
+	}
 }
 
-static void run(void)
+/* the queue counters are recorded relative to the start of the run */
+static void prof_reset(struct worker *w)
+{
+	memset(&w->prof, 0x0, sizeof(w->prof));
+
+	qstats_read(w, &w->prof.doorbells, &w->prof.posted);
+}
+
+static void prof_finish(struct worker *w)
+{
+	uint64_t doorbells, posted;
+
+	w->profiling = false;
+
+	qstats_read(w, &doorbells, &posted);
+
+	w->prof.doorbells = doorbells - w->prof.doorbells;
+	w->prof.posted = posted - w->prof.posted;
+}
+
+static void *worker_run(void *opaque)
 {
-	uint64_t deadline, update_stats, now = get_ticks();
-	uint64_t twarmup, trun, tupdate;
-	bool warmup = (warmup_in_seconds > 0);
-	float iops, mbps, lavg, lmin, lmax;
-	uint64_t iova;
-	void *mem;
-	unsigned int to_submit = io_depth;
+	struct worker *w = opaque;
 
-	twarmup = warmup_in_seconds * __vfn_ticks_freq;
-	trun = runtime_in_seconds * __vfn_ticks_freq;
-	tupdate = update_stats_interval * __vfn_ticks_freq;
+	if (w->cpu >= 0) {
+		cpu_set_t set;
 
-	deadline = now + (warmup ? twarmup : trun);
-	update_stats = now + tupdate;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
 
-	stats.tmin = UINT64_MAX;
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			warnx("worker %d: could not pin to cpu %d", w->id, w->cpu);
+	}
 
-	mem = mmap(NULL, io_depth * 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-	if (!mem)
-		err(1, "mmap");
+	w->phase = LOAD(phase);
+	stats_reset(w->stats);
+	memset(w->dev_stats, 0x0, sizeof(*w->dev_stats) * (size_t)ndevs);
+	prof_reset(w);
 
-	if (iommu_map_vaddr(__iommu_ctx(&ctrl), mem, io_depth * 0x1000, &iova, 0x0))
-		err(1, "failed to map");
+	if (rate) {
+		for (int i = 0; i < io_depth; i++)
+			w->iods_free[w->niods_free++] = &w->iods[i];
+
+		w->tnext = (double)get_ticks();
+	} else {
+		for (int i = 0; i < io_depth; i++)
+			io_start(w, &w->iods[i], NULL, get_ticks());
+
+		sq_update_tails(w);
+	}
 
 	do {
-		struct nvme_rq *rq;
-		struct iod *iod;
+		enum phase p = LOAD(phase);
 
-		rq = nvme_rq_acquire(sq);
-		if (!rq)
+		if (unlikely(p != w->phase)) {
+			if (w->phase == PHASE_WARMUP) {
+				stats_reset(w->stats);
+				memset(w->dev_stats, 0x0, sizeof(*w->dev_stats) * (size_t)ndevs);
+				prof_reset(w);
+			}
+
+			w->phase = p;
+		}
+
+		if (profile)
+			w->profiling = ++w->prof.iters % profile == 0;
+
+		if (rate && w->phase != PHASE_DRAIN)
+			io_issue_open_loop(w);
+
+		cq_process(w);
+
+		/* completions may have resubmitted on another controller */
+		sq_update_tails(w);
+	} while (w->phase != PHASE_DRAIN);
+
+	prof_finish(w);
+
+	while (w->queued) {
+		for (int i = 0; i < ndevs; i++)
+			nvme_cq_process(w->cqs[i], io_depth);
+
+		sq_update_tails(w);
+	}
+
+	return NULL;
+}
+
+static void stats_aggregate(struct stats *total)
+{
+	stats_reset(total);
+
+	for (int i = 0; i < nthreads; i++) {
+		for (int op = 0; op < NR_OPS; op++) {
+			struct stats *stats = &workers[i].stats[op];
+
+			total[op].completed += stats->completed;
+			total[op].errors += stats->errors;
+			total[op].miscompares += stats->miscompares;
+			total[op].ttotal += stats->ttotal;
+
+			if (stats->tmin < total[op].tmin)
+				total[op].tmin = stats->tmin;
+
+			if (stats->tmax > total[op].tmax)
+				total[op].tmax = stats->tmax;
+		}
+	}
+}
+
+static void stats_sum(struct stats *sum, struct stats *stats)
+{
+	memset(sum, 0x0, sizeof(*sum));
+	sum->tmin = UINT64_MAX;
+
+	for (int op = 0; op < NR_OPS; op++) {
+		sum->completed += stats[op].completed;
+		sum->errors += stats[op].errors;
+		sum->miscompares += stats[op].miscompares;
+		sum->ttotal += stats[op].ttotal;
+
+		if (stats[op].tmin < sum->tmin)
+			sum->tmin = stats[op].tmin;
+
+		if (stats[op].tmax > sum->tmax)
+			sum->tmax = stats[op].tmax;
+	}
+}
+
+static struct histogram hist_base[NR_OPS], hist_cur[NR_OPS];
+static struct histogram hist_total, hist_prev, hist_interval;
+
+static void hist_snapshot(struct histogram *h)
+{
+	memset(h, 0x0, sizeof(*h) * NR_OPS);
+
+	for (int i = 0; i < nthreads; i++) {
+		for (int op = 0; op < NR_OPS; op++)
+			histogram_merge(&h[op], &workers[i].hist[op]);
+	}
+}
+
+/* fold a per-op snapshot into a single histogram */
+static void hist_sum(struct histogram *sum, struct histogram *h)
+{
+	memset(sum, 0x0, sizeof(*sum));
+
+	for (int op = 0; op < NR_OPS; op++)
+		histogram_merge(sum, &h[op]);
+}
+
+static inline double ticks_to_usec(uint64_t ticks)
+{
+	return (double)ticks_to_ns(ticks) / 1000;
+}
+
+/* bytes transferred (or deallocated) per i/o */
+static inline unsigned int op_bytes(int op)
+{
+	return op == OP_FLUSH ? 0 : block_size;
+}
+
+static void print_percentiles(const struct histogram *h)
+{
+	for (int i = 0; i < npercentiles; i++) {
+		double lat = ticks_to_usec(histogram_percentile(h, percentiles[i]));
+
+		switch (output) {
+		case OUTPUT_JSON:
+			printf("%s\"%g\": %.2f", i ? ", " : "", percentiles[i], lat);
+			break;
+		case OUTPUT_CSV:
+			printf(",%.2f", lat);
 			break;
+		case OUTPUT_TEXT:
+			printf(" %10.2f", lat);
+			break;
+		}
+	}
+}
+
+static void print_header(void)
+{
+	switch (output) {
+	case OUTPUT_JSON:
+		printf("{\n  \"intervals\": [");
+		break;
+	case OUTPUT_CSV:
+		printf("kind,op,time,iops,mbps,lavg,lmin,lmax,errors,miscompares");
+
+		for (int i = 0; i < npercentiles; i++)
+			printf(",p%g", percentiles[i]);
+
+		printf("\n");
+		break;
+	case OUTPUT_TEXT:
+		break;
+	}
+}
 
-		iod = calloc(1, sizeof(*iod));
+static void print_interval(unsigned long t, const struct histogram *h)
+{
+	double iops = (double)h->count / update_stats_interval;
+	double lavg = h->count ? ticks_to_usec(h->sum) / (double)h->count : 0;
+
+	switch (output) {
+	case OUTPUT_JSON:
+		printf("%s\n    { \"time\": %lu, \"iops\": %.2f, \"lavg\": %.2f, "
+		       "\"percentiles\": { ", t == update_stats_interval ? "" : ",", t, iops, lavg);
+		print_percentiles(h);
+		printf(" } }");
+		break;
+	case OUTPUT_CSV:
+		printf("interval,total,%lu,%.2f,,%.2f,,,,", t, iops, lavg);
+		print_percentiles(h);
+		printf("\n");
+		break;
+	case OUTPUT_TEXT:
+		if (!isatty(STDOUT_FILENO))
+			return;
+
+		printf("%10s iops %10.2f lavg %10.2f\r", "", iops, lavg);
+		fflush(stdout);
+		return;
+	}
 
-		iod->cmd.rw.opcode = nvme_cmd_read;
-		iod->cmd.rw.nsid = cpu_to_le32(nsid);
-		iod->cmd.rw.dptr.prp1 = cpu_to_le64(iova);
+	fflush(stdout);
+}
 
-		nvme_rq_prep_cmd(rq, &iod->cmd);
+static void print_summary_op(const char *name, struct stats *stats, double mbps,
+			     const struct histogram *h, bool first)
+{
+	double iops, lavg, lmin, lmax;
+
+	iops = (double)stats->completed / runtime_in_seconds;
+	lmin = ticks_to_usec(stats->tmin);
+	lmax = ticks_to_usec(stats->tmax);
+	lavg = ticks_to_usec(stats->ttotal) / (double)stats->completed;
+
+	switch (output) {
+	case OUTPUT_JSON:
+		printf("%s\n    \"%s\": { \"iops\": %.2f, \"mbps\": %.2f, \"lavg\": %.2f, "
+		       "\"lmin\": %.2f, \"lmax\": %.2f, \"errors\": %lu, \"miscompares\": %lu, "
+		       "\"percentiles\": { ", first ? "" : ",", name, iops, mbps, lavg, lmin, lmax,
+		       stats->errors, stats->miscompares);
+		print_percentiles(h);
+		printf(" } }");
+		break;
+	case OUTPUT_CSV:
+		printf("summary,%s,%lu,%.2f,%.2f,%.2f,%.2f,%.2f,%lu,%lu", name, runtime_in_seconds,
+		       iops, mbps, lavg, lmin, lmax, stats->errors, stats->miscompares);
+		print_percentiles(h);
+		printf("\n");
+		break;
+	case OUTPUT_TEXT:
+		printf("%10s %10.2f %10.2f %10.2f %10.2f %10.2f %10lu %10lu", name, iops, mbps,
+		       lavg, lmin, lmax, stats->errors, stats->miscompares);
+		print_percentiles(h);
+		printf("\n");
+		break;
+	}
+}
 
-		iova += 0x1000;
+static void print_summary(struct stats *stats, struct histogram *h)
+{
+	double mbps, mbps_total = 0;
+	struct stats total;
+	bool first = true;
+
+	switch (output) {
+	case OUTPUT_JSON:
+		printf("\n  ],\n  \"summary\": {");
+		break;
+	case OUTPUT_CSV:
+		break;
+	case OUTPUT_TEXT:
+		printf("%10s %10s %10s %10s %10s %10s %10s %10s", "op", "iops", "mbps", "lavg",
+		       "lmin", "lmax", "errors", "miscmp");
+
+		for (int i = 0; i < npercentiles; i++) {
+			char buf[16];
+
+			snprintf(buf, sizeof(buf), "p%g", percentiles[i]);
+			printf(" %10s", buf);
+		}
 
-		rq->opaque = iod;
+		printf("\n");
+		break;
+	}
 
-		io_issue(rq);
-	} while (true && --to_submit > 0);
+	for (int op = 0; op < NR_OPS; op++) {
+		if (!stats[op].completed)
+			continue;
 
-	nvme_sq_update_tail(sq);
+		mbps = (double)stats[op].completed * op_bytes(op) / runtime_in_seconds /
+			(1024 * 1024);
 
-	do {
+		if (op == OP_READ || op == OP_WRITE)
+			mbps_total += mbps;
 
-		while (!reap())
-			;
+		print_summary_op(op_names[op], &stats[op], mbps, &h[op], first);
+		first = false;
+	}
 
-		nvme_sq_update_tail(sq);
+	stats_sum(&total, stats);
+	hist_sum(&hist_total, h);
 
-		now = get_ticks();
+	if (total.completed)
+		print_summary_op("total", &total, mbps_total, &hist_total, first);
 
-		if (now > update_stats) {
-			update_stats = update_stats + tupdate;
-			update_and_print_stats(warmup);
+	if (output == OUTPUT_JSON)
+		printf("\n  }");
+}
+
+static void print_devices(void)
+{
+	switch (output) {
+	case OUTPUT_JSON:
+		printf(",\n  \"devices\": {");
+		break;
+	case OUTPUT_CSV:
+		break;
+	case OUTPUT_TEXT:
+		printf("\n%16s %10s %10s %10s %10s\n", "device", "iops", "mbps", "lavg", "errors");
+		break;
+	}
+
+	for (int d = 0; d < ndevs; d++) {
+		struct dev_stats total = {};
+		double iops, mbps, lavg;
+
+		for (int i = 0; i < nthreads; i++) {
+			struct dev_stats *stats = &workers[i].dev_stats[d];
+
+			total.completed += stats->completed;
+			total.errors += stats->errors;
+			total.bytes += stats->bytes;
+			total.ttotal += stats->ttotal;
 		}
 
-		if (now > deadline) {
-			if (warmup) {
-				warmup = false;
+		iops = (double)total.completed / runtime_in_seconds;
+		mbps = (double)total.bytes / runtime_in_seconds / (1024 * 1024);
+		lavg = total.completed ? ticks_to_usec(total.ttotal) / (double)total.completed : 0;
 
-				memset(&stats, 0x0, sizeof(stats));
-				stats.tmin = UINT64_MAX;
-				deadline = now + trun;
+		switch (output) {
+		case OUTPUT_JSON:
+			printf("%s\n    \"%s\": { \"iops\": %.2f, \"mbps\": %.2f, \"lavg\": %.2f, "
+			       "\"errors\": %lu }", d ? "," : "", devs[d].bdf, iops, mbps, lavg,
+			       total.errors);
+			break;
+		case OUTPUT_CSV:
+			printf("device,%s,%lu,%.2f,%.2f,%.2f,,,%lu,", devs[d].bdf,
+			       runtime_in_seconds, iops, mbps, lavg, total.errors);
 
-				continue;
-			}
+			for (int i = 0; i < npercentiles; i++)
+				printf(",");
 
+			printf("\n");
+			break;
+		case OUTPUT_TEXT:
+			printf("%16s %10.2f %10.2f %10.2f %10lu\n", devs[d].bdf, iops, mbps, lavg,
+			       total.errors);
 			break;
 		}
-	} while (true);
+	}
 
-	update_and_print_stats(false);
+	if (output == OUTPUT_JSON)
+		printf("\n  }");
+}
 
-	iops = (float)stats.completed / runtime_in_seconds;
-	mbps = iops * 512 / (1024 * 1024);
-	lmin = (float)stats.tmin * 1000 * 1000 / __vfn_ticks_freq;
-	lmax = (float)stats.tmax * 1000 * 1000 / __vfn_ticks_freq;
-	lavg = ((float)stats.ttotal * 1000 * 1000 / __vfn_ticks_freq) / stats.completed;
+static void print_profile(struct stats *stats)
+{
+	struct prof total = {};
+	struct stats sum;
+	uint64_t ttotal = 0;
+	double ticks, ns, ratio, doorbells = -1;
 
-	printf("%10s %10s %10s %10s %10s\n", "iops", "mbps", "lavg", "lmin", "lmax");
-	printf("%10.2f %10.2f %10.2f %10.2f %10.2f\n", iops, mbps, lavg, lmin, lmax);
+	for (int i = 0; i < nthreads; i++) {
+		struct prof *prof = &workers[i].prof;
 
-	draining = true;
+		for (int ph = 0; ph < NR_PROF; ph++) {
+			total.ticks[ph] += prof->ticks[ph];
+			ttotal += prof->ticks[ph];
+		}
 
-	nvme_sq_update_tail(sq);
+		total.sampled += prof->sampled;
+		total.polls += prof->polls;
+		total.empty_polls += prof->empty_polls;
+		total.doorbells += prof->doorbells;
+		total.posted += prof->posted;
+	}
 
-	do {
-		reap();
-	} while (queued);
+	stats_sum(&sum, stats);
+
+	ratio = total.polls ? (double)total.empty_polls / (double)total.polls : 0;
+
+	/* without queue counters, nothing is ever posted */
+	if (total.posted && sum.completed)
+		doorbells = (double)total.doorbells / (double)sum.completed;
+
+	switch (output) {
+	case OUTPUT_JSON:
+		printf(",\n  \"profile\": {\n    \"sampled\": %lu,", total.sampled);
+		break;
+	case OUTPUT_CSV:
+		break;
+	case OUTPUT_TEXT:
+		printf("\n%10s %10s %10s\n", "phase", "ticks/io", "ns/io");
+		break;
+	}
+
+	for (int ph = 0; ph <= NR_PROF; ph++) {
+		const char *name = ph < NR_PROF ? prof_names[ph] : "total";
+		uint64_t t = ph < NR_PROF ? total.ticks[ph] : ttotal;
+
+		ticks = total.sampled ? (double)t / (double)total.sampled : 0;
+		ns = total.sampled ? (double)ticks_to_ns(t) / (double)total.sampled : 0;
+
+		switch (output) {
+		case OUTPUT_JSON:
+			printf("%s\n    \"%s\": { \"ticks\": %.1f, \"ns\": %.1f }",
+			       ph ? "," : "", name, ticks, ns);
+			break;
+		case OUTPUT_CSV:
+			/* the time per i/o goes in the lavg column */
+			printf("profile,%s,%lu,,,%.3f,,,,", name, runtime_in_seconds, ns / 1000);
+
+			for (int i = 0; i < npercentiles; i++)
+				printf(",");
+
+			printf("\n");
+			break;
+		case OUTPUT_TEXT:
+			printf("%10s %10.1f %10.1f\n", name, ticks, ns);
+			break;
+		}
+	}
+
+	switch (output) {
+	case OUTPUT_JSON:
+		printf(",\n    \"empty_poll_ratio\": %.4f", ratio);
+
+		if (doorbells >= 0)
+			printf(",\n    \"doorbells_per_io\": %.4f", doorbells);
+
+		printf("\n  }");
+		break;
+	case OUTPUT_CSV:
+		break;
+	case OUTPUT_TEXT:
+		printf("\nempty polls %.2f%% (%lu of %lu), sampled i/os %lu\n", ratio * 100,
+		       total.empty_polls, total.polls, total.sampled);
+
+		if (doorbells >= 0)
+			printf("doorbell writes per i/o %.2f\n", doorbells);
+		else
+			printf("doorbell writes per i/o n/a (libvfn built without qstats)\n");
+
+		break;
+	}
+}
+
+static void run(void)
+{
+	struct stats total[NR_OPS];
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]))
+			errx(1, "could not create worker thread");
+	}
+
+	for (unsigned long t = 0; t < warmup_in_seconds; t += update_stats_interval) {
+		sleep((unsigned int)update_stats_interval);
+
+		if (output == OUTPUT_TEXT && isatty(STDOUT_FILENO)) {
+			hist_snapshot(hist_cur);
+			hist_sum(&hist_total, hist_cur);
+
+			printf("%10s iops %10.2f\r", "(warmup)",
+			       (double)(hist_total.count - hist_prev.count) /
+			       update_stats_interval);
+			fflush(stdout);
+
+			memcpy(&hist_prev, &hist_total, sizeof(hist_prev));
+		}
+	}
+
+	STORE(phase, PHASE_RUN);
+
+	hist_snapshot(hist_base);
+	hist_sum(&hist_prev, hist_base);
+
+	print_header();
+
+	for (unsigned long t = update_stats_interval; t <= runtime_in_seconds;
+	     t += update_stats_interval) {
+		sleep((unsigned int)update_stats_interval);
+
+		hist_snapshot(hist_cur);
+		hist_sum(&hist_total, hist_cur);
+
+		memcpy(&hist_interval, &hist_total, sizeof(hist_interval));
+		histogram_sub(&hist_interval, &hist_prev);
+
+		print_interval(t, &hist_interval);
+
+		memcpy(&hist_prev, &hist_total, sizeof(hist_prev));
+	}
+
+	STORE(phase, PHASE_DRAIN);
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	stats_aggregate(total);
+
+	hist_snapshot(hist_cur);
+
+	for (int op = 0; op < NR_OPS; op++)
+		histogram_sub(&hist_cur[op], &hist_base[op]);
+
+	print_summary(total, hist_cur);
+
+	if (ndevs > 1)
+		print_devices();
+
+	if (profile)
+		print_profile(total);
+
+	if (output == OUTPUT_JSON)
+		printf("\n}\n");
+}
+
+static int parse_percentiles(const char *list)
+{
+	const char *p = list;
+	char *endptr;
+
+	while (*p) {
+		if (npercentiles == MAX_PERCENTILES)
+			return -1;
+
+		percentiles[npercentiles] = strtod(p, &endptr);
+		if (endptr == p || (*endptr && *endptr != ','))
+			return -1;
+
+		if (percentiles[npercentiles] <= 0 || percentiles[npercentiles] > 100)
+			return -1;
+
+		npercentiles++;
+
+		p = *endptr ? endptr + 1 : endptr;
+	}
+
+	return 0;
+}
+
+static int parse_list(const char *list, int *v, int max)
+{
+	const char *p = list;
+	char *endptr;
+	int n = 0;
+
+	while (*p) {
+		if (n == max)
+			return -1;
+
+		v[n++] = (int)strtol(p, &endptr, 0);
+		if (endptr == p || (*endptr && *endptr != ','))
+			return -1;
+
+		p = *endptr ? endptr + 1 : endptr;
+	}
+
+	return n;
+}
+
+static void identify_ns(struct nvme_ctrl *ctrl, struct ns *ns)
+{
+	struct nvme_ns *info = nvme_ns_get(ctrl, ns->nsid);
+
+	if (!info)
+		errx(1, "namespace %u is inactive", ns->nsid);
+
+	ns->nsze = info->nsze;
+	ns->lbads = info->lbads;
+	ns->max_nlb = info->max_nlb;
+}
+
+static void setup_workers(void)
+{
+	int ncpus, cpulist[1024], *local = NULL;
+
+	ncpus = parse_list(cpus, cpulist, 1024);
+	if (ncpus < 0)
+		errx(1, "invalid --cpus list");
+
+	if (!ncpus) {
+		ncpus = pci_device_get_local_cpus(devs[0].bdf, &local);
+		if (ncpus > 1024)
+			ncpus = 1024;
+
+		for (int i = 0; i < ncpus; i++)
+			cpulist[i] = local[i];
+
+		free(local);
+	}
+
+	workers = calloc((size_t)nthreads, sizeof(*workers));
+	if (!workers)
+		err(1, "calloc");
+
+	for (int i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+		size_t nranges = (size_t)(ndevs * nnamespaces);
+		int qid = i + 1;
+
+		w->id = i;
+		w->cpu = ncpus > 0 ? cpulist[i % ncpus] : -1;
+		w->rng = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1) ^ get_ticks();
+
+		w->sqs = calloc((size_t)ndevs, sizeof(struct nvme_sq *));
+		w->cqs = calloc((size_t)ndevs, sizeof(struct nvme_cq *));
+		w->dev_stats = calloc((size_t)ndevs, sizeof(struct dev_stats));
+		w->iods = calloc((size_t)io_depth, sizeof(struct iod));
+		w->iods_free = calloc((size_t)io_depth, sizeof(struct iod *));
+		w->lba_first = calloc(nranges, sizeof(uint64_t));
+		w->lba_nr = calloc(nranges, sizeof(uint64_t));
+		w->slba = calloc(nranges, sizeof(uint64_t));
+		if (!w->sqs || !w->cqs || !w->dev_stats || !w->iods || !w->iods_free ||
+		    !w->lba_first || !w->lba_nr || !w->slba)
+			err(1, "calloc");
+
+		/* stagger the striping such that workers start on different devices */
+		w->dev_next = i % ndevs;
+
+		for (int d = 0; d < ndevs; d++) {
+			struct nvme_ctrl *ctrl = &devs[d].ctrl;
+
+			if (nvme_create_iocq(ctrl, qid, io_qsize, -1))
+				err(1, "nvme_create_iocq");
+
+			if (nvme_create_iosq_buf(ctrl, qid, io_qsize, &ctrl->cq[qid], 0x0,
+						 block_size))
+				err(1, "nvme_create_iosq_buf");
+
+			w->sqs[d] = &ctrl->sq[qid];
+			w->cqs[d] = &ctrl->cq[qid];
+		}
+
+		if (export_dir) {
+			w->xstats = calloc((size_t)ndevs, sizeof(struct nvme_stats_queue *));
+			if (!w->xstats)
+				err(1, "calloc");
+
+			for (int d = 0; d < ndevs; d++)
+				w->xstats[d] = nvme_stats_queue(&devs[d].ctrl, qid);
+		}
+
+		/* the target rate is split evenly between workers */
+		if (rate)
+			w->mean = (double)get_ticks_freq() * nthreads / (double)rate;
+
+		/*
+		 * Spread sequential workers out over the namespaces. In verify
+		 * mode, workers get disjoint lba ranges such that they never
+		 * overwrite each other's stamps.
+		 */
+		for (int j = 0; j < ndevs * nnamespaces; j++) {
+			struct ns *ns = &devs[j / nnamespaces].ns[j % nnamespaces];
+			uint64_t nblocks = block_size >> ns->lbads;
+			uint64_t start = ALIGN_DOWN(ns->nsze / (uint64_t)nthreads * (uint64_t)i,
+						    nblocks);
+
+			w->lba_first[j] = 0;
+			w->lba_nr[j] = ns->nsze;
+
+			if (verify) {
+				w->lba_first[j] = start;
+				w->lba_nr[j] = ALIGN_DOWN(ns->nsze / (uint64_t)nthreads, nblocks);
+
+				if (w->lba_nr[j] < nblocks)
+					errx(1, "namespace %u too small to verify", ns->nsid);
+			}
+
+			w->slba[j] = start;
+		}
+	}
 }
 
 int main(int argc, char **argv)
 {
-	void *vaddr;
-	ssize_t len;
-	struct nvme_id_ns *id_ns;
-	union nvme_cmd cmd;
+	int ids[MAX_NAMESPACES];
+	char *bdfs, *tok, *saveptr;
 
 	opt_register_table(opts, NULL);
 	opt_parse(&argc, argv, opt_log_stderr_exit);
@@ -267,51 +1410,141 @@ int main(int argc, char **argv)
 	if (streq(bdf, ""))
 		opt_usage_exit_fail("missing --device parameter");
 
-	if (!nsid || nsid > (NVME_NSID_ALL - 1))
+	nnamespaces = parse_list(nsids, ids, MAX_NAMESPACES);
+	if (nnamespaces <= 0)
 		opt_usage_exit_fail("missing or invalid --nsid parameter");
 
+	for (int i = 0; i < nnamespaces; i++) {
+		if (ids[i] <= 0 || (uint32_t)ids[i] > (NVME_NSID_ALL - 1))
+			opt_usage_exit_fail("invalid --nsid parameter");
+	}
+
+	bdfs = strdup(bdf);
+	if (!bdfs)
+		err(1, "strdup");
+
+	for (tok = strtok_r(bdfs, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		if (ndevs == MAX_DEVICES)
+			opt_usage_exit_fail("too many devices");
+
+		devs[ndevs].bdf = tok;
+
+		for (int i = 0; i < nnamespaces; i++)
+			devs[ndevs].ns[i].nsid = (uint32_t)ids[i];
+
+		ndevs++;
+	}
+
+	if (!ndevs)
+		opt_usage_exit_fail("missing --device parameter");
+
+	if (!streq(iommu_context, "shared") && !streq(iommu_context, "device"))
+		errx(1, "unsupported iommu context mode");
+
 	if (strstarts(io_pattern, "rand")) {
 		random_io = true;
 		io_pattern = &io_pattern[4];
 	}
 
-	if (!streq(io_pattern, "read"))
+	if (streq(io_pattern, "read"))
+		rwmix_read = 100;
+	else if (streq(io_pattern, "write"))
+		rwmix_read = 0;
+	else if (streq(io_pattern, "trim"))
+		pattern_op = OP_TRIM;
+	else if (streq(io_pattern, "flush") && !random_io)
+		pattern_op = OP_FLUSH;
+	else if (!streq(io_pattern, "rw"))
 		errx(1, "unsupported i/o pattern");
 
+	if (verify && (pattern_op != NR_OPS || rwmix_read == 100))
+		errx(1, "verify requires a pattern with writes");
+
+	if (rwmix_read > 100)
+		errx(1, "invalid rwmix-read");
+
 	if (io_depth < 1)
 		errx(1, "invalid io-depth");
 
-	if (nvme_init(&ctrl, bdf, NULL))
-		err(1, "failed to init nvme controller");
+	if (nthreads < 1)
+		errx(1, "invalid number of threads");
+
+	if (!runtime_in_seconds || !update_stats_interval)
+		errx(1, "invalid runtime or update stats interval");
+
+	if (streq(arrival_dist, "constant"))
+		arrival = ARRIVAL_CONSTANT;
+	else if (streq(arrival_dist, "poisson"))
+		arrival = ARRIVAL_POISSON;
+	else if (streq(arrival_dist, "bursty"))
+		arrival = ARRIVAL_BURSTY;
+	else
+		errx(1, "unsupported arrival distribution");
+
+	if (!burst_size)
+		errx(1, "invalid burst size");
+
+	if (parse_percentiles(percentiles_list))
+		errx(1, "invalid percentiles");
+
+	if (streq(output_format, "json"))
+		output = OUTPUT_JSON;
+	else if (streq(output_format, "csv"))
+		output = OUTPUT_CSV;
+	else if (!streq(output_format, "text"))
+		errx(1, "unsupported output format");
 
-	len = pgmap(&vaddr, NVME_IDENTIFY_DATA_SIZE);
-	if (len < 0)
-		err(1, "could not allocate aligned memory");
+	for (int d = 0; d < ndevs; d++) {
+		struct nvme_ctrl *ctrl = &devs[d].ctrl;
 
-	cmd.identify = (struct nvme_cmd_identify) {
-		.opcode = nvme_admin_identify,
-		.nsid = cpu_to_le32(nsid),
-		.cns = NVME_IDENTIFY_CNS_NS,
-	};
+		/* default is the shared (default) iommu context */
+		if (streq(iommu_context, "device"))
+			ctrl->pci.dev.ctx = iommu_get_context(devs[d].bdf);
 
-	if (nvme_admin(&ctrl, &cmd, vaddr, len, NULL))
-		err(1, "nvme_admin");
+		if (nvme_init(ctrl, devs[d].bdf, NULL))
+			err(1, "failed to init nvme controller %s", devs[d].bdf);
 
-	id_ns = (struct nvme_id_ns *)vaddr;
+		if (nthreads > ctrl->config.nsqa + 1 || nthreads > ctrl->config.ncqa + 1)
+			errx(1, "controller %s supports at most %d i/o queue pairs", devs[d].bdf,
+			     min(ctrl->config.nsqa, ctrl->config.ncqa) + 1);
 
-	nsze = le64_to_cpu((__force leint64_t)(id_ns->nsze));
+		for (int i = 0; i < nnamespaces; i++) {
+			struct ns *ns = &devs[d].ns[i];
 
-	if (io_qsize < 0)
-		io_qsize = ctrl.config.mqes + 1;
+			identify_ns(ctrl, ns);
+
+			if (!block_size)
+				block_size = 1 << ns->lbads;
+
+			if (block_size & ((1 << ns->lbads) - 1))
+				errx(1, "block size must be a multiple of the lba size of "
+				     "%s nsid %u", devs[d].bdf, ns->nsid);
+
+			if ((block_size >> ns->lbads) > ns->max_nlb)
+				errx(1, "block size too large for %s nsid %u", devs[d].bdf,
+				     ns->nsid);
+		}
+
+		if (io_qsize < 0 || io_qsize > ctrl->config.mqes + 1)
+			io_qsize = ctrl->config.mqes + 1;
+
+		if (export_dir) {
+			char *path;
+
+			if (asprintf(&path, "%s/vfn-%s", export_dir, devs[d].bdf) < 0)
+				err(1, "asprintf");
+
+			if (nvme_stats_export(ctrl, path) < 0)
+				err(1, "could not export counters to %s", path);
+
+			free(path);
+		}
+	}
 
 	if (io_depth > io_qsize - 1)
 		errx(1, "io-depth must be less than io-qsize");
 
-	if (nvme_create_ioqpair(&ctrl, 1, io_qsize, -1, 0x0))
-		err(1, "nvme_create_ioqpair");
-
-	sq = &ctrl.sq[1];
-	cq = &ctrl.cq[1];
+	setup_workers();
 
 	run();
 
@@ -0,0 +1,770 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vfn/nvme.h>
+
+#include <nvme/types.h>
+
+#include "ccan/err/err.h"
+#include "ccan/likely/likely.h"
+#include "ccan/minmax/minmax.h"
+#include "ccan/opt/opt.h"
+#include "ccan/str/str.h"
+
+#include "common.h"
+#include "histogram.h"
+
+/*
+ * Trace file format (little endian); a header followed by records sorted by
+ * issue time:
+ *
+ *   struct replay_hdr | struct replay_rec[nrecords]
+ *
+ * Offsets and lengths are in 512 byte sectors (as in blktrace) and are
+ * converted to logical blocks of the namespace on replay. Records of a stream
+ * are issued in trace order; a record flagged REPLAY_F_BARRIER is issued once
+ * all earlier records of its stream have completed and no later record of the
+ * stream is issued until it completes.
+ */
+#define REPLAY_MAGIC "vfnrplay"
+#define REPLAY_VERSION 1
+
+#define REPLAY_F_BARRIER (1 << 0)
+
+#define REPLAY_MAX_STREAMS (1 << 16)
+#define MAX_PERCENTILES 16
+
+struct replay_hdr {
+	char magic[8];
+	leint32_t version;
+
+	/* largest record in sectors; sizes the data buffers */
+	leint32_t max_nsect;
+
+	leint64_t nrecords;
+};
+
+struct replay_rec {
+	/* issue time relative to the start of the trace */
+	leint64_t tns;
+
+	leint64_t sector;
+	leint32_t nsect;
+
+	uint8_t op;
+	uint8_t flags;
+	leint16_t stream;
+};
+
+static_assert(sizeof(struct replay_rec) == 24, "unexpected trace record size");
+
+static char *trace_file = "", *convert_file = "", *event = "D";
+static char *percentiles_list = "50,90,99,99.9,99.99", *output_format = "text";
+static unsigned long nsid = 1;
+static double speed = 1.0;
+static bool afap;
+static int io_depth = 32, nthreads = 1;
+
+static struct opt_table opts[] = {
+	OPT_SUBTABLE(opts_base, NULL),
+	OPT_WITH_ARG("-N|--nsid NSID", opt_set_ulongval, opt_show_ulongval, &nsid,
+		     "namespace identifier"),
+	OPT_WITH_ARG("-f|--trace FILE", opt_set_charp, opt_show_charp, &trace_file,
+		     "trace file to replay (or write with --convert)"),
+	OPT_WITHOUT_ARG("-A|--afap", opt_set_bool, &afap,
+			"replay as fast as possible, ignoring the original timing"),
+	OPT_WITH_ARG("-s|--speed FACTOR", opt_set_doubleval, opt_show_doubleval, &speed,
+		     "scale the original timing (2 replays twice as fast)"),
+	OPT_WITH_ARG("-q|--io-depth", opt_set_intval, opt_show_intval, &io_depth,
+		     "outstanding i/o limit per thread"),
+	OPT_WITH_ARG("-j|--threads N", opt_set_intval, opt_show_intval, &nthreads,
+		     "number of worker threads (one i/o queue pair each, streams are split "
+		     "between them)"),
+	OPT_WITH_ARG("-P|--percentiles P[,P...]", opt_set_charp, opt_show_charp,
+		     &percentiles_list, "latency percentiles to report"),
+	OPT_WITH_ARG("-o|--output-format FORMAT", opt_set_charp, opt_show_charp, &output_format,
+		     "output format (text or json)"),
+	OPT_WITH_ARG("-C|--convert FILE", opt_set_charp, opt_show_charp, &convert_file,
+		     "convert blkparse output to the trace file given by --trace and exit"),
+	OPT_WITH_ARG("-e|--event ACTION", opt_set_charp, opt_show_charp, &event,
+		     "blkparse action to convert (e.g. D for issued or Q for queued)"),
+	OPT_ENDTABLE,
+};
+
+enum op {
+	OP_READ,
+	OP_WRITE,
+	OP_TRIM,
+	OP_FLUSH,
+
+	NR_OPS,
+};
+
+static const char *op_names[NR_OPS] = {
+	[OP_READ] = "read",
+	[OP_WRITE] = "write",
+	[OP_TRIM] = "trim",
+	[OP_FLUSH] = "flush",
+};
+
+static const uint8_t op_opcodes[NR_OPS] = {
+	[OP_READ] = nvme_cmd_read,
+	[OP_WRITE] = nvme_cmd_write,
+	[OP_TRIM] = nvme_cmd_dsm,
+	[OP_FLUSH] = nvme_cmd_flush,
+};
+
+static bool json;
+
+static double percentiles[MAX_PERCENTILES];
+static int npercentiles;
+
+static struct nvme_ctrl ctrl;
+static struct nvme_ns *ns;
+
+static const struct replay_rec *records;
+static uint64_t nrecords;
+static uint32_t max_nsect;
+
+/* start of the replay; the origin of the record issue times */
+static uint64_t tstart;
+
+struct stats {
+	unsigned long completed, errors;
+	uint64_t ttotal, tmin, tmax;
+};
+
+struct stream {
+	unsigned int inflight;
+
+	/* a barrier record is in flight */
+	bool barrier;
+};
+
+struct iod {
+	uint64_t tsubmit;
+	enum op op;
+	struct stream *stream;
+	bool barrier;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+
+	struct nvme_sq *sq;
+	struct nvme_cq *cq;
+
+	/* next record to consider; records of other threads are skipped */
+	uint64_t cursor;
+	unsigned int queued;
+
+	/* the streams handled by the worker (stream % nthreads == id) */
+	struct stream *streams;
+
+	/* indexed by command identifier */
+	struct iod *iods;
+
+	/* time from the intended to the actual issue (original timing only) */
+	uint64_t lag_total, lag_max;
+
+	uint64_t tend;
+
+	struct stats stats[NR_OPS];
+	struct histogram hist[NR_OPS];
+} __attribute__((aligned(64)));
+
+static struct worker *workers;
+
+static void stats_reset(struct stats *stats)
+{
+	memset(stats, 0x0, sizeof(*stats));
+	stats->tmin = UINT64_MAX;
+}
+
+static void stats_add(struct stats *dst, const struct stats *src)
+{
+	dst->completed += src->completed;
+	dst->errors += src->errors;
+	dst->ttotal += src->ttotal;
+	dst->tmin = min(dst->tmin, src->tmin);
+	dst->tmax = max(dst->tmax, src->tmax);
+}
+
+static inline double ticks_to_usec(uint64_t ticks)
+{
+	return (double)ticks_to_ns(ticks) / 1000;
+}
+
+static void io_complete(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg)
+{
+	struct worker *w = arg;
+	struct iod *iod = &w->iods[rq->cid];
+	struct stats *stats = &w->stats[iod->op];
+	uint64_t diff = get_ticks() - iod->tsubmit;
+
+	w->queued--;
+
+	iod->stream->inflight--;
+	if (iod->barrier)
+		iod->stream->barrier = false;
+
+	stats->completed++;
+	stats->ttotal += diff;
+
+	if (unlikely(diff < stats->tmin))
+		stats->tmin = diff;
+
+	if (unlikely(diff > stats->tmax))
+		stats->tmax = diff;
+
+	histogram_record(&w->hist[iod->op], diff);
+
+	if (unlikely(!nvme_cqe_ok(cqe)))
+		stats->errors++;
+}
+
+static void io_submit(struct worker *w, const struct replay_rec *rec, struct stream *stream)
+{
+	struct nvme_rq *rq = nvme_rq_acquire(w->sq);
+	struct iod *iod = &w->iods[rq->cid];
+	uint64_t slba, nlb, sector = le64_to_cpu(rec->sector);
+	union nvme_cmd cmd = {};
+	struct nvme_dsm_range *range;
+	size_t len = 0;
+
+	nlb = ((uint64_t)le32_to_cpu(rec->nsect) << 9) >> ns->lbads;
+	if (!nlb)
+		nlb = 1;
+
+	/* fold the trace onto the namespace */
+	slba = (sector << 9) >> ns->lbads;
+	if (slba + nlb > ns->nsze)
+		slba %= ns->nsze - nlb + 1;
+
+	iod->op = (enum op)rec->op;
+	iod->stream = stream;
+	iod->barrier = rec->flags & REPLAY_F_BARRIER;
+
+	cmd.opcode = op_opcodes[iod->op];
+	cmd.nsid = cpu_to_le32(ns->nsid);
+
+	switch (iod->op) {
+	case OP_READ:
+	case OP_WRITE:
+		cmd.rw.slba = cpu_to_le64(slba);
+		cmd.rw.nlb = cpu_to_le16((uint16_t)(nlb - 1));
+
+		len = nlb << ns->lbads;
+		break;
+
+	case OP_TRIM:
+		range = rq->buf.vaddr;
+
+		range->cattr = 0;
+		range->nlb = cpu_to_le32((uint32_t)nlb);
+		range->slba = cpu_to_le64(slba);
+
+		cmd.cdw10 = 0;
+		cmd.cdw11 = cpu_to_le32(NVME_DSMGMT_AD);
+
+		len = sizeof(*range);
+		break;
+
+	default:
+		break;
+	}
+
+	if (len && nvme_rq_map_own_buf(&ctrl, rq, &cmd, len))
+		err(1, "nvme_rq_map_own_buf");
+
+	stream->inflight++;
+	if (iod->barrier)
+		stream->barrier = true;
+
+	w->queued++;
+
+	iod->tsubmit = get_ticks();
+
+	nvme_rq_submit(rq, &cmd, io_complete, w);
+}
+
+/*
+ * Issue the records of the worker in trace order until one is not due yet,
+ * must wait for its stream, or the i/o depth is reached.
+ */
+static void worker_issue(struct worker *w)
+{
+	uint64_t now = get_ticks();
+	bool issued = false;
+
+	while (w->cursor < nrecords && w->queued < (unsigned int)io_depth) {
+		const struct replay_rec *rec = &records[w->cursor];
+		unsigned int id = le16_to_cpu(rec->stream);
+		struct stream *stream;
+
+		if (id % (unsigned int)nthreads != (unsigned int)w->id) {
+			w->cursor++;
+			continue;
+		}
+
+		if (unlikely(rec->op >= NR_OPS))
+			errx(1, "%s: invalid op in record %" PRIu64, trace_file, w->cursor);
+
+		stream = &w->streams[id / (unsigned int)nthreads];
+
+		if (stream->barrier || ((rec->flags & REPLAY_F_BARRIER) && stream->inflight))
+			break;
+
+		if (!afap) {
+			uint64_t tdue = tstart +
+				ns_to_ticks((uint64_t)((double)le64_to_cpu(rec->tns) / speed));
+
+			if (tdue > now)
+				break;
+
+			w->lag_total += now - tdue;
+			w->lag_max = max(w->lag_max, now - tdue);
+		}
+
+		io_submit(w, rec, stream);
+		w->cursor++;
+
+		issued = true;
+	}
+
+	if (issued)
+		nvme_sq_update_tail(w->sq);
+}
+
+static void *worker_run(void *opaque)
+{
+	struct worker *w = opaque;
+
+	while (w->cursor < nrecords || w->queued) {
+		worker_issue(w);
+
+		nvme_cq_process(w->cq, io_depth);
+	}
+
+	w->tend = get_ticks();
+
+	return NULL;
+}
+
+static void print_percentiles(const struct histogram *h)
+{
+	for (int i = 0; i < npercentiles; i++) {
+		double lat = ticks_to_usec(histogram_percentile(h, percentiles[i]));
+
+		if (json)
+			printf("%s\"%g\": %.2f", i ? ", " : "", percentiles[i], lat);
+		else
+			printf(" %10.2f", lat);
+	}
+}
+
+static void print_summary_op(const char *name, struct stats *stats, double elapsed,
+			     const struct histogram *h, bool first)
+{
+	double iops = (double)stats->completed / elapsed;
+	double lavg = ticks_to_usec(stats->ttotal) / (double)stats->completed;
+	double lmin = ticks_to_usec(stats->tmin), lmax = ticks_to_usec(stats->tmax);
+
+	if (json) {
+		printf("%s\n    \"%s\": { \"ios\": %lu, \"iops\": %.2f, \"lavg\": %.2f, "
+		       "\"lmin\": %.2f, \"lmax\": %.2f, \"errors\": %lu, \"percentiles\": { ",
+		       first ? "" : ",", name, stats->completed, iops, lavg, lmin, lmax,
+		       stats->errors);
+		print_percentiles(h);
+		printf(" } }");
+
+		return;
+	}
+
+	printf("%10s %10lu %10.2f %10.2f %10.2f %10.2f %10lu", name, stats->completed, iops,
+	       lavg, lmin, lmax, stats->errors);
+	print_percentiles(h);
+	printf("\n");
+}
+
+static void print_summary(void)
+{
+	/* the last entry is the total */
+	struct histogram *hist = calloc(NR_OPS + 1, sizeof(*hist));
+	struct stats stats[NR_OPS + 1];
+	uint64_t tend = tstart, lag_total = 0, lag_max = 0;
+	double elapsed, lag_avg;
+	bool first = true;
+
+	if (!hist)
+		err(1, "calloc");
+
+	for (int op = 0; op <= NR_OPS; op++)
+		stats_reset(&stats[op]);
+
+	for (int i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+
+		for (int op = 0; op < NR_OPS; op++) {
+			stats_add(&stats[op], &w->stats[op]);
+			stats_add(&stats[NR_OPS], &w->stats[op]);
+
+			histogram_merge(&hist[op], &w->hist[op]);
+			histogram_merge(&hist[NR_OPS], &w->hist[op]);
+		}
+
+		tend = max(tend, w->tend);
+		lag_total += w->lag_total;
+		lag_max = max(lag_max, w->lag_max);
+	}
+
+	elapsed = (double)ticks_to_ns(tend - tstart) / 1e9;
+	lag_avg = nrecords ? ticks_to_usec(lag_total) / (double)nrecords : 0;
+
+	if (json) {
+		printf("{\n  \"records\": %" PRIu64 ",\n  \"elapsed\": %.3f,", nrecords, elapsed);
+
+		if (!afap)
+			printf("\n  \"lag\": { \"avg\": %.2f, \"max\": %.2f },",
+			       lag_avg, ticks_to_usec(lag_max));
+
+		printf("\n  \"summary\": {");
+	} else {
+		printf("replayed %" PRIu64 " records in %.3f seconds\n", nrecords, elapsed);
+
+		if (!afap)
+			printf("issue lag avg %.2f max %.2f usec\n",
+			       lag_avg, ticks_to_usec(lag_max));
+
+		printf("\n%10s %10s %10s %10s %10s %10s %10s", "op", "ios", "iops", "lavg", "lmin",
+		       "lmax", "errors");
+
+		for (int i = 0; i < npercentiles; i++) {
+			char buf[16];
+
+			snprintf(buf, sizeof(buf), "p%g", percentiles[i]);
+			printf(" %10s", buf);
+		}
+
+		printf("\n");
+	}
+
+	for (int op = 0; op <= NR_OPS; op++) {
+		if (!stats[op].completed)
+			continue;
+
+		print_summary_op(op < NR_OPS ? op_names[op] : "total", &stats[op], elapsed,
+				 &hist[op], first);
+		first = false;
+	}
+
+	if (json)
+		printf("\n  }\n}\n");
+
+	free(hist);
+}
+
+static void map_trace(void)
+{
+	const struct replay_hdr *hdr;
+	struct stat st;
+	void *mem;
+	int fd;
+
+	fd = open(trace_file, O_RDONLY);
+	if (fd < 0)
+		err(1, "could not open %s", trace_file);
+
+	if (fstat(fd, &st))
+		err(1, "fstat");
+
+	if ((size_t)st.st_size < sizeof(*hdr))
+		errx(1, "%s: truncated trace", trace_file);
+
+	/* pages are faulted in as the replay progresses */
+	mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED)
+		err(1, "mmap");
+
+	close(fd);
+
+	hdr = mem;
+
+	if (memcmp(hdr->magic, REPLAY_MAGIC, sizeof(hdr->magic)) ||
+	    le32_to_cpu(hdr->version) != REPLAY_VERSION)
+		errx(1, "%s: not a trace file (or unsupported version)", trace_file);
+
+	nrecords = le64_to_cpu(hdr->nrecords);
+
+	if (nrecords > ((size_t)st.st_size - sizeof(*hdr)) / sizeof(struct replay_rec))
+		errx(1, "%s: truncated trace", trace_file);
+
+	records = (const struct replay_rec *)(hdr + 1);
+
+	if (madvise(mem, (size_t)st.st_size, MADV_SEQUENTIAL))
+		warn("madvise");
+
+	max_nsect = le32_to_cpu(hdr->max_nsect);
+
+	if (((uint64_t)max_nsect << 9) >> ns->lbads > ns->max_nlb)
+		errx(1, "%s: i/o size exceeds the maximum transfer size of the namespace",
+		     trace_file);
+}
+
+static void setup_workers(size_t buf_size)
+{
+	size_t nstreams = (REPLAY_MAX_STREAMS + (size_t)nthreads - 1) / (size_t)nthreads;
+
+	workers = calloc((size_t)nthreads, sizeof(*workers));
+	if (!workers)
+		err(1, "calloc");
+
+	for (int i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+		int qid = i + 1;
+
+		w->id = i;
+
+		w->streams = calloc(nstreams, sizeof(struct stream));
+		w->iods = calloc((size_t)io_depth + 1, sizeof(struct iod));
+		if (!w->streams || !w->iods)
+			err(1, "calloc");
+
+		for (int op = 0; op < NR_OPS; op++)
+			stats_reset(&w->stats[op]);
+
+		if (nvme_create_iocq(&ctrl, qid, io_depth + 1, -1))
+			err(1, "nvme_create_iocq");
+
+		if (nvme_create_iosq_buf(&ctrl, qid, io_depth + 1, &ctrl.cq[qid], 0x0, buf_size))
+			err(1, "nvme_create_iosq_buf");
+
+		w->sq = &ctrl.sq[qid];
+		w->cq = &ctrl.cq[qid];
+	}
+}
+
+static int parse_percentiles(const char *list)
+{
+	const char *p = list;
+	char *endptr;
+
+	while (*p) {
+		if (npercentiles == MAX_PERCENTILES)
+			return -1;
+
+		percentiles[npercentiles] = strtod(p, &endptr);
+		if (endptr == p || (*endptr && *endptr != ','))
+			return -1;
+
+		if (percentiles[npercentiles] <= 0 || percentiles[npercentiles] > 100)
+			return -1;
+
+		npercentiles++;
+
+		p = *endptr ? endptr + 1 : endptr;
+	}
+
+	return 0;
+}
+
+/*
+ * Convert blkparse (default format) output, e.g.
+ *
+ *   8,0    3        1     0.000000000   697  D  WS 223490 + 8 [kjournald]
+ *
+ * The cpu the request was traced on is its stream. Pure flushes become flush
+ * records and requests with preflush or fua semantics become barriers.
+ */
+static void convert(void)
+{
+	struct replay_hdr hdr = { .version = cpu_to_le32(REPLAY_VERSION) };
+	uint64_t n = 0, tprev = 0, t0 = 0;
+	uint32_t max_nsect = 0;
+	char *line = NULL;
+	size_t len = 0;
+	FILE *in, *out;
+
+	in = fopen(convert_file, "r");
+	if (!in)
+		err(1, "could not open %s", convert_file);
+
+	out = fopen(trace_file, "w");
+	if (!out)
+		err(1, "could not create %s", trace_file);
+
+	memcpy(hdr.magic, REPLAY_MAGIC, sizeof(hdr.magic));
+
+	/* the header is rewritten with the final counts */
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		err(1, "fwrite");
+
+	while (getline(&line, &len, in) > 0) {
+		unsigned int maj, mnr, cpu, seq, pid, nsect = 0;
+		unsigned long long sector = 0;
+		char action[4], rwbs[16];
+		struct replay_rec rec = {};
+		uint64_t tns;
+		double t;
+		int ret;
+
+		ret = sscanf(line, "%u,%u %u %u %lf %u %3s %15s %llu + %u", &maj, &mnr, &cpu, &seq,
+			     &t, &pid, action, rwbs, &sector, &nsect);
+		if (ret < 8 || !streq(action, event))
+			continue;
+
+		if (strchr(rwbs, 'D'))
+			rec.op = OP_TRIM;
+		else if (strchr(rwbs, 'W'))
+			rec.op = OP_WRITE;
+		else if (strchr(rwbs, 'R'))
+			rec.op = OP_READ;
+		else if (rwbs[0] == 'F')
+			rec.op = OP_FLUSH;
+		else
+			continue;
+
+		/* a flush with data is a preflush; the data part is replayed as a barrier */
+		if (strchr(rwbs, 'F'))
+			rec.flags |= REPLAY_F_BARRIER;
+
+		if (ret < 10)
+			nsect = 0;
+
+		if (rec.op != OP_FLUSH && !nsect)
+			continue;
+
+		if (!n)
+			t0 = (uint64_t)(t * 1e9);
+
+		/* keep the records sorted even if the input is not */
+		tns = max((uint64_t)(t * 1e9), t0) - t0;
+		tns = max(tns, tprev);
+		tprev = tns;
+
+		rec.tns = cpu_to_le64(tns);
+		rec.sector = cpu_to_le64(rec.op == OP_FLUSH ? 0 : sector);
+		rec.nsect = cpu_to_le32(rec.op == OP_FLUSH ? 0 : nsect);
+		rec.stream = cpu_to_le16((uint16_t)cpu);
+
+		if (rec.op != OP_TRIM)
+			max_nsect = max(max_nsect, le32_to_cpu(rec.nsect));
+
+		if (fwrite(&rec, sizeof(rec), 1, out) != 1)
+			err(1, "fwrite");
+
+		n++;
+	}
+
+	free(line);
+	fclose(in);
+
+	hdr.max_nsect = cpu_to_le32(max_nsect);
+	hdr.nrecords = cpu_to_le64(n);
+
+	if (fseek(out, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, out) != 1 || fclose(out))
+		err(1, "could not write %s", trace_file);
+
+	printf("converted %" PRIu64 " records\n", n);
+}
+
+int main(int argc, char **argv)
+{
+	size_t buf_size;
+
+	opt_register_table(opts, NULL);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+
+	if (show_usage)
+		opt_usage_and_exit(NULL);
+
+	if (streq(trace_file, ""))
+		opt_usage_exit_fail("missing --trace parameter");
+
+	if (!streq(convert_file, "")) {
+		convert();
+		return 0;
+	}
+
+	if (streq(bdf, ""))
+		opt_usage_exit_fail("missing --device parameter");
+
+	if (!nsid || nsid >= NVME_NSID_ALL)
+		opt_usage_exit_fail("invalid --nsid parameter");
+
+	if (io_depth < 1)
+		errx(1, "invalid io-depth");
+
+	if (nthreads < 1)
+		errx(1, "invalid number of threads");
+
+	if (!(speed > 0))
+		errx(1, "invalid speed");
+
+	if (parse_percentiles(percentiles_list))
+		errx(1, "invalid percentiles");
+
+	if (streq(output_format, "json"))
+		json = true;
+	else if (!streq(output_format, "text"))
+		errx(1, "unsupported output format");
+
+	if (nvme_init(&ctrl, bdf, NULL))
+		err(1, "failed to init nvme controller");
+
+	if (nthreads > ctrl.config.nsqa + 1 || nthreads > ctrl.config.ncqa + 1)
+		errx(1, "controller supports at most %d i/o queue pairs",
+		     min(ctrl.config.nsqa, ctrl.config.ncqa) + 1);
+
+	if (io_depth > ctrl.config.mqes)
+		errx(1, "io-depth must be less than the maximum queue size");
+
+	ns = nvme_ns_get(&ctrl, (uint32_t)nsid);
+	if (!ns)
+		errx(1, "namespace %lu is inactive", nsid);
+
+	map_trace();
+
+	/* records smaller than a logical block are rounded up */
+	buf_size = max_t(size_t, (size_t)max_nsect << 9, 1ULL << ns->lbads);
+
+	setup_workers(buf_size);
+
+	tstart = get_ticks();
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]))
+			errx(1, "could not create worker thread");
+	}
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	print_summary();
+
+	nvme_close(&ctrl);
+
+	return 0;
+}
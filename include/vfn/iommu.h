@@ -21,6 +21,8 @@ extern "C" {
 #include <stddef.h>
 #include <stdint.h>
 
+#include <sys/uio.h>
+
 #include <linux/types.h>
 
 #include <vfn/iommu/context.h>
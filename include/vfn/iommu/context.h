@@ -19,8 +19,52 @@
  *
  * Create a new iommu context. The mechanism depends on the backend.
  *
+ * If vfio no-iommu mode is enabled (``enable_unsafe_noiommu_mode``) and the
+ * system has no iommu, the context uses vfio no-iommu groups. Mapped memory is
+ * then pinned and devices are given its physical address (as found in
+ * ``/proc/self/pagemap``, which requires ``CAP_SYS_ADMIN``), so each mapping
+ * must be physically contiguous (e.g., hugepage backed, like the memory from
+ * iommu_alloc()) and ``IOMMU_MAP_FIXED_IOVA`` is not supported.
+ *
  * Return: A new &struct iommu_ctx.
  */
 struct iommu_ctx *iommu_get_context(const char *name);
 
+/**
+ * iommu_export_context - Share an iommu context with another process
+ * @ctx: &struct iommu_ctx
+ * @sockfd: connected unix domain socket
+ *
+ * Send the address space of @ctx and a table of its mappings over @sockfd
+ * (using ``SCM_RIGHTS``), to be picked up by iommu_import_context() in the
+ * peer. The table is kept up to date as mappings are added to and removed from
+ * @ctx; ephemeral mappings (see &enum iommu_map_flags) are not shared. The
+ * table holds up to 16384 mappings.
+ *
+ * Only supported by the iommufd backend.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``. If the backend
+ * does not support sharing, ``errno`` is set to ``EOPNOTSUPP``.
+ */
+int iommu_export_context(struct iommu_ctx *ctx, int sockfd);
+
+/**
+ * iommu_import_context - Use an iommu context shared by another process
+ * @sockfd: connected unix domain socket
+ *
+ * Receive an iommu context sent by iommu_export_context() from @sockfd.
+ *
+ * iommu_translate_vaddr() on the returned context falls back to the mappings
+ * of the exporting process, without issuing any ioctls. Since the table holds
+ * the virtual addresses of the exporting process, memory shared between the
+ * processes must be mapped at the same addresses in both for this to work.
+ * Already shared memory is not mapped again by iommu_map_vaddr().
+ *
+ * Mappings added through the returned context are private to it, but use the
+ * shared address space; iommu_unmap_all() only removes those.
+ *
+ * Return: A new &struct iommu_ctx, or ``NULL`` on error and sets ``errno``.
+ */
+struct iommu_ctx *iommu_import_context(int sockfd);
+
 #endif /* LIBVFN_IOMMU_CONTEXT_H */
@@ -19,18 +19,53 @@
  * @IOMMU_MAP_EPHEMERAL: If set, the mapping is considered temporary
  * @IOMMU_MAP_NOWRITE: DMA is not allowed to write to this mapping
  * @IOMMU_MAP_NOREAD: DMA is not allowed to read from this mapping
+ * @IOMMU_MAP_PREFAULT: Populate the page tables of the process before mapping
  *
  * IOMMU_MAP_EPHEMERAL may change how the iova is allocated. I.e., currently,
  * the vfio-based backend will allocate an IOVA from a reserved range of 64k.
  * The iommufd-based backend has no such restrictions.
+ *
+ * With IOMMU_MAP_PREFAULT, the memory is faulted in with
+ * ``MADV_POPULATE_WRITE`` (``MADV_POPULATE_READ`` if IOMMU_MAP_NOWRITE is
+ * set), in parallel for large areas, such that the kernel does not have to
+ * fault in the pages one by one when pinning them. This is best effort; if
+ * populating fails, the area is mapped anyway.
  */
 enum iommu_map_flags {
 	IOMMU_MAP_FIXED_IOVA	= 1 << 0,
 	IOMMU_MAP_EPHEMERAL	= 1 << 1,
 	IOMMU_MAP_NOWRITE	= 1 << 2,
 	IOMMU_MAP_NOREAD	= 1 << 3,
+	IOMMU_MAP_PREFAULT	= 1 << 4,
 };
 
+/**
+ * struct iommu_map_stats - DMA mapping counters
+ * @maps: number of map ioctls
+ * @bytes: number of bytes mapped
+ * @nsecs: total time spent in map ioctls
+ * @max_nsecs: longest time spent in a single map ioctl
+ * @prefault_nsecs: total time spent prefaulting (see ``IOMMU_MAP_PREFAULT``)
+ */
+struct iommu_map_stats {
+	uint64_t maps;
+	uint64_t bytes;
+	uint64_t nsecs;
+	uint64_t max_nsecs;
+	uint64_t prefault_nsecs;
+};
+
+/**
+ * iommu_get_map_stats - Get the DMA mapping counters of a context
+ * @ctx: &struct iommu_ctx
+ * @stats: output parameter for the counters
+ *
+ * Copy the counters of @ctx (see &struct iommu_map_stats) to @stats. The
+ * counters are updated by all threads mapping in @ctx and are copied one at a
+ * time.
+ */
+void iommu_get_map_stats(struct iommu_ctx *ctx, struct iommu_map_stats *stats);
+
 /**
  * iommu_map_vaddr - Map a virtual memory address to an I/O virtual address
  * @ctx: &struct iommu_ctx
@@ -46,14 +81,39 @@ enum iommu_map_flags {
  * If @vaddr falls within an already mapped area, calculate the corresponding
  * iova instead.
  *
- * Note that, for the vfio backend, the allocated IOVA is not recycled when the
- * mapping is removed; the IOVA will never be allocated again.
+ * For the vfio backend, the allocated iova is given back when the mapping is
+ * removed and may be handed out again.
  *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
 int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
 		    unsigned long flags);
 
+/**
+ * iommu_map_vaddr_file - Map a file backed virtual memory area in the IOMMU
+ * @ctx: &struct iommu_ctx
+ * @vaddr: page aligned address of a shared mapping of @fd
+ * @len: number of bytes to map
+ * @fd: file descriptor (e.g. a memfd or a file on hugetlbfs)
+ * @offset: page aligned offset into @fd that @vaddr maps
+ * @iova: output parameter for mapped I/O virtual address
+ * @flags: combination of enum iommu_map_flags
+ *
+ * Like iommu_map_vaddr(), but if the backend supports it (iommufd with
+ * ``IOMMU_IOAS_MAP_FILE``), the IOMMU mapping is created from the pages of @fd
+ * instead of by walking the page tables of the process. This is considerably
+ * faster for large pools and does not depend on the process mapping remaining
+ * in place. Otherwise, or if the kernel refuses the file, @vaddr is mapped as
+ * with iommu_map_vaddr().
+ *
+ * The area is translated by iommu_translate_vaddr() and unmapped with
+ * iommu_unmap_vaddr().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_map_vaddr_file(struct iommu_ctx *ctx, void *vaddr, size_t len, int fd, uint64_t offset,
+			 uint64_t *iova, unsigned long flags);
+
 /**
  * iommu_unmap_vaddr - Unmap a virtual memory address in the IOMMU
  * @ctx: &struct iommu_ctx
@@ -61,23 +121,138 @@ int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *io
  * @len: output parameter for length of mapping
  *
  * Remove the mapping associated with @vaddr. This can only be used with
- * mappings created using iommu_map_vaddr(). If @len is not NULL, the length of
- * the mapping will be written to the pointee.
+ * mappings created using iommu_map_vaddr() or iommu_map_vaddr_file(). If @len
+ * is not NULL, the length of the mapping will be written to the pointee.
  *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
 int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len);
 
+/**
+ * iommu_map_vaddrs - Map an array of virtual memory areas
+ * @ctx: &struct iommu_ctx
+ * @iov: array of @n virtual memory areas to map
+ * @n: number of elements in @iov
+ * @iovas: array of @n iovas (output parameter; may be ``NULL``)
+ * @flags: combination of enum iommu_map_flags (except ``IOMMU_MAP_EPHEMERAL``)
+ *
+ * Like calling iommu_map_vaddr() for each element of @iov, but cheaper when
+ * mapping many buffers. For the vfio backend, iova for all areas is reserved in
+ * one step and the areas are mapped at consecutive iovas. The mappings are
+ * allocated together and added to the iova map in a single locked pass.
+ *
+ * Areas that fall within an already mapped area are only translated. If
+ * ``IOMMU_MAP_FIXED_IOVA`` is set, @iovas holds the iovas to map at.
+ *
+ * Each area is still a separate mapping that may be removed with
+ * iommu_unmap_vaddr(). If any area cannot be mapped, none are.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_map_vaddrs(struct iommu_ctx *ctx, const struct iovec *iov, int n, uint64_t *iovas,
+		     unsigned long flags);
+
+/**
+ * iommu_map_vaddrs_contig - Map virtual memory areas at contiguous iovas
+ * @ctx: &struct iommu_ctx
+ * @iov: array of @n virtual memory areas to map
+ * @n: number of elements in @iov
+ * @iova: output parameter for the iova of the first area
+ * @flags: combination of enum iommu_map_flags (except ``IOMMU_MAP_EPHEMERAL``)
+ *
+ * Like iommu_map_vaddrs(), but the areas are mapped back to back in a single
+ * range of iovas, such that discontiguous memory can be used as one buffer
+ * starting at @iova (e.g. described by a single SGL data block descriptor, see
+ * nvme_rq_map()). All areas must be page aligned and, but for the last one, a
+ * multiple of the page size long. None of them may be mapped already.
+ *
+ * If ``IOMMU_MAP_FIXED_IOVA`` is set, @iova holds the iova to map the first
+ * area at. Otherwise, the range is reserved in one step; this requires a
+ * backend that allocates iovas itself (vfio) and fails with ``EOPNOTSUPP``
+ * otherwise.
+ *
+ * Each area is a separate mapping that may be removed with iommu_unmap_vaddr();
+ * iommu_unmap_vaddrs() removes all of them with a single unmap.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_map_vaddrs_contig(struct iommu_ctx *ctx, const struct iovec *iov, int n, uint64_t *iova,
+			    unsigned long flags);
+
+/**
+ * iommu_unmap_vaddrs - Unmap an array of virtual memory addresses
+ * @ctx: &struct iommu_ctx
+ * @vaddrs: array of @n virtual memory addresses to unmap
+ * @n: number of elements in @vaddrs
+ *
+ * Remove the mappings associated with @vaddrs (see iommu_unmap_vaddr()).
+ * Mappings that are adjacent in the iova space are unmapped from the IOMMU
+ * together and all mappings are removed from the iova map in a single locked
+ * pass.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``. If any address
+ * is not mapped, nothing is unmapped and ``errno`` is set to ``ENOENT``.
+ */
+int iommu_unmap_vaddrs(struct iommu_ctx *ctx, void **vaddrs, int n);
+
 /**
  * iommu_unmap_all - Unmap all virtual memory address in the IOMMU
  * @ctx: &struct iommu_ctx
  *
- * Remove all mappings.
+ * Remove all mappings. Memory allocated with iommu_alloc() is released as well
+ * and must not be used or freed afterwards.
  *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
 int iommu_unmap_all(struct iommu_ctx *ctx);
 
+/**
+ * struct iommu_file_map - File mapping
+ * @iova: I/O virtual address of the mapping
+ * @len: length of the mapping
+ */
+struct iommu_file_map {
+	uint64_t iova;
+	size_t len;
+
+	/* private: */
+	void *vaddr;
+	unsigned long flags;
+};
+
+/**
+ * iommu_map_file - Map a file (e.g. a dma-buf) for DMA
+ * @ctx: &struct iommu_ctx
+ * @fd: file descriptor
+ * @offset: page aligned offset into the file
+ * @len: page aligned number of bytes to map
+ * @flags: combination of enum iommu_map_flags (except ``IOMMU_MAP_EPHEMERAL``)
+ * @map: &struct iommu_file_map to initialize
+ *
+ * Map @len bytes of the file @fd starting at @offset into @ctx. If
+ * ``IOMMU_MAP_FIXED_IOVA`` is set, @map->iova holds the iova to map at. The
+ * resulting @map->iova can be used directly for I/O (e.g. with
+ * nvme_rq_map_prp()); the pages are not mapped by iommu_translate_vaddr().
+ *
+ * If the backend supports it (iommufd with ``IOMMU_IOAS_MAP_FILE``), the file
+ * is pinned and mapped by the kernel without a process mapping. Otherwise, or
+ * if the kernel refuses the file, it is mapped through mmap(), which requires
+ * the exporter to support mapping the file into the process.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_map_file(struct iommu_ctx *ctx, int fd, uint64_t offset, size_t len,
+		   unsigned long flags, struct iommu_file_map *map);
+
+/**
+ * iommu_unmap_file - Unmap a file mapped with iommu_map_file()
+ * @ctx: &struct iommu_ctx
+ * @map: &struct iommu_file_map
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_unmap_file(struct iommu_ctx *ctx, struct iommu_file_map *map);
+
 #ifndef IOMMU_IOAS_IOVA_RANGES
 struct iommu_iova_range {
 	__aligned_u64 start;
@@ -109,4 +284,100 @@ bool iommu_translate_vaddr(struct iommu_ctx *ctx, void *vaddr, uint64_t *iova);
  */
 int iommu_get_iova_ranges(struct iommu_ctx *ctx, struct iommu_iova_range **ranges);
 
+/**
+ * iommu_alloc - Allocate memory for DMA
+ * @ctx: &struct iommu_ctx
+ * @len: number of bytes to allocate
+ * @vaddr: output parameter for the virtual address of the allocation
+ * @iova: output parameter for the I/O virtual address of the allocation
+ *
+ * Allocate @len bytes of page aligned, hugepage backed memory that is already
+ * mapped in @ctx. Allocations up to 2M are carved out of 2M hugepages that are
+ * mapped once and reused; larger allocations get a dedicated mapping (backed
+ * by 1G hugepages if @len is at least 1G).
+ *
+ * Since the iova is returned directly, the memory can be used for I/O without
+ * calling iommu_map_vaddr() or iommu_translate_vaddr().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_alloc(struct iommu_ctx *ctx, size_t len, void **vaddr, uint64_t *iova);
+
+/**
+ * iommu_alloc_node - Allocate and map DMA memory on a numa node
+ * @ctx: &struct iommu_ctx
+ * @len: number of bytes to allocate
+ * @node: preferred numa node (see pgbind()); if negative, like iommu_alloc()
+ * @vaddr: output parameter for the virtual address
+ * @iova: output parameter for the I/O virtual address
+ *
+ * Like iommu_alloc(), but prefer placing the memory on @node. Small allocations
+ * are only carved out of hugepage chunks allocated for the same node.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_alloc_node(struct iommu_ctx *ctx, size_t len, int node, void **vaddr, uint64_t *iova);
+
+/**
+ * iommu_free - Free memory allocated with iommu_alloc() or iommu_alloc_node()
+ * @ctx: &struct iommu_ctx
+ * @vaddr: virtual address returned by iommu_alloc()
+ * @len: length passed to iommu_alloc()
+ *
+ * Release memory allocated with iommu_alloc(). Hugepage chunks used for small
+ * allocations remain mapped for reuse.
+ */
+void iommu_free(struct iommu_ctx *ctx, void *vaddr, size_t len);
+
+/**
+ * enum iommu_dirty_flags - Flags for getting dirty iova ranges
+ * @IOMMU_DIRTY_NO_CLEAR: Do not clear the dirty state of the reported ranges
+ */
+enum iommu_dirty_flags {
+	IOMMU_DIRTY_NO_CLEAR	= 1 << 0,
+};
+
+/**
+ * iommu_set_dirty_tracking - Enable or disable dirty tracking
+ * @ctx: &struct iommu_ctx
+ * @enable: whether to track device writes
+ *
+ * Start or stop recording which pages are written by DMA from the devices
+ * attached to @ctx. Enabling dirty tracking does not clear the dirty state;
+ * use iommu_get_dirty_ranges() to do that.
+ *
+ * Only supported by the iommufd backend, and only if the IOMMU supports dirty
+ * tracking for all devices attached to the context.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``. If dirty
+ * tracking is not supported, ``errno`` is set to ``EOPNOTSUPP``.
+ */
+int iommu_set_dirty_tracking(struct iommu_ctx *ctx, bool enable);
+
+/**
+ * iommu_get_dirty_ranges - Get (and clear) dirty iova ranges
+ * @ctx: &struct iommu_ctx
+ * @iova: start of the iova range to query
+ * @len: length of the iova range to query
+ * @fn: function to call for each dirty range
+ * @opaque: opaque data pointer passed to @fn
+ * @flags: combination of enum iommu_dirty_flags
+ *
+ * Call @fn for each maximal range of pages in [@iova; @iova + @len) that has
+ * been written by a device since dirty tracking was enabled or the dirty state
+ * was last cleared, in order of iova. Unless ``IOMMU_DIRTY_NO_CLEAR`` is set,
+ * the dirty state of the queried range is cleared.
+ *
+ * The range is queried in windows of a bounded size and clean words of the
+ * dirty bitmap are skipped, so querying sparsely written ranges is cheap; to
+ * avoid walking unused iova space, query only the mapped ranges.
+ *
+ * Both @iova and @len must be page aligned.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int iommu_get_dirty_ranges(struct iommu_ctx *ctx, uint64_t iova, size_t len,
+			   void (*fn)(void *opaque, uint64_t iova, size_t len), void *opaque,
+			   unsigned long flags);
+
 #endif /* LIBVFN_IOMMU_DMA_H */
@@ -40,8 +40,34 @@ extern "C" {
 #include <vfn/nvme/types.h>
 #include <vfn/nvme/queue.h>
 #include <vfn/nvme/ctrl.h>
+#include <vfn/nvme/cmb.h>
+#include <vfn/nvme/ns.h>
+#include <vfn/nvme/pmr.h>
+#include <vfn/nvme/hmb.h>
+#include <vfn/nvme/power.h>
+#include <vfn/nvme/directive.h>
+#include <vfn/nvme/zns.h>
 #include <vfn/nvme/util.h>
+#include <vfn/nvme/logpage.h>
+#include <vfn/nvme/health.h>
+#include <vfn/nvme/stats.h>
+#include <vfn/nvme/pi.h>
+#include <vfn/nvme/fixed.h>
+#include <vfn/nvme/timeout.h>
 #include <vfn/nvme/rq.h>
+#include <vfn/nvme/tmpl.h>
+#include <vfn/nvme/ostream.h>
+#include <vfn/nvme/pow2.h>
+#include <vfn/nvme/reactor.h>
+#include <vfn/nvme/bdev.h>
+#include <vfn/nvme/bcache.h>
+#include <vfn/nvme/mpath.h>
+#include <vfn/nvme/qos.h>
+#include <vfn/nvme/qmgr.h>
+#include <vfn/nvme/readahead.h>
+#include <vfn/nvme/lease.h>
+#include <vfn/nvme/view.h>
+#include <vfn/nvme/rxring.h>
 
 #ifdef __cplusplus
 }
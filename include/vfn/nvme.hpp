@@ -0,0 +1,812 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_HPP
+#define LIBVFN_NVME_HPP
+
+/*
+ * Header-only C++ layer over <vfn/nvme.h>.
+ *
+ * Resource owning types (Controller, QueuePair, DmaBuffer and Request) are
+ * move-only RAII handles holding a single pointer (or pointer and length);
+ * their constructors throw std::system_error on failure. Everything on the
+ * submission and completion paths is inline, does not throw and forwards
+ * directly to the C inline functions, so it compiles to the same code.
+ *
+ * With C++20 coroutines, commands may be awaited (see QueuePair::read()) from
+ * a Task run by an Executor.
+ *
+ * The standard library headers are included before the C headers, since the
+ * latter define function-like macros (e.g., barrier()) that clash with
+ * standard library identifiers.
+ */
+
+#if __cplusplus < 201703L
+# error "vfn/nvme.hpp requires C++17"
+#endif
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+# include <span>
+# define LIBVFN_HAVE_SPAN 1
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+# include <coroutine>
+# include <exception>
+# include <vector>
+# define LIBVFN_HAVE_COROUTINE 1
+#endif
+
+#include <sys/types.h>
+
+#include <vfn/nvme.h>
+
+namespace vfn {
+namespace nvme {
+
+namespace detail {
+
+[[noreturn]] inline void throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+/* constexpr counterpart of cpu_to_le32() */
+constexpr uint32_t to_le32(uint32_t v)
+{
+	return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? v : __builtin_bswap32(v);
+}
+
+} /* namespace detail */
+
+/*
+ * Command builders
+ */
+namespace cmd {
+
+enum class Opcode : uint8_t {
+	Flush			= 0x00,
+	Write			= 0x01,
+	Read			= 0x02,
+	WriteZeroes		= 0x08,
+};
+
+/*
+ * Read, Write and Write Zeroes. The opcode is a template parameter, such that
+ * using a builder with a command that does not take a logical block range is a
+ * compile-time error. @nlb is the (one-based) number of logical blocks; zero
+ * blocks is rejected like nvme_ns_prep_rw() does, failing constant evaluation
+ * at compile time and throwing std::invalid_argument otherwise.
+ */
+template <Opcode Op>
+constexpr union nvme_cmd rw(uint32_t nsid, uint64_t slba, uint16_t nlb)
+{
+	static_assert(Op == Opcode::Read || Op == Opcode::Write || Op == Opcode::WriteZeroes,
+		      "not a logical block range command");
+
+	if (nlb == 0)
+		throw std::invalid_argument("nlb must be at least one");
+
+	union nvme_cmd c{};
+
+	c.opcode = static_cast<uint8_t>(Op);
+	c.nsid = detail::to_le32(nsid);
+	c.cdw10 = detail::to_le32(static_cast<uint32_t>(slba));
+	c.cdw11 = detail::to_le32(static_cast<uint32_t>(slba >> 32));
+	c.cdw12 = detail::to_le32(static_cast<uint32_t>(nlb - 1));
+
+	return c;
+}
+
+constexpr union nvme_cmd read(uint32_t nsid, uint64_t slba, uint16_t nlb)
+{
+	return rw<Opcode::Read>(nsid, slba, nlb);
+}
+
+constexpr union nvme_cmd write(uint32_t nsid, uint64_t slba, uint16_t nlb)
+{
+	return rw<Opcode::Write>(nsid, slba, nlb);
+}
+
+constexpr union nvme_cmd flush(uint32_t nsid)
+{
+	union nvme_cmd c{};
+
+	c.opcode = static_cast<uint8_t>(Opcode::Flush);
+	c.nsid = detail::to_le32(nsid);
+
+	return c;
+}
+
+/* admin Identify */
+constexpr union nvme_cmd identify(uint8_t cns, uint32_t nsid = 0)
+{
+	union nvme_cmd c{};
+
+	c.opcode = 0x06;
+	c.nsid = detail::to_le32(nsid);
+	c.cdw10 = detail::to_le32(cns);
+
+	return c;
+}
+
+} /* namespace cmd */
+
+/*
+ * Memory allocated with iommu_alloc() and mapped for the lifetime of the
+ * buffer.
+ */
+class DmaBuffer {
+public:
+	DmaBuffer() noexcept = default;
+
+	DmaBuffer(struct iommu_ctx *ctx, size_t len) : ctx_(ctx), len_(len)
+	{
+		if (iommu_alloc(ctx, len, &vaddr_, &iova_))
+			detail::throw_errno("iommu_alloc");
+	}
+
+	DmaBuffer(const DmaBuffer &) = delete;
+	DmaBuffer &operator=(const DmaBuffer &) = delete;
+
+	DmaBuffer(DmaBuffer &&o) noexcept
+		: ctx_(o.ctx_), vaddr_(std::exchange(o.vaddr_, nullptr)), iova_(o.iova_),
+		  len_(std::exchange(o.len_, 0)) {}
+
+	DmaBuffer &operator=(DmaBuffer &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+
+			ctx_ = o.ctx_;
+			vaddr_ = std::exchange(o.vaddr_, nullptr);
+			iova_ = o.iova_;
+			len_ = std::exchange(o.len_, 0);
+		}
+
+		return *this;
+	}
+
+	~DmaBuffer() { reset(); }
+
+	void reset() noexcept
+	{
+		if (vaddr_)
+			iommu_free(ctx_, vaddr_, len_);
+
+		vaddr_ = nullptr;
+		len_ = 0;
+	}
+
+	void *data() const noexcept { return vaddr_; }
+	uint64_t iova() const noexcept { return iova_; }
+	size_t size() const noexcept { return len_; }
+
+#ifdef LIBVFN_HAVE_SPAN
+	std::span<std::byte> span() const noexcept
+	{
+		return { static_cast<std::byte *>(vaddr_), len_ };
+	}
+#endif
+
+private:
+	struct iommu_ctx *ctx_ = nullptr;
+	void *vaddr_ = nullptr;
+	uint64_t iova_ = 0;
+	size_t len_ = 0;
+};
+
+class Request;
+
+/*
+ * A controller initialized with nvme_init() and closed with nvme_close(). The
+ * controller structure is heap allocated, such that the handle may be moved
+ * while queues and request trackers refer to it.
+ */
+class Controller {
+public:
+	explicit Controller(const char *bdf, const struct nvme_ctrl_opts *opts = nullptr)
+		: ctrl_(new nvme_ctrl{})
+	{
+		if (nvme_init(ctrl_.get(), bdf, opts)) {
+			int err = errno;
+
+			/* a partially initialized controller cannot be closed */
+			delete ctrl_.release();
+
+			errno = err;
+			detail::throw_errno("nvme_init");
+		}
+	}
+
+	struct nvme_ctrl *get() const noexcept { return ctrl_.get(); }
+	struct iommu_ctx *iommu() const noexcept { return __iommu_ctx(ctrl_.get()); }
+
+	struct nvme_sq *admin_sq() const noexcept { return ctrl_->adminq.sq; }
+
+	DmaBuffer alloc(size_t len) const { return DmaBuffer(iommu(), len); }
+
+private:
+	struct closer {
+		void operator()(struct nvme_ctrl *ctrl) const noexcept
+		{
+			nvme_close(ctrl);
+			delete ctrl;
+		}
+	};
+
+	std::unique_ptr<struct nvme_ctrl, closer> ctrl_;
+};
+
+#ifdef LIBVFN_HAVE_COROUTINE
+/*
+ * The result of an awaited command. @error is an errno value; either the
+ * command could not be submitted or it completed with an error status (see
+ * nvme_set_errno_from_cqe()), in which case @cqe holds the completion.
+ */
+struct Completion {
+	struct nvme_cqe cqe;
+	int error;
+
+	explicit operator bool() const noexcept { return !error; }
+};
+
+/*
+ * Awaitable submission of a single command. The command is posted when the
+ * awaiting coroutine suspends and the coroutine is resumed from the completion
+ * callback, i.e., from within nvme_cq_process() (see Executor::poll()), so it
+ * must not itself process the completion queue. Commands posted by resumed
+ * coroutines are batched into a single doorbell write by nvme_cq_process();
+ * otherwise, the doorbell is written by the next Executor::poll() (or
+ * QueuePair::update_tail()).
+ *
+ * If no request tracker is available, the command is not submitted and the
+ * result is EBUSY.
+ */
+class CommandAwaiter {
+public:
+	CommandAwaiter(struct nvme_ctrl *ctrl, struct nvme_sq *sq, const union nvme_cmd &c,
+		       uint64_t iova = 0, size_t len = 0) noexcept
+		: ctrl_(ctrl), sq_(sq), cmd_(c), iova_(iova), len_(len) {}
+
+	/* fail without submitting */
+	explicit CommandAwaiter(int error) noexcept : res_{ {}, error } {}
+
+	bool await_ready() const noexcept { return res_.error != 0; }
+
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		struct nvme_rq *rq = nvme_rq_acquire(sq_);
+
+		if (!rq) {
+			res_.error = errno;
+			return false;
+		}
+
+		if (len_ && nvme_rq_map(ctrl_, rq, &cmd_, iova_, len_)) {
+			res_.error = errno;
+			nvme_rq_release(rq);
+
+			return false;
+		}
+
+		h_ = h;
+
+		nvme_rq_submit(rq, &cmd_, complete, this);
+
+		return true;
+	}
+
+	Completion await_resume() const noexcept { return res_; }
+
+private:
+	static void complete(struct nvme_rq *, struct nvme_cqe *cqe, void *arg)
+	{
+		CommandAwaiter *self = static_cast<CommandAwaiter *>(arg);
+
+		self->res_.cqe = *cqe;
+		self->res_.error = nvme_set_errno_from_cqe(cqe) ? errno : 0;
+
+		/* the tracker is released by nvme_cq_process() when this returns */
+		self->h_.resume();
+	}
+
+	struct nvme_ctrl *ctrl_ = nullptr;
+	struct nvme_sq *sq_ = nullptr;
+	union nvme_cmd cmd_{};
+	uint64_t iova_ = 0;
+	size_t len_ = 0;
+
+	std::coroutine_handle<> h_;
+	Completion res_{};
+};
+#endif
+
+/*
+ * An I/O queue pair created with nvme_create_ioqpair() and deleted with
+ * nvme_delete_ioqpair().
+ */
+class QueuePair {
+public:
+	QueuePair(Controller &ctrl, int qid, int qsize, int vector = -1, unsigned long flags = 0)
+		: ctrl_(ctrl.get()), qid_(qid)
+	{
+		if (nvme_create_ioqpair(ctrl_, qid, qsize, vector, flags))
+			detail::throw_errno("nvme_create_ioqpair");
+	}
+
+	QueuePair(const QueuePair &) = delete;
+	QueuePair &operator=(const QueuePair &) = delete;
+
+	QueuePair(QueuePair &&o) noexcept
+		: ctrl_(std::exchange(o.ctrl_, nullptr)), qid_(o.qid_) {}
+
+	QueuePair &operator=(QueuePair &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+
+			ctrl_ = std::exchange(o.ctrl_, nullptr);
+			qid_ = o.qid_;
+		}
+
+		return *this;
+	}
+
+	~QueuePair() { reset(); }
+
+	void reset() noexcept
+	{
+		if (ctrl_)
+			nvme_delete_ioqpair(ctrl_, qid_);
+
+		ctrl_ = nullptr;
+	}
+
+	struct nvme_sq *sq() const noexcept { return &ctrl_->sq[qid_]; }
+	struct nvme_cq *cq() const noexcept { return &ctrl_->cq[qid_]; }
+	int id() const noexcept { return qid_; }
+
+	inline std::optional<Request> acquire() noexcept;
+
+	/* see nvme_cq_process() */
+	int process(int budget) noexcept { return nvme_cq_process(cq(), budget); }
+
+	/* see nvme_sq_update_tail() */
+	void update_tail() noexcept { nvme_sq_update_tail(sq()); }
+
+#ifdef LIBVFN_HAVE_COROUTINE
+	/* co_await the completion of @c with a data buffer mapped at @iova */
+	CommandAwaiter submit(const union nvme_cmd &c, uint64_t iova = 0, size_t len = 0) noexcept
+	{
+		return { ctrl_, sq(), c, iova, len };
+	}
+
+	/* co_await a read of @buf worth of logical blocks (see nvme_ns_prep_rw()) */
+	CommandAwaiter read(struct nvme_ns *ns, uint64_t slba, const DmaBuffer &buf) noexcept
+	{
+		return rw(cmd::Opcode::Read, ns, slba, buf);
+	}
+
+	CommandAwaiter write(struct nvme_ns *ns, uint64_t slba, const DmaBuffer &buf) noexcept
+	{
+		return rw(cmd::Opcode::Write, ns, slba, buf);
+	}
+#endif
+
+private:
+#ifdef LIBVFN_HAVE_COROUTINE
+	CommandAwaiter rw(cmd::Opcode op, struct nvme_ns *ns, uint64_t slba,
+			  const DmaBuffer &buf) noexcept
+	{
+		union nvme_cmd c;
+
+		if (nvme_ns_prep_rw(ns, &c, static_cast<uint8_t>(op), slba, buf.size()))
+			return CommandAwaiter(errno);
+
+		return submit(c, buf.iova(), buf.size());
+	}
+#endif
+
+	struct nvme_ctrl *ctrl_;
+	int qid_;
+};
+
+/*
+ * Submission and completion fast paths for queues of a power-of-two size fixed
+ * at compile time; the counterpart of NVME_QUEUE_POW2_DEFINE() (see
+ * <vfn/nvme/pow2.h>).
+ */
+template <unsigned int QSize>
+struct Pow2Queue {
+	static_assert(QSize >= 2 && QSize <= 65536 && !(QSize & (QSize - 1)),
+		      "queue size must be a power of two");
+
+	static constexpr uint16_t mask = static_cast<uint16_t>(QSize - 1);
+
+	/* see nvme_sq_post() */
+	static void post(struct nvme_sq *sq, const union nvme_cmd &sqe) noexcept
+	{
+		__nvme_sq_post_mask(sq, &sqe, mask);
+	}
+
+	/* see nvme_cq_get_cqe() */
+	static struct nvme_cqe *get_cqe(struct nvme_cq *cq) noexcept
+	{
+		return __nvme_cq_get_cqe_mask(cq, mask);
+	}
+
+	/* see nvme_cq_reap_batch() */
+	static int reap_batch(struct nvme_cq *cq, struct nvme_cqe **out, int max) noexcept
+	{
+		return __nvme_cq_reap_batch_mask(cq, out, max, mask);
+	}
+
+	/* see nvme_cq_rq_from_cqe() */
+	static struct nvme_rq *rq_from_cqe(struct nvme_cq *cq, struct nvme_cqe *cqe) noexcept
+	{
+		return __nvme_cq_rq_from_cqe_mask(cq, cqe, mask);
+	}
+};
+
+/*
+ * Ownership of a request tracker acquired with nvme_rq_acquire(). The tracker
+ * is released when the handle is destroyed, unless ownership was handed to
+ * the completion path with submit().
+ */
+class Request {
+public:
+	Request() noexcept = default;
+
+	/* adopt a tracker acquired elsewhere */
+	explicit Request(struct nvme_rq *rq) noexcept : rq_(rq) {}
+
+	static std::optional<Request> acquire(struct nvme_sq *sq) noexcept
+	{
+		struct nvme_rq *rq = nvme_rq_acquire(sq);
+
+		if (!rq)
+			return std::nullopt;
+
+		return Request(rq);
+	}
+
+	Request(const Request &) = delete;
+	Request &operator=(const Request &) = delete;
+
+	Request(Request &&o) noexcept : rq_(std::exchange(o.rq_, nullptr)) {}
+
+	Request &operator=(Request &&o) noexcept
+	{
+		if (this != &o) {
+			reset();
+
+			rq_ = std::exchange(o.rq_, nullptr);
+		}
+
+		return *this;
+	}
+
+	~Request() { reset(); }
+
+	void reset() noexcept
+	{
+		if (rq_)
+			nvme_rq_release(rq_);
+
+		rq_ = nullptr;
+	}
+
+	/* give up ownership without releasing the tracker */
+	[[nodiscard]] struct nvme_rq *release() noexcept { return std::exchange(rq_, nullptr); }
+
+	struct nvme_rq *get() const noexcept { return rq_; }
+	explicit operator bool() const noexcept { return rq_ != nullptr; }
+
+	/*
+	 * Data pointer setup; returns 0 on success and -1 (setting errno) on
+	 * error, like the C functions. See nvme_rq_map().
+	 */
+	int map(Controller &ctrl, union nvme_cmd &c, uint64_t iova, size_t len) noexcept
+	{
+		return nvme_rq_map(ctrl.get(), rq_, &c, iova, len);
+	}
+
+	int map(Controller &ctrl, union nvme_cmd &c, const DmaBuffer &buf, size_t offset,
+		size_t len) noexcept
+	{
+		return map(ctrl, c, buf.iova() + offset, len);
+	}
+
+	/* see nvme_rq_map_prp() */
+	int map_prp(Controller &ctrl, union nvme_cmd &c, uint64_t iova, size_t len) noexcept
+	{
+		return nvme_rq_map_prp(ctrl.get(), rq_, &c, iova, len);
+	}
+
+#ifdef LIBVFN_HAVE_SPAN
+	/* map a range of already mapped memory (see iommu_translate_vaddr()) */
+	int map_prp(Controller &ctrl, union nvme_cmd &c, std::span<const std::byte> buf) noexcept
+	{
+		uint64_t iova;
+
+		if (!iommu_translate_vaddr(ctrl.iommu(), const_cast<std::byte *>(buf.data()),
+					   &iova)) {
+			errno = EFAULT;
+			return -1;
+		}
+
+		return map_prp(ctrl, c, iova, buf.size());
+	}
+#endif
+
+	/* see nvme_rq_exec() and nvme_rq_spin() */
+	void exec(union nvme_cmd &c) noexcept { nvme_rq_exec(rq_, &c); }
+	int spin(struct nvme_cqe *cqe = nullptr) noexcept { return nvme_rq_spin(rq_, cqe); }
+
+	/* see nvme_rq_post() */
+	void post(union nvme_cmd &c) noexcept { nvme_rq_post(rq_, &c); }
+
+	/*
+	 * Post the command with a completion callback (see nvme_rq_submit());
+	 * the tracker is released by nvme_cq_process().
+	 */
+	void submit(union nvme_cmd &c, nvme_rq_cb cb, void *arg) && noexcept
+	{
+		nvme_rq_submit(release(), &c, cb, arg);
+	}
+
+private:
+	struct nvme_rq *rq_ = nullptr;
+};
+
+inline std::optional<Request> QueuePair::acquire() noexcept
+{
+	return Request::acquire(sq());
+}
+
+#ifdef LIBVFN_HAVE_COROUTINE
+class Executor;
+
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+struct task_promise_base {
+	struct final_awaiter {
+		bool await_ready() const noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			auto &p = h.promise();
+
+			if (p.continuation)
+				return p.continuation;
+
+			/* a detached task (see Executor::spawn()) */
+			if (p.exec) {
+				auto *exec = p.exec;
+				std::exception_ptr e = std::move(p.exception);
+
+				h.destroy();
+				exec->done(std::move(e));
+			}
+
+			return std::noop_coroutine();
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+
+	void unhandled_exception() noexcept { exception = std::current_exception(); }
+
+	std::coroutine_handle<> continuation;
+	Executor *exec = nullptr;
+	std::exception_ptr exception;
+};
+
+template <typename T>
+struct task_promise : task_promise_base {
+	Task<T> get_return_object() noexcept;
+
+	template <typename U>
+	void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+
+	std::optional<T> value;
+};
+
+template <>
+struct task_promise<void> : task_promise_base {
+	Task<void> get_return_object() noexcept;
+
+	void return_void() const noexcept {}
+};
+
+} /* namespace detail */
+
+/*
+ * A lazily started coroutine. A Task runs when awaited by another Task (and
+ * resumes it on return) or when spawned on an Executor.
+ */
+template <typename T>
+class [[nodiscard]] Task {
+public:
+	using promise_type = detail::task_promise<T>;
+
+	explicit Task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+
+	Task(Task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+
+	Task &operator=(Task &&o) noexcept
+	{
+		if (this != &o) {
+			if (h_)
+				h_.destroy();
+
+			h_ = std::exchange(o.h_, nullptr);
+		}
+
+		return *this;
+	}
+
+	~Task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+	{
+		h_.promise().continuation = c;
+
+		return h_;
+	}
+
+	T await_resume()
+	{
+		promise_type &p = h_.promise();
+
+		if (p.exception)
+			std::rethrow_exception(p.exception);
+
+		if constexpr (!std::is_void_v<T>)
+			return std::move(*p.value);
+	}
+
+private:
+	friend class Executor;
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <typename T>
+inline Task<T> task_promise<T>::get_return_object() noexcept
+{
+	return Task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline Task<void> task_promise<void>::get_return_object() noexcept
+{
+	return Task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+} /* namespace detail */
+
+/*
+ * A single-threaded executor for detached tasks, polling a set of queue pairs
+ * for completions.
+ *
+ * run() polls until all spawned tasks have completed. To integrate with an
+ * external event loop, call poll() from it instead; e.g., from an idle
+ * handler, or when the interrupt eventfd of a completion queue (see
+ * nvme_create_iocq()) becomes readable. pending() is the number of tasks that
+ * have not yet completed.
+ */
+class Executor {
+public:
+	Executor() = default;
+
+	Executor(const Executor &) = delete;
+	Executor &operator=(const Executor &) = delete;
+
+	void attach(struct nvme_sq *sq, struct nvme_cq *cq) { queues_.push_back({ sq, cq }); }
+	void attach(QueuePair &qp) { attach(qp.sq(), qp.cq()); }
+
+	/* start @t; it runs until its first suspension before this returns */
+	void spawn(Task<> t) noexcept
+	{
+		std::coroutine_handle<Task<>::promise_type> h = std::exchange(t.h_, nullptr);
+
+		h.promise().exec = this;
+		pending_++;
+
+		h.resume();
+	}
+
+	/*
+	 * Write the doorbells of the attached submission queues and process up
+	 * to @budget completions on each completion queue, resuming the
+	 * awaiting coroutines. Rethrows the first exception escaping a spawned
+	 * task. Returns the number of completions processed.
+	 */
+	int poll(int budget = 64)
+	{
+		int n = 0;
+
+		for (auto &q : queues_) {
+			nvme_sq_update_tail(q.sq);
+
+			n += nvme_cq_process(q.cq, budget);
+		}
+
+		if (exception_)
+			std::rethrow_exception(std::exchange(exception_, nullptr));
+
+		return n;
+	}
+
+	void run()
+	{
+		while (pending_)
+			poll();
+	}
+
+	size_t pending() const noexcept { return pending_; }
+
+private:
+	friend struct detail::task_promise_base::final_awaiter;
+
+	void done(std::exception_ptr e) noexcept
+	{
+		pending_--;
+
+		if (e && !exception_)
+			exception_ = std::move(e);
+	}
+
+	struct queue {
+		struct nvme_sq *sq;
+		struct nvme_cq *cq;
+	};
+
+	std::vector<queue> queues_;
+	size_t pending_ = 0;
+	std::exception_ptr exception_;
+};
+#endif
+
+} /* namespace nvme */
+} /* namespace vfn */
+
+#endif /* LIBVFN_NVME_HPP */
@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_BCACHE_H
+#define LIBVFN_NVME_BCACHE_H
+
+/**
+ * DOC: Block cache
+ *
+ * A &struct vfn_bcache caches fixed-size pages of a block device (see &struct
+ * vfn_bdev) in memory that is allocated and mapped once, on the numa node of
+ * the controller. Cache misses read straight into the page (its iova is the
+ * data pointer of the read), so filling the cache does not copy.
+ *
+ * Pages are spread over a number of stripes by a hash of the page number. Each
+ * stripe has its own lock, hash table and Adaptive Replacement Cache (ARC):
+ * resident pages are kept on a list of pages seen once (recency) and a list of
+ * pages seen at least twice (frequency), and the page numbers last evicted
+ * from each are remembered on a ghost list. A miss that hits a ghost list moves
+ * the target size of the recency list, so the cache adapts to the mix of
+ * scans and re-reads of the workload.
+ *
+ * Pages are written back, not through. Dirty pages are written back by
+ * vfn_bcache_flush(), all at once and sorted by page number, so writes of
+ * adjacent pages are merged into large commands (see vfn_bdev_unplug()). Dirty
+ * pages are not evicted; if a stripe has nothing else to evict, the dirty pages
+ * are flushed first.
+ *
+ * All I/O is done through the &struct vfn_bdev_queue of the calling thread and
+ * completed by polling it, so any number of threads may use the cache, each
+ * with its own queue.
+ */
+
+struct vfn_bcache_entry;
+struct vfn_bcache_stripe;
+
+/**
+ * struct vfn_bcache_page - Cached page
+ * @vaddr: Page data
+ * @iova: I/O virtual address of @vaddr
+ * @pgno: Page number (the byte offset on the device divided by the page size)
+ *
+ * Returned pinned by vfn_bcache_get(); the page stays valid until given back
+ * with vfn_bcache_put().
+ */
+struct vfn_bcache_page {
+	void *vaddr;
+	uint64_t iova;
+	uint64_t pgno;
+
+	/* private: */
+	struct vfn_bcache_entry *entry;
+	struct vfn_bcache_stripe *stripe;
+	unsigned int ref;
+	bool valid, dirty, writeback;
+	bool filling;
+
+	struct vfn_bdev_io io;
+	bool failed;
+};
+
+/**
+ * struct vfn_bcache - Block cache
+ * @bdev: See &struct vfn_bdev
+ * @pagesize: Page size in bytes
+ * @npages: Number of pages
+ */
+struct vfn_bcache {
+	struct vfn_bdev *bdev;
+	size_t pagesize;
+	int npages;
+
+	/* private: */
+	void *vaddr;
+	uint64_t iova;
+	size_t len;
+	struct vfn_bcache_page *pages;
+	unsigned int shift;
+
+	struct vfn_bcache_stripe *stripes;
+	int nstripes;
+};
+
+/**
+ * struct vfn_bcache_stats - Block cache statistics
+ * @hits: Number of lookups of resident pages
+ * @misses: Number of lookups that read the page
+ * @ghost_hits: Number of misses of recently evicted pages
+ * @evictions: Number of pages evicted
+ * @writebacks: Number of pages written back
+ */
+struct vfn_bcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t ghost_hits;
+	uint64_t evictions;
+	uint64_t writebacks;
+};
+
+/**
+ * vfn_bcache_init - Initialize a block cache
+ * @c: &struct vfn_bcache
+ * @bdev: &struct vfn_bdev
+ * @pagesize: Page size in bytes (a power of two multiple of the logical block
+ *            size, at least the host page size and at most &struct
+ *            nvme_ns.max_nlb blocks)
+ * @npages: Number of pages
+ * @nstripes: Number of stripes (at most @npages)
+ *
+ * Allocate and map @npages pages on the numa node of the controller of @bdev
+ * (see iommu_alloc_node()) and split them over @nstripes stripes.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int vfn_bcache_init(struct vfn_bcache *c, struct vfn_bdev *bdev, size_t pagesize, int npages,
+		    int nstripes);
+
+/**
+ * vfn_bcache_destroy - Release a block cache
+ * @c: &struct vfn_bcache
+ *
+ * Release the pages; dirty pages are discarded. See vfn_bcache_flush().
+ */
+void vfn_bcache_destroy(struct vfn_bcache *c);
+
+/**
+ * vfn_bcache_get - Look up a page
+ * @c: &struct vfn_bcache
+ * @q: &struct vfn_bdev_queue of the calling thread
+ * @pgno: Page number
+ *
+ * Look up @pgno and pin it. On a miss, a page is evicted (writing back the
+ * dirty pages with vfn_bcache_flush() if only dirty pages are left to evict)
+ * and the page is read into it on @q, polling @q until the read completes. If
+ * another thread is reading the page, wait for it.
+ *
+ * Return: The pinned page (see &struct vfn_bcache_page). On error, returns
+ * NULL and sets ``errno`` (``EINVAL`` if @pgno is beyond the end of the
+ * device, ``EBUSY`` if all pages of the stripe are pinned, ``EIO`` if the read
+ * or write-back failed).
+ */
+struct vfn_bcache_page *vfn_bcache_get(struct vfn_bcache *c, struct vfn_bdev_queue *q,
+				       uint64_t pgno);
+
+/**
+ * vfn_bcache_put - Unpin a page
+ * @c: &struct vfn_bcache
+ * @page: Page returned by vfn_bcache_get()
+ */
+void vfn_bcache_put(struct vfn_bcache *c, struct vfn_bcache_page *page);
+
+/**
+ * vfn_bcache_dirty - Mark a page dirty
+ * @c: &struct vfn_bcache
+ * @page: Pinned page (see vfn_bcache_get())
+ *
+ * Mark @page for write-back after its data has been modified. The page must not
+ * be modified while a vfn_bcache_flush() is in progress.
+ */
+void vfn_bcache_dirty(struct vfn_bcache *c, struct vfn_bcache_page *page);
+
+/**
+ * vfn_bcache_flush - Write back dirty pages
+ * @c: &struct vfn_bcache
+ * @q: &struct vfn_bdev_queue of the calling thread
+ *
+ * Write back all dirty pages on @q in ascending page order, so that adjacent
+ * pages are merged into single commands, and poll @q until the writes
+ * complete. Pages that fail to be written back remain dirty.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EIO`` if a write failed).
+ */
+int vfn_bcache_flush(struct vfn_bcache *c, struct vfn_bdev_queue *q);
+
+/**
+ * vfn_bcache_get_stats - Get block cache statistics
+ * @c: &struct vfn_bcache
+ * @stats: Output parameter (&struct vfn_bcache_stats)
+ *
+ * Sum up the statistics of all stripes.
+ */
+void vfn_bcache_get_stats(struct vfn_bcache *c, struct vfn_bcache_stats *stats);
+
+#endif /* LIBVFN_NVME_BCACHE_H */
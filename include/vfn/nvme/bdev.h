@@ -0,0 +1,193 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_BDEV_H
+#define LIBVFN_NVME_BDEV_H
+
+/**
+ * DOC: Block device
+ *
+ * A &struct vfn_bdev is a thin block device layer over a single namespace. I/Os
+ * (see &struct vfn_bdev_io) are added to a per-thread &struct vfn_bdev_queue
+ * with vfn_bdev_add() and held back ("plugged") until vfn_bdev_unplug() is
+ * called or the queue is full. On unplug, the plugged I/Os are sorted by
+ * logical block address and I/Os of the same type covering adjacent ranges are
+ * merged into one command (up to &struct nvme_ns.max_nlb logical blocks). All
+ * commands of the batch are then submitted with a single doorbell write.
+ *
+ * The buffers of merged I/Os need not be contiguous; they are mapped with
+ * nvme_rq_mapv(), so they are only merged if the resulting iovec can be
+ * described by the controller (any buffers with SGLs, page aligned boundaries
+ * with PRPs).
+ *
+ * Completions are reaped with vfn_bdev_poll() (or nvme_cq_process() on the
+ * completion queue), which invokes the callback of each I/O of a completed
+ * command. Plugged I/Os are not ordered with respect to each other, just like
+ * any commands outstanding at the same time.
+ */
+
+/* maximum number of plugged i/os per queue */
+#define VFN_BDEV_PLUG_MAX 64
+
+/* maximum number of i/os merged into one command */
+#define VFN_BDEV_MERGE_MAX 32
+
+struct vfn_bdev_io;
+
+/**
+ * typedef vfn_bdev_cb - I/O completion callback
+ * @io: The completed &struct vfn_bdev_io
+ * @cqe: Completion queue entry of the command that @io was part of
+ *       (&struct nvme_cqe)
+ */
+typedef void (*vfn_bdev_cb)(struct vfn_bdev_io *io, struct nvme_cqe *cqe);
+
+/**
+ * enum vfn_bdev_op - Block device I/O type
+ * @VFN_BDEV_OP_WRITE: Write
+ * @VFN_BDEV_OP_READ: Read
+ *
+ * The values are the NVM Command Set opcodes.
+ */
+enum vfn_bdev_op {
+	VFN_BDEV_OP_WRITE		= 0x01,
+	VFN_BDEV_OP_READ		= 0x02,
+};
+
+/**
+ * struct vfn_bdev - Block device
+ * @ctrl: See &struct nvme_ctrl
+ * @ns: Namespace (see &struct nvme_ns)
+ */
+struct vfn_bdev {
+	struct nvme_ctrl *ctrl;
+	struct nvme_ns *ns;
+};
+
+/**
+ * struct vfn_bdev_io - Block device I/O
+ * @op: I/O type (see &enum vfn_bdev_op)
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ * @iova: I/O virtual address of the data buffer
+ * @dtype: Directive type of a placement hint (see &enum nvme_dir_type; ``0``
+ *         for none)
+ * @dspec: Directive specific value of the placement hint (see
+ *         nvme_rw_set_directive())
+ * @cb: Completion callback
+ * @opaque: Opaque data for @cb
+ *
+ * The I/O must remain valid until its callback is invoked. I/Os are only
+ * merged with I/Os that have the same placement hint.
+ */
+struct vfn_bdev_io {
+	uint8_t op;
+	uint64_t slba;
+	uint32_t nlb;
+	uint64_t iova;
+	uint8_t dtype;
+	uint16_t dspec;
+	vfn_bdev_cb cb;
+	void *opaque;
+
+	/* private: */
+	struct vfn_bdev_io *next;
+};
+
+/**
+ * struct vfn_bdev_queue - Per-thread block device queue
+ * @bdev: See &struct vfn_bdev
+ * @sq: Submission queue that commands are submitted to
+ * @merged: Number of I/Os merged into the command of another I/O
+ * @commands: Number of commands submitted
+ */
+struct vfn_bdev_queue {
+	struct vfn_bdev *bdev;
+	struct nvme_sq *sq;
+
+	uint64_t merged;
+	uint64_t commands;
+
+	/* private: */
+	int nplugged;
+	struct vfn_bdev_io *plug[VFN_BDEV_PLUG_MAX];
+};
+
+/**
+ * vfn_bdev_open - Open a namespace as a block device
+ * @bdev: &struct vfn_bdev to initialize
+ * @ctrl: &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ *
+ * Look up @nsid in the namespace cache (see nvme_ns_get()). Only namespaces
+ * without metadata are supported.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if @nsid is not an active namespace, ``ENOTSUP`` if
+ * the namespace is formatted with metadata).
+ */
+int vfn_bdev_open(struct vfn_bdev *bdev, struct nvme_ctrl *ctrl, uint32_t nsid);
+
+/**
+ * vfn_bdev_queue_init - Initialize a block device queue
+ * @q: &struct vfn_bdev_queue to initialize
+ * @bdev: &struct vfn_bdev
+ * @sq: I/O submission queue (with a completion queue processed by
+ *      nvme_cq_process(), see vfn_bdev_poll())
+ *
+ * A queue must only be used by one thread at a time.
+ */
+void vfn_bdev_queue_init(struct vfn_bdev_queue *q, struct vfn_bdev *bdev, struct nvme_sq *sq);
+
+/**
+ * vfn_bdev_add - Queue an I/O
+ * @q: &struct vfn_bdev_queue
+ * @io: &struct vfn_bdev_io
+ *
+ * Plug @io until the next vfn_bdev_unplug(). If the queue is full, it is
+ * unplugged first.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if @io is not valid for the namespace, ``EBUSY`` if
+ * the queue is full and could not be unplugged).
+ */
+int vfn_bdev_add(struct vfn_bdev_queue *q, struct vfn_bdev_io *io);
+
+/**
+ * vfn_bdev_unplug - Submit plugged I/Os
+ * @q: &struct vfn_bdev_queue
+ *
+ * Sort and merge the plugged I/Os, submit the resulting commands and write the
+ * submission queue doorbell once. I/Os whose buffer cannot be mapped are
+ * completed immediately with an Invalid Field in Command status.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` to ``EBUSY`` if request trackers ran out; the I/Os not submitted
+ * remain plugged.
+ */
+int vfn_bdev_unplug(struct vfn_bdev_queue *q);
+
+/**
+ * vfn_bdev_poll - Process block device completions
+ * @q: &struct vfn_bdev_queue
+ * @budget: Maximum number of completions to process
+ *
+ * Process completions on the completion queue of @q (see nvme_cq_process()).
+ *
+ * Return: The number of completions (commands, not I/Os) processed.
+ */
+static inline int vfn_bdev_poll(struct vfn_bdev_queue *q, int budget)
+{
+	return nvme_cq_process(q->sq->cq, budget);
+}
+
+#endif /* LIBVFN_NVME_BDEV_H */
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_CMB_H
+#define LIBVFN_NVME_CMB_H
+
+/**
+ * DOC: Controller Memory Buffer
+ *
+ * The Controller Memory Buffer (CMB) is a region of device memory exposed in
+ * one of the controller bars. It may hold submission queues (see
+ * ``NVME_IOSQ_F_CMB``) and data buffers. Buffers carved out of the CMB of one
+ * controller may be used as the data pointer of commands submitted to another
+ * controller, such that data is copied from one drive to the other without
+ * going through host memory (peer-to-peer dma).
+ *
+ * For peer-to-peer dma, the CMB must be initialized with ``NVME_CMB_F_P2P`` and
+ * the controllers must share an iommu context (like the default context, see
+ * iommu_get_default_context()).
+ */
+
+/**
+ * enum nvme_cmb_flags - Controller Memory Buffer flags
+ * @NVME_CMB_F_P2P: Map the CMB in the iommu context of the controller such that
+ *                  it is reachable by peer devices in the same context
+ */
+enum nvme_cmb_flags {
+	NVME_CMB_F_P2P		= 1 << 0,
+};
+
+/**
+ * nvme_cmb_init - Discover, enable and map the Controller Memory Buffer
+ * @ctrl: &struct nvme_ctrl
+ * @flags: combination of &enum nvme_cmb_flags
+ *
+ * Enable the CMB of @ctrl and map it (write-combining if possible, see
+ * vfio_pci_map_bar_wc()). On return, ``ctrl->cmb`` describes the CMB.
+ *
+ * If ``NVME_CMB_F_P2P`` is set, the CMB is additionally mapped in the iommu
+ * context of @ctrl at the address that the controller itself decodes as the
+ * CMB (the controller memory space base address if the controller supports
+ * CMBMSC, or the pci bus address otherwise). That address is then valid for
+ * both @ctrl and any peer device that shares the iommu context.
+ *
+ * The CMB is initialized implicitly (without ``NVME_CMB_F_P2P``) when the first
+ * submission queue is created in it. If the CMB is already initialized, this is
+ * a no-op, except that requesting ``NVME_CMB_F_P2P`` for a CMB that was
+ * initialized without it fails.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_cmb_init(struct nvme_ctrl *ctrl, unsigned long flags);
+
+/**
+ * nvme_cmb_alloc - Allocate a buffer in the Controller Memory Buffer
+ * @ctrl: &struct nvme_ctrl
+ * @len: number of bytes to allocate
+ * @vaddr: output parameter for the virtual address of the buffer
+ * @iova: output parameter for the address of the buffer as seen by devices
+ *
+ * Allocate @len bytes (rounded up to the controller memory page size) of the
+ * CMB, initializing it if needed (see nvme_cmb_init()). The buffer is aligned
+ * to at least the controller memory page size and may be released with
+ * nvme_cmb_free().
+ *
+ * @vaddr is a device memory mapping; copy to and from it with
+ * vfio_pci_memcpy_to_bar() and vfio_pci_memcpy_from_bar().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_cmb_alloc(struct nvme_ctrl *ctrl, size_t len, void **vaddr, uint64_t *iova);
+
+/**
+ * nvme_cmb_free - Free a buffer in the Controller Memory Buffer
+ * @ctrl: &struct nvme_ctrl
+ * @vaddr: virtual address of the buffer (as returned by nvme_cmb_alloc())
+ * @len: length of the buffer (as given to nvme_cmb_alloc())
+ */
+void nvme_cmb_free(struct nvme_ctrl *ctrl, void *vaddr, size_t len);
+
+/**
+ * nvme_cmb_close - Release the Controller Memory Buffer
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Unmap the CMB. Any buffers allocated from it must no longer be in use. Called
+ * by nvme_close().
+ */
+void nvme_cmb_close(struct nvme_ctrl *ctrl);
+
+#endif /* LIBVFN_NVME_CMB_H */
@@ -15,11 +15,92 @@
 
 #define NVME_CTRL_MPS 0
 
+/**
+ * enum nvme_numa_policy - Placement of queue and buffer memory
+ * @NVME_NUMA_LOCAL: no preference; pages are allocated on the node of the
+ *                   thread that first touches them
+ * @NVME_NUMA_DEVICE: prefer the numa node the device is attached to (as
+ *                    reported by the ``numa_node`` sysfs property)
+ * @NVME_NUMA_NODE: prefer the node given by &nvme_ctrl_opts.numa_node
+ *
+ * The policy applies to queue rings, prp list pages and data buffers allocated
+ * by the library (see pgbind()). It may be overridden for individual queues
+ * with nvme_set_queue_numa_node().
+ */
+enum nvme_numa_policy {
+	NVME_NUMA_LOCAL		= 0,
+	NVME_NUMA_DEVICE	= 1,
+	NVME_NUMA_NODE		= 2,
+};
+
+/**
+ * struct nvme_arb_opts - Command arbitration options
+ * @wrr: Enable the Weighted Round Robin with Urgent Priority Class arbitration
+ *       mechanism if supported by the controller (``CAP.AMS``); otherwise
+ *       round robin arbitration is used
+ * @ab: Arbitration burst (log2 of the number of commands fetched from a queue
+ *      at a time; ``7`` for no limit)
+ * @hpw: High priority weight (zeroes based)
+ * @mpw: Medium priority weight (zeroes based)
+ * @lpw: Low priority weight (zeroes based)
+ *
+ * With @wrr, the weights and arbitration burst are set (see
+ * nvme_set_arbitration()) when the controller is initialized and after it is
+ * recovered. The priority class of an I/O submission queue is given on
+ * creation (see &enum nvme_create_iosq_flags).
+ */
+struct nvme_arb_opts {
+	bool wrr;
+	uint8_t ab;
+	uint8_t hpw, mpw, lpw;
+};
+
+/**
+ * enum nvme_power_policy - Power state management policy
+ * @NVME_POWER_DEFAULT: leave the power management configuration of the
+ *                      controller as is
+ * @NVME_POWER_APST: enable Autonomous Power State Transitions, but only to
+ *                   non-operational states with an exit latency of at most
+ *                   &nvme_power_opts.max_latency_us (see nvme_set_apst())
+ * @NVME_POWER_PIN: disable Autonomous Power State Transitions and stay in
+ *                  power state &nvme_power_opts.ps
+ */
+enum nvme_power_policy {
+	NVME_POWER_DEFAULT	= 0,
+	NVME_POWER_APST		= 1,
+	NVME_POWER_PIN		= 2,
+};
+
+/**
+ * struct nvme_power_opts - Power state management options
+ * @policy: power state management policy (see &enum nvme_power_policy)
+ * @max_latency_us: maximum exit latency in microseconds with ``NVME_POWER_APST``
+ * @ps: power state used with ``NVME_POWER_PIN``
+ *
+ * Unless @policy is ``NVME_POWER_DEFAULT``, the policy is applied (see
+ * nvme_set_power_policy()) when the controller is initialized and after it is
+ * recovered.
+ */
+struct nvme_power_opts {
+	int policy;
+	uint32_t max_latency_us;
+	uint8_t ps;
+};
+
 /**
  * struct nvme_ctrl_opts - NVMe controller options
  * @nsqr: number of submission queues to request
  * @ncqr: number of completion queues to request
  * @quirks: quirks to apply
+ * @cq_poll: completion queue wait policy (see &struct nvme_cq_poll_opts)
+ * @reattach: skip the controller reset in nvme_init() if the controller is
+ *            found disabled and healthy (see nvme_init())
+ * @numa_policy: memory placement policy (see &enum nvme_numa_policy)
+ * @numa_node: numa node used with ``NVME_NUMA_NODE``
+ * @arb: command arbitration (see &struct nvme_arb_opts)
+ * @hmb_max: maximum size in bytes of the Host Memory Buffer set up by
+ *           nvme_init() (``0`` to not set one up; see nvme_hmb_enable())
+ * @power: power state management (see &struct nvme_power_opts)
  *
  * Note: @nsqr and @ncqr are zeroes based values.
  */
@@ -27,13 +108,58 @@ struct nvme_ctrl_opts {
 	int nsqr, ncqr;
 #define NVME_QUIRK_BROKEN_DBBUF (1 << 0)
 	unsigned int quirks;
+	struct nvme_cq_poll_opts cq_poll;
+	bool reattach;
+	int numa_policy;
+	int numa_node;
+	struct nvme_arb_opts arb;
+	size_t hmb_max;
+	struct nvme_power_opts power;
 };
 
 static const struct nvme_ctrl_opts nvme_ctrl_opts_default = {
 	.nsqr = 63, .ncqr = 63,
 	.quirks = 0x0,
+	.cq_poll = {
+		.spin_usec = 50,
+		.adaptive = true,
+		.coalesce = false,
+	},
+	.reattach = false,
+	.numa_policy = NVME_NUMA_LOCAL,
+	.numa_node = -1,
+	.arb = {
+		.wrr = false,
+		.ab = 0x7,
+		.hpw = 0, .mpw = 0, .lpw = 0,
+	},
+	.hmb_max = 256ULL << 20,
+	.power = {
+		.policy = NVME_POWER_DEFAULT,
+		.max_latency_us = 0,
+		.ps = 0,
+	},
 };
 
+struct nvme_ctrl;
+struct nvme_queue_mem;
+struct nvme_mock;
+struct nvme_hmb_chunk;
+struct nvme_psd;
+
+/**
+ * typedef nvme_aer_cb - Asynchronous event handler
+ * @ctrl: Controller reference
+ * @cqe: Completion queue entry of the Asynchronous Event Request command
+ * @opaque: Opaque argument given to nvme_aer_set_handler()
+ *
+ * Invoked by the admin completion demultiplexer (see nvme_admin_process()) when
+ * an Asynchronous Event Request completes. The request has already been
+ * re-armed; the handler may issue admin commands, e.g., to read the log page
+ * that unmasks the event. @cqe is only valid for the duration of the call.
+ */
+typedef void (*nvme_aer_cb)(struct nvme_ctrl *ctrl, struct nvme_cqe *cqe, void *opaque);
+
 /**
  * struct nvme_ctrl - NVMe Controller
  * @sq: submission queues
@@ -59,8 +185,27 @@ struct nvme_ctrl {
 	struct {
 		struct nvme_sq *sq;
 		struct nvme_cq *cq;
+
+		/* private: asynchronous event handler (see nvme_aer_set_handler()) */
+		nvme_aer_cb aer_cb;
+		void *aer_opaque;
 	} adminq;
 
+	/**
+	 * @reg: Immutable controller registers, read once when the controller is
+	 * opened. ``CMBSZ`` and ``CMBLOC`` are updated by nvme_cmb_init() if the
+	 * controller requires them to be explicitly enabled (``CAP.CMBS``).
+	 */
+	struct {
+		uint64_t cap;
+		uint32_t vs;
+		uint32_t cmbloc, cmbsz;
+		uint32_t pmrcap;
+
+		/* private: doorbell stride in bytes (``4 << CAP.DSTRD``) */
+		uint32_t dbstride;
+	} reg;
+
 	/**
 	 * @doorbells: mapped doorbell registers
 	 */
@@ -79,6 +224,88 @@ struct nvme_ctrl {
 	 */
 	struct nvme_ctrl_opts opts;
 
+	/**
+	 * @cmb: Controller Memory Buffer (see nvme_cmb_init())
+	 */
+	struct {
+		void *vaddr;
+		uint64_t iova;
+		size_t len;
+		uint64_t ofst;
+		int bir;
+
+		/* private: */
+		uint32_t sz;
+		bool p2p;
+
+		struct iova_allocator *alloc;
+		struct iommu_iova_range range;
+	} cmb;
+
+	/**
+	 * @pmr: Persistent Memory Region (see nvme_pmr_enable())
+	 */
+	struct {
+		void *vaddr;
+		size_t len;
+		int bir;
+
+		/* private: */
+		uint32_t wbm;
+	} pmr;
+
+	/**
+	 * @hmb: Host Memory Buffer (see nvme_hmb_enable())
+	 */
+	struct {
+		size_t len;
+		bool enabled;
+
+		/* private: limits reported by the controller (in bytes) */
+		size_t pre, min, minds;
+		int maxd;
+
+		struct nvme_hmb_chunk *chunks;
+		int nchunks;
+
+		/* descriptor list */
+		void *descs;
+		uint64_t descs_iova;
+	} hmb;
+
+	/* private: power state descriptors (see nvme_get_power_states()) */
+	struct {
+		struct nvme_psd *psds;
+		int npsds;
+		bool apsta;
+	} power;
+
+	/* private: smart / health cache (see nvme_health_enable()) */
+	struct {
+		struct nvme_health_cache *cache;
+
+		/* set by the asynchronous event demultiplexer */
+		bool stale;
+	} health;
+
+	/* private: shared memory statistics segment (see nvme_stats_export()) */
+	struct {
+		void *base;
+		size_t len;
+		int fd;
+		int nqueues;
+	} stats;
+
+	/* private: queue memory regions (see nvme_create_ioqpair()) */
+	struct nvme_queue_mem *qmem;
+
+	/* private: released regions kept mapped (see nvme_queue_mem_recycle()) */
+	struct nvme_queue_mem *qmem_pool;
+	int qmem_recycle;
+
+	/* private: software emulated controller (see nvme_init()) */
+	struct nvme_mock *mock;
+
 	/**
 	 * @config: cached run-time controller configuration
 	 */
@@ -86,8 +313,70 @@ struct nvme_ctrl {
 		int nsqa, ncqa;
 		int mqes;
 		int mps;
+		uint32_t sgls;
+
+		/* maximum data transfer size in bytes (0 if not limited) */
+		size_t mdts;
+
+		/* log page attributes */
+		uint8_t lpa;
+
+		/* optional nvm commands and fused operations supported */
+		uint16_t oncs, fuses;
+
+		/* atomic compare and write unit in logical blocks */
+		uint32_t acwu;
+
+		/* write zeroes and verify size limits in bytes (0 if limited by mdts) */
+		size_t wzsl, vsl;
+
+		/* dataset management range, range size and size limits (0 if not limited) */
+		int dmrl;
+		uint32_t dmrsl;
+		uint64_t dmsl;
+
+		/* weighted round robin arbitration enabled (see nvme_enable()) */
+		bool wrr;
 	} config;
 
+	/**
+	 * @ns: namespace cache indexed by nsid - 1 (see nvme_ns_get())
+	 */
+	struct nvme_ns *ns;
+
+	/**
+	 * @nns: number of entries in @ns
+	 */
+	int nns;
+
+	/* private: registered buffers (see nvme_register_buffers()) */
+	struct {
+		struct nvme_fixed_buf *bufs;
+		int nbufs;
+
+		/* prp lists of all buffers */
+		void *vaddr;
+		uint64_t iova;
+		size_t len;
+	} fixed;
+
+	/* private: pre-mapped bounce buffers for small nvme_sync() payloads */
+	struct {
+		void *vaddr;
+		uint64_t iova;
+
+		/* bitmap of free slots */
+		uint32_t free;
+	} bounce;
+
+	/* private: preferred numa node of library allocated memory (or -1) */
+	struct {
+		int node;
+
+		/* per-queue overrides; indexed by qid */
+		int *qnodes;
+	} numa;
+
 	/* private: internal */
 	unsigned long flags;
 };
@@ -103,10 +392,46 @@ struct nvme_ctrl {
  *
  * See &struct nvme_ctrl_opts for configurable options.
  *
+ * The controller is reset unless &struct nvme_ctrl_opts.reattach is set and
+ * the controller is already disabled (``CC.EN`` and ``CSTS.RDY`` cleared) with
+ * no fatal status, as is usually the case when a process restarts and vfio-pci
+ * has reset the function on release. A controller that is still enabled is
+ * always reset: the previous owner's queues live in memory that is no longer
+ * mapped for DMA, and the admin queue can only be replaced while disabled.
+ *
+ * If @bdf is ``"mock"``, or ``"mock:"`` followed by colon separated
+ * ``key=value`` options, a software emulated controller is initialized instead,
+ * for benchmarking the library without hardware. A thread of its own polls the
+ * doorbells (or the shadow doorbells, if configured) and posts completions;
+ * I/O commands are checked, but no data is transferred. The controller does not
+ * interrupt, and I/O virtual addresses are process virtual addresses. The
+ * options are ``latency_usec`` (completion latency of I/O commands),
+ * ``iops`` (maximum I/O completions per second), ``nsze`` (size of namespace 1
+ * in logical blocks) and ``lbads`` (log2 of the logical block size).
+ *
  * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
  */
 int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts);
 
+/**
+ * nvme_init_many - Initialize a number of controllers concurrently
+ * @ctrls: Array of @n controllers to initialize
+ * @bdfs: Array of @n PCI device identifiers ("bus:device:function")
+ * @n: Number of controllers
+ * @opts: Controller configuration options (applied to all controllers)
+ *
+ * Like calling nvme_init() for each controller, but with the time of the
+ * slowest controller instead of the sum. The devices are opened and their
+ * resets issued one after the other, then the resets are waited for and the
+ * remaining initialization of each controller runs on a thread of its own.
+ *
+ * Return: ``0`` on success. If any controller fails to initialize, all the
+ * controllers that were opened are closed again, and ``-1`` is returned with
+ * ``errno`` set according to the first failure.
+ */
+int nvme_init_many(struct nvme_ctrl *ctrls, const char * const *bdfs, int n,
+		   const struct nvme_ctrl_opts *opts);
+
 /**
  * nvme_close - Close a controller
  * @ctrl: Controller to close
@@ -126,6 +451,40 @@ void nvme_close(struct nvme_ctrl *ctrl);
  */
 int nvme_reset(struct nvme_ctrl *ctrl);
 
+/**
+ * enum nvme_reset_type - Reset type
+ * @NVME_RESET_AUTO: Use the cheapest reset that works (see
+ *                   nvme_reset_escalate())
+ * @NVME_RESET_CONTROLLER: Controller reset (clearing CC.EN)
+ * @NVME_RESET_FUNCTION: PCI function level reset (see vfio_pci_reset())
+ * @NVME_RESET_SUBSYSTEM: NVM Subsystem Reset (requires CAP.NSSRS); this also
+ *                        resets any other controllers in the subsystem
+ */
+enum nvme_reset_type {
+	NVME_RESET_AUTO,
+	NVME_RESET_CONTROLLER,
+	NVME_RESET_FUNCTION,
+	NVME_RESET_SUBSYSTEM,
+};
+
+/**
+ * nvme_reset_escalate - Reset controller, escalating as needed
+ * @ctrl: Controller to reset
+ * @type: See &enum nvme_reset_type
+ *
+ * Perform the reset given by @type and wait for the controller to be disabled
+ * (CSTS.RDY cleared). With ``NVME_RESET_AUTO``, try a controller reset if the
+ * controller registers respond, then a function level reset if supported, and
+ * finally an NVM Subsystem Reset if supported; readiness is polled with
+ * bounded backoff after each. The controller must be configured and enabled
+ * again afterwards (see nvme_recover(), which uses ``NVME_RESET_AUTO``).
+ *
+ * Return: On success, returns the &enum nvme_reset_type of the reset
+ * performed. On error, returns ``-1`` and sets ``errno`` (``ENODEV`` if no
+ * reset brought the controller back).
+ */
+int nvme_reset_escalate(struct nvme_ctrl *ctrl, enum nvme_reset_type type);
+
 /**
  * nvme_enable - Enable controller
  * @ctrl: Controller to enable
@@ -136,6 +495,61 @@ int nvme_reset(struct nvme_ctrl *ctrl);
  */
 int nvme_enable(struct nvme_ctrl *ctrl);
 
+/**
+ * enum nvme_recover_policy - What to do with outstanding commands on recovery
+ * @NVME_RECOVER_FAIL: Complete outstanding commands with an error
+ * @NVME_RECOVER_RESUBMIT: Resubmit outstanding commands to the re-created
+ *                         queues (where possible)
+ */
+enum nvme_recover_policy {
+	NVME_RECOVER_FAIL,
+	NVME_RECOVER_RESUBMIT,
+};
+
+/**
+ * nvme_recover - Reset the controller and re-create its queues
+ * @ctrl: Controller to recover
+ * @policy: See &enum nvme_recover_policy
+ *
+ * Recover from a controller fatal status (CSTS.CFS) or an otherwise stuck
+ * controller without tearing down the library state. Completions already
+ * posted are processed first. The commands still outstanding on each I/O
+ * submission queue are then captured, the controller is reset (escalating to a
+ * function level or subsystem reset if needed, see nvme_reset_escalate()) and
+ * enabled, the controller memory space is enabled again (if the controller
+ * memory buffer was initialized), and the I/O queues are re-created with the
+ * same ring memory and I/O virtual addresses, such that nothing is remapped
+ * and request trackers, PRP list pages and data buffers remain valid.
+ *
+ * With @policy ``NVME_RECOVER_RESUBMIT``, captured commands are posted again to
+ * their (re-created) submission queue; their deadlines are armed again if
+ * timeouts are enabled. Commands whose submission queue entry was overwritten
+ * after the controller fetched it, commands that timed out and, with @policy
+ * ``NVME_RECOVER_FAIL``, all captured commands are completed with a Command
+ * Aborted due to SQ Deletion status, as with nvme_cq_process(). If recovery
+ * fails, all captured commands are failed and the controller should be closed.
+ *
+ * Commands posted without a completion callback (nvme_rq_post(),
+ * nvme_rq_exec()) are captured if their request tracker is neither free nor
+ * cached; with @policy ``NVME_RECOVER_RESUBMIT``, they are posted again if
+ * intact, such that polling for the completion (e.g., nvme_rq_wait()) finds
+ * it. Otherwise, there is no callback to fail them to, and they are logged and
+ * left to their owner.
+ *
+ * The controller must be quiescent; no other thread may submit to it during
+ * the recovery. Admin commands are not recovered; outstanding ones (e.g.,
+ * waited for by nvme_admin() or a &struct nvme_future) are completed with a
+ * Command Aborted due to SQ Deletion status once the controller is reset.
+ * Asynchronous Event Requests are discarded and must be issued again with
+ * nvme_aer(). Interrupt vector configuration (e.g., coalescing) set with Set
+ * Features is not restored.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENODEV`` if the device cannot be reset, ``ENOSPC`` if the
+ * controller no longer allocates as many queues).
+ */
+int nvme_recover(struct nvme_ctrl *ctrl, enum nvme_recover_policy policy);
+
 /**
  * nvme_create_iocq - Create an I/O Completion Queue
  * @ctrl: Controller reference
@@ -146,7 +560,9 @@ int nvme_enable(struct nvme_ctrl *ctrl);
  * Create an I/O Completion Queue on @ctrl with identifier @qid and size @qsize.
  * Set @vector to -1 to disable interrupts. If you associate an interrupt
  * vector, you need to use vfio_set_irq() to associate the vector with an
- * eventfd.
+ * eventfd. A vector that is already wired to the eventfd of another completion
+ * queue is not shared; @qid gets no eventfd (see nvme_cq_get_fd()) and is
+ * polled.
  *
  * **Note** that one slot in the queue is reserved for the full queue condition.
  * So, if a queue command depth of ``N`` is required, qsize should be ``N + 1``.
@@ -168,6 +584,38 @@ int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector);
  */
 int nvme_delete_iocq(struct nvme_ctrl *ctrl, int qid);
 
+/**
+ * enum nvme_create_iosq_flags - I/O Submission Queue creation flags
+ * @NVME_IOSQ_F_CMB: Place the queue in the Controller Memory Buffer. The
+ *                   buffer is mapped write-combining (if possible) and entries
+ *                   are posted with streaming stores. Requires that the
+ *                   controller supports submission queues in the CMB
+ *                   (``CMBSZ.SQS``).
+ * @NVME_IOSQ_F_QPRIO_URGENT: Urgent priority class; always serviced before the
+ *                            weighted classes
+ * @NVME_IOSQ_F_QPRIO_HIGH: High priority class
+ * @NVME_IOSQ_F_QPRIO_MEDIUM: Medium priority class (the default)
+ * @NVME_IOSQ_F_QPRIO_LOW: Low priority class
+ * @NVME_IOSQ_F_SHARED: Back the rings and prp list pages of the queue pair with
+ *                      a memfd, such that the queue pair can be leased to
+ *                      another process (see nvme_export_ioqpair()). Only
+ *                      supported by nvme_create_ioqpair() and not together
+ *                      with @NVME_IOSQ_F_CMB.
+ *
+ * The priority classes are mutually exclusive and only take effect if weighted
+ * round robin arbitration is enabled (see &struct nvme_arb_opts).
+ */
+enum nvme_create_iosq_flags {
+	NVME_IOSQ_F_CMB			= 1 << 0,
+	NVME_IOSQ_F_QPRIO_URGENT	= 1 << 1,
+	NVME_IOSQ_F_QPRIO_HIGH		= 2 << 1,
+	NVME_IOSQ_F_QPRIO_MEDIUM	= 3 << 1,
+	NVME_IOSQ_F_QPRIO_LOW		= 4 << 1,
+	NVME_IOSQ_F_SHARED		= 1 << 4,
+};
+
+#define NVME_IOSQ_F_QPRIO_MASK (7 << 1)
+
 /**
  * nvme_create_iosq - Create an I/O Submission Queue
  * @ctrl: Controller reference
@@ -180,6 +628,11 @@ int nvme_delete_iocq(struct nvme_ctrl *ctrl, int qid);
  * @qsize and associated with I/O Completion Queue @cq. @flags may be used to
  * modify the behavior (see &enum nvme_create_iosq_flags).
  *
+ * If the maximum data transfer size of the controller requires more than a
+ * single prp list page per command, a pool of extra list pages is allocated
+ * for the queue, sized for a number of maximum sized transfers to be in flight
+ * at a time.
+ *
  * **Note** that one slot in the queue is reserved for the full queue condition.
  * So, if a queue command depth of ``N`` is required, qsize should be ``N + 1``.
  *
@@ -189,6 +642,29 @@ int nvme_delete_iocq(struct nvme_ctrl *ctrl, int qid);
 int nvme_create_iosq(struct nvme_ctrl *ctrl, int qid, int qsize,
 		     struct nvme_cq *cq, unsigned long flags);
 
+/**
+ * nvme_create_iosq_buf - Create an I/O Submission Queue with data buffers
+ * @ctrl: Controller reference
+ * @qid: Queue identifier
+ * @qsize: Queue size
+ * @cq: Associated I/O Completion Queue
+ * @flags: See &enum nvme_create_iosq_flags
+ * @buf_size: Size of the data buffer attached to each request tracker
+ *
+ * Like nvme_create_iosq(), but also allocate a pre-mapped data buffer of
+ * @buf_size bytes (rounded up to the controller page size) for each request
+ * tracker of the queue. The buffers are carved out of a single allocation
+ * from iommu_alloc() and are released when the queue is deleted. Use
+ * nvme_rq_map_own_buf() to map the buffer into a command.
+ *
+ * If @buf_size is zero, this is equivalent to nvme_create_iosq().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_create_iosq_buf(struct nvme_ctrl *ctrl, int qid, int qsize,
+			 struct nvme_cq *cq, unsigned long flags, size_t buf_size);
+
 /**
  * nvme_delete_iosq - Delete an I/O Submission Queue
  * @ctrl: See &struct nvme_ctrl
@@ -213,6 +689,13 @@ int nvme_delete_iosq(struct nvme_ctrl *ctrl, int qid);
  * queue identifier, queue size. @flags may be used to modify the behavior of
  * the submission queu (see &enum nvme_create_iosq_flags).
  *
+ * The completion queue ring, the submission queue ring and the prp list pages
+ * of the submission queue are packed (aligned to the controller page size) in a
+ * single IOMMU mapping, which is released (or kept for reuse, see
+ * nvme_queue_mem_recycle()) when both queues are deleted. If the mapping cannot
+ * be set up, the queues are mapped individually (unless @flags has
+ * ``NVME_IOSQ_F_SHARED``, in which case creating the queue pair fails).
+ *
  * **Note** that one slot in the queue is reserved for the full queue condition.
  * So, if a queue command depth of ``N`` is required, qsize should be ``N + 1``.
  *
@@ -234,4 +717,82 @@ int nvme_create_ioqpair(struct nvme_ctrl *ctrl, int qid, int qsize, int vector,
  */
 int nvme_delete_ioqpair(struct nvme_ctrl *ctrl, int qid);
 
+/**
+ * nvme_queue_mem_recycle - Keep the memory of deleted queues for reuse
+ * @ctrl: See &struct nvme_ctrl
+ * @enable: Whether to keep released queue memory regions
+ *
+ * If @enable is ``true``, a queue memory region (see nvme_create_ioqpair()) is
+ * kept mapped when the last queue carved from it is deleted, and queue pairs
+ * created later on the same numa node are carved from it instead of setting up
+ * a new IOMMU mapping. Queues mapped individually are not kept.
+ *
+ * Calls nest, such that independent users (e.g. &struct nvme_qmgr) may enable
+ * recycling: each call with @enable ``true`` must be balanced by a call with
+ * @enable ``false``, and the regions kept so far are released when the last
+ * user disables recycling. Regions kept are released by nvme_close().
+ */
+void nvme_queue_mem_recycle(struct nvme_ctrl *ctrl, bool enable);
+
+/**
+ * struct nvme_ioqpair_info - I/O queue pair interrupt and affinity information
+ * @qid: Queue identifier
+ * @vector: MSI-X vector associated with the completion queue
+ * @efd: Interrupt eventfd (see nvme_cq_get_fd()); ``-1`` if the vector could
+ *       not be wired to an eventfd
+ * @cpu: Suggested cpu to process the queue on (from the device
+ *       ``local_cpulist``); ``-1`` if unknown
+ * @numa_node: Numa node of the device; ``-1`` if unknown
+ */
+struct nvme_ioqpair_info {
+	int qid;
+	int vector;
+	int efd;
+	int cpu;
+	int numa_node;
+};
+
+/**
+ * nvme_set_queue_numa_node - Set the preferred numa node of a queue
+ * @ctrl: Controller reference
+ * @qid: Queue identifier
+ * @node: numa node; ``-1`` for no preference
+ *
+ * Override the memory placement policy of the controller (see
+ * &enum nvme_numa_policy) for the rings, prp list pages and data buffers of the
+ * queues with identifier @qid that are created after this call. Queues placed
+ * on another node than the controller default do not share the queue memory
+ * region set up by nvme_create_ioqpairs().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_set_queue_numa_node(struct nvme_ctrl *ctrl, int qid, int node);
+
+/**
+ * nvme_create_ioqpairs - Create I/O queue pairs with one vector per queue
+ * @ctrl: Controller reference
+ * @nqueues: Number of queue pairs to create
+ * @qsize: Queue size
+ * @flags: See &enum nvme_create_iosq_flags
+ * @info: Array of @nqueues entries to fill (see &struct nvme_ioqpair_info)
+ *
+ * Create @nqueues I/O queue pairs with identifiers ``1`` through @nqueues. The
+ * completion queue of queue pair ``N`` is assigned MSI-X vector ``N`` (vector
+ * ``0`` is left for the admin queue). All vectors are (re)initialized by this
+ * function. The local cpus of the device are assigned round-robin to the
+ * queues as a suggestion for where to process them.
+ *
+ * Unlike repeated calls to nvme_create_ioqpair(), the queue rings and prp list
+ * pages of all queue pairs are allocated from a single (hugepage backed) IOMMU
+ * mapping, which is released when the last of the queues is deleted, and the
+ * create commands are kept in flight together on the admin queue. For the same
+ * reason, ``NVME_IOSQ_F_SHARED`` is not supported.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``; queue pairs created before the error are deleted again.
+ */
+int nvme_create_ioqpairs(struct nvme_ctrl *ctrl, int nqueues, int qsize, unsigned long flags,
+			 struct nvme_ioqpair_info *info);
+
 #endif /* LIBVFN_NVME_CTRL_H */
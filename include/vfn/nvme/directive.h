@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_DIRECTIVE_H
+#define LIBVFN_NVME_DIRECTIVE_H
+
+/**
+ * DOC: Directives and Flexible Data Placement
+ *
+ * Directives let the host tell the controller which writes belong together,
+ * such that data with a similar lifetime is placed in the same erase units and
+ * the write amplification caused by garbage collection is reduced. With the
+ * Streams directive, writes are tagged with a stream identifier allocated with
+ * nvme_streams_alloc(). With Flexible Data Placement (FDP), which is enabled
+ * per endurance group (see nvme_fdp_get_config()), writes are tagged with a
+ * placement identifier that selects one of the reclaim unit handles reported
+ * by nvme_fdp_get_ruhs().
+ *
+ * In both cases, the tag goes into the Directive Type and Directive Specific
+ * fields of write commands; see nvme_rw_set_directive() and
+ * &vfn_bdev_io.dtype.
+ */
+
+/**
+ * enum nvme_dir_type - Directive types
+ * @NVME_DIR_TYPE_IDENTIFY: Identify directive (also means "no directive" in
+ *                          read and write commands)
+ * @NVME_DIR_TYPE_STREAMS: Streams directive
+ * @NVME_DIR_TYPE_FDP: Data placement directive (Flexible Data Placement)
+ */
+enum nvme_dir_type {
+	NVME_DIR_TYPE_IDENTIFY	= 0x0,
+	NVME_DIR_TYPE_STREAMS	= 0x1,
+	NVME_DIR_TYPE_FDP	= 0x2,
+};
+
+/**
+ * struct nvme_dir_info - Directive support of a namespace
+ * @supported: bitmap of supported directive types (bit ``i`` is directive type
+ *             ``i``; see &enum nvme_dir_type)
+ * @enabled: bitmap of enabled directive types
+ * @persistent: bitmap of directive types that persist across controller level
+ *              resets
+ */
+struct nvme_dir_info {
+	uint32_t supported;
+	uint32_t enabled;
+	uint32_t persistent;
+};
+
+/**
+ * struct nvme_streams_params - Streams directive parameters
+ * @msl: maximum number of streams supported by the NVM subsystem
+ * @nssa: number of streams available to the NVM subsystem
+ * @nsso: number of streams open in the NVM subsystem
+ * @sws: stream write size in logical blocks
+ * @sgs: stream granularity size in units of @sws
+ * @nsa: number of streams allocated to the namespace
+ * @nso: number of streams open in the namespace
+ */
+struct nvme_streams_params {
+	uint16_t msl;
+	uint16_t nssa;
+	uint16_t nsso;
+	uint32_t sws;
+	uint16_t sgs;
+	uint16_t nsa;
+	uint16_t nso;
+};
+
+/**
+ * struct nvme_fdp_config - Flexible Data Placement configuration
+ * @enabled: FDP is enabled in the endurance group
+ * @index: index of the FDP configuration in use
+ */
+struct nvme_fdp_config {
+	bool enabled;
+	uint8_t index;
+};
+
+/**
+ * struct nvme_ruhs - Reclaim unit handle status
+ * @pid: placement identifier (the directive specific value of writes to the
+ *       reclaim unit handle)
+ * @ruhid: reclaim unit handle identifier
+ * @earutr: estimated active reclaim unit time remaining in seconds
+ * @ruamw: reclaim unit available media writes in logical blocks
+ */
+struct nvme_ruhs {
+	uint16_t pid;
+	uint16_t ruhid;
+	uint32_t earutr;
+	uint64_t ruamw;
+};
+
+/**
+ * nvme_dir_send - Submit a Directive Send command
+ * @ctrl: &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @dtype: Directive type (see &enum nvme_dir_type)
+ * @doper: Directive operation
+ * @dspec: Directive specific value
+ * @cdw12: Directive operation specific command dword
+ * @buf: Command payload (may be ``NULL``)
+ * @len: Command payload length (a multiple of four)
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_dir_send(struct nvme_ctrl *ctrl, uint32_t nsid, uint8_t dtype, uint8_t doper,
+		  uint16_t dspec, uint32_t cdw12, void *buf, size_t len);
+
+/**
+ * nvme_dir_recv - Submit a Directive Receive command
+ * @ctrl: &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @dtype: Directive type (see &enum nvme_dir_type)
+ * @doper: Directive operation
+ * @dspec: Directive specific value
+ * @cdw12: Directive operation specific command dword
+ * @buf: Command payload (may be ``NULL``)
+ * @len: Command payload length (a multiple of four)
+ * @cqe: Completion queue entry to fill (may be ``NULL``)
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_dir_recv(struct nvme_ctrl *ctrl, uint32_t nsid, uint8_t dtype, uint8_t doper,
+		  uint16_t dspec, uint32_t cdw12, void *buf, size_t len, struct nvme_cqe *cqe);
+
+/**
+ * nvme_dir_identify - Get the directive support of a namespace
+ * @ctrl: &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @info: output parameter for the directive support
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_dir_identify(struct nvme_ctrl *ctrl, uint32_t nsid, struct nvme_dir_info *info);
+
+/**
+ * nvme_dir_enable - Enable or disable a directive type for a namespace
+ * @ctrl: &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @dtype: Directive type (see &enum nvme_dir_type)
+ * @enable: whether to enable or disable the directive type
+ *
+ * The data placement directive cannot be enabled this way; it is enabled
+ * along with FDP in the endurance group.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_dir_enable(struct nvme_ctrl *ctrl, uint32_t nsid, uint8_t dtype, bool enable);
+
+/**
+ * nvme_streams_get_params - Get the Streams directive parameters
+ * @ctrl: &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @params: output parameter for the parameters
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_streams_get_params(struct nvme_ctrl *ctrl, uint32_t nsid,
+			    struct nvme_streams_params *params);
+
+/**
+ * nvme_streams_alloc - Allocate streams to a namespace
+ * @ctrl: &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ * @nsr: Number of streams requested
+ *
+ * Allocate streams for the exclusive use of the namespace. Stream identifiers
+ * ``1`` through the returned number of streams may then be used as the
+ * directive specific value of writes.
+ *
+ * Return: On success, returns the number of streams allocated (which may be
+ * less than @nsr). On error, returns ``-1`` and sets ``errno``.
+ */
+int nvme_streams_alloc(struct nvme_ctrl *ctrl, uint32_t nsid, uint16_t nsr);
+
+/**
+ * nvme_fdp_get_config - Get the Flexible Data Placement configuration
+ * @ctrl: &struct nvme_ctrl
+ * @endgid: Endurance group identifier (see &nvme_ns.endgid)
+ * @config: output parameter for the configuration
+ *
+ * Get the Flexible Data Placement feature (FID ``0x1D``) of the endurance
+ * group.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_fdp_get_config(struct nvme_ctrl *ctrl, uint16_t endgid, struct nvme_fdp_config *config);
+
+/**
+ * nvme_fdp_get_ruhs - Get the reclaim unit handle status of a namespace
+ * @ctrl: &struct nvme_ctrl
+ * @sq: I/O submission queue to submit the I/O Management Receive command to
+ * @nsid: Namespace identifier
+ * @ruhs: output parameter for the reclaim unit handle status descriptors
+ * @max: maximum number of descriptors to store in @ruhs
+ *
+ * Discover the reclaim unit handles that the namespace may write to. The
+ * placement identifiers in @ruhs are valid directive specific values of
+ * writes with the data placement directive.
+ *
+ * Return: On success, returns the number of descriptors stored in @ruhs. On
+ * error, returns ``-1`` and sets ``errno``.
+ */
+int nvme_fdp_get_ruhs(struct nvme_ctrl *ctrl, struct nvme_sq *sq, uint32_t nsid,
+		      struct nvme_ruhs *ruhs, int max);
+
+#endif /* LIBVFN_NVME_DIRECTIVE_H */
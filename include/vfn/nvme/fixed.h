@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_FIXED_H
+#define LIBVFN_NVME_FIXED_H
+
+/**
+ * DOC: Registered buffers
+ *
+ * Long-lived data buffers may be registered with a controller up front (see
+ * nvme_register_buffers()). They are mapped in the IOMMU once and the prp list
+ * of each buffer is built at registration time. Commands then refer to a
+ * registered buffer by index, offset and length (see nvme_rq_map_fixed()),
+ * which avoids translating the virtual address and building the prp list on
+ * every I/O.
+ */
+
+/**
+ * struct nvme_fixed_buf - Registered buffer
+ * @vaddr: Virtual address of the buffer
+ * @iova: I/O virtual address of the buffer
+ * @len: Length of the buffer
+ */
+struct nvme_fixed_buf {
+	void *vaddr;
+	uint64_t iova;
+	size_t len;
+
+	/* private: */
+
+	/* prp list entries for all pages spanned by the buffer */
+	leint64_t *prps;
+	uint64_t prps_iova;
+
+	bool do_unmap;
+};
+
+/**
+ * nvme_register_buffers - Register data buffers with a controller
+ * @ctrl: See &struct nvme_ctrl
+ * @iov: Array of buffers to register
+ * @n: Number of entries in @iov
+ *
+ * Map the buffers in @iov in the IOMMU (unless already mapped) and build their
+ * prp lists. Buffers are referred to by their index in @iov. Only one set of
+ * buffers can be registered at a time.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EBUSY`` if buffers are already registered).
+ */
+int nvme_register_buffers(struct nvme_ctrl *ctrl, const struct iovec *iov, int n);
+
+/**
+ * nvme_unregister_buffers - Unregister data buffers
+ * @ctrl: See &struct nvme_ctrl
+ *
+ * Unmap the buffers registered with nvme_register_buffers() (if they were
+ * mapped by it) and release their prp lists. No commands referring to them may
+ * be in flight. This is done by nvme_close().
+ */
+void nvme_unregister_buffers(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_fixed_buf_get - Get a registered buffer
+ * @ctrl: See &struct nvme_ctrl
+ * @idx: Buffer index
+ *
+ * Return: The registered buffer (see &struct nvme_fixed_buf), or NULL if @idx
+ * is out of range.
+ */
+static inline struct nvme_fixed_buf *nvme_fixed_buf_get(struct nvme_ctrl *ctrl, int idx)
+{
+	if (idx < 0 || idx >= ctrl->fixed.nbufs)
+		return NULL;
+
+	return &ctrl->fixed.bufs[idx];
+}
+
+#endif /* LIBVFN_NVME_FIXED_H */
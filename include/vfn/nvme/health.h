@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_HEALTH_H
+#define LIBVFN_NVME_HEALTH_H
+
+/**
+ * DOC: SMART / health monitoring
+ *
+ * Monitoring agents read the SMART / Health Information log page of every
+ * controller at a high rate. Rather than issuing a Get Log Page command for
+ * each read, the health cache keeps the last copy of the log page in the
+ * controller and refreshes it in the background; readers get a copy from
+ * nvme_health_get() without any admin traffic, from any thread.
+ *
+ * The cache is refreshed by nvme_health_process() once the configured interval
+ * has elapsed, or early when the controller posts a SMART / Health Status
+ * asynchronous event (see nvme_aer()). The log page is read into a buffer that
+ * is mapped once, with a single command in flight.
+ */
+
+/**
+ * struct nvme_health - SMART / health information
+ * @critical_warning: critical warnings for the state of the controller
+ * @temperature: composite temperature in Kelvin
+ * @avail_spare: remaining spare capacity in percent
+ * @spare_thresh: available spare threshold in percent
+ * @percent_used: estimate of the life used in percent (may exceed 100)
+ * @data_units_read: number of 512 byte data units read, in thousands
+ * @data_units_written: number of 512 byte data units written, in thousands
+ * @host_reads: number of read commands completed
+ * @host_writes: number of write commands completed
+ * @ctrl_busy_time: time busy with I/O commands in minutes
+ * @power_cycles: number of power cycles
+ * @power_on_hours: number of power-on hours
+ * @unsafe_shutdowns: number of unsafe shutdowns
+ * @media_errors: number of unrecovered data integrity errors
+ * @num_err_log_entries: number of error information log entries
+ * @updated: time of the refresh in ticks (see get_ticks())
+ *
+ * The 128 bit counters of the log page are truncated to 64 bits.
+ */
+struct nvme_health {
+	uint8_t critical_warning;
+	uint16_t temperature;
+	uint8_t avail_spare;
+	uint8_t spare_thresh;
+	uint8_t percent_used;
+	uint64_t data_units_read;
+	uint64_t data_units_written;
+	uint64_t host_reads;
+	uint64_t host_writes;
+	uint64_t ctrl_busy_time;
+	uint64_t power_cycles;
+	uint64_t power_on_hours;
+	uint64_t unsafe_shutdowns;
+	uint64_t media_errors;
+	uint64_t num_err_log_entries;
+	uint64_t updated;
+};
+
+/**
+ * nvme_health_enable - Set up the SMART / health cache
+ * @ctrl: &struct nvme_ctrl
+ * @interval_us: refresh interval in microseconds (``0`` to refresh only on
+ *               SMART / Health Status asynchronous events)
+ *
+ * Allocate and map the log page buffer and fill the cache with a first read of
+ * the controller wide SMART / Health Information log page. If the cache is
+ * already set up, only change the interval.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_health_enable(struct nvme_ctrl *ctrl, uint64_t interval_us);
+
+/**
+ * nvme_health_disable - Release the SMART / health cache
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Wait for a refresh in flight and release the cache. Must not be called while
+ * other threads may be in nvme_health_get(). Called by nvme_close().
+ */
+void nvme_health_disable(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_health_process - Refresh the SMART / health cache
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Reap the admin completion queue (see nvme_admin_process()), publish the log
+ * page read by a completed refresh and, if the interval has elapsed or the
+ * cache was invalidated by an asynchronous event, submit the next refresh.
+ * Does not block; call it from the loop that otherwise processes admin
+ * completions. Concurrent calls return immediately.
+ *
+ * Return: Returns ``1`` if the cache was updated, ``0`` otherwise. On error
+ * (e.g., if the refresh failed), returns ``-1`` and sets ``errno``; the cache
+ * keeps the last good copy and the refresh is retried after the interval.
+ */
+int nvme_health_process(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_health_get - Get the cached SMART / health information
+ * @ctrl: &struct nvme_ctrl
+ * @health: output parameter for the health information
+ *
+ * Copy the cached health information. Never issues commands and may be called
+ * from any thread; copies are consistent even while the cache is refreshed
+ * concurrently.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if the cache is not set up).
+ */
+int nvme_health_get(struct nvme_ctrl *ctrl, struct nvme_health *health);
+
+#endif /* LIBVFN_NVME_HEALTH_H */
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_HMB_H
+#define LIBVFN_NVME_HMB_H
+
+/**
+ * DOC: Host Memory Buffer
+ *
+ * Controllers without (enough) local DRAM may request a Host Memory Buffer
+ * (HMB); a region of host memory that the controller uses for its own data
+ * structures, such as the logical to physical translation table. Without it,
+ * such controllers typically fall short of their rated random read
+ * performance.
+ *
+ * nvme_init() sets up a buffer of the preferred size reported by the
+ * controller (up to &nvme_ctrl_opts.hmb_max). The buffer is handed back to the
+ * controller, contents retained, when it is recovered (see nvme_recover()) and
+ * disabled and released by nvme_close().
+ */
+
+/**
+ * nvme_hmb_enable - Allocate and enable the Host Memory Buffer
+ * @ctrl: &struct nvme_ctrl
+ * @len: size of the buffer in bytes (or ``0`` for the preferred size)
+ *
+ * Allocate a Host Memory Buffer of @len bytes (clamped to the preferred size
+ * reported by the controller) as a list of hugepage backed chunks mapped in the
+ * iommu context of @ctrl, and enable it with Set Features. If the buffer is
+ * already allocated, but was disabled by a controller reset, it is handed back
+ * to the controller with its contents retained (Memory Return) and @len is
+ * ignored. If the buffer is enabled, this is a no-op.
+ *
+ * On success, ``ctrl->hmb.len`` is the size of the buffer.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOTSUP`` if the controller does not use a host memory buffer
+ * and ``EINVAL`` if @len is less than the minimum size required by the
+ * controller).
+ */
+int nvme_hmb_enable(struct nvme_ctrl *ctrl, size_t len);
+
+/**
+ * nvme_hmb_disable - Disable and release the Host Memory Buffer
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Disable the Host Memory Buffer with Set Features and release the memory.
+ */
+void nvme_hmb_disable(struct nvme_ctrl *ctrl);
+
+#endif /* LIBVFN_NVME_HMB_H */
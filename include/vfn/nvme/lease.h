@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_LEASE_H
+#define LIBVFN_NVME_LEASE_H
+
+/**
+ * DOC: Queue pair leasing
+ *
+ * The process that owns a controller may create I/O queue pairs and lease them
+ * to worker processes, which then drive them directly (e.g., with
+ * nvme_sq_post() and nvme_cq_get_cqe()); the data path involves no IPC.
+ *
+ * A leased queue pair must be created with ``NVME_IOSQ_F_SHARED`` (see
+ * nvme_create_ioqpair()), which backs its rings and prp list pages with a
+ * memfd. nvme_export_ioqpair() sends the memfd, the vfio device file (for the
+ * doorbells) and a description of the queue pair that only holds offsets and
+ * I/O virtual addresses over a unix domain socket. nvme_attach_ioqpair() maps
+ * them in the worker and sets up queue structures and request trackers of its
+ * own, so no pointers are shared between the processes.
+ *
+ * Data buffers must be mapped in the iommu context of the controller, for
+ * instance through a context shared with iommu_export_context().
+ */
+
+/**
+ * struct nvme_qpair_lease - Leased I/O queue pair
+ * @ctrl: Controller stand-in; holds the controller configuration and the
+ *        namespace cache of the exporting process and may be given to helpers
+ *        such as nvme_rq_map_prp() and vfn_bdev_open()
+ * @qid: Queue identifier
+ * @sq: Submission queue (see &struct nvme_sq)
+ * @cq: Completion queue (see &struct nvme_cq)
+ */
+struct nvme_qpair_lease {
+	struct nvme_ctrl ctrl;
+
+	int qid;
+	struct nvme_sq *sq;
+	struct nvme_cq *cq;
+
+	/* private: */
+	void *mem;
+	size_t len;
+};
+
+/**
+ * nvme_export_ioqpair - Lease an I/O queue pair to another process
+ * @ctrl: See &struct nvme_ctrl
+ * @qid: Queue identifier of a queue pair created with ``NVME_IOSQ_F_SHARED``
+ * @sockfd: Connected unix domain socket
+ *
+ * Send the queue pair @qid over @sockfd (using ``SCM_RIGHTS``), to be picked
+ * up by nvme_attach_ioqpair() in the peer. The queue pair must be idle and
+ * cannot be used by the calling process afterwards; its request trackers are
+ * withdrawn (nvme_rq_acquire() fails with ``EBUSY``) until it is deleted with
+ * nvme_delete_ioqpair(), which should only be done after the peer detached.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if the queue pair does not exist or was not created
+ * with ``NVME_IOSQ_F_SHARED``, ``EBUSY`` if commands are in flight,
+ * ``ENOTSUP`` if the controller is emulated, uses shadow doorbells or the
+ * queue has data buffers attached).
+ */
+int nvme_export_ioqpair(struct nvme_ctrl *ctrl, int qid, int sockfd);
+
+/**
+ * nvme_attach_ioqpair - Take over an I/O queue pair leased by another process
+ * @lease: &struct nvme_qpair_lease to initialize
+ * @ctx: iommu context that data buffers are mapped in (see
+ *       iommu_import_context()), or NULL
+ * @sockfd: Connected unix domain socket
+ *
+ * Receive a queue pair sent by nvme_export_ioqpair() from @sockfd and map its
+ * rings and doorbells. The queues continue where the exporting process left
+ * them. If the completion queue is interrupt driven, the eventfd is received
+ * as well (see nvme_cq_wait()).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_attach_ioqpair(struct nvme_qpair_lease *lease, struct iommu_ctx *ctx, int sockfd);
+
+/**
+ * nvme_detach_ioqpair - Give up a leased I/O queue pair
+ * @lease: &struct nvme_qpair_lease
+ *
+ * Unmap the queue pair. Commands still in flight are abandoned.
+ */
+void nvme_detach_ioqpair(struct nvme_qpair_lease *lease);
+
+#endif /* LIBVFN_NVME_LEASE_H */
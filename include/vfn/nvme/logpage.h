@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_LOGPAGE_H
+#define LIBVFN_NVME_LOGPAGE_H
+
+/**
+ * DOC: Streaming log page reads
+ *
+ * Some log pages (e.g., the Telemetry Host-Initiated and Controller-Initiated
+ * logs) are far larger than what a single command can transfer. A &struct
+ * nvme_log_reader reads such a log in chunks, using the Log Page Offset to keep
+ * several Get Log Page commands in flight on the admin queue. Chunks are read
+ * into a ring of buffers that is allocated and mapped once, and are handed to a
+ * callback in log order as they complete. The reader is driven by
+ * nvme_log_reader_poll(), which never blocks, so collecting a log may be
+ * interleaved with other work on the same thread.
+ */
+
+/**
+ * nvme_log_cb - Log chunk callback
+ * @opaque: Opaque argument given to nvme_log_reader_start()
+ * @offset: Offset of the chunk in the log page in bytes
+ * @buf: Chunk data
+ * @len: Length of the chunk in bytes
+ *
+ * Chunks are delivered in log order. @buf is only valid until the callback
+ * returns; the buffer is reused for a later chunk afterwards.
+ *
+ * Return: ``0`` to continue reading the log, or non-zero to stop.
+ */
+typedef int (*nvme_log_cb)(void *opaque, uint64_t offset, void *buf, size_t len);
+
+struct nvme_log_slot;
+
+/**
+ * struct nvme_log_reader - Streaming log page reader
+ *
+ * See nvme_log_reader_init().
+ */
+struct nvme_log_reader {
+	/* private: */
+	struct nvme_ctrl *ctrl;
+
+	/* buffer ring; one slot per command in flight */
+	void *vaddr;
+	size_t len, chunk;
+	struct nvme_log_slot *slots;
+	int depth;
+
+	/* command prototype and progress of the current read */
+	union nvme_cmd cmd;
+	uint64_t next, end;
+	int head, inflight;
+	int err;
+
+	nvme_log_cb cb;
+	void *opaque;
+};
+
+/**
+ * nvme_log_reader_init - Initialize a streaming log page reader
+ * @reader: &struct nvme_log_reader
+ * @ctrl: &struct nvme_ctrl
+ * @chunk: Size of each Get Log Page command in bytes (a multiple of four that
+ *         does not exceed the maximum data transfer size of @ctrl)
+ * @depth: Maximum number of commands in flight
+ *
+ * Allocate and map a ring of @depth buffers of @chunk bytes each. The reader
+ * may be used for any number of reads (see nvme_log_reader_start()), one at a
+ * time.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_log_reader_init(struct nvme_log_reader *reader, struct nvme_ctrl *ctrl, size_t chunk,
+			 int depth);
+
+/**
+ * nvme_log_reader_fini - Release a streaming log page reader
+ * @reader: &struct nvme_log_reader
+ *
+ * Wait for any commands still in flight and release the buffer ring.
+ */
+void nvme_log_reader_fini(struct nvme_log_reader *reader);
+
+/**
+ * nvme_log_reader_start - Start reading a log page
+ * @reader: &struct nvme_log_reader
+ * @cmd: Get Log Page command prototype (&union nvme_cmd; the log page
+ *       identifier, log specific fields and namespace identifier are used)
+ * @offset: Offset in the log page in bytes to start reading at (a multiple of
+ *          four)
+ * @len: Number of bytes to read (a multiple of four)
+ * @cb: Chunk callback (see &nvme_log_cb)
+ * @opaque: Opaque argument passed to @cb
+ *
+ * Submit the first commands of the read; the rest are submitted by
+ * nvme_log_reader_poll() as chunks are delivered. Reading at an offset or
+ * reading more than a single chunk requires the controller to support extended
+ * data for Get Log Page.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EBUSY`` if a read is in progress).
+ */
+int nvme_log_reader_start(struct nvme_log_reader *reader, union nvme_cmd *cmd, uint64_t offset,
+			  uint64_t len, nvme_log_cb cb, void *opaque);
+
+/**
+ * nvme_log_reader_poll - Make progress on a log page read
+ * @reader: &struct nvme_log_reader
+ *
+ * Reap the admin completion queue (see nvme_admin_process()), deliver the
+ * chunks that are complete and in order to the callback and submit commands
+ * for the following chunks into the freed buffers. Does not block.
+ *
+ * Once an error occurs (or the callback asks to stop), no more commands are
+ * submitted and the read ends when the commands in flight have completed.
+ *
+ * Return: Returns ``1`` if the read is complete, ``0`` if it is in progress.
+ * On error, returns ``-1`` when all commands in flight have completed and sets
+ * ``errno`` (``ECANCELED`` if the callback stopped the read).
+ */
+int nvme_log_reader_poll(struct nvme_log_reader *reader);
+
+/**
+ * nvme_log_read - Read a log page in chunks
+ * @reader: &struct nvme_log_reader
+ * @cmd: Get Log Page command prototype (see nvme_log_reader_start())
+ * @offset: Offset in the log page in bytes to start reading at
+ * @len: Number of bytes to read
+ * @cb: Chunk callback (see &nvme_log_cb)
+ * @opaque: Opaque argument passed to @cb
+ *
+ * Like nvme_log_reader_start(), but poll the reader until the read is
+ * complete.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_log_read(struct nvme_log_reader *reader, union nvme_cmd *cmd, uint64_t offset,
+		  uint64_t len, nvme_log_cb cb, void *opaque);
+
+#endif /* LIBVFN_NVME_LOGPAGE_H */
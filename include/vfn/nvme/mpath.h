@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_MPATH_H
+#define LIBVFN_NVME_MPATH_H
+
+/**
+ * DOC: Multipath
+ *
+ * A &struct vfn_mpath binds a namespace shared by several controllers (e.g.,
+ * the ports of a dual ported drive) into one block device. Each path is a
+ * &struct vfn_bdev on one of the controllers. I/Os (see &struct vfn_mpath_io)
+ * are added to a per-thread &struct vfn_mpath_queue with vfn_mpath_add(),
+ * which selects a path according to the policy of the device (see
+ * &enum vfn_mpath_policy) and then behaves like vfn_bdev_add() on the
+ * &struct vfn_bdev_queue of that path (including plugging and merging).
+ *
+ * If an I/O completes with a path related status, is aborted due to submission
+ * queue deletion (e.g., by nvme_recover()) or times out (see
+ * &struct nvme_timeout), the path is marked as failed for all queues of the
+ * device and the I/O is transparently retried on another path that it has not
+ * yet been tried on. The callback of the I/O only sees the error once all
+ * paths have been tried. A failed path is not selected again until it is
+ * reinstated with vfn_mpath_set_path_state().
+ */
+
+/* maximum number of paths to a namespace */
+#define VFN_MPATH_MAX_PATHS 4
+
+/**
+ * enum vfn_mpath_policy - Path selection policy
+ * @VFN_MPATH_ROUND_ROBIN: Alternate between the live paths
+ * @VFN_MPATH_QUEUE_DEPTH: Select the live path with the fewest I/Os
+ *                         outstanding on the queue
+ * @VFN_MPATH_NUMA: Alternate between the live paths to controllers attached to
+ *                  the numa node of the thread that initialized the queue; if
+ *                  there are none, alternate between all live paths
+ */
+enum vfn_mpath_policy {
+	VFN_MPATH_ROUND_ROBIN,
+	VFN_MPATH_QUEUE_DEPTH,
+	VFN_MPATH_NUMA,
+};
+
+/**
+ * struct vfn_mpath - Multipath block device
+ * @npaths: Number of paths
+ * @policy: Path selection policy (see &enum vfn_mpath_policy)
+ */
+struct vfn_mpath {
+	int npaths;
+	int policy;
+
+	/* private: */
+	struct {
+		struct vfn_bdev bdev;
+
+		/* numa node of the controller (or -1) */
+		int node;
+
+		bool failed;
+	} paths[VFN_MPATH_MAX_PATHS];
+};
+
+struct vfn_mpath_queue;
+
+/**
+ * struct vfn_mpath_io - Multipath block device I/O
+ * @io: The I/O (see &struct vfn_bdev_io); the callback is invoked with @io
+ *
+ * The I/O must remain valid until its callback is invoked.
+ */
+struct vfn_mpath_io {
+	struct vfn_bdev_io io;
+
+	/* private: */
+	vfn_bdev_cb cb;
+	struct vfn_mpath_queue *q;
+	int path;
+
+	/* bitmap of paths the i/o was submitted on */
+	unsigned int tried;
+};
+
+/**
+ * struct vfn_mpath_queue - Per-thread multipath block device queue
+ * @mp: See &struct vfn_mpath
+ * @failovers: Number of I/Os retried on another path
+ */
+struct vfn_mpath_queue {
+	struct vfn_mpath *mp;
+
+	uint64_t failovers;
+
+	/* private: */
+	int node;
+	unsigned int next;
+
+	struct {
+		struct vfn_bdev_queue q;
+		unsigned int inflight;
+	} paths[VFN_MPATH_MAX_PATHS];
+};
+
+/**
+ * vfn_mpath_open - Open a shared namespace as a multipath block device
+ * @mp: &struct vfn_mpath to initialize
+ * @ctrls: Array of @n controllers (&struct nvme_ctrl)
+ * @n: Number of paths
+ * @nsid: Namespace identifier
+ * @policy: Path selection policy (see &enum vfn_mpath_policy)
+ *
+ * Open @nsid on each of @ctrls (see vfn_bdev_open()). The namespace must have
+ * the same size and logical block size on all controllers; the identity of the
+ * namespace is not verified otherwise.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if @n or @policy is not valid or the namespaces do not
+ * match, or as set by vfn_bdev_open()).
+ */
+int vfn_mpath_open(struct vfn_mpath *mp, struct nvme_ctrl **ctrls, int n, uint32_t nsid,
+		   int policy);
+
+/**
+ * vfn_mpath_set_path_state - Fail or reinstate a path
+ * @mp: &struct vfn_mpath
+ * @path: Path index (the index of the controller given to vfn_mpath_open())
+ * @live: Whether the path may be selected
+ *
+ * Paths are failed automatically on path related errors; reinstate a path
+ * once its controller has recovered (e.g., after nvme_recover()). May be
+ * called from any thread.
+ */
+void vfn_mpath_set_path_state(struct vfn_mpath *mp, int path, bool live);
+
+/**
+ * vfn_mpath_queue_init - Initialize a multipath block device queue
+ * @q: &struct vfn_mpath_queue to initialize
+ * @mp: &struct vfn_mpath
+ * @sqs: Array of &struct vfn_mpath.npaths I/O submission queues, one on the
+ *       controller of each path (see vfn_bdev_queue_init())
+ *
+ * The queue must only be used by one thread at a time. With
+ * ``VFN_MPATH_NUMA``, paths are selected with respect to the numa node of the
+ * calling thread.
+ */
+void vfn_mpath_queue_init(struct vfn_mpath_queue *q, struct vfn_mpath *mp,
+			  struct nvme_sq **sqs);
+
+/**
+ * vfn_mpath_add - Queue an I/O
+ * @q: &struct vfn_mpath_queue
+ * @mio: &struct vfn_mpath_io
+ *
+ * Select a path and add @mio to it (see vfn_bdev_add()).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENODEV`` if all paths have failed, or as set by
+ * vfn_bdev_add()).
+ */
+int vfn_mpath_add(struct vfn_mpath_queue *q, struct vfn_mpath_io *mio);
+
+/**
+ * vfn_mpath_unplug - Submit plugged I/Os
+ * @q: &struct vfn_mpath_queue
+ *
+ * Unplug the queue of every path (see vfn_bdev_unplug()).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` to ``EBUSY`` if request trackers ran out on a path; the I/Os not
+ * submitted remain plugged.
+ */
+int vfn_mpath_unplug(struct vfn_mpath_queue *q);
+
+/**
+ * vfn_mpath_poll - Process multipath block device completions
+ * @q: &struct vfn_mpath_queue
+ * @budget: Maximum number of completions to process per path
+ *
+ * Process completions on the completion queue of each path (see
+ * vfn_bdev_poll()) and submit the I/Os that failed over to another path.
+ *
+ * Return: The number of completions (commands, not I/Os) processed.
+ */
+int vfn_mpath_poll(struct vfn_mpath_queue *q, int budget);
+
+#endif /* LIBVFN_NVME_MPATH_H */
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_NS_H
+#define LIBVFN_NVME_NS_H
+
+/**
+ * DOC: Namespace cache
+ *
+ * nvme_init() identifies the active namespaces of the controller (see
+ * nvme_scan_ns()) and keeps what is needed to build and validate I/O commands
+ * in a table indexed by namespace identifier. Looking up a namespace with
+ * nvme_ns_get() does not involve any admin commands.
+ */
+
+/* namespaces beyond this identifier are not cached */
+#define NVME_NS_CACHE_MAX 1024
+
+/**
+ * struct nvme_ns - Cached namespace information
+ * @nsid: Namespace identifier (``0`` if the namespace is not active)
+ * @nsze: Namespace size in logical blocks
+ * @lbads: Logical block data size (as a power of two)
+ * @ms: Metadata size per logical block
+ * @extended: Whether metadata is transferred at the end of each logical block
+ *            (instead of in a separate buffer)
+ * @pi: Protection information type (``0`` if disabled)
+ * @pi_first: Protection information is in the first (instead of the last)
+ *            bytes of the metadata
+ * @pif: Protection information format (see &enum nvme_pi_format)
+ * @sts: Storage tag size in bits (of the 64b guard protection information
+ *       reference tag field)
+ * @max_nlb: Maximum number of logical blocks per command, as limited by the
+ *           controller maximum data transfer size and the command format
+ * @max_wz_nlb: Maximum number of logical blocks per Write Zeroes command
+ *              (``0`` if not supported)
+ * @max_verify_nlb: Maximum number of logical blocks per Verify command (``0``
+ *                  if not supported)
+ * @endgid: Endurance group identifier (``0`` if not reported; see
+ *          nvme_fdp_get_config())
+ */
+struct nvme_ns {
+	uint32_t nsid;
+	uint64_t nsze;
+	uint8_t lbads;
+	uint16_t ms;
+	bool extended;
+	uint8_t pi;
+	bool pi_first;
+	uint8_t pif;
+	uint8_t sts;
+	uint32_t max_nlb;
+	uint32_t max_wz_nlb, max_verify_nlb;
+	uint16_t endgid;
+};
+
+/**
+ * nvme_scan_ns - Refresh the namespace cache
+ * @ctrl: See &struct nvme_ctrl
+ *
+ * Identify all active namespaces (with identifiers up to
+ * ``NVME_NS_CACHE_MAX``). The Identify commands are kept in flight together on
+ * the admin queue. This is done by nvme_init(); call it again after namespace
+ * attributes changed.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_scan_ns(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_ns_get - Look up a cached namespace
+ * @ctrl: See &struct nvme_ctrl
+ * @nsid: Namespace identifier
+ *
+ * Return: The namespace (see &struct nvme_ns), or NULL if @nsid is not an
+ * active namespace (or is not cached).
+ */
+static inline struct nvme_ns *nvme_ns_get(struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+	struct nvme_ns *ns;
+
+	if (!nsid || nsid > (uint32_t)ctrl->nns)
+		return NULL;
+
+	ns = &ctrl->ns[nsid - 1];
+
+	return ns->nsid ? ns : NULL;
+}
+
+/**
+ * nvme_ns_nlb - Get the number of logical blocks of a transfer
+ * @ns: See &struct nvme_ns
+ * @len: Data length in bytes (excluding any metadata)
+ *
+ * Return: The number of logical blocks covered by @len.
+ */
+static inline uint64_t nvme_ns_nlb(struct nvme_ns *ns, size_t len)
+{
+	return len >> ns->lbads;
+}
+
+/**
+ * nvme_ns_prep_rw - Prepare a read or write command
+ * @ns: See &struct nvme_ns
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @opcode: Command opcode (e.g., Read or Write)
+ * @slba: Starting logical block address
+ * @len: Data length in bytes (excluding any metadata)
+ *
+ * Initialize @cmd as a &struct nvme_cmd_rw for @len bytes starting at @slba,
+ * verifying that @len is a non-zero multiple of the logical block size, does
+ * not exceed &struct nvme_ns.max_nlb blocks and that the range is within the
+ * namespace. The data pointer is left for the caller to map.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` to ``EINVAL``.
+ */
+static inline int nvme_ns_prep_rw(struct nvme_ns *ns, union nvme_cmd *cmd, uint8_t opcode,
+				  uint64_t slba, size_t len)
+{
+	uint64_t nlb = nvme_ns_nlb(ns, len);
+
+	if (!nlb || len & ((1ULL << ns->lbads) - 1) || nlb > ns->max_nlb ||
+	    slba >= ns->nsze || nlb > ns->nsze - slba) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(cmd, 0x0, sizeof(*cmd));
+
+	cmd->rw.opcode = opcode;
+	cmd->rw.nsid = cpu_to_le32(ns->nsid);
+	cmd->rw.slba = cpu_to_le64(slba);
+	cmd->rw.nlb = cpu_to_le16((uint16_t)(nlb - 1));
+
+	return 0;
+}
+
+/**
+ * nvme_rw_set_directive - Set a directive (e.g., a placement hint) of a command
+ * @cmd: Read or write command (&union nvme_cmd; see nvme_ns_prep_rw())
+ * @dtype: Directive type (see &enum nvme_dir_type)
+ * @dspec: Directive specific value (e.g., a stream identifier or a placement
+ *         identifier; see nvme_fdp_get_ruhs())
+ *
+ * Fill in the Directive Type (``CDW12.DTYPE``) and Directive Specific
+ * (``CDW13.DSPEC``) fields of @cmd. A @dtype of ``NVME_DIR_TYPE_IDENTIFY``
+ * (zero) clears the directive.
+ */
+static inline void nvme_rw_set_directive(union nvme_cmd *cmd, uint8_t dtype, uint16_t dspec)
+{
+	uint16_t control = le16_to_cpu(cmd->rw.control) & (uint16_t)~(0xf << 4);
+
+	cmd->rw.control = cpu_to_le16((uint16_t)(control | (dtype & 0xf) << 4));
+	cmd->rw.dspec = cpu_to_le16(dtype ? dspec : 0);
+}
+
+#endif /* LIBVFN_NVME_NS_H */
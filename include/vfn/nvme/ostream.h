@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_OSTREAM_H
+#define LIBVFN_NVME_OSTREAM_H
+
+/**
+ * DOC: Ordered completion streams
+ *
+ * Commands complete in any order, but some users (e.g. a replicated log) must
+ * acknowledge them in the order they were submitted. A &struct nvme_ostream
+ * numbers the commands submitted through it (see nvme_ostream_submit()) and
+ * records each completion in a reorder buffer indexed by its sequence number.
+ * Completions are delivered in submission order once all earlier commands have
+ * completed; the watermark (the sequence number of the oldest command not yet
+ * delivered) is then reported to the stream callback.
+ *
+ * The reorder buffer has a slot for each command that can be in flight on the
+ * submission queue and is allocated by nvme_ostream_init(). Submitting and
+ * completing commands does not allocate. The stream must only be used by the
+ * thread processing the completion queue (see nvme_cq_process()).
+ */
+
+struct nvme_ostream;
+
+/**
+ * typedef nvme_ostream_io_cb - In-order command completion callback
+ * @seq: Sequence number of the command
+ * @cqe: Completion queue entry of the command (valid for the duration of the
+ *       callback)
+ * @arg: Opaque argument given to nvme_ostream_submit()
+ */
+typedef void (*nvme_ostream_io_cb)(uint32_t seq, struct nvme_cqe *cqe, void *arg);
+
+/**
+ * typedef nvme_ostream_cb - Watermark callback
+ * @os: &struct nvme_ostream
+ * @watermark: All commands with sequence numbers below @watermark have been
+ *             delivered
+ * @opaque: Opaque argument given to nvme_ostream_init()
+ */
+typedef void (*nvme_ostream_cb)(struct nvme_ostream *os, uint32_t watermark, void *opaque);
+
+/* reorder buffer slot of a command (internal) */
+struct nvme_ostream_slot {
+	nvme_ostream_io_cb cb;
+	void *arg;
+	struct nvme_cqe cqe;
+	bool done;
+};
+
+/**
+ * struct nvme_ostream - Ordered completion stream
+ * @sq: Submission queue
+ * @cb: Watermark callback (may be NULL)
+ * @opaque: Opaque argument passed to @cb
+ */
+struct nvme_ostream {
+	struct nvme_sq *sq;
+	nvme_ostream_cb cb;
+	void *opaque;
+
+	/* private: */
+	struct nvme_ostream_slot *slots;
+	uint32_t mask;
+
+	/* next sequence number and watermark */
+	uint32_t next, head;
+};
+
+/**
+ * nvme_ostream_init - Initialize an ordered completion stream
+ * @os: &struct nvme_ostream
+ * @sq: Submission queue
+ * @cb: Watermark callback (may be NULL)
+ * @opaque: Opaque argument passed to @cb
+ *
+ * Allocate the reorder buffer of @os for the depth of @sq. Sequence numbers
+ * start at zero and wrap around.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_ostream_init(struct nvme_ostream *os, struct nvme_sq *sq, nvme_ostream_cb cb,
+		      void *opaque);
+
+/**
+ * nvme_ostream_destroy - Free the reorder buffer of an ordered completion stream
+ * @os: &struct nvme_ostream
+ */
+void nvme_ostream_destroy(struct nvme_ostream *os);
+
+/**
+ * nvme_ostream_watermark - Get the watermark of an ordered completion stream
+ * @os: &struct nvme_ostream
+ *
+ * Return: The sequence number of the oldest command that has not been
+ * delivered.
+ */
+static inline uint32_t nvme_ostream_watermark(struct nvme_ostream *os)
+{
+	return os->head;
+}
+
+void __nvme_ostream_complete(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg);
+
+/**
+ * nvme_ostream_submit - Post a command in an ordered completion stream
+ * @os: &struct nvme_ostream
+ * @rq: Request tracker (&struct nvme_rq) of the submission queue of @os
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @cb: In-order completion callback (may be NULL)
+ * @arg: Opaque argument passed to @cb
+ *
+ * Assign the next sequence number to the command and post it with
+ * nvme_rq_submit(). The tracker is released when the command completes, as
+ * usual; @cb is invoked (with the completion queue entry) once all commands
+ * submitted earlier in @os have been delivered.
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail().
+ *
+ * Return: On success, returns the sequence number of the command. On error,
+ * returns ``-1`` and sets ``errno`` (``EBUSY`` if the reorder buffer is full,
+ * i.e. an old command has not completed yet).
+ */
+static inline int64_t nvme_ostream_submit(struct nvme_ostream *os, struct nvme_rq *rq,
+					   union nvme_cmd *cmd, nvme_ostream_io_cb cb, void *arg)
+{
+	struct nvme_ostream_slot *slot;
+	uint32_t seq = os->next;
+
+	if (seq - os->head > os->mask) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	slot = &os->slots[seq & os->mask];
+	slot->cb = cb;
+	slot->arg = arg;
+
+	rq->seq = seq;
+	os->next = seq + 1;
+
+	nvme_rq_submit(rq, cmd, __nvme_ostream_complete, os);
+
+	return seq;
+}
+
+#endif /* LIBVFN_NVME_OSTREAM_H */
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_PI_H
+#define LIBVFN_NVME_PI_H
+
+/**
+ * DOC: Protection Information
+ *
+ * End-to-end data protection attaches a protection information tuple (a guard
+ * checksum of the logical block data, an application tag and a reference tag)
+ * to the metadata of each logical block. The host generates the tuples before
+ * writing and verifies them after reading, such that corruption anywhere
+ * between the application buffer and the media is detected.
+ *
+ * A &struct nvme_pi describes the buffers of one command. The namespace format
+ * (protection information type, guard format, metadata size and whether
+ * metadata is interleaved with the data) is taken from the namespace cache
+ * (see &struct nvme_ns). nvme_pi_generate() and nvme_pi_verify() process all
+ * logical blocks of the command in one pass. The 64b guard is computed with the
+ * fastest CRC64 implementation supported by the cpu (e.g., carry-less
+ * multiplication).
+ *
+ * Verification may be deferred to the completion path by attaching the
+ * &struct nvme_pi to the request tracker (see nvme_rq_set_pi()). The tuples
+ * are then verified by the thread that reaps the completion (the reactor
+ * thread, if the queue is served by a &struct nvme_reactor) and a mismatch is
+ * reported as a failed command.
+ *
+ * The 16b and 64b guard formats are supported; storage tags are not.
+ */
+
+/**
+ * enum nvme_pi_format - Protection information format
+ * @NVME_PI_FORMAT_16B: 16b guard (CRC-16 T10-DIF) and 32b reference tag
+ * @NVME_PI_FORMAT_32B: 32b guard (CRC-32C) and 80b storage and reference tag
+ *                      (not supported)
+ * @NVME_PI_FORMAT_64B: 64b guard (NVMe CRC64) and 48b storage and reference tag
+ */
+enum nvme_pi_format {
+	NVME_PI_FORMAT_16B		= 0,
+	NVME_PI_FORMAT_32B		= 1,
+	NVME_PI_FORMAT_64B		= 2,
+};
+
+/**
+ * enum nvme_pi_check - Protection information checks
+ * @NVME_PI_CHECK_REF: Check the reference tag
+ * @NVME_PI_CHECK_APP: Check the application tag
+ * @NVME_PI_CHECK_GUARD: Check the guard
+ *
+ * The values match the Protection Information Check (PRCHK) field of read and
+ * write commands.
+ */
+enum nvme_pi_check {
+	NVME_PI_CHECK_REF		= 1 << 0,
+	NVME_PI_CHECK_APP		= 1 << 1,
+	NVME_PI_CHECK_GUARD		= 1 << 2,
+};
+
+/**
+ * struct nvme_pi - Protection information of a command
+ * @ns: Namespace (see &struct nvme_ns)
+ * @data: Logical block data (and metadata, if the namespace format is
+ *        extended)
+ * @meta: Separate metadata buffer (ignored if the namespace format is
+ *        extended)
+ * @nlb: Number of logical blocks
+ * @reftag: Reference tag of the first logical block (incremented for each
+ *          logical block, unless the protection information type is 3)
+ * @apptag: Application tag
+ * @appmask: Application tag mask (bits that are checked)
+ * @checks: Checks to perform on verification (see &enum nvme_pi_check)
+ * @err: The check that failed verification (see &enum nvme_pi_check)
+ * @err_block: Index of the logical block that failed verification
+ */
+struct nvme_pi {
+	struct nvme_ns *ns;
+	void *data;
+	void *meta;
+	uint32_t nlb;
+	uint64_t reftag;
+	uint16_t apptag;
+	uint16_t appmask;
+	unsigned int checks;
+
+	/* output */
+	unsigned int err;
+	uint32_t err_block;
+};
+
+/**
+ * nvme_pi_generate - Generate protection information
+ * @pi: &struct nvme_pi
+ *
+ * Write a protection information tuple to the metadata of each logical block
+ * described by @pi.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if protection information is not enabled for the
+ * namespace or the metadata is too small to hold it, ``ENOTSUP`` if the
+ * namespace format is not supported).
+ */
+int nvme_pi_generate(struct nvme_pi *pi);
+
+/**
+ * nvme_pi_verify - Verify protection information
+ * @pi: &struct nvme_pi
+ *
+ * Perform the checks in &struct nvme_pi.checks on each logical block described
+ * by @pi. As defined by the protection information type, checking is disabled
+ * for logical blocks with an application tag of ``0xffff`` (and, for type 3, a
+ * reference tag with all bits set).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``. If a check fails, ``errno`` is set to ``EILSEQ`` and
+ * &struct nvme_pi.err and &struct nvme_pi.err_block identify the first failure.
+ * Otherwise, ``errno`` is set as by nvme_pi_generate().
+ */
+int nvme_pi_verify(struct nvme_pi *pi);
+
+/**
+ * nvme_pi_prep_rw - Prepare the protection information fields of a command
+ * @pi: &struct nvme_pi
+ * @cmd: NVMe command prototype (&union nvme_cmd), as prepared by
+ *       nvme_ns_prep_rw()
+ *
+ * Set the initial reference tag, application tag and mask and the checks to be
+ * performed by the controller in @cmd. The metadata pointer (if the namespace
+ * format is not extended) is left for the caller to map.
+ */
+void nvme_pi_prep_rw(struct nvme_pi *pi, union nvme_cmd *cmd);
+
+/**
+ * nvme_pi_complete - Verify protection information of a completed command
+ * @pi: &struct nvme_pi
+ * @cqe: Completion queue entry (&struct nvme_cqe)
+ *
+ * If @cqe indicates success, verify the protection information described by
+ * @pi (see nvme_pi_verify()). On failure, the status field of @cqe is set to
+ * the corresponding End-to-end Guard, Application Tag or Reference Tag Check
+ * Error (or Invalid Field in Command, if @pi is not valid for the namespace).
+ *
+ * Return: ``true`` if @cqe indicates success (after verification), ``false``
+ * otherwise.
+ */
+bool nvme_pi_complete(struct nvme_pi *pi, struct nvme_cqe *cqe);
+
+#endif /* LIBVFN_NVME_PI_H */
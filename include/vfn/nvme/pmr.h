@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_PMR_H
+#define LIBVFN_NVME_PMR_H
+
+/**
+ * DOC: Persistent Memory Region
+ *
+ * The Persistent Memory Region (PMR) is a region of byte-addressable device
+ * memory in one of the controller bars whose contents survive power loss and
+ * controller resets. Once enabled and mapped (see nvme_pmr_enable()), it is
+ * written directly with cpu stores (preferably vfio_pci_memcpy_to_bar()), and
+ * nvme_pmr_persist() waits until all prior writes are persistent.
+ *
+ * This allows, for example, committing small journal records in the time of
+ * a few mmio accesses instead of a write command round trip.
+ */
+
+/**
+ * nvme_pmr_enable - Enable and map the Persistent Memory Region
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Enable the PMR of @ctrl, wait for it to become ready and map the bar holding
+ * it (write-combining if possible, see vfio_pci_map_bar_wc()). On return,
+ * ``ctrl->pmr`` describes the mapping. If the PMR is already enabled, this is a
+ * no-op.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOTSUP`` if the controller has no PMR or no supported write
+ * barrier mechanism, ``ETIMEDOUT`` if the PMR did not become ready and ``EIO``
+ * if the PMR reports an error).
+ */
+int nvme_pmr_enable(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_pmr_persist - Persist writes to the Persistent Memory Region
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Flush write-combining buffers and wait until all prior writes to the PMR are
+ * persistent, using the write barrier mechanism advertised by the controller
+ * (a read of the PMR status register or of the PMR itself).
+ */
+void nvme_pmr_persist(struct nvme_ctrl *ctrl);
+
+/**
+ * nvme_pmr_disable - Disable the Persistent Memory Region
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Unmap and disable the PMR. The contents are retained.
+ */
+void nvme_pmr_disable(struct nvme_ctrl *ctrl);
+
+#endif /* LIBVFN_NVME_PMR_H */
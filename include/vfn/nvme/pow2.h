@@ -0,0 +1,203 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_POW2_H
+#define LIBVFN_NVME_POW2_H
+
+/**
+ * DOC: Power-of-two queue fast paths
+ *
+ * For queue pairs whose size is a power of two known at compile time,
+ * NVME_QUEUE_POW2_DEFINE() generates variants of the submission and completion
+ * fast paths in which the queue size is a constant. Wrapping the tail and head
+ * is a mask, the completion queue phase is flipped without a branch and
+ * command identifiers are masked into range instead of being bounds checked
+ * (every submission queue has a spare request tracker for this).
+ *
+ * The variants operate on the regular queue state, so they may be mixed
+ * freely with the generic functions. They must only be used with queues of
+ * the given size (e.g., created with nvme_create_ioqpair()); this is checked in
+ * debug builds. C++ code may use ``vfn::nvme::Pow2Queue<QSize>`` instead.
+ */
+
+#ifdef DEBUG
+# define __nvme_pow2_check(q, mask) assert((q)->qsize == (int)(mask) + 1)
+#else
+# define __nvme_pow2_check(q, mask) ((void)0)
+#endif
+
+/*
+ * The helpers below take the queue size minus one; they are always inlined
+ * such that the mask is a compile-time constant.
+ */
+static inline __attribute__((always_inline)) void
+__nvme_sq_post_mask(struct nvme_sq *sq, const union nvme_cmd *sqe, uint16_t mask)
+{
+	__nvme_pow2_check(sq, mask);
+
+	__nvme_sq_copy(sq, sq->tail, sqe, 1);
+
+	__nvme_qstat_add(sq, posted, 1);
+
+	trace_probe(NVME_SQ_POST, sq->id, sq->tail);
+
+	trace_guard(NVME_SQ_POST) {
+		trace_emit("sqid %d tail %d\n", sq->id, sq->tail);
+	}
+
+	sq->tail = (uint16_t)((sq->tail + 1) & mask);
+}
+
+static inline __attribute__((always_inline)) struct nvme_cqe *
+__nvme_cq_get_cqe_mask(struct nvme_cq *cq, uint16_t mask)
+{
+	struct nvme_cqe *cqe = nvme_cq_head(cq);
+
+	__nvme_pow2_check(cq, mask);
+
+	if (unlikely(cq->dbc_sq))
+		__nvme_cq_flush_dbc(cq);
+
+	trace_probe(NVME_CQ_GET_CQE, cq->id);
+
+	trace_guard(NVME_CQ_GET_CQE) {
+		trace_emitrl(1, (uintptr_t)cq, "cq %d\n", cq->id);
+	}
+
+	if ((le16_to_cpu(LOAD(cqe->sfp)) & 0x1) == cq->phase) {
+		__nvme_qstat_add(cq, empty_polls, 1);
+
+		return NULL;
+	}
+
+	__nvme_qstat_add(cq, reaped, 1);
+
+	trace_probe(NVME_CQ_GOT_CQE, cq->id, cqe->cid);
+
+	trace_guard(NVME_CQ_GOT_CQE) {
+		trace_emit("cq %d cid %" PRIu16 "\n", cq->id, cqe->cid);
+	}
+
+	/* prevent load/load reordering between sfp and head */
+	dma_rmb();
+
+	if (cq->sqs)
+		__nvme_cq_track_sqhd(cq, cqe);
+
+	cq->head = (uint16_t)((cq->head + 1) & mask);
+
+	/* the phase flips when the head wraps to zero */
+	cq->phase ^= !cq->head;
+
+	return cqe;
+}
+
+static inline __attribute__((always_inline)) int
+__nvme_cq_reap_batch_mask(struct nvme_cq *cq, struct nvme_cqe **out, int max, uint16_t mask)
+{
+	struct nvme_cqe *cqe = nvme_cq_head(cq);
+	unsigned int head = cq->head;
+	int n;
+
+	__nvme_pow2_check(cq, mask);
+
+	if (unlikely(cq->dbc_sq))
+		__nvme_cq_flush_dbc(cq);
+
+	/* keep empty polls cheap */
+	if (max <= 0 || (le16_to_cpu(LOAD(cqe->sfp)) & 0x1) == cq->phase) {
+		__nvme_qstat_add(cq, empty_polls, 1);
+
+		return 0;
+	}
+
+	n = __nvme_cq_scan(cq, max);
+
+	/* prevent load/load reordering between sfp and the rest of the entries */
+	dma_rmb();
+
+	for (int i = 0; i < n; i++) {
+		out[i] = (struct nvme_cqe *)(cq->vaddr + (((head + (unsigned int)i) & mask) <<
+							  NVME_CQES));
+
+		if (cq->sqs)
+			__nvme_cq_track_sqhd(cq, out[i]);
+	}
+
+	head += (unsigned int)n;
+
+	/* at most one wrap, since n is bounded by the queue size */
+	cq->phase ^= (int)(head > mask);
+	cq->head = (uint16_t)(head & mask);
+
+	__builtin_prefetch(nvme_cq_head(cq));
+
+	trace_probe(NVME_CQ_REAP_BATCH, cq->id, cq->head, n);
+
+	trace_guard(NVME_CQ_REAP_BATCH) {
+		trace_emit("cq %d head %" PRIu16 " n %d\n", cq->id, cq->head, n);
+	}
+
+	__nvme_qstat_add(cq, reaped, n);
+
+	return n;
+}
+
+static inline __attribute__((always_inline)) struct nvme_rq *
+__nvme_cq_rq_from_cqe_mask(struct nvme_cq *cq, struct nvme_cqe *cqe, uint16_t mask)
+{
+	struct nvme_sq *sq = nvme_cq_sq_from_cqe(cq, cqe);
+
+	__nvme_pow2_check(sq, mask);
+
+	return &sq->rqs[cqe->cid & mask];
+}
+
+/**
+ * NVME_QUEUE_POW2_DEFINE - Define fast paths for a power-of-two queue size
+ * @name: Suffix of the generated functions
+ * @qsize: Queue size (a power of two; at least 2 and at most 65536)
+ *
+ * Define static inline functions nvme_sq_post_@name(),
+ * nvme_cq_get_cqe_@name(), nvme_cq_reap_batch_@name() and
+ * nvme_cq_rq_from_cqe_@name(), with the same semantics as nvme_sq_post(),
+ * nvme_cq_get_cqe(), nvme_cq_reap_batch() and nvme_cq_rq_from_cqe(), for
+ * queues of @qsize entries. For example, ``NVME_QUEUE_POW2_DEFINE(q1k, 1024)``.
+ */
+#define NVME_QUEUE_POW2_DEFINE(name, qsize)						\
+	static_assert((qsize) >= 2 && (qsize) <= 65536 && !((qsize) & ((qsize) - 1)),	\
+		      "queue size must be a power of two");				\
+											\
+	static inline void nvme_sq_post_##name(struct nvme_sq *sq,			\
+					       const union nvme_cmd *sqe)		\
+	{										\
+		__nvme_sq_post_mask(sq, sqe, (uint16_t)((qsize) - 1));			\
+	}										\
+											\
+	static inline struct nvme_cqe *nvme_cq_get_cqe_##name(struct nvme_cq *cq)	\
+	{										\
+		return __nvme_cq_get_cqe_mask(cq, (uint16_t)((qsize) - 1));		\
+	}										\
+											\
+	static inline int nvme_cq_reap_batch_##name(struct nvme_cq *cq,			\
+						    struct nvme_cqe **out, int max)	\
+	{										\
+		return __nvme_cq_reap_batch_mask(cq, out, max, (uint16_t)((qsize) - 1));	\
+	}										\
+											\
+	static inline struct nvme_rq *nvme_cq_rq_from_cqe_##name(struct nvme_cq *cq,	\
+								 struct nvme_cqe *cqe)	\
+	{										\
+		return __nvme_cq_rq_from_cqe_mask(cq, cqe, (uint16_t)((qsize) - 1));	\
+	}
+
+#endif /* LIBVFN_NVME_POW2_H */
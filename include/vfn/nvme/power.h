@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_POWER_H
+#define LIBVFN_NVME_POWER_H
+
+/**
+ * DOC: Power state management
+ *
+ * With Autonomous Power State Transitions (APST), the controller enters
+ * non-operational power states on its own after being idle for a while. The
+ * first command after that pays the exit latency of the state, which may be
+ * several milliseconds. For latency critical applications, APST may be limited
+ * to states with a bounded exit latency (nvme_set_apst()), or disabled
+ * altogether with the controller pinned to a power state
+ * (nvme_set_power_state()). See &struct nvme_power_opts for applying either
+ * policy when the controller is initialized.
+ */
+
+/* number of entries in the autonomous power state transition table */
+#define NVME_APST_ENTRIES 32
+
+/**
+ * struct nvme_psd - Power state descriptor
+ * @mp_uw: maximum power in microwatts
+ * @enlat_us: entry latency in microseconds
+ * @exlat_us: exit latency in microseconds
+ * @nonop: the state is non-operational (no commands are processed in it)
+ */
+struct nvme_psd {
+	uint32_t mp_uw;
+	uint32_t enlat_us;
+	uint32_t exlat_us;
+	bool nonop;
+};
+
+/**
+ * struct nvme_apst_entry - Autonomous power state transition table entry
+ * @itps: idle transition power state
+ * @itpt_ms: idle time prior to transition in milliseconds (``0`` if the entry
+ *           is disabled)
+ */
+struct nvme_apst_entry {
+	uint8_t itps;
+	uint32_t itpt_ms;
+};
+
+/**
+ * struct nvme_power_info - Current power state configuration
+ * @ps: current power state
+ * @apste: autonomous power state transitions are enabled
+ * @apst: autonomous power state transition table (entry ``i`` applies while
+ *        the controller is idle in power state ``i``)
+ */
+struct nvme_power_info {
+	uint8_t ps;
+	bool apste;
+	struct nvme_apst_entry apst[NVME_APST_ENTRIES];
+};
+
+/**
+ * nvme_get_power_states - Get the power state descriptors
+ * @ctrl: &struct nvme_ctrl
+ * @psds: output parameter for the descriptors
+ *
+ * Store the address of the power state descriptors read from the Identify
+ * Controller data structure when @ctrl was initialized in @psds. The array is
+ * indexed by power state and owned by @ctrl.
+ *
+ * Return: the number of power states supported by the controller.
+ */
+int nvme_get_power_states(struct nvme_ctrl *ctrl, const struct nvme_psd **psds);
+
+/**
+ * nvme_apst_build - Build an autonomous power state transition table
+ * @psds: power state descriptors
+ * @n: number of entries in @psds
+ * @max_latency_us: maximum exit latency in microseconds
+ * @table: output parameter for the table
+ *
+ * Fill @table such that the controller steps down from each power state to the
+ * next deeper non-operational power state with an exit latency of at most
+ * @max_latency_us. The idle time prior to a transition is 50 times the sum of
+ * the entry and exit latencies of the target state, which bounds the fraction
+ * of time lost to transitions.
+ *
+ * Return: the number of enabled entries in @table.
+ */
+int nvme_apst_build(const struct nvme_psd *psds, int n, uint32_t max_latency_us,
+		    struct nvme_apst_entry table[NVME_APST_ENTRIES]);
+
+/**
+ * nvme_set_apst - Enable latency bounded autonomous power state transitions
+ * @ctrl: &struct nvme_ctrl
+ * @max_latency_us: maximum exit latency in microseconds
+ *
+ * Set the Autonomous Power State Transition feature (FID ``0x0C``) with a
+ * table built by nvme_apst_build(). If no non-operational state has an
+ * acceptable exit latency, autonomous power state transitions are disabled.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOTSUP`` if the controller does not support autonomous power
+ * state transitions).
+ */
+int nvme_set_apst(struct nvme_ctrl *ctrl, uint32_t max_latency_us);
+
+/**
+ * nvme_set_power_state - Pin the controller to a power state
+ * @ctrl: &struct nvme_ctrl
+ * @ps: power state
+ *
+ * Disable autonomous power state transitions (if supported) and set the Power
+ * Management feature (FID ``0x02``) to @ps.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if @ps is not a supported power state).
+ */
+int nvme_set_power_state(struct nvme_ctrl *ctrl, uint8_t ps);
+
+/**
+ * nvme_set_power_policy - Apply a power state management policy
+ * @ctrl: &struct nvme_ctrl
+ * @opts: power state management options
+ *
+ * Apply the policy given by @opts (see &enum nvme_power_policy). This is done
+ * by nvme_init() and nvme_recover() with &nvme_ctrl_opts.power.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_set_power_policy(struct nvme_ctrl *ctrl, const struct nvme_power_opts *opts);
+
+/**
+ * nvme_get_power_info - Get the current power state configuration
+ * @ctrl: &struct nvme_ctrl
+ * @info: output parameter for the configuration
+ *
+ * Get the current power state (FID ``0x02``) and, if supported, the
+ * autonomous power state transition configuration (FID ``0x0C``) of @ctrl.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_get_power_info(struct nvme_ctrl *ctrl, struct nvme_power_info *info);
+
+#endif /* LIBVFN_NVME_POWER_H */
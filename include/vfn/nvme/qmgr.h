@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_QMGR_H
+#define LIBVFN_NVME_QMGR_H
+
+/**
+ * DOC: Queue manager
+ *
+ * A &struct nvme_qmgr creates and deletes I/O queue pairs of a controller on
+ * demand, e.g. to add queues (and pollers) when the load goes up and release
+ * them when it goes down again. nvme_qmgr_grow() creates a queue pair with the
+ * lowest queue identifier that is not in use; nvme_qmgr_shrink() drains a queue
+ * pair and deletes it.
+ *
+ * The manager enables recycling of queue memory (see
+ * nvme_queue_mem_recycle()), so the rings of a deleted queue pair are kept
+ * mapped and queue pairs created later reuse them without new IOMMU mappings.
+ *
+ * The manager takes no locks. Calls on a manager must be serialized, and no
+ * other thread may use the admin queue synchronously at the same time.
+ */
+
+/**
+ * struct nvme_qmgr - I/O queue pair manager
+ * @ctrl: Controller (see &struct nvme_ctrl)
+ * @qsize: Size of the queues created
+ * @flags: Submission queue flags (see &enum nvme_create_iosq_flags)
+ * @nqueues: Number of queue pairs currently created by the manager
+ */
+struct nvme_qmgr {
+	struct nvme_ctrl *ctrl;
+	int qsize;
+	unsigned long flags;
+	int nqueues;
+
+	/* private: */
+	int maxqid;
+
+	/* indexed by qid; queue pairs created by the manager */
+	bool *managed;
+};
+
+/**
+ * nvme_qmgr_init - Initialize a queue manager
+ * @qmgr: &struct nvme_qmgr
+ * @ctrl: Controller (see &struct nvme_ctrl)
+ * @qsize: Size of the queues to create (see nvme_create_ioqpair())
+ * @flags: Submission queue flags (see &enum nvme_create_iosq_flags)
+ *
+ * Queue identifiers up to the number of queues granted by the controller may
+ * be handed out; identifiers of queues created by other means (e.g.
+ * nvme_create_ioqpairs()) are skipped.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_qmgr_init(struct nvme_qmgr *qmgr, struct nvme_ctrl *ctrl, int qsize,
+		   unsigned long flags);
+
+/**
+ * nvme_qmgr_destroy - Delete all queue pairs of a queue manager
+ * @qmgr: &struct nvme_qmgr
+ *
+ * Delete the queue pairs still created by @qmgr without draining them (the
+ * controller aborts any commands still in flight) and release the recycled
+ * queue memory.
+ */
+void nvme_qmgr_destroy(struct nvme_qmgr *qmgr);
+
+/**
+ * nvme_qmgr_grow - Create a queue pair
+ * @qmgr: &struct nvme_qmgr
+ *
+ * Create a polled (interrupts disabled) queue pair with the lowest free queue
+ * identifier.
+ *
+ * Return: On success, returns the submission queue of the new queue pair (its
+ * completion queue has the same identifier). On error, returns ``NULL`` and
+ * sets ``errno`` (``ENOSPC`` if all queue identifiers are in use).
+ */
+struct nvme_sq *nvme_qmgr_grow(struct nvme_qmgr *qmgr);
+
+/**
+ * nvme_qmgr_shrink - Drain and delete a queue pair
+ * @qmgr: &struct nvme_qmgr
+ * @sq: Submission queue returned by nvme_qmgr_grow()
+ * @ts: Maximum time to wait for the queue to drain (or NULL to wait
+ *      indefinitely)
+ *
+ * The caller must have stopped submitting commands to @sq and must not be
+ * processing its completion queue. Outstanding commands are completed with
+ * nvme_cq_process() (invoking their callbacks) until every request tracker of
+ * @sq has been released; then the queue pair is deleted.
+ *
+ * Note: All commands in flight on @sq must have been submitted with
+ * nvme_rq_submit(), and trackers held in a &struct nvme_rq_cache count as in
+ * flight.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ETIMEDOUT`` if @sq did not drain in time; the queue pair is
+ * left as is).
+ */
+int nvme_qmgr_shrink(struct nvme_qmgr *qmgr, struct nvme_sq *sq, struct timespec *ts);
+
+#endif /* LIBVFN_NVME_QMGR_H */
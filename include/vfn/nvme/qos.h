@@ -0,0 +1,191 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_QOS_H
+#define LIBVFN_NVME_QOS_H
+
+/**
+ * DOC: Software quality of service
+ *
+ * A &struct nvme_qos schedules the I/Os of a number of tenants
+ * (&struct nvme_qos_tenant) onto a single submission queue. I/Os are queued
+ * per tenant with nvme_qos_enqueue() and posted by nvme_qos_dispatch(), which
+ * ends each batch with a single nvme_sq_update_tail().
+ *
+ * Each tenant may be rate limited in I/Os per second and bytes per second
+ * (token buckets, see &struct nvme_qos_limits). Tenants that are not rate
+ * limited share the queue in proportion to their quantum (deficit round
+ * robin). A tenant gets to dispatch I/Os worth up to its quantum in bytes (plus
+ * any deficit carried over) per turn. If the quantum is at least the size of
+ * the largest I/O, every turn dispatches at least one I/O, so the cost of
+ * scheduling is constant per I/O. Rate limited tenants are skipped for the
+ * rest of the batch and do not accumulate quantum while they wait.
+ *
+ * The scheduler takes no locks; the queue and its tenants must only be used by
+ * one thread at a time.
+ */
+
+/* default deficit round robin quantum in bytes */
+#define NVME_QOS_QUANTUM_DEFAULT (128 << 10)
+
+/* default token bucket depth */
+#define NVME_QOS_BURST_USEC_DEFAULT 1000
+
+struct nvme_qos;
+
+/**
+ * struct nvme_qos_io - Scheduled I/O
+ * @cmd: Command prototype; the data pointer is set up when the I/O is
+ *       dispatched
+ * @iova: I/O virtual address of the data buffer
+ * @len: Length of the data buffer in bytes (``0`` for no data)
+ * @cb: Completion callback (see nvme_rq_submit())
+ * @opaque: Opaque argument passed to @cb
+ *
+ * The I/O must remain valid until it is dispatched.
+ */
+struct nvme_qos_io {
+	union nvme_cmd cmd;
+	uint64_t iova;
+	size_t len;
+	nvme_rq_cb cb;
+	void *opaque;
+
+	/* private: */
+	struct nvme_qos_io *next;
+};
+
+/**
+ * struct nvme_qos_limits - Tenant limits
+ * @iops: Maximum number of I/Os per second (``0`` for no limit)
+ * @bps: Maximum number of bytes per second (``0`` for no limit)
+ * @burst_usec: Depth of the token buckets as a duration at the configured
+ *              rates (``0`` for ``NVME_QOS_BURST_USEC_DEFAULT``)
+ * @quantum: Deficit round robin quantum in bytes (``0`` for
+ *           ``NVME_QOS_QUANTUM_DEFAULT``)
+ */
+struct nvme_qos_limits {
+	uint64_t iops;
+	uint64_t bps;
+	uint32_t burst_usec;
+	uint32_t quantum;
+};
+
+/**
+ * struct nvme_qos_tenant - Tenant
+ * @dispatched: Number of I/Os dispatched
+ * @throttled: Number of turns cut short by a rate limit
+ */
+struct nvme_qos_tenant {
+	uint64_t dispatched;
+	uint64_t throttled;
+
+	/* private: */
+	struct nvme_qos *qos;
+
+	/* token buckets, in units of 10^-9 tokens */
+	struct {
+		uint64_t rate;
+		int64_t depth;
+		int64_t tokens;
+	} iops, bps;
+
+	/* timestamp of the last refill (nanoseconds) */
+	uint64_t last;
+
+	uint32_t quantum;
+	uint64_t deficit;
+
+	/* the current turn was credited with the quantum */
+	bool credited;
+
+	struct nvme_qos_io *head, *tail;
+
+	bool active;
+	struct nvme_qos_tenant *next;
+};
+
+/**
+ * struct nvme_qos - Submission queue scheduler
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: Submission queue that I/Os are dispatched to
+ * @dispatched: Number of I/Os dispatched
+ * @batches: Number of dispatch batches that posted I/Os
+ */
+struct nvme_qos {
+	struct nvme_ctrl *ctrl;
+	struct nvme_sq *sq;
+
+	uint64_t dispatched;
+	uint64_t batches;
+
+	/* private: round robin list of tenants with queued i/os */
+	struct nvme_qos_tenant *head, *tail;
+	int nactive;
+};
+
+/**
+ * nvme_qos_init - Initialize a submission queue scheduler
+ * @qos: &struct nvme_qos to initialize
+ * @ctrl: &struct nvme_ctrl
+ * @sq: I/O submission queue (with a completion queue processed by
+ *      nvme_cq_process())
+ */
+void nvme_qos_init(struct nvme_qos *qos, struct nvme_ctrl *ctrl, struct nvme_sq *sq);
+
+/**
+ * nvme_qos_tenant_init - Initialize a tenant
+ * @t: &struct nvme_qos_tenant to initialize
+ * @qos: &struct nvme_qos
+ * @limits: See &struct nvme_qos_limits (NULL for no limits)
+ *
+ * The token buckets start out full.
+ */
+void nvme_qos_tenant_init(struct nvme_qos_tenant *t, struct nvme_qos *qos,
+			  const struct nvme_qos_limits *limits);
+
+/**
+ * nvme_qos_tenant_set_limits - Change the limits of a tenant
+ * @t: &struct nvme_qos_tenant
+ * @limits: See &struct nvme_qos_limits (NULL for no limits)
+ *
+ * Takes effect from the next dispatch. Tokens in excess of the new bucket
+ * depths are dropped.
+ */
+void nvme_qos_tenant_set_limits(struct nvme_qos_tenant *t, const struct nvme_qos_limits *limits);
+
+/**
+ * nvme_qos_enqueue - Queue an I/O
+ * @t: &struct nvme_qos_tenant
+ * @io: &struct nvme_qos_io
+ *
+ * Queue @io behind the I/Os already queued by @t. I/Os of a tenant are
+ * dispatched in order.
+ */
+void nvme_qos_enqueue(struct nvme_qos_tenant *t, struct nvme_qos_io *io);
+
+/**
+ * nvme_qos_dispatch - Dispatch queued I/Os
+ * @qos: &struct nvme_qos
+ * @budget: Maximum number of I/Os to dispatch
+ *
+ * Select up to @budget queued I/Os, set up their data pointers and post them
+ * (see nvme_rq_submit()), then update the tail doorbell once (see
+ * nvme_sq_update_tail()). Dispatching stops early if request trackers run out
+ * or all tenants with queued I/Os are rate limited. I/Os whose buffer cannot
+ * be mapped are completed immediately with an Invalid Field in Command status.
+ *
+ * Return: The number of I/Os dispatched.
+ */
+int nvme_qos_dispatch(struct nvme_qos *qos, int budget);
+
+#endif /* LIBVFN_NVME_QOS_H */
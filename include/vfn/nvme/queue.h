@@ -22,8 +22,187 @@ struct nvme_dbbuf {
 	void *eventidx;
 };
 
+struct nvme_cq;
+struct nvme_timeout;
+
+/**
+ * struct nvme_sq_stats - Submission queue counters
+ * @posted: Number of submission queue entries posted
+ * @doorbells: Number of tail doorbell (mmio) writes
+ * @dbbuf_skips: Number of tail doorbell writes elided by the shadow doorbell
+ *               buffer
+ * @busy: Number of failed request tracker acquisitions (``EBUSY`` from
+ *        nvme_rq_acquire())
+ * @deferred: Number of tail doorbell writes deferred by the doorbell batching
+ *            policy (see nvme_sq_set_db_batch()) or by automatic doorbell
+ *            coalescing (see nvme_sq_set_db_coalesce())
+ *
+ * The counters are only maintained if libvfn is configured with
+ * ``-Dqstats=true`` (which defines ``NVME_QSTATS``). They have a single writer
+ * and are not updated atomically; the @busy counter may miss updates when
+ * using nvme_rq_acquire_atomic() concurrently.
+ */
+struct nvme_sq_stats {
+	uint64_t posted;
+	uint64_t doorbells;
+	uint64_t dbbuf_skips;
+	uint64_t busy;
+	uint64_t deferred;
+};
+
+/**
+ * struct nvme_cq_stats - Completion queue counters
+ * @reaped: Number of completion queue entries consumed
+ * @head_updates: Number of nvme_cq_update_head() and nvme_cq_commit_head() calls
+ * @doorbells: Number of head doorbell (mmio) writes
+ * @dbbuf_skips: Number of head doorbell writes elided by the shadow doorbell
+ *               buffer
+ * @empty_polls: Number of nvme_cq_get_cqe() and nvme_cq_reap_batch() calls
+ *               that found no valid entry
+ * @deferred: Number of head doorbell writes deferred by the lazy head policy
+ *            (see nvme_cq_set_lazy_head())
+ *
+ * See &struct nvme_sq_stats.
+ */
+struct nvme_cq_stats {
+	uint64_t reaped;
+	uint64_t head_updates;
+	uint64_t doorbells;
+	uint64_t dbbuf_skips;
+	uint64_t empty_polls;
+	uint64_t deferred;
+};
+
+#ifdef NVME_QSTATS
+# define __nvme_qstat_add(q, counter, n) ((q)->stats.counter += (uint64_t)(n))
+#else
+# define __nvme_qstat_add(q, counter, n) ((void)0)
+#endif
+
+#define NVME_LAT_HIST_SUB_BITS 2
+#define NVME_LAT_HIST_BUCKETS 128
+
+/**
+ * struct nvme_sq_latency - Command latency histogram
+ * @count: Number of commands recorded
+ * @sum_ns: Sum of the recorded latencies (in nanoseconds)
+ * @max_ns: Largest recorded latency (in nanoseconds)
+ * @buckets: Log-linear histogram of the recorded latencies; each power of two
+ *           is split into ``2^NVME_LAT_HIST_SUB_BITS`` linear sub-buckets (see
+ *           nvme_lat_hist_bucket() and nvme_lat_hist_lower())
+ *
+ * See nvme_sq_set_latency_tracking().
+ */
+struct nvme_sq_latency {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[NVME_LAT_HIST_BUCKETS];
+};
+
+/**
+ * nvme_lat_hist_bucket - Get the latency histogram bucket of a latency
+ * @ns: Latency in nanoseconds
+ *
+ * Latencies below ``2^NVME_LAT_HIST_SUB_BITS`` nanoseconds have a bucket each;
+ * the last bucket also counts all latencies beyond the range of the histogram
+ * (about 8.5 seconds).
+ *
+ * Return: The index of the bucket counting @ns.
+ */
+static inline unsigned int nvme_lat_hist_bucket(uint64_t ns)
+{
+	unsigned int msb, idx;
+
+	if (ns < (1 << NVME_LAT_HIST_SUB_BITS))
+		return (unsigned int)ns;
+
+	msb = 63 - (unsigned int)__builtin_clzll(ns);
+	idx = ((msb - NVME_LAT_HIST_SUB_BITS + 1) << NVME_LAT_HIST_SUB_BITS) |
+		(unsigned int)((ns >> (msb - NVME_LAT_HIST_SUB_BITS)) &
+			       ((1 << NVME_LAT_HIST_SUB_BITS) - 1));
+
+	return idx < NVME_LAT_HIST_BUCKETS ? idx : NVME_LAT_HIST_BUCKETS - 1;
+}
+
+/**
+ * nvme_lat_hist_lower - Get the lower bound of a latency histogram bucket
+ * @idx: Bucket index
+ *
+ * Return: The smallest latency (in nanoseconds) counted by bucket @idx.
+ */
+static inline uint64_t nvme_lat_hist_lower(unsigned int idx)
+{
+	unsigned int msb;
+
+	if (idx < (1 << NVME_LAT_HIST_SUB_BITS))
+		return idx;
+
+	msb = (idx >> NVME_LAT_HIST_SUB_BITS) + NVME_LAT_HIST_SUB_BITS - 1;
+
+	return (uint64_t)((1 << NVME_LAT_HIST_SUB_BITS) |
+			  (idx & ((1 << NVME_LAT_HIST_SUB_BITS) - 1))) <<
+		(msb - NVME_LAT_HIST_SUB_BITS);
+}
+
+/**
+ * struct nvme_cq_poll_opts - Completion queue wait policy options
+ * @spin_usec: Maximum number of microseconds to spin before blocking on the
+ *             interrupt eventfd
+ * @adaptive: Let nvme_cq_wait() pick the spin budget (up to @spin_usec) from
+ *            the observed inter-completion times
+ * @coalesce: Automatically disable interrupt coalescing for the queue vector
+ *            while waits mostly block on the interrupt, and enable it again
+ *            while they are mostly satisfied by spinning (see
+ *            nvme_set_irq_vector_coalescing())
+ */
+struct nvme_cq_poll_opts {
+	unsigned int spin_usec;
+	bool adaptive;
+	bool coalesce;
+};
+
+/**
+ * struct nvme_cq_poll_stats - Completion queue wait statistics
+ * @spin_ticks: Time spent spinning (in ticks, see get_ticks())
+ * @block_ticks: Time spent blocked on the interrupt eventfd (in ticks)
+ * @nspin: Number of waits satisfied while spinning
+ * @nblock: Number of waits that blocked on the interrupt eventfd
+ */
+struct nvme_cq_poll_stats {
+	uint64_t spin_ticks;
+	uint64_t block_ticks;
+	unsigned long nspin;
+	unsigned long nblock;
+};
+
+/**
+ * struct nvme_cq_poll - Adaptive completion queue wait policy
+ * @opts: Policy options (see &struct nvme_cq_poll_opts)
+ * @stats: Wait statistics (see &struct nvme_cq_poll_stats)
+ */
+struct nvme_cq_poll {
+	struct nvme_cq_poll_opts opts;
+	struct nvme_cq_poll_stats stats;
+
+	/* private: */
+	uint64_t last;	/* time of the last completion (ticks) */
+	uint64_t mean;	/* moving average of the inter-completion time (ticks) */
+
+	/* interrupt (blocking) or polling mode; see @opts.coalesce */
+	bool irq;
+	int streak;
+
+	void (*set_irq_mode)(struct nvme_cq *cq, bool irq, void *opaque);
+	void *opaque;
+};
+
 /**
  * struct nvme_cq - Completion Queue
+ * @poll: Wait policy and statistics (see &struct nvme_cq_poll)
+ *
+ * Fields written when reaping completions are kept on cache lines separate
+ * from the read-mostly queue configuration (see tests/layout.c).
  */
 struct nvme_cq {
 	/* private: */
@@ -31,7 +210,6 @@ struct nvme_cq {
 	uint64_t iova;
 
 	int id;
-	uint16_t head;
 	int qsize;
 	size_t entry_size;
 
@@ -40,13 +218,62 @@ struct nvme_cq {
 
 	struct nvme_dbbuf dbbuf;
 
-	int phase;
+	/* lazy head doorbell threshold (see nvme_cq_set_lazy_head()) */
+	int db_lazy;
+
 	int vector;
+
+	/* interrupt eventfd (-1 if the queue is not interrupt driven) */
+	int efd;
+
+	/* submission queues of the controller (indexed by cqe sqid) and their number */
+	int nsqs;
+	struct nvme_sq *sqs;
+
+	/* command timeouts (see nvme_timeout_init()) */
+	struct nvme_timeout *tmo;
+
+	/* reaped by a reactor (see nvme_reactor_add_cq()) */
+	bool reactor;
+
+	/* consumer */
+	uint16_t head __cacheline_aligned;
+	uint16_t phead;
+	int phase;
+
+	/* submission queue holding back a tail doorbell write (see nvme_sq_set_db_coalesce()) */
+	struct nvme_sq *dbc_sq;
+
+	/* see nvme_cq_trylock() */
+	int lock;
+
+	/* see nvme_cq_get_stats() */
+	struct nvme_cq_stats stats;
+
+	/* public: */
+	struct nvme_cq_poll poll;
 };
 
 /**
  * struct nvme_sq - Submission Queue
+ *
+ * Fields written when submitting commands and the head written when reaping
+ * completions are kept on cache lines separate from each other and from the
+ * read-mostly queue configuration (see tests/layout.c).
  */
+/*
+ * struct nvme_prp_page - Extra prp list page for chaining
+ *
+ * Pre-mapped list pages are handed out to request trackers on demand by
+ * nvme_rq_map_prp() and returned when the tracker is released.
+ */
+struct nvme_prp_page {
+	void *vaddr;
+	uint64_t iova;
+
+	struct nvme_prp_page *next;
+};
+
 struct nvme_sq {
 	/* private: */
 	struct nvme_cq *cq;
@@ -59,7 +286,17 @@ struct nvme_sq {
 		uint64_t iova;
 	} pages;
 
-	uint16_t tail, ptail;
+	/* pool of extra prp list pages (carved from @pages) */
+	struct nvme_prp_page *prp_pages;
+	int nprp_pages;
+
+	/* optional per-rq data buffers (see nvme_create_iosq_buf()) */
+	struct {
+		void *vaddr;
+		uint64_t iova;
+		size_t len;
+	} bufs;
+
 	int qsize;
 	int id;
 	size_t entry_size;
@@ -69,11 +306,91 @@ struct nvme_sq {
 
 	struct nvme_dbbuf dbbuf;
 
-	/* rq stack */
+	/* tail doorbell batching threshold (see nvme_sq_set_db_batch()) */
+	int db_batch;
+
+	/* see enum nvme_sq_flags */
+	unsigned long flags;
+
+	/* priority class given on creation (NVME_SQ_QPRIO_*) */
+	uint16_t qprio;
+
+	/* command latency histogram (see nvme_sq_set_latency_tracking()) */
+	struct nvme_sq_latency *lat;
+
 	struct nvme_rq *rqs;
-	struct nvme_rq *rq_top;
+
+	/* producer */
+	uint16_t tail __cacheline_aligned;
+	uint16_t ptail;
+
+	/* free stack of @rqs (see __nvme_rq_top()) */
+	uint64_t rq_top;
+
+	/* free stack of @prp_pages (see __nvme_prp_top()) */
+	uint64_t prp_top;
+
+	/*
+	 * automatic doorbell coalescing (see nvme_sq_set_db_coalesce()); all
+	 * times in ticks, @max is zero if disabled
+	 */
+	struct {
+		uint64_t max, window, deadline;
+
+		/* time of the last tail update */
+		uint64_t last;
+
+		/* moving averages of the doorbell write cost and the update interval */
+		uint64_t cost, gap;
+
+		int batch;
+	} dbc;
+
+	/* see nvme_sq_get_stats() */
+	struct nvme_sq_stats stats;
+
+	/* completion side; head as last reported by the controller (cqe sqhd) */
+	uint16_t head __cacheline_aligned;
 };
 
+/*
+ * enum nvme_sq_flags - Submission queue flags
+ * @NVME_SQ_F_CMB: Queue is resident in the (write-combining mapped)
+ *                 Controller Memory Buffer
+ */
+enum nvme_sq_flags {
+	NVME_SQ_F_CMB = 1 << 0,
+};
+
+static inline void __nvme_sq_copy(struct nvme_sq *sq, uint16_t idx, const union nvme_cmd *sqes,
+				  int n)
+{
+	void *dst = sq->vaddr + (idx << NVME_SQES);
+	size_t len = (size_t)n << NVME_SQES;
+
+	if (sq->flags & NVME_SQ_F_CMB) {
+		mmio_stream(dst, sqes, len);
+		return;
+	}
+
+	memcpy(dst, sqes, len);
+}
+
+/* account for an entry written in place at the tail and advance it */
+static inline void __nvme_sq_advance(struct nvme_sq *sq)
+{
+	__nvme_qstat_add(sq, posted, 1);
+
+	trace_probe(NVME_SQ_POST, sq->id, sq->tail);
+
+	trace_guard(NVME_SQ_POST) {
+		trace_emit("sqid %d tail %d\n", sq->id, sq->tail);
+	}
+
+	if (++sq->tail == sq->qsize)
+		sq->tail = 0;
+}
+
 /**
  * nvme_sq_post - Add a submission queue entry to a submission queue
  * @sq: Submission queue
@@ -84,14 +401,46 @@ struct nvme_sq {
  */
 static inline void nvme_sq_post(struct nvme_sq *sq, const union nvme_cmd *sqe)
 {
-	memcpy(sq->vaddr + (sq->tail << NVME_SQES), sqe, 1 << NVME_SQES);
+	__nvme_sq_copy(sq, sq->tail, sqe, 1);
+	__nvme_sq_advance(sq);
+}
 
-	trace_guard(NVME_SQ_POST) {
-		trace_emit("sqid %d tail %d\n", sq->id, sq->tail);
+/**
+ * nvme_sq_post_batch - Add multiple submission queue entries to a submission
+ *                      queue
+ * @sq: Submission queue
+ * @cmds: Array of submission queue entries
+ * @n: Number of entries in @cmds
+ *
+ * Add @n submission queue entries to a submission queue, updating the queue
+ * tail pointer in the process. The entries are copied with at most two
+ * memcpy's (split at the ring wrap point), or with streaming stores if the
+ * queue is resident in the Controller Memory Buffer.
+ *
+ * Note: The caller must ensure that there is room for @n entries in the queue.
+ * Does NOT write the doorbell. See nvme_sq_update_tail().
+ */
+static inline void nvme_sq_post_batch(struct nvme_sq *sq, const union nvme_cmd *cmds, int n)
+{
+	int m = sq->qsize - sq->tail;
+
+	if (m > n)
+		m = n;
+
+	__nvme_sq_copy(sq, sq->tail, cmds, m);
+
+	if (m < n)
+		__nvme_sq_copy(sq, 0, &cmds[m], n - m);
+
+	__nvme_qstat_add(sq, posted, n);
+
+	trace_probe(NVME_SQ_POST_BATCH, sq->id, sq->tail, n);
+
+	trace_guard(NVME_SQ_POST_BATCH) {
+		trace_emit("sqid %d tail %d n %d\n", sq->id, sq->tail, n);
 	}
 
-	if (++sq->tail == sq->qsize)
-		sq->tail = 0;
+	sq->tail = (uint16_t)((sq->tail + n) % sq->qsize);
 }
 
 static inline bool __nvme_need_mmio(uint16_t eventidx, uint16_t val, uint16_t old)
@@ -107,17 +456,19 @@ static inline int nvme_try_dbbuf(uint16_t v, struct nvme_dbbuf *dbbuf)
 		return -1;
 
 	/* force submission queue write */
-	wmb();
+	dma_wmb();
 
 	old = __LOAD_PTR(uint32_t *, dbbuf->doorbell);
 	__STORE_PTR(uint32_t *, dbbuf->doorbell, v);
 
 	/* do not reorder the eventidx load with the doorbell store */
-	mb();
+	dma_mb();
 
 	eventidx = __LOAD_PTR(uint32_t *, dbbuf->eventidx);
 
 	if (!__nvme_need_mmio((uint16_t)eventidx, v, (uint16_t)old)) {
+		trace_probe(NVME_SKIP_MMIO, eventidx, v, old);
+
 		trace_guard(NVME_SKIP_MMIO) {
 			trace_emit("eventidx %u val %u old %u\n", eventidx, v, old);
 		}
@@ -128,29 +479,226 @@ static inline int nvme_try_dbbuf(uint16_t v, struct nvme_dbbuf *dbbuf)
 	return -1;
 }
 
+/*
+ * Whether a shadow doorbell update from @old to @v would be picked up by the
+ * (actively polling) controller without an mmio write. This is a hint only;
+ * nvme_try_dbbuf() makes the final (properly ordered) decision.
+ */
+static inline bool __nvme_dbbuf_polling(struct nvme_dbbuf *dbbuf, uint16_t v, uint16_t old)
+{
+	if (!dbbuf->doorbell)
+		return false;
+
+	return !__nvme_need_mmio((uint16_t)__LOAD_PTR(uint32_t *, dbbuf->eventidx), v, old);
+}
+
 /**
- * nvme_sq_update_tail - Write the submission queue doorbell
+ * nvme_sq_set_db_batch - Set the tail doorbell batching policy
  * @sq: Submission queue
+ * @batch: Minimum number of pending entries before the tail doorbell is written
+ *
+ * Let nvme_sq_update_tail() defer writing the tail doorbell until at least
+ * @batch entries have been posted since the last write. If the queue uses a
+ * shadow doorbell buffer and the controller is actively polling it (i.e., the
+ * update does not require an mmio write), the update is never deferred. Zero
+ * or one disables batching (the default).
  *
- * Write the queue doorbell if the tail pointer has changed since last written.
+ * With batching enabled, call nvme_sq_flush_tail() before waiting on
+ * completions for entries that may not have been submitted to the controller,
+ * e.g. when draining the queue.
  */
-static inline void nvme_sq_update_tail(struct nvme_sq *sq)
+static inline void nvme_sq_set_db_batch(struct nvme_sq *sq, int batch)
+{
+	sq->db_batch = batch;
+}
+
+/**
+ * nvme_sq_set_db_coalesce - Coalesce tail doorbell writes automatically
+ * @sq: Submission queue
+ * @max_ns: Maximum time (in nanoseconds) that a posted entry may be held back;
+ *          zero disables coalescing (the default)
+ *
+ * Let nvme_sq_update_tail() (and nvme_sq_exec(), nvme_sq_try_exec() and
+ * nvme_rq_exec()) hold back the tail doorbell write until enough entries are
+ * pending, a deadline expires or the completion queue is polled next (e.g.,
+ * with nvme_cq_get_cqe() or nvme_cq_reap_batch()), whichever comes first.
+ *
+ * The thresholds are tuned from the measured cost of the doorbell write and
+ * the interval between tail updates: entries are held back for a few doorbell
+ * write times (but at most @max_ns), and the pending entry threshold is the
+ * number of entries expected to be posted in that window. Queues receiving
+ * only sporadic submissions thus write the doorbell right away. The doorbell
+ * batching policy (see nvme_sq_set_db_batch()) does not apply while enabled.
+ *
+ * Since the completion queue poll may write the doorbell, submissions and
+ * completion processing must happen on the same thread.
+ */
+void nvme_sq_set_db_coalesce(struct nvme_sq *sq, unsigned int max_ns);
+
+static inline void __nvme_sq_latency_add(struct nvme_sq_latency *lat, uint64_t ticks)
+{
+	uint64_t ns = ticks_to_ns(ticks);
+
+	lat->count++;
+	lat->sum_ns += ns;
+	lat->buckets[nvme_lat_hist_bucket(ns)]++;
+
+	if (ns > lat->max_ns)
+		lat->max_ns = ns;
+}
+
+void __nvme_sq_dbc_tune(struct nvme_sq *sq, uint64_t cost);
+
+static inline void __nvme_sq_write_tail(struct nvme_sq *sq)
+{
+	uint64_t start;
+
+	if (!sq->dbc.max) {
+		mmio_write32(sq->doorbell, cpu_to_le32(sq->tail));
+
+		return;
+	}
+
+	start = get_ticks();
+
+	mmio_write32(sq->doorbell, cpu_to_le32(sq->tail));
+
+	__nvme_sq_dbc_tune(sq, get_ticks() - start);
+}
+
+/**
+ * nvme_sq_flush_tail - Write the submission queue doorbell
+ * @sq: Submission queue
+ *
+ * Like nvme_sq_update_tail(), but ignore the doorbell batching policy.
+ */
+static inline void nvme_sq_flush_tail(struct nvme_sq *sq)
 {
 	if (sq->tail == sq->ptail)
 		return;
 
+	trace_probe(NVME_SQ_UPDATE_TAIL, sq->id, sq->tail);
+
 	trace_guard(NVME_SQ_UPDATE_TAIL) {
 		trace_emit("sqid %d tail %d\n", sq->id, sq->tail);
 	}
 
+	/* streaming stores to the cmb are weakly ordered */
+	if (sq->flags & NVME_SQ_F_CMB)
+		wmb();
+
 	if (nvme_try_dbbuf(sq->tail, &sq->dbbuf)) {
 		/* do not reorder queue entry store with doorbell store */
-		wmb();
+		io_wmb();
 
-		mmio_write32(sq->doorbell, cpu_to_le32(sq->tail));
+		__nvme_sq_write_tail(sq);
+
+		__nvme_qstat_add(sq, doorbells, 1);
+	} else {
+		__nvme_qstat_add(sq, dbbuf_skips, 1);
 	}
 
 	sq->ptail = sq->tail;
+	sq->dbc.deadline = 0;
+}
+
+/*
+ * Hold back the tail doorbell write if automatic coalescing is enabled and
+ * neither the pending entry threshold nor the deadline has been reached. The
+ * completion queue remembers the submission queue, such that the next poll
+ * writes the doorbell (see __nvme_cq_flush_dbc()).
+ */
+static inline bool __nvme_sq_dbc_defer(struct nvme_sq *sq)
+{
+	uint64_t now = get_ticks(), gap = now - sq->dbc.last;
+	int pending = (sq->tail - sq->ptail + sq->qsize) % sq->qsize;
+
+	sq->dbc.last = now;
+	sq->dbc.gap = (7 * sq->dbc.gap + (gap < sq->dbc.max ? gap : sq->dbc.max)) / 8;
+
+	if (!sq->dbc.deadline)
+		sq->dbc.deadline = now + sq->dbc.window;
+
+	if (pending >= sq->dbc.batch || now >= sq->dbc.deadline)
+		return false;
+
+	if (sq->cq && sq->cq->dbc_sq != sq) {
+		if (sq->cq->dbc_sq)
+			nvme_sq_flush_tail(sq->cq->dbc_sq);
+
+		sq->cq->dbc_sq = sq;
+	}
+
+	return true;
+}
+
+/**
+ * nvme_sq_update_tail - Write the submission queue doorbell
+ * @sq: Submission queue
+ *
+ * Write the queue doorbell if the tail pointer has changed since last written,
+ * subject to the doorbell batching policy (see nvme_sq_set_db_batch()) or
+ * automatic doorbell coalescing (see nvme_sq_set_db_coalesce()).
+ */
+static inline void nvme_sq_update_tail(struct nvme_sq *sq)
+{
+	if (sq->dbc.max) {
+		if (sq->tail != sq->ptail &&
+		    !__nvme_dbbuf_polling(&sq->dbbuf, sq->tail, sq->ptail) &&
+		    __nvme_sq_dbc_defer(sq)) {
+			__nvme_qstat_add(sq, deferred, 1);
+
+			return;
+		}
+
+		nvme_sq_flush_tail(sq);
+
+		return;
+	}
+
+	if (sq->db_batch > 1 && sq->tail != sq->ptail &&
+	    (sq->tail - sq->ptail + sq->qsize) % sq->qsize < sq->db_batch &&
+	    !__nvme_dbbuf_polling(&sq->dbbuf, sq->tail, sq->ptail)) {
+		__nvme_qstat_add(sq, deferred, 1);
+
+		return;
+	}
+
+	nvme_sq_flush_tail(sq);
+}
+
+/* write the doorbell after posting, unless coalescing is enabled */
+static inline void __nvme_sq_ring(struct nvme_sq *sq)
+{
+	if (sq->dbc.max)
+		nvme_sq_update_tail(sq);
+	else
+		nvme_sq_flush_tail(sq);
+}
+
+/**
+ * nvme_sq_space - Get the number of free submission queue entries
+ * @sq: Submission queue
+ *
+ * Get the number of entries that may be posted without overwriting entries
+ * not yet fetched by the controller, based on the submission queue head last
+ * reported in a completion queue entry (&nvme_cqe.sqhd). The head is recorded
+ * whenever entries are consumed from a completion queue with
+ * nvme_cq_get_cqe() or nvme_cq_reap_batch() (and everything built on them),
+ * provided the completion queue knows its submission queues (as all queues
+ * created by the library do). The reported head may lag behind, so the result
+ * is conservative.
+ *
+ * This allows posting commands without a request tracker per entry; see
+ * nvme_sq_try_exec().
+ *
+ * Return: The number of free entries.
+ */
+static inline int nvme_sq_space(struct nvme_sq *sq)
+{
+	uint16_t head = atomic_load_acquire(&sq->head);
+
+	return (head - sq->tail - 1 + sq->qsize) % sq->qsize;
 }
 
 /**
@@ -158,12 +706,218 @@ static inline void nvme_sq_update_tail(struct nvme_sq *sq)
  * @sq: Submission queue
  * @sqe: Submission queue entry
  *
- * Combine the effects of nvme_sq_post() and nvme_sq_update_tail().
+ * Combine the effects of nvme_sq_post() and nvme_sq_flush_tail() (or
+ * nvme_sq_update_tail() if automatic doorbell coalescing is enabled, see
+ * nvme_sq_set_db_coalesce()).
  */
 static inline void nvme_sq_exec(struct nvme_sq *sq, const union nvme_cmd *sqe)
 {
 	nvme_sq_post(sq, sqe);
-	nvme_sq_update_tail(sq);
+	__nvme_sq_ring(sq);
+}
+
+/**
+ * nvme_sq_try_post - Add a submission queue entry if there is room
+ * @sq: Submission queue
+ * @sqe: Submission queue entry
+ *
+ * Like nvme_sq_post(), but fail instead of overwriting an entry not yet
+ * fetched by the controller (see nvme_sq_space()).
+ *
+ * Return: On success, returns ``0``. If the queue is full, returns ``-1`` and
+ * sets ``errno`` to ``EBUSY``.
+ */
+static inline int nvme_sq_try_post(struct nvme_sq *sq, const union nvme_cmd *sqe)
+{
+	if (!nvme_sq_space(sq)) {
+		__nvme_qstat_add(sq, busy, 1);
+
+		errno = EBUSY;
+		return -1;
+	}
+
+	nvme_sq_post(sq, sqe);
+
+	return 0;
+}
+
+/**
+ * nvme_sq_try_exec - Post a submission queue entry if there is room and write
+ *                    the doorbell
+ * @sq: Submission queue
+ * @sqe: Submission queue entry
+ *
+ * Combine the effects of nvme_sq_try_post() and nvme_sq_flush_tail() (see
+ * nvme_sq_exec()).
+ *
+ * Return: On success, returns ``0``. If the queue is full, returns ``-1`` and
+ * sets ``errno`` to ``EBUSY``.
+ */
+static inline int nvme_sq_try_exec(struct nvme_sq *sq, const union nvme_cmd *sqe)
+{
+	if (nvme_sq_try_post(sq, sqe))
+		return -1;
+
+	__nvme_sq_ring(sq);
+
+	return 0;
+}
+
+/**
+ * struct nvme_mpsq - Multi-producer submission queue front-end
+ *
+ * Allows several threads to post to a single &struct nvme_sq without a lock
+ * (see nvme_mpsq_init()). Producers reserve queue slots with an atomic
+ * increment of a ticket counter, fill the entries in place and mark them ready.
+ * The contiguous prefix of ready entries is then made visible to the controller
+ * by one producer at a time; a producer that finds another one publishing
+ * leaves its entry to be picked up by it.
+ *
+ * The front-end does not track the queue head, so the number of entries
+ * reserved but not yet consumed by the controller must never exceed the queue
+ * size. This holds as long as each command owns a request tracker of the queue
+ * from reservation until its completion is processed (see
+ * nvme_rq_mpsq_post()).
+ */
+struct nvme_mpsq {
+	/* private: */
+	struct nvme_sq *sq;
+
+	/* per-slot ticket + 1 of the last entry marked ready */
+	uint64_t *ready;
+
+	/* next ticket */
+	uint64_t reserved __cacheline_aligned;
+
+	/* tickets below this have been published */
+	uint64_t published __cacheline_aligned;
+	bool busy;
+};
+
+/**
+ * nvme_mpsq_init - Initialize a multi-producer submission queue front-end
+ * @mpsq: &struct nvme_mpsq
+ * @sq: Submission queue
+ *
+ * Initialize @mpsq for posting to @sq. After this, @sq must only be posted to
+ * through @mpsq.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EBUSY`` if @sq has entries that have not been submitted with
+ * nvme_sq_flush_tail()).
+ */
+int nvme_mpsq_init(struct nvme_mpsq *mpsq, struct nvme_sq *sq);
+
+/**
+ * nvme_mpsq_fini - Release resources of a multi-producer submission queue
+ *                  front-end
+ * @mpsq: &struct nvme_mpsq
+ *
+ * Must not be called while producers are active.
+ */
+void nvme_mpsq_fini(struct nvme_mpsq *mpsq);
+
+/**
+ * nvme_mpsq_publish - Submit ready submission queue entries
+ * @mpsq: &struct nvme_mpsq
+ *
+ * Advance the submission queue tail over the contiguous range of entries
+ * marked ready and write the doorbell (with nvme_sq_flush_tail(); the doorbell
+ * batching policy does not apply). Returns immediately if another thread is
+ * publishing, in which case that thread picks up the entries.
+ *
+ * Called by nvme_mpsq_commit().
+ */
+void nvme_mpsq_publish(struct nvme_mpsq *mpsq);
+
+/**
+ * nvme_mpsq_reserve - Reserve a submission queue entry
+ * @mpsq: &struct nvme_mpsq
+ * @ticket: Output parameter for the reservation ticket
+ *
+ * Reserve the next submission queue entry. The entry must be filled in and
+ * then handed back with nvme_mpsq_commit(). For queues resident in the
+ * Controller Memory Buffer, use nvme_mpsq_post() instead of filling the entry
+ * in place.
+ *
+ * Return: Pointer to the reserved submission queue entry.
+ */
+static inline union nvme_cmd *nvme_mpsq_reserve(struct nvme_mpsq *mpsq, uint64_t *ticket)
+{
+	struct nvme_sq *sq = mpsq->sq;
+
+	*ticket = atomic_inc_fetch(&mpsq->reserved) - 1;
+
+	return (union nvme_cmd *)(sq->vaddr + ((*ticket % (uint64_t)sq->qsize) << NVME_SQES));
+}
+
+/**
+ * nvme_mpsq_commit - Mark a reserved submission queue entry as ready
+ * @mpsq: &struct nvme_mpsq
+ * @ticket: Ticket returned by nvme_mpsq_reserve()
+ *
+ * Mark the entry as ready and submit it along with any other ready entries
+ * preceding it (see nvme_mpsq_publish()). The doorbell is written once all
+ * entries reserved before @ticket have been committed as well.
+ */
+static inline void nvme_mpsq_commit(struct nvme_mpsq *mpsq, uint64_t ticket)
+{
+	atomic_store_release(&mpsq->ready[ticket % (uint64_t)mpsq->sq->qsize], ticket + 1);
+
+	nvme_mpsq_publish(mpsq);
+}
+
+/**
+ * nvme_mpsq_post - Post a submission queue entry from any thread
+ * @mpsq: &struct nvme_mpsq
+ * @sqe: Submission queue entry
+ *
+ * Reserve an entry, copy @sqe to it and commit it.
+ */
+static inline void nvme_mpsq_post(struct nvme_mpsq *mpsq, const union nvme_cmd *sqe)
+{
+	uint64_t ticket;
+
+	nvme_mpsq_reserve(mpsq, &ticket);
+
+	__nvme_sq_copy(mpsq->sq, (uint16_t)(ticket % (uint64_t)mpsq->sq->qsize), sqe, 1);
+
+	nvme_mpsq_commit(mpsq, ticket);
+}
+
+/**
+ * nvme_mpsq_post_fused - Post a fused pair of submission queue entries from any
+ *                        thread
+ * @mpsq: &struct nvme_mpsq
+ * @sqes: The two submission queue entries of the fused operation
+ *
+ * Reserve two consecutive entries, copy @sqes to them and commit them such
+ * that they are always submitted by the same doorbell write, as fused
+ * operations require. The flags of @sqes must already be set up (see
+ * nvme_rq_mpsq_post_fused()).
+ */
+static inline void nvme_mpsq_post_fused(struct nvme_mpsq *mpsq, const union nvme_cmd *sqes)
+{
+	uint64_t qsize = (uint64_t)mpsq->sq->qsize;
+	uint64_t ticket = __atomic_fetch_add(&mpsq->reserved, 2, __ATOMIC_SEQ_CST);
+
+	__nvme_sq_copy(mpsq->sq, (uint16_t)(ticket % qsize), &sqes[0], 1);
+	__nvme_sq_copy(mpsq->sq, (uint16_t)((ticket + 1) % qsize), &sqes[1], 1);
+
+	/* publishing stops at the first entry until both are ready */
+	atomic_store_release(&mpsq->ready[(ticket + 1) % qsize], ticket + 2);
+
+	nvme_mpsq_commit(mpsq, ticket);
+}
+
+/* write the tail doorbell held back by automatic coalescing */
+static inline void __nvme_cq_flush_dbc(struct nvme_cq *cq)
+{
+	struct nvme_sq *sq = cq->dbc_sq;
+
+	cq->dbc_sq = NULL;
+
+	nvme_sq_flush_tail(sq);
 }
 
 /**
@@ -178,19 +932,84 @@ static inline struct nvme_cqe *nvme_cq_head(struct nvme_cq *cq)
 }
 
 /**
- * nvme_cq_update_head - Write the completion queue head doorbell
+ * nvme_cq_set_lazy_head - Set the lazy head doorbell policy
  * @cq: Completion queue
+ * @n: Minimum number of consumed entries before the head doorbell is written
+ *
+ * Let nvme_cq_update_head() defer writing the head doorbell until at least @n
+ * entries have been consumed since the last write, or half of the queue has
+ * been consumed, whichever comes first. Zero disables the policy (the default).
+ *
+ * Since the controller only needs the head doorbell to reclaim queue entries,
+ * deferring it does not delay completions.
  *
- * Write the completion queue head doorbell.
+ * To defer the head doorbell across a batch of completions (e.g. reaped with
+ * nvme_rq_wait()), set @n to the queue size and write it once with
+ * nvme_cq_commit_head() when done polling.
  */
-static inline void nvme_cq_update_head(struct nvme_cq *cq)
+static inline void nvme_cq_set_lazy_head(struct nvme_cq *cq, int n)
+{
+	cq->db_lazy = n;
+}
+
+static inline void __nvme_cq_write_head(struct nvme_cq *cq)
 {
+	trace_probe(NVME_CQ_UPDATE_HEAD, cq->id, cq->head);
+
 	trace_guard(NVME_CQ_UPDATE_HEAD) {
 		trace_emit("cqid %d head %d\n", cq->id, cq->head);
 	}
 
-	if (nvme_try_dbbuf(cq->head, &cq->dbbuf))
+	if (nvme_try_dbbuf(cq->head, &cq->dbbuf)) {
 		mmio_write32(cq->doorbell, cpu_to_le32(cq->head));
+
+		__nvme_qstat_add(cq, doorbells, 1);
+	} else {
+		__nvme_qstat_add(cq, dbbuf_skips, 1);
+	}
+
+	cq->phead = cq->head;
+}
+
+/**
+ * nvme_cq_commit_head - Write the completion queue head doorbell if needed
+ * @cq: Completion queue
+ *
+ * Like nvme_cq_update_head(), but ignore the lazy head policy and only write
+ * the doorbell if the head has advanced since the doorbell was last written.
+ */
+static inline void nvme_cq_commit_head(struct nvme_cq *cq)
+{
+	__nvme_qstat_add(cq, head_updates, 1);
+
+	if (cq->head == cq->phead)
+		return;
+
+	__nvme_cq_write_head(cq);
+}
+
+/**
+ * nvme_cq_update_head - Write the completion queue head doorbell
+ * @cq: Completion queue
+ *
+ * Write the completion queue head doorbell, subject to the lazy head policy
+ * (see nvme_cq_set_lazy_head()).
+ */
+static inline void nvme_cq_update_head(struct nvme_cq *cq)
+{
+	__nvme_qstat_add(cq, head_updates, 1);
+
+	if (cq->db_lazy) {
+		int consumed = (cq->head - cq->phead + cq->qsize) % cq->qsize;
+
+		if (consumed < cq->db_lazy && consumed < cq->qsize / 2) {
+			__nvme_qstat_add(cq, deferred, 1);
+
+			return;
+		}
+	}
+
+	__nvme_cq_write_head(cq);
 }
 
 /**
@@ -205,6 +1024,11 @@ static inline void nvme_cq_spin(struct nvme_cq *cq)
 {
 	struct nvme_cqe *cqe = nvme_cq_head(cq);
 
+	if (unlikely(cq->dbc_sq))
+		__nvme_cq_flush_dbc(cq);
+
+	trace_probe(NVME_CQ_SPIN, cq->id);
+
 	trace_guard(NVME_CQ_SPIN) {
 		trace_emit("cq %d\n", cq->id);
 	}
@@ -221,6 +1045,76 @@ static inline void nvme_cq_spin(struct nvme_cq *cq)
 		;
 }
 
+/**
+ * nvme_cq_pending - Check if a completion is available
+ * @cq: Completion queue
+ *
+ * Check the phase tag of the current head of @cq without consuming it. May be
+ * called by threads other than the one reaping @cq (e.g. to find a queue to
+ * steal from), in which case the result is a hint only.
+ *
+ * Return: ``true`` if the current head entry is valid, ``false`` otherwise.
+ */
+static inline bool nvme_cq_pending(struct nvme_cq *cq)
+{
+	uint16_t head = __atomic_load_n(&cq->head, __ATOMIC_RELAXED);
+	int phase = __atomic_load_n(&cq->phase, __ATOMIC_RELAXED);
+	struct nvme_cqe *cqe = (struct nvme_cqe *)(cq->vaddr + (head << NVME_CQES));
+
+	return (le16_to_cpu(LOAD(cqe->sfp)) & 0x1) != phase;
+}
+
+/**
+ * nvme_cq_trylock - Try to take the completion queue lock
+ * @cq: Completion queue
+ *
+ * The completion queue lock serializes reaping @cq between threads, e.g. the
+ * synchronous helpers (see nvme_sync()) or pollers stealing completions (see
+ * nvme_cq_steal()).
+ *
+ * Return: ``true`` if the lock was taken, ``false`` if it is held.
+ */
+static inline bool nvme_cq_trylock(struct nvme_cq *cq)
+{
+	return !__atomic_exchange_n(&cq->lock, 1, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * nvme_cq_lock - Take the completion queue lock
+ * @cq: Completion queue
+ *
+ * Spin until the lock is taken. See nvme_cq_trylock().
+ */
+static inline void nvme_cq_lock(struct nvme_cq *cq)
+{
+	while (!nvme_cq_trylock(cq))
+		;
+}
+
+/**
+ * nvme_cq_unlock - Release the completion queue lock
+ * @cq: Completion queue
+ */
+static inline void nvme_cq_unlock(struct nvme_cq *cq)
+{
+	atomic_store_release(&cq->lock, 0);
+}
+
+/*
+ * Record the submission queue head reported in @cqe (see nvme_sq_space()). The
+ * entry must have been ordered against the phase load with dma_rmb(). The
+ * identifier comes from the device; an out of range one is dropped.
+ */
+static inline void __nvme_cq_track_sqhd(struct nvme_cq *cq, struct nvme_cqe *cqe)
+{
+	uint16_t sqid = le16_to_cpu(cqe->sqid);
+
+	if (unlikely(sqid >= cq->nsqs))
+		return;
+
+	atomic_store_release(&cq->sqs[sqid].head, le16_to_cpu(cqe->sqhd));
+}
+
 /**
  * nvme_cq_get_cqe - Get a pointer to the current completion queue head and
  *                   advance it
@@ -239,12 +1133,24 @@ static inline struct nvme_cqe *nvme_cq_get_cqe(struct nvme_cq *cq)
 {
 	struct nvme_cqe *cqe = nvme_cq_head(cq);
 
+	if (unlikely(cq->dbc_sq))
+		__nvme_cq_flush_dbc(cq);
+
+	trace_probe(NVME_CQ_GET_CQE, cq->id);
+
 	trace_guard(NVME_CQ_GET_CQE) {
 		trace_emitrl(1, (uintptr_t)cq, "cq %d\n", cq->id);
 	}
 
-	if ((le16_to_cpu(LOAD(cqe->sfp)) & 0x1) == cq->phase)
+	if ((le16_to_cpu(LOAD(cqe->sfp)) & 0x1) == cq->phase) {
+		__nvme_qstat_add(cq, empty_polls, 1);
+
 		return NULL;
+	}
+
+	__nvme_qstat_add(cq, reaped, 1);
+
+	trace_probe(NVME_CQ_GOT_CQE, cq->id, cqe->cid);
 
 	trace_guard(NVME_CQ_GOT_CQE) {
 		trace_emit("cq %d cid %" PRIu16 "\n", cq->id, cqe->cid);
@@ -253,6 +1159,9 @@ static inline struct nvme_cqe *nvme_cq_get_cqe(struct nvme_cq *cq)
 	/* prevent load/load reordering between sfp and head */
 	dma_rmb();
 
+	if (cq->sqs)
+		__nvme_cq_track_sqhd(cq, cqe);
+
 	if (unlikely(++cq->head == cq->qsize)) {
 		cq->head = 0;
 		cq->phase ^= 0x1;
@@ -261,6 +1170,119 @@ static inline struct nvme_cqe *nvme_cq_get_cqe(struct nvme_cq *cq)
 	return cqe;
 }
 
+/**
+ * __nvme_cq_scan - Count valid completion queue entries
+ * @cq: Completion queue
+ * @max: Maximum number of entries to count
+ *
+ * Count the number of consecutive valid entries starting at the current head,
+ * following the ring around a wrap. Uses the fastest phase tag scanner
+ * supported by the host (selected at load time).
+ *
+ * This is an internal helper for nvme_cq_reap_batch() and does not include
+ * any read barrier.
+ *
+ * Return: The number of valid entries (at most @max).
+ */
+int __nvme_cq_scan(struct nvme_cq *cq, int max);
+
+/**
+ * nvme_cq_reap_batch - Get pointers to a run of valid completion queue entries
+ *                      and advance the head past them
+ * @cq: Completion queue
+ * @out: Array of at least @max pointers to fill
+ * @max: Maximum number of entries to reap
+ *
+ * Scan the completion queue from the current head and store a pointer to each
+ * consecutive entry with the right phase in @out, stopping at the first entry
+ * that is not yet valid (or when @max entries have been found). The scan is
+ * vectorized where the host supports it. A single ``dma_rmb()`` orders the
+ * phase loads against subsequent loads of the entries and the cache line at
+ * the new head is prefetched.
+ *
+ * The entries are not copied; the pointers remain valid until the completion
+ * queue head doorbell is written.
+ *
+ * Note: Does NOT update the cq head doorbell. See nvme_cq_update_head().
+ *
+ * Return: The number of entries stored in @out.
+ */
+static inline int nvme_cq_reap_batch(struct nvme_cq *cq, struct nvme_cqe **out, int max)
+{
+	struct nvme_cqe *cqe = nvme_cq_head(cq);
+	uint16_t head = cq->head;
+	int phase = cq->phase;
+	int n;
+
+	if (unlikely(cq->dbc_sq))
+		__nvme_cq_flush_dbc(cq);
+
+	/* keep empty polls cheap */
+	if (max <= 0 || (le16_to_cpu(LOAD(cqe->sfp)) & 0x1) == phase) {
+		__nvme_qstat_add(cq, empty_polls, 1);
+
+		return 0;
+	}
+
+	n = __nvme_cq_scan(cq, max);
+
+	/* prevent load/load reordering between sfp and the rest of the entries */
+	dma_rmb();
+
+	for (int i = 0; i < n; i++) {
+		out[i] = (struct nvme_cqe *)(cq->vaddr + (head << NVME_CQES));
+
+		if (cq->sqs)
+			__nvme_cq_track_sqhd(cq, out[i]);
+
+		if (unlikely(++head == cq->qsize)) {
+			head = 0;
+			phase ^= 0x1;
+		}
+	}
+
+	__builtin_prefetch(cq->vaddr + (head << NVME_CQES));
+
+	trace_probe(NVME_CQ_REAP_BATCH, cq->id, head, n);
+
+	trace_guard(NVME_CQ_REAP_BATCH) {
+		trace_emit("cq %d head %" PRIu16 " n %d\n", cq->id, head, n);
+	}
+
+	cq->head = head;
+	cq->phase = phase;
+
+	__nvme_qstat_add(cq, reaped, n);
+
+	return n;
+}
+
+/**
+ * nvme_sq_get_stats - Get submission queue counters
+ * @sq: Submission queue
+ * @stats: Output parameter for the counters
+ *
+ * Copy the counters of @sq (see &struct nvme_sq_stats) to @stats. Without
+ * ``NVME_QSTATS``, all counters are zero.
+ */
+static inline void nvme_sq_get_stats(struct nvme_sq *sq, struct nvme_sq_stats *stats)
+{
+	*stats = sq->stats;
+}
+
+/**
+ * nvme_cq_get_stats - Get completion queue counters
+ * @cq: Completion queue
+ * @stats: Output parameter for the counters
+ *
+ * Copy the counters of @cq (see &struct nvme_cq_stats) to @stats. Without
+ * ``NVME_QSTATS``, all counters are zero.
+ */
+static inline void nvme_cq_get_stats(struct nvme_cq *cq, struct nvme_cq_stats *stats)
+{
+	*stats = cq->stats;
+}
+
 /**
  * nvme_cq_get_cqes - Get an exact number of cqes from a completion queue
  * @cq: Completion queue
@@ -290,4 +1312,60 @@ void nvme_cq_get_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n);
  */
 int nvme_cq_wait_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n, struct timespec *ts);
 
+/**
+ * nvme_cq_get_fd - Get the interrupt eventfd of a completion queue
+ * @cq: Completion queue
+ *
+ * Get the eventfd that is signaled when the interrupt vector associated with
+ * @cq fires. The eventfd is non-blocking and may be added to an epoll set.
+ * Since the eventfd counter is not reset when completions are reaped by
+ * polling, consumers should drain it (read(2)) and re-check @cq before
+ * blocking on it (see nvme_cq_wait_hybrid()).
+ *
+ * Return: The eventfd or ``-1`` if @cq was not created with an interrupt
+ * vector (or shares it with another completion queue; see nvme_create_iocq()).
+ */
+static inline int nvme_cq_get_fd(struct nvme_cq *cq)
+{
+	return cq->efd;
+}
+
+/**
+ * nvme_cq_wait_hybrid - Wait for a completion by spinning, then blocking
+ * @cq: Completion queue
+ * @spin_usec: Number of microseconds to spin before blocking
+ * @ts: Maximum time to wait (or NULL to wait indefinitely)
+ *
+ * Spin on @cq for up to @spin_usec microseconds. If no completion queue entry
+ * became available, arm the interrupt (by draining the eventfd and re-checking
+ * the queue) and block on the eventfd (see nvme_cq_get_fd()) until a
+ * completion arrives. If @cq has no eventfd, keep spinning until @ts has
+ * elapsed.
+ *
+ * The entry is not consumed; use e.g. nvme_cq_get_cqe() or nvme_cq_process().
+ *
+ * Return: ``0`` when a completion queue entry is available, ``-1`` on error
+ * and sets ``errno`` (``ETIMEDOUT`` if @ts elapsed).
+ */
+int nvme_cq_wait_hybrid(struct nvme_cq *cq, unsigned int spin_usec, struct timespec *ts);
+
+/**
+ * nvme_cq_wait - Wait for a completion using the queue wait policy
+ * @cq: Completion queue
+ * @ts: Maximum time to wait (or NULL to wait indefinitely)
+ *
+ * Like nvme_cq_wait_hybrid(), but the spin budget is taken from
+ * &nvme_cq.poll. If the policy is adaptive, the library tracks a moving
+ * average of the time between completions and, similar to hybrid polling in
+ * the kernel, only spins if the next completion is expected within the
+ * configured maximum spin time. Otherwise, it blocks on the interrupt right
+ * away.
+ *
+ * The time spent spinning and blocked is accounted in &nvme_cq_poll.stats.
+ *
+ * Return: ``0`` when a completion queue entry is available, ``-1`` on error
+ * and sets ``errno`` (``ETIMEDOUT`` if @ts elapsed).
+ */
+int nvme_cq_wait(struct nvme_cq *cq, struct timespec *ts);
+
 #endif /* LIBVFN_NVME_QUEUE_H */
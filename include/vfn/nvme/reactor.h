@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_REACTOR_H
+#define LIBVFN_NVME_REACTOR_H
+
+/**
+ * DOC: Completion reactor
+ *
+ * A reactor owns a set of completion queues and reaps them on a dedicated
+ * thread (or whenever nvme_reactor_poll() is called). Completions are copied to
+ * single-producer/single-consumer rings, one per registered consumer, and
+ * routed by the submission queue of the command (see nvme_reactor_route()).
+ * Consumers (typically application worker threads) pick them up with
+ * nvme_reactor_consume() or nvme_reactor_process().
+ *
+ * If the ring of a consumer is full, the reactor stops reaping the completion
+ * queues routed to it until the consumer catches up. Entries are left in the
+ * completion queue (and the head doorbell is not advanced past them), so the
+ * back-pressure propagates to the controller instead of completions being
+ * dropped.
+ */
+
+#define NVME_REACTOR_MAX_CONSUMERS 64
+
+struct nvme_reactor;
+struct nvme_reactor_consumer;
+
+/**
+ * struct nvme_reactor_opts - Reactor options
+ * @cpu: CPU to pin the reaper thread to (``-1`` to not pin it)
+ * @batch: Maximum number of entries reaped from a completion queue at a time
+ *         (``0`` for the default)
+ * @idle_usec: Sleep time of the reaper thread after a pass that found no
+ *             completions (``0`` to busy poll)
+ */
+struct nvme_reactor_opts {
+	int cpu;
+	int batch;
+	unsigned int idle_usec;
+};
+
+/**
+ * struct nvme_reactor_stats - Reactor counters
+ * @reaped: Completions handed to consumers
+ * @stalls: Passes over a completion queue skipped because the ring of a
+ *          consumer was full
+ * @unrouted: Completions discarded because their submission queue was not
+ *            routed to any consumer
+ */
+struct nvme_reactor_stats {
+	uint64_t reaped;
+	uint64_t stalls;
+	uint64_t unrouted;
+};
+
+/**
+ * struct nvme_reactor_cqe - Completion record
+ * @rq: Request tracker associated with the completion
+ * @cqe: Copy of the completion queue entry
+ */
+struct nvme_reactor_cqe {
+	struct nvme_rq *rq;
+	struct nvme_cqe cqe;
+};
+
+/**
+ * nvme_reactor_create - Create a completion reactor
+ * @opts: Options (see &struct nvme_reactor_opts; NULL for the defaults)
+ *
+ * Create a reactor without any queues or consumers. The reaper thread is not
+ * started until nvme_reactor_start() is called.
+ *
+ * Return: The reactor on success, NULL on error and sets ``errno``.
+ */
+struct nvme_reactor *nvme_reactor_create(const struct nvme_reactor_opts *opts);
+
+/**
+ * nvme_reactor_destroy - Destroy a completion reactor
+ * @reactor: &struct nvme_reactor
+ *
+ * Stop the reaper thread (if running) and free the reactor and its consumers.
+ */
+void nvme_reactor_destroy(struct nvme_reactor *reactor);
+
+/**
+ * nvme_reactor_add_cq - Let a reactor reap a completion queue
+ * @reactor: &struct nvme_reactor
+ * @cq: Completion queue
+ *
+ * Must not be called while the reaper thread is running. The reactor takes over
+ * reaping @cq; no other thread may consume entries from it. Command timeouts
+ * (see nvme_timeout_init()) are not supported on @cq.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if command timeouts are enabled on @cq).
+ */
+int nvme_reactor_add_cq(struct nvme_reactor *reactor, struct nvme_cq *cq);
+
+/**
+ * nvme_reactor_add_consumer - Register a completion consumer
+ * @reactor: &struct nvme_reactor
+ * @nentries: Size of the completion ring (rounded up to a power of two)
+ *
+ * Must not be called while the reaper thread is running.
+ *
+ * Return: The consumer on success, NULL on error and sets ``errno``.
+ */
+struct nvme_reactor_consumer *nvme_reactor_add_consumer(struct nvme_reactor *reactor,
+							 unsigned int nentries);
+
+/**
+ * nvme_reactor_route - Route the completions of a submission queue to a
+ *                      consumer
+ * @reactor: &struct nvme_reactor
+ * @sq: Submission queue (its completion queue must have been added with
+ *      nvme_reactor_add_cq())
+ * @consumer: Consumer to receive the completions of commands posted to @sq
+ *
+ * Must not be called while the reaper thread is running.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_reactor_route(struct nvme_reactor *reactor, struct nvme_sq *sq,
+		       struct nvme_reactor_consumer *consumer);
+
+/**
+ * nvme_reactor_start - Start the reaper thread
+ * @reactor: &struct nvme_reactor
+ *
+ * Start a thread that calls nvme_reactor_poll() until nvme_reactor_stop() is
+ * called, pinned to &struct nvme_reactor_opts.cpu if given.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_reactor_start(struct nvme_reactor *reactor);
+
+/**
+ * nvme_reactor_stop - Stop the reaper thread
+ * @reactor: &struct nvme_reactor
+ *
+ * Stop the reaper thread and wait for it to exit. Completions already in the
+ * consumer rings remain there.
+ */
+void nvme_reactor_stop(struct nvme_reactor *reactor);
+
+/**
+ * nvme_reactor_poll - Reap all completion queues of a reactor once
+ * @reactor: &struct nvme_reactor
+ *
+ * Reap the completion queues of @reactor and hand the completions to the
+ * consumers. This is what the reaper thread runs; it may be called directly
+ * instead of starting the thread, but only from one thread at a time.
+ *
+ * Return: The number of completions handed to consumers.
+ */
+int nvme_reactor_poll(struct nvme_reactor *reactor);
+
+/**
+ * nvme_reactor_get_stats - Get reactor counters
+ * @reactor: &struct nvme_reactor
+ * @stats: Output parameter for the counters
+ *
+ * The counters are written by the reaping thread and read without
+ * synchronization.
+ */
+void nvme_reactor_get_stats(struct nvme_reactor *reactor, struct nvme_reactor_stats *stats);
+
+/**
+ * nvme_reactor_consume - Get completions from the ring of a consumer
+ * @consumer: &struct nvme_reactor_consumer
+ * @out: Array of at least @max records to fill
+ * @max: Maximum number of records to get
+ *
+ * Non-blocking. Must only be called by the thread owning @consumer.
+ *
+ * Return: The number of records stored in @out.
+ */
+int nvme_reactor_consume(struct nvme_reactor_consumer *consumer, struct nvme_reactor_cqe *out,
+			 int max);
+
+/**
+ * nvme_reactor_process - Process completions from the ring of a consumer
+ * @consumer: &struct nvme_reactor_consumer
+ * @budget: Maximum number of completions to process
+ *
+ * Like nvme_cq_process(), but for completions handed over by the reactor:
+ * invoke the callback registered with nvme_rq_submit() for each completion
+ * and release the request tracker, unless the callback resubmitted it. The
+ * tail doorbell of submission queues that callbacks posted to is written.
+ *
+ * Must only be called by the thread owning @consumer.
+ *
+ * Return: The number of completions processed.
+ */
+int nvme_reactor_process(struct nvme_reactor_consumer *consumer, int budget);
+
+#endif /* LIBVFN_NVME_REACTOR_H */
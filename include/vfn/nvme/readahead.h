@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_READAHEAD_H
+#define LIBVFN_NVME_READAHEAD_H
+
+/**
+ * DOC: Sequential readahead
+ *
+ * A &struct nvme_readahead streams a range of logical blocks of a namespace to
+ * a consumer. Reads of a fixed chunk size are kept in flight ahead of the
+ * consumer, spread round-robin over one or more I/O queues, into a ring of
+ * buffers that is allocated and mapped once (see iommu_alloc_node()). The
+ * consumer gets the chunks in order with nvme_readahead_next(), directly in the
+ * buffers the controller wrote them to, and gives each buffer back with
+ * nvme_readahead_release() when done with it.
+ *
+ * The number of reads in flight (the window) is bounded by the ring and, unless
+ * disabled, adapted to the bandwidth observed: after each epoch of as many
+ * completions as the window, the window keeps moving in the same direction if
+ * the bandwidth improved, turns around if it dropped and moves down if it did
+ * not change, so it settles at the smallest window that saturates the device.
+ *
+ * The reader processes the completion queues of its submission queues with
+ * nvme_cq_process(), so all commands on those queues must have been submitted
+ * with a completion callback (see nvme_rq_submit()). It must only be used by a
+ * single thread.
+ */
+
+struct nvme_readahead_slot;
+
+/**
+ * struct nvme_readahead - Sequential readahead reader
+ * @window: Maximum number of reads in flight; may be changed between calls
+ *          (between ``1`` and the depth of the ring)
+ * @adaptive: Adapt @window to the observed bandwidth (on by default)
+ *
+ * See nvme_readahead_init().
+ */
+struct nvme_readahead {
+	int window;
+	bool adaptive;
+
+	/* private: */
+	struct nvme_ctrl *ctrl;
+	struct nvme_ns *ns;
+
+	struct nvme_sq **sqs;
+	int nsqs, next_sq;
+
+	/* buffer ring */
+	void *vaddr;
+	uint64_t iova;
+	size_t len, chunk;
+	struct nvme_readahead_slot *slots;
+	int depth;
+
+	/*
+	 * Slots from @tail are handed out to the consumer (@held), followed by
+	 * those submitted and not yet handed out (@queued, of which @inflight
+	 * have not completed).
+	 */
+	int tail, held, queued, inflight;
+
+	/* progress of the current read in logical blocks */
+	uint64_t next, end;
+	int err;
+
+	/* bandwidth of the current and last epoch */
+	uint64_t epoch_start, epoch_bytes, bw;
+	int epoch_n, dir;
+};
+
+/**
+ * nvme_readahead_init - Initialize a sequential readahead reader
+ * @ra: &struct nvme_readahead
+ * @ctrl: &struct nvme_ctrl
+ * @sqs: I/O submission queues to read on (the array is copied)
+ * @nsqs: Number of queues in @sqs
+ * @chunk: Size of each read in bytes (must not exceed the maximum data transfer
+ *         size of @ctrl)
+ * @depth: Number of buffers in the ring
+ *
+ * Allocate and map a ring of @depth buffers of @chunk bytes each. The window
+ * starts at a quarter of @depth (at least one). The reader may be used for any
+ * number of reads (see nvme_readahead_start()), one at a time.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_readahead_init(struct nvme_readahead *ra, struct nvme_ctrl *ctrl, struct nvme_sq **sqs,
+			int nsqs, size_t chunk, int depth);
+
+/**
+ * nvme_readahead_fini - Release a sequential readahead reader
+ * @ra: &struct nvme_readahead
+ *
+ * Wait for any reads still in flight and release the buffer ring. Buffers
+ * handed out by nvme_readahead_next() are no longer valid.
+ */
+void nvme_readahead_fini(struct nvme_readahead *ra);
+
+/**
+ * nvme_readahead_start - Start reading a range of logical blocks
+ * @ra: &struct nvme_readahead
+ * @nsid: Namespace identifier (see nvme_ns_get())
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks to read
+ *
+ * Submit the reads of the first window; the rest are submitted as chunks are
+ * consumed. The chunk size must be a multiple of the logical block size of the
+ * namespace; the last chunk may be shorter.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EBUSY`` if a read is in progress).
+ */
+int nvme_readahead_start(struct nvme_readahead *ra, uint32_t nsid, uint64_t slba, uint64_t nlb);
+
+/**
+ * nvme_readahead_next - Get the next chunk of a sequential read
+ * @ra: &struct nvme_readahead
+ * @buf: Output parameter for the chunk data
+ *
+ * Reap the completion queues, submit reads into the free buffers and hand out
+ * the next chunk if it has been read. Does not block. The buffer stays valid
+ * until it is given back with nvme_readahead_release(); chunks must be given
+ * back in the order they were handed out, but several may be held at a time.
+ *
+ * Once a read fails, no more reads are submitted and the chunks before it are
+ * still handed out.
+ *
+ * Return: The length of the chunk in bytes, or ``0`` if it has not been read
+ * yet. At the end of the range, or if the read of the chunk failed, returns
+ * ``-1`` and sets ``errno`` (``ENODATA`` and ``EIO``, respectively).
+ */
+ssize_t nvme_readahead_next(struct nvme_readahead *ra, void **buf);
+
+/**
+ * nvme_readahead_release - Give back the oldest chunk handed out
+ * @ra: &struct nvme_readahead
+ *
+ * Release the buffer of the oldest chunk handed out by nvme_readahead_next()
+ * and reuse it for a read further ahead.
+ */
+void nvme_readahead_release(struct nvme_readahead *ra);
+
+#endif /* LIBVFN_NVME_READAHEAD_H */
@@ -13,26 +13,253 @@
 #ifndef LIBVFN_NVME_RQ_H
 #define LIBVFN_NVME_RQ_H
 
+struct nvme_rq;
+
+/**
+ * typedef nvme_rq_cb - Request completion callback
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cqe: Completion queue entry (&struct nvme_cqe)
+ * @arg: Opaque argument given to nvme_rq_submit()
+ *
+ * Invoked by nvme_cq_process() when the command associated with @rq completes.
+ * @cqe is only valid for the duration of the callback.
+ */
+typedef void (*nvme_rq_cb)(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg);
+
 /**
  * struct nvme_rq - Request tracker
  * @opaque: Opaque data pointer
+ * @buf: Pre-mapped data buffer (only if the queue was created with
+ *       nvme_create_iosq_buf())
+ *
+ * Trackers are cache line aligned, and the fields used when acquiring,
+ * submitting, completing and releasing a tracker share its first cache line
+ * (see tests/layout.c).
  */
 struct nvme_rq {
 	void *opaque;
 
 	/* private: */
 	struct nvme_sq *sq;
+	struct nvme_rq *rq_next;
+
+	/* owning cache (see nvme_rq_cache_init()) */
+	struct nvme_rq_cache *cache;
+
+	/* completion callback (see nvme_rq_submit()) */
+	nvme_rq_cb cb;
+	void *cb_arg;
 
 	uint16_t cid;
 
+	/* submission order in an ordered stream (see nvme_ostream_submit()) */
+	uint32_t seq;
+
+	/* public: */
+	struct {
+		void *vaddr;
+		uint64_t iova;
+		size_t len;
+	} buf;
+
+	/* private: */
 	struct {
 		void *vaddr;
 		uint64_t iova;
 	} page;
 
-	struct nvme_rq *rq_next;
+	/* extra prp list pages chained from @page (see nvme_rq_map_prp()) */
+	struct nvme_prp_page *prp_chain;
+
+	/* buffer that the prp list in @page was last built for */
+	struct {
+		uint64_t iova;
+		size_t len;
+	} prp_cache;
+
+	/* protection information verified on completion (see nvme_rq_set_pi()) */
+	struct nvme_pi *pi;
+
+	/* timer wheel linkage and deadline (see &struct nvme_timeout) */
+	struct nvme_rq *tmo_next, **tmo_pprev;
+	uint64_t tmo_expires;
+
+	/* time posted (ticks; see nvme_sq_set_latency_tracking()) */
+	uint64_t tsubmit;
+} __cacheline_aligned;
+
+/**
+ * struct nvme_rq_cache - Per-thread request tracker cache
+ *
+ * A set of request trackers taken from a submission queue and owned by a single
+ * thread (see nvme_rq_cache_init()). The owning thread acquires and releases
+ * trackers without atomic operations. Trackers released by other threads (e.g.
+ * when completions are reaped elsewhere) are pushed on a separate list that the
+ * owner reclaims in one go when its own free list runs dry, so remote releases
+ * do not contend on the owner's free list or on &struct nvme_sq.rq_top.
+ *
+ * Trackers are only ever removed from the remote list by atomically exchanging
+ * the entire list, so the list is not subject to the ABA problem.
+ */
+struct nvme_rq_cache {
+	/* private: */
+	struct nvme_sq *sq;
+
+	/* owner only */
+	struct nvme_rq *free;
+
+	/* released by other threads; kept on a separate cache line */
+	struct nvme_rq *remote __cacheline_aligned;
 };
 
+/*
+ * The free stacks of request trackers and of prp list pages are linked through
+ * &struct nvme_rq.rq_next and &struct nvme_prp_page.next, but their tops
+ * (&struct nvme_sq.rq_top and &struct nvme_sq.prp_top) are 64-bit words holding
+ * the index of the topmost element in &struct nvme_sq.rqs or &struct
+ * nvme_sq.prp_pages plus one (zero if the stack is empty) in the low half and a
+ * generation count in the high half. Every pop bumps the generation, such that
+ * a compare-and-swap fails if the topmost element was popped and pushed back in
+ * the meantime (the ABA problem).
+ */
+#define __NVME_TOP_GEN (1ULL << 32)
+#define __NVME_TOP_IDX (__NVME_TOP_GEN - 1)
+
+/**
+ * __nvme_rq_top - Get the request tracker referenced by a free stack top
+ * @sq: Submission queue (&struct nvme_sq)
+ * @top: Value of &struct nvme_sq.rq_top
+ *
+ * Return: The topmost &struct nvme_rq or NULL if the stack is empty.
+ */
+static inline struct nvme_rq *__nvme_rq_top(struct nvme_sq *sq, uint64_t top)
+{
+	uint64_t idx = top & __NVME_TOP_IDX;
+
+	return idx ? &sq->rqs[idx - 1] : NULL;
+}
+
+/**
+ * __nvme_rq_top_set - Make a free stack top
+ * @sq: Submission queue (&struct nvme_sq)
+ * @top: Value of &struct nvme_sq.rq_top to take the generation from
+ * @rq: New topmost &struct nvme_rq (or NULL)
+ *
+ * Return: The new value of &struct nvme_sq.rq_top.
+ */
+static inline uint64_t __nvme_rq_top_set(struct nvme_sq *sq, uint64_t top, struct nvme_rq *rq)
+{
+	return (top & ~__NVME_TOP_IDX) | (rq ? (uint64_t)(rq - sq->rqs) + 1 : 0);
+}
+
+/**
+ * __nvme_prp_top - Get the prp list page referenced by a free stack top
+ * @sq: Submission queue (&struct nvme_sq)
+ * @top: Value of &struct nvme_sq.prp_top
+ *
+ * Return: The topmost &struct nvme_prp_page or NULL if the pool is empty.
+ */
+static inline struct nvme_prp_page *__nvme_prp_top(struct nvme_sq *sq, uint64_t top)
+{
+	uint64_t idx = top & __NVME_TOP_IDX;
+
+	return idx ? &sq->prp_pages[idx - 1] : NULL;
+}
+
+/**
+ * __nvme_prp_top_set - Make a prp list page pool top
+ * @sq: Submission queue (&struct nvme_sq)
+ * @top: Value of &struct nvme_sq.prp_top to take the generation from
+ * @page: New topmost &struct nvme_prp_page (or NULL)
+ *
+ * Return: The new value of &struct nvme_sq.prp_top.
+ */
+static inline uint64_t __nvme_prp_top_set(struct nvme_sq *sq, uint64_t top,
+					  struct nvme_prp_page *page)
+{
+	return (top & ~__NVME_TOP_IDX) | (page ? (uint64_t)(page - sq->prp_pages) + 1 : 0);
+}
+
+/**
+ * __nvme_rq_release_prp_chain - Return chained prp list pages to the pool
+ * @rq: &struct nvme_rq
+ *
+ * Return the extra prp list pages held by @rq to the pool of its submission
+ * queue. Must only be called if &struct nvme_rq.prp_chain is set.
+ */
+static inline void __nvme_rq_release_prp_chain(struct nvme_rq *rq)
+{
+	struct nvme_sq *sq = rq->sq;
+	struct nvme_prp_page *first = rq->prp_chain, *last = first;
+	uint64_t top;
+
+	rq->prp_chain = NULL;
+
+	while (last->next)
+		last = last->next;
+
+	top = atomic_load_acquire(&sq->prp_top);
+
+	do {
+		last->next = __nvme_prp_top(sq, top);
+	} while (!atomic_cmpxchg(&sq->prp_top, top, __nvme_prp_top_set(sq, top, first)));
+}
+
+/**
+ * __nvme_timeout_add - Add a request tracker to the timer wheel
+ * @tmo: &struct nvme_timeout
+ * @rq: &struct nvme_rq with &struct nvme_rq.tmo_expires set
+ *
+ * Deadlines less than a wheel revolution away go into the first level;
+ * deadlines beyond the second level are parked in its last slot and placed
+ * again when that slot is cascaded.
+ */
+static inline void __nvme_timeout_add(struct nvme_timeout *tmo, struct nvme_rq *rq)
+{
+	const uint64_t mask = NVME_TIMEOUT_WHEEL_SIZE - 1;
+	uint64_t delta = rq->tmo_expires - tmo->clk, expires = rq->tmo_expires;
+	struct nvme_rq **slot;
+
+	if (delta <= mask) {
+		slot = &tmo->wheel[0][expires & mask];
+	} else {
+		if (delta >= NVME_TIMEOUT_WHEEL_SIZE * NVME_TIMEOUT_WHEEL_SIZE)
+			expires = tmo->clk + NVME_TIMEOUT_WHEEL_SIZE * NVME_TIMEOUT_WHEEL_SIZE - 1;
+
+		slot = &tmo->wheel[1][(expires >> NVME_TIMEOUT_WHEEL_BITS) & mask];
+	}
+
+	rq->tmo_next = *slot;
+	if (*slot)
+		(*slot)->tmo_pprev = &rq->tmo_next;
+
+	*slot = rq;
+	rq->tmo_pprev = slot;
+
+	tmo->armed++;
+}
+
+/**
+ * __nvme_timeout_del - Remove a request tracker from the timer wheel
+ * @tmo: &struct nvme_timeout
+ * @rq: &struct nvme_rq
+ *
+ * If the deadline of @rq is armed, disarm it.
+ */
+static inline void __nvme_timeout_del(struct nvme_timeout *tmo, struct nvme_rq *rq)
+{
+	if (!rq->tmo_pprev)
+		return;
+
+	*rq->tmo_pprev = rq->tmo_next;
+	if (rq->tmo_next)
+		rq->tmo_next->tmo_pprev = rq->tmo_pprev;
+
+	rq->tmo_pprev = NULL;
+
+	tmo->armed--;
+}
+
 /**
  * nvme_rq_reset - Reset a request tracker for reuse
  * @rq: &struct nvme_rq
@@ -42,6 +269,30 @@ struct nvme_rq {
 static inline void nvme_rq_reset(struct nvme_rq *rq)
 {
 	rq->opaque = NULL;
+	rq->pi = NULL;
+
+	if (rq->prp_chain)
+		__nvme_rq_release_prp_chain(rq);
+}
+
+/**
+ * __nvme_rq_cache_release_remote - Release a cached request tracker from any
+ *                                  thread
+ * @rq: &struct nvme_rq
+ *
+ * Push the request tracker on the remote list of its owning &struct
+ * nvme_rq_cache.
+ */
+static inline void __nvme_rq_cache_release_remote(struct nvme_rq *rq)
+{
+	struct nvme_rq_cache *cache = rq->cache;
+
+	nvme_rq_reset(rq);
+
+	rq->rq_next = atomic_load_acquire(&cache->remote);
+
+	while (!atomic_cmpxchg(&cache->remote, rq->rq_next, rq))
+		;
 }
 
 /**
@@ -49,15 +300,22 @@ static inline void nvme_rq_reset(struct nvme_rq *rq)
  * @rq: &struct nvme_rq
  *
  * Release the request tracker and push it on the request tracker free stack.
+ * If the tracker belongs to a &struct nvme_rq_cache, it is returned to the
+ * cache instead (see nvme_rq_cache_release()).
  */
 static inline void nvme_rq_release(struct nvme_rq *rq)
 {
 	struct nvme_sq *sq = rq->sq;
 
+	if (rq->cache) {
+		__nvme_rq_cache_release_remote(rq);
+		return;
+	}
+
 	nvme_rq_reset(rq);
 
-	rq->rq_next = sq->rq_top;
-	sq->rq_top = rq;
+	rq->rq_next = __nvme_rq_top(sq, sq->rq_top);
+	sq->rq_top = __nvme_rq_top_set(sq, sq->rq_top, rq);
 }
 
 /**
@@ -69,13 +327,20 @@ static inline void nvme_rq_release(struct nvme_rq *rq)
 static inline void nvme_rq_release_atomic(struct nvme_rq *rq)
 {
 	struct nvme_sq *sq = rq->sq;
+	uint64_t top;
+
+	if (rq->cache) {
+		__nvme_rq_cache_release_remote(rq);
+		return;
+	}
 
 	nvme_rq_reset(rq);
 
-	rq->rq_next = atomic_load_acquire(&sq->rq_top);
+	top = atomic_load_acquire(&sq->rq_top);
 
-	while (!atomic_cmpxchg(&sq->rq_top, rq->rq_next, rq))
-		;
+	do {
+		rq->rq_next = __nvme_rq_top(sq, top);
+	} while (!atomic_cmpxchg(&sq->rq_top, top, __nvme_rq_top_set(sq, top, rq)));
 }
 
 /**
@@ -91,14 +356,16 @@ static inline void nvme_rq_release_atomic(struct nvme_rq *rq)
  */
 static inline struct nvme_rq *nvme_rq_acquire(struct nvme_sq *sq)
 {
-	struct nvme_rq *rq = sq->rq_top;
+	struct nvme_rq *rq = __nvme_rq_top(sq, sq->rq_top);
 
 	if (!rq) {
+		__nvme_qstat_add(sq, busy, 1);
+
 		errno = EBUSY;
 		return NULL;
 	}
 
-	sq->rq_top = rq->rq_next;
+	sq->rq_top = __nvme_rq_top_set(sq, sq->rq_top + __NVME_TOP_GEN, rq->rq_next);
 
 	return rq;
 }
@@ -107,23 +374,104 @@ static inline struct nvme_rq *nvme_rq_acquire(struct nvme_sq *sq)
  * nvme_rq_acquire_atomic - Acquire a request tracker atomically
  * @sq: Submission queue (&struct nvme_sq)
  *
- * Lock-free (compare-and-swap) version of nvme_rq_acquire().
+ * Lock-free (compare-and-swap) version of nvme_rq_acquire(). The free stack top
+ * is tagged with a generation count, so a tracker acquired and released by
+ * another thread while the compare-and-swap is in progress is not handed out
+ * twice. When trackers are acquired on several threads, a &struct
+ * nvme_rq_cache per thread still avoids contending on the stack.
  *
  * Return: A &struct nvme_rq or NULL if none are available.
  */
 static inline struct nvme_rq *nvme_rq_acquire_atomic(struct nvme_sq *sq)
 {
-	struct nvme_rq *rq = atomic_load_acquire(&sq->rq_top);
+	uint64_t top = atomic_load_acquire(&sq->rq_top);
+	struct nvme_rq *rq;
 
-	while (rq && !atomic_cmpxchg(&sq->rq_top, rq, rq->rq_next))
-		;
+	do {
+		rq = __nvme_rq_top(sq, top);
+		if (!rq) {
+			__nvme_qstat_add(sq, busy, 1);
 
-	if (!rq)
-		errno = EBUSY;
+			errno = EBUSY;
+			return NULL;
+		}
+	} while (!atomic_cmpxchg(&sq->rq_top, top,
+				 __nvme_rq_top_set(sq, top + __NVME_TOP_GEN, rq->rq_next)));
 
 	return rq;
 }
 
+/**
+ * nvme_rq_cache_init - Populate a per-thread request tracker cache
+ * @cache: &struct nvme_rq_cache
+ * @sq: Submission queue (&struct nvme_sq)
+ * @n: Maximum number of request trackers to take from @sq
+ *
+ * Initialize @cache and move up to @n request trackers from the free stack of
+ * @sq (see nvme_rq_acquire_atomic()) to it. The calling thread becomes the
+ * owner of the cache.
+ *
+ * Return: The number of request trackers moved to the cache.
+ */
+int nvme_rq_cache_init(struct nvme_rq_cache *cache, struct nvme_sq *sq, int n);
+
+/**
+ * nvme_rq_cache_fini - Return cached request trackers to the submission queue
+ * @cache: &struct nvme_rq_cache
+ *
+ * Return all request trackers currently free in @cache to the free stack of the
+ * submission queue. Must be called by the owning thread when no trackers
+ * belonging to the cache are outstanding.
+ */
+void nvme_rq_cache_fini(struct nvme_rq_cache *cache);
+
+/**
+ * nvme_rq_cache_acquire - Acquire a request tracker from a cache
+ * @cache: &struct nvme_rq_cache
+ *
+ * Acquire a request tracker from the cache. Must only be called by the owning
+ * thread. If the local free list is empty, trackers released by other threads
+ * are reclaimed.
+ *
+ * Return: A &struct nvme_rq or NULL if none are available.
+ */
+static inline struct nvme_rq *nvme_rq_cache_acquire(struct nvme_rq_cache *cache)
+{
+	struct nvme_rq *rq = cache->free;
+
+	if (!rq) {
+		rq = atomic_xchg(&cache->remote, NULL);
+		if (!rq) {
+			__nvme_qstat_add(cache->sq, busy, 1);
+
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	cache->free = rq->rq_next;
+
+	return rq;
+}
+
+/**
+ * nvme_rq_cache_release - Release a request tracker to its cache
+ * @rq: &struct nvme_rq
+ *
+ * Release a request tracker acquired with nvme_rq_cache_acquire(). Must only be
+ * called by the owning thread of the cache; other threads may release the
+ * tracker with nvme_rq_release() or nvme_rq_release_atomic().
+ */
+static inline void nvme_rq_cache_release(struct nvme_rq *rq)
+{
+	struct nvme_rq_cache *cache = rq->cache;
+
+	nvme_rq_reset(rq);
+
+	rq->rq_next = cache->free;
+	cache->free = rq;
+}
+
 /**
  * __nvme_rq_from_cqe - Get the request tracker associated with completion queue
  *                      entry
@@ -168,6 +516,88 @@ static inline struct nvme_rq *nvme_rq_from_cqe(struct nvme_ctrl *ctrl, struct nv
 	return __nvme_rq_from_cqe(sq, cqe);
 }
 
+/**
+ * nvme_cq_sq_from_cqe - Get the submission queue of a completion queue entry
+ * @cq: Completion queue (&struct nvme_cq)
+ * @cqe: Completion queue entry (&struct nvme_cqe)
+ *
+ * Get the submission queue identified by &nvme_cqe.sqid among the submission
+ * queues sharing @cq. Unlike nvme_rq_from_cqe(), the identifier is only checked
+ * in debug builds.
+ *
+ * Return: The submission queue (see &struct nvme_sq).
+ */
+static inline struct nvme_sq *nvme_cq_sq_from_cqe(struct nvme_cq *cq, struct nvme_cqe *cqe)
+{
+	struct nvme_sq *sq = &cq->sqs[le16_to_cpu(cqe->sqid)];
+
+#ifdef DEBUG
+	assert(sq->cq == cq);
+#endif
+
+	return sq;
+}
+
+/**
+ * nvme_cq_rq_from_cqe - Get the request tracker associated with a completion
+ *                       queue entry
+ * @cq: Completion queue (&struct nvme_cq)
+ * @cqe: Completion queue entry (&struct nvme_cqe)
+ *
+ * Like nvme_rq_from_cqe(), but look up the submission queue among those sharing
+ * @cq (see nvme_cq_sq_from_cqe()) and only check the command identifier in
+ * debug builds.
+ *
+ * Return: The associated request tracker (see &struct nvme_rq).
+ */
+static inline struct nvme_rq *nvme_cq_rq_from_cqe(struct nvme_cq *cq, struct nvme_cqe *cqe)
+{
+	struct nvme_sq *sq = nvme_cq_sq_from_cqe(cq, cqe);
+
+#ifdef DEBUG
+	assert(cqe->cid < sq->qsize - 1);
+#endif
+
+	return __nvme_rq_from_cqe(sq, cqe);
+}
+
+/**
+ * nvme_sq_set_latency_tracking - Enable or disable command latency tracking
+ * @sq: Submission queue
+ * @enable: Whether to track command latencies
+ *
+ * Let nvme_rq_post() (and nvme_rq_post_batch(), nvme_rq_mpsq_post() and
+ * nvme_rq_submit()) timestamp request trackers of @sq and let nvme_cq_process()
+ * record the latency of each completed command in a histogram owned by @sq
+ * (see nvme_sq_get_latency()). Commands posted before tracking was enabled are
+ * not recorded. Disabling tracking discards the histogram.
+ *
+ * The cost is a timestamp per command posted with nvme_rq_post(),
+ * nvme_rq_submit() or nvme_rq_mpsq_post(), one per nvme_rq_post_batch() call
+ * and one per processed batch of completions; queues without tracking only
+ * test a pointer.
+ *
+ * The histogram is read and freed without synchronization, so this must be
+ * called by the thread processing the completion queue of @sq.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_sq_set_latency_tracking(struct nvme_sq *sq, bool enable);
+
+/**
+ * nvme_sq_get_latency - Get the command latency histogram
+ * @sq: Submission queue
+ * @lat: Output parameter for the histogram
+ *
+ * Copy the command latency histogram of @sq (see &struct nvme_sq_latency) to
+ * @lat.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOENT`` if latency tracking is not enabled).
+ */
+int nvme_sq_get_latency(struct nvme_sq *sq, struct nvme_sq_latency *lat);
+
 /**
  * nvme_rq_prep_cmd - Associate the request tracker with the given command
  * @rq: Request tracker (&struct nvme_rq)
@@ -180,24 +610,306 @@ static inline void nvme_rq_prep_cmd(struct nvme_rq *rq, union nvme_cmd *cmd)
 	cmd->cid = rq->cid;
 }
 
+static inline void __nvme_rq_stamp(struct nvme_rq *rq)
+{
+	if (rq->sq->lat)
+		rq->tsubmit = get_ticks();
+}
+
+/**
+ * nvme_rq_post - Post a command associated with a request tracker
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ *
+ * Prepare @cmd and post it to the submission queue associated with @rq. If
+ * latency tracking is enabled on the queue (see
+ * nvme_sq_set_latency_tracking()), @rq is timestamped.
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail().
+ */
 static inline void nvme_rq_post(struct nvme_rq *rq, union nvme_cmd *cmd)
 {
 	nvme_rq_prep_cmd(rq, cmd);
+	__nvme_rq_stamp(rq);
 	nvme_sq_post(rq->sq, cmd);
 }
 
+/**
+ * nvme_rq_mpsq_post - Post a command associated with a request tracker from any
+ *                     thread
+ * @rq: Request tracker (&struct nvme_rq)
+ * @mpsq: Multi-producer front-end of the submission queue of @rq
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ *
+ * Prepare @cmd and post it with nvme_mpsq_post(). Unlike nvme_rq_post(), the
+ * doorbell is written as well.
+ */
+static inline void nvme_rq_mpsq_post(struct nvme_rq *rq, struct nvme_mpsq *mpsq,
+				     union nvme_cmd *cmd)
+{
+	nvme_rq_prep_cmd(rq, cmd);
+	__nvme_rq_stamp(rq);
+	nvme_mpsq_post(mpsq, cmd);
+}
+
+/**
+ * nvme_rq_post_batch - Post multiple commands associated with request trackers
+ * @rqs: Array of request trackers (&struct nvme_rq)
+ * @cmds: Array of NVMe command prototypes (&union nvme_cmd)
+ * @n: Number of entries in @rqs and @cmds
+ *
+ * Prepare each command in @cmds with the command identifier of the request
+ * tracker at the same index in @rqs and post them all to the submission queue
+ * with nvme_sq_post_batch(). All request trackers must belong to the same
+ * submission queue.
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail().
+ */
+static inline void nvme_rq_post_batch(struct nvme_rq **rqs, union nvme_cmd *cmds, int n)
+{
+	if (n <= 0)
+		return;
+
+	for (int i = 0; i < n; i++)
+		nvme_rq_prep_cmd(rqs[i], &cmds[i]);
+
+	if (rqs[0]->sq->lat) {
+		uint64_t now = get_ticks();
+
+		for (int i = 0; i < n; i++)
+			rqs[i]->tsubmit = now;
+	}
+
+	nvme_sq_post_batch(rqs[0]->sq, cmds, n);
+}
+
+/* record the completion callback of @rq and arm its deadline */
+static inline void __nvme_rq_arm(struct nvme_rq *rq, nvme_rq_cb cb, void *arg)
+{
+	struct nvme_timeout *tmo = rq->sq->cq->tmo;
+
+	rq->cb = cb;
+	rq->cb_arg = arg;
+
+	if (tmo) {
+		rq->tmo_expires = (get_ticks() >> tmo->shift) + tmo->timeout;
+		__nvme_timeout_add(tmo, rq);
+	}
+}
+
+/**
+ * nvme_rq_submit - Post a command with a completion callback
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @cb: Completion callback (must not be NULL)
+ * @arg: Opaque argument passed to @cb
+ *
+ * Prepare @cmd, post it to the submission queue associated with @rq and
+ * record @cb to be invoked by nvme_cq_process() when the command completes.
+ * If timeouts are enabled on the completion queue (see nvme_timeout_init()),
+ * the deadline of the command is armed.
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail(). Submissions
+ * made from within a completion callback are flushed by nvme_cq_process().
+ */
+static inline void nvme_rq_submit(struct nvme_rq *rq, union nvme_cmd *cmd, nvme_rq_cb cb,
+				  void *arg)
+{
+	__nvme_rq_arm(rq, cb, arg);
+
+	nvme_rq_post(rq, cmd);
+}
+
+/**
+ * nvme_rq_prep_fused - Associate request trackers with a fused operation
+ * @first: Request tracker of the first command (&struct nvme_rq)
+ * @second: Request tracker of the second command (&struct nvme_rq)
+ * @cmds: The two NVMe command prototypes of the fused operation (e.g., a
+ *        Compare followed by a Write of the same logical blocks)
+ *
+ * Prepare @cmds as for nvme_rq_prep_cmd() and mark them as the first and second
+ * command of a fused operation. Both request trackers must belong to the same
+ * submission queue.
+ */
+static inline void nvme_rq_prep_fused(struct nvme_rq *first, struct nvme_rq *second,
+				      union nvme_cmd *cmds)
+{
+	nvme_rq_prep_cmd(first, &cmds[0]);
+	nvme_rq_prep_cmd(second, &cmds[1]);
+
+	cmds[0].flags = (uint8_t)((cmds[0].flags & ~NVME_CMD_FLAGS_FUSE_MASK) |
+				  NVME_CMD_FUSE_FIRST);
+	cmds[1].flags = (uint8_t)((cmds[1].flags & ~NVME_CMD_FLAGS_FUSE_MASK) |
+				  NVME_CMD_FUSE_SECOND);
+}
+
+/**
+ * nvme_rq_post_fused - Post a fused operation
+ * @first: Request tracker of the first command (&struct nvme_rq)
+ * @second: Request tracker of the second command (&struct nvme_rq)
+ * @cmds: The two NVMe command prototypes of the fused operation
+ *
+ * Prepare @cmds with nvme_rq_prep_fused() and post them to adjacent entries of
+ * the submission queue with nvme_sq_post_batch(), such that the next doorbell
+ * write submits both. Use nvme_rq_mpsq_post_fused() for queues posted to by
+ * several threads.
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail().
+ */
+static inline void nvme_rq_post_fused(struct nvme_rq *first, struct nvme_rq *second,
+				      union nvme_cmd *cmds)
+{
+	nvme_rq_prep_fused(first, second, cmds);
+	nvme_sq_post_batch(first->sq, cmds, 2);
+}
+
+/**
+ * nvme_rq_mpsq_post_fused - Post a fused operation from any thread
+ * @first: Request tracker of the first command (&struct nvme_rq)
+ * @second: Request tracker of the second command (&struct nvme_rq)
+ * @mpsq: Multi-producer front-end of the submission queue of the trackers
+ * @cmds: The two NVMe command prototypes of the fused operation
+ *
+ * Prepare @cmds with nvme_rq_prep_fused() and post them with
+ * nvme_mpsq_post_fused(). The doorbell is written as well.
+ */
+static inline void nvme_rq_mpsq_post_fused(struct nvme_rq *first, struct nvme_rq *second,
+					   struct nvme_mpsq *mpsq, union nvme_cmd *cmds)
+{
+	nvme_rq_prep_fused(first, second, cmds);
+	nvme_mpsq_post_fused(mpsq, cmds);
+}
+
+/**
+ * nvme_rq_submit_fused - Post a fused operation with a completion callback
+ * @first: Request tracker of the first command (&struct nvme_rq)
+ * @second: Request tracker of the second command (&struct nvme_rq)
+ * @cmds: The two NVMe command prototypes of the fused operation
+ * @cb: Completion callback (must not be NULL)
+ * @arg: Opaque argument passed to @cb
+ *
+ * Like nvme_rq_submit(), but post @cmds with nvme_rq_post_fused(). Each of the
+ * commands completes separately, so @cb is invoked twice (once for each request
+ * tracker). If one of the commands fails, the other one completes with the
+ * Operation Aborted due to Failed Fused Command status.
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail().
+ */
+static inline void nvme_rq_submit_fused(struct nvme_rq *first, struct nvme_rq *second,
+					union nvme_cmd *cmds, nvme_rq_cb cb, void *arg)
+{
+	__nvme_rq_arm(first, cb, arg);
+	__nvme_rq_arm(second, cb, arg);
+
+	nvme_rq_post_fused(first, second, cmds);
+}
+
+/**
+ * nvme_rq_set_pi - Verify protection information on completion
+ * @rq: Request tracker (&struct nvme_rq)
+ * @pi: Protection information of the command (&struct nvme_pi)
+ *
+ * Have the thread that reaps the completion of the command associated with @rq
+ * (nvme_cq_process(), nvme_admin_process() or the reactor thread) verify @pi
+ * (see nvme_pi_complete()) before the completion is delivered. Verification
+ * failures are reported in the completion queue entry. @pi must remain valid until the command
+ * completes; it is detached when @rq is released.
+ */
+static inline void nvme_rq_set_pi(struct nvme_rq *rq, struct nvme_pi *pi)
+{
+	rq->pi = pi;
+}
+
+/**
+ * nvme_cq_process - Process completions and invoke request callbacks
+ * @cq: Completion queue (&struct nvme_cq)
+ * @budget: Maximum number of completions to process
+ *
+ * Reap up to @budget completion queue entries (see nvme_cq_reap_batch()) and,
+ * for each entry, invoke the callback registered with nvme_rq_submit(). Unless
+ * the callback resubmitted it, the request tracker is released (see
+ * nvme_rq_release()) when the callback returns. Finally, the submission queue
+ * tail doorbell is written for any queue with new submissions and the
+ * completion queue head doorbell is written once. If timeouts are enabled on
+ * @cq, the deadlines of completed commands are disarmed and the commands that
+ * timed out are handled (see nvme_timeout_check()).
+ *
+ * Any number of submission queues may share @cq. Completions are looked up with
+ * nvme_cq_rq_from_cqe() and grouped by submission queue for each batch, such
+ * that the tail doorbell of each queue is written at most once per batch.
+ *
+ * Note: All commands completing on @cq must have been submitted with
+ * nvme_rq_submit().
+ *
+ * Return: The number of completions processed.
+ */
+int nvme_cq_process(struct nvme_cq *cq, int budget);
+
+/**
+ * __nvme_cq_process - Process completions without handling timeouts
+ * @cq: Completion queue (&struct nvme_cq)
+ * @budget: Maximum number of completions to process
+ *
+ * Like nvme_cq_process(), but do not handle commands that timed out (which
+ * issues Abort commands). Used when the controller may not be responding.
+ *
+ * Return: The number of completions processed.
+ */
+int __nvme_cq_process(struct nvme_cq *cq, int budget);
+
+/**
+ * nvme_cq_process_shared - Process completions of a completion queue that may
+ *                          be stolen from
+ * @cq: Completion queue (&struct nvme_cq)
+ * @budget: Maximum number of completions to process
+ *
+ * Like nvme_cq_process(), but with the completion queue lock held (see
+ * nvme_cq_trylock()). If the lock is held by another thread (which is then
+ * processing the completions), return immediately.
+ *
+ * When other threads may steal completions from @cq (see nvme_cq_steal()), the
+ * owner of @cq must process it with this function and callbacks may run on any
+ * of the stealing threads. The submission queues completing on @cq are then
+ * shared with the callbacks; the owner must hold the completion queue lock (see
+ * nvme_cq_lock()) when acquiring request trackers and submitting to them.
+ * Callbacks run with the lock held and may resubmit as usual.
+ *
+ * Return: The number of completions processed (``0`` if the lock is held).
+ */
+int nvme_cq_process_shared(struct nvme_cq *cq, int budget);
+
+/**
+ * nvme_cq_steal - Process completions on behalf of a busy peer
+ * @cqs: Completion queues of the peers
+ * @ncqs: Number of completion queues in @cqs
+ * @budget: Maximum number of completions to process
+ *
+ * Meant to be called by a poller that found its own completion queues empty.
+ * Look for a completion queue in @cqs with a completion available (see
+ * nvme_cq_pending()) that is not being processed, and process it with
+ * nvme_cq_process_shared(). The completion callbacks are invoked on the calling
+ * thread. Successive calls on a thread start from the queue following the one
+ * last stolen from.
+ *
+ * Return: The number of completions processed (``0`` if there was nothing to
+ * steal).
+ */
+int nvme_cq_steal(struct nvme_cq *const *cqs, int ncqs, int budget);
+
 /**
  * nvme_rq_exec - Execute the NVMe command on the submission queue associated
  *                with the given request tracker
  * @rq: Request tracker (&struct nvme_rq)
  * @cmd: NVMe command prototype (&union nvme_cmd)
  *
- * Prepare @cmd, post it to a submission queue and ring the doorbell.
+ * Prepare @cmd, post it to a submission queue and ring the doorbell (regardless
+ * of the doorbell batching policy, see nvme_sq_set_db_batch(), but subject to
+ * automatic doorbell coalescing, see nvme_sq_set_db_coalesce()).
  */
 static inline void nvme_rq_exec(struct nvme_rq *rq, union nvme_cmd *cmd)
 {
 	nvme_rq_post(rq, cmd);
-	nvme_sq_update_tail(rq->sq);
+	__nvme_sq_ring(rq->sq);
 }
 
 /**
@@ -210,13 +922,59 @@ static inline void nvme_rq_exec(struct nvme_rq *rq, union nvme_cmd *cmd)
  * @iova: I/O Virtual Address
  * @len: Length of buffer
  *
- * Map a buffer of size @len into the command payload.
+ * Map a buffer of size @len into the command payload. If the prp list does not
+ * fit in the prp list page of @rq, it is chained into extra list pages taken
+ * from the pool of the submission queue (see nvme_create_iosq()); they are
+ * returned when @rq is released.
  *
- * Return: ``0`` on success, ``-1`` on error and sets errno.
+ * If @rq last mapped a buffer starting at @iova that was at least @len bytes
+ * long (as is common when trackers are tied to ring buffer slots, see e.g.
+ * nvme_rq_map_own_buf()), the prp list it built is reused as is.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno (``EBUSY`` if the
+ * pool is exhausted).
  */
 int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, uint64_t iova,
 		    size_t len);
 
+/**
+ * nvme_rq_map_own_buf - Set up the data pointer of the command to point to the
+ *                       request tracker data buffer
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @len: Number of bytes of the buffer to map
+ *
+ * Map the first @len bytes of the pre-mapped data buffer of @rq (see
+ * nvme_create_iosq_buf()) into the command payload. Since the iova of the
+ * buffer is known, this does not require any address translation.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_map_own_buf(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+			size_t len);
+
+/**
+ * nvme_rq_map_fixed - Set up the data pointer of the command to point into a
+ *                     registered buffer
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @idx: Index of the registered buffer (see nvme_register_buffers())
+ * @ofst: Offset into the buffer
+ * @len: Number of bytes to map
+ *
+ * Map @len bytes at offset @ofst of a registered buffer into the command
+ * payload, using an SGL data block if supported (as nvme_rq_map() does). With
+ * PRPs, the prp list built at registration is referred to directly if the
+ * entries covering the range do not cross a page boundary. Otherwise, the list
+ * is built in the prp list page of @rq (see nvme_rq_map_prp()).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_map_fixed(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, int idx,
+		      size_t ofst, size_t len);
+
 /**
  * nvme_rq_mapv_prp - Set up the Physical Region Pages in the data pointer of
  *                    the command from an iovec.
@@ -228,13 +986,137 @@ int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *
  *
  * Map the IOVAs contained in @iov into the request PRPs. The first entry is
  * allowed to be unaligned, but the entry MUST end on a page boundary. All
- * subsequent entries MUST be page aligned.
+ * subsequent entries MUST be page aligned. Long prp lists are chained as for
+ * nvme_rq_map_prp().
  *
  * Return: ``0`` on success, ``-1`` on error and sets errno.
  */
 int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
 		     struct iovec *iov, int niov);
 
+/**
+ * nvme_rq_map_sgl - Set up a Scatter Gather List in the data pointer of the
+ *                   command from a buffer that is contiguous in iova mapped
+ *                   memory.
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @iova: I/O Virtual Address
+ * @len: Length of buffer
+ *
+ * Map a buffer of size @len into the command payload using a single SGL Data
+ * Block descriptor. The controller must support SGLs (see
+ * &nvme_ctrl.config.sgls) and the command must not be an admin command.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_map_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, uint64_t iova,
+		    size_t len);
+
+/**
+ * nvme_rq_mapv_sgl - Set up a Scatter Gather List in the data pointer of the
+ *                    command from an iovec.
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @iov: array of iovecs
+ * @niov: number of iovec in @iovec
+ *
+ * Map the IOVAs contained in @iov into the command payload. If @niov is
+ * larger than one, a Data Block descriptor is set up for each entry in the
+ * request tracker page and the command data pointer is set to a Last Segment
+ * descriptor pointing to it. Contrary to nvme_rq_mapv_prp(), the entries have
+ * no page alignment requirements (but may need to be dword aligned, depending
+ * on the controller).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_mapv_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		     struct iovec *iov, int niov);
+
+/**
+ * nvme_rq_prep_copy - Prepare a Copy command
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @ns: Namespace (see &struct nvme_ns)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @sdlba: Starting destination logical block address
+ * @ranges: Source ranges (see &struct nvme_rq_copy_range)
+ * @nr: Number of source ranges (at most 256)
+ * @fmt: Source range descriptor format (see &enum nvme_copy_format)
+ *
+ * Initialize @cmd as a Copy command that copies the logical blocks of @ranges,
+ * in order, to @sdlba and onwards. The source range descriptors are written to
+ * the request tracker page, which is also used as the data pointer, so no
+ * allocation or mapping is involved. With 4k controller pages, this holds 128
+ * descriptors of format 0 or 102 of format 1. Any prp list previously built in
+ * the page is invalidated.
+ *
+ * The destination protection information fields may be set with
+ * nvme_pi_prep_rw().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` to ``EINVAL``.
+ */
+int nvme_rq_prep_copy(struct nvme_ctrl *ctrl, struct nvme_rq *rq, struct nvme_ns *ns,
+		      union nvme_cmd *cmd, uint64_t sdlba, const struct nvme_rq_copy_range *ranges,
+		      int nr, enum nvme_copy_format fmt);
+
+/**
+ * nvme_rq_prep_dsm - Prepare a Dataset Management command
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @ns: Namespace (see &struct nvme_ns)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @ranges: Ranges (see &struct nvme_rq_dsm_range)
+ * @nr: Number of ranges (at most 256)
+ * @attrs: Combination of &enum nvme_dsm_attr (e.g., ``NVME_DSM_AD`` to
+ *         deallocate the ranges)
+ *
+ * Initialize @cmd as a Dataset Management command for @ranges. As for
+ * nvme_rq_prep_copy(), the range descriptors are written to the request tracker
+ * page.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` to ``EINVAL``.
+ */
+int nvme_rq_prep_dsm(struct nvme_ctrl *ctrl, struct nvme_rq *rq, struct nvme_ns *ns,
+		     union nvme_cmd *cmd, const struct nvme_rq_dsm_range *ranges, int nr,
+		     uint32_t attrs);
+
+/**
+ * nvme_rq_map - Set up the data pointer of the command from a buffer that is
+ *               contiguous in iova mapped memory.
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @iova: I/O Virtual Address
+ * @len: Length of buffer
+ *
+ * Use nvme_rq_map_sgl() if the controller supports SGLs and @rq is associated
+ * with an I/O queue. Otherwise, use nvme_rq_map_prp().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_map(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, uint64_t iova,
+		size_t len);
+
+/**
+ * nvme_rq_mapv - Set up the data pointer of the command from an iovec.
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @iov: array of iovecs
+ * @niov: number of iovec in @iovec
+ *
+ * Use nvme_rq_mapv_sgl() if the controller supports SGLs and @rq is associated
+ * with an I/O queue. Otherwise, use nvme_rq_mapv_prp().
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets errno.
+ */
+int nvme_rq_mapv(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		 struct iovec *iov, int niov);
+
 /**
  * nvme_rq_spin - Spin for completion of the command associated with the request
  *                tracker
@@ -259,6 +1141,9 @@ int nvme_rq_spin(struct nvme_rq *rq, struct nvme_cqe *cqe_copy);
  *
  * Like nvme_rq_spin(), but do not spin for more than @ts.
  *
+ * The completion queue head doorbell is written with nvme_cq_update_head() and
+ * is thus subject to the lazy head policy (see nvme_cq_set_lazy_head()).
+ *
  * Return: ``0`` on success, ``-1`` on error and set ``errno``.
  */
 int nvme_rq_wait(struct nvme_rq *rq, struct nvme_cqe *cqe_copy, struct timespec *ts);
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_RXRING_H
+#define LIBVFN_NVME_RXRING_H
+
+/**
+ * DOC: Zero-copy receive buffers
+ *
+ * A &struct nvme_rxring registers an io_uring provided buffer ring (see
+ * ``IORING_REGISTER_PBUF_RING``) whose buffers are carved out of DMA memory
+ * allocated and mapped once in the iommu context of the controller (see
+ * iommu_alloc_node()). Receives on the io_uring that select a buffer from the
+ * group (``IOSQE_BUFFER_SELECT``) thus land in memory that the controller can
+ * read, and received payloads are written to a namespace with
+ * nvme_rxring_write() by their I/O virtual addresses, without copying them.
+ *
+ * Buffers are reference counted. A buffer picked by a receive is owned by the
+ * application (see nvme_rxring_recv()), each write referring to it holds a
+ * reference until it completes, and the buffer is given back to the kernel
+ * once the last reference is dropped (see nvme_rxring_put()). A buffer may be
+ * referred to by several writes, e.g. if a payload straddles logical block
+ * boundaries of consecutive writes.
+ *
+ * The application owns the io_uring and submits the receives; the buffer ring
+ * must only be used by a single thread (the one processing the completion
+ * queue of the writes).
+ */
+
+/* maximum number of buffer segments in one write */
+#define NVME_RXRING_SEGS_MAX 16
+
+struct nvme_rxring_write;
+
+/**
+ * struct nvme_rxring - Provided buffer ring in DMA memory
+ * @vaddr: Base address of the buffers
+ * @iova: I/O virtual address of @vaddr
+ * @buf_size: Size of each buffer in bytes
+ * @nbufs: Number of buffers
+ * @bgid: Buffer group identifier
+ * @recycled: Number of buffers given back to the kernel
+ *
+ * See nvme_rxring_init().
+ */
+struct nvme_rxring {
+	void *vaddr;
+	uint64_t iova;
+	size_t buf_size;
+	unsigned int nbufs;
+	uint16_t bgid;
+
+	uint64_t recycled;
+
+	/* private: */
+	struct nvme_ctrl *ctrl;
+	int uring_fd;
+
+	/* the shared ring (struct io_uring_buf_ring) */
+	void *br;
+	size_t br_len;
+	uint16_t tail;
+
+	/* references per buffer; zero while owned by the kernel */
+	uint16_t *refs;
+
+	/* write contexts */
+	struct nvme_rxring_write *writes, *free;
+};
+
+/**
+ * struct nvme_rxring_seg - Part of a receive buffer
+ * @bid: Buffer identifier
+ * @offset: Offset into the buffer in bytes
+ * @len: Length in bytes
+ */
+struct nvme_rxring_seg {
+	uint16_t bid;
+	uint32_t offset;
+	uint32_t len;
+};
+
+/**
+ * nvme_rxring_init - Register a provided buffer ring in DMA memory
+ * @rx: &struct nvme_rxring
+ * @ctrl: &struct nvme_ctrl
+ * @uring_fd: io_uring file descriptor
+ * @bgid: Buffer group identifier to register
+ * @nbufs: Number of buffers (a power of two, at most 32768)
+ * @buf_size: Size of each buffer in bytes (a non-zero multiple of four)
+ *
+ * Allocate @nbufs contiguous buffers of @buf_size bytes in the iommu context of
+ * @ctrl, register them with the io_uring as buffer group @bgid and hand all of
+ * them to the kernel. A multiple of the page size for @buf_size keeps whole
+ * buffers mappable with PRPs (see nvme_rxring_write()).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOTSUP`` if libvfn was built without provided buffer ring
+ * support).
+ */
+int nvme_rxring_init(struct nvme_rxring *rx, struct nvme_ctrl *ctrl, int uring_fd, uint16_t bgid,
+		     unsigned int nbufs, size_t buf_size);
+
+/**
+ * nvme_rxring_fini - Unregister a provided buffer ring
+ * @rx: &struct nvme_rxring
+ *
+ * Unregister the buffer group and release the buffers. There must be no
+ * receives selecting from the group and no writes in flight.
+ */
+void nvme_rxring_fini(struct nvme_rxring *rx);
+
+/**
+ * nvme_rxring_recv - Take ownership of the buffer of a receive
+ * @rx: &struct nvme_rxring
+ * @cqe_flags: Flags of the io_uring completion queue entry of the receive
+ *
+ * Return: On success, returns the buffer identifier, holding a reference to
+ * the buffer for the application. On error, returns ``-1`` and sets ``errno``
+ * (``ENOBUFS`` if the receive did not pick a buffer).
+ */
+int nvme_rxring_recv(struct nvme_rxring *rx, uint32_t cqe_flags);
+
+/**
+ * nvme_rxring_put - Drop a reference to a receive buffer
+ * @rx: &struct nvme_rxring
+ * @bid: Buffer identifier
+ *
+ * Once the last reference is dropped, the buffer is given back to the kernel
+ * for another receive.
+ */
+void nvme_rxring_put(struct nvme_rxring *rx, uint16_t bid);
+
+/**
+ * nvme_rxring_buf - Get the address of a receive buffer
+ * @rx: &struct nvme_rxring
+ * @bid: Buffer identifier
+ *
+ * Return: The virtual address of buffer @bid.
+ */
+static inline void *nvme_rxring_buf(struct nvme_rxring *rx, uint16_t bid)
+{
+	return (char *)rx->vaddr + (size_t)bid * rx->buf_size;
+}
+
+/**
+ * nvme_rxring_write - Write receive buffer segments to a namespace
+ * @rx: &struct nvme_rxring
+ * @rq: Request tracker (&struct nvme_rq)
+ * @ns: Namespace (see &struct nvme_ns)
+ * @slba: Starting logical block address
+ * @segs: Buffer segments (see &struct nvme_rxring_seg), in order
+ * @nsegs: Number of segments (at most NVME_RXRING_SEGS_MAX)
+ * @cb: Completion callback (see nvme_rq_submit())
+ * @arg: Opaque argument passed to @cb
+ *
+ * Prepare a Write command for the concatenated segments, map them by their I/O
+ * virtual addresses (see nvme_rq_mapv()) and submit it. Each segment holds a
+ * reference to its buffer until the command completes; the references are
+ * dropped after @cb returns. The total length must be a multiple of the logical
+ * block size. With PRPs, all segments but the first must start on a page
+ * boundary and all but the last must end on one; SGLs (if supported by the
+ * controller) have no such restriction.
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if the segments cannot be written as one command,
+ * ``EBUSY`` if there are too many writes in flight).
+ */
+int nvme_rxring_write(struct nvme_rxring *rx, struct nvme_rq *rq, struct nvme_ns *ns,
+		      uint64_t slba, const struct nvme_rxring_seg *segs, int nsegs, nvme_rq_cb cb,
+		      void *arg);
+
+#endif /* LIBVFN_NVME_RXRING_H */
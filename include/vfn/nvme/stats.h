@@ -0,0 +1,316 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_STATS_H
+#define LIBVFN_NVME_STATS_H
+
+/**
+ * DOC: Shared memory statistics
+ *
+ * A controller may export its counters in a shared memory segment (a memfd or
+ * a file, e.g. in ``/dev/shm``; see nvme_stats_export()), such that external
+ * scrapers (e.g., ``vfnstat``) can collect them without any cooperation from
+ * the process driving the controller.
+ *
+ * The segment consists of a &struct nvme_stats_header, followed by a &struct
+ * nvme_stats_ctrl block and &nvme_stats_header.nqueues &struct
+ * nvme_stats_queue blocks (one per queue identifier, starting with the admin
+ * queue), each at a multiple of &nvme_stats_header.block_size. Each block has a
+ * single writer (the thread owning the queue), which updates it with plain
+ * stores bracketed by a sequence count; readers in other processes take a
+ * consistent copy with nvme_stats_read_queue() and nvme_stats_read_ctrl().
+ *
+ * Queue blocks are updated by the owner of the queue with
+ * nvme_stats_submitted(), nvme_stats_completed() and nvme_stats_sync_queue();
+ * the library does not update them on its own. The latency histogram recorded
+ * by the library (see nvme_sq_set_latency_tracking()) is published by
+ * nvme_stats_sync_queue() as well.
+ */
+
+#define NVME_STATS_MAGIC "VFNSTATS"
+#define NVME_STATS_VERSION 2
+
+#define NVME_STATS_HIST_BUCKETS 32
+
+/**
+ * struct nvme_stats_header - Statistics segment header
+ * @magic: NVME_STATS_MAGIC (not NUL-terminated)
+ * @version: NVME_STATS_VERSION
+ * @nqueues: number of &struct nvme_stats_queue blocks
+ * @block_size: size of each block in bytes (the stride of the blocks)
+ * @rsvd: reserved
+ * @ticks_freq: tick frequency (ticks per second) of the exporting process
+ * @name: name of the controller (its pci address; NUL-terminated)
+ */
+struct nvme_stats_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nqueues;
+	uint32_t block_size;
+	uint32_t rsvd;
+	uint64_t ticks_freq;
+	char name[32];
+};
+
+/**
+ * struct nvme_stats_ctrl - Per-controller counter block
+ * @seq: sequence count (odd while the block is updated)
+ * @aens: number of asynchronous events reaped by the admin completion
+ *        demultiplexer
+ * @resets: number of controller resets (see nvme_reset())
+ */
+struct nvme_stats_ctrl {
+	uint64_t seq;
+	uint64_t aens;
+	uint64_t resets;
+};
+
+/**
+ * struct nvme_stats_queue - Per-queue counter block
+ * @seq: sequence count (odd while the block is updated)
+ * @qid: queue identifier
+ * @rsvd: reserved
+ * @submitted: number of commands submitted
+ * @completed: number of commands completed
+ * @errors: number of commands completed with an error status
+ * @posted: submission queue entries posted (see &struct nvme_sq_stats)
+ * @sq_doorbells: tail doorbell writes (see &struct nvme_sq_stats)
+ * @busy: failed request tracker acquisitions (see &struct nvme_sq_stats)
+ * @reaped: completion queue entries consumed (see &struct nvme_cq_stats)
+ * @cq_doorbells: head doorbell writes (see &struct nvme_cq_stats)
+ * @empty_polls: completion queue polls that found nothing (see &struct
+ *               nvme_cq_stats)
+ * @latency_ns: command latency histogram; bucket ``i`` counts latencies of
+ *              ``2^i`` up to ``2^(i+1)`` nanoseconds (the first bucket also
+ *              counts shorter and the last bucket also counts longer
+ *              latencies)
+ * @lat_count: number of commands recorded by library latency tracking (see
+ *             nvme_sq_set_latency_tracking())
+ * @lat_sum_ns: sum of the recorded latencies in nanoseconds
+ * @lat_max_ns: largest recorded latency in nanoseconds
+ * @lat_hist: log-linear histogram of the recorded latencies (see &struct
+ *            nvme_sq_latency and nvme_lat_hist_lower())
+ */
+struct nvme_stats_queue {
+	uint64_t seq;
+	uint32_t qid;
+	uint32_t rsvd;
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t errors;
+	uint64_t posted;
+	uint64_t sq_doorbells;
+	uint64_t busy;
+	uint64_t reaped;
+	uint64_t cq_doorbells;
+	uint64_t empty_polls;
+	uint64_t latency_ns[NVME_STATS_HIST_BUCKETS];
+	uint64_t lat_count;
+	uint64_t lat_sum_ns;
+	uint64_t lat_max_ns;
+	uint64_t lat_hist[NVME_LAT_HIST_BUCKETS];
+};
+
+__static_assert(sizeof(struct nvme_stats_header) == 64);
+__static_assert(sizeof(struct nvme_stats_queue) == 1392);
+
+/* blocks are cache line aligned such that writers do not share lines */
+#define NVME_STATS_BLOCK_SIZE ALIGN_UP(sizeof(struct nvme_stats_queue), 64)
+
+/**
+ * nvme_stats_export - Export the counters of a controller in shared memory
+ * @ctrl: &struct nvme_ctrl
+ * @path: file to create (or ``NULL`` to create an anonymous memfd)
+ *
+ * Create the statistics segment of @ctrl with a block for each queue
+ * identifier that @ctrl may use. The segment is unmapped by nvme_close(); a
+ * file at @path is left in place.
+ *
+ * Return: On success, returns a file descriptor for the segment (owned by
+ * @ctrl; readers may open @path or receive a duplicate). On error, returns
+ * ``-1`` and sets ``errno`` (``EBUSY`` if the counters are already exported).
+ */
+int nvme_stats_export(struct nvme_ctrl *ctrl, const char *path);
+
+/**
+ * nvme_stats_unexport - Remove the statistics segment of a controller
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Unmap the segment and close its file descriptor. Called by nvme_close().
+ */
+void nvme_stats_unexport(struct nvme_ctrl *ctrl);
+
+static inline void __nvme_stats_write_begin(uint64_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void __nvme_stats_write_end(uint64_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * nvme_stats_ctrl - Get the per-controller counter block
+ * @ctrl: &struct nvme_ctrl
+ *
+ * Return: The &struct nvme_stats_ctrl of @ctrl, or ``NULL`` if the counters are
+ * not exported.
+ */
+static inline struct nvme_stats_ctrl *nvme_stats_ctrl(struct nvme_ctrl *ctrl)
+{
+	if (!ctrl->stats.base)
+		return NULL;
+
+	return (struct nvme_stats_ctrl *)((char *)ctrl->stats.base + NVME_STATS_BLOCK_SIZE);
+}
+
+/**
+ * nvme_stats_queue - Get the counter block of a queue
+ * @ctrl: &struct nvme_ctrl
+ * @qid: queue identifier
+ *
+ * Return: The &struct nvme_stats_queue of queue @qid, or ``NULL`` if the
+ * counters are not exported.
+ */
+static inline struct nvme_stats_queue *nvme_stats_queue(struct nvme_ctrl *ctrl, int qid)
+{
+	if (!ctrl->stats.base || qid < 0 || qid >= ctrl->stats.nqueues)
+		return NULL;
+
+	return (struct nvme_stats_queue *)((char *)ctrl->stats.base +
+					   (size_t)(qid + 2) * NVME_STATS_BLOCK_SIZE);
+}
+
+/**
+ * nvme_stats_submitted - Count submitted commands
+ * @q: &struct nvme_stats_queue
+ * @n: number of commands
+ */
+static inline void nvme_stats_submitted(struct nvme_stats_queue *q, unsigned int n)
+{
+	__nvme_stats_write_begin(&q->seq);
+	q->submitted += n;
+	__nvme_stats_write_end(&q->seq);
+}
+
+/**
+ * nvme_stats_completed - Count a completed command
+ * @q: &struct nvme_stats_queue
+ * @cqe: completion queue entry of the command
+ * @ticks: latency of the command in ticks (see get_ticks())
+ */
+static inline void nvme_stats_completed(struct nvme_stats_queue *q, struct nvme_cqe *cqe,
+					uint64_t ticks)
+{
+	uint64_t ns = ticks_to_ns(ticks);
+	unsigned int i = ns > 1 ? 63 - (unsigned int)__builtin_clzll(ns) : 0;
+
+	if (i >= NVME_STATS_HIST_BUCKETS)
+		i = NVME_STATS_HIST_BUCKETS - 1;
+
+	__nvme_stats_write_begin(&q->seq);
+
+	q->completed++;
+	q->latency_ns[i]++;
+
+	if (le16_to_cpu(cqe->sfp) >> 1)
+		q->errors++;
+
+	__nvme_stats_write_end(&q->seq);
+}
+
+/**
+ * nvme_stats_sync_queue - Copy the queue counters of a queue pair
+ * @q: &struct nvme_stats_queue
+ * @sq: submission queue
+ *
+ * Copy the counters of @sq and its completion queue (see &struct nvme_sq_stats
+ * and &struct nvme_cq_stats) to @q. The counters are only maintained if
+ * libvfn is configured with ``-Dqstats=true``. If latency tracking is enabled
+ * on @sq (see nvme_sq_set_latency_tracking()), its histogram is copied as well.
+ */
+static inline void nvme_stats_sync_queue(struct nvme_stats_queue *q, struct nvme_sq *sq)
+{
+	__nvme_stats_write_begin(&q->seq);
+
+	q->posted = sq->stats.posted;
+	q->sq_doorbells = sq->stats.doorbells;
+	q->busy = sq->stats.busy;
+	q->reaped = sq->cq->stats.reaped;
+	q->cq_doorbells = sq->cq->stats.doorbells;
+	q->empty_polls = sq->cq->stats.empty_polls;
+
+	if (sq->lat) {
+		q->lat_count = sq->lat->count;
+		q->lat_sum_ns = sq->lat->sum_ns;
+		q->lat_max_ns = sq->lat->max_ns;
+
+		memcpy(q->lat_hist, sq->lat->buckets, sizeof(q->lat_hist));
+	}
+
+	__nvme_stats_write_end(&q->seq);
+}
+
+/**
+ * struct nvme_stats_reader - Statistics segment reader
+ * @hdr: segment header
+ *
+ * See nvme_stats_open().
+ */
+struct nvme_stats_reader {
+	const struct nvme_stats_header *hdr;
+
+	/* private: */
+	size_t len;
+};
+
+/**
+ * nvme_stats_open - Map a statistics segment for reading
+ * @reader: &struct nvme_stats_reader
+ * @fd: file descriptor of the segment (see nvme_stats_export())
+ *
+ * Map the segment read-only and check its header. @fd may be closed
+ * afterwards.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if @fd is not a statistics segment of a supported
+ * version).
+ */
+int nvme_stats_open(struct nvme_stats_reader *reader, int fd);
+
+/**
+ * nvme_stats_close - Unmap a statistics segment
+ * @reader: &struct nvme_stats_reader
+ */
+void nvme_stats_close(struct nvme_stats_reader *reader);
+
+/**
+ * nvme_stats_read_ctrl - Read the per-controller counters
+ * @reader: &struct nvme_stats_reader
+ * @ctrl: output parameter for a consistent copy of the block
+ */
+void nvme_stats_read_ctrl(struct nvme_stats_reader *reader, struct nvme_stats_ctrl *ctrl);
+
+/**
+ * nvme_stats_read_queue - Read the counters of a queue
+ * @reader: &struct nvme_stats_reader
+ * @qid: queue identifier
+ * @q: output parameter for a consistent copy of the block
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if there is no block for @qid).
+ */
+int nvme_stats_read_queue(struct nvme_stats_reader *reader, int qid, struct nvme_stats_queue *q);
+
+#endif /* LIBVFN_NVME_STATS_H */
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_TIMEOUT_H
+#define LIBVFN_NVME_TIMEOUT_H
+
+/**
+ * DOC: Command timeouts
+ *
+ * A &struct nvme_timeout tracks a deadline for every command submitted with
+ * nvme_rq_submit() to a submission queue associated with a completion queue
+ * that has timeouts enabled (see nvme_timeout_init()). Deadlines are kept in a
+ * two-level hierarchical timer wheel with a resolution of roughly a
+ * millisecond; arming a deadline on submission and disarming it on completion
+ * are constant time list operations, and the wheel is advanced by
+ * nvme_cq_process() at an amortized constant cost per poll.
+ *
+ * When a command times out, its request tracker is held and an Abort command
+ * is submitted on the admin queue without waiting for it; the Abort completes
+ * as the admin queue is reaped, which nvme_timeout_check() does while Abort
+ * commands are in flight. The completion callback of the command is not
+ * invoked until both the Abort command and the command itself completed (the
+ * latter with a Command Abort Requested status if it was aborted) or the
+ * controller is reset (see nvme_recover()), such that neither the command
+ * identifier nor the data buffer is reused while the controller may still own
+ * them. If the controller
+ * could not abort the command (see &struct nvme_timeout.abort_failed), the
+ * tracker stays held until then; the controller should be reset.
+ *
+ * Submission and completion processing for the completion queue must happen
+ * on the same thread.
+ */
+
+#define NVME_TIMEOUT_WHEEL_BITS 6
+#define NVME_TIMEOUT_WHEEL_SIZE (1 << NVME_TIMEOUT_WHEEL_BITS)
+
+/**
+ * struct nvme_timeout - Command timeout tracking
+ * @expired: Number of commands that timed out
+ * @abort_failed: Number of timed out commands that the controller did not
+ *                abort
+ */
+struct nvme_timeout {
+	uint64_t expired;
+	uint64_t abort_failed;
+
+	/* private: */
+	struct nvme_ctrl *ctrl;
+	struct nvme_cq *cq;
+
+	/* the wheel clock counts jiffies of 2^shift ticks */
+	unsigned int shift;
+	uint64_t timeout;
+	uint64_t clk;
+
+	unsigned int armed;
+
+	struct nvme_rq *wheel[2][NVME_TIMEOUT_WHEEL_SIZE];
+
+	/* timed out commands held until the controller completes them */
+	struct nvme_timeout_held *held;
+	unsigned int nheld;
+
+	/* Abort commands in flight */
+	unsigned int aborting;
+};
+
+/**
+ * nvme_timeout_init - Enable command timeouts on a completion queue
+ * @tmo: &struct nvme_timeout to initialize
+ * @ctrl: &struct nvme_ctrl
+ * @cq: I/O completion queue (&struct nvme_cq)
+ * @timeout_ms: Command timeout in milliseconds
+ *
+ * Track a deadline of @timeout_ms for each command subsequently submitted to a
+ * submission queue that completes on @cq. Must not be called while commands
+ * are outstanding on @cq.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` to ``EINVAL`` (if @cq is the admin completion queue or reaped by a
+ * reactor (see nvme_reactor_add_cq()), or @timeout_ms is zero).
+ */
+int nvme_timeout_init(struct nvme_timeout *tmo, struct nvme_ctrl *ctrl, struct nvme_cq *cq,
+		      unsigned int timeout_ms);
+
+/**
+ * nvme_timeout_fini - Disable command timeouts
+ * @tmo: &struct nvme_timeout
+ *
+ * Stop tracking (and disarm the deadlines of) commands on the completion queue
+ * of @tmo. Commands that timed out and completed are handed to their
+ * callbacks; the others stay held until the controller completes them.
+ */
+void nvme_timeout_fini(struct nvme_timeout *tmo);
+
+/**
+ * nvme_timeout_check - Handle command timeouts
+ * @tmo: &struct nvme_timeout
+ *
+ * Advance the timer wheel to the current time and abort the commands that
+ * timed out, and reap the admin queue while Abort commands are in flight. This
+ * is done by nvme_cq_process(); call it directly if the completion queue is
+ * idle and not polled.
+ *
+ * Return: The number of commands that timed out.
+ */
+int nvme_timeout_check(struct nvme_timeout *tmo);
+
+#endif /* LIBVFN_NVME_TIMEOUT_H */
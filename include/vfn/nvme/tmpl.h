@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_TMPL_H
+#define LIBVFN_NVME_TMPL_H
+
+/**
+ * DOC: Command templates
+ *
+ * Most fields of the read and write commands issued by a submitter do not
+ * change from one command to the next (opcode, namespace, directives, ...).
+ * Instead of building a &union nvme_cmd from scratch for each command, a
+ * &struct nvme_cmd_tmpl holds the invariant fields (e.g. per queue, namespace
+ * and opcode) and nvme_rq_post_tmpl() copies it straight into the submission
+ * queue slot (a single aligned 64 byte copy) and patches only the command
+ * identifier, the logical block range and the data pointer.
+ */
+
+/**
+ * struct nvme_cmd_tmpl - Command template
+ * @cmd: Invariant fields of the command; may be modified after
+ *       nvme_cmd_tmpl_init() (e.g. with nvme_rw_set_directive())
+ * @lbads: Logical block data size (as a power of two) of the namespace
+ */
+struct nvme_cmd_tmpl {
+	union nvme_cmd cmd;
+	uint8_t lbads;
+} __attribute__((aligned(1 << NVME_SQES)));
+
+/**
+ * nvme_cmd_tmpl_init - Initialize a command template
+ * @tmpl: &struct nvme_cmd_tmpl
+ * @ns: Namespace (see &struct nvme_ns)
+ * @opcode: Command opcode (e.g., Read or Write)
+ */
+static inline void nvme_cmd_tmpl_init(struct nvme_cmd_tmpl *tmpl, struct nvme_ns *ns,
+				      uint8_t opcode)
+{
+	memset(tmpl, 0x0, sizeof(*tmpl));
+
+	tmpl->cmd.rw.opcode = opcode;
+	tmpl->cmd.rw.nsid = cpu_to_le32(ns->nsid);
+	tmpl->lbads = ns->lbads;
+}
+
+static inline void __nvme_cmd_tmpl_copy(union nvme_cmd *dst, const struct nvme_cmd_tmpl *tmpl)
+{
+	/* both are 64 byte aligned; let the compiler use the widest stores available */
+	memcpy(__builtin_assume_aligned(dst, 1 << NVME_SQES),
+	       __builtin_assume_aligned(&tmpl->cmd, 1 << NVME_SQES), sizeof(*dst));
+}
+
+/**
+ * nvme_rq_post_tmpl - Post a command built from a template
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @tmpl: Command template (&struct nvme_cmd_tmpl)
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks (at least one; not zero-based)
+ * @iova: I/O Virtual Address of the data buffer
+ *
+ * Copy @tmpl into the submission queue slot at the tail, set the command
+ * identifier of @rq and the logical block range, map the data buffer in place
+ * (see nvme_rq_map()) and advance the tail. If the submission queue is in the
+ * Controller Memory Buffer, the command is patched in a local copy and posted
+ * with nvme_sq_post() instead. Unlike nvme_ns_prep_rw(), the range is not
+ * validated. Like nvme_rq_post(), @rq is timestamped if latency tracking is
+ * enabled on the queue.
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (see nvme_rq_map()); nothing is posted.
+ */
+static inline int nvme_rq_post_tmpl(struct nvme_ctrl *ctrl, struct nvme_rq *rq,
+				    const struct nvme_cmd_tmpl *tmpl, uint64_t slba, uint32_t nlb,
+				    uint64_t iova)
+{
+	struct nvme_sq *sq = rq->sq;
+	union nvme_cmd local __attribute__((aligned(1 << NVME_SQES)));
+	union nvme_cmd *cmd = &local;
+
+	/* write-combined memory is not read back; patch a copy */
+	if (!(sq->flags & NVME_SQ_F_CMB))
+		cmd = (union nvme_cmd *)(sq->vaddr + (sq->tail << NVME_SQES));
+
+	__nvme_cmd_tmpl_copy(cmd, tmpl);
+
+	cmd->cid = rq->cid;
+	cmd->rw.slba = cpu_to_le64(slba);
+	cmd->rw.nlb = cpu_to_le16((uint16_t)(nlb - 1));
+
+	/* the controller does not see the slot until the doorbell is written */
+	if (nvme_rq_map(ctrl, rq, cmd, iova, (size_t)nlb << tmpl->lbads))
+		return -1;
+
+	__nvme_rq_stamp(rq);
+
+	if (cmd == &local)
+		nvme_sq_post(sq, cmd);
+	else
+		__nvme_sq_advance(sq);
+
+	return 0;
+}
+
+/**
+ * nvme_rq_submit_tmpl - Post a command built from a template with a completion
+ *                       callback
+ * @ctrl: &struct nvme_ctrl
+ * @rq: Request tracker (&struct nvme_rq)
+ * @tmpl: Command template (&struct nvme_cmd_tmpl)
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks (at least one; not zero-based)
+ * @iova: I/O Virtual Address of the data buffer
+ * @cb: Completion callback (must not be NULL)
+ * @arg: Opaque argument passed to @cb
+ *
+ * Like nvme_rq_submit(), but post the command with nvme_rq_post_tmpl().
+ *
+ * Note: Does NOT write the doorbell. See nvme_sq_update_tail().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``; nothing is posted.
+ */
+static inline int nvme_rq_submit_tmpl(struct nvme_ctrl *ctrl, struct nvme_rq *rq,
+				      const struct nvme_cmd_tmpl *tmpl, uint64_t slba,
+				      uint32_t nlb, uint64_t iova, nvme_rq_cb cb, void *arg)
+{
+	if (nvme_rq_post_tmpl(ctrl, rq, tmpl, slba, nlb, iova))
+		return -1;
+
+	__nvme_rq_arm(rq, cb, arg);
+
+	return 0;
+}
+
+#endif /* LIBVFN_NVME_TMPL_H */
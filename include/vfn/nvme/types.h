@@ -31,6 +31,19 @@ __static_assert(sizeof(struct nvme_sgld) == 16);
 #define NVME_SGLD_TYPE_MASK 0xf
 #define NVME_SGLD_TYPE_SHIFT 4
 
+/**
+ * enum nvme_sgls - SGL Support (Identify Controller SGLS field)
+ * @NVME_SGLS_SUPPORTED: SGLs are supported without alignment requirements
+ * @NVME_SGLS_SUPPORTED_DWORD: SGLs are supported with dword alignment and
+ *                             granularity requirements for data blocks
+ */
+enum nvme_sgls {
+	NVME_SGLS_SUPPORTED		= 0x1,
+	NVME_SGLS_SUPPORTED_DWORD	= 0x2,
+};
+
+#define NVME_SGLS_SUPPORT_MASK 0x3
+
 union nvme_dptr {
 	struct {
 		leint64_t prp1;
@@ -173,6 +186,7 @@ struct nvme_cmd_rw {
 	leint16_t nlb;
 	leint16_t control;
 	leint16_t dsm;
+	leint16_t dspec;
 	leint32_t reftag;
 	leint16_t apptag;
 	leint16_t appmask;
@@ -259,6 +273,21 @@ enum nvme_cmd_flags {
 #define NVME_CMD_FLAGS_PSDT_MASK 0x3
 #define NVME_CMD_FLAGS_PSDT_SHIFT 6
 
+/**
+ * enum nvme_cmd_fuse - Fused operation
+ * @NVME_CMD_FUSE_NONE: Normal operation
+ * @NVME_CMD_FUSE_FIRST: First command of a fused operation
+ * @NVME_CMD_FUSE_SECOND: Second command of a fused operation
+ */
+enum nvme_cmd_fuse {
+	NVME_CMD_FUSE_NONE			= 0x0,
+	NVME_CMD_FUSE_FIRST			= 0x1,
+	NVME_CMD_FUSE_SECOND			= 0x2,
+};
+
+#define NVME_CMD_FLAGS_FUSE_MASK 0x3
+#define NVME_CMD_FLAGS_FUSE_SHIFT 0
+
 struct nvme_cqe {
 	union {
 		struct {
@@ -282,6 +311,97 @@ __static_assert(sizeof(struct nvme_cqe) == 16);
 
 typedef void (*cqe_handler)(struct nvme_cqe *cqe);
 
+/**
+ * enum nvme_copy_format - Copy source range descriptor format
+ * @NVME_COPY_FORMAT_0: 32 byte descriptors with 32b reference tags (16b guard
+ *                      protection information)
+ * @NVME_COPY_FORMAT_1: 40 byte descriptors with 48b reference tags (64b guard
+ *                      protection information)
+ */
+enum nvme_copy_format {
+	NVME_COPY_FORMAT_0		= 0x0,
+	NVME_COPY_FORMAT_1		= 0x1,
+};
+
+struct nvme_copy_desc_fmt0 {
+	uint8_t   rsvd0[8];
+	leint64_t slba;
+	leint16_t nlb;
+	uint8_t   rsvd18[6];
+	leint32_t elbt;
+	leint16_t elbat;
+	leint16_t elbatm;
+};
+__static_assert(sizeof(struct nvme_copy_desc_fmt0) == 32);
+
+struct nvme_copy_desc_fmt1 {
+	uint8_t   rsvd0[8];
+	leint64_t slba;
+	leint16_t nlb;
+	uint8_t   rsvd18[8];
+	uint8_t   elbt[10];
+	leint16_t elbat;
+	leint16_t elbatm;
+};
+__static_assert(sizeof(struct nvme_copy_desc_fmt1) == 40);
+
+/**
+ * struct nvme_rq_copy_range - Copy source range
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks (at most 65536)
+ * @reftag: Expected initial logical block reference tag
+ * @apptag: Expected logical block application tag
+ * @appmask: Expected logical block application tag mask
+ *
+ * The expected tags are only checked if the namespace is formatted with
+ * protection information and checking is enabled for the command.
+ */
+struct nvme_rq_copy_range {
+	uint64_t slba;
+	uint32_t nlb;
+	uint64_t reftag;
+	uint16_t apptag;
+	uint16_t appmask;
+};
+
+/**
+ * enum nvme_dsm_attr - Dataset Management attributes
+ * @NVME_DSM_IDR: Integral Dataset for Read
+ * @NVME_DSM_IDW: Integral Dataset for Write
+ * @NVME_DSM_AD: Deallocate
+ */
+enum nvme_dsm_attr {
+	NVME_DSM_IDR			= 1 << 0,
+	NVME_DSM_IDW			= 1 << 1,
+	NVME_DSM_AD			= 1 << 2,
+};
+
+struct nvme_dsm_desc {
+	leint32_t cattr;
+	leint32_t nlb;
+	leint64_t slba;
+};
+__static_assert(sizeof(struct nvme_dsm_desc) == 16);
+
+/**
+ * struct nvme_rq_dsm_range - Dataset Management range
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ * @cattr: Context attributes (access hints)
+ */
+struct nvme_rq_dsm_range {
+	uint64_t slba;
+	uint32_t nlb;
+	uint32_t cattr;
+};
+
+struct nvme_crc16_pi_tuple {
+	beint16_t guard;
+	beint16_t apptag;
+	beint32_t reftag;
+};
+__static_assert(sizeof(struct nvme_crc16_pi_tuple) == 8);
+
 struct nvme_crc64_pi_tuple {
 	beint64_t guard;
 	beint16_t apptag;
@@ -63,13 +63,53 @@ int nvme_set_errno_from_cqe(struct nvme_cqe *cqe);
  * @opaque: Opaque data pointer
  *
  * Issue an Asynchronous Event Request command and associate @opaque with the
- * request tracker.
+ * request tracker. The command identifier has ``NVME_CID_AER`` set.
+ *
+ * If a handler is set (see nvme_aer_set_handler()), the completion is
+ * delivered to it by the admin completion demultiplexer and the request is
+ * re-armed with the same tracker. Otherwise, an event reaped by the
+ * demultiplexer is dropped and the tracker released; callers reaping the admin
+ * completion queue themselves must clear ``NVME_CID_AER`` before looking up
+ * the tracker.
  *
  * Return: On success, returns ``0``. On error, returns ``-1`` and sets
  * ``errno``.
  */
 int nvme_aer(struct nvme_ctrl *ctrl, void *opaque);
 
+/**
+ * nvme_aer_set_handler - Set the asynchronous event handler
+ * @ctrl: Controller reference
+ * @cb: Handler (or NULL to stop delivering and re-arming events)
+ * @opaque: Opaque argument passed to @cb
+ *
+ * Route the completions of Asynchronous Event Requests (see nvme_aer()) to @cb.
+ * Events are delivered from whichever thread reaps the admin completion queue;
+ * that is, from within nvme_admin() and friends or nvme_admin_process().
+ */
+void nvme_aer_set_handler(struct nvme_ctrl *ctrl, nvme_aer_cb cb, void *opaque);
+
+/**
+ * nvme_admin_process - Reap and dispatch admin completions
+ * @ctrl: Controller reference
+ *
+ * Reap the admin completion queue and route each completion to its owner:
+ * commands waited for by nvme_admin() (or nvme_sync() on the admin queue) and
+ * nvme_admin_async(), and asynchronous events (see nvme_aer_set_handler()).
+ * Completions that no one is waiting for are logged and dropped. Like
+ * nvme_cq_process(), latencies are tracked, protection information is verified
+ * and request trackers are released when their callback returns (unless the
+ * callback resubmitted them).
+ *
+ * Only one thread reaps at a time; if another thread is reaping, return
+ * immediately. Callbacks are invoked after the queue has been released, so
+ * they may issue admin commands. Call this to receive asynchronous events when
+ * no admin commands are issued.
+ *
+ * Return: The number of completions dispatched.
+ */
+int nvme_admin_process(struct nvme_ctrl *ctrl);
+
 /**
  * nvme_sync - Submit a command and wait for completion
  * @ctrl: Controller reference
@@ -79,14 +119,23 @@ int nvme_aer(struct nvme_ctrl *ctrl, void *opaque);
  * @len: Command payload length
  * @cqe_copy: Completion queue entry to fill
  *
- * Submit a command and wait for completion in a synchronous manner. If a
- * spurious completion queue entry is posted (i.e., the command identifier is
- * different from the one set in @sqe), the CQE is ignored and an error message
- * is logged.
+ * Submit a command and wait for completion in a synchronous manner. While
+ * waiting, the completion queue is reaped by one waiter at a time and each
+ * completion is delivered to the request tracker it belongs to (see
+ * nvme_admin_process()), such that concurrent callers (and other commands
+ * submitted with nvme_rq_submit()) only ever wait for their own completion,
+ * no matter which thread reaps it. Completion queue entries that do not belong
+ * to an outstanding command are logged and dropped.
  *
- * **Note**: This function should only be used for synchronous commands where no
- * spurious CQEs are expected to be posted on the completion queue. Any spurious
- * CQEs will be logged and dropped.
+ * If @buf is not already mapped (see iommu_map_vaddr()), payloads of up to 16k
+ * are copied through a per-controller bounce buffer that is mapped once at
+ * initialization. Based on the data transfer direction of the opcode, @buf is
+ * copied in before submission and/or copied out after completion. Larger
+ * payloads (or all, if the bounce buffers are in use) are mapped for the
+ * duration of the command.
+ *
+ * **Note**: The completion queue must not also be processed by other means
+ * (e.g., nvme_cq_process()) concurrently.
  *
  * Return: On success, returns ``0``. On error, returns ``-1`` and sets
  * ``errno``.
@@ -110,4 +159,355 @@ int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, v
 int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
 	       struct nvme_cqe *cqe_copy);
 
+/**
+ * struct nvme_future - Pending command
+ * @cqe: Completion queue entry (valid when @done is set)
+ * @done: Whether the command has completed
+ *
+ * Tracks a command submitted with nvme_async() (or the commands that a transfer
+ * submitted with nvme_read_async() or nvme_write_async() was split into). The
+ * future must stay valid (and must not be moved) until it is done.
+ */
+struct nvme_future {
+	struct nvme_cqe cqe;
+	bool done;
+
+	/* private: */
+	struct nvme_ctrl *ctrl;
+	struct nvme_sq *sq;
+	void *buf, *buf2;
+	bool do_unmap, do_unmap2;
+	int pending;
+};
+
+/**
+ * nvme_async - Submit a command without waiting for completion
+ * @ctrl: Controller reference
+ * @sq: Submission queue
+ * @sqe: Submission queue entry
+ * @buf: Command payload
+ * @len: Command payload length
+ * @future: Future to complete (see &struct nvme_future)
+ *
+ * Like nvme_sync(), but return as soon as the command has been posted (and the
+ * doorbell written). Any number of commands may be in flight at a time, up to
+ * the number of request trackers of @sq. Wait for completion with
+ * nvme_future_wait() or nvme_future_wait_all(); @buf must remain valid until
+ * then.
+ *
+ * **Note**: While futures are pending on @sq, commands completing on its
+ * completion queue that were not submitted with this function (e.g.,
+ * Asynchronous Event Requests) are logged and dropped, and the queue must not
+ * be reaped by anything else. Futures are not thread safe.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EBUSY`` if all request trackers are in use).
+ */
+int nvme_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, void *buf,
+	       size_t len, struct nvme_future *future);
+
+/**
+ * nvme_admin_async - Submit an Admin command without waiting for completion
+ * @ctrl: See &struct nvme_ctrl
+ * @sqe: Submission queue entry
+ * @buf: Command payload
+ * @len: Command payload length
+ * @future: Future to complete (see &struct nvme_future)
+ *
+ * Shortcut for nvme_async(), submitting to the admin submission queue.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_admin_async(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
+		     struct nvme_future *future);
+
+/**
+ * nvme_read_async - Submit a read without waiting for completion
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @ns: Namespace (see nvme_ns_get())
+ * @slba: Starting logical block address
+ * @buf: Data buffer
+ * @len: Data length in bytes (a multiple of the logical block size)
+ * @future: Future to complete (see &struct nvme_future)
+ *
+ * Read @len bytes starting at @slba into @buf. Transfers larger than what a
+ * single command can carry (see &struct nvme_ns.max_nlb) are split into
+ * multiple commands that are kept in flight together on @sq. @future is done
+ * when all of them have completed; if any of them failed, the completion queue
+ * entry of the first failure is reported.
+ *
+ * If @sq runs out of request trackers (or chained prp list pages, see
+ * nvme_rq_map_prp()), completions are reaped (see nvme_future_wait()) until the
+ * remaining commands can be posted. The same restrictions
+ * as for nvme_async() apply. Namespaces formatted with metadata are not
+ * supported.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``. If posting fails after some commands were submitted, those are
+ * waited for before returning.
+ */
+int nvme_read_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns, uint64_t slba,
+		    void *buf, size_t len, struct nvme_future *future);
+
+/**
+ * nvme_write_async - Submit a write without waiting for completion
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @ns: Namespace (see nvme_ns_get())
+ * @slba: Starting logical block address
+ * @buf: Data buffer
+ * @len: Data length in bytes (a multiple of the logical block size)
+ * @future: Future to complete (see &struct nvme_future)
+ *
+ * Write @len bytes from @buf starting at @slba. See nvme_read_async().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_write_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+		     uint64_t slba, void *buf, size_t len, struct nvme_future *future);
+
+/**
+ * nvme_read - Read from a namespace
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @ns: Namespace (see nvme_ns_get())
+ * @slba: Starting logical block address
+ * @buf: Data buffer
+ * @len: Data length in bytes (a multiple of the logical block size)
+ *
+ * Synchronous version of nvme_read_async().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_read(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns, uint64_t slba,
+	      void *buf, size_t len);
+
+/**
+ * nvme_write - Write to a namespace
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @ns: Namespace (see nvme_ns_get())
+ * @slba: Starting logical block address
+ * @buf: Data buffer
+ * @len: Data length in bytes (a multiple of the logical block size)
+ *
+ * Synchronous version of nvme_write_async().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_write(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns, uint64_t slba,
+	       void *buf, size_t len);
+
+/**
+ * enum nvme_fill_op - Region fill operations
+ * @NVME_FILL_WRITE_ZEROES: Write Zeroes
+ * @NVME_FILL_WRITE_ZEROES_DEAC: Write Zeroes, deallocating the logical blocks
+ *                               if the controller is able to (reading them
+ *                               still returns zeroes)
+ * @NVME_FILL_VERIFY: Verify (the controller checks the integrity of the data
+ *                    without transferring it)
+ * @NVME_FILL_DEALLOCATE: Dataset Management with the Deallocate attribute
+ *
+ * None of the operations transfer data, so a region is filled (or scrubbed)
+ * without spending any host memory or PCIe bandwidth on it.
+ */
+enum nvme_fill_op {
+	NVME_FILL_WRITE_ZEROES,
+	NVME_FILL_WRITE_ZEROES_DEAC,
+	NVME_FILL_VERIFY,
+	NVME_FILL_DEALLOCATE,
+};
+
+/**
+ * nvme_fill_async - Fill a region without waiting for completion
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @ns: Namespace (see nvme_ns_get())
+ * @op: Operation (see &enum nvme_fill_op)
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ * @future: Future to complete (see &struct nvme_future)
+ *
+ * Apply @op to @nlb logical blocks starting at @slba. The region is split into
+ * as many commands as the per-command limits of the controller require (see
+ * &struct nvme_ns.max_wz_nlb and &struct nvme_ns.max_verify_nlb; deallocation
+ * is batched into Dataset Management commands of as many ranges as allowed).
+ * Otherwise, this behaves like nvme_read_async().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOTSUP`` if the controller does not support @op).
+ */
+int nvme_fill_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+		    enum nvme_fill_op op, uint64_t slba, uint64_t nlb, struct nvme_future *future);
+
+/**
+ * nvme_fill - Fill a region using a number of queues
+ * @ctrl: See &struct nvme_ctrl
+ * @sqs: I/O submission queues
+ * @nsqs: Number of queues in @sqs
+ * @ns: Namespace (see nvme_ns_get())
+ * @op: Operation (see &enum nvme_fill_op)
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ *
+ * Like nvme_fill_async(), but split the region into one contiguous part per
+ * queue (in whole commands), keep all of the queues busy and wait for the
+ * entire region to complete. The queues must not be in use by anything else
+ * while this is in progress.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` according to the first failure.
+ */
+int nvme_fill(struct nvme_ctrl *ctrl, struct nvme_sq **sqs, int nsqs, struct nvme_ns *ns,
+	      enum nvme_fill_op op, uint64_t slba, uint64_t nlb);
+
+/**
+ * nvme_deallocate_async - Deallocate a number of ranges without waiting for
+ *                         completion
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @ns: Namespace (see nvme_ns_get())
+ * @ranges: Ranges (see &struct nvme_rq_dsm_range; the context attributes are
+ *          ignored)
+ * @nr: Number of ranges in @ranges
+ * @future: Future to complete (see &struct nvme_future)
+ *
+ * Deallocate @ranges with as few Dataset Management commands as the range,
+ * range size and command size limits of the controller allow. See
+ * nvme_fill_async().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_deallocate_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+			  const struct nvme_rq_dsm_range *ranges, int nr,
+			  struct nvme_future *future);
+
+/**
+ * nvme_compare_write_async - Atomically compare and write without waiting for
+ *                            completion
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @ns: Namespace (see nvme_ns_get())
+ * @slba: Starting logical block address
+ * @cmp: Data to compare the logical blocks to
+ * @buf: Data to write if the logical blocks match @cmp
+ * @len: Length of @cmp and @buf in bytes
+ * @future: Future to complete (see &struct nvme_future)
+ *
+ * Submit a fused Compare and Write of @len bytes starting at @slba; see
+ * nvme_rq_submit_fused(). The controller writes @buf only if the logical blocks
+ * match @cmp, and executes the pair atomically with respect to other commands,
+ * so the operation may be used as a compare-and-swap on the medium (e.g., for
+ * locks or metadata shared by several hosts). The range may not exceed the
+ * Atomic Compare & Write Unit (&nvme_ctrl.config.acwu) of the controller.
+ *
+ * On a miscompare, @future completes with the Compare Failure status.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOTSUP`` if the controller does not support the operation).
+ */
+int nvme_compare_write_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+			     uint64_t slba, void *cmp, void *buf, size_t len,
+			     struct nvme_future *future);
+
+/**
+ * nvme_compare_write - Atomically compare and write
+ * @ctrl: See &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @ns: Namespace (see nvme_ns_get())
+ * @slba: Starting logical block address
+ * @cmp: Data to compare the logical blocks to
+ * @buf: Data to write if the logical blocks match @cmp
+ * @len: Length of @cmp and @buf in bytes
+ *
+ * Like nvme_compare_write_async(), but wait for completion.
+ *
+ * Return: Returns ``0`` if the logical blocks matched @cmp and @buf was
+ * written and ``1`` if they did not match (and nothing was written). On error,
+ * returns ``-1`` and sets ``errno``.
+ */
+int nvme_compare_write(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+		       uint64_t slba, void *cmp, void *buf, size_t len);
+
+/**
+ * nvme_future_wait - Wait for a pending command to complete
+ * @future: See &struct nvme_future
+ *
+ * Spin on the completion queue until @future is done. Completions of other
+ * pending futures on the same queue are processed along the way, so waiting for
+ * futures in any order is fine.
+ *
+ * Return: On success (i.e. the command completed with a successful status),
+ * returns ``0``. On error, returns ``-1`` and sets ``errno``.
+ */
+int nvme_future_wait(struct nvme_future *future);
+
+/**
+ * nvme_future_wait_all - Wait for a number of pending commands to complete
+ * @futures: Array of &struct nvme_future
+ * @n: Number of futures in @futures
+ *
+ * Wait for all of @futures, even if some of them fail.
+ *
+ * Return: If all commands completed successfully, returns ``0``. Otherwise,
+ * returns ``-1`` and sets ``errno`` according to the first failure.
+ */
+int nvme_future_wait_all(struct nvme_future *futures, int n);
+
+/**
+ * nvme_set_arbitration - Configure command arbitration
+ * @ctrl: See &struct nvme_ctrl
+ * @ab: Arbitration burst (log2 of the maximum number of commands fetched from
+ *      a submission queue at a time; ``7`` for no limit)
+ * @lpw: Low priority weight (zeroes based)
+ * @mpw: Medium priority weight (zeroes based)
+ * @hpw: High priority weight (zeroes based)
+ *
+ * Set the Arbitration feature (FID ``0x01``). The weights only apply if the
+ * controller was enabled with weighted round robin arbitration (see
+ * &struct nvme_arb_opts); the arbitration burst applies to all mechanisms.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_set_arbitration(struct nvme_ctrl *ctrl, uint8_t ab, uint8_t lpw, uint8_t mpw,
+			 uint8_t hpw);
+
+/**
+ * nvme_set_irq_coalescing - Configure controller-wide interrupt coalescing
+ * @ctrl: See &struct nvme_ctrl
+ * @time: Aggregation time in 100 microsecond increments (``0`` disables the
+ *        time based aggregation)
+ * @thr: Aggregation threshold (zeroes based number of completion queue
+ *       entries)
+ *
+ * Set the Interrupt Coalescing feature (FID ``0x08``). Coalescing applies to
+ * all I/O completion queue vectors that do not have it disabled (see
+ * nvme_set_irq_vector_coalescing()).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_set_irq_coalescing(struct nvme_ctrl *ctrl, uint8_t time, uint8_t thr);
+
+/**
+ * nvme_set_irq_vector_coalescing - Enable or disable coalescing for a vector
+ * @ctrl: See &struct nvme_ctrl
+ * @iv: Interrupt vector
+ * @enable: Whether interrupt coalescing applies to @iv
+ *
+ * Set the Interrupt Vector Configuration feature (FID ``0x09``) for @iv. Use
+ * this to disable coalescing for latency critical queues.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_set_irq_vector_coalescing(struct nvme_ctrl *ctrl, uint16_t iv, bool enable);
+
 #endif /* LIBVFN_NVME_UTIL_H */
@@ -0,0 +1,181 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_VIEW_H
+#define LIBVFN_NVME_VIEW_H
+
+/**
+ * DOC: Demand-paged namespace view
+ *
+ * A &struct nvme_view maps a range of logical blocks of a namespace into the
+ * address space of the process, such that it may simply be dereferenced. The
+ * virtual range is reserved up front and registered with userfaultfd; nothing
+ * is read until a page is first touched. The page fault is then served by
+ * reading the page through libvfn into a staging page allocated and mapped in
+ * the iommu context once (see iommu_alloc_node()), and copying it into place
+ * (``UFFDIO_COPY``), which wakes up the faulting thread.
+ *
+ * Faults are served by nvme_view_serve(), which must be called by a thread
+ * other than those touching the view (e.g., from a reactor, polling the
+ * userfaultfd returned by nvme_view_fd()). Pages expected to be touched soon
+ * may be read ahead with nvme_view_prefetch(), and pages no longer needed are
+ * dropped with nvme_view_evict(), after which they are read again on the next
+ * touch.
+ *
+ * The view is read-only; writes to it fault with ``SIGSEGV``. A page whose read
+ * on a page fault fails is poisoned if the kernel supports it (touching it
+ * raises ``SIGBUS`` until it is evicted) and filled with zeroes otherwise (see
+ * &struct nvme_view.errors). Failed prefetches are dropped.
+ *
+ * The serving thread processes the completion queue of the submission queue of
+ * the view with nvme_cq_process(), so all commands on that queue must have been
+ * submitted with a completion callback (see nvme_rq_submit()).
+ */
+
+struct nvme_view_slot;
+
+/**
+ * struct nvme_view - Demand-paged namespace view
+ * @vaddr: Base address of the view
+ * @len: Length of the view in bytes (a multiple of the page size)
+ * @faults: Number of page faults served with a read
+ * @prefetched: Number of pages read by nvme_view_prefetch()
+ * @evicted: Number of pages dropped by nvme_view_evict()
+ * @errors: Number of page faults that could not be served with a read
+ *
+ * See nvme_view_init().
+ */
+struct nvme_view {
+	void *vaddr;
+	size_t len;
+
+	uint64_t faults;
+	uint64_t prefetched;
+	uint64_t evicted;
+	uint64_t errors;
+
+	/* private: */
+	struct nvme_ctrl *ctrl;
+	struct nvme_ns *ns;
+	struct nvme_sq *sq;
+
+	/* first logical block and number of logical blocks in the view */
+	uint64_t slba, nlb;
+
+	int uffd;
+	bool poison;
+
+	/* per page; @resident is also cleared by nvme_view_evict() from any thread */
+	uint64_t *resident, *pending;
+	size_t npages;
+
+	/* staging pages */
+	void *stage;
+	uint64_t stage_iova;
+	size_t stage_len;
+	struct nvme_view_slot *slots, *free;
+	int inflight;
+};
+
+/**
+ * nvme_view_init - Map a range of logical blocks of a namespace
+ * @view: &struct nvme_view
+ * @ctrl: &struct nvme_ctrl
+ * @sq: I/O submission queue to read on
+ * @nsid: Namespace identifier (see nvme_ns_get())
+ * @slba: Starting logical block address
+ * @nlb: Number of logical blocks
+ * @depth: Number of staging pages (the maximum number of reads in flight)
+ *
+ * Reserve a virtual range covering @nlb logical blocks from @slba, register it
+ * with userfaultfd and allocate and map @depth staging pages. If the range does
+ * not end on a page boundary, the rest of the last page reads as zeroes. The
+ * logical block size of the namespace must not exceed the page size.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if the range is not valid for the namespace, or
+ * ``EPERM`` or ``ENOSYS`` if userfaultfd is not available).
+ */
+int nvme_view_init(struct nvme_view *view, struct nvme_ctrl *ctrl, struct nvme_sq *sq,
+		   uint32_t nsid, uint64_t slba, uint64_t nlb, int depth);
+
+/**
+ * nvme_view_fini - Unmap a namespace view
+ * @view: &struct nvme_view
+ *
+ * Wait for any reads still in flight, unmap the view and release the staging
+ * pages. No thread may touch the view anymore.
+ */
+void nvme_view_fini(struct nvme_view *view);
+
+/**
+ * nvme_view_fd - Get the userfaultfd of a namespace view
+ * @view: &struct nvme_view
+ *
+ * The file descriptor is non-blocking and becomes readable when a thread
+ * faults on a page of the view that is not being read already.
+ *
+ * Return: The userfaultfd of @view.
+ */
+static inline int nvme_view_fd(struct nvme_view *view)
+{
+	return view->uffd;
+}
+
+/**
+ * nvme_view_serve - Serve page faults on a namespace view
+ * @view: &struct nvme_view
+ * @budget: Maximum number of page faults to take
+ *
+ * Process completed reads, waking up the threads faulting on them, and submit
+ * reads for up to @budget pending page faults, as staging pages and request
+ * trackers allow. Does not block. Faults that could not be taken stay queued
+ * on the userfaultfd.
+ *
+ * Return: On success, returns the number of page faults taken. On error,
+ * returns ``-1`` and sets ``errno``.
+ */
+int nvme_view_serve(struct nvme_view *view, int budget);
+
+/**
+ * nvme_view_prefetch - Read ahead pages of a namespace view
+ * @view: &struct nvme_view
+ * @offset: Offset into the view in bytes
+ * @len: Length in bytes
+ *
+ * Submit reads for the pages covering @offset to @offset + @len that are
+ * neither resident nor being read, as staging pages and request trackers allow.
+ * The pages are copied into place by nvme_view_serve(). Must be called by the
+ * thread serving the view.
+ *
+ * Return: On success, returns the number of reads submitted. On error, returns
+ * ``-1`` and sets ``errno`` (``EINVAL`` if the range is outside the view).
+ */
+int nvme_view_prefetch(struct nvme_view *view, size_t offset, size_t len);
+
+/**
+ * nvme_view_evict - Drop pages of a namespace view
+ * @view: &struct nvme_view
+ * @offset: Offset into the view in bytes
+ * @len: Length in bytes
+ *
+ * Release the memory of the pages covering @offset to @offset + @len (see
+ * ``MADV_DONTNEED`` in madvise(2)). The pages are read again on the next
+ * touch. May be called from any thread; pages being read at the time may be
+ * installed again when the read completes.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if the range is outside the view).
+ */
+int nvme_view_evict(struct nvme_view *view, size_t offset, size_t len);
+
+#endif /* LIBVFN_NVME_VIEW_H */
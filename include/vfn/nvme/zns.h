@@ -0,0 +1,275 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_NVME_ZNS_H
+#define LIBVFN_NVME_ZNS_H
+
+/**
+ * DOC: Zoned Namespaces
+ *
+ * A zoned namespace is divided into zones of &struct nvme_zns.zsze logical
+ * blocks that must be written sequentially at the zone write pointer. A
+ * &struct nvme_zns keeps the state and write pointer of every zone in a compact
+ * table (see &struct nvme_zone), which is populated by nvme_zns_init() and
+ * refreshed for a range of zones with nvme_zns_report().
+ *
+ * Zone Append commands (see nvme_zns_prep_append()) write to a zone without
+ * specifying the location; the controller writes the data at the write pointer
+ * and returns the assigned logical block address in the completion queue entry
+ * (see nvme_zns_append_complete()). Any number of appends to the same zone may
+ * be in flight, from any number of queues and threads, without host-side
+ * serialization.
+ *
+ * The controller must have been enabled with all I/O command sets (which
+ * nvme_init() does if the controller supports it).
+ */
+
+/**
+ * enum nvme_zns_opcode - Zoned Namespace Command Set opcodes
+ * @NVME_ZNS_ZONE_MGMT_SEND: Zone Management Send
+ * @NVME_ZNS_ZONE_MGMT_RECV: Zone Management Receive
+ * @NVME_ZNS_ZONE_APPEND: Zone Append
+ */
+enum nvme_zns_opcode {
+	NVME_ZNS_ZONE_MGMT_SEND		= 0x79,
+	NVME_ZNS_ZONE_MGMT_RECV		= 0x7a,
+	NVME_ZNS_ZONE_APPEND		= 0x7d,
+};
+
+/**
+ * enum nvme_zone_state - Zone state
+ * @NVME_ZONE_STATE_EMPTY: Empty
+ * @NVME_ZONE_STATE_IMPLICITLY_OPEN: Implicitly Opened
+ * @NVME_ZONE_STATE_EXPLICITLY_OPEN: Explicitly Opened
+ * @NVME_ZONE_STATE_CLOSED: Closed
+ * @NVME_ZONE_STATE_READ_ONLY: Read Only
+ * @NVME_ZONE_STATE_FULL: Full
+ * @NVME_ZONE_STATE_OFFLINE: Offline
+ */
+enum nvme_zone_state {
+	NVME_ZONE_STATE_EMPTY		= 0x1,
+	NVME_ZONE_STATE_IMPLICITLY_OPEN	= 0x2,
+	NVME_ZONE_STATE_EXPLICITLY_OPEN	= 0x3,
+	NVME_ZONE_STATE_CLOSED		= 0x4,
+	NVME_ZONE_STATE_READ_ONLY	= 0xd,
+	NVME_ZONE_STATE_FULL		= 0xe,
+	NVME_ZONE_STATE_OFFLINE		= 0xf,
+};
+
+/**
+ * enum nvme_zone_action - Zone Send Action
+ * @NVME_ZONE_ACTION_CLOSE: Close Zone
+ * @NVME_ZONE_ACTION_FINISH: Finish Zone
+ * @NVME_ZONE_ACTION_OPEN: Open Zone
+ * @NVME_ZONE_ACTION_RESET: Reset Zone
+ * @NVME_ZONE_ACTION_OFFLINE: Offline Zone
+ */
+enum nvme_zone_action {
+	NVME_ZONE_ACTION_CLOSE		= 0x1,
+	NVME_ZONE_ACTION_FINISH		= 0x2,
+	NVME_ZONE_ACTION_OPEN		= 0x3,
+	NVME_ZONE_ACTION_RESET		= 0x4,
+	NVME_ZONE_ACTION_OFFLINE	= 0x5,
+};
+
+/**
+ * struct nvme_zone - Cached zone information
+ * @wp: Write pointer
+ * @zcap: Zone capacity in logical blocks
+ * @state: Zone state (see &enum nvme_zone_state)
+ * @attrs: Zone attributes
+ *
+ * @wp and @state are updated atomically by nvme_zns_append_complete().
+ */
+struct nvme_zone {
+	uint64_t wp;
+	uint32_t zcap;
+	uint8_t state;
+	uint8_t attrs;
+};
+
+/**
+ * struct nvme_zns - Zoned namespace
+ * @ns: Namespace (see &struct nvme_ns)
+ * @zsze: Zone size in logical blocks
+ * @nzones: Number of zones
+ * @mor: Maximum number of open zones (``0`` if not limited)
+ * @mar: Maximum number of active zones (``0`` if not limited)
+ * @max_append_nlb: Maximum number of logical blocks per Zone Append command
+ * @zones: Zone table (see &struct nvme_zone), indexed by zone number
+ */
+struct nvme_zns {
+	struct nvme_ns *ns;
+	uint64_t zsze;
+	uint32_t nzones;
+	uint32_t mor, mar;
+	uint32_t max_append_nlb;
+	struct nvme_zone *zones;
+};
+
+/**
+ * nvme_zns_init - Identify a zoned namespace and populate its zone table
+ * @ctrl: &struct nvme_ctrl
+ * @sq: I/O submission queue used for zone reports
+ * @nsid: Namespace identifier
+ * @zns: &struct nvme_zns to initialize
+ *
+ * Identify the zoned namespace @nsid and report all its zones (see
+ * nvme_zns_report()). Release @zns with nvme_zns_close().
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``EINVAL`` if @nsid is not an active zoned namespace).
+ */
+int nvme_zns_init(struct nvme_ctrl *ctrl, struct nvme_sq *sq, uint32_t nsid,
+		  struct nvme_zns *zns);
+
+/**
+ * nvme_zns_close - Release a zoned namespace
+ * @zns: &struct nvme_zns
+ */
+void nvme_zns_close(struct nvme_zns *zns);
+
+/**
+ * nvme_zns_report - Refresh the zone table
+ * @ctrl: &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @zns: &struct nvme_zns
+ * @slba: Logical block address in the first zone to refresh
+ * @nzones: Number of zones to refresh
+ *
+ * Issue Zone Management Receive (Report Zones) commands for @nzones zones
+ * starting with the zone containing @slba and update those entries of the zone
+ * table. The commands are executed synchronously on @sq (see nvme_sync()).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_zns_report(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_zns *zns,
+		    uint64_t slba, uint32_t nzones);
+
+/**
+ * nvme_zns_mgmt_send - Perform a zone action
+ * @ctrl: &struct nvme_ctrl
+ * @sq: I/O submission queue
+ * @zns: &struct nvme_zns
+ * @zslba: Start logical block address of the zone
+ * @action: Zone action (see &enum nvme_zone_action)
+ * @all: Apply @action to all zones (in a state that allows it)
+ *
+ * Issue a Zone Management Send command synchronously on @sq (see nvme_sync())
+ * and update the zone table accordingly (if @all is set, by reporting all
+ * zones).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int nvme_zns_mgmt_send(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_zns *zns,
+		       uint64_t zslba, enum nvme_zone_action action, bool all);
+
+/**
+ * nvme_zns_zone - Look up the zone containing a logical block
+ * @zns: &struct nvme_zns
+ * @lba: Logical block address
+ *
+ * Return: The zone (see &struct nvme_zone), or NULL if @lba is beyond the last
+ * zone.
+ */
+static inline struct nvme_zone *nvme_zns_zone(struct nvme_zns *zns, uint64_t lba)
+{
+	uint64_t idx = lba / zns->zsze;
+
+	return idx < zns->nzones ? &zns->zones[idx] : NULL;
+}
+
+/**
+ * nvme_zns_zslba - Get the start logical block address of a zone
+ * @zns: &struct nvme_zns
+ * @zone: Zone (see &struct nvme_zone) in the zone table of @zns
+ *
+ * Return: The start logical block address of @zone.
+ */
+static inline uint64_t nvme_zns_zslba(struct nvme_zns *zns, struct nvme_zone *zone)
+{
+	return (uint64_t)(zone - zns->zones) * zns->zsze;
+}
+
+/**
+ * nvme_zns_prep_append - Prepare a Zone Append command
+ * @zns: &struct nvme_zns
+ * @cmd: NVMe command prototype (&union nvme_cmd)
+ * @zslba: Start logical block address of the zone
+ * @len: Data length in bytes (excluding any metadata)
+ *
+ * Initialize @cmd as a Zone Append command for @len bytes to the zone starting
+ * at @zslba, verifying that @len is a non-zero multiple of the logical block
+ * size that does not exceed &struct nvme_zns.max_append_nlb blocks. The data
+ * pointer is left for the caller to map.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` to ``EINVAL``.
+ */
+static inline int nvme_zns_prep_append(struct nvme_zns *zns, union nvme_cmd *cmd,
+				       uint64_t zslba, size_t len)
+{
+	uint64_t nlb = nvme_ns_nlb(zns->ns, len);
+
+	if (!nlb || len & ((1ULL << zns->ns->lbads) - 1) || nlb > zns->max_append_nlb ||
+	    zslba % zns->zsze || zslba / zns->zsze >= zns->nzones) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(cmd, 0x0, sizeof(*cmd));
+
+	cmd->rw.opcode = NVME_ZNS_ZONE_APPEND;
+	cmd->rw.nsid = cpu_to_le32(zns->ns->nsid);
+	cmd->rw.slba = cpu_to_le64(zslba);
+	cmd->rw.nlb = cpu_to_le16((uint16_t)(nlb - 1));
+
+	return 0;
+}
+
+/**
+ * nvme_zns_append_complete - Complete a Zone Append command
+ * @zns: &struct nvme_zns
+ * @cqe: Completion queue entry (&struct nvme_cqe) of a successful Zone Append
+ * @nlb: Number of logical blocks appended
+ *
+ * Advance the cached write pointer of the zone past the appended blocks (and
+ * update the cached zone state). May be called concurrently for the same zone.
+ *
+ * Return: The logical block address assigned to the first appended block.
+ */
+static inline uint64_t nvme_zns_append_complete(struct nvme_zns *zns, struct nvme_cqe *cqe,
+						uint32_t nlb)
+{
+	uint64_t lba = le64_to_cpu(cqe->qw0), end = lba + nlb, wp;
+	struct nvme_zone *zone = nvme_zns_zone(zns, lba);
+	uint8_t state = NVME_ZONE_STATE_EMPTY;
+
+	if (!zone)
+		return lba;
+
+	/* appends complete out of order; the write pointer only moves forward */
+	wp = atomic_load_acquire(&zone->wp);
+	while (wp < end && !atomic_cmpxchg(&zone->wp, wp, end))
+		;
+
+	if (end >= nvme_zns_zslba(zns, zone) + zone->zcap)
+		atomic_store_release(&zone->state, (uint8_t)NVME_ZONE_STATE_FULL);
+	else
+		atomic_cmpxchg(&zone->state, state, (uint8_t)NVME_ZONE_STATE_IMPLICITLY_OPEN);
+
+	return lba;
+}
+
+#endif /* LIBVFN_NVME_ZNS_H */
@@ -62,6 +62,33 @@ int pci_driver_new_id(const char *driver, uint16_t vid, uint16_t did);
  */
 int pci_driver_remove_id(const char *driver, uint16_t vid, uint16_t did);
 
+/**
+ * pci_driver_override - Set the driver override of a pci device
+ * @bdf: pci device identifier ("bus:device:function")
+ * @driver: kernel driver (NULL to clear the override)
+ *
+ * Write the ``driver_override`` sysfs property of the device identified by
+ * @bdf such that only @driver will bind to it. Unlike pci_driver_new_id(), this
+ * only affects the given device. The override takes effect when the device is
+ * probed (see pci_probe()).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int pci_driver_override(const char *bdf, const char *driver);
+
+/**
+ * pci_probe - Probe drivers for a pci device
+ * @bdf: pci device identifier ("bus:device:function")
+ *
+ * Ask the kernel to bind the (unbound) device identified by @bdf to a matching
+ * driver.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int pci_probe(const char *bdf);
+
 /**
  * pci_device_info_get_ull - Get sysfs property
  * @bdf: pci device identifier ("bus:device:function")
@@ -75,6 +102,30 @@ int pci_driver_remove_id(const char *driver, uint16_t vid, uint16_t did);
  */
 int pci_device_info_get_ull(const char *bdf, const char *prop, unsigned long long *v);
 
+/**
+ * pci_device_get_local_cpus - Get the cpus local to the device
+ * @bdf: pci device identifier ("bus:device:function")
+ * @cpus: output parameter for an allocated array of cpu numbers
+ *
+ * Parse the ``local_cpulist`` sysfs property of the device identified by
+ * @bdf. The caller is responsible for freeing @cpus.
+ *
+ * Return: On success, returns the number of cpus in @cpus. On error, returns
+ * ``-1`` and sets ``errno``.
+ */
+int pci_device_get_local_cpus(const char *bdf, int **cpus);
+
+/**
+ * pci_device_get_numa_node - Get the numa node of the device
+ * @bdf: pci device identifier ("bus:device:function")
+ *
+ * Read the ``numa_node`` sysfs property of the device identified by @bdf.
+ *
+ * Return: The numa node or ``-1`` if the device is not associated with a
+ * node (or on error).
+ */
+int pci_device_get_numa_node(const char *bdf);
+
 /**
  * pci_get_driver - Get the name of the driver that the device is currently
  *                  bound to
@@ -108,4 +159,133 @@ char *pci_get_iommu_group(const char *bdf);
  */
 char *pci_get_device_vfio_id(const char *bdf);
 
+/* class code (and mask) of nvme controllers */
+#define PCI_CLASS_NVME 0x010800
+#define PCI_CLASS_NVME_MASK 0xffff00
+
+/**
+ * struct pci_device_info - Pci device information
+ * @bdf: pci device identifier ("domain:bus:device.function")
+ * @vendor: Vendor id
+ * @device: Device id
+ * @classcode: Class code
+ * @numa_node: Numa node (``-1`` if the device is not associated with a node)
+ * @iommu_group: iommu group number (``-1`` if the device is not in a group)
+ * @driver: Name of the driver the device was bound to (empty if unbound)
+ */
+struct pci_device_info {
+	char bdf[16];
+	uint16_t vendor, device;
+	uint32_t classcode;
+	int numa_node;
+	int iommu_group;
+	char driver[32];
+};
+
+/**
+ * pci_scan - Enumerate pci devices
+ * @classcode: Class code to match
+ * @mask: Bits of @classcode to match (``0`` to match all devices)
+ * @devs: output parameter for an allocated array of &struct pci_device_info
+ *
+ * Scan ``/sys/bus/pci/devices`` once and collect the information of the
+ * devices whose class code matches @classcode in the bits of @mask (e.g.,
+ * ``PCI_CLASS_NVME`` and ``PCI_CLASS_NVME_MASK``), sorted by @bdf. The caller
+ * is responsible for freeing @devs.
+ *
+ * Return: On success, returns the number of devices in @devs. On error,
+ * returns ``-1`` and sets ``errno``.
+ */
+int pci_scan(uint32_t classcode, uint32_t mask, struct pci_device_info **devs);
+
+/**
+ * pci_device_lookup - Look up a device in the device cache
+ * @bdf: pci device identifier ("domain:bus:device.function")
+ * @info: output parameter
+ *
+ * Look up @bdf in a process-wide table of the nvme controllers in the system,
+ * built by pci_scan() on first use. pci_device_get_numa_node(),
+ * pci_get_iommu_group() and nvme_init() use the table and only fall back to
+ * reading sysfs for devices not in it. The table is invalidated by pci_bind()
+ * and pci_unbind(); call pci_device_cache_invalidate() if devices are added or
+ * removed otherwise.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENODEV`` if @bdf is not in the table).
+ */
+int pci_device_lookup(const char *bdf, struct pci_device_info *info);
+
+/**
+ * pci_device_cache_invalidate - Invalidate the device cache
+ *
+ * Have the next pci_device_lookup() scan the devices again.
+ */
+void pci_device_cache_invalidate(void);
+
+/* maximum number of upstream ports reported by pci_device_get_upstream() */
+#define PCI_TOPOLOGY_MAX_DEPTH 16
+
+/**
+ * struct pci_link_info - PCI Express link information
+ * @max_speed: Maximum link speed in MT/s (``0`` if unknown)
+ * @max_width: Maximum link width (``0`` if unknown)
+ * @speed: Current link speed in MT/s (``0`` if unknown)
+ * @width: Negotiated link width (``0`` if unknown)
+ */
+struct pci_link_info {
+	unsigned int max_speed;
+	unsigned int max_width;
+	unsigned int speed;
+	unsigned int width;
+};
+
+/**
+ * pci_device_get_link_info - Get the PCI Express link of a device
+ * @bdf: pci device identifier ("domain:bus:device.function")
+ * @info: output parameter
+ *
+ * Read the ``max_link_speed``, ``max_link_width``, ``current_link_speed`` and
+ * ``current_link_width`` sysfs properties of the device identified by @bdf. A
+ * link running at less than its maximum speed or width (e.g., a x4 device in
+ * a x16 slot trained at x1) usually indicates a cabling or slot problem.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOENT`` if the device has no PCI Express link).
+ */
+int pci_device_get_link_info(const char *bdf, struct pci_link_info *info);
+
+/**
+ * pci_device_get_upstream - Get the upstream ports of a device
+ * @bdf: pci device identifier ("domain:bus:device.function")
+ * @ports: output parameter for the upstream ports
+ * @n: number of entries in @ports
+ *
+ * Resolve the sysfs device path of @bdf and collect the bridges above it
+ * (switch ports and the root port), nearest first, followed by the host bridge
+ * (e.g., ``pci0000:00``).
+ *
+ * Return: On success, returns the number of ports stored in @ports (at most
+ * @n). On error, returns ``-1`` and sets ``errno``.
+ */
+int pci_device_get_upstream(const char *bdf, char (*ports)[16], int n);
+
+/**
+ * pci_device_common_upstream - Find the nearest common upstream port
+ * @a: pci device identifier ("domain:bus:device.function")
+ * @b: pci device identifier ("domain:bus:device.function")
+ * @port: output parameter for the common port (may be NULL)
+ * @len: size of @port
+ *
+ * Find the nearest port that both @a and @b are below. Peer-to-peer traffic
+ * between the two devices is routed through that port; it is usually most
+ * efficient if the port is a switch port rather than a root port or the host
+ * bridge.
+ *
+ * Return: On success, returns the distance between the two devices, i.e. the
+ * number of levels in the device hierarchy from @a up to @port and down to @b.
+ * On error, returns ``-1`` and sets ``errno`` (``ENOENT`` if the devices are
+ * not below a common host bridge).
+ */
+int pci_device_common_upstream(const char *a, const char *b, char *port, size_t len);
+
 #endif /* LIBVFN_PCI_UTIL_H */
@@ -23,6 +23,7 @@
 #define __atomic_store_n(ptr, val, memorder) ({ *(ptr) = val; })
 #define __atomic_compare_exchange_n(ptr, expected, desired, weak, ok_memorder, fail_memorder) \
 	({ *ptr = desired; })
+#define __atomic_exchange_n(ptr, val, memorder) ({ typeof(*(ptr)) __old = *(ptr); *(ptr) = val; __old; })
 #endif
 
 /**
@@ -92,6 +93,17 @@
 #define atomic_dec(ptr) \
 	((void) __atomic_fetch_sub(ptr, 1, __ATOMIC_SEQ_CST))
 
+/**
+ * atomic_add - Syntactic suger for __atomic_fetch_add
+ * @ptr: Pointer to value
+ * @val: Value to add
+ *
+ * Atomically add @val to the value at @ptr with sequential consistency
+ * semantics.
+ */
+#define atomic_add(ptr, val) \
+	((void) __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST))
+
 /**
  * atomic_cmpxchg - Syntactic suger for __atomic_compare_exchange_n
  * @ptr: Pointer to value to compare
@@ -105,4 +117,16 @@
 #define atomic_cmpxchg(ptr, expected, desired) \
 	__atomic_compare_exchange_n(ptr, &expected, desired, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)
 
+/**
+ * atomic_xchg - Syntactic suger for __atomic_exchange_n
+ * @ptr: Pointer to value
+ * @val: Value that should be set
+ *
+ * Atomically store @val in @ptr.
+ *
+ * Return: The previous value of @ptr.
+ */
+#define atomic_xchg(ptr, val) \
+	__atomic_exchange_n(ptr, val, __ATOMIC_ACQ_REL)
+
 #endif /* LIBVFN_SUPPORT_ATOMIC_H */
@@ -18,6 +18,15 @@
  *
  * Defines the usual ``rmb()``, ``wmb()``, ``mb()`` and ``dma_rmb()``
  * architecture specific memory barriers.
+ *
+ * ``rmb()``, ``wmb()`` and ``mb()`` order all memory accesses, including
+ * weakly ordered (e.g., streaming or write-combining) stores to memory-mapped
+ * regions. The cheaper ``dma_rmb()``, ``dma_wmb()`` and ``dma_mb()`` only order
+ * accesses to normal (coherent, cacheable) memory as observed by devices, such
+ * as a submission queue entry and the shadow doorbell that announces it.
+ * ``io_wmb()`` orders stores to normal memory before a following (uncached)
+ * mmio store, such as a doorbell write. ``cpu_relax()`` is a spin-wait hint
+ * for busy loops polling a value written by another thread.
  */
 
 /**
@@ -32,11 +41,24 @@
 # define wmb()		asm volatile("dsb st" ::: "memory")
 # define mb()		asm volatile("dsb sy" ::: "memory")
 # define dma_rmb()	asm volatile("dmb oshld" ::: "memory")
+# define dma_wmb()	asm volatile("dmb oshst" ::: "memory")
+# define dma_mb()	asm volatile("dmb osh" ::: "memory")
+# define io_wmb()	dma_wmb()
+# define cpu_relax()	asm volatile("yield" ::: "memory")
 #elif defined(__x86_64__)
 # define rmb()		asm volatile("lfence" ::: "memory")
 # define wmb()		asm volatile("sfence" ::: "memory")
 # define mb()		asm volatile("mfence" ::: "memory")
 # define dma_rmb()	barrier()
+# define dma_wmb()	barrier()
+/*
+ * A locked instruction orders stores with later loads (like mfence, but for
+ * normal memory only). Adding zero leaves the stack slot alone; the far end of
+ * the red zone is unlikely to hold recently accessed data.
+ */
+# define dma_mb()	asm volatile("lock; addl $0,-128(%%rsp)" ::: "memory", "cc")
+# define io_wmb()	barrier()
+# define cpu_relax()	asm volatile("pause" ::: "memory")
 #else
 # error unsupported architecture
 #endif
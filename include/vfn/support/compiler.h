@@ -64,6 +64,14 @@
  */
 #define STORE_PTR(ptr, val) __STORE_PTR(typeof(ptr), ptr, val)
 
+/*
+ * Cache line size assumed for data layout; this is part of the ABI of the
+ * structures using it and does not vary with the target.
+ */
+#define __VFN_CACHELINE_SIZE 64
+
+#define __cacheline_aligned __attribute__((aligned(__VFN_CACHELINE_SIZE)))
+
 #define likely(cond) __builtin_expect(!!(cond), 1)
 #define unlikely(cond) __builtin_expect(!!(cond), 0)
 
@@ -15,6 +15,7 @@
 
 extern struct log_state {
 	int v;
+	bool async;
 } __log_state;
 
 enum __log_level {
@@ -23,6 +24,14 @@ enum __log_level {
 	LOG_DEBUG,
 };
 
+/*
+ * Calls above this verbosity level are compiled away (see the ``log-level``
+ * build option).
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DEBUG
+#endif
+
 /**
  * logv - Determine if log verbosity is as given
  * @v: target verbositry level
@@ -31,6 +40,9 @@ enum __log_level {
  */
 static inline bool logv(int v)
 {
+	if (v > LOG_LEVEL_MAX)
+		return false;
+
 	if (atomic_load_acquire(&__log_state.v) >= v)
 		return true;
 
@@ -46,6 +58,29 @@ static inline void logv_set(int v)
 	atomic_store_release(&__log_state.v, v);
 }
 
+/**
+ * log_async_enable - Log asynchronously
+ *
+ * Format messages into a lock-free ring that is written to stderr by a
+ * background thread, such that logging never blocks the caller on stderr.
+ * Messages are truncated to 256 bytes; messages that do not fit in the ring
+ * are dropped (and counted).
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int log_async_enable(void);
+
+/**
+ * log_async_disable - Log synchronously
+ *
+ * Stop the background thread once it has written all queued messages and log
+ * directly to stderr again. Called on exit.
+ */
+void log_async_disable(void);
+
+void __log_async(char const *fmt, va_list va);
+
 /**
  * __log - Log a message at a given verbosity level
  * @v: verbosity level
@@ -62,7 +97,12 @@ static inline void __attribute__((format(printf, 2, 3))) __log(int v, char const
 		return;
 
 	va_start(va, fmt);
-	vfprintf(stderr, fmt, va);
+
+	if (atomic_load_acquire(&__log_state.async))
+		__log_async(fmt, va);
+	else
+		vfprintf(stderr, fmt, va);
+
 	va_end(va);
 }
 
@@ -70,19 +110,71 @@ static inline void __attribute__((format(printf, 2, 3))) __log(int v, char const
 #define log_fmt(fmt) fmt
 #endif
 
+/* the arguments are still type checked when the call is compiled away */
+#define __log_if(v, fmt, ...) \
+	((v) <= LOG_LEVEL_MAX ? __log(v, fmt, ##__VA_ARGS__) : (void)0)
+
 #ifdef DEBUG
-# define log_error(fmt, ...) __log(LOG_ERROR, "E %s (%s:%d): " log_fmt(fmt), \
-				   __func__, __FILE__, __LINE__, ##__VA_ARGS__)
-# define log_info(fmt, ...)  __log(LOG_INFO,  "I %s (%s:%d): " log_fmt(fmt), \
-				   __func__, __FILE__, __LINE__, ##__VA_ARGS__)
-# define log_debug(fmt, ...) __log(LOG_DEBUG, "D %s (%s:%d): " log_fmt(fmt), \
-				   __func__, __FILE__, __LINE__, ##__VA_ARGS__)
+# define log_error(fmt, ...) __log_if(LOG_ERROR, "E %s (%s:%d): " log_fmt(fmt), \
+				      __func__, __FILE__, __LINE__, ##__VA_ARGS__)
+# define log_info(fmt, ...)  __log_if(LOG_INFO,  "I %s (%s:%d): " log_fmt(fmt), \
+				      __func__, __FILE__, __LINE__, ##__VA_ARGS__)
+# define log_debug(fmt, ...) __log_if(LOG_DEBUG, "D %s (%s:%d): " log_fmt(fmt), \
+				      __func__, __FILE__, __LINE__, ##__VA_ARGS__)
 #else
-# define log_error(fmt, ...) __log(LOG_ERROR, log_fmt(fmt), ##__VA_ARGS__)
-# define log_info(fmt, ...)  __log(LOG_INFO,  log_fmt(fmt), ##__VA_ARGS__)
-# define log_debug(fmt, ...) __log(LOG_DEBUG, log_fmt(fmt), ##__VA_ARGS__)
+# define log_error(fmt, ...) __log_if(LOG_ERROR, log_fmt(fmt), ##__VA_ARGS__)
+# define log_info(fmt, ...)  __log_if(LOG_INFO,  log_fmt(fmt), ##__VA_ARGS__)
+# define log_debug(fmt, ...) __log_if(LOG_DEBUG, log_fmt(fmt), ##__VA_ARGS__)
 #endif /* DEBUG */
 
+struct trace_ratelimit_state {
+	int interval, skipped;
+	uint64_t tag;
+	uint64_t begin, end;
+};
+
+bool __trace_ratelimited(struct trace_ratelimit_state *rs, uint64_t tag, const char *event);
+
+/*
+ * Each call site is ratelimited on its own; the state is per thread such that
+ * pollers do not share it.
+ */
+#define __logrl(v, log, interval, tag, fmt, ...) \
+	({ \
+		static __thread struct trace_ratelimit_state _rs = { \
+			interval, 0, 0, 0, 0, \
+		}; \
+		\
+		if (logv(v) && !__trace_ratelimited(&_rs, tag, __func__)) \
+			log(fmt, ##__VA_ARGS__); \
+	})
+
+/**
+ * log_errorrl - Log an error message (ratelimited)
+ * @interval: ratelimiting interval in seconds
+ * @tag: identifies what is subject to ratelimiting (e.g. a pointer or fixed tag)
+ * @fmt: format string
+ * @...: format string arguments
+ *
+ * Like log_error(), but log at most one message per @interval seconds from the
+ * call site as long as @tag is unchanged. The number of messages skipped is
+ * reported when the next message is logged.
+ */
+#define log_errorrl(interval, tag, fmt, ...) \
+	__logrl(LOG_ERROR, log_error, interval, tag, fmt, ##__VA_ARGS__)
+
+/**
+ * log_debugrl - Log a debug message (ratelimited)
+ * @interval: ratelimiting interval in seconds
+ * @tag: identifies what is subject to ratelimiting
+ * @fmt: format string
+ * @...: format string arguments
+ *
+ * See log_errorrl().
+ */
+#define log_debugrl(interval, tag, fmt, ...) \
+	__logrl(LOG_DEBUG, log_debug, interval, tag, fmt, ##__VA_ARGS__)
+
 #define log_fatal(fmt, ...) \
 	do { \
 		log_error(fmt, ##__VA_ARGS__); \
@@ -76,6 +76,21 @@ static inline void *zmalloc(size_t sz)
 	return mem;
 }
 
+static inline void *zmalloc_aligned(size_t align, size_t sz)
+{
+	void *mem = NULL;
+
+	if (unlikely(!sz))
+		return NULL;
+
+	if (unlikely(posix_memalign(&mem, align, sz)))
+		backtrace_abort();
+
+	memset(mem, 0x0, sz);
+
+	return mem;
+}
+
 static inline void *mallocn(unsigned int n, size_t sz)
 {
 	if (would_overflow(n, sz)) {
@@ -115,9 +130,46 @@ static inline void *reallocn(void *mem, unsigned int n, size_t sz)
 #define new_t(t, n) _new_t(t, n, mallocn)
 #define znew_t(t, n) _new_t(t, n, zmallocn)
 
+/* for types with an alignment requirement beyond that of malloc */
+#define znew_aligned_t(t, n) \
+	((t *) zmalloc_aligned(__alignof__(t), __abort_on_overflow(n, sizeof(t))))
+
 ssize_t pgmap(void **mem, size_t sz);
 ssize_t pgmapn(void **mem, unsigned int n, size_t sz);
 
+/**
+ * pgmap_huge - Allocate hugepage backed memory
+ * @mem: output parameter for the allocated memory
+ * @sz: number of bytes to allocate
+ * @shift: hugepage size shift (e.g., 21 for 2M or 30 for 1G pages)
+ *
+ * Allocate @sz bytes, rounded up to the hugepage size, backed by hugetlb pages.
+ * If no hugetlb pages are available, fall back to an aligned anonymous mapping
+ * advised to use transparent hugepages.
+ *
+ * The memory may be released with pgunmap().
+ *
+ * Return: The length of the allocation on success, ``-1`` on error and sets
+ * ``errno``.
+ */
+ssize_t pgmap_huge(void **mem, size_t sz, unsigned int shift);
+
+/**
+ * pgbind - Set the preferred numa node of memory
+ * @mem: page aligned memory
+ * @len: number of bytes
+ * @node: numa node; if negative, this is a no-op
+ *
+ * Prefer allocating pages for @mem on @node (``mbind(2)`` with
+ * ``MPOL_PREFERRED``); pages fall back to other nodes if @node is out of
+ * memory. Only pages faulted in after the call are affected, so call this
+ * before the memory is touched (or mapped with iommu_map_vaddr(), which faults
+ * it in).
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int pgbind(void *mem, size_t len, int node);
+
 static inline void pgunmap(void *mem, size_t len)
 {
 	if (munmap(mem, len))
@@ -13,6 +13,10 @@
 #ifndef LIBVFN_SUPPORT_MMIO_H
 #define LIBVFN_SUPPORT_MMIO_H
 
+#if defined(__x86_64__)
+# include <emmintrin.h>
+#endif
+
 /**
  * mmio_read32 - read 4 bytes in memory-mapped register
  * @addr: memory-mapped register
@@ -86,4 +90,27 @@ static inline void mmio_hl_write64(void *addr, leint64_t v)
 	mmio_write32(addr, (leint32_t __force)v);
 }
 
+/**
+ * mmio_stream - copy to write-combining memory-mapped region
+ * @addr: memory-mapped destination (16 byte aligned)
+ * @src: source buffer
+ * @len: number of bytes to copy (multiple of 16)
+ *
+ * Copy @len bytes from @src to @addr using streaming (non-temporal) stores
+ * where supported by the architecture, allowing the stores to be combined into
+ * full bus transactions. The stores are weakly ordered; issue a ``wmb()``
+ * before any subsequent doorbell write.
+ */
+static inline void mmio_stream(void *addr, const void *src, size_t len)
+{
+#if defined(__x86_64__)
+	for (size_t i = 0; i < len; i += 16)
+		_mm_stream_si128((__m128i *)(addr + i), _mm_loadu_si128((const __m128i *)(src + i)));
+#else
+	for (size_t i = 0; i < len; i += 8)
+		/* memory-mapped region */
+		*(volatile uint64_t __force *)(addr + i) = *(const uint64_t *)(src + i);
+#endif
+}
+
 #endif /* LIBVFN_SUPPORT_MMIO_H */
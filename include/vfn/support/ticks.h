@@ -25,7 +25,23 @@
 # error unsupported architecture
 #endif
 
-extern uint64_t __vfn_ticks_freq;
+/*
+ * Fixed-point conversion factor; a value v converts to (v * mult) >> shift,
+ * computed with a 128-bit intermediate product such that the multiplication
+ * itself cannot overflow. The result is truncated to 64 bits, so when mult
+ * exceeds 2^shift (the conversion scales up) large inputs still wrap.
+ */
+__extension__ typedef unsigned __int128 __vfn_u128;
+
+struct __vfn_ticks_conv {
+	uint64_t mult;
+	unsigned int shift;
+};
+
+extern uint64_t __vfn_ticks_freq_cached;
+extern struct __vfn_ticks_conv __vfn_ticks_to_ns, __vfn_ns_to_ticks;
+
+uint64_t __vfn_ticks_calibrate(void);
 
 /**
  * get_ticks - get ticks
@@ -39,4 +55,62 @@ static inline uint64_t get_ticks(void)
 
 uint64_t get_ticks_freq_arch(void);
 
+/**
+ * get_ticks_freq - get the frequency of the timestamp counter
+ *
+ * The frequency is determined on first use. If the architecture does not
+ * report it, it is measured (which takes about 100 ms) and cached in
+ * ``/run/libvfn`` for subsequent processes.
+ *
+ * Return: ticks per second
+ */
+static inline uint64_t get_ticks_freq(void)
+{
+	uint64_t freq = __atomic_load_n(&__vfn_ticks_freq_cached, __ATOMIC_ACQUIRE);
+
+	if (__builtin_expect(!freq, 0))
+		freq = __vfn_ticks_calibrate();
+
+	return freq;
+}
+
+static inline uint64_t __ticks_conv(const struct __vfn_ticks_conv *conv, uint64_t v)
+{
+	return (uint64_t)(((__vfn_u128)v * conv->mult) >> conv->shift);
+}
+
+/**
+ * ticks_to_ns - convert ticks to nanoseconds
+ * @ticks: number of ticks
+ *
+ * Convert with a precomputed multiplier and shift (no division).
+ *
+ * Return: @ticks in nanoseconds
+ */
+static inline uint64_t ticks_to_ns(uint64_t ticks)
+{
+	/* calibrates on first use */
+	get_ticks_freq();
+
+	return __ticks_conv(&__vfn_ticks_to_ns, ticks);
+}
+
+/**
+ * ns_to_ticks - convert nanoseconds to ticks
+ * @ns: number of nanoseconds
+ *
+ * Convert with a precomputed multiplier and shift (no division).
+ *
+ * Return: @ns in ticks
+ */
+static inline uint64_t ns_to_ticks(uint64_t ns)
+{
+	get_ticks_freq();
+
+	return __ticks_conv(&__vfn_ns_to_ticks, ns);
+}
+
+/* deprecated; use get_ticks_freq() */
+#define __vfn_ticks_freq get_ticks_freq()
+
 #endif /* LIBVFN_SUPPORT_TICKS_H */
@@ -14,12 +14,96 @@
 #define LIBVFN_TRACE_H
 
 #include <vfn/trace/events.h>
+#include <vfn/trace/ring.h>
 
 #ifdef DEBUG
 extern __thread const char *__trace_event;
+extern __thread int __trace_event_id;
+extern bool __trace_ring_enabled;
 
 # define __trace_prefix(fmt) "T %s (%s:%d) " fmt
 
+void __trace_ring_emit(const char *fmt, int nargs, uint64_t a0, uint64_t a1, uint64_t a2,
+		       uint64_t a3, uint64_t a4);
+
+# define __trace_arg(x) ((uint64_t)(uintptr_t)(x))
+
+# define __trace_args0() 0, 0, 0, 0, 0, 0
+# define __trace_args1(a) 1, __trace_arg(a), 0, 0, 0, 0
+# define __trace_args2(a, b) 2, __trace_arg(a), __trace_arg(b), 0, 0, 0
+# define __trace_args3(a, b, c) 3, __trace_arg(a), __trace_arg(b), __trace_arg(c), 0, 0
+# define __trace_args4(a, b, c, d) \
+	4, __trace_arg(a), __trace_arg(b), __trace_arg(c), __trace_arg(d), 0
+# define __trace_args5(a, b, c, d, e) \
+	5, __trace_arg(a), __trace_arg(b), __trace_arg(c), __trace_arg(d), __trace_arg(e)
+
+# define __trace_nargs_(_0, _1, _2, _3, _4, _5, n, ...) n
+# define __trace_nargs(...) __trace_nargs_(0, ##__VA_ARGS__, 5, 4, 3, 2, 1, 0)
+
+# define ___trace_args(n, ...) __trace_args ## n(__VA_ARGS__)
+# define __trace_args_(n, ...) ___trace_args(n, ##__VA_ARGS__)
+# define __trace_args(...) __trace_args_(__trace_nargs(__VA_ARGS__), ##__VA_ARGS__)
+
+# ifdef TRACE_STATIC_KEYS
+/**
+ * struct trace_jump_entry - Patchable trace guard site
+ * @code: address of the patchable instruction
+ * @target: address of the trace scope
+ * @event: trace event index
+ */
+struct trace_jump_entry {
+	uint64_t code, target, event;
+};
+
+extern const struct trace_jump_entry __start___vfn_trace_jump[]
+	__attribute__((weak, visibility("hidden")));
+extern const struct trace_jump_entry __stop___vfn_trace_jump[]
+	__attribute__((weak, visibility("hidden")));
+
+void __trace_jump_register(const struct trace_jump_entry *start,
+			   const struct trace_jump_entry *stop);
+
+/*
+ * Each executable or shared object has its own table of guard sites; register
+ * it such that trace_set_active() can patch them.
+ */
+static void __attribute__((constructor, used)) __trace_jump_init(void)
+{
+	__trace_jump_register(__start___vfn_trace_jump, __stop___vfn_trace_jump);
+}
+
+#  if defined(__x86_64__)
+#   define __TRACE_JUMP_NOP ".byte 0x0f, 0x1f, 0x44, 0x00, 0x00"
+#  elif defined(__aarch64__)
+#   define __TRACE_JUMP_NOP "nop"
+#  else
+#   error unsupported architecture
+#  endif
+
+/*
+ * The guard site is a nop that trace_set_active() patches into a jump to the
+ * trace scope when the event is enabled.
+ */
+static inline __attribute__((always_inline)) bool __trace_static_branch(const int event)
+{
+	asm goto("1: " __TRACE_JUMP_NOP "\n\t"
+		 ".pushsection __vfn_trace_jump, \"aw\"\n\t"
+		 ".balign 8\n\t"
+		 ".quad 1b, %l[active], %c0\n\t"
+		 ".popsection\n\t"
+		 : : "i" (event) : : active);
+
+	return false;
+
+active:
+	return true;
+}
+
+#  define __trace_active(name) __trace_static_branch(TRACE_ ## name ## _ID)
+# else
+#  define __trace_active(name) TRACE_ ## name ## _ACTIVE
+# endif
+
 /**
  * trace_guard - conditionally open a tracing scope
  * @name: trace event identifier
@@ -34,13 +118,18 @@ extern __thread const char *__trace_event;
  *     }
  *
  * If debugging is disabled, or if the specific tracing event is statically
- * disabled, this will have zero overhead.
+ * disabled, this will have zero overhead. If libvfn is configured with
+ * ``-Dtrace-static-keys=true``, a dynamically disabled event costs a single
+ * nop instruction (instead of a load and a branch); trace_set_active() patches
+ * the instruction into a jump.
  */
 # define trace_guard(name) \
 	if (({ \
-		bool cond = ((!TRACE_ ## name ## _DISABLED) && TRACE_ ## name ## _ACTIVE); \
-		if (cond) \
+		bool cond = ((!TRACE_ ## name ## _DISABLED) && __trace_active(name)); \
+		if (cond) { \
 			__trace_event = TRACE_ ## name; \
+			__trace_event_id = TRACE_ ## name ## _ID; \
+		} \
 		cond; \
 	}))
 
@@ -51,9 +140,21 @@ extern __thread const char *__trace_event;
  *
  * Emit a trace point message. Must be used inside an opened trace point. See
  * trace_guard().
+ *
+ * If the binary ring buffer backend is enabled (see trace_ring_dump()), the
+ * message is not formatted; instead, a &struct trace_ring_record holding the
+ * format string and the raw arguments is written to a per-thread ring buffer.
+ * In that case, at most TRACE_RING_MAX_ARGS integer or pointer arguments are
+ * supported.
  */
 # define trace_emit(fmt, ...) \
-	fprintf(stderr, __trace_prefix(fmt), __trace_event, __FILE__, __LINE__, ##__VA_ARGS__)
+	do { \
+		if (__trace_ring_enabled) \
+			__trace_ring_emit(fmt, __trace_args(__VA_ARGS__)); \
+		else \
+			fprintf(stderr, __trace_prefix(fmt), __trace_event, __FILE__, __LINE__, \
+				##__VA_ARGS__); \
+	} while (0)
 
 /**
  * trace_emitrl - emit a trace event message (ratelimited)
@@ -83,21 +184,36 @@ extern __thread const char *__trace_event;
 # define trace_emitrl(interval, subject, fmt, ...) ((void)0)
 #endif
 
-struct trace_ratelimit_state {
-	int interval, skipped;
-	uint64_t tag;
-	uint64_t begin, end;
-};
+/**
+ * trace_probe - fire a USDT probe
+ * @name: trace event identifier
+ * @...: typed probe arguments (as declared in the trace events file)
+ *
+ * If libvfn is built with USDT support (``-Dusdt=enabled`` or ``auto`` and
+ * ``<sys/sdt.h>`` available), fire the ``libvfn:<event>`` probe. Unlike
+ * trace_guard(), probes are independent of ``DEBUG`` and cost a single nop
+ * when no tracer (e.g. bpftrace) is attached. Statically disabled events have
+ * no probes.
+ */
+#ifdef TRACE_USDT
+# define trace_probe(name, ...) __trace_probe_ ## name(__VA_ARGS__)
+#else
+# define trace_probe(name, ...) ((void)0)
+#endif
 
-bool __trace_ratelimited(struct trace_ratelimit_state *rs, uint64_t tag, const char *event);
+/* struct trace_ratelimit_state is declared in vfn/support/log.h */
 
 /**
- * trace_event_set_active - Enable or disable a range of trace events
+ * trace_set_active - Enable or disable a range of trace events
  * @prefix: trace event identifier prefix
  * @active: boolean (enable/disable)
  *
  * Enable/disable all trace points with the given @prefix.
+ *
+ * With static keys (``-Dtrace-static-keys=true``), this patches the code of
+ * the trace guards and should not be called while other threads may be
+ * executing them (e.g. while doing I/O).
  */
-void trace_event_set_active(const char *prefix, bool active);
+void trace_set_active(const char *prefix, bool active);
 
 #endif /* LIBVFN_TRACE_H */
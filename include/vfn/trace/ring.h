@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#ifndef LIBVFN_TRACE_RING_H
+#define LIBVFN_TRACE_RING_H
+
+#define TRACE_RING_MAGIC "VFNTRACE"
+#define TRACE_RING_VERSION 1
+
+#define TRACE_RING_MAX_ARGS 5
+
+/**
+ * struct trace_ring_record - Binary trace record
+ * @ticks: timestamp (see get_ticks())
+ * @fmt: format string address (in memory) or format string table index (in a
+ *       dump file)
+ * @event: trace event index
+ * @nargs: number of valid @args
+ * @rsvd: reserved
+ * @tid: thread identifier of the emitting thread
+ * @args: raw format string arguments (converted to 64 bits)
+ *
+ * Records are emitted by trace_emit() when the binary ring buffer backend is
+ * enabled. Arguments are stored unformatted and must be decoded offline.
+ */
+struct trace_ring_record {
+	uint64_t ticks;
+	uint64_t fmt;
+	uint16_t event;
+	uint8_t nargs;
+	uint8_t rsvd;
+	uint32_t tid;
+	uint64_t args[TRACE_RING_MAX_ARGS];
+};
+
+/**
+ * struct trace_ring_header - Binary trace dump file header
+ * @magic: TRACE_RING_MAGIC (not NUL-terminated)
+ * @version: TRACE_RING_VERSION
+ * @nevents: number of entries in the event name table
+ * @nfmts: number of entries in the format string table
+ * @rsvd: reserved
+ * @ticks_freq: tick frequency (ticks per second) of &struct trace_ring_record.ticks
+ * @nrecords: number of records
+ *
+ * A dump file consists of this header, followed by @nevents and @nfmts
+ * NUL-terminated strings (the event name and format string tables), followed
+ * by @nrecords &struct trace_ring_record. Records are grouped by thread and
+ * ordered by time within each group.
+ */
+struct trace_ring_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nevents;
+	uint32_t nfmts;
+	uint32_t rsvd;
+	uint64_t ticks_freq;
+	uint64_t nrecords;
+};
+
+/**
+ * trace_ring_dump - Write the contents of all trace ring buffers to a file
+ * @path: output file path
+ *
+ * Write the records currently held in the per-thread trace ring buffers to
+ * @path. Records being emitted concurrently may or may not be included.
+ *
+ * If the ring buffer backend is enabled with the ``VFN_TRACE_RING`` environment
+ * variable, this is done automatically at exit to the path given by the
+ * variable.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno``.
+ */
+int trace_ring_dump(const char *path);
+
+#endif /* LIBVFN_TRACE_RING_H */
@@ -37,6 +37,20 @@ struct vfio_device {
  */
 int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count);
 
+/**
+ * vfio_set_irq_range - Enable IRQs through eventfds for a subrange of vectors
+ * @dev: &struct vfio_device
+ * @eventfds: array of eventfds
+ * @start: first vector
+ * @count: number of eventfds
+ *
+ * Like vfio_set_irq(), but for the @count vectors starting at @start. An
+ * eventfd of ``-1`` disables the trigger for the corresponding vector.
+ *
+ * Return: ``0`` on success, ``-1`` on error and sets ``errno``.
+ */
+int vfio_set_irq_range(struct vfio_device *dev, int *eventfds, int start, int count);
+
 /**
  * vfio_disable_irq - Disable all IRQs
  * @dev: &struct vfio_device
@@ -17,12 +17,16 @@
 # define PCI_STD_NUM_BARS 6
 #endif
 
+#define VFIO_PCI_MAX_MMAP_AREAS 4
+
 /**
  * struct vfio_pci_device - vfio pci device state
  * @dev: &struct vfio_device
  * @bdf: pci device identifier ("bus:device:function")
  * @config_region_info: pci configuration space region information
  * @bar_region_info: pci BAR region information
+ * @bar_mmap_areas: mmap-able ranges of each BAR (relative to the BAR)
+ * @nbar_mmap_areas: number of mmap-able ranges of each BAR
  */
 struct vfio_pci_device {
 	struct vfio_device dev;
@@ -31,6 +35,55 @@ struct vfio_pci_device {
 
 	struct vfio_region_info config_region_info;
 	struct vfio_region_info bar_region_info[PCI_STD_NUM_BARS];
+
+	struct vfio_region_sparse_mmap_area
+		bar_mmap_areas[PCI_STD_NUM_BARS][VFIO_PCI_MAX_MMAP_AREAS];
+	int nbar_mmap_areas[PCI_STD_NUM_BARS];
+
+	/* private: configuration space snapshot; invalid if config_len is 0 */
+	uint8_t *config;
+	size_t config_len;
+};
+
+/**
+ * struct vfio_pci_msix_info - MSI-X capability
+ * @nvec: number of vectors
+ * @table_bir: bar holding the vector table
+ * @table_offset: offset of the vector table in the bar
+ * @pba_bir: bar holding the pending bit array
+ * @pba_offset: offset of the pending bit array in the bar
+ */
+struct vfio_pci_msix_info {
+	int nvec;
+	int table_bir;
+	uint32_t table_offset;
+	int pba_bir;
+	uint32_t pba_offset;
+};
+
+/**
+ * struct vfio_pci_link_info - PCI Express link capabilities and status
+ * @max_speed: maximum link speed (Link Capabilities, encoded as in the
+ *             specification; ``1`` is 2.5 GT/s)
+ * @max_width: maximum link width
+ * @speed: current link speed (Link Status)
+ * @width: negotiated link width
+ */
+struct vfio_pci_link_info {
+	uint8_t max_speed;
+	uint8_t max_width;
+	uint8_t speed;
+	uint8_t width;
+};
+
+/**
+ * struct vfio_pci_acs_info - Access Control Services capability
+ * @cap: ACS Capability register
+ * @ctrl: ACS Control register
+ */
+struct vfio_pci_acs_info {
+	uint16_t cap;
+	uint16_t ctrl;
 };
 
 /**
@@ -38,13 +91,49 @@ struct vfio_pci_device {
  * @pci: &struct vfio_pci_device to initialize
  * @bdf: pci device identifier ("bus:device:function") to open
  *
- * Open the pci device identified by @bdf and initialize @pci.
+ * Open the pci device identified by @bdf and initialize @pci. Opened devices
+ * are cached per process (by @bdf and iommu context), so opening a device that
+ * is already open, or that was closed with vfio_pci_close(), reuses the device
+ * file descriptor and region information instead of resolving the device
+ * through sysfs and setting it up again.
  *
  * Return: On success, returns ``0``. On error, returns ``-1`` and sets
  * ``errno``.
  */
 int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf);
 
+/**
+ * vfio_pci_close - close a pci device
+ * @pci: &struct vfio_pci_device opened with vfio_pci_open()
+ *
+ * Drop the reference to the device taken by vfio_pci_open(). The device file
+ * descriptor is kept open such that the device can be reopened quickly; use
+ * vfio_pci_cache_flush() to release it.
+ */
+void vfio_pci_close(struct vfio_pci_device *pci);
+
+/**
+ * vfio_pci_cache_flush - release closed pci devices
+ *
+ * Close the file descriptors of all cached devices that are no longer open,
+ * allowing them to be reset and bound to other drivers.
+ */
+void vfio_pci_cache_flush(void);
+
+/**
+ * vfio_pci_reset - reset a pci device
+ * @pci: &struct vfio_pci_device
+ *
+ * Reset the device with vfio_reset() (typically a function level reset), poll
+ * the configuration space until the device responds again and enable bus
+ * mastering if it was lost. Bar mappings remain valid.
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOTSUP`` if the device cannot be reset, ``ETIMEDOUT`` if it
+ * does not become ready).
+ */
+int vfio_pci_reset(struct vfio_pci_device *pci);
+
 /**
  * vfio_pci_map_bar - map a vfio device region into virtual memory
  * @pci: &struct vfio_pci_device
@@ -54,6 +143,8 @@ int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf);
  * @prot: what accesses to permit to the mapped area (see ``man mmap``).
  *
  * Map the vfio device memory region identified by @idx into virtual memory.
+ * The range must be contained in one of the mmap-able areas of the BAR (see
+ * vfio_pci_get_bar_mmap_areas()).
  *
  * Return: On success, returns the virtual memory address mapped. On error,
  * returns ``NULL`` and sets ``errno``.
@@ -61,6 +152,44 @@ int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf);
 void *vfio_pci_map_bar(struct vfio_pci_device *pci, int idx, size_t len, uint64_t offset,
 		       int prot);
 
+/**
+ * vfio_pci_map_bar_wc - map a pci bar region into virtual memory as
+ *                       write-combining
+ * @pci: &struct vfio_pci_device
+ * @idx: the bar index to map
+ * @len: number of bytes to map
+ * @offset: offset at which to start mapping
+ * @prot: what accesses to permit to the mapped area (see ``man mmap``).
+ *
+ * Map the bar identified by @idx into virtual memory with a write-combining
+ * memory type. vfio always maps bars uncached, so this uses the sysfs
+ * ``resource<N>_wc`` file of the device, which requires a prefetchable bar and
+ * sufficient privileges. If that fails, falls back to vfio_pci_map_bar().
+ *
+ * The region may be unmapped with vfio_pci_unmap_bar().
+ *
+ * Return: On success, returns the virtual memory address mapped. On error,
+ * returns ``NULL`` and sets ``errno``.
+ */
+void *vfio_pci_map_bar_wc(struct vfio_pci_device *pci, int idx, size_t len, uint64_t offset,
+			  int prot);
+
+/**
+ * vfio_pci_get_bar_mmap_areas - get the mmap-able ranges of a pci bar
+ * @pci: &struct vfio_pci_device
+ * @idx: the bar index
+ * @areas: output parameter for the array of ranges
+ *
+ * Get the ranges of the bar identified by @idx that may be mapped with
+ * vfio_pci_map_bar(). Offsets are relative to the start of the bar. vfio may
+ * exclude parts of a bar from mmap (e.g. a page holding the MSI-X table), in
+ * which case the bar is reported as several sparse ranges.
+ *
+ * Return: The number of ranges in @areas (``0`` if the bar cannot be mapped).
+ */
+int vfio_pci_get_bar_mmap_areas(struct vfio_pci_device *pci, int idx,
+				const struct vfio_region_sparse_mmap_area **areas);
+
 /**
  * vfio_pci_unmap_bar - unmap a vfio device region in virtual memory
  * @pci: &struct vfio_pci_device
@@ -108,8 +237,118 @@ static inline ssize_t vfio_pci_read_config(struct vfio_pci_device *pci, void *bu
 static inline ssize_t vfio_pci_write_config(struct vfio_pci_device *pci, void *buf, size_t len,
 					    off_t offset)
 {
+	/* registers may not read back as written; drop the snapshot */
+	pci->config_len = 0;
+
 	return pwrite(pci->dev.fd, buf, len, pci->config_region_info.offset + offset);
 }
 
+/**
+ * vfio_pci_config_snapshot - Get a snapshot of the PCI configuration space
+ * @pci: &struct vfio_pci_device
+ * @len: output parameter for the size of the snapshot
+ *
+ * Read the configuration space (up to the 4K of extended configuration space)
+ * with a single access and cache it, such that subsequent calls, and the
+ * capability helpers below, do not access the device. The snapshot is
+ * invalidated by vfio_pci_write_config() and vfio_pci_config_invalidate().
+ *
+ * The snapshot is not suitable for registers that change by themselves (e.g.,
+ * the status register); use vfio_pci_read_config() for those.
+ *
+ * Return: On success, returns the snapshot (valid until invalidated). On
+ * error, returns ``NULL`` and sets ``errno``.
+ */
+const void *vfio_pci_config_snapshot(struct vfio_pci_device *pci, size_t *len);
+
+/**
+ * vfio_pci_config_invalidate - Invalidate the configuration space snapshot
+ * @pci: &struct vfio_pci_device
+ *
+ * Invalidate the snapshot taken by vfio_pci_config_snapshot(), e.g. after the
+ * device was reset.
+ */
+void vfio_pci_config_invalidate(struct vfio_pci_device *pci);
+
+/**
+ * vfio_pci_find_cap - Find a PCI capability
+ * @pci: &struct vfio_pci_device
+ * @id: capability id (``PCI_CAP_ID_*``)
+ *
+ * Walk the capability list of the configuration space snapshot (see
+ * vfio_pci_config_snapshot()).
+ *
+ * Return: The offset of the capability, ``0`` if the device does not have it
+ * or ``-1`` on error (and sets ``errno``).
+ */
+int vfio_pci_find_cap(struct vfio_pci_device *pci, uint8_t id);
+
+/**
+ * vfio_pci_find_ext_cap - Find a PCI Express extended capability
+ * @pci: &struct vfio_pci_device
+ * @id: extended capability id (``PCI_EXT_CAP_ID_*``)
+ *
+ * Like vfio_pci_find_cap(), but walks the extended capability list.
+ *
+ * Return: See vfio_pci_find_cap().
+ */
+int vfio_pci_find_ext_cap(struct vfio_pci_device *pci, uint16_t id);
+
+/**
+ * vfio_pci_get_msix_info - Get the MSI-X table location
+ * @pci: &struct vfio_pci_device
+ * @info: output parameter
+ *
+ * Return: On success, returns ``0``. On error, returns ``-1`` and sets
+ * ``errno`` (``ENOENT`` if the device does not have the capability).
+ */
+int vfio_pci_get_msix_info(struct vfio_pci_device *pci, struct vfio_pci_msix_info *info);
+
+/**
+ * vfio_pci_get_link_info - Get the PCI Express link capabilities and status
+ * @pci: &struct vfio_pci_device
+ * @info: output parameter
+ *
+ * The link status is that of the snapshot; invalidate it first (see
+ * vfio_pci_config_invalidate()) to get the current status.
+ *
+ * Return: See vfio_pci_get_msix_info().
+ */
+int vfio_pci_get_link_info(struct vfio_pci_device *pci, struct vfio_pci_link_info *info);
+
+/**
+ * vfio_pci_get_acs_info - Get the Access Control Services registers
+ * @pci: &struct vfio_pci_device
+ * @info: output parameter
+ *
+ * Return: See vfio_pci_get_msix_info().
+ */
+int vfio_pci_get_acs_info(struct vfio_pci_device *pci, struct vfio_pci_acs_info *info);
+
+/**
+ * vfio_pci_memcpy_to_bar - copy to a mapped pci bar
+ * @dst: destination address in a mapped bar
+ * @src: source buffer
+ * @len: number of bytes to copy
+ *
+ * Copy @len bytes to bar memory using non-temporal stores for the 16 byte
+ * aligned part and single stores for any unaligned head and tail. On a
+ * write-combining mapping (see vfio_pci_map_bar_wc()) this lets the cpu issue
+ * full cache line writes to the device. The stores are ordered (wmb()) before
+ * any subsequent write, such as a doorbell.
+ */
+void vfio_pci_memcpy_to_bar(void *dst, const void *src, size_t len);
+
+/**
+ * vfio_pci_memcpy_from_bar - copy from a mapped pci bar
+ * @dst: destination buffer
+ * @src: source address in a mapped bar
+ * @len: number of bytes to copy
+ *
+ * Copy @len bytes from bar memory using naturally aligned 8 byte loads where
+ * possible. Unlike memcpy(), this never issues loads wider than the device may
+ * support.
+ */
+void vfio_pci_memcpy_from_bar(void *dst, const void *src, size_t len);
 
 #endif /* LIBVFN_VFIO_PCI_H */
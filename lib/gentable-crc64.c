@@ -21,7 +21,8 @@
 
 #include "ccan/compiler/compiler.h"
 
-static UNNEEDED int COEFFS[] = {
+/* exponents of the (non-reflected) polynomial, except x^64 */
+static int COEFFS[] = {
 	63, 61, 59, 58, 56, 55, 52, 49,
 	48, 47, 46, 44, 41, 37, 36, 34,
 	32, 31, 28, 26, 23, 22, 19, 16,
@@ -30,7 +31,42 @@ static UNNEEDED int COEFFS[] = {
 
 #define CRC64_NVME_POLY 0x9A6C9329AC4BC9B5ULL
 
-static uint64_t crc64_nvme_table[256] = { 0 };
+/* slice-by-8; table k holds the crc of a byte followed by k zero bytes */
+static uint64_t crc64_nvme_table[8][256] = { 0 };
+
+/*
+ * Folding constants for carry-less multiplication. Folding a 128 bit block by
+ * d bits multiplies its high and low order halves by x^(d + 64) and x^d
+ * respectively; the constants are one degree lower since a carry-less multiply
+ * of reflected operands yields the product shifted by one.
+ */
+static const int FOLDS[] = { 128, 512 };
+
+static uint64_t crc64_nvme_fold[2][2];
+
+static uint64_t reflect(uint64_t v)
+{
+	uint64_t r = 0;
+
+	for (int i = 0; i < 64; i++)
+		r |= ((v >> i) & 1) << (63 - i);
+
+	return r;
+}
+
+/* x^n mod P (reflected) */
+static uint64_t xpow(int n)
+{
+	uint64_t poly = 0, r = 1;
+
+	for (unsigned int i = 0; i < sizeof(COEFFS) / sizeof(COEFFS[0]); i++)
+		poly |= 1ULL << COEFFS[i];
+
+	for (int i = 0; i < n; i++)
+		r = (r << 1) ^ ((r >> 63) ? poly : 0);
+
+	return reflect(r);
+}
 
 static void generate(void)
 {
@@ -48,7 +84,19 @@ static void generate(void)
 				crc = crc >> 1;
 		}
 
-		crc64_nvme_table[i] = crc;
+		crc64_nvme_table[0][i] = crc;
+	}
+
+	for (int k = 1; k < 8; k++) {
+		for (int i = 0; i < 256; i++) {
+			crc = crc64_nvme_table[k - 1][i];
+			crc64_nvme_table[k][i] = (crc >> 8) ^ crc64_nvme_table[0][crc & 0xff];
+		}
+	}
+
+	for (int i = 0; i < 2; i++) {
+		crc64_nvme_fold[i][0] = xpow(FOLDS[i] + 64 - 1);
+		crc64_nvme_fold[i][1] = xpow(FOLDS[i] - 1);
 	}
 }
 
@@ -56,21 +104,36 @@ static void print(void)
 {
 	printf("/* GENERATED FILE; DO NOT EDIT! */\n");
 	printf("\n");
-	printf("static const uint64_t crc64_nvme_table[256] = {\n");
+	printf("static const uint64_t crc64_nvme_table[8][256] = {\n");
 
-	for (int i = 0; i < 256; i++) {
-		if (i % 2 == 0)
-			printf("\t");
+	for (int k = 0; k < 8; k++) {
+		printf("\t{\n");
 
-		printf("0x%016" PRIx64 "ULL", crc64_nvme_table[i]);
+		for (int i = 0; i < 256; i++) {
+			if (i % 2 == 0)
+				printf("\t\t");
 
-		if (i % 2 == 1)
-			printf(",\n");
-		else
-			printf(", ");
+			printf("0x%016" PRIx64 "ULL", crc64_nvme_table[k][i]);
+
+			if (i % 2 == 1)
+				printf(",\n");
+			else
+				printf(", ");
+		}
+
+		printf("\t},\n");
 	}
 
 	printf("};\n");
+
+	for (int i = 0; i < 2; i++) {
+		printf("\n");
+		printf("static const uint64_t crc64_nvme_fold%d[2] __attribute__((unused)) = {\n",
+		       FOLDS[i]);
+		printf("\t0x%016" PRIx64 "ULL, 0x%016" PRIx64 "ULL,\n", crc64_nvme_fold[i][0],
+		       crc64_nvme_fold[i][1]);
+		printf("};\n");
+	}
 }
 
 int main(int argc UNUSED, char *argv[] UNUSED)
@@ -19,12 +19,15 @@ use strict;
 use warnings;
 
 sub usage {
-	print "usage: $0 [--mode {header,source}] EVENTSFILE...\n";
+	print "usage: $0 [--mode {header,source}] [--static-keys] [--usdt] [--disable PREFIX]... EVENTSFILE...\n";
 	exit 1;
 }
 
 my @events;
+my @disable;
 my $mode = "header";
+my $static_keys = 0;
+my $usdt = 0;
 
 while (@ARGV && $ARGV[0] =~ m/^(--?.*)/) {
 	my $arg = $1;
@@ -32,6 +35,12 @@ while (@ARGV && $ARGV[0] =~ m/^(--?.*)/) {
 
 	if ($arg eq "-m" || $arg eq "--mode") {
 		$mode = shift @ARGV;
+	} elsif ($arg eq "--static-keys") {
+		$static_keys = 1;
+	} elsif ($arg eq "--usdt") {
+		$usdt = 1;
+	} elsif ($arg eq "--disable") {
+		push @disable, uc shift @ARGV;
 	} else {
 		usage();
 	}
@@ -45,18 +54,41 @@ sub collect($) {
 	while (<IN>) {
 		continue if (/^#/);
 
-		unless (/^(-)?(\w+)$/) {
+		# EVENT or EVENT(type name, ...); a '-' prefix statically disables it
+		unless (/^(-)?(\w+)(?:\((.*)\))?$/) {
 			die "parse error";
 		}
 
+		my ($disabled, $name) = ($1 ? 1 : 0, $2);
+		my @args;
+
+		foreach my $arg (split(/\s*,\s*/, $3 // "")) {
+			unless ($arg =~ /^\s*(.*?)\s*\b(\w+)$/ && $1) {
+				die "parse error in arguments of $name";
+			}
+
+			push @args, { type => $1, name => $2 };
+		}
+
+		foreach my $prefix (@disable) {
+			$disabled = 1 if (index($name, $prefix) == 0);
+		}
+
 		push @events, {
-			disabled => $1 ? 1 : 0,
-			name => $2,
+			disabled => $disabled,
+			name => $name,
+			args => \@args,
 		};
 	}
 }
 
 sub output_header() {
+	print "#ifndef LIBVFN_TRACE_EVENTS_H\n#define LIBVFN_TRACE_EVENTS_H\n\n";
+
+	if ($static_keys) {
+		print "#define TRACE_STATIC_KEYS 1\n\n";
+	}
+
 	foreach my $event (@events) {
 		printf "#define TRACE_%s \"%s\"\n", $event->{"name"}, lc $event->{"name"};
 	}
@@ -69,9 +101,55 @@ sub output_header() {
 
 	print "\n";
 
+	my $id = 0;
+
+	foreach my $event (@events) {
+		printf "#define TRACE_%s_ID %d\n", $event->{"name"}, $id++;
+	}
+
+	print "\n";
+
 	foreach my $event (@events) {
 		printf "extern bool TRACE_%s_ACTIVE;\n", $event->{"name"};
 	}
+
+	output_usdt() if ($usdt);
+
+	print "\n#endif /* LIBVFN_TRACE_EVENTS_H */\n";
+}
+
+sub output_usdt() {
+	print <<EOF;
+
+#define TRACE_USDT 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/sdt.h>
+EOF
+	foreach my $event (@events) {
+		my @args = @{$event->{"args"}};
+
+		print "\n";
+
+		if ($event->{"disabled"}) {
+			printf "#define __trace_probe_%s(...) ((void)0)\n", $event->{"name"};
+			next;
+		}
+
+		printf "static inline void __trace_probe_%s(%s)\n{\n", $event->{"name"},
+			@args ? join(", ", map { $_->{"type"} =~ /\*$/ ?
+				"$_->{type}$_->{name}" : "$_->{type} $_->{name}" } @args) : "void";
+
+		if (@args) {
+			printf "\tDTRACE_PROBE%d(libvfn, %s, %s);\n", scalar @args, lc $event->{"name"},
+				join(", ", map { $_->{"name"} } @args);
+		} else {
+			printf "\tDTRACE_PROBE(libvfn, %s);\n", lc $event->{"name"};
+		}
+
+		print "}\n";
+	}
 }
 
 sub output_source() {
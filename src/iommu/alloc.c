@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/alloc: " fmt
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/list/list.h"
+
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+#include "context.h"
+
+/*
+ * Allocations of up to IOMMU_DMA_CHUNK_SIZE bytes are carved out of 2M
+ * hugepage chunks that are mapped once and kept around.
+ */
+#define IOMMU_DMA_CHUNK_SHIFT 21
+#define IOMMU_DMA_CHUNK_SIZE (1ULL << IOMMU_DMA_CHUNK_SHIFT)
+#define IOMMU_DMA_BLOCK_SHIFT 12
+#define IOMMU_DMA_NBLOCKS (IOMMU_DMA_CHUNK_SIZE >> IOMMU_DMA_BLOCK_SHIFT)
+#define IOMMU_DMA_NBLOCKS_FOR(len) \
+	((unsigned int)(ALIGN_UP(len, 1ULL << IOMMU_DMA_BLOCK_SHIFT) >> IOMMU_DMA_BLOCK_SHIFT))
+
+#define IOMMU_DMA_HUGE_1G_SHIFT 30
+
+struct iommu_dma_chunk {
+	void *vaddr;
+	uint64_t iova;
+
+	/* preferred numa node (or -1) */
+	int node;
+
+	int nfree;
+	uint64_t used[IOMMU_DMA_NBLOCKS / 64];
+
+	struct list_node list;
+};
+
+static inline bool block_used(struct iommu_dma_chunk *c, unsigned int i)
+{
+	return c->used[i / 64] & (1ULL << (i % 64));
+}
+
+static inline void block_set(struct iommu_dma_chunk *c, unsigned int i, bool used)
+{
+	if (used)
+		c->used[i / 64] |= 1ULL << (i % 64);
+	else
+		c->used[i / 64] &= ~(1ULL << (i % 64));
+}
+
+/* first fit; returns the first block of a free run of @n blocks or -1 */
+static int chunk_find(struct iommu_dma_chunk *c, unsigned int n)
+{
+	unsigned int run = 0;
+
+	for (unsigned int i = 0; i < IOMMU_DMA_NBLOCKS; i++) {
+		if (block_used(c, i)) {
+			run = 0;
+			continue;
+		}
+
+		if (++run == n)
+			return (int)(i + 1 - n);
+	}
+
+	return -1;
+}
+
+static struct iommu_dma_chunk *chunk_new(struct iommu_ctx *ctx, int node)
+{
+	struct iommu_dma_chunk *c;
+	ssize_t len;
+	void *vaddr;
+
+	len = pgmap_huge(&vaddr, IOMMU_DMA_CHUNK_SIZE, IOMMU_DMA_CHUNK_SHIFT);
+	if (len < 0)
+		return NULL;
+
+	/* not fatal; the memory is just not node local */
+	if (pgbind(vaddr, len, node))
+		log_debug("could not bind chunk to node %d\n", node);
+
+	c = znew_t(struct iommu_dma_chunk, 1);
+
+	if (iommu_map_vaddr(ctx, vaddr, len, &c->iova, 0x0)) {
+		log_debug("failed to map chunk\n");
+
+		pgunmap(vaddr, len);
+		free(c);
+
+		return NULL;
+	}
+
+	c->vaddr = vaddr;
+	c->node = node;
+	c->nfree = IOMMU_DMA_NBLOCKS;
+
+	list_add_tail(&ctx->dma_pool.chunks, &c->list);
+
+	return c;
+}
+
+static int iommu_alloc_huge(struct iommu_ctx *ctx, size_t len, int node, void **vaddr,
+			    uint64_t *iova)
+{
+	unsigned int shift = IOMMU_DMA_CHUNK_SHIFT;
+	ssize_t maplen;
+
+	if (len >= 1ULL << IOMMU_DMA_HUGE_1G_SHIFT)
+		shift = IOMMU_DMA_HUGE_1G_SHIFT;
+
+	maplen = pgmap_huge(vaddr, len, shift);
+	if (maplen < 0)
+		return -1;
+
+	if (pgbind(*vaddr, maplen, node))
+		log_debug("could not bind memory to node %d\n", node);
+
+	if (iommu_map_vaddr(ctx, *vaddr, maplen, iova, 0x0)) {
+		log_debug("failed to map vaddr\n");
+
+		pgunmap(*vaddr, maplen);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int iommu_alloc_pool(struct iommu_ctx *ctx, unsigned int n, int node, void **vaddr,
+			    uint64_t *iova)
+{
+	__autolock(&ctx->dma_pool.lock);
+
+	struct iommu_dma_chunk *c;
+	int blk = -1;
+
+	list_for_each(&ctx->dma_pool.chunks, c, list) {
+		if (c->node != node || c->nfree < (int)n)
+			continue;
+
+		blk = chunk_find(c, n);
+		if (blk >= 0)
+			break;
+	}
+
+	if (blk < 0) {
+		c = chunk_new(ctx, node);
+		if (!c)
+			return -1;
+
+		blk = 0;
+	}
+
+	for (unsigned int i = 0; i < n; i++)
+		block_set(c, blk + i, true);
+
+	c->nfree -= n;
+
+	*vaddr = c->vaddr + ((size_t)blk << IOMMU_DMA_BLOCK_SHIFT);
+	*iova = c->iova + ((uint64_t)blk << IOMMU_DMA_BLOCK_SHIFT);
+
+	return 0;
+}
+
+int iommu_alloc_node(struct iommu_ctx *ctx, size_t len, int node, void **vaddr, uint64_t *iova)
+{
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (node < 0)
+		node = -1;
+
+	if (len > IOMMU_DMA_CHUNK_SIZE)
+		return iommu_alloc_huge(ctx, len, node, vaddr, iova);
+
+	return iommu_alloc_pool(ctx, IOMMU_DMA_NBLOCKS_FOR(len), node, vaddr, iova);
+}
+
+int iommu_alloc(struct iommu_ctx *ctx, size_t len, void **vaddr, uint64_t *iova)
+{
+	return iommu_alloc_node(ctx, len, -1, vaddr, iova);
+}
+
+void __iommu_dma_pool_clear(struct iommu_ctx *ctx, bool unmap)
+{
+	struct iommu_dma_chunk *c, *next;
+
+	list_for_each_safe(&ctx->dma_pool.chunks, c, next, list) {
+		if (unmap && iommu_unmap_vaddr(ctx, c->vaddr, NULL))
+			log_debug("failed to unmap chunk\n");
+
+		list_del(&c->list);
+
+		pgunmap(c->vaddr, IOMMU_DMA_CHUNK_SIZE);
+		free(c);
+	}
+}
+
+static void iommu_free_pool(struct iommu_ctx *ctx, void *vaddr, unsigned int n)
+{
+	__autolock(&ctx->dma_pool.lock);
+
+	struct iommu_dma_chunk *c;
+	unsigned int blk;
+
+	list_for_each(&ctx->dma_pool.chunks, c, list) {
+		if (vaddr < c->vaddr || vaddr >= c->vaddr + IOMMU_DMA_CHUNK_SIZE)
+			continue;
+
+		blk = (unsigned int)((vaddr - c->vaddr) >> IOMMU_DMA_BLOCK_SHIFT);
+
+		for (unsigned int i = 0; i < n; i++) {
+			log_fatal_if(!block_used(c, blk + i), "double free of %p\n", vaddr);
+
+			block_set(c, blk + i, false);
+		}
+
+		c->nfree += n;
+
+		return;
+	}
+
+	log_error("%p was not allocated with iommu_alloc()\n", vaddr);
+}
+
+void iommu_free(struct iommu_ctx *ctx, void *vaddr, size_t len)
+{
+	size_t maplen;
+
+	if (len <= IOMMU_DMA_CHUNK_SIZE) {
+		iommu_free_pool(ctx, vaddr, IOMMU_DMA_NBLOCKS_FOR(len));
+		return;
+	}
+
+	if (iommu_unmap_vaddr(ctx, vaddr, &maplen)) {
+		log_debug("failed to unmap vaddr\n");
+		return;
+	}
+
+	pgunmap(vaddr, maplen);
+}
@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "alloc.c"
+
+static uint64_t next_iova = 0x100000;
+static int nmaps;
+
+static int stub_dma_map(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len,
+			uint64_t *iova, unsigned long flags UNUSED)
+{
+	*iova = next_iova;
+	next_iova += ALIGN_UP(len, 0x1000);
+
+	nmaps++;
+
+	return 0;
+}
+
+static int stub_dma_unmap(struct iommu_ctx *ctx UNUSED, uint64_t iova UNUSED,
+			  size_t len UNUSED)
+{
+	nmaps--;
+
+	return 0;
+}
+
+static struct iommu_ctx ctx = {
+	.ops = {
+		.dma_map = stub_dma_map,
+		.dma_unmap = stub_dma_unmap,
+	},
+};
+
+int main(void)
+{
+	void *a, *b, *c, *big;
+	uint64_t iova_a, iova_b, iova_c, iova_big, iova;
+
+	plan_tests(17);
+
+	iova_map_init(&ctx.map);
+
+	list_head_init(&ctx.dma_pool.chunks);
+	pthread_mutex_init(&ctx.dma_pool.lock, NULL);
+
+	ok1(iommu_alloc(&ctx, 0, &a, &iova_a) < 0 && errno == EINVAL);
+
+	ok1(iommu_alloc(&ctx, 0x1000, &a, &iova_a) == 0 && nmaps == 1);
+	ok1(iommu_alloc(&ctx, 0x1800, &b, &iova_b) == 0 && nmaps == 1);
+
+	/* carved out of the same chunk */
+	ok1(b == a + 0x1000 && iova_b == iova_a + 0x1000);
+	ok1(iommu_translate_vaddr(&ctx, b + 0x10, &iova) && iova == iova_b + 0x10);
+
+	memset(a, 0xff, 0x1000);
+	memset(b, 0xff, 0x1800);
+
+	/* freed blocks are reused */
+	iommu_free(&ctx, a, 0x1000);
+	ok1(iommu_alloc(&ctx, 0x200, &c, &iova_c) == 0 && c == a && iova_c == iova_a);
+
+	/* a full chunk does not fit next to b; a new chunk is mapped */
+	ok1(iommu_alloc(&ctx, IOMMU_DMA_CHUNK_SIZE, &a, &iova_a) == 0 && nmaps == 2);
+	ok1(ALIGNED((uintptr_t)a, IOMMU_DMA_CHUNK_SIZE));
+
+	/* allocations larger than a chunk get a dedicated mapping */
+	ok1(iommu_alloc(&ctx, IOMMU_DMA_CHUNK_SIZE + 1, &big, &iova_big) == 0 && nmaps == 3);
+	ok1(iommu_translate_vaddr(&ctx, big + IOMMU_DMA_CHUNK_SIZE, &iova) &&
+	    iova == iova_big + IOMMU_DMA_CHUNK_SIZE);
+
+	iommu_free(&ctx, big, IOMMU_DMA_CHUNK_SIZE + 1);
+	ok1(nmaps == 2);
+
+	/* chunks stay mapped when empty */
+	iommu_free(&ctx, a, IOMMU_DMA_CHUNK_SIZE);
+	iommu_free(&ctx, b, 0x1800);
+	iommu_free(&ctx, c, 0x200);
+	ok1(nmaps == 2);
+
+	/* chunks are not shared between nodes */
+	ok1(iommu_alloc_node(&ctx, 0x1000, 0, &a, &iova_a) == 0 && nmaps == 3);
+	ok1(iommu_alloc_node(&ctx, 0x1000, 0, &b, &iova_b) == 0 && b == a + 0x1000);
+
+	/* unmapping everything drains the pool; new allocations map a new chunk */
+	ok1(iommu_unmap_all(&ctx) == 0 && nmaps == 0 && list_empty(&ctx.dma_pool.chunks));
+	ok1(iommu_alloc(&ctx, 0x1000, &a, &iova_a) == 0 && nmaps == 1 &&
+	    iommu_translate_vaddr(&ctx, a, &iova) && iova == iova_a);
+
+	/* releasing the context unmaps the chunks (see iommu_ctx_fini()) */
+	__iommu_dma_pool_clear(&ctx, true);
+	ok1(nmaps == 0 && list_empty(&ctx.dma_pool.chunks));
+
+	return exit_status();
+}
@@ -12,8 +12,13 @@
 
 #define log_fmt(fmt) "iommu/context: " fmt
 
+#include <dirent.h>
+#include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
 #include <sys/stat.h>
@@ -41,8 +46,47 @@ static void __attribute__((constructor)) __check_iommufd_broken(void)
 }
 #endif
 
+static bool __noiommu;
+
+/* no-iommu mode is only used if it is enabled and there really is no iommu */
+static void __attribute__((constructor)) __check_noiommu(void)
+{
+	char mode = 'N';
+	struct dirent *dentry;
+	FILE *f;
+	DIR *dp;
+
+	f = fopen("/sys/module/vfio/parameters/enable_unsafe_noiommu_mode", "r");
+	if (!f)
+		return;
+
+	if (fread(&mode, 1, 1, f) != 1 || mode != 'Y')
+		goto close_f;
+
+	dp = opendir("/sys/class/iommu");
+	if (dp) {
+		while ((dentry = readdir(dp)) && dentry->d_name[0] == '.')
+			;
+
+		closedir(dp);
+
+		if (dentry)
+			goto close_f;
+	}
+
+	log_info("no iommu; using vfio no-iommu mode\n");
+
+	__noiommu = true;
+
+close_f:
+	fclose(f);
+}
+
 struct iommu_ctx *iommu_get_default_context(void)
 {
+	if (__noiommu)
+		return vfio_get_default_noiommu_context();
+
 #ifdef HAVE_VFIO_DEVICE_BIND_IOMMUFD
 	if (__iommufd_broken)
 		goto fallback;
@@ -56,6 +100,9 @@ fallback:
 
 struct iommu_ctx *iommu_get_context(const char *name)
 {
+	if (__noiommu)
+		return vfio_get_noiommu_context(name);
+
 #ifdef HAVE_VFIO_DEVICE_BIND_IOMMUFD
 	if (__iommufd_broken)
 		goto fallback;
@@ -67,6 +114,29 @@ fallback:
 	return vfio_get_iommu_context(name);
 }
 
+int iommu_export_context(struct iommu_ctx *ctx, int sockfd)
+{
+	if (!ctx->ops.export_context) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return ctx->ops.export_context(ctx, sockfd);
+}
+
+struct iommu_ctx *iommu_import_context(int sockfd)
+{
+#ifdef HAVE_VFIO_DEVICE_BIND_IOMMUFD
+	if (!__iommufd_broken)
+		return iommufd_import_context(sockfd);
+#endif
+
+	(void)sockfd;
+
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
 void iommu_ctx_init(struct iommu_ctx *ctx)
 {
 	ctx->nranges = 1;
@@ -81,6 +151,21 @@ void iommu_ctx_init(struct iommu_ctx *ctx)
 
 	pthread_mutex_init(&ctx->lock, NULL);
 
-	skiplist_init(&ctx->map.list);
-	pthread_mutex_init(&ctx->map.lock, NULL);
+	iova_map_init(&ctx->map);
+
+	list_head_init(&ctx->dma_pool.chunks);
+	pthread_mutex_init(&ctx->dma_pool.lock, NULL);
+}
+
+void iommu_ctx_fini(struct iommu_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->dma_pool.lock);
+	__iommu_dma_pool_clear(ctx, true);
+	pthread_mutex_unlock(&ctx->dma_pool.lock);
+
+	pthread_mutex_destroy(&ctx->dma_pool.lock);
+	pthread_mutex_destroy(&ctx->map.lock);
+	pthread_mutex_destroy(&ctx->lock);
+
+	free(ctx->iova_ranges);
 }
@@ -10,7 +10,11 @@
  * COPYING and LICENSE files for more information.
  */
 
-#include "util/skiplist.h"
+#include "ccan/list/list.h"
+
+#include "util/btree.h"
+
+#include "shared.h"
 
 struct iommu_ctx;
 
@@ -18,16 +22,29 @@ struct iommu_ctx_ops {
 	/* container/ioas ops */
 	int (*iova_reserve)(struct iommu_ctx *ctx, size_t len, uint64_t *iova,
 			    unsigned long flags);
-	void (*iova_put_ephemeral)(struct iommu_ctx *ctx);
+	void (*iova_release)(struct iommu_ctx *ctx, uint64_t iova, size_t len,
+			     unsigned long flags);
 	int (*dma_map)(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
 		       unsigned long flags);
 	int (*dma_unmap)(struct iommu_ctx *ctx, uint64_t iova, size_t len);
+	int (*dma_map_file)(struct iommu_ctx *ctx, int fd, uint64_t offset, size_t len,
+			    uint64_t *iova, unsigned long flags);
 	int (*dma_unmap_all)(struct iommu_ctx *ctx);
 
+	/* dirty tracking ops; the bitmap has a bit per page starting at @iova */
+	int (*set_dirty_tracking)(struct iommu_ctx *ctx, bool enable);
+	int (*get_dirty_bitmap)(struct iommu_ctx *ctx, uint64_t iova, size_t len,
+				uint64_t *bitmap, unsigned long flags);
+
 	/* device ops */
 	int (*get_device_fd)(struct iommu_ctx *ctx, const char *bdf);
+
+	/* sharing ops */
+	int (*export_context)(struct iommu_ctx *ctx, int sockfd);
 };
 
+struct iova_mapping_batch;
+
 struct iova_mapping {
 	void *vaddr;
 	size_t len;
@@ -35,12 +52,31 @@ struct iova_mapping {
 
 	unsigned long flags;
 
-	struct skiplist_node list;
+	/* set if allocated as part of a batch (see iommu_map_vaddrs()) */
+	struct iova_mapping_batch *batch;
+};
+
+struct iova_mapping_batch {
+	/* number of mappings not yet freed */
+	unsigned int refs;
+
+	struct iova_mapping mappings[];
 };
 
 struct iova_map {
+	/* serializes writers; lookups are lock-free */
 	pthread_mutex_t lock;
-	struct skiplist list;
+	struct btree tree;
+
+	/* bumped when a mapping is removed; invalidates translation caches */
+	unsigned long gen;
+
+	/* kept up to date for other processes (see iommu_export_context()) */
+	struct iova_shared_table *exported;
+	int exported_fd;
+
+	/* mappings of the exporting process; consulted on lookup misses */
+	const struct iova_shared_table *imported;
 };
 
 struct iommu_ctx {
@@ -50,17 +86,52 @@ struct iommu_ctx {
 	pthread_mutex_t lock;
 	int nranges;
 	struct iommu_iova_range *iova_ranges;
+
+	/* see iommu_get_map_stats() */
+	struct iommu_map_stats stats;
+
+	/* hugepage chunks for iommu_alloc() */
+	struct {
+		pthread_mutex_t lock;
+		struct list_head chunks;
+	} dma_pool;
 };
 
 struct iommu_ctx *iommu_get_default_context(void);
 
 struct iommu_ctx *vfio_get_default_iommu_context(void);
 struct iommu_ctx *vfio_get_iommu_context(const char *name);
+struct iommu_ctx *vfio_get_default_noiommu_context(void);
+struct iommu_ctx *vfio_get_noiommu_context(const char *name);
 
 #ifdef HAVE_VFIO_DEVICE_BIND_IOMMUFD
 struct iommu_ctx *iommufd_get_default_iommu_context(void);
 struct iommu_ctx *iommufd_get_iommu_context(const char *name);
+struct iommu_ctx *iommufd_import_context(int sockfd);
 #endif
 
 void iommu_ctx_init(struct iommu_ctx *ctx);
+void iommu_ctx_fini(struct iommu_ctx *ctx);
+
+/*
+ * Release all chunks of the iommu_alloc() pool, unmapping them if @unmap is
+ * set. The caller holds the pool lock.
+ */
+void __iommu_dma_pool_clear(struct iommu_ctx *ctx, bool unmap);
+
+/* account a map ioctl of @len bytes that took @nsecs nanoseconds */
+static inline void iommu_ctx_account_map(struct iommu_ctx *ctx, size_t len, uint64_t nsecs)
+{
+	struct iommu_map_stats *stats = &ctx->stats;
+	uint64_t max = atomic_load_acquire(&stats->max_nsecs);
+
+	atomic_inc(&stats->maps);
+	atomic_add(&stats->bytes, len);
+	atomic_add(&stats->nsecs, nsecs);
+
+	while (nsecs > max && !atomic_cmpxchg(&stats->max_nsecs, max, nsecs))
+		;
+}
+void iova_map_init(struct iova_map *map);
+int iova_map_export(struct iova_map *map, int *fd);
 int iommu_iova_range_to_string(struct iommu_iova_range *range, char **str);
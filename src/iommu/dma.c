@@ -16,26 +16,119 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
+#include <unistd.h>
+
+#include <sys/mman.h>
+
 #include "ccan/compiler/compiler.h"
 #include "ccan/minmax/minmax.h"
 
 #include "vfn/iommu.h"
 #include "vfn/support.h"
 
+#include "support/slab.h"
+#include "util/rcu.h"
+
 #include "context.h"
 
-static int iova_cmp(const void *vaddr, const struct skiplist_node *n)
+#define IOVA_CACHE_SIZE 64
+
+/* dirty bitmap words queried at a time (1g of iova space with 4k pages) */
+#define DIRTY_BITMAP_WORDS 4096
+
+/*
+ * Per-thread direct-mapped cache of recent translations. An entry is valid
+ * only if the generation of the map it was filled from has not changed since.
+ */
+struct iova_cache_entry {
+	struct iova_map *map;
+	unsigned long gen;
+
+	void *vaddr;
+	size_t len;
+	uint64_t iova;
+};
+
+static __thread struct iova_cache_entry iova_cache[IOVA_CACHE_SIZE];
+
+static inline struct iova_cache_entry *iova_cache_entry(void *vaddr)
 {
-	struct iova_mapping *m = container_of_var(n, m, list);
+	return &iova_cache[((uintptr_t)vaddr >> __VFN_PAGESHIFT) & (IOVA_CACHE_SIZE - 1)];
+}
 
-	if (vaddr < m->vaddr)
-		return -1;
-	else if (vaddr >= m->vaddr + m->len)
-		return 1;
+/* the mapping containing @vaddr; must be called in an rcu read-side section */
+static struct iova_mapping *__iova_map_find(struct iova_map *map, void *vaddr)
+{
+	struct iova_mapping *m = btree_find_le(&map->tree, (uintptr_t)vaddr, NULL);
 
-	return 0;
+	if (m && vaddr < m->vaddr + m->len)
+		return m;
+
+	return NULL;
+}
+
+static struct slab iova_mapping_slab = SLAB_INIT(struct iova_mapping);
+
+/*
+ * Generations are drawn from a single counter, such that a map initialized
+ * at the address of one that is gone never matches its cached translations.
+ */
+static unsigned long iova_map_gen;
+
+static inline void __iova_map_bump(struct iova_map *map)
+{
+	atomic_store_release(&map->gen, atomic_inc_fetch(&iova_map_gen));
+}
+
+void iova_map_init(struct iova_map *map)
+{
+	btree_init(&map->tree);
+	pthread_mutex_init(&map->lock, NULL);
+
+	__iova_map_bump(map);
+}
+
+/* ephemeral mappings are short-lived and not shared; called with the map lock held */
+static void __iova_map_share(struct iova_map *map, struct iova_mapping *m)
+{
+	if (!map->exported || m->flags & IOMMU_MAP_EPHEMERAL)
+		return;
+
+	if (iova_shared_insert(map->exported, m->vaddr, m->len, m->iova))
+		log_info("shared mapping table is full; vaddr %p is not shared\n", m->vaddr);
+}
+
+static void __iova_map_unshare(struct iova_map *map, void *vaddr)
+{
+	if (map->exported)
+		iova_shared_remove(map->exported, vaddr);
+}
+
+/* if @deferred, concurrent lookups may still hold a reference to @m */
+static void __iova_mapping_free(struct iova_mapping *m, bool deferred)
+{
+	struct iova_mapping_batch *batch = m->batch;
+
+	if (!batch) {
+		if (deferred)
+			rcu_free_with(m, slab_free_fn, &iova_mapping_slab);
+		else
+			slab_free(&iova_mapping_slab, m);
+
+		return;
+	}
+
+	/* the batch goes when its last mapping does */
+	if (!atomic_dec_fetch(&batch->refs)) {
+		if (deferred)
+			rcu_free(batch);
+		else
+			free(batch);
+	}
 }
 
 static int iova_map_add(struct iova_map *map, void *vaddr, size_t len, uint64_t iova,
@@ -43,7 +136,6 @@ static int iova_map_add(struct iova_map *map, void *vaddr, size_t len, uint64_t
 {
 	__autolock(&map->lock);
 
-	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
 	struct iova_mapping *m;
 
 	if (!len) {
@@ -51,70 +143,292 @@ static int iova_map_add(struct iova_map *map, void *vaddr, size_t len, uint64_t
 		return -1;
 	}
 
-	if (skiplist_find(&map->list, vaddr, iova_cmp, update)) {
+	if (__iova_map_find(map, vaddr)) {
 		errno = EEXIST;
 		return -1;
 	}
 
-	m = znew_t(struct iova_mapping, 1);
+	m = slab_zalloc(&iova_mapping_slab);
 
 	m->vaddr = vaddr;
 	m->len = len;
 	m->iova = iova;
 	m->flags = flags;
 
-	skiplist_link(&map->list, &m->list, update);
+	if (btree_insert(&map->tree, (uintptr_t)vaddr, m)) {
+		slab_free(&iova_mapping_slab, m);
+		return -1;
+	}
+
+	__iova_map_share(map, m);
 
 	return 0;
 }
 
-static void iova_map_remove(struct iova_map *map, void *vaddr)
+/*
+ * Insert @n mappings in one pass over the locked map. If any of them overlaps
+ * an existing mapping, none are inserted.
+ */
+static int iova_map_add_batch(struct iova_map *map, struct iova_mapping *mappings, int n)
 {
 	__autolock(&map->lock);
 
-	struct skiplist_node *n, *update[SKIPLIST_LEVELS] = {};
+	int i;
 
-	n = skiplist_find(&map->list, vaddr, iova_cmp, update);
-	if (!n)
-		return;
+	for (i = 0; i < n; i++) {
+		struct iova_mapping *m = &mappings[i];
 
-	skiplist_erase(&map->list, n, update);
+		if (__iova_map_find(map, m->vaddr) ||
+		    __iova_map_find(map, m->vaddr + m->len - 1)) {
+			errno = EEXIST;
+			goto remove;
+		}
+
+		if (btree_insert(&map->tree, (uintptr_t)m->vaddr, m))
+			goto remove;
+	}
+
+	for (i = 0; i < n; i++)
+		__iova_map_share(map, &mappings[i]);
+
+	return 0;
+
+remove:
+	while (i--)
+		btree_remove(&map->tree, (uintptr_t)mappings[i].vaddr);
+
+	/* lookups may have cached the removed translations */
+	__iova_map_bump(map);
+
+	return -1;
+}
+
+/* returns false if @m is no longer in the map (e.g., unmapped concurrently) */
+static bool iova_map_remove(struct iova_map *map, struct iova_mapping *m)
+{
+	__autolock(&map->lock);
+
+	if (__iova_map_find(map, m->vaddr) != m)
+		return false;
+
+	btree_remove(&map->tree, (uintptr_t)m->vaddr);
+
+	__iova_map_unshare(map, m->vaddr);
+
+	__iova_map_bump(map);
+
+	return true;
+}
+
+/* put back a mapping removed with iova_map_remove() */
+static void iova_map_restore(struct iova_map *map, struct iova_mapping *m)
+{
+	__autolock(&map->lock);
+
+	log_fatal_if(btree_insert(&map->tree, (uintptr_t)m->vaddr, m),
+		     "failed to restore mapping of vaddr %p\n", m->vaddr);
+
+	__iova_map_share(map, m);
+}
+
+static void iova_map_remove_batch(struct iova_map *map, struct iova_mapping **mappings, int n)
+{
+	__autolock(&map->lock);
+
+	for (int i = 0; i < n; i++) {
+		btree_remove(&map->tree, (uintptr_t)mappings[i]->vaddr);
+
+		__iova_map_unshare(map, mappings[i]->vaddr);
+	}
+
+	__iova_map_bump(map);
 }
 
 static struct iova_mapping *iova_map_find(struct iova_map *map, void *vaddr)
+{
+	struct iova_mapping *m;
+
+	rcu_read_lock();
+	m = __iova_map_find(map, vaddr);
+	rcu_read_unlock();
+
+	return m;
+}
+
+static void iova_map_clear_with(struct iova_map *map, btree_iter_fn fn, void *opaque)
 {
 	__autolock(&map->lock);
 
-	return container_of_or_null(skiplist_find(&map->list, vaddr, iova_cmp, NULL),
-				    struct iova_mapping, list);
+	btree_clear_with(&map->tree, fn, opaque);
+
+	if (map->exported)
+		iova_shared_clear(map->exported);
+
+	__iova_map_bump(map);
+}
+
+static void __share_mapping(void *opaque, uint64_t key UNUSED, void *val)
+{
+	__iova_map_share(opaque, val);
 }
 
-static void iova_map_clear_with(struct iova_map *map, skiplist_iter_fn fn, void *opaque)
+int iova_map_export(struct iova_map *map, int *fd)
 {
 	__autolock(&map->lock);
 
-	skiplist_clear_with(&map->list, fn, opaque);
+	if (!map->exported) {
+		map->exported = iova_shared_create(&map->exported_fd);
+		if (!map->exported)
+			return -1;
+
+		btree_for_each(&map->tree, __share_mapping, map);
+	}
+
+	*fd = map->exported_fd;
+
+	return 0;
 }
 
-static void UNUSED iova_map_clear(struct iova_map *map)
+/* give back iova reserved through iommu_ctx_ops.iova_reserve */
+static void __iova_release(struct iommu_ctx *ctx, uint64_t iova, size_t len, unsigned long flags)
 {
-	iova_map_clear_with(map, NULL, NULL);
+	if (flags & IOMMU_MAP_FIXED_IOVA || !ctx->ops.iova_release)
+		return;
+
+	ctx->ops.iova_release(ctx, iova, ALIGN_UP(len, __VFN_PAGESIZE), flags);
+}
+
+static void __release_mapping(void *opaque, uint64_t key UNUSED, void *val)
+{
+	struct iommu_ctx *ctx = opaque;
+	struct iova_mapping *m = val;
+
+	__iova_release(ctx, m->iova, m->len, m->flags);
+	__iova_mapping_free(m, false);
 }
 
 bool iommu_translate_vaddr(struct iommu_ctx *ctx, void *vaddr, uint64_t *iova)
 {
-	struct iova_mapping *m = iova_map_find(&ctx->map, vaddr);
+	struct iova_cache_entry *e = iova_cache_entry(vaddr);
+	struct iova_mapping *m;
+	unsigned long gen;
 
-	if (m) {
-		*iova = m->iova + (vaddr - m->vaddr);
+	/* read the generation before the lookup so a racing removal is detected */
+	gen = atomic_load_acquire(&ctx->map.gen);
+
+	if (e->map == &ctx->map && e->gen == gen &&
+	    vaddr >= e->vaddr && vaddr < e->vaddr + e->len) {
+		*iova = e->iova + (vaddr - e->vaddr);
 		return true;
 	}
 
-	return false;
+	rcu_read_lock();
+
+	m = __iova_map_find(&ctx->map, vaddr);
+	if (!m) {
+		rcu_read_unlock();
+
+		/* the shared table may change at any time, so do not cache its entries */
+		return ctx->map.imported && iova_shared_translate(ctx->map.imported, vaddr, iova);
+	}
+
+	*e = (struct iova_cache_entry) {
+		.map = &ctx->map,
+		.gen = gen,
+		.vaddr = m->vaddr,
+		.len = m->len,
+		.iova = m->iova,
+	};
+
+	rcu_read_unlock();
+
+	*iova = e->iova + (vaddr - e->vaddr);
+
+	return true;
 }
 
-int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
-		    unsigned long flags)
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* prefault in parallel only if each thread gets at least this much */
+#define IOMMU_PREFAULT_CHUNK_SIZE (1ULL << 30)
+#define IOMMU_PREFAULT_MAX_THREADS 16
+
+struct prefault_job {
+	pthread_t thread;
+
+	void *vaddr;
+	size_t len;
+	int advice;
+	int err;
+};
+
+static void *__prefault_job(void *opaque)
+{
+	struct prefault_job *job = opaque;
+
+	job->err = madvise(job->vaddr, job->len, job->advice) ? errno : 0;
+
+	return NULL;
+}
+
+static void __prefault(struct iommu_ctx *ctx, void *vaddr, size_t len, unsigned long flags)
+{
+	struct prefault_job jobs[IOMMU_PREFAULT_MAX_THREADS] = {};
+	int advice = flags & IOMMU_MAP_NOWRITE ? MADV_POPULATE_READ : MADV_POPULATE_WRITE;
+	uint64_t start = get_ticks();
+	void *end = vaddr + len;
+	long ncpus;
+	size_t chunk;
+	int n;
+
+	vaddr = (void *)ALIGN_DOWN((uintptr_t)vaddr, __VFN_PAGESIZE);
+	len = ALIGN_UP((size_t)(end - vaddr), __VFN_PAGESIZE);
+
+	ncpus = clamp_t(long, sysconf(_SC_NPROCESSORS_ONLN), 1, IOMMU_PREFAULT_MAX_THREADS);
+
+	n = (int)min_t(uint64_t, len / IOMMU_PREFAULT_CHUNK_SIZE, (uint64_t)ncpus);
+	n = max_t(int, n, 1);
+
+	/* keep chunk boundaries hugepage aligned */
+	chunk = ALIGN_UP(len / (size_t)n, 1ULL << 21);
+
+	for (int i = 0; i < n && (size_t)i * chunk < len; i++) {
+		struct prefault_job *job = &jobs[i];
+
+		job->vaddr = vaddr + (size_t)i * chunk;
+		job->len = min_t(size_t, chunk, len - (size_t)i * chunk);
+		job->advice = advice;
+
+		/* the first chunk is handled by the calling thread */
+		if (i && pthread_create(&job->thread, NULL, __prefault_job, job)) {
+			job->thread = 0;
+			__prefault_job(job);
+		}
+	}
+
+	__prefault_job(&jobs[0]);
+
+	for (int i = 0; i < n; i++) {
+		if (i && jobs[i].thread)
+			pthread_join(jobs[i].thread, NULL);
+
+		if (jobs[i].err)
+			log_debug("could not prefault %p (%s)\n", jobs[i].vaddr,
+				  strerror(jobs[i].err));
+	}
+
+	atomic_add(&ctx->stats.prefault_nsecs, ticks_to_ns(get_ticks() - start));
+}
+
+/* map @vaddr; if @fd is not negative, @vaddr is a shared mapping of @fd at @offset */
+static int __map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, int fd, uint64_t offset,
+		       uint64_t *iova, unsigned long flags)
 {
 	uint64_t _iova;
 
@@ -128,14 +442,27 @@ int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *io
 		return -1;
 	}
 
+	if (flags & IOMMU_MAP_PREFAULT)
+		__prefault(ctx, vaddr, len, flags);
+
+	if (fd >= 0 && ctx->ops.dma_map_file) {
+		if (!ctx->ops.dma_map_file(ctx, fd, offset, len, &_iova, flags))
+			goto add;
+
+		log_debug("could not map file directly (%s)\n", strerror(errno));
+	}
+
 	if (ctx->ops.dma_map(ctx, vaddr, len, &_iova, flags)) {
 		log_debug("failed to map dma\n");
-		return -1;
+		goto release;
 	}
 
+add:
 	if (iova_map_add(&ctx->map, vaddr, len, _iova, flags)) {
 		log_debug("failed to add mapping\n");
-		return -1;
+
+		log_fatal_if(ctx->ops.dma_unmap(ctx, _iova, len), "failed to unmap dma\n");
+		goto release;
 	}
 
 out:
@@ -143,6 +470,28 @@ out:
 		*iova = _iova;
 
 	return 0;
+
+release:
+	__iova_release(ctx, _iova, len, flags);
+
+	return -1;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
+		    unsigned long flags)
+{
+	return __map_vaddr(ctx, vaddr, len, -1, 0, iova, flags);
+}
+
+int iommu_map_vaddr_file(struct iommu_ctx *ctx, void *vaddr, size_t len, int fd, uint64_t offset,
+			 uint64_t *iova, unsigned long flags)
+{
+	if (!ALIGNED(offset, __VFN_PAGESIZE) || !ALIGNED((uintptr_t)vaddr, __VFN_PAGESIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return __map_vaddr(ctx, vaddr, ALIGN_UP(len, __VFN_PAGESIZE), fd, offset, iova, flags);
 }
 
 int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len)
@@ -155,49 +504,527 @@ int iommu_unmap_vaddr(struct iommu_ctx *ctx, void *vaddr, size_t *len)
 		return -1;
 	}
 
+	/* new lookups must not translate to an iova that is unmapped (and reused) */
+	if (!iova_map_remove(&ctx->map, m)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (ctx->ops.dma_unmap(ctx, m->iova, m->len)) {
+		log_debug("failed to unmap dma\n");
+
+		iova_map_restore(&ctx->map, m);
+
+		return -1;
+	}
+
 	if (len)
 		*len = m->len;
 
-	if (ctx->ops.dma_unmap(ctx, m->iova, m->len)) {
+	__iova_release(ctx, m->iova, m->len, m->flags);
+
+	/* concurrent lookups may still hold a reference */
+	__iova_mapping_free(m, true);
+
+	return 0;
+}
+
+/* map the file through the process address space */
+static int __map_file_vaddr(struct iommu_ctx *ctx, int fd, uint64_t offset, size_t len,
+			    unsigned long flags, struct iommu_file_map *map)
+{
+	int prot = PROT_READ;
+	void *vaddr;
+
+	if (!(flags & IOMMU_MAP_NOWRITE))
+		prot |= PROT_WRITE;
+
+	vaddr = mmap(NULL, len, prot, MAP_SHARED, fd, (off_t)offset);
+	if (vaddr == MAP_FAILED) {
+		log_debug("failed to mmap file\n");
+		return -1;
+	}
+
+	if (iommu_map_vaddr(ctx, vaddr, len, &map->iova, flags)) {
+		int err = errno;
+
+		log_fatal_if(munmap(vaddr, len), "munmap\n");
+
+		errno = err;
+		return -1;
+	}
+
+	map->vaddr = vaddr;
+
+	return 0;
+}
+
+int iommu_map_file(struct iommu_ctx *ctx, int fd, uint64_t offset, size_t len,
+		   unsigned long flags, struct iommu_file_map *map)
+{
+	uint64_t iova = map->iova;
+
+	if (!len || !ALIGNED(offset, __VFN_PAGESIZE) || !ALIGNED(len, __VFN_PAGESIZE) ||
+	    flags & IOMMU_MAP_EPHEMERAL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	map->len = len;
+	map->vaddr = NULL;
+	map->flags = flags;
+
+	if (!ctx->ops.dma_map_file)
+		return __map_file_vaddr(ctx, fd, offset, len, flags, map);
+
+	if (!(flags & IOMMU_MAP_FIXED_IOVA) && ctx->ops.iova_reserve &&
+	    ctx->ops.iova_reserve(ctx, len, &iova, flags)) {
+		log_debug("failed to allocate iova\n");
+		return -1;
+	}
+
+	if (ctx->ops.dma_map_file(ctx, fd, offset, len, &iova, flags)) {
+		log_info("could not map file directly (%s); falling back to mmap\n",
+			 strerror(errno));
+
+		__iova_release(ctx, iova, len, flags);
+
+		return __map_file_vaddr(ctx, fd, offset, len, flags, map);
+	}
+
+	map->iova = iova;
+
+	return 0;
+}
+
+int iommu_unmap_file(struct iommu_ctx *ctx, struct iommu_file_map *map)
+{
+	if (map->vaddr) {
+		if (iommu_unmap_vaddr(ctx, map->vaddr, NULL))
+			return -1;
+
+		log_fatal_if(munmap(map->vaddr, map->len), "munmap\n");
+
+		map->vaddr = NULL;
+
+		return 0;
+	}
+
+	if (ctx->ops.dma_unmap(ctx, map->iova, map->len)) {
 		log_debug("failed to unmap dma\n");
 		return -1;
 	}
 
-	if (m->flags & IOMMU_MAP_EPHEMERAL && ctx->ops.iova_put_ephemeral)
-		ctx->ops.iova_put_ephemeral(ctx);
+	__iova_release(ctx, map->iova, map->len, map->flags);
 
-	iova_map_remove(&ctx->map, m->vaddr);
+	return 0;
+}
+
+static int __cmp_mapping_iova(const void *a, const void *b)
+{
+	const struct iova_mapping *ma = *(struct iova_mapping * const *)a;
+	const struct iova_mapping *mb = *(struct iova_mapping * const *)b;
 
-	free(m);
+	if (ma->iova != mb->iova)
+		return ma->iova < mb->iova ? -1 : 1;
 
 	return 0;
 }
 
-static void __unmap_mapping(void *opaque, struct skiplist_node *n)
+/*
+ * Unmap the (iova sorted) mappings, issuing a single unmap for each run of
+ * mappings that are adjacent in the iova space. Return the number of mappings
+ * that were unmapped.
+ */
+static int __dma_unmap_coalesced(struct iommu_ctx *ctx, struct iova_mapping **mappings, int n)
+{
+	int i = 0;
+
+	while (i < n) {
+		uint64_t iova = mappings[i]->iova;
+		size_t len = mappings[i]->len;
+		int j = i + 1;
+
+		while (j < n && mappings[j]->iova == iova + len)
+			len += mappings[j++]->len;
+
+		if (ctx->ops.dma_unmap(ctx, iova, len)) {
+			log_debug("failed to unmap dma (iova 0x%" PRIx64 " len %zu)\n", iova, len);
+			return i;
+		}
+
+		i = j;
+	}
+
+	return n;
+}
+
+/*
+ * If @contig is set, the areas are mapped back to back; they must be page
+ * aligned (but for the length of the last area) and none may be mapped already.
+ */
+static int __map_vaddrs(struct iommu_ctx *ctx, const struct iovec *iov, int n, uint64_t *iovas,
+			unsigned long flags, bool contig)
+{
+	struct iova_mapping_batch *batch;
+	struct iova_mapping **sorted;
+	uint64_t iova = 0;
+	size_t total = 0;
+	int i, j, nmap = 0;
+
+	if (n < 1 || flags & IOMMU_MAP_EPHEMERAL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	batch = zmalloc(sizeof(*batch) + (size_t)n * sizeof(struct iova_mapping));
+
+	for (i = 0; i < n; i++) {
+		struct iova_mapping *m = &batch->mappings[nmap];
+		uint64_t _iova;
+
+		if (!iov[i].iov_len) {
+			errno = EINVAL;
+			goto free_batch;
+		}
+
+		if (contig && (!ALIGNED((uintptr_t)iov[i].iov_base, __VFN_PAGESIZE) ||
+			       (i < n - 1 && !ALIGNED(iov[i].iov_len, __VFN_PAGESIZE)))) {
+			errno = EINVAL;
+			goto free_batch;
+		}
+
+		if (iommu_translate_vaddr(ctx, iov[i].iov_base, &_iova)) {
+			if (contig) {
+				errno = EEXIST;
+				goto free_batch;
+			}
+
+			if (iovas)
+				iovas[i] = _iova;
+
+			continue;
+		}
+
+		m->vaddr = iov[i].iov_base;
+		m->len = iov[i].iov_len;
+		m->flags = flags;
+		m->batch = batch;
+
+		if (flags & IOMMU_MAP_FIXED_IOVA)
+			m->iova = iovas[i];
+
+		total += ALIGN_UP(m->len, __VFN_PAGESIZE);
+		nmap++;
+	}
+
+	if (!nmap) {
+		free(batch);
+		return 0;
+	}
+
+	if (contig && !(flags & IOMMU_MAP_FIXED_IOVA) && !ctx->ops.iova_reserve) {
+		log_debug("cannot reserve a contiguous iova range\n");
+
+		errno = EOPNOTSUPP;
+		goto free_batch;
+	}
+
+	/* a single reservation for the entire batch */
+	if (!(flags & IOMMU_MAP_FIXED_IOVA) && ctx->ops.iova_reserve) {
+		if (ctx->ops.iova_reserve(ctx, total, &iova, flags)) {
+			log_debug("failed to allocate iova\n");
+			goto free_batch;
+		}
+
+		for (i = 0; i < nmap; i++) {
+			batch->mappings[i].iova = iova;
+			iova += ALIGN_UP(batch->mappings[i].len, __VFN_PAGESIZE);
+		}
+	}
+
+	for (i = 0; flags & IOMMU_MAP_PREFAULT && i < nmap; i++)
+		__prefault(ctx, batch->mappings[i].vaddr, batch->mappings[i].len, flags);
+
+	for (i = 0; i < nmap; i++) {
+		struct iova_mapping *m = &batch->mappings[i];
+
+		if (ctx->ops.dma_map(ctx, m->vaddr, m->len, &m->iova, flags)) {
+			log_debug("failed to map dma\n");
+			goto unmap;
+		}
+	}
+
+	batch->refs = (unsigned int)nmap;
+
+	if (iova_map_add_batch(&ctx->map, batch->mappings, nmap)) {
+		log_debug("failed to add mappings\n");
+		goto unmap;
+	}
+
+	/* the new mappings are in the order of @iov */
+	for (i = 0, j = 0; iovas && i < n; i++) {
+		if (j < nmap && batch->mappings[j].vaddr == iov[i].iov_base)
+			iovas[i] = batch->mappings[j++].iova;
+	}
+
+	return 0;
+
+unmap:
+	if (i) {
+		sorted = znew_t(struct iova_mapping *, i);
+
+		for (j = 0; j < i; j++)
+			sorted[j] = &batch->mappings[j];
+
+		qsort(sorted, (size_t)i, sizeof(*sorted), __cmp_mapping_iova);
+
+		log_fatal_if(__dma_unmap_coalesced(ctx, sorted, i) != i, "failed to unmap dma\n");
+
+		free(sorted);
+	}
+
+	for (j = 0; j < nmap; j++)
+		__iova_release(ctx, batch->mappings[j].iova, batch->mappings[j].len, flags);
+
+free_batch:
+	/* a failed batch insertion may have been visible to lookups */
+	rcu_free(batch);
+
+	return -1;
+}
+
+int iommu_map_vaddrs(struct iommu_ctx *ctx, const struct iovec *iov, int n, uint64_t *iovas,
+		     unsigned long flags)
+{
+	return __map_vaddrs(ctx, iov, n, iovas, flags, false);
+}
+
+int iommu_map_vaddrs_contig(struct iommu_ctx *ctx, const struct iovec *iov, int n, uint64_t *iova,
+			    unsigned long flags)
+{
+	__autofree uint64_t *iovas = NULL;
+
+	if (n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	iovas = xmalloc((size_t)n * sizeof(*iovas));
+
+	if (flags & IOMMU_MAP_FIXED_IOVA) {
+		iovas[0] = *iova;
+
+		for (int i = 1; i < n; i++)
+			iovas[i] = iovas[i - 1] + iov[i - 1].iov_len;
+	}
+
+	if (__map_vaddrs(ctx, iov, n, iovas, flags, true))
+		return -1;
+
+	*iova = iovas[0];
+
+	return 0;
+}
+
+int iommu_unmap_vaddrs(struct iommu_ctx *ctx, void **vaddrs, int n)
+{
+	struct iova_mapping **mappings;
+	int i, nunique = 0, nunmapped;
+
+	if (n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	mappings = znew_t(struct iova_mapping *, n);
+
+	for (i = 0; i < n; i++) {
+		mappings[i] = iova_map_find(&ctx->map, vaddrs[i]);
+		if (!mappings[i]) {
+			free(mappings);
+
+			errno = ENOENT;
+			return -1;
+		}
+	}
+
+	qsort(mappings, (size_t)n, sizeof(*mappings), __cmp_mapping_iova);
+
+	/* the same mapping may be given more than once */
+	for (i = 0; i < n; i++) {
+		if (!nunique || mappings[nunique - 1] != mappings[i])
+			mappings[nunique++] = mappings[i];
+	}
+
+	nunmapped = __dma_unmap_coalesced(ctx, mappings, nunique);
+
+	iova_map_remove_batch(&ctx->map, mappings, nunmapped);
+
+	/* the iovas may be handed out again once no lookup translates to them */
+	for (i = 0; i < nunmapped; i++)
+		__iova_release(ctx, mappings[i]->iova, mappings[i]->len, mappings[i]->flags);
+
+	/* concurrent lookups may still hold a reference */
+	for (i = 0; i < nunmapped; i++)
+		__iova_mapping_free(mappings[i], true);
+
+	free(mappings);
+
+	if (nunmapped < nunique) {
+		log_debug("failed to unmap dma\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void __unmap_mapping(void *opaque, uint64_t key, void *val)
 {
 	struct iommu_ctx *ctx = opaque;
-	struct iova_mapping *m = container_of_var(n, m, list);
+	struct iova_mapping *m = val;
 
-	log_fatal_if(ctx->ops.dma_unmap(ctx, m->len, m->iova),
+	log_fatal_if(ctx->ops.dma_unmap(ctx, m->iova, m->len),
 		     "failed to unmap dma (iova 0x%" PRIx64 " len %zu)\n", m->iova, m->len);
 
-	free(m);
+	__release_mapping(ctx, key, m);
 }
 
 int iommu_unmap_all(struct iommu_ctx *ctx)
 {
+	/* keep iommu_alloc() from handing out pool memory while it goes away */
+	__autolock(&ctx->dma_pool.lock);
+
 	if (ctx->ops.dma_unmap_all) {
 		if (ctx->ops.dma_unmap_all(ctx)) {
 			log_debug("failed to unmap dma\n");
 			return -1;
 		}
 
-		iova_map_clear(&ctx->map);
+		iova_map_clear_with(&ctx->map, __release_mapping, ctx);
+	} else {
+		iova_map_clear_with(&ctx->map, __unmap_mapping, ctx);
+	}
+
+	/* the chunk mappings are gone; do not carve from them again */
+	__iommu_dma_pool_clear(ctx, false);
+
+	return 0;
+}
+
+void iommu_get_map_stats(struct iommu_ctx *ctx, struct iommu_map_stats *stats)
+{
+	struct iommu_map_stats *s = &ctx->stats;
+
+	*stats = (struct iommu_map_stats) {
+		.maps = atomic_load_acquire(&s->maps),
+		.bytes = atomic_load_acquire(&s->bytes),
+		.nsecs = atomic_load_acquire(&s->nsecs),
+		.max_nsecs = atomic_load_acquire(&s->max_nsecs),
+		.prefault_nsecs = atomic_load_acquire(&s->prefault_nsecs),
+	};
+}
+
+int iommu_set_dirty_tracking(struct iommu_ctx *ctx, bool enable)
+{
+	if (!ctx->ops.set_dirty_tracking) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return ctx->ops.set_dirty_tracking(ctx, enable);
+}
+
+struct dirty_run {
+	void (*fn)(void *opaque, uint64_t iova, size_t len);
+	void *opaque;
+
+	uint64_t iova;
+
+	/* start page of the current run (if @active) */
+	uint64_t start;
+	bool active;
+};
+
+static inline void __dirty_run_end(struct dirty_run *run, uint64_t pg)
+{
+	run->fn(run->opaque, run->iova + (run->start << __VFN_PAGESHIFT),
+		(size_t)(pg - run->start) << __VFN_PAGESHIFT);
+
+	run->active = false;
+}
+
+/* feed the 64 pages starting at @pg into @run */
+static void __dirty_run_word(struct dirty_run *run, uint64_t pg, uint64_t word)
+{
+	unsigned int pos = 0;
+
+	/* the common cases; runs continue or stay ended */
+	if (word == (run->active ? ~0ULL : 0ULL))
+		return;
+
+	while (pos < 64) {
+		uint64_t rest = (run->active ? ~word : word) >> pos;
+
+		if (!rest)
+			return;
+
+		pos += (unsigned int)__builtin_ctzll(rest);
+
+		if (run->active) {
+			__dirty_run_end(run, pg + pos);
+		} else {
+			run->start = pg + pos;
+			run->active = true;
+		}
+	}
+}
+
+int iommu_get_dirty_ranges(struct iommu_ctx *ctx, uint64_t iova, size_t len,
+			   void (*fn)(void *opaque, uint64_t iova, size_t len), void *opaque,
+			   unsigned long flags)
+{
+	const size_t window = (size_t)DIRTY_BITMAP_WORDS * 64 << __VFN_PAGESHIFT;
+	__autofree uint64_t *bitmap = NULL;
+	uint64_t npages = len >> __VFN_PAGESHIFT;
+
+	struct dirty_run run = {
+		.fn = fn,
+		.opaque = opaque,
+		.iova = iova,
+	};
 
-		return 0;
+	if (!ctx->ops.get_dirty_bitmap) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (!ALIGNED(iova, __VFN_PAGESIZE) || !ALIGNED(len, __VFN_PAGESIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bitmap = new_t(uint64_t, DIRTY_BITMAP_WORDS);
+
+	for (size_t ofst = 0; ofst < len; ofst += window) {
+		size_t n = min_t(size_t, len - ofst, window);
+		uint64_t pg = ofst >> __VFN_PAGESHIFT;
+		size_t nwords = ((n >> __VFN_PAGESHIFT) + 63) / 64;
+
+		/* the backend only sets bits */
+		memset(bitmap, 0x0, nwords * sizeof(uint64_t));
+
+		if (ctx->ops.get_dirty_bitmap(ctx, iova + ofst, n, bitmap, flags)) {
+			log_debug("failed to get dirty bitmap\n");
+			return -1;
+		}
+
+		for (size_t i = 0; i < nwords; i++)
+			__dirty_run_word(&run, pg + i * 64, bitmap[i]);
 	}
 
-	iova_map_clear_with(&ctx->map, __unmap_mapping, ctx);
+	if (run.active)
+		__dirty_run_end(&run, npages);
 
 	return 0;
 }
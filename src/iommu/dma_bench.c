@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+
+#include "dma.c"
+
+#define LOOKUPS 1000000
+#define STRIDE 0x2000
+#define MAX_THREADS 4
+
+static uint64_t next_iova = 0x100000;
+
+static int stub_dma_map(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len,
+			uint64_t *iova, unsigned long flags UNUSED)
+{
+	*iova = next_iova;
+	next_iova += ALIGN_UP(len, 0x1000);
+
+	return 0;
+}
+
+static int stub_dma_unmap(struct iommu_ctx *ctx UNUSED, uint64_t iova UNUSED,
+			  size_t len UNUSED)
+{
+	return 0;
+}
+
+static struct iommu_ctx ctx = {
+	.ops = {
+		.dma_map = stub_dma_map,
+		.dma_unmap = stub_dma_unmap,
+	},
+};
+
+static void *base;
+static int nmappings;
+
+struct lookup {
+	pthread_t thread;
+	uint64_t seed, ticks;
+};
+
+static void *random_lookups(void *opaque)
+{
+	struct lookup *l = opaque;
+	uint64_t x = l->seed, iova, start;
+	unsigned long misses = 0;
+
+	start = get_ticks();
+
+	for (int i = 0; i < LOOKUPS; i++) {
+		/* xorshift64 */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+
+		if (!iommu_translate_vaddr(&ctx, base + (x % (uint64_t)nmappings) * STRIDE, &iova))
+			misses++;
+	}
+
+	l->ticks = get_ticks() - start;
+
+	if (misses)
+		fprintf(stderr, "%lu translations failed\n", misses);
+
+	return NULL;
+}
+
+static double ns(uint64_t ticks)
+{
+	return (double)ticks * 1e9 / (double)get_ticks_freq() / LOOKUPS;
+}
+
+static void bench(int n)
+{
+	struct lookup lookups[MAX_THREADS];
+	uint64_t iova, start, t_hot, t_map, t_unmap, t_mt = 0;
+
+	nmappings = n;
+
+	start = get_ticks();
+	for (int i = 0; i < n; i++)
+		assert(iommu_map_vaddr(&ctx, base + (size_t)i * STRIDE, 0x1000, &iova, 0x0) == 0);
+	t_map = get_ticks() - start;
+
+	/* the same address; served by the per-thread translation cache */
+	start = get_ticks();
+	for (int i = 0; i < LOOKUPS; i++)
+		assert(iommu_translate_vaddr(&ctx, base + 0x10, &iova));
+	t_hot = get_ticks() - start;
+
+	lookups[0].seed = 0x9e3779b97f4a7c15ULL;
+	random_lookups(&lookups[0]);
+
+	printf("%8d %12.1f %12.1f %12.1f", n,
+	       (double)t_map * 1e9 / (double)get_ticks_freq() / n, ns(t_hot),
+	       ns(lookups[0].ticks));
+
+	/* concurrent random lookups */
+	for (int i = 0; i < MAX_THREADS; i++) {
+		lookups[i].seed = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+		assert(pthread_create(&lookups[i].thread, NULL, random_lookups, &lookups[i]) == 0);
+	}
+
+	for (int i = 0; i < MAX_THREADS; i++) {
+		pthread_join(lookups[i].thread, NULL);
+		t_mt += lookups[i].ticks;
+	}
+
+	printf(" %12.1f", ns(t_mt / MAX_THREADS));
+
+	start = get_ticks();
+	for (int i = 0; i < n; i++)
+		assert(iommu_unmap_vaddr(&ctx, base + (size_t)i * STRIDE, NULL) == 0);
+	t_unmap = get_ticks() - start;
+
+	printf(" %12.1f\n", (double)t_unmap * 1e9 / (double)get_ticks_freq() / n);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	iova_map_init(&ctx.map);
+
+	list_head_init(&ctx.dma_pool.chunks);
+	pthread_mutex_init(&ctx.dma_pool.lock, NULL);
+
+	/* address space only; the stub never touches the memory */
+	base = mmap(NULL, (size_t)100000 * STRIDE, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert(base != MAP_FAILED);
+
+	printf("average ns per operation (%d threads for mt)\n", MAX_THREADS);
+	printf("%8s %12s %12s %12s %12s %12s\n", "n", "map", "hot", "random", "random mt",
+	       "unmap");
+
+	for (int n = 10; n <= 100000; n *= 100)
+		bench(n);
+
+	return 0;
+}
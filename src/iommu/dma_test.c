@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+#include <unistd.h>
+
+#include "ccan/array_size/array_size.h"
+#include "ccan/tap/tap.h"
+
+#include "dma.c"
+
+#define PG(n) ((size_t)(n) << __VFN_PAGESHIFT)
+
+static uint64_t next_iova = 0x100000;
+
+static int stub_dma_map(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len,
+			uint64_t *iova, unsigned long flags UNUSED)
+{
+	*iova = next_iova;
+	next_iova += ALIGN_UP(len, 0x1000);
+
+	return 0;
+}
+
+static int stub_iova_reserve(struct iommu_ctx *ctx UNUSED, size_t len, uint64_t *iova,
+			     unsigned long flags UNUSED)
+{
+	*iova = next_iova;
+	next_iova += len;
+
+	return 0;
+}
+
+/* the vfio backend maps at the reserved iova */
+static int stub_dma_map_fixed(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED,
+			      size_t len UNUSED, uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+static int nunmaps;
+static bool unmap_fails;
+
+static int stub_dma_unmap(struct iommu_ctx *ctx UNUSED, uint64_t iova UNUSED,
+			  size_t len UNUSED)
+{
+	if (unmap_fails)
+		return -1;
+
+	nunmaps++;
+
+	return 0;
+}
+
+static bool map_file_fails;
+static int nmapfiles;
+
+static int stub_dma_map_file(struct iommu_ctx *ctx UNUSED, int fd UNUSED, uint64_t offset UNUSED,
+			     size_t len UNUSED, uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	if (map_file_fails) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	nmapfiles++;
+
+	return 0;
+}
+
+/* dirty page ranges (in pages); the second spans a bitmap word boundary */
+static const uint64_t dirty[][2] = { { 0, 3 }, { 63, 66 }, { 262100, 262200 }, };
+
+/* pages below this have been cleared (queries are made in order of iova) */
+static uint64_t dirty_cleared;
+
+static int stub_get_dirty_bitmap(struct iommu_ctx *ctx UNUSED, uint64_t iova, size_t len,
+				 uint64_t *bitmap, unsigned long flags)
+{
+	uint64_t first = iova >> __VFN_PAGESHIFT, last = first + (len >> __VFN_PAGESHIFT);
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(dirty); i++) {
+		uint64_t start = max(max(dirty[i][0], first), dirty_cleared);
+
+		for (uint64_t pg = start; pg < min(dirty[i][1], last); pg++)
+			bitmap[(pg - first) / 64] |= 1ULL << ((pg - first) % 64);
+	}
+
+	if (!(flags & IOMMU_DIRTY_NO_CLEAR))
+		dirty_cleared = max(dirty_cleared, last);
+
+	return 0;
+}
+
+static uint64_t ranges[8][2];
+static unsigned int nranges;
+
+static void collect_range(void *opaque UNUSED, uint64_t iova, size_t len)
+{
+	if (nranges < ARRAY_SIZE(ranges)) {
+		ranges[nranges][0] = iova >> __VFN_PAGESHIFT;
+		ranges[nranges][1] = (iova + len) >> __VFN_PAGESHIFT;
+	}
+
+	nranges++;
+}
+
+static bool ranges_are_dirty(void)
+{
+	if (nranges != ARRAY_SIZE(dirty))
+		return false;
+
+	for (unsigned int i = 0; i < nranges; i++) {
+		if (ranges[i][0] != dirty[i][0] || ranges[i][1] != dirty[i][1])
+			return false;
+	}
+
+	return true;
+}
+
+static struct iommu_ctx ctx = {
+	.ops = {
+		.dma_map = stub_dma_map,
+		.dma_unmap = stub_dma_unmap,
+	},
+};
+
+static void *buf;
+
+static void *translate_thread(void *opaque)
+{
+	uint64_t *iova = opaque;
+
+	if (!iommu_translate_vaddr(&ctx, buf + 0x10, iova))
+		*iova = 0;
+
+	return NULL;
+}
+
+int main(void)
+{
+	uint64_t iova, iova2, thread_iova, iovas[4];
+	struct iovec iov[4];
+	void *vaddrs[4];
+	struct iova_map map;
+	unsigned long gen;
+	pthread_t thread;
+	struct iommu_file_map fmap = {};
+	struct iovec ciov[3];
+	void *cbuf;
+	struct iommu_map_stats stats;
+	unsigned char vec[4];
+	void *pfbuf;
+	void *fbuf;
+	size_t len;
+	int fd;
+
+	plan_tests(47);
+
+	iova_map_init(&ctx.map);
+
+	list_head_init(&ctx.dma_pool.chunks);
+	pthread_mutex_init(&ctx.dma_pool.lock, NULL);
+
+	assert(pgmap(&buf, 0x2000) > 0);
+
+	ok1(iommu_translate_vaddr(&ctx, buf, &iova) == false);
+
+	ok1(iommu_map_vaddr(&ctx, buf, 0x2000, &iova, 0x0) == 0);
+	ok1(iommu_translate_vaddr(&ctx, buf + 0x1008, &iova2) && iova2 == iova + 0x1008);
+
+	/* cached translation */
+	gen = ctx.map.gen;
+	ok1(iommu_translate_vaddr(&ctx, buf + 0x1010, &iova2) && iova2 == iova + 0x1010);
+	ok1(ctx.map.gen == gen);
+
+	/* translation from another thread (with a separate cache) */
+	pthread_create(&thread, NULL, translate_thread, &thread_iova);
+	pthread_join(thread, NULL);
+	ok1(thread_iova == iova + 0x10);
+
+	/* unmap invalidates the cached translation */
+	ok1(iommu_unmap_vaddr(&ctx, buf, &len) == 0 && len == 0x2000);
+	ok1(ctx.map.gen != gen);
+	ok1(iommu_translate_vaddr(&ctx, buf + 0x1010, &iova2) == false);
+
+	/* remapping does not return a stale translation */
+	ok1(iommu_map_vaddr(&ctx, buf, 0x2000, &iova2, 0x0) == 0 && iova2 != iova);
+
+	/* a failed unmap leaves the mapping in place */
+	unmap_fails = true;
+	ok1(iommu_unmap_vaddr(&ctx, buf, NULL) == -1);
+	unmap_fails = false;
+	ok1(iommu_translate_vaddr(&ctx, buf, &iova) && iova == iova2);
+
+	iommu_unmap_all(&ctx);
+	ok1(iommu_translate_vaddr(&ctx, buf, &iova2) == false);
+
+	/* a map initialized later (possibly at the same address) never reuses a generation */
+	gen = ctx.map.gen;
+	iova_map_init(&map);
+	ok1(map.gen > gen);
+
+	/* prefaulting populates the page tables before mapping */
+	assert(pgmap(&pfbuf, PG(4)) > 0);
+
+	ok1(iommu_map_vaddr(&ctx, pfbuf, PG(4), &iova2, IOMMU_MAP_PREFAULT) == 0);
+	ok1(mincore(pfbuf, PG(4), vec) == 0 && vec[0] & vec[1] & vec[2] & vec[3] & 0x1);
+
+	iommu_unmap_vaddr(&ctx, pfbuf, NULL);
+	pgunmap(pfbuf, PG(4));
+
+	/* map ioctl accounting */
+	iommu_ctx_account_map(&ctx, 0x2000, 100);
+	iommu_ctx_account_map(&ctx, 0x1000, 50);
+	iommu_get_map_stats(&ctx, &stats);
+
+	ok1(stats.maps == 2 && stats.bytes == 0x3000 && stats.nsecs == 150 &&
+	    stats.max_nsecs == 100);
+
+	/* batched mapping with a single iova reservation */
+	ctx.ops.iova_reserve = stub_iova_reserve;
+	ctx.ops.dma_map = stub_dma_map_fixed;
+
+	assert(pgmap(&buf, 0x4000) > 0);
+
+	for (int i = 0; i < 4; i++)
+		iov[i] = (struct iovec) { .iov_base = buf + i * 0x1000, .iov_len = 0x1000 };
+
+	ok1(iommu_map_vaddrs(&ctx, iov, 4, iovas, 0x0) == 0);
+	ok1(iovas[1] == iovas[0] + 0x1000 && iovas[3] == iovas[0] + 0x3000);
+	ok1(iommu_translate_vaddr(&ctx, buf + 0x2008, &iova2) && iova2 == iovas[2] + 0x8);
+
+	/* already mapped areas are only translated */
+	ok1(iommu_map_vaddrs(&ctx, &iov[2], 1, &iova2, 0x0) == 0 && iova2 == iovas[2]);
+
+	/* adjacent iova ranges are unmapped together */
+	for (int i = 0; i < 4; i++)
+		vaddrs[i] = iov[3 - i].iov_base;
+
+	nunmaps = 0;
+	ok1(iommu_unmap_vaddrs(&ctx, &vaddrs[1], 3) == 0 && nunmaps == 1);
+	ok1(iommu_translate_vaddr(&ctx, buf, &iova2) == false);
+	ok1(iommu_translate_vaddr(&ctx, buf + 0x3000, &iova2) && iova2 == iovas[3]);
+
+	ok1(iommu_unmap_vaddrs(&ctx, vaddrs, 2) == -1 && errno == ENOENT);
+
+	/* if any area overlaps, none are mapped */
+	iov[0].iov_len = 0x2000;
+	ok1(iommu_map_vaddrs(&ctx, iov, 2, NULL, 0x0) == -1 && errno == EEXIST);
+	ok1(iommu_translate_vaddr(&ctx, buf, &iova2) == false);
+
+	/* files are mapped through the process address space by default */
+	fd = memfd_create("dma_test", 0);
+	assert(fd >= 0 && ftruncate(fd, PG(4)) == 0);
+
+	ok1(iommu_map_file(&ctx, fd, 0x800, PG(1), 0x0, &fmap) == -1 && errno == EINVAL);
+
+	ok1(iommu_map_file(&ctx, fd, PG(1), PG(2), 0x0, &fmap) == 0 && fmap.vaddr &&
+	    iommu_translate_vaddr(&ctx, fmap.vaddr, &iova2) && iova2 == fmap.iova);
+
+	nunmaps = 0;
+	ok1(iommu_unmap_file(&ctx, &fmap) == 0 && nunmaps == 1);
+
+	/* or directly, if supported; with a fallback if the file is refused */
+	ctx.ops.dma_map_file = stub_dma_map_file;
+
+	ok1(iommu_map_file(&ctx, fd, 0x0, PG(2), 0x0, &fmap) == 0 && !fmap.vaddr &&
+	    iommu_unmap_file(&ctx, &fmap) == 0 && nunmaps == 2);
+
+	map_file_fails = true;
+	ok1(iommu_map_file(&ctx, fd, 0x0, PG(2), 0x0, &fmap) == 0 && fmap.vaddr &&
+	    iommu_unmap_file(&ctx, &fmap) == 0 && nunmaps == 3);
+
+	/* a file backed area is mapped from the file, but translated as usual */
+	map_file_fails = false;
+
+	fbuf = mmap(NULL, PG(2), PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)PG(2));
+	assert(fbuf != MAP_FAILED);
+
+	ok1(iommu_map_vaddr_file(&ctx, fbuf, PG(2), fd, PG(2), &iova, 0x0) == 0 &&
+	    nmapfiles == 2 && iommu_translate_vaddr(&ctx, fbuf + 0x1010, &iova2) &&
+	    iova2 == iova + 0x1010);
+	ok1(iommu_unmap_vaddr(&ctx, fbuf, &len) == 0 && len == PG(2) && nunmaps == 4);
+
+	munmap(fbuf, PG(2));
+	close(fd);
+
+	/* discontiguous areas mapped back to back */
+	assert(pgmap(&cbuf, PG(4)) > 0);
+
+	ciov[0] = (struct iovec) { .iov_base = cbuf + PG(2), .iov_len = PG(1) };
+	ciov[1] = (struct iovec) { .iov_base = cbuf, .iov_len = PG(2) };
+	ciov[2] = (struct iovec) { .iov_base = cbuf + PG(3), .iov_len = 0x800 };
+
+	ok1(iommu_map_vaddrs_contig(&ctx, ciov, 3, &iova, 0x0) == 0);
+	ok1(iommu_translate_vaddr(&ctx, cbuf + 0x10, &iova2) && iova2 == iova + PG(1) + 0x10);
+	ok1(iommu_translate_vaddr(&ctx, cbuf + PG(3), &iova2) && iova2 == iova + PG(3));
+
+	/* already mapped */
+	ok1(iommu_map_vaddrs_contig(&ctx, &ciov[1], 1, &iova2, 0x0) == -1 && errno == EEXIST);
+
+	for (int i = 0; i < 3; i++)
+		vaddrs[i] = ciov[i].iov_base;
+
+	nunmaps = 0;
+	ok1(iommu_unmap_vaddrs(&ctx, vaddrs, 3) == 0 && nunmaps == 1);
+
+	/* a hole would break contiguity */
+	ciov[0].iov_len = 0x800;
+	ok1(iommu_map_vaddrs_contig(&ctx, ciov, 2, &iova, 0x0) == -1 && errno == EINVAL);
+
+	/* the backend must reserve the range, unless it is fixed */
+	ctx.ops.iova_reserve = NULL;
+	ok1(iommu_map_vaddrs_contig(&ctx, &ciov[1], 1, &iova, 0x0) == -1 && errno == EOPNOTSUPP);
+
+	iova = 0x40000000;
+	ok1(iommu_map_vaddrs_contig(&ctx, &ciov[1], 2, &iova, IOMMU_MAP_FIXED_IOVA) == 0 &&
+	    iommu_translate_vaddr(&ctx, cbuf + PG(3), &iova2) && iova2 == 0x40000000 + PG(2));
+
+	ctx.ops.iova_reserve = stub_iova_reserve;
+
+	/* dirty tracking */
+	ok1(iommu_set_dirty_tracking(&ctx, true) == -1 && errno == EOPNOTSUPP);
+
+	ctx.ops.get_dirty_bitmap = stub_get_dirty_bitmap;
+
+	ok1(iommu_get_dirty_ranges(&ctx, 0x800, PG(8), collect_range, NULL, 0x0) == -1 &&
+	    errno == EINVAL);
+
+	/* ranges are coalesced across bitmap words and query windows */
+	ok1(iommu_get_dirty_ranges(&ctx, 0x0, PG(300000), collect_range, NULL,
+				   IOMMU_DIRTY_NO_CLEAR) == 0 && ranges_are_dirty());
+
+	nranges = 0;
+	ok1(iommu_get_dirty_ranges(&ctx, 0x0, PG(300000), collect_range, NULL, 0x0) == 0 &&
+	    ranges_are_dirty());
+
+	nranges = 0;
+	ok1(iommu_get_dirty_ranges(&ctx, 0x0, PG(300000), collect_range, NULL, 0x0) == 0 &&
+	    nranges == 0);
+
+	return exit_status();
+}
@@ -0,0 +1,489 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Compare the iommu backends (vfio type1 and iommufd) on the cost of mapping
+ * and unmapping memory and on the latency of device DMA as the number of iova
+ * pages touched (and thus IOTLB pressure) grows.
+ *
+ * Each backend is measured in a child process of its own, since a device can
+ * only be attached to one of them at a time. Results are written as a table
+ * or (with -o json) as a single json document.
+ *
+ * The device is given with -d or, for meson benchmark runs, in the
+ * VFN_BENCH_DEVICE environment variable:
+ *
+ *   VFN_BENCH_DEVICE=0000:01:00.0 meson test -C build --benchmark --suite device
+ */
+
+#include <assert.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <vfn/nvme.h>
+
+#include "ccan/array_size/array_size.h"
+#include "ccan/err/err.h"
+#include "ccan/minmax/minmax.h"
+#include "ccan/opt/opt.h"
+#include "ccan/str/str.h"
+
+/* private; the backends are otherwise picked by iommu_get_context() */
+#include "iommu/context.h"
+
+#define EXIT_SKIPPED 77
+
+#define MAX_THREADS 64
+#define HUGEPAGE_SIZE (2ULL << 20)
+
+/* pages mapped and unmapped per round by each thread in the contention test */
+#define CONTENTION_PAGES 256
+#define CONTENTION_ROUNDS 16
+
+/* commands issued per working set size in the iotlb test */
+#define IOTLB_CMDS 4096
+#define IOTLB_MAX_PAGES (1 << 15)
+
+static char *bdf;
+static char *output_format = "text";
+static unsigned long max_size = 1ULL << 30;
+static unsigned int max_threads = 8;
+static bool show_usage, json;
+
+static struct opt_table opts[] = {
+	OPT_WITHOUT_ARG("-h|--help", opt_set_bool, &show_usage, "show usage"),
+	OPT_WITH_ARG("-d|--device BDF", opt_set_charp, opt_show_charp, &bdf, "pci device"),
+	OPT_WITH_ARG("-s|--max-size BYTES", opt_set_ulongval_bi, opt_show_ulongval_bi, &max_size,
+		     "largest mapping"),
+	OPT_WITH_ARG("-t|--max-threads N", opt_set_uintval, opt_show_uintval, &max_threads,
+		     "largest number of threads mapping concurrently"),
+	OPT_WITH_ARG("-o|--output FORMAT", opt_set_charp, opt_show_charp, &output_format,
+		     "output format (text or json)"),
+	OPT_ENDTABLE,
+};
+
+struct backend {
+	const char *name;
+	struct iommu_ctx *(*get_context)(const char *name);
+};
+
+static const struct backend backends[] = {
+	{ "vfio-type1", vfio_get_iommu_context },
+#ifdef HAVE_VFIO_DEVICE_BIND_IOMMUFD
+	{ "iommufd", iommufd_get_iommu_context },
+#endif
+};
+
+static struct nvme_ctrl ctrl;
+static struct iommu_ctx *ctx;
+
+static double ns(uint64_t ticks)
+{
+	return (double)ticks_to_ns(ticks);
+}
+
+/* a separator is needed before every json element but the first one */
+static const char *sep(bool *first)
+{
+	if (*first) {
+		*first = false;
+		return "";
+	}
+
+	return ",";
+}
+
+static void *alloc_buf(size_t len, bool huge)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	void *vaddr;
+
+	if (huge) {
+		len = ALIGN_UP(len, HUGEPAGE_SIZE);
+		flags |= MAP_HUGETLB;
+	}
+
+	vaddr = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (vaddr == MAP_FAILED)
+		return NULL;
+
+	return vaddr;
+}
+
+static void free_buf(void *vaddr, size_t len, bool huge)
+{
+	munmap(vaddr, huge ? ALIGN_UP(len, HUGEPAGE_SIZE) : len);
+}
+
+/*
+ * Map and unmap buffers of increasing size, with and without
+ * IOMMU_MAP_EPHEMERAL (which recycles iovas).
+ */
+static void bench_map_one(void *buf, size_t size, bool huge, unsigned long flags, bool *first)
+{
+	int iterations = (int)clamp_t(size_t, (256ULL << 20) / size, 4, 1000);
+	uint64_t t_map = 0, t_unmap = 0, start, iova;
+	const char *pages = huge ? "2m" : "4k";
+	const char *mode = flags & IOMMU_MAP_EPHEMERAL ? "ephemeral" : "persistent";
+	double map_ns, unmap_ns, gbps;
+
+	for (int i = 0; i < iterations; i++) {
+		start = get_ticks();
+
+		if (iommu_map_vaddr(ctx, buf, size, &iova, flags))
+			err(1, "could not map %zu bytes", size);
+
+		t_map += get_ticks() - start;
+		start = get_ticks();
+
+		if (iommu_unmap_vaddr(ctx, buf, NULL))
+			err(1, "could not unmap %zu bytes", size);
+
+		t_unmap += get_ticks() - start;
+	}
+
+	map_ns = ns(t_map) / iterations;
+	unmap_ns = ns(t_unmap) / iterations;
+	gbps = (double)size / map_ns;
+
+	if (json) {
+		printf("%s\n        { \"size\": %zu, \"pages\": \"%s\", \"mode\": \"%s\", "
+		       "\"iterations\": %d, \"map_ns\": %.1f, \"unmap_ns\": %.1f, "
+		       "\"map_gbps\": %.3f }", sep(first), size, pages, mode, iterations, map_ns,
+		       unmap_ns, gbps);
+	} else {
+		printf("%12zu %6s %10s %12.1f %12.1f %10.3f\n", size, pages, mode, map_ns, unmap_ns,
+		       gbps);
+	}
+}
+
+static void bench_map(void)
+{
+	bool first = true;
+
+	if (json)
+		printf(",\n      \"map\": [");
+	else
+		printf("\n%12s %6s %10s %12s %12s %10s\n", "size", "pages", "mode", "map ns",
+		       "unmap ns", "map GB/s");
+
+	for (int huge = 0; huge < 2; huge++) {
+		void *buf = alloc_buf(max_size, huge);
+
+		if (!buf) {
+			if (!json)
+				printf("%12s %6s (%s)\n", "-", huge ? "2m" : "4k",
+				       "could not allocate");
+
+			continue;
+		}
+
+		for (size_t size = 4096; size <= max_size; size <<= 2) {
+			bench_map_one(buf, size, huge, 0x0, &first);
+			bench_map_one(buf, size, huge, IOMMU_MAP_EPHEMERAL, &first);
+		}
+
+		free_buf(buf, max_size, huge);
+	}
+
+	if (json)
+		printf("\n      ]");
+}
+
+struct contender {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	void *buf;
+	uint64_t t_map, t_unmap, ticks;
+};
+
+/* threads map into the same context; writers serialize on ctx->map.lock */
+static void *contend(void *opaque)
+{
+	struct contender *c = opaque;
+	uint64_t begin, start, iova;
+
+	pthread_barrier_wait(c->barrier);
+
+	begin = get_ticks();
+
+	for (int r = 0; r < CONTENTION_ROUNDS; r++) {
+		for (int i = 0; i < CONTENTION_PAGES; i++) {
+			start = get_ticks();
+
+			if (iommu_map_vaddr(ctx, c->buf + ((size_t)i << 12), 4096, &iova, 0x0))
+				err(1, "could not map");
+
+			c->t_map += get_ticks() - start;
+		}
+
+		for (int i = 0; i < CONTENTION_PAGES; i++) {
+			start = get_ticks();
+
+			if (iommu_unmap_vaddr(ctx, c->buf + ((size_t)i << 12), NULL))
+				err(1, "could not unmap");
+
+			c->t_unmap += get_ticks() - start;
+		}
+	}
+
+	c->ticks = get_ticks() - begin;
+
+	return NULL;
+}
+
+static void bench_contention(void)
+{
+	static struct contender contenders[MAX_THREADS];
+	size_t len = (size_t)CONTENTION_PAGES << 12;
+	pthread_barrier_t barrier;
+	bool first = true;
+
+	if (json)
+		printf(",\n      \"contention\": [");
+	else
+		printf("\n%8s %12s %12s %12s\n", "threads", "ops/s", "map ns", "unmap ns");
+
+	for (unsigned int n = 1; n <= min_t(unsigned int, max_threads, MAX_THREADS); n <<= 1) {
+		uint64_t t_map = 0, t_unmap = 0, ticks = 0;
+		double nops = (double)n * CONTENTION_ROUNDS * CONTENTION_PAGES, opss;
+
+		pthread_barrier_init(&barrier, NULL, n);
+
+		for (unsigned int i = 0; i < n; i++) {
+			struct contender *c = &contenders[i];
+
+			*c = (struct contender) {
+				.barrier = &barrier,
+				.buf = alloc_buf(len, false),
+			};
+
+			if (!c->buf)
+				err(1, "could not allocate");
+
+			if (pthread_create(&c->thread, NULL, contend, c))
+				err(1, "could not create thread");
+		}
+
+		for (unsigned int i = 0; i < n; i++) {
+			struct contender *c = &contenders[i];
+
+			pthread_join(c->thread, NULL);
+
+			t_map += c->t_map;
+			t_unmap += c->t_unmap;
+			ticks = max_t(uint64_t, ticks, c->ticks);
+
+			free_buf(c->buf, len, false);
+		}
+
+		pthread_barrier_destroy(&barrier);
+
+		/* both maps and unmaps */
+		opss = 2 * nops / (ns(ticks) / 1e9);
+
+		if (json) {
+			printf("%s\n        { \"threads\": %u, \"size\": 4096, "
+			       "\"ops_per_sec\": %.0f, "
+			       "\"map_ns\": %.1f, \"unmap_ns\": %.1f }", sep(&first), n, opss,
+			       ns(t_map) / nops, ns(t_unmap) / nops);
+		} else {
+			printf("%8u %12.0f %12.1f %12.1f\n", n, opss, ns(t_map) / nops,
+			       ns(t_unmap) / nops);
+		}
+	}
+
+	if (json)
+		printf("\n      ]");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Have the controller write identify data to random pages of a working set of
+ * increasing size; once the working set exceeds the IOTLB, translations miss.
+ */
+static void bench_iotlb(void)
+{
+	static uint64_t lat[IOTLB_CMDS];
+	size_t len = (size_t)IOTLB_MAX_PAGES << 12;
+	uint64_t iova, x = 0x9e3779b97f4a7c15ULL, sum;
+	bool first = true;
+	void *buf;
+
+	if (json)
+		printf(",\n      \"iotlb\": [");
+	else
+		printf("\n%8s %12s %12s %12s\n", "pages", "lavg ns", "p50 ns", "p99 ns");
+
+	buf = alloc_buf(len, false);
+	if (!buf)
+		err(1, "could not allocate");
+
+	if (iommu_map_vaddr(ctx, buf, len, &iova, 0x0))
+		err(1, "could not map");
+
+	for (int npages = 1; npages <= IOTLB_MAX_PAGES; npages <<= 3) {
+		sum = 0;
+
+		for (int i = 0; i < IOTLB_CMDS; i++) {
+			union nvme_cmd cmd = {
+				.identify = {
+					.opcode = 0x06,
+					.cns = 0x1,
+				},
+			};
+			uint64_t start;
+			void *page;
+
+			/* xorshift64 */
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+
+			page = buf + ((x % (uint64_t)npages) << 12);
+
+			start = get_ticks();
+
+			if (nvme_admin(&ctrl, &cmd, page, 4096, NULL))
+				err(1, "could not identify");
+
+			lat[i] = get_ticks() - start;
+			sum += lat[i];
+		}
+
+		qsort(lat, IOTLB_CMDS, sizeof(*lat), cmp_u64);
+
+		if (json) {
+			printf("%s\n        { \"pages\": %d, \"lavg_ns\": %.1f, \"p50_ns\": %.1f, "
+			       "\"p99_ns\": %.1f }", sep(&first), npages, ns(sum) / IOTLB_CMDS,
+			       ns(lat[IOTLB_CMDS / 2]), ns(lat[IOTLB_CMDS * 99 / 100]));
+		} else {
+			printf("%8d %12.1f %12.1f %12.1f\n", npages, ns(sum) / IOTLB_CMDS,
+			       ns(lat[IOTLB_CMDS / 2]), ns(lat[IOTLB_CMDS * 99 / 100]));
+		}
+	}
+
+	if (iommu_unmap_vaddr(ctx, buf, NULL))
+		err(1, "could not unmap");
+
+	free_buf(buf, len, false);
+
+	if (json)
+		printf("\n      ]");
+}
+
+static void bench_backend(const struct backend *backend, bool first)
+{
+	ctx = backend->get_context(backend->name);
+	if (!ctx)
+		err(1, "could not create %s context", backend->name);
+
+	/* attach the device to the context */
+	ctrl.pci.dev.ctx = ctx;
+
+	if (nvme_init(&ctrl, bdf, NULL))
+		err(1, "failed to init nvme controller");
+
+	if (json)
+		printf("%s\n    {\n      \"backend\": \"%s\"", first ? "" : ",", backend->name);
+	else
+		printf("%s\n", backend->name);
+
+	bench_map();
+	bench_contention();
+	bench_iotlb();
+
+	if (json)
+		printf("\n    }");
+	else
+		printf("\n");
+
+	nvme_close(&ctrl);
+}
+
+int main(int argc, char *argv[])
+{
+	bool first = true;
+
+	opt_register_table(opts, NULL);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+
+	if (show_usage)
+		opt_usage_and_exit(NULL);
+
+	opt_free_table();
+
+	if (!bdf)
+		bdf = getenv("VFN_BENCH_DEVICE");
+
+	if (!bdf) {
+		fprintf(stderr, "no device given; skipping\n");
+		return EXIT_SKIPPED;
+	}
+
+	if (streq(output_format, "json"))
+		json = true;
+	else if (!streq(output_format, "text"))
+		errx(1, "unknown output format '%s'", output_format);
+
+	if (max_size < 4096)
+		errx(1, "the largest mapping must be at least 4096 bytes");
+
+	if (json)
+		printf("{\n  \"benchmark\": \"iommu\",\n  \"device\": \"%s\",\n  \"backends\": [",
+		       bdf);
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(backends); i++) {
+		int status;
+		pid_t pid;
+
+		/* do not duplicate buffered output in the child */
+		fflush(stdout);
+
+		pid = fork();
+		if (pid < 0)
+			err(1, "fork");
+
+		if (!pid) {
+			bench_backend(&backends[i], first);
+
+			fflush(stdout);
+			exit(0);
+		}
+
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			warnx("%s backend failed", backends[i].name);
+			continue;
+		}
+
+		first = false;
+	}
+
+	if (json)
+		printf("\n  ]\n}\n");
+
+	return 0;
+}
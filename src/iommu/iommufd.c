@@ -26,6 +26,7 @@
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 
 #include <linux/types.h>
 #include <linux/iommufd.h>
@@ -36,6 +37,7 @@
 #include "vfn/pci.h"
 #include "vfn/iommu.h"
 
+#include "ccan/compiler/compiler.h"
 #include "ccan/list/list.h"
 
 #include "context.h"
@@ -47,7 +49,18 @@ struct iommu_ioas {
 	struct iommu_ctx ctx;
 
 	char *name;
+
+	/* the iommufd the ioas belongs to (imported contexts have their own) */
+	int fd;
 	uint32_t id;
+
+#ifdef HAVE_IOMMU_HWPT_GET_DIRTY_BITMAP
+	/* dirty tracking capable hardware pagetable (zero if not allocated) */
+	uint32_t hwpt_id;
+
+	/* set if any device is attached without it */
+	bool untracked;
+#endif
 };
 
 static struct iommu_ioas iommufd_default_ioas = {
@@ -62,7 +75,7 @@ static int iommu_ioas_update_iova_ranges(struct iommu_ioas *ioas)
 		.num_iovas = 0,
 	};
 
-	if (ioctl(__iommufd, IOMMU_IOAS_IOVA_RANGES, &iova_ranges)) {
+	if (ioctl(ioas->fd, IOMMU_IOAS_IOVA_RANGES, &iova_ranges)) {
 		if (errno != EMSGSIZE) {
 			log_debug("could not get ioas iova ranges\n");
 			return -1;
@@ -74,7 +87,7 @@ static int iommu_ioas_update_iova_ranges(struct iommu_ioas *ioas)
 
 		iova_ranges.allowed_iovas = (uintptr_t)ioas->ctx.iova_ranges;
 
-		if (ioctl(__iommufd, IOMMU_IOAS_IOVA_RANGES, &iova_ranges)) {
+		if (ioctl(ioas->fd, IOMMU_IOAS_IOVA_RANGES, &iova_ranges)) {
 			log_debug("could not get ioas iova ranges\n");
 			return -1;
 		}
@@ -95,6 +108,76 @@ static int iommu_ioas_update_iova_ranges(struct iommu_ioas *ioas)
 	return 0;
 }
 
+#ifdef HAVE_IOMMU_HWPT_GET_DIRTY_BITMAP
+/*
+ * Devices are attached to a hardware pagetable allocated with dirty tracking
+ * support, if the iommu has that. Otherwise, they are attached to the ioas and
+ * the kernel picks the pagetable.
+ */
+static uint32_t iommufd_get_pt_id(struct iommu_ioas *ioas, uint32_t dev_id)
+{
+	struct iommu_hwpt_alloc alloc = {
+		.size = sizeof(alloc),
+		.flags = IOMMU_HWPT_ALLOC_DIRTY_TRACKING,
+		.dev_id = dev_id,
+		.pt_id = ioas->id,
+	};
+
+	if (ioas->hwpt_id)
+		return ioas->hwpt_id;
+
+	if (ioas->untracked)
+		return ioas->id;
+
+	if (ioctl(ioas->fd, IOMMU_HWPT_ALLOC, &alloc)) {
+		log_info("could not allocate dirty tracking hwpt; attaching to ioas\n");
+
+		ioas->untracked = true;
+
+		return ioas->id;
+	}
+
+	ioas->hwpt_id = alloc.out_hwpt_id;
+
+	return ioas->hwpt_id;
+}
+
+static int iommufd_attach(struct iommu_ioas *ioas, int devfd, uint32_t dev_id)
+{
+	struct vfio_device_attach_iommufd_pt attach_data = {
+		.argsz = sizeof(attach_data),
+		.flags = 0,
+		.pt_id = iommufd_get_pt_id(ioas, dev_id),
+	};
+
+	if (!ioctl(devfd, VFIO_DEVICE_ATTACH_IOMMUFD_PT, &attach_data))
+		return 0;
+
+	if (attach_data.pt_id == ioas->id)
+		return -1;
+
+	/* the device may be behind an iommu that is incompatible with the hwpt */
+	log_info("could not attach device to dirty tracking hwpt; attaching to ioas\n");
+
+	ioas->untracked = true;
+
+	attach_data.pt_id = ioas->id;
+
+	return ioctl(devfd, VFIO_DEVICE_ATTACH_IOMMUFD_PT, &attach_data);
+}
+#else
+static int iommufd_attach(struct iommu_ioas *ioas, int devfd, uint32_t dev_id UNUSED)
+{
+	struct vfio_device_attach_iommufd_pt attach_data = {
+		.argsz = sizeof(attach_data),
+		.flags = 0,
+		.pt_id = ioas->id,
+	};
+
+	return ioctl(devfd, VFIO_DEVICE_ATTACH_IOMMUFD_PT, &attach_data);
+}
+#endif
+
 static int iommufd_get_device_fd(struct iommu_ctx *ctx, const char *bdf)
 {
 	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
@@ -106,13 +189,7 @@ static int iommufd_get_device_fd(struct iommu_ctx *ctx, const char *bdf)
 	struct vfio_device_bind_iommufd bind = {
 		.argsz = sizeof(bind),
 		.flags = 0,
-		.iommufd = __iommufd,
-	};
-
-	struct vfio_device_attach_iommufd_pt attach_data = {
-		.argsz = sizeof(attach_data),
-		.flags = 0,
-		.pt_id = ioas->id,
+		.iommufd = ioas->fd,
 	};
 
 	vfio_id = pci_get_device_vfio_id(bdf);
@@ -137,7 +214,7 @@ static int iommufd_get_device_fd(struct iommu_ctx *ctx, const char *bdf)
 		goto close_dev;
 	}
 
-	if (ioctl(devfd, VFIO_DEVICE_ATTACH_IOMMUFD_PT, &attach_data)) {
+	if (iommufd_attach(ioas, devfd, bind.out_devid)) {
 		log_debug("could not associate device with ioas\n");
 		goto close_dev;
 	}
@@ -160,6 +237,7 @@ static int iommu_ioas_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_t len,
 				 unsigned long flags)
 {
 	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+	uint64_t start, nsecs;
 
 	struct iommu_ioas_map map = {
 		.size = sizeof(map),
@@ -180,6 +258,9 @@ static int iommu_ioas_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_t len,
 	if (flags & IOMMU_MAP_NOREAD)
 		map.flags &= ~IOMMU_IOAS_MAP_READABLE;
 
+	/* the iova is zero if it is to be allocated */
+	trace_probe(IOMMUFD_IOAS_MAP_DMA, vaddr, map.iova, len);
+
 	trace_guard(IOMMUFD_IOAS_MAP_DMA) {
 		if (flags & IOMMU_MAP_FIXED_IOVA)
 			trace_emit("vaddr %p iova 0x%" PRIx64 " len %zu\n", vaddr, *iova, len);
@@ -187,11 +268,23 @@ static int iommu_ioas_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_t len,
 			trace_emit("vaddr %p iova AUTO len %zu\n", vaddr, len);
 	}
 
-	if (ioctl(__iommufd, IOMMU_IOAS_MAP, &map)) {
+	start = get_ticks();
+
+	if (ioctl(ioas->fd, IOMMU_IOAS_MAP, &map)) {
 		log_debug("failed to map\n");
 		return -1;
 	}
 
+	nsecs = ticks_to_ns(get_ticks() - start);
+	iommu_ctx_account_map(ctx, len, nsecs);
+
+	trace_probe(IOMMUFD_IOAS_MAP_DMA_DONE, (uint64_t)map.iova, len, nsecs);
+
+	trace_guard(IOMMUFD_IOAS_MAP_DMA_DONE) {
+		trace_emit("iova 0x%" PRIx64 " len %zu in %" PRIu64 " ns\n", (uint64_t)map.iova,
+			   len, nsecs);
+	}
+
 	if (flags & IOMMU_MAP_FIXED_IOVA)
 		return 0;
 
@@ -215,11 +308,13 @@ static int iommu_ioas_do_dma_unmap(struct iommu_ctx *ctx, uint64_t iova, size_t
 		.length = len
 	};
 
+	trace_probe(IOMMUFD_IOAS_UNMAP_DMA, iova, len);
+
 	trace_guard(IOMMUFD_IOAS_UNMAP_DMA) {
 		trace_emit("iova 0x%" PRIx64 " len %zu\n", iova, len);
 	}
 
-	if (ioctl(__iommufd, IOMMU_IOAS_UNMAP, &unmap)) {
+	if (ioctl(ioas->fd, IOMMU_IOAS_UNMAP, &unmap)) {
 		log_debug("failed to unmap\n");
 		return -1;
 	}
@@ -227,17 +322,181 @@ static int iommu_ioas_do_dma_unmap(struct iommu_ctx *ctx, uint64_t iova, size_t
 	return 0;
 }
 
+#ifdef HAVE_IOMMU_IOAS_MAP_FILE
+static int iommu_ioas_do_dma_map_file(struct iommu_ctx *ctx, int fd, uint64_t offset, size_t len,
+				      uint64_t *iova, unsigned long flags)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+	uint64_t start, nsecs;
+
+	struct iommu_ioas_map_file map = {
+		.size = sizeof(map),
+		.flags = IOMMU_IOAS_MAP_READABLE | IOMMU_IOAS_MAP_WRITEABLE,
+		.ioas_id = ioas->id,
+		.fd = fd,
+		.start = offset,
+		.length = len,
+	};
+
+	if (flags & IOMMU_MAP_FIXED_IOVA) {
+		map.flags |= IOMMU_IOAS_MAP_FIXED_IOVA;
+		map.iova = *iova;
+	}
+
+	if (flags & IOMMU_MAP_NOWRITE)
+		map.flags &= ~IOMMU_IOAS_MAP_WRITEABLE;
+
+	if (flags & IOMMU_MAP_NOREAD)
+		map.flags &= ~IOMMU_IOAS_MAP_READABLE;
+
+	start = get_ticks();
+
+	if (ioctl(ioas->fd, IOMMU_IOAS_MAP_FILE, &map)) {
+		log_debug("failed to map file\n");
+		return -1;
+	}
+
+	nsecs = ticks_to_ns(get_ticks() - start);
+	iommu_ctx_account_map(ctx, len, nsecs);
+
+	trace_probe(IOMMUFD_IOAS_MAP_DMA_DONE, (uint64_t)map.iova, len, nsecs);
+
+	trace_guard(IOMMUFD_IOAS_MAP_DMA_DONE) {
+		trace_emit("fd %d iova 0x%" PRIx64 " len %zu in %" PRIu64 " ns\n", fd,
+			   (uint64_t)map.iova, len, nsecs);
+	}
+
+	if (!(flags & IOMMU_MAP_FIXED_IOVA))
+		*iova = map.iova;
+
+	return 0;
+}
+#endif
+
 static int iommu_ioas_do_dma_unmap_all(struct iommu_ctx *ctx)
 {
 	return iommu_ioas_do_dma_unmap(ctx, 0, UINT64_MAX);
 }
 
+#ifdef HAVE_IOMMU_HWPT_GET_DIRTY_BITMAP
+static int iommufd_set_dirty_tracking(struct iommu_ctx *ctx, bool enable)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+
+	struct iommu_hwpt_set_dirty_tracking set = {
+		.size = sizeof(set),
+		.flags = enable ? IOMMU_HWPT_DIRTY_TRACKING_ENABLE : 0,
+		.hwpt_id = ioas->hwpt_id,
+	};
+
+	if (!ioas->hwpt_id || ioas->untracked) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (ioctl(ioas->fd, IOMMU_HWPT_SET_DIRTY_TRACKING, &set)) {
+		log_debug("could not set dirty tracking\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int iommufd_get_dirty_bitmap(struct iommu_ctx *ctx, uint64_t iova, size_t len,
+				    uint64_t *bitmap, unsigned long flags)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+
+	struct iommu_hwpt_get_dirty_bitmap get = {
+		.size = sizeof(get),
+		.hwpt_id = ioas->hwpt_id,
+		.iova = iova,
+		.length = len,
+		.page_size = __VFN_PAGESIZE,
+		.data = (uintptr_t)bitmap,
+	};
+
+	if (!ioas->hwpt_id || ioas->untracked) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (flags & IOMMU_DIRTY_NO_CLEAR)
+		get.flags |= IOMMU_HWPT_GET_DIRTY_BITMAP_NO_CLEAR;
+
+	if (ioctl(ioas->fd, IOMMU_HWPT_GET_DIRTY_BITMAP, &get)) {
+		log_debug("could not get dirty bitmap\n");
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/* sent along with the iommufd and the mapping table (in that order) */
+struct iommufd_export_msg {
+	uint32_t magic;
+	uint32_t ioas_id;
+};
+
+#define IOMMUFD_EXPORT_MAGIC 0x76666e69 /* "vfni" */
+
+static int iommufd_export_context(struct iommu_ctx *ctx, int sockfd)
+{
+	struct iommu_ioas *ioas = container_of_var(ctx, ioas, ctx);
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} u = {};
+	struct iommufd_export_msg msg = {
+		.magic = IOMMUFD_EXPORT_MAGIC,
+		.ioas_id = ioas->id,
+	};
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg), };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	int fds[2] = { ioas->fd, -1 };
+
+	if (iova_map_export(&ctx->map, &fds[1])) {
+		log_debug("could not export mapping table\n");
+		return -1;
+	}
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sockfd, &mh, 0) != sizeof(msg)) {
+		log_debug("could not send context\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static const struct iommu_ctx_ops iommufd_ops = {
 	.get_device_fd = iommufd_get_device_fd,
 
 	.dma_map = iommu_ioas_do_dma_map,
 	.dma_unmap = iommu_ioas_do_dma_unmap,
 	.dma_unmap_all = iommu_ioas_do_dma_unmap_all,
+
+#ifdef HAVE_IOMMU_IOAS_MAP_FILE
+	.dma_map_file = iommu_ioas_do_dma_map_file,
+#endif
+
+	.export_context = iommufd_export_context,
+
+#ifdef HAVE_IOMMU_HWPT_GET_DIRTY_BITMAP
+	.set_dirty_tracking = iommufd_set_dirty_tracking,
+	.get_dirty_bitmap = iommufd_get_dirty_bitmap,
+#endif
 };
 
 static int iommu_ioas_init(struct iommu_ioas *ioas)
@@ -247,7 +506,9 @@ static int iommu_ioas_init(struct iommu_ioas *ioas)
 		.flags = 0,
 	};
 
-	if (ioctl(__iommufd, IOMMU_IOAS_ALLOC, &alloc_data)) {
+	ioas->fd = __iommufd;
+
+	if (ioctl(ioas->fd, IOMMU_IOAS_ALLOC, &alloc_data)) {
 		log_debug("could not allocate ioas\n");
 		return -1;
 	}
@@ -278,6 +539,7 @@ struct iommu_ctx *iommufd_get_iommu_context(const char *name)
 		log_fatal_if(iommufd_open(), "could not open /dev/iommu\n");
 
 	if (iommu_ioas_init(ioas) < 0) {
+		iommu_ctx_fini(&ioas->ctx);
 		free(ioas);
 		return NULL;
 	}
@@ -298,3 +560,84 @@ struct iommu_ctx *iommufd_get_default_iommu_context(void)
 
 	return &iommufd_default_ioas.ctx;
 }
+
+struct iommu_ctx *iommufd_import_context(int sockfd)
+{
+	union {
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr align;
+	} u = {};
+	struct iommufd_export_msg msg;
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg), };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct iommu_ioas *ioas;
+	struct cmsghdr *cmsg;
+	int fds[2];
+
+	if (recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC) != sizeof(msg)) {
+		log_debug("could not receive context\n");
+		return NULL;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		log_debug("no file descriptors received\n");
+
+		errno = EPROTO;
+		return NULL;
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if (msg.magic != IOMMUFD_EXPORT_MAGIC) {
+		log_debug("bad context magic\n");
+
+		errno = EPROTO;
+		goto close_fds;
+	}
+
+	ioas = znew_t(struct iommu_ioas, 1);
+
+	iommu_ctx_init(&ioas->ctx);
+
+	ioas->fd = fds[0];
+	ioas->id = msg.ioas_id;
+	ioas->name = strdup("imported");
+
+	memcpy(&ioas->ctx.ops, &iommufd_ops, sizeof(ioas->ctx.ops));
+
+	/* the ioas is shared; only ever unmap what was mapped by this process */
+	ioas->ctx.ops.dma_unmap_all = NULL;
+
+	ioas->ctx.map.imported = iova_shared_open(fds[1]);
+	if (!ioas->ctx.map.imported) {
+		log_debug("could not open mapping table\n");
+		goto free_ioas;
+	}
+
+	/* the mapping stays valid */
+	log_fatal_if(close(fds[1]), "close: %s\n", strerror(errno));
+
+	/* not fatal; the ioas allocates iovas */
+	if (iommu_ioas_update_iova_ranges(ioas))
+		log_debug("could not update iova ranges\n");
+
+	return &ioas->ctx;
+
+free_ioas:
+	iommu_ctx_fini(&ioas->ctx);
+	free(ioas->name);
+	free(ioas);
+
+close_fds:
+	log_fatal_if(close(fds[0]), "close: %s\n", strerror(errno));
+	log_fatal_if(close(fds[1]), "close: %s\n", strerror(errno));
+
+	return NULL;
+}
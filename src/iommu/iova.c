@@ -0,0 +1,412 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/iova: " fmt
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/container_of/container_of.h"
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+#include "support/slab.h"
+
+#include "iova.h"
+
+#define IOVA_MAG_SLOTS 4
+
+struct iova_magazine {
+	struct iova_allocator *owner;
+
+	unsigned int n[IOVA_MAG_CLASSES];
+	uint64_t iovas[IOVA_MAG_CLASSES][IOVA_MAG_SIZE];
+};
+
+/* a thread caches blocks for a few allocators at a time */
+struct iova_magazines {
+	struct iova_magazine mags[IOVA_MAG_SLOTS];
+};
+
+static __thread struct iova_magazines *iova_mags;
+
+static pthread_key_t iova_mags_key;
+static pthread_once_t iova_mags_once = PTHREAD_ONCE_INIT;
+
+#define IOVA_MAX_PAGES (1ULL << (IOVA_NCLASSES - 1))
+
+static inline uint64_t __pages_to_len(uint64_t npages)
+{
+	return npages << __VFN_PAGESHIFT;
+}
+
+/* the smallest class that holds @npages */
+static inline int __class(uint64_t npages)
+{
+	return npages == 1 ? 0 : 64 - __builtin_clzll(npages - 1);
+}
+
+struct iova_block {
+	uint64_t iova;
+
+	struct skiplist_node list;
+};
+
+static struct slab iova_block_slab = SLAB_INIT(struct iova_block);
+
+static int __cmp_block(const void *key, const struct skiplist_node *n)
+{
+	struct iova_block *b = container_of_var(n, b, list);
+	const uint64_t *iova = key;
+
+	if (*iova < b->iova)
+		return -1;
+	else if (*iova > b->iova)
+		return 1;
+
+	return 0;
+}
+
+static void __insert_block(struct iova_allocator *a, uint64_t iova, int k)
+{
+	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
+	struct iova_block *b = slab_alloc(&iova_block_slab);
+
+	b->iova = iova;
+
+	skiplist_find(&a->free[k], &iova, __cmp_block, update);
+	skiplist_link(&a->free[k], &b->list, update);
+}
+
+/* remove the free block at @iova of class @k (if there is one) */
+static bool __remove_block(struct iova_allocator *a, uint64_t iova, int k)
+{
+	struct skiplist_node *update[SKIPLIST_LEVELS] = {};
+	struct skiplist_node *n;
+
+	n = skiplist_find(&a->free[k], &iova, __cmp_block, update);
+	if (!n)
+		return false;
+
+	skiplist_erase(&a->free[k], n, update);
+	slab_free(&iova_block_slab, container_of(n, struct iova_block, list));
+
+	return true;
+}
+
+static bool __take_block(struct iova_allocator *a, int k, uint64_t *iova)
+{
+	struct skiplist_node *n = skiplist_next(&a->free[k], &a->free[k].sentinel, 0);
+
+	if (!n)
+		return false;
+
+	*iova = container_of(n, struct iova_block, list)->iova;
+
+	return __remove_block(a, *iova, k);
+}
+
+/* put a block back, merging it with its buddy as long as that is free */
+static void __free_block(struct iova_allocator *a, uint64_t iova, int k)
+{
+	while (k < IOVA_NCLASSES - 1) {
+		uint64_t buddy = iova ^ __pages_to_len(1ULL << k);
+
+		if (!__remove_block(a, buddy, k))
+			break;
+
+		iova = min(iova, buddy);
+		k++;
+	}
+
+	__insert_block(a, iova, k);
+}
+
+/* put @npages back as naturally aligned power-of-two blocks */
+static void __release_locked(struct iova_allocator *a, uint64_t iova, uint64_t npages)
+{
+	while (npages) {
+		uint64_t pfn = iova >> __VFN_PAGESHIFT;
+		int k = 63 - __builtin_clzll(npages);
+
+		if (pfn)
+			k = min(k, __builtin_ctzll(pfn));
+
+		k = min(k, IOVA_NCLASSES - 1);
+
+		__free_block(a, iova, k);
+
+		iova += __pages_to_len(1ULL << k);
+		npages -= 1ULL << k;
+	}
+}
+
+/* take a naturally aligned block of never allocated iova space */
+static bool __bump(struct iova_allocator *a, uint64_t npages, uint64_t *iova)
+{
+	uint64_t len = __pages_to_len(npages), next = a->next;
+	uint64_t align = __pages_to_len(1ULL << min(__class(npages), IOVA_NCLASSES - 1));
+
+	for (int i = 0; i < a->nranges; i++) {
+		struct iommu_iova_range *r = &a->ranges[i];
+		uint64_t start;
+
+		if (r->last < next)
+			continue;
+
+		next = max_t(uint64_t, next, r->start);
+		start = ALIGN_UP(next, align);
+
+		if (start < next || start > r->last || r->last - start + 1 < len) {
+			uint64_t rest = r->last - next + 1;
+
+			/* if not much is left of the range, free it for smaller blocks */
+			if (r->last != UINT64_MAX && rest < __pages_to_len(IOVA_MAX_PAGES)) {
+				__release_locked(a, next, rest >> __VFN_PAGESHIFT);
+				a->next = r->last + 1;
+			}
+
+			continue;
+		}
+
+		/* as is the padding */
+		__release_locked(a, next, (start - next) >> __VFN_PAGESHIFT);
+
+		*iova = start;
+		a->next = start + len;
+
+		return true;
+	}
+
+	return false;
+}
+
+static bool __alloc_locked(struct iova_allocator *a, uint64_t npages, uint64_t *iova)
+{
+	int c = __class(npages);
+
+	for (int k = c; k < IOVA_NCLASSES; k++) {
+		uint64_t b;
+
+		if (!__take_block(a, k, &b))
+			continue;
+
+		/* split off the upper halves until the block is of class c */
+		for (int j = k - 1; j >= c; j--)
+			__insert_block(a, b + __pages_to_len(1ULL << j), j);
+
+		if (npages < 1ULL << c)
+			__release_locked(a, b + __pages_to_len(npages), (1ULL << c) - npages);
+
+		*iova = b;
+
+		return true;
+	}
+
+	return __bump(a, npages, iova);
+}
+
+static void __mag_flush(struct iova_magazine *m, int c, unsigned int keep)
+{
+	struct iova_allocator *a = m->owner;
+
+	__autolock(&a->lock);
+
+	while (m->n[c] > keep)
+		__free_block(a, m->iovas[c][--m->n[c]], c);
+}
+
+static void __mag_flush_all(struct iova_magazine *m)
+{
+	for (int c = 0; c < IOVA_MAG_CLASSES; c++)
+		__mag_flush(m, c, 0);
+
+	m->owner = NULL;
+}
+
+static void iova_mags_destroy(void *opaque)
+{
+	struct iova_magazines *mags = opaque;
+
+	for (int i = 0; i < IOVA_MAG_SLOTS; i++) {
+		if (mags->mags[i].owner)
+			__mag_flush_all(&mags->mags[i]);
+	}
+
+	free(mags);
+}
+
+static void iova_mags_init_key(void)
+{
+	if (pthread_key_create(&iova_mags_key, iova_mags_destroy))
+		backtrace_abort();
+}
+
+static struct iova_magazine *__mag(struct iova_allocator *a)
+{
+	struct iova_magazine *m;
+
+	if (!iova_mags) {
+		pthread_once(&iova_mags_once, iova_mags_init_key);
+
+		iova_mags = znew_t(struct iova_magazines, 1);
+		pthread_setspecific(iova_mags_key, iova_mags);
+	}
+
+	for (int i = 0; i < IOVA_MAG_SLOTS; i++) {
+		if (iova_mags->mags[i].owner == a)
+			return &iova_mags->mags[i];
+	}
+
+	for (int i = 0; i < IOVA_MAG_SLOTS; i++) {
+		m = &iova_mags->mags[i];
+
+		if (!m->owner)
+			goto out;
+	}
+
+	/* evict another allocator */
+	m = &iova_mags->mags[((uintptr_t)a >> 6) % IOVA_MAG_SLOTS];
+	__mag_flush_all(m);
+
+out:
+	m->owner = a;
+
+	return m;
+}
+
+void iova_allocator_init(struct iova_allocator *a, struct iommu_iova_range *ranges, int nranges,
+			 bool cache)
+{
+	pthread_mutex_init(&a->lock, NULL);
+
+	for (int k = 0; k < IOVA_NCLASSES; k++)
+		skiplist_init(&a->free[k]);
+
+	a->ranges = ranges;
+	a->nranges = nranges;
+	a->next = 0;
+	a->cache = cache;
+}
+
+static void __destroy_block(void *opaque UNUSED, struct skiplist_node *n)
+{
+	slab_free(&iova_block_slab, container_of(n, struct iova_block, list));
+}
+
+/* only for allocators without magazines */
+void iova_allocator_destroy(struct iova_allocator *a)
+{
+	assert(!a->cache);
+
+	for (int k = 0; k < IOVA_NCLASSES; k++)
+		skiplist_clear_with(&a->free[k], __destroy_block, NULL);
+
+	pthread_mutex_destroy(&a->lock);
+}
+
+int iova_alloc(struct iova_allocator *a, size_t len, uint64_t *iova)
+{
+	uint64_t npages = len >> __VFN_PAGESHIFT;
+	int c = __class(npages);
+	bool ok;
+
+	if (!len || !ALIGNED(len, __VFN_PAGESIZE)) {
+		log_debug("len is not page aligned\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (a->cache && c < IOVA_MAG_CLASSES) {
+		struct iova_magazine *m = __mag(a);
+
+		if (!m->n[c]) {
+			__autolock(&a->lock);
+
+			while (m->n[c] < IOVA_MAG_SIZE / 2 &&
+			       __take_block(a, c, &m->iovas[c][m->n[c]]))
+				m->n[c]++;
+		}
+
+		if (m->n[c]) {
+			*iova = m->iovas[c][--m->n[c]];
+
+			if (npages < 1ULL << c)
+				iova_release(a, *iova + len, __pages_to_len((1ULL << c) - npages));
+
+			return 0;
+		}
+	}
+
+	pthread_mutex_lock(&a->lock);
+	ok = __alloc_locked(a, npages, iova);
+	pthread_mutex_unlock(&a->lock);
+
+	/* blocks cached by this thread may be split */
+	if (!ok && a->cache && iova_mags) {
+		for (int i = 0; i < IOVA_MAG_SLOTS; i++) {
+			struct iova_magazine *m = &iova_mags->mags[i];
+
+			if (m->owner == a) {
+				__mag_flush_all(m);
+
+				pthread_mutex_lock(&a->lock);
+				ok = __alloc_locked(a, npages, iova);
+				pthread_mutex_unlock(&a->lock);
+
+				break;
+			}
+		}
+	}
+
+	if (!ok) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+void iova_release(struct iova_allocator *a, uint64_t iova, size_t len)
+{
+	uint64_t npages = len >> __VFN_PAGESHIFT;
+	int c = __class(npages);
+
+	if (!npages)
+		return;
+
+	if (a->cache && c < IOVA_MAG_CLASSES && npages == 1ULL << c) {
+		struct iova_magazine *m = __mag(a);
+
+		if (m->n[c] == IOVA_MAG_SIZE)
+			__mag_flush(m, c, IOVA_MAG_SIZE / 2);
+
+		m->iovas[c][m->n[c]++] = iova;
+
+		return;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	__release_locked(a, iova, npages);
+	pthread_mutex_unlock(&a->lock);
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include "util/skiplist.h"
+
+/*
+ * Recycling iova allocator.
+ *
+ * A buddy allocator over naturally aligned power-of-two sized blocks (in
+ * pages). Released blocks are merged with their buddy if it is free. Space
+ * that has never been handed out is not on the free lists; it is taken from
+ * the ranges given at initialization when no free block is large enough.
+ *
+ * If enabled, small blocks (of the IOVA_MAG_CLASSES smallest classes) are
+ * cached in per-thread magazines such that allocating and releasing them does
+ * not take the lock in the common case. Since cached blocks are not available
+ * to other threads, this is not suitable for small ranges. Allocators must not
+ * be destroyed while threads remain that have used them.
+ */
+
+/* 4k up to 1g blocks (with 4k pages) */
+#define IOVA_NCLASSES 19
+
+/* magazines cache blocks of up to 16 pages */
+#define IOVA_MAG_CLASSES 5
+#define IOVA_MAG_SIZE 32
+
+struct iova_allocator {
+	pthread_mutex_t lock;
+
+	struct iommu_iova_range *ranges;
+	int nranges;
+
+	/* next never allocated iova */
+	uint64_t next;
+
+	/* use per-thread magazines */
+	bool cache;
+
+	/* free blocks of each class, ordered by iova */
+	struct skiplist free[IOVA_NCLASSES];
+};
+
+void iova_allocator_init(struct iova_allocator *a, struct iommu_iova_range *ranges, int nranges,
+			 bool cache);
+void iova_allocator_destroy(struct iova_allocator *a);
+int iova_alloc(struct iova_allocator *a, size_t len, uint64_t *iova);
+void iova_release(struct iova_allocator *a, uint64_t iova, size_t len);
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ccan/tap/tap.h"
+
+#include "vfn/iommu.h"
+#include "vfn/support.h"
+
+#include "iova.h"
+
+#define PG(n) ((uint64_t)(n) << __VFN_PAGESHIFT)
+
+/* 16 and 1024 pages (the page size is only known at runtime) */
+static struct iommu_iova_range ranges[2];
+
+static struct iova_allocator a;
+
+static void *churn_thread(void *opaque)
+{
+	bool *ok = opaque;
+	uint64_t iova;
+
+	/* would exhaust the ranges many times over without recycling */
+	for (int i = 0; i < 10000; i++) {
+		if (iova_alloc(&a, PG(1 + i % 5), &iova)) {
+			*ok = false;
+			return NULL;
+		}
+
+		iova_release(&a, iova, PG(1 + i % 5));
+	}
+
+	*ok = true;
+
+	return NULL;
+}
+
+int main(void)
+{
+	uint64_t iova, iova2, iova3;
+	struct iova_allocator b;
+	pthread_t threads[4];
+	bool ok[4];
+
+	plan_tests(12);
+
+	ranges[0] = (struct iommu_iova_range) { .start = PG(16), .last = PG(32) - 1 };
+	ranges[1] = (struct iommu_iova_range) { .start = PG(1024), .last = PG(2048) - 1 };
+
+	iova_allocator_init(&a, ranges, 2, false);
+
+	/* fresh space is taken in order */
+	ok1(iova_alloc(&a, PG(4), &iova) == 0 && iova == PG(16));
+	ok1(iova_alloc(&a, PG(16), &iova2) == 0 && iova2 == PG(1024));
+
+	ok1(iova_alloc(&a, 0x800, &iova3) == -1 && errno == EINVAL);
+
+	/* released space is merged and reused */
+	iova_release(&a, iova, PG(4));
+	ok1(iova_alloc(&a, PG(16), &iova) == 0 && iova == PG(16));
+
+	/* larger blocks are split */
+	iova_release(&a, iova, PG(16));
+	ok1(iova_alloc(&a, PG(8), &iova) == 0 && iova == PG(16));
+	ok1(iova_alloc(&a, PG(8), &iova3) == 0 && iova3 == PG(24));
+
+	/* the tail of a rounded up block is not lost */
+	iova_release(&a, iova, PG(8));
+	iova_release(&a, iova3, PG(8));
+	ok1(iova_alloc(&a, PG(3), &iova) == 0 && iova == PG(16));
+	ok1(iova_alloc(&a, PG(1), &iova3) == 0 && iova3 == PG(19));
+
+	ok1(iova_alloc(&a, PG(2048), &iova3) == -1 && errno == ENOMEM);
+
+	/* cached blocks are reused by the thread */
+	memset(&b, 0x0, sizeof(b));
+	iova_allocator_init(&b, ranges, 1, true);
+
+	ok1(iova_alloc(&b, PG(8), &iova) == 0 && iova_alloc(&b, PG(8), &iova2) == 0);
+	iova_release(&b, iova, PG(8));
+	iova_release(&b, iova2, PG(8));
+
+	/* and merged when the range is otherwise exhausted */
+	ok1(iova_alloc(&b, PG(16), &iova3) == 0 && iova3 == PG(16));
+
+	memset(&a, 0x0, sizeof(a));
+	iova_allocator_init(&a, ranges, 2, true);
+
+	for (int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, churn_thread, &ok[i]);
+
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+
+	ok1(ok[0] && ok[1] && ok[2] && ok[3]);
+
+	return exit_status();
+}
@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/pagemap: " fmt
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/support.h"
+
+#include "pagemap.h"
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_PFN_MASK ((1ULL << 55) - 1)
+
+/* entries read at a time; a 2M hugepage worth of 4k pages */
+#define PAGEMAP_BATCH 512
+
+static int __pagemap_fd = -1;
+
+static int __pagemap_open(void)
+{
+	int fd = atomic_load_acquire(&__pagemap_fd), unset = -1;
+
+	if (fd >= 0)
+		return fd;
+
+	fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_debug("could not open pagemap: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* lost the race; use the descriptor of the winner */
+	if (!atomic_cmpxchg(&__pagemap_fd, unset, fd)) {
+		log_fatal_if(close(fd), "close: %s\n", strerror(errno));
+		fd = unset;
+	}
+
+	return fd;
+}
+
+int pagemap_translate(void *vaddr, size_t len, uint64_t *pa)
+{
+	uint64_t entries[PAGEMAP_BATCH], pfn0 = 0;
+	size_t pgsize = (size_t)sysconf(_SC_PAGESIZE);
+	uint64_t first, last, pg;
+	int fd;
+
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = __pagemap_open();
+	if (fd < 0)
+		return -1;
+
+	first = (uintptr_t)vaddr / pgsize;
+	last = ((uintptr_t)vaddr + len - 1) / pgsize;
+
+	for (pg = first; pg <= last; ) {
+		size_t n = (size_t)min_t(uint64_t, last - pg + 1, PAGEMAP_BATCH);
+		ssize_t ret;
+
+		ret = pread(fd, entries, n * sizeof(uint64_t), (off_t)(pg * sizeof(uint64_t)));
+		if (ret != (ssize_t)(n * sizeof(uint64_t))) {
+			log_debug("could not read pagemap\n");
+
+			if (ret >= 0)
+				errno = EIO;
+
+			return -1;
+		}
+
+		for (size_t i = 0; i < n; i++, pg++) {
+			uint64_t pfn = entries[i] & PAGEMAP_PFN_MASK;
+
+			if (!(entries[i] & PAGEMAP_PRESENT)) {
+				log_debug("page at 0x%" PRIx64 " not present\n", pg * pgsize);
+
+				errno = EFAULT;
+				return -1;
+			}
+
+			if (!pfn) {
+				log_debug("page frame numbers hidden; requires CAP_SYS_ADMIN\n");
+
+				errno = EPERM;
+				return -1;
+			}
+
+			if (pg == first) {
+				pfn0 = pfn;
+			} else if (pfn != pfn0 + (pg - first)) {
+				log_debug("%p (len %zu) not physically contiguous\n", vaddr, len);
+
+				errno = EINVAL;
+				return -1;
+			}
+		}
+	}
+
+	*pa = pfn0 * pgsize + (uintptr_t)vaddr % pgsize;
+
+	return 0;
+}
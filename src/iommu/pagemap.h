@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Physical address translation through /proc/self/pagemap.
+ *
+ * Used by the no-iommu vfio backend, where devices are given physical
+ * addresses. Reading page frame numbers requires CAP_SYS_ADMIN; without it, the
+ * kernel reports them as zero and translation fails with EPERM.
+ */
+
+/*
+ * Translate @vaddr to a physical address. The @len bytes at @vaddr must be
+ * resident (e.g., locked with mlock()) and physically contiguous, which holds
+ * within a hugepage; fails with EFAULT or EINVAL otherwise.
+ */
+int pagemap_translate(void *vaddr, size_t len, uint64_t *pa);
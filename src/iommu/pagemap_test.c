@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "ccan/tap/tap.h"
+
+#include "vfn/support.h"
+
+#include "pagemap.h"
+
+int main(void)
+{
+	uint64_t pa, pa2;
+	void *mem;
+	ssize_t len;
+
+	plan_tests(6);
+
+	len = pgmap(&mem, 2 * __VFN_PAGESIZE);
+	assert(len > 0);
+
+	/* not faulted in yet */
+	ok1(pagemap_translate(mem, 8, &pa) == -1 && errno == EFAULT);
+	ok1(pagemap_translate(mem, 0, &pa) == -1 && errno == EINVAL);
+
+	assert(mlock(mem, (size_t)len) == 0);
+
+	if (pagemap_translate(mem, 8, &pa) && errno == EPERM) {
+		skip(4, "page frame numbers are hidden (requires CAP_SYS_ADMIN)");
+		return exit_status();
+	}
+
+	/* offsets within the page are kept */
+	ok1(pagemap_translate(mem + 0x123, 8, &pa2) == 0 && pa2 == pa + 0x123 &&
+	    !(pa & (__VFN_PAGESIZE - 1)));
+
+	/* a translation must not span physically discontiguous pages */
+	ok1(pagemap_translate(mem + __VFN_PAGESIZE, 8, &pa2) == 0 &&
+	    (pa2 == pa + __VFN_PAGESIZE ||
+	     (pagemap_translate(mem, (size_t)len, &pa2) == -1 && errno == EINVAL)));
+
+	pgunmap(mem, (size_t)len);
+
+	/* a hugepage is physically contiguous */
+	len = 1LL << 21;
+	mem = mmap(NULL, (size_t)len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		skip(2, "no hugetlb pages");
+		return exit_status();
+	}
+
+	if (mlock(mem, (size_t)len)) {
+		skip(2, "could not fault in hugetlb page");
+
+		pgunmap(mem, (size_t)len);
+		return exit_status();
+	}
+
+	ok1(pagemap_translate(mem, (size_t)len, &pa) == 0 && !(pa & ((1ULL << 21) - 1)));
+	ok1(pagemap_translate(mem + (1 << 20), 4096, &pa2) == 0 && pa2 == pa + (1 << 20));
+
+	pgunmap(mem, (size_t)len);
+
+	return exit_status();
+}
@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "iommu/shared: " fmt
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/support.h"
+
+#include "shared.h"
+
+/* index of the first entry with a vaddr above @vaddr */
+static uint32_t __upper_bound(const struct iova_shared_table *t, uint32_t n, uint64_t vaddr)
+{
+	uint32_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (__atomic_load_n(&t->entries[mid].vaddr, __ATOMIC_RELAXED) <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void __write_begin(struct iova_shared_table *t)
+{
+	__atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void __write_end(struct iova_shared_table *t)
+{
+	__atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+}
+
+struct iova_shared_table *iova_shared_create(int *fd)
+{
+	struct iova_shared_table *t;
+
+	*fd = memfd_create("vfn-iova-map", MFD_CLOEXEC);
+	if (*fd < 0) {
+		log_debug("could not create memfd\n");
+		return NULL;
+	}
+
+	if (ftruncate(*fd, sizeof(*t))) {
+		log_debug("could not size memfd\n");
+		goto close_fd;
+	}
+
+	t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (t == MAP_FAILED) {
+		log_debug("could not map memfd\n");
+		goto close_fd;
+	}
+
+	t->magic = IOVA_SHARED_MAGIC;
+
+	return t;
+
+close_fd:
+	log_fatal_if(close(*fd), "close: %s\n", strerror(errno));
+
+	return NULL;
+}
+
+const struct iova_shared_table *iova_shared_open(int fd)
+{
+	struct iova_shared_table *t;
+	struct stat sb;
+
+	if (fstat(fd, &sb)) {
+		log_debug("could not stat table\n");
+		return NULL;
+	}
+
+	if ((size_t)sb.st_size < sizeof(*t)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	t = mmap(NULL, sizeof(*t), PROT_READ, MAP_SHARED, fd, 0);
+	if (t == MAP_FAILED) {
+		log_debug("could not map table\n");
+		return NULL;
+	}
+
+	if (t->magic != IOVA_SHARED_MAGIC) {
+		log_debug("bad table magic\n");
+
+		munmap(t, sizeof(*t));
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return t;
+}
+
+int iova_shared_insert(struct iova_shared_table *t, void *vaddr, size_t len, uint64_t iova)
+{
+	uint32_t i;
+
+	if (t->n == IOVA_SHARED_ENTRIES) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	i = __upper_bound(t, t->n, (uintptr_t)vaddr);
+
+	__write_begin(t);
+
+	memmove(&t->entries[i + 1], &t->entries[i], (t->n - i) * sizeof(t->entries[0]));
+
+	t->entries[i] = (struct iova_shared_entry) {
+		.vaddr = (uintptr_t)vaddr,
+		.len = len,
+		.iova = iova,
+	};
+
+	t->n++;
+
+	__write_end(t);
+
+	return 0;
+}
+
+void iova_shared_remove(struct iova_shared_table *t, void *vaddr)
+{
+	uint32_t i = __upper_bound(t, t->n, (uintptr_t)vaddr);
+
+	if (!i || t->entries[i - 1].vaddr != (uintptr_t)vaddr)
+		return;
+
+	__write_begin(t);
+
+	memmove(&t->entries[i - 1], &t->entries[i], (t->n - i) * sizeof(t->entries[0]));
+	t->n--;
+
+	__write_end(t);
+}
+
+void iova_shared_clear(struct iova_shared_table *t)
+{
+	__write_begin(t);
+
+	t->n = 0;
+
+	__write_end(t);
+}
+
+bool iova_shared_translate(const struct iova_shared_table *t, void *vaddr, uint64_t *iova)
+{
+	uint64_t seq, start, len, base;
+	uint32_t n, i;
+
+	for (;;) {
+		seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		n = min_t(uint32_t, __atomic_load_n(&t->n, __ATOMIC_RELAXED), IOVA_SHARED_ENTRIES);
+		i = __upper_bound(t, n, (uintptr_t)vaddr);
+
+		start = len = base = 0;
+
+		if (i) {
+			start = __atomic_load_n(&t->entries[i - 1].vaddr, __ATOMIC_RELAXED);
+			len = __atomic_load_n(&t->entries[i - 1].len, __ATOMIC_RELAXED);
+			base = __atomic_load_n(&t->entries[i - 1].iova, __ATOMIC_RELAXED);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	if (!i || (uintptr_t)vaddr >= start + len)
+		return false;
+
+	*iova = base + ((uintptr_t)vaddr - start);
+
+	return true;
+}
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Mapping table shared between processes.
+ *
+ * A fixed-size array of mappings ordered by vaddr in a memfd, written by the
+ * process that owns the iova map and read by processes that imported it (see
+ * iommu_export_context()). The writer is serialized by the map lock and
+ * readers retry lookups that raced with an update (the table is protected by
+ * a sequence counter), so lookups never block the writer.
+ *
+ * Virtual addresses are those of the writer; readers must map shared memory at
+ * the same addresses to translate it.
+ */
+
+#define IOVA_SHARED_MAGIC 0x766d6170 /* "vmap" */
+#define IOVA_SHARED_ENTRIES 16384
+
+struct iova_shared_entry {
+	uint64_t vaddr;
+	uint64_t len;
+	uint64_t iova;
+};
+
+struct iova_shared_table {
+	uint32_t magic;
+	uint32_t n;
+
+	/* odd while an update is in progress */
+	uint64_t seq;
+
+	struct iova_shared_entry entries[IOVA_SHARED_ENTRIES];
+};
+
+struct iova_shared_table *iova_shared_create(int *fd);
+const struct iova_shared_table *iova_shared_open(int fd);
+
+int iova_shared_insert(struct iova_shared_table *t, void *vaddr, size_t len, uint64_t iova);
+void iova_shared_remove(struct iova_shared_table *t, void *vaddr);
+void iova_shared_clear(struct iova_shared_table *t);
+
+bool iova_shared_translate(const struct iova_shared_table *t, void *vaddr, uint64_t *iova);
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ccan/tap/tap.h"
+
+#include "vfn/support.h"
+
+#include "shared.h"
+
+static struct iova_shared_table *t;
+static const struct iova_shared_table *ro;
+
+static bool stop;
+
+/* the entry at 0x100000 is never removed; lookups must not miss it */
+static void *reader(void *opaque)
+{
+	bool *ok = opaque;
+	uint64_t iova;
+
+	*ok = true;
+
+	while (!atomic_load_acquire(&stop)) {
+		if (!iova_shared_translate(ro, (void *)0x100010, &iova) || iova != 0x10010)
+			*ok = false;
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t thread;
+	uint64_t iova;
+	bool ok;
+	int fd;
+
+	plan_tests(8);
+
+	t = iova_shared_create(&fd);
+	ok1(t != NULL);
+
+	ro = iova_shared_open(fd);
+	ok1(ro != NULL);
+
+	ok1(iova_shared_translate(ro, (void *)0x100000, &iova) == false);
+
+	/* inserted out of order */
+	iova_shared_insert(t, (void *)0x300000, 0x1000, 0x30000);
+	iova_shared_insert(t, (void *)0x100000, 0x2000, 0x10000);
+	iova_shared_insert(t, (void *)0x200000, 0x1000, 0x20000);
+
+	ok1(iova_shared_translate(ro, (void *)0x101008, &iova) && iova == 0x11008);
+	ok1(iova_shared_translate(ro, (void *)0x201000, &iova) == false);
+
+	iova_shared_remove(t, (void *)0x200000);
+	ok1(iova_shared_translate(ro, (void *)0x200000, &iova) == false &&
+	    iova_shared_translate(ro, (void *)0x300008, &iova) && iova == 0x30008);
+
+	/* concurrent updates of other entries */
+	pthread_create(&thread, NULL, reader, &ok);
+
+	for (int i = 0; i < 10000; i++) {
+		void *vaddr = (void *)(uintptr_t)(0x200000 + (i % 16) * 0x1000);
+
+		if (i % 32 < 16)
+			iova_shared_insert(t, vaddr, 0x1000, 0x20000);
+		else
+			iova_shared_remove(t, vaddr);
+	}
+
+	atomic_store_release(&stop, true);
+	pthread_join(thread, NULL);
+
+	ok1(ok);
+
+	iova_shared_clear(t);
+	ok1(iova_shared_translate(ro, (void *)0x100000, &iova) == false);
+
+	return exit_status();
+}
@@ -31,6 +31,7 @@
 
 #include "ccan/str/str.h"
 #include "ccan/compiler/compiler.h"
+#include "ccan/container_of/container_of.h"
 #include "ccan/minmax/minmax.h"
 
 #include <linux/types.h>
@@ -42,6 +43,8 @@
 #include "vfn/pci/util.h"
 
 #include "context.h"
+#include "iova.h"
+#include "pagemap.h"
 
 #define VFIO_IOMMU_TYPE1_IOVA_RESERVED 0x10000
 
@@ -61,11 +64,13 @@ struct vfio_container {
 #define VFN_MAX_VFIO_GROUPS 64
 	struct vfio_group groups[VFN_MAX_VFIO_GROUPS];
 
-	pthread_mutex_t lock;
-	uint64_t next, next_ephemeral, nephemerals;
+	struct iova_allocator iova, ephemeral_iova;
 	struct iommu_iova_range ephemerals;
 
 	bool iommu_set;
+
+	/* groups are vfio-noiommu groups; devices are given physical addresses */
+	bool noiommu;
 };
 
 static struct vfio_container vfio_default_container = {
@@ -73,6 +78,12 @@ static struct vfio_container vfio_default_container = {
 	.name = "default",
 };
 
+static struct vfio_container vfio_default_noiommu_container = {
+	.fd = -1,
+	.name = "default",
+	.noiommu = true,
+};
+
 #ifdef VFIO_IOMMU_INFO_CAPS
 # ifdef VFIO_IOMMU_TYPE1_INFO_CAP_IOVA_RANGE
 __static_assert(sizeof(struct vfio_iova_range) == sizeof(struct iommu_iova_range));
@@ -188,59 +199,28 @@ static int vfio_iommu_type1_get_capabilities(struct vfio_container *vfio)
 }
 #endif /* VFIO_IOMMU_INFO_CAPS */
 
-static bool __iova_reserve(struct iommu_iova_range *ranges, int nranges, uint64_t *next,
-			   size_t len, uint64_t *iova)
+static int vfio_iommu_type1_iova_reserve(struct iommu_ctx *ctx, size_t len, uint64_t *iova,
+					 unsigned long flags)
 {
-	uint64_t _next = *next;
-
-	for (int i = 0; i < nranges; i++) {
-		struct iommu_iova_range *r = &ranges[i];
-
-		if (r->last < _next)
-			continue;
-
-		_next = max_t(uint64_t, _next, r->start);
-
-		if (_next > r->last || r->last - _next + 1 < len)
-			continue;
-
-		*iova = _next;
-		*next = _next + len;
+	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
 
-		return true;
-	}
+	if (flags & IOMMU_MAP_EPHEMERAL)
+		return iova_alloc(&vfio->ephemeral_iova, len, iova);
 
-	return false;
+	return iova_alloc(&vfio->iova, len, iova);
 }
 
-static int vfio_iommu_type1_iova_reserve(struct iommu_ctx *ctx, size_t len, uint64_t *iova,
-					 unsigned long flags)
+static void vfio_iommu_type1_iova_release(struct iommu_ctx *ctx, uint64_t iova, size_t len,
+					  unsigned long flags)
 {
 	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
 
-	__autolock(&vfio->lock);
-
-	if (!ALIGNED(len, __VFN_PAGESIZE)) {
-		log_debug("len is not page aligned\n");
-		errno = EINVAL;
-		return -1;
-	}
-
 	if (flags & IOMMU_MAP_EPHEMERAL) {
-		if (!__iova_reserve(&vfio->ephemerals, 1, &vfio->next_ephemeral, len, iova))
-			goto enomem;
-
-		atomic_inc(&vfio->nephemerals);
-
-		return 0;
+		iova_release(&vfio->ephemeral_iova, iova, len);
+		return;
 	}
 
-	if (__iova_reserve(ctx->iova_ranges, ctx->nranges, &vfio->next, len, iova))
-		return 0;
-
-enomem:
-	errno = ENOMEM;
-	return -1;
+	iova_release(&vfio->iova, iova, len);
 }
 
 static int vfio_iommu_type1_init(struct vfio_container *vfio)
@@ -250,6 +230,20 @@ static int vfio_iommu_type1_init(struct vfio_container *vfio)
 	if (vfio->iommu_set)
 		return 0;
 
+#ifdef VFIO_NOIOMMU_IOMMU
+	if (vfio->noiommu) {
+		if (ioctl(vfio->fd, VFIO_SET_IOMMU, VFIO_NOIOMMU_IOMMU)) {
+			log_debug("failed to set vfio no-iommu type\n");
+			return -1;
+		}
+
+		/* there is no iova space to manage */
+		vfio->iommu_set = true;
+
+		return 0;
+	}
+#endif
+
 	if (ioctl(vfio->fd, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU)) {
 		log_debug("failed to set vfio iommu type\n");
 		return -1;
@@ -264,6 +258,8 @@ static int vfio_iommu_type1_init(struct vfio_container *vfio)
 	}
 #endif
 
+	iova_allocator_init(&vfio->iova, vfio->ctx.iova_ranges, vfio->ctx.nranges, true);
+
 	if (vfio_iommu_type1_iova_reserve(&vfio->ctx, VFIO_IOMMU_TYPE1_IOVA_RESERVED, &iova, 0x0)) {
 		log_debug("could not reserve iova range\n");
 		return -1;
@@ -272,6 +268,9 @@ static int vfio_iommu_type1_init(struct vfio_container *vfio)
 	vfio->ephemerals.start = iova;
 	vfio->ephemerals.last = iova + VFIO_IOMMU_TYPE1_IOVA_RESERVED - 1;
 
+	/* the range is too small to be cached per thread */
+	iova_allocator_init(&vfio->ephemeral_iova, &vfio->ephemerals, 1, false);
+
 	if (logv(LOG_INFO)) {
 		__autofree char *str;
 
@@ -397,6 +396,20 @@ static int vfio_get_device_fd(struct iommu_ctx *ctx, const char *bdf)
 		errno = EINVAL;
 		return -1;
 	}
+	if (vfio->noiommu) {
+		char *p = strrchr(group, '/');
+		char *path;
+
+		/* the group device node is named noiommu-<group> */
+		if (!p || asprintf(&path, "/dev/vfio/noiommu-%s", p + 1) < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		free(group);
+		group = path;
+	}
+
 	log_info("vfio iommu group is %s\n", group);
 
 	gfd = vfio_get_group_fd(vfio, group);
@@ -416,6 +429,7 @@ static int vfio_iommu_type1_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_
 				       uint64_t *iova, unsigned long flags)
 {
 	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
+	uint64_t start, nsecs;
 
 	struct vfio_iommu_type1_dma_map dma_map = {
 		.argsz = sizeof(dma_map),
@@ -431,6 +445,8 @@ static int vfio_iommu_type1_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_
 	if (flags & IOMMU_MAP_NOREAD)
 		dma_map.flags &= ~VFIO_DMA_MAP_FLAG_READ;
 
+	trace_probe(VFIO_IOMMU_TYPE1_MAP_DMA, vaddr, *iova, len);
+
 	trace_guard(VFIO_IOMMU_TYPE1_MAP_DMA) {
 		trace_emit("vaddr %p iova 0x%" PRIx64 " len %zu\n", vaddr, *iova, len);
 	}
@@ -441,11 +457,22 @@ static int vfio_iommu_type1_do_dma_map(struct iommu_ctx *ctx, void *vaddr, size_
 		return -1;
 	}
 
+	start = get_ticks();
+
 	if (ioctl(vfio->fd, VFIO_IOMMU_MAP_DMA, &dma_map)) {
 		log_debug("could not map\n");
 		return -1;
 	}
 
+	nsecs = ticks_to_ns(get_ticks() - start);
+	iommu_ctx_account_map(ctx, len, nsecs);
+
+	trace_probe(VFIO_IOMMU_TYPE1_MAP_DMA_DONE, *iova, len, nsecs);
+
+	trace_guard(VFIO_IOMMU_TYPE1_MAP_DMA_DONE) {
+		trace_emit("iova 0x%" PRIx64 " len %zu in %" PRIu64 " ns\n", *iova, len, nsecs);
+	}
+
 	return 0;
 }
 
@@ -459,6 +486,8 @@ static int vfio_iommu_type1_do_dma_unmap(struct iommu_ctx *ctx, uint64_t iova, s
 		.iova = iova,
 	};
 
+	trace_probe(VFIO_IOMMU_TYPE1_UNMAP_DMA, iova, len);
+
 	trace_guard(VFIO_IOMMU_TYPE1_UNMAP_DMA) {
 		trace_emit("iova 0x%" PRIx64 " len %zu\n", iova, len);
 	}
@@ -471,26 +500,6 @@ static int vfio_iommu_type1_do_dma_unmap(struct iommu_ctx *ctx, uint64_t iova, s
 	return 0;
 }
 
-static void vfio_iommu_type1_recycle_ephemeral_iovas(struct vfio_container *vfio)
-{
-	__autolock(&vfio->lock);
-
-	trace_guard(VFIO_IOMMU_TYPE1_RECYCLE_EPHEMERAL_IOVAS) {
-		trace_emit("recycling ephemeral range (0x%" PRIx64 " -> 0x%llx)\n",
-			   vfio->next_ephemeral, vfio->ephemerals.start);
-	}
-
-	vfio->next_ephemeral = vfio->ephemerals.start;
-}
-
-static void vfio_iommu_type1_iova_put_ephemeral(struct iommu_ctx *ctx)
-{
-	struct vfio_container *vfio = container_of_var(ctx, vfio, ctx);
-
-	if (atomic_dec_fetch(&vfio->nephemerals) == 0)
-		vfio_iommu_type1_recycle_ephemeral_iovas(vfio);
-}
-
 #ifdef VFIO_UNMAP_ALL
 static int vfio_iommu_type1_do_dma_unmap_all(struct iommu_ctx *ctx)
 {
@@ -510,11 +519,60 @@ static int vfio_iommu_type1_do_dma_unmap_all(struct iommu_ctx *ctx)
 }
 #endif
 
+/*
+ * Without an iommu, the device addresses memory by its physical address; the
+ * memory is pinned and its physical address is the iova of the mapping.
+ */
+static int vfio_noiommu_dma_map(struct iommu_ctx *ctx, void *vaddr, size_t len, uint64_t *iova,
+				unsigned long flags)
+{
+	uint64_t start = get_ticks();
+
+	if (flags & IOMMU_MAP_FIXED_IOVA) {
+		log_debug("cannot map at a fixed iova without an iommu\n");
+
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (mlock(vaddr, len)) {
+		log_debug("could not pin memory: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (pagemap_translate(vaddr, len, iova)) {
+		int err = errno;
+
+		munlock(vaddr, len);
+
+		errno = err;
+		return -1;
+	}
+
+	iommu_ctx_account_map(ctx, len, ticks_to_ns(get_ticks() - start));
+
+	return 0;
+}
+
+/* the memory stays pinned until it is unmapped from the process */
+static int vfio_noiommu_dma_unmap(struct iommu_ctx *ctx UNUSED, uint64_t iova UNUSED,
+				  size_t len UNUSED)
+{
+	return 0;
+}
+
+static const struct iommu_ctx_ops vfio_noiommu_ops = {
+	.get_device_fd = vfio_get_device_fd,
+
+	.dma_map = vfio_noiommu_dma_map,
+	.dma_unmap = vfio_noiommu_dma_unmap,
+};
+
 static const struct iommu_ctx_ops vfio_ops = {
 	.get_device_fd = vfio_get_device_fd,
 
 	.iova_reserve = vfio_iommu_type1_iova_reserve,
-	.iova_put_ephemeral = vfio_iommu_type1_iova_put_ephemeral,
+	.iova_release = vfio_iommu_type1_iova_release,
 
 	.dma_map = vfio_iommu_type1_do_dma_map,
 	.dma_unmap = vfio_iommu_type1_do_dma_unmap,
@@ -536,6 +594,24 @@ static int vfio_init_container(struct vfio_container *vfio)
 		return -1;
 	}
 
+	if (vfio->noiommu) {
+#ifdef VFIO_NOIOMMU_IOMMU
+		if (!ioctl(vfio->fd, VFIO_CHECK_EXTENSION, VFIO_NOIOMMU_IOMMU)) {
+			log_debug("vfio no-iommu mode not enabled\n");
+
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		memcpy(&vfio->ctx.ops, &vfio_noiommu_ops, sizeof(vfio->ctx.ops));
+
+		return 0;
+#else
+		errno = ENOTSUP;
+		return -1;
+#endif
+	}
+
 	if (!ioctl(vfio->fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU)) {
 		log_debug("vfio type 1 iommu not supported\n");
 		return -1;
@@ -546,13 +622,16 @@ static int vfio_init_container(struct vfio_container *vfio)
 	return 0;
 }
 
-struct iommu_ctx *vfio_get_iommu_context(const char *name)
+static struct iommu_ctx *__vfio_get_iommu_context(const char *name, bool noiommu)
 {
 	struct vfio_container *vfio = znew_t(struct vfio_container, 1);
 
+	vfio->noiommu = noiommu;
+
 	iommu_ctx_init(&vfio->ctx);
 
 	if (vfio_init_container(vfio) < 0) {
+		iommu_ctx_fini(&vfio->ctx);
 		free(vfio);
 		return NULL;
 	}
@@ -562,6 +641,16 @@ struct iommu_ctx *vfio_get_iommu_context(const char *name)
 	return &vfio->ctx;
 }
 
+struct iommu_ctx *vfio_get_iommu_context(const char *name)
+{
+	return __vfio_get_iommu_context(name, false);
+}
+
+struct iommu_ctx *vfio_get_noiommu_context(const char *name)
+{
+	return __vfio_get_iommu_context(name, true);
+}
+
 struct iommu_ctx *vfio_get_default_iommu_context(void)
 {
 	if (vfio_default_container.fd == -1) {
@@ -573,3 +662,15 @@ struct iommu_ctx *vfio_get_default_iommu_context(void)
 
 	return &vfio_default_container.ctx;
 }
+
+struct iommu_ctx *vfio_get_default_noiommu_context(void)
+{
+	if (vfio_default_noiommu_container.fd == -1) {
+		iommu_ctx_init(&vfio_default_noiommu_container.ctx);
+
+		log_fatal_if(vfio_init_container(&vfio_default_noiommu_container),
+			     "init default no-iommu container\n");
+	}
+
+	return &vfio_default_noiommu_container.ctx;
+}
@@ -0,0 +1,701 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/bcache: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/container_of/container_of.h"
+#include "ccan/list/list.h"
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* the arc lists; resident (t1, t2) and ghost (b1, b2) */
+enum {
+	BC_T1,
+	BC_T2,
+	BC_B1,
+	BC_B2,
+
+	BC_NLISTS,
+};
+
+struct vfn_bcache_entry {
+	uint64_t pgno;
+	struct vfn_bcache_entry *hnext;
+
+	/* on one of the arc lists, or the free list */
+	struct list_node lru;
+	int list;
+
+	/* NULL for ghost entries */
+	struct vfn_bcache_page *page;
+};
+
+struct vfn_bcache_stripe {
+	pthread_mutex_t lock;
+
+	/* capacity and target size of t1 */
+	int c, p;
+
+	struct list_head lists[BC_NLISTS];
+	int len[BC_NLISTS];
+
+	/* twice the capacity; enough for the resident and ghost entries */
+	struct vfn_bcache_entry *entries;
+	struct list_head free;
+
+	struct vfn_bcache_entry **buckets;
+	uint64_t mask;
+
+	/* the pages of the stripe; those not yet used are on the stack */
+	struct vfn_bcache_page *pages, **unused;
+	int nunused;
+
+	/* number of pages that are dirty or being written back */
+	int ndirty;
+
+	struct vfn_bcache_stats stats;
+} __cacheline_aligned;
+
+static inline uint64_t __hash(uint64_t pgno)
+{
+	return pgno * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct vfn_bcache_stripe *__stripe(struct vfn_bcache *c, uint64_t h)
+{
+	return &c->stripes[(uint32_t)(h >> 32) % (uint32_t)c->nstripes];
+}
+
+int vfn_bcache_init(struct vfn_bcache *c, struct vfn_bdev *bdev, size_t pagesize, int npages,
+		    int nstripes)
+{
+	struct nvme_ctrl *ctrl = bdev->ctrl;
+	struct nvme_ns *ns = bdev->ns;
+	struct vfn_bcache_page *page;
+
+	if (!pagesize || pagesize & (pagesize - 1) || pagesize < __VFN_PAGESIZE ||
+	    pagesize < (1ULL << ns->lbads) || (pagesize >> ns->lbads) > ns->max_nlb ||
+	    (ctrl->config.mdts && pagesize > ctrl->config.mdts)) {
+		log_debug("invalid page size %zu\n", pagesize);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nstripes <= 0 || npages < nstripes) {
+		log_debug("invalid number of pages %d or stripes %d\n", npages, nstripes);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	*c = (struct vfn_bcache) {
+		.bdev = bdev,
+		.pagesize = pagesize,
+		.npages = npages,
+		.len = pagesize * (size_t)npages,
+		.nstripes = nstripes,
+		.shift = (unsigned int)__builtin_ctzll(pagesize) - ns->lbads,
+	};
+
+	if (iommu_alloc_node(__iommu_ctx(ctrl), c->len, ctrl->numa.node, &c->vaddr, &c->iova)) {
+		log_debug("could not allocate pages\n");
+		return -1;
+	}
+
+	c->pages = znew_t(struct vfn_bcache_page, npages);
+	c->stripes = znew_t(struct vfn_bcache_stripe, nstripes);
+
+	page = c->pages;
+
+	for (int i = 0; i < nstripes; i++) {
+		struct vfn_bcache_stripe *s = &c->stripes[i];
+		int nbuckets;
+
+		s->c = npages / nstripes + (i < npages % nstripes);
+
+		pthread_mutex_init(&s->lock, NULL);
+
+		for (int l = 0; l < BC_NLISTS; l++)
+			list_head_init(&s->lists[l]);
+
+		list_head_init(&s->free);
+
+		s->entries = znew_t(struct vfn_bcache_entry, 2 * s->c);
+
+		for (int e = 0; e < 2 * s->c; e++)
+			list_add_tail(&s->free, &s->entries[e].lru);
+
+		nbuckets = 1 << (32 - __builtin_clz((uint32_t)(2 * s->c) - 1));
+
+		s->buckets = znew_t(struct vfn_bcache_entry *, nbuckets);
+		s->mask = (uint64_t)nbuckets - 1;
+
+		s->pages = page;
+		s->unused = znew_t(struct vfn_bcache_page *, s->c);
+
+		for (int p = 0; p < s->c; p++, page++) {
+			size_t off = (size_t)(page - c->pages) * pagesize;
+
+			page->vaddr = c->vaddr + off;
+			page->iova = c->iova + off;
+			page->stripe = s;
+
+			s->unused[s->nunused++] = page;
+		}
+	}
+
+	return 0;
+}
+
+void vfn_bcache_destroy(struct vfn_bcache *c)
+{
+	for (int i = 0; i < c->nstripes; i++) {
+		struct vfn_bcache_stripe *s = &c->stripes[i];
+
+		pthread_mutex_destroy(&s->lock);
+
+		free(s->entries);
+		free(s->buckets);
+		free(s->unused);
+	}
+
+	iommu_free(__iommu_ctx(c->bdev->ctrl), c->vaddr, c->len);
+
+	free(c->stripes);
+	free(c->pages);
+
+	memset(c, 0x0, sizeof(*c));
+}
+
+static struct vfn_bcache_entry *__lookup(struct vfn_bcache_stripe *s, uint64_t h, uint64_t pgno)
+{
+	struct vfn_bcache_entry *e = s->buckets[h & s->mask];
+
+	while (e && e->pgno != pgno)
+		e = e->hnext;
+
+	return e;
+}
+
+static void __hash_del(struct vfn_bcache_stripe *s, struct vfn_bcache_entry *e)
+{
+	struct vfn_bcache_entry **pp = &s->buckets[__hash(e->pgno) & s->mask];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+
+	*pp = e->hnext;
+}
+
+/* move @e to the most recently used end of @list */
+static void __move(struct vfn_bcache_stripe *s, struct vfn_bcache_entry *e, int list)
+{
+	list_del_from(&s->lists[e->list], &e->lru);
+	s->len[e->list]--;
+
+	list_add(&s->lists[list], &e->lru);
+	s->len[list]++;
+
+	e->list = list;
+}
+
+/* forget the page number of @e entirely */
+static void __drop(struct vfn_bcache_stripe *s, struct vfn_bcache_entry *e)
+{
+	list_del_from(&s->lists[e->list], &e->lru);
+	s->len[e->list]--;
+
+	__hash_del(s, e);
+
+	list_add(&s->free, &e->lru);
+}
+
+static void __drop_lru(struct vfn_bcache_stripe *s, int list)
+{
+	struct vfn_bcache_entry *e = list_tail(&s->lists[list], struct vfn_bcache_entry, lru);
+
+	if (e)
+		__drop(s, e);
+}
+
+static inline bool __evictable(struct vfn_bcache_page *page)
+{
+	return !page->ref && !page->dirty && !page->writeback;
+}
+
+/* the least recently used entry on @list whose page may be evicted */
+static struct vfn_bcache_entry *__victim(struct vfn_bcache_stripe *s, int list)
+{
+	struct vfn_bcache_entry *e;
+
+	list_for_each_rev(&s->lists[list], e, lru) {
+		if (__evictable(e->page))
+			return e;
+	}
+
+	return NULL;
+}
+
+/* take the page of @e, remembering its page number on @ghost (or not, if negative) */
+static struct vfn_bcache_page *__evict(struct vfn_bcache_stripe *s, struct vfn_bcache_entry *e,
+				       int ghost)
+{
+	struct vfn_bcache_page *page = e->page;
+
+	page->entry = NULL;
+	page->valid = false;
+
+	e->page = NULL;
+
+	if (ghost < 0)
+		__drop(s, e);
+	else
+		__move(s, e, ghost);
+
+	s->stats.evictions++;
+
+	return page;
+}
+
+/*
+ * The arc replacement; evict from t1 if it is above its target size (or at
+ * it, on a hit in b2), otherwise from t2. Pinned and dirty pages are skipped,
+ * falling back to the other list.
+ */
+static struct vfn_bcache_page *__replace(struct vfn_bcache_stripe *s, bool in_b2)
+{
+	int first = BC_T2, other = BC_T1;
+	struct vfn_bcache_entry *e;
+
+	if (s->len[BC_T1] && (s->len[BC_T1] > s->p || (in_b2 && s->len[BC_T1] == s->p))) {
+		first = BC_T1;
+		other = BC_T2;
+	}
+
+	e = __victim(s, first);
+	if (!e)
+		e = __victim(s, other);
+
+	if (!e) {
+		/* the dirty pages may be evicted once written back */
+		errno = s->ndirty ? EAGAIN : EBUSY;
+		return NULL;
+	}
+
+	return __evict(s, e, e->list == BC_T1 ? BC_B1 : BC_B2);
+}
+
+static struct vfn_bcache_page *__alloc(struct vfn_bcache_stripe *s, bool in_b2)
+{
+	if (s->nunused)
+		return s->unused[--s->nunused];
+
+	return __replace(s, in_b2);
+}
+
+static void __attach(struct vfn_bcache_entry *e, struct vfn_bcache_page *page)
+{
+	e->page = page;
+
+	page->entry = e;
+	page->pgno = e->pgno;
+}
+
+/*
+ * Look up @pgno (with the stripe locked) and return its page pinned. On a
+ * miss, the page is attached to the page number but not valid.
+ */
+static struct vfn_bcache_page *__get(struct vfn_bcache_stripe *s, uint64_t h, uint64_t pgno)
+{
+	struct vfn_bcache_entry *e = __lookup(s, h, pgno);
+	struct vfn_bcache_page *page;
+	int total;
+
+	/* hit; seen at least twice now */
+	if (e && e->page) {
+		s->stats.hits++;
+
+		__move(s, e, BC_T2);
+		e->page->ref++;
+
+		return e->page;
+	}
+
+	s->stats.misses++;
+
+	/* recently evicted; grow the list it was evicted from */
+	if (e) {
+		bool in_b2 = e->list == BC_B2;
+		int b1 = s->len[BC_B1], b2 = s->len[BC_B2];
+
+		s->stats.ghost_hits++;
+
+		if (in_b2)
+			s->p = max_t(int, 0, s->p - max_t(int, b1 / b2, 1));
+		else
+			s->p = min_t(int, s->c, s->p + max_t(int, b2 / b1, 1));
+
+		page = __alloc(s, in_b2);
+		if (!page)
+			return NULL;
+
+		__move(s, e, BC_T2);
+		__attach(e, page);
+
+		page->ref = 1;
+
+		return page;
+	}
+
+	/* keep the directory (resident and ghost entries) at twice the capacity */
+	page = NULL;
+	total = s->len[BC_T1] + s->len[BC_T2] + s->len[BC_B1] + s->len[BC_B2];
+
+	if (s->len[BC_T1] + s->len[BC_B1] == s->c) {
+		if (s->len[BC_T1] < s->c) {
+			__drop_lru(s, BC_B1);
+		} else {
+			/* t1 is the entire cache; evict from it without a ghost */
+			e = __victim(s, BC_T1);
+			if (e)
+				page = __evict(s, e, -1);
+		}
+	} else if (total >= 2 * s->c) {
+		__drop_lru(s, BC_B2);
+	}
+
+	if (!page) {
+		page = __alloc(s, false);
+		if (!page)
+			return NULL;
+	}
+
+	/* with pinned pages the directory may still be full */
+	if (list_empty(&s->free))
+		__drop_lru(s, s->len[BC_B1] ? BC_B1 : BC_B2);
+
+	e = list_pop(&s->free, struct vfn_bcache_entry, lru);
+	assert(e);
+
+	e->pgno = pgno;
+	e->hnext = s->buckets[h & s->mask];
+	s->buckets[h & s->mask] = e;
+
+	e->list = BC_T1;
+	list_add(&s->lists[BC_T1], &e->lru);
+	s->len[BC_T1]++;
+
+	__attach(e, page);
+
+	page->ref = 1;
+
+	return page;
+}
+
+static void __io_done(struct vfn_bdev_io *io, struct nvme_cqe *cqe)
+{
+	struct vfn_bcache_page *page = container_of(io, struct vfn_bcache_page, io);
+	int *pending = io->opaque;
+
+	page->failed = !nvme_cqe_ok(cqe);
+
+	(*pending)--;
+}
+
+static void __io_prep(struct vfn_bcache *c, struct vfn_bcache_page *page, uint8_t op,
+		      int *pending)
+{
+	page->io = (struct vfn_bdev_io) {
+		.op = op,
+		.slba = page->pgno << c->shift,
+		.nlb = (uint32_t)(c->pagesize >> c->bdev->ns->lbads),
+		.iova = page->iova,
+		.cb = __io_done,
+		.opaque = pending,
+	};
+
+	page->failed = false;
+}
+
+/* plug @io, making room by polling if request trackers are short */
+static int __io_add(struct vfn_bdev_queue *q, struct vfn_bdev_io *io)
+{
+	while (vfn_bdev_add(q, io)) {
+		if (errno != EBUSY)
+			return -1;
+
+		vfn_bdev_poll(q, q->sq->qsize);
+	}
+
+	return 0;
+}
+
+static void __io_wait(struct vfn_bdev_queue *q, int *pending)
+{
+	while (vfn_bdev_unplug(q))
+		vfn_bdev_poll(q, q->sq->qsize);
+
+	while (*pending)
+		vfn_bdev_poll(q, q->sq->qsize);
+}
+
+static int __fill(struct vfn_bcache *c, struct vfn_bdev_queue *q, struct vfn_bcache_page *page)
+{
+	int pending = 1;
+
+	__io_prep(c, page, VFN_BDEV_OP_READ, &pending);
+
+	if (__io_add(q, &page->io))
+		return -1;
+
+	__io_wait(q, &pending);
+
+	if (page->failed) {
+		log_debug("could not read page %" PRIu64 "\n", page->pgno);
+
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * A read takes at least a device round trip; spin with exponentially more
+ * pause hints between polls and then yield, rather than hammering the line.
+ */
+#define BCACHE_FILL_MAX_SPIN 1024
+
+static void __wait_filled(struct vfn_bcache_page *page)
+{
+	unsigned int spin = 1;
+
+	while (atomic_load_acquire(&page->filling)) {
+		if (spin > BCACHE_FILL_MAX_SPIN) {
+			sched_yield();
+			continue;
+		}
+
+		for (unsigned int i = 0; i < spin; i++)
+			cpu_relax();
+
+		spin <<= 1;
+	}
+}
+
+struct vfn_bcache_page *vfn_bcache_get(struct vfn_bcache *c, struct vfn_bdev_queue *q,
+				       uint64_t pgno)
+{
+	uint64_t h = __hash(pgno);
+	struct vfn_bcache_stripe *s = __stripe(c, h);
+	struct vfn_bcache_page *page;
+	bool fill;
+	int ret;
+
+	if (pgno >= c->bdev->ns->nsze >> c->shift) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+
+		page = __get(s, h, pgno);
+		if (page)
+			break;
+
+		pthread_mutex_unlock(&s->lock);
+
+		if (errno != EAGAIN || vfn_bcache_flush(c, q))
+			return NULL;
+	}
+
+	/* another thread is reading the page; the pin keeps it from being evicted */
+	while (atomic_load_acquire(&page->filling)) {
+		pthread_mutex_unlock(&s->lock);
+
+		__wait_filled(page);
+
+		pthread_mutex_lock(&s->lock);
+	}
+
+	/* a miss, or a read by another thread that failed */
+	fill = !page->valid;
+	if (fill)
+		atomic_store_release(&page->filling, true);
+
+	pthread_mutex_unlock(&s->lock);
+
+	if (!fill)
+		return page;
+
+	ret = __fill(c, q, page);
+
+	pthread_mutex_lock(&s->lock);
+
+	page->valid = !ret;
+	atomic_store_release(&page->filling, false);
+
+	pthread_mutex_unlock(&s->lock);
+
+	if (ret) {
+		vfn_bcache_put(c, page);
+
+		errno = EIO;
+		return NULL;
+	}
+
+	return page;
+}
+
+void vfn_bcache_put(struct vfn_bcache *c UNUSED, struct vfn_bcache_page *page)
+{
+	__autolock(&page->stripe->lock);
+
+	assert(page->ref);
+
+	page->ref--;
+}
+
+void vfn_bcache_dirty(struct vfn_bcache *c UNUSED, struct vfn_bcache_page *page)
+{
+	struct vfn_bcache_stripe *s = page->stripe;
+
+	__autolock(&s->lock);
+
+	if (!page->dirty && !page->writeback)
+		s->ndirty++;
+
+	page->dirty = true;
+}
+
+static int __pgno_cmp(const void *a, const void *b)
+{
+	const struct vfn_bcache_page *pa = *(struct vfn_bcache_page * const *)a;
+	const struct vfn_bcache_page *pb = *(struct vfn_bcache_page * const *)b;
+
+	return pa->pgno < pb->pgno ? -1 : pa->pgno > pb->pgno;
+}
+
+int vfn_bcache_flush(struct vfn_bcache *c, struct vfn_bdev_queue *q)
+{
+	struct vfn_bcache_page **wb = new_t(struct vfn_bcache_page *, c->npages);
+	int n = 0, pending = 0, ret = 0;
+
+	for (int i = 0; i < c->nstripes; i++) {
+		struct vfn_bcache_stripe *s = &c->stripes[i];
+
+		__autolock(&s->lock);
+
+		for (int p = 0; p < s->c; p++) {
+			struct vfn_bcache_page *page = &s->pages[p];
+
+			if (!page->dirty || page->writeback)
+				continue;
+
+			/* dirtied again while written back, it is written again */
+			page->dirty = false;
+			page->writeback = true;
+			page->ref++;
+
+			wb[n++] = page;
+		}
+	}
+
+	/* in page order, so the writes of adjacent pages are merged */
+	qsort(wb, (size_t)n, sizeof(*wb), __pgno_cmp);
+
+	for (int i = 0; i < n; i++) {
+		__io_prep(c, wb[i], VFN_BDEV_OP_WRITE, &pending);
+
+		if (__io_add(q, &wb[i]->io)) {
+			wb[i]->failed = true;
+			continue;
+		}
+
+		pending++;
+	}
+
+	__io_wait(q, &pending);
+
+	for (int i = 0; i < n; i++) {
+		struct vfn_bcache_page *page = wb[i];
+		struct vfn_bcache_stripe *s = page->stripe;
+
+		__autolock(&s->lock);
+
+		page->writeback = false;
+		page->ref--;
+
+		if (page->failed) {
+			log_debug("could not write back page %" PRIu64 "\n", page->pgno);
+
+			page->dirty = true;
+			ret = -1;
+
+			continue;
+		}
+
+		s->stats.writebacks++;
+
+		if (!page->dirty)
+			s->ndirty--;
+	}
+
+	free(wb);
+
+	if (ret)
+		errno = EIO;
+
+	return ret;
+}
+
+void vfn_bcache_get_stats(struct vfn_bcache *c, struct vfn_bcache_stats *stats)
+{
+	memset(stats, 0x0, sizeof(*stats));
+
+	for (int i = 0; i < c->nstripes; i++) {
+		struct vfn_bcache_stripe *s = &c->stripes[i];
+
+		__autolock(&s->lock);
+
+		stats->hits += s->stats.hits;
+		stats->misses += s->stats.misses;
+		stats->ghost_hits += s->stats.ghost_hits;
+		stats->evictions += s->stats.evictions;
+		stats->writebacks += s->stats.writebacks;
+	}
+}
@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "bcache.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+int iommu_alloc_node(struct iommu_ctx *ctx UNUSED, size_t len, int node UNUSED, void **vaddr,
+		     uint64_t *iova)
+{
+	if (pgmap(vaddr, len) < 0)
+		return -1;
+
+	*iova = (uint64_t)*vaddr;
+
+	return 0;
+}
+
+void iommu_free(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len)
+{
+	pgunmap(vaddr, len);
+}
+
+#define SQSIZE 8
+#define CQSIZE 8
+#define LBADS 12
+#define NBLOCKS 64
+
+static uint32_t sqdb, cqdb;
+static struct nvme_sq sqs[2];
+static struct nvme_cq cq;
+static struct nvme_rq rqs[SQSIZE - 1];
+
+/* the device; a thread executing reads and writes against memory */
+static uint8_t disk[NBLOCKS << LBADS];
+static pthread_t device_thread;
+static bool stop;
+
+static int nreads, nwrites;
+static uint32_t last_write_nlb;
+static uint64_t fail_slba = UINT64_MAX;
+
+static void *__dptr(union nvme_cmd *cmd, size_t off)
+{
+	uint64_t prp1 = le64_to_cpu(cmd->dptr.prp1), prp2 = le64_to_cpu(cmd->dptr.prp2);
+	size_t first = __VFN_PAGESIZE - (prp1 & (__VFN_PAGESIZE - 1));
+	size_t len = ((size_t)le16_to_cpu(cmd->rw.nlb) + 1) << LBADS;
+
+	if (off < first)
+		return (void *)(prp1 + off);
+
+	off -= first;
+
+	if (len - first <= __VFN_PAGESIZE)
+		return (void *)(prp2 + off);
+
+	return (void *)(((uint64_t *)prp2)[off / __VFN_PAGESIZE] + off % __VFN_PAGESIZE);
+}
+
+static void __execute(union nvme_cmd *cmd, uint16_t sqhd, int idx)
+{
+	struct nvme_cqe *cqe = cq.vaddr + ((idx % CQSIZE) << NVME_CQES);
+	uint64_t slba = le64_to_cpu(cmd->rw.slba);
+	uint32_t nlb = le16_to_cpu(cmd->rw.nlb) + 1U;
+	uint16_t status = 0;
+
+	if (slba <= fail_slba && fail_slba < slba + nlb) {
+		status = NVME_SC_INVALID_FIELD;
+	} else {
+		for (size_t off = 0; off < nlb << LBADS; off += __VFN_PAGESIZE) {
+			uint8_t *blk = &disk[(slba << LBADS) + off];
+
+			if (cmd->rw.opcode == NVME_NVM_READ)
+				memcpy(__dptr(cmd, off), blk, __VFN_PAGESIZE);
+			else
+				memcpy(blk, __dptr(cmd, off), __VFN_PAGESIZE);
+		}
+	}
+
+	if (cmd->rw.opcode == NVME_NVM_READ) {
+		nreads++;
+	} else {
+		nwrites++;
+		last_write_nlb = nlb;
+	}
+
+	cqe->sqid = cpu_to_le16(1);
+	cqe->sqhd = cpu_to_le16(sqhd);
+	cqe->cid = cmd->cid;
+
+	/* the phase tag flips with every pass through the queue */
+	atomic_store_release(&cqe->sfp,
+			     cpu_to_le16((uint16_t)(status << 1 | !((idx / CQSIZE) & 1))));
+}
+
+static void *device(void *arg UNUSED)
+{
+	uint16_t head = 0;
+	int idx = 0;
+
+	while (!atomic_load_acquire(&stop)) {
+		uint32_t tail = atomic_load_acquire(&sqdb);
+
+		for (; head != tail; head = (head + 1) % SQSIZE)
+			__execute(sqs[1].vaddr + (head << NVME_SQES), (head + 1) % SQSIZE, idx++);
+	}
+
+	return NULL;
+}
+
+static struct vfn_bcache c;
+static struct vfn_bdev_queue q;
+
+/* a page that holds the contents of the block of the same number */
+static bool check(struct vfn_bcache_page *page, uint64_t pgno)
+{
+	uint8_t *p = page->vaddr;
+
+	return page->pgno == pgno && p[0] == (uint8_t)pgno && p[4095] == (uint8_t)pgno;
+}
+
+static bool get_check(uint64_t pgno)
+{
+	struct vfn_bcache_page *page = vfn_bcache_get(&c, &q, pgno);
+	bool ret = page && check(page, pgno);
+
+	if (page)
+		vfn_bcache_put(&c, page);
+
+	return ret;
+}
+
+static void write_page(uint64_t pgno, uint8_t val)
+{
+	struct vfn_bcache_page *page = vfn_bcache_get(&c, &q, pgno);
+
+	assert(page);
+
+	memset(page->vaddr, val, 4096);
+
+	vfn_bcache_dirty(&c, page);
+	vfn_bcache_put(&c, page);
+}
+
+int main(void)
+{
+	struct nvme_ns ns = { .nsid = 1, .nsze = NBLOCKS, .lbads = LBADS, .max_nlb = 32 };
+	struct nvme_ctrl ctrl = { .ns = &ns, .nns = 1 };
+	struct vfn_bcache_page *pinned[4];
+	struct vfn_bcache_stats stats;
+	struct vfn_bdev bdev;
+	int reads;
+
+	plan_tests(15);
+
+	cq = (struct nvme_cq) {
+		.qsize = CQSIZE,
+		.doorbell = &cqdb,
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = SQSIZE,
+		.doorbell = &sqdb,
+		.cq = &cq,
+		.rqs = rqs,
+	};
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = SQSIZE - 2; i >= 0; i--) {
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+
+		assert(pgmap(&rqs[i].page.vaddr, __VFN_PAGESIZE) > 0);
+		rqs[i].page.iova = (uint64_t)rqs[i].page.vaddr;
+
+		nvme_rq_release(&rqs[i]);
+	}
+
+	for (int b = 0; b < NBLOCKS; b++)
+		memset(&disk[b << LBADS], b, 1 << LBADS);
+
+	assert(vfn_bdev_open(&bdev, &ctrl, 1) == 0);
+	vfn_bdev_queue_init(&q, &bdev, &sqs[1]);
+
+	assert(pthread_create(&device_thread, NULL, device, NULL) == 0);
+
+	ok1(vfn_bcache_init(&c, &bdev, 6000, 4, 1) == -1 && errno == EINVAL &&
+	    vfn_bcache_init(&c, &bdev, 4096, 1, 2) == -1 && errno == EINVAL);
+
+	/* one stripe, so the replacement is deterministic */
+	ok1(vfn_bcache_init(&c, &bdev, 4096, 4, 1) == 0);
+
+	/* a miss reads into the page; a hit does not read */
+	ok1(get_check(0) && nreads == 1 && get_check(0) && nreads == 1);
+	ok1(!vfn_bcache_get(&c, &q, NBLOCKS) && errno == EINVAL);
+
+	/* a page seen twice survives a scan that fills the cache twice over */
+	for (int pgno = 1; pgno <= 8; pgno++)
+		assert(get_check((uint64_t)pgno));
+
+	reads = nreads;
+
+	ok1(get_check(0) && nreads == reads);
+
+	/* pages evicted by the scan are remembered; a miss on one adapts */
+	ok1(get_check(5) && nreads == reads + 1 && c.stripes[0].p == 1);
+
+	vfn_bcache_get_stats(&c, &stats);
+
+	ok1(stats.hits == 2 && stats.misses == 10 && stats.ghost_hits == 1 &&
+	    stats.evictions == 6);
+
+	/* pinned pages are not evicted */
+	for (int i = 0; i < 4; i++)
+		pinned[i] = vfn_bcache_get(&c, &q, (uint64_t)(10 + i));
+
+	ok1(pinned[0] && pinned[3] && !vfn_bcache_get(&c, &q, 20) && errno == EBUSY);
+
+	for (int i = 0; i < 4; i++)
+		vfn_bcache_put(&c, pinned[i]);
+
+	/* write-back of adjacent dirty pages is merged into one command */
+	write_page(12, 0xaa);
+	write_page(10, 0xaa);
+	write_page(11, 0xaa);
+
+	ok1(nwrites == 0 && vfn_bcache_flush(&c, &q) == 0 && nwrites == 1 && last_write_nlb == 3);
+	ok1(disk[10 << LBADS] == 0xaa && disk[(13 << LBADS) - 1] == 0xaa &&
+	    disk[13 << LBADS] == 13);
+
+	/* with only dirty pages left, they are written back to make room */
+	for (int i = 0; i < 4; i++)
+		write_page((uint64_t)(20 + i), 0xbb);
+
+	ok1(get_check(30) && nwrites == 2 && last_write_nlb == 4 && disk[23 << LBADS] == 0xbb);
+
+	/* a failed read is not cached; the next lookup reads again */
+	fail_slba = 40;
+	reads = nreads;
+
+	ok1(!vfn_bcache_get(&c, &q, 40) && errno == EIO && nreads == reads + 1);
+
+	fail_slba = UINT64_MAX;
+
+	ok1(get_check(40) && nreads == reads + 2);
+
+	/* a failed write-back leaves the page dirty */
+	write_page(41, 0xcc);
+	fail_slba = 41;
+
+	ok1(vfn_bcache_flush(&c, &q) == -1 && errno == EIO && disk[41 << LBADS] == 41);
+
+	fail_slba = UINT64_MAX;
+
+	ok1(vfn_bcache_flush(&c, &q) == 0 && disk[41 << LBADS] == 0xcc);
+
+	vfn_bcache_destroy(&c);
+
+	atomic_store_release(&stop, true);
+	pthread_join(device_thread, NULL);
+
+	return exit_status();
+}
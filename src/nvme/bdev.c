@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/bdev: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "types.h"
+
+/* a run of plugged i/os merged into one command */
+struct bdev_run {
+	struct vfn_bdev_io *head, *tail;
+	uint64_t end;
+	uint32_t nlb;
+	int nios;
+
+	struct iovec iov[VFN_BDEV_MERGE_MAX];
+	int niov;
+};
+
+int vfn_bdev_open(struct vfn_bdev *bdev, struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+	struct nvme_ns *ns = nvme_ns_get(ctrl, nsid);
+
+	if (!ns) {
+		log_debug("nsid %"PRIu32" is not an active namespace\n", nsid);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ns->ms) {
+		log_debug("nsid %"PRIu32" is formatted with metadata\n", nsid);
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	bdev->ctrl = ctrl;
+	bdev->ns = ns;
+
+	return 0;
+}
+
+void vfn_bdev_queue_init(struct vfn_bdev_queue *q, struct vfn_bdev *bdev, struct nvme_sq *sq)
+{
+	memset(q, 0x0, sizeof(*q));
+
+	q->bdev = bdev;
+	q->sq = sq;
+}
+
+int vfn_bdev_add(struct vfn_bdev_queue *q, struct vfn_bdev_io *io)
+{
+	struct nvme_ns *ns = q->bdev->ns;
+
+	if ((io->op != VFN_BDEV_OP_READ && io->op != VFN_BDEV_OP_WRITE) || !io->nlb ||
+	    io->nlb > ns->max_nlb || io->slba >= ns->nsze || io->nlb > ns->nsze - io->slba) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (q->nplugged == VFN_BDEV_PLUG_MAX && vfn_bdev_unplug(q))
+		return -1;
+
+	q->plug[q->nplugged++] = io;
+
+	return 0;
+}
+
+static inline bool __io_before(struct vfn_bdev_io *a, struct vfn_bdev_io *b)
+{
+	return a->op < b->op || (a->op == b->op && a->slba < b->slba);
+}
+
+/* insertion sort; batches are small and often already (nearly) sorted */
+static void __sort(struct vfn_bdev_io **ios, int n)
+{
+	for (int i = 1; i < n; i++) {
+		struct vfn_bdev_io *io = ios[i];
+		int j = i;
+
+		for (; j > 0 && __io_before(io, ios[j - 1]); j--)
+			ios[j] = ios[j - 1];
+
+		ios[j] = io;
+	}
+}
+
+static void __run_init(struct bdev_run *r, struct vfn_bdev_io *io, size_t len)
+{
+	io->next = NULL;
+
+	r->head = r->tail = io;
+	r->end = io->slba + io->nlb;
+	r->nlb = io->nlb;
+	r->nios = 1;
+
+	r->iov[0] = (struct iovec) { .iov_base = (void *)io->iova, .iov_len = len };
+	r->niov = 1;
+}
+
+/*
+ * Append @io to the run if it continues the run on the device and the merged
+ * buffers can still be described by a single data pointer.
+ */
+static bool __run_add(struct vfn_bdev_queue *q, struct bdev_run *r, struct vfn_bdev_io *io,
+		      size_t len)
+{
+	struct nvme_ctrl *ctrl = q->bdev->ctrl;
+	struct iovec *last = &r->iov[r->niov - 1];
+	uint64_t last_end = (uint64_t)last->iov_base + last->iov_len;
+	uint64_t pagesize = __mps_to_pagesize(ctrl->config.mps);
+
+	if (io->op != r->head->op || io->slba != r->end || r->nios == VFN_BDEV_MERGE_MAX ||
+	    io->nlb > q->bdev->ns->max_nlb - r->nlb)
+		return false;
+
+	/* data with different placement hints must not end up in the same command */
+	if (io->dtype != r->head->dtype || io->dspec != r->head->dspec)
+		return false;
+
+	if (last_end == io->iova) {
+		last->iov_len += len;
+	} else {
+		if (ctrl->config.sgls & NVME_SGLS_SUPPORT_MASK) {
+			/* be conservative with respect to dword alignment requirements */
+			if (!ALIGNED(io->iova, 4))
+				return false;
+		} else if (!ALIGNED(last_end, pagesize) || !ALIGNED(io->iova, pagesize)) {
+			return false;
+		}
+
+		r->iov[r->niov++] = (struct iovec) { .iov_base = (void *)io->iova, .iov_len = len };
+	}
+
+	io->next = NULL;
+
+	r->tail->next = io;
+	r->tail = io;
+	r->end += io->nlb;
+	r->nlb += io->nlb;
+	r->nios++;
+
+	return true;
+}
+
+static void __bdev_complete(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *arg)
+{
+	struct vfn_bdev_io *io = arg, *next;
+
+	for (; io; io = next) {
+		/* the callback may reuse the i/o */
+		next = io->next;
+
+		io->cb(io, cqe);
+	}
+}
+
+static void __bdev_fail(struct vfn_bdev_io *io)
+{
+	struct nvme_cqe cqe = {
+		.sfp = cpu_to_le16(NVME_SC_INVALID_FIELD << 1),
+	};
+
+	__bdev_complete(NULL, &cqe, io);
+}
+
+static int __submit(struct vfn_bdev_queue *q, struct nvme_rq *rq, struct bdev_run *r)
+{
+	struct nvme_ctrl *ctrl = q->bdev->ctrl;
+	struct nvme_ns *ns = q->bdev->ns;
+	union nvme_cmd cmd;
+	int ret;
+
+	if (nvme_ns_prep_rw(ns, &cmd, r->head->op, r->head->slba, (size_t)r->nlb << ns->lbads))
+		return -1;
+
+	if (r->head->dtype)
+		nvme_rw_set_directive(&cmd, r->head->dtype, r->head->dspec);
+
+	if (r->niov == 1)
+		ret = nvme_rq_map(ctrl, rq, &cmd, (uint64_t)r->iov[0].iov_base, r->iov[0].iov_len);
+	else
+		ret = nvme_rq_mapv(ctrl, rq, &cmd, r->iov, r->niov);
+
+	if (ret)
+		return -1;
+
+	nvme_rq_submit(rq, &cmd, __bdev_complete, r->head);
+
+	return 0;
+}
+
+int vfn_bdev_unplug(struct vfn_bdev_queue *q)
+{
+	struct nvme_ns *ns = q->bdev->ns;
+	struct bdev_run r;
+	struct nvme_rq *rq;
+	int i = 0, j;
+
+	__sort(q->plug, q->nplugged);
+
+	while (i < q->nplugged) {
+		rq = nvme_rq_acquire(q->sq);
+		if (!rq)
+			break;
+
+		__run_init(&r, q->plug[i], (size_t)q->plug[i]->nlb << ns->lbads);
+
+		for (j = i + 1; j < q->nplugged; j++) {
+			struct vfn_bdev_io *io = q->plug[j];
+
+			if (!__run_add(q, &r, io, (size_t)io->nlb << ns->lbads))
+				break;
+		}
+
+		if (__submit(q, rq, &r)) {
+			log_debug("could not map i/o (slba 0x%"PRIx64")\n", r.head->slba);
+
+			nvme_rq_release(rq);
+
+			__bdev_fail(r.head);
+		} else {
+			q->commands++;
+			q->merged += (uint64_t)(r.nios - 1);
+		}
+
+		i = j;
+	}
+
+	/* one doorbell write for the entire batch */
+	nvme_sq_flush_tail(q->sq);
+
+	q->nplugged -= i;
+	if (q->nplugged) {
+		memmove(q->plug, &q->plug[i], (size_t)q->nplugged * sizeof(q->plug[0]));
+
+		errno = EBUSY;
+		return -1;
+	}
+
+	return 0;
+}
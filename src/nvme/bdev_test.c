@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/* count doorbell writes regardless of the build configuration */
+#define NVME_QSTATS
+
+#include "ccan/tap/tap.h"
+
+#include "bdev.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+static int ncompleted, nfailed;
+
+static void complete_cb(struct vfn_bdev_io *io UNUSED, struct nvme_cqe *cqe)
+{
+	if (nvme_cqe_ok(cqe))
+		ncompleted++;
+	else
+		nfailed++;
+}
+
+static void post_cqe(struct nvme_cq *cq, uint16_t idx, uint16_t sqid, uint16_t cid)
+{
+	struct nvme_cqe *cqe = cq->vaddr + (idx << NVME_CQES);
+
+	cqe->sqid = cpu_to_le16(sqid);
+	cqe->cid = cid;
+	cqe->sfp = cpu_to_le16(0x1);
+}
+
+static struct vfn_bdev_io ios[8];
+
+static void prep_io(int i, uint8_t op, uint64_t slba, uint32_t nlb, uint64_t iova)
+{
+	ios[i] = (struct vfn_bdev_io) {
+		.op = op, .slba = slba, .nlb = nlb, .iova = iova, .cb = complete_cb,
+	};
+}
+
+int main(void)
+{
+	struct nvme_ns ns = { .nsid = 1, .nsze = 0x100000, .lbads = 12, .max_nlb = 64 };
+	struct nvme_ctrl ctrl = { .ns = &ns, .nns = 1 };
+	uint32_t sqdb = 0, cqdb = 0;
+	struct nvme_sq sqs[2] = {};
+	struct nvme_rq rqs[3] = {};
+	struct nvme_cq cq = {
+		.qsize = 8,
+		.doorbell = &cqdb,
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+	struct vfn_bdev bdev;
+	struct vfn_bdev_queue q;
+	struct nvme_rq *rq;
+	union nvme_cmd *sqes;
+	uint64_t *prplist;
+
+	plan_tests(27);
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = 8,
+		.doorbell = &sqdb,
+		.cq = &cq,
+		.rqs = rqs,
+	};
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+	sqes = sqs[1].vaddr;
+
+	for (int i = 2; i >= 0; i--) {
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+
+		assert(pgmap(&rqs[i].page.vaddr, __VFN_PAGESIZE) > 0);
+		rqs[i].page.iova = (uint64_t)rqs[i].page.vaddr;
+
+		nvme_rq_release(&rqs[i]);
+	}
+
+	ok1(vfn_bdev_open(&bdev, &ctrl, 2) == -1 && errno == EINVAL);
+	ok1(vfn_bdev_open(&bdev, &ctrl, 1) == 0);
+
+	vfn_bdev_queue_init(&q, &bdev, &sqs[1]);
+
+	/* out of range */
+	prep_io(0, VFN_BDEV_OP_READ, ns.nsze - 1, 2, 0x1000000);
+	ok1(vfn_bdev_add(&q, &ios[0]) == -1 && errno == EINVAL);
+
+	prep_io(0, VFN_BDEV_OP_READ, 0x0, 0, 0x1000000);
+	ok1(vfn_bdev_add(&q, &ios[0]) == -1 && errno == EINVAL);
+
+	/*
+	 * Three adjacent writes (added out of order) with contiguous buffers, a
+	 * write elsewhere and a read of the same range.
+	 */
+	prep_io(0, VFN_BDEV_OP_WRITE, 0x8, 8, 0x1008000);
+	prep_io(1, VFN_BDEV_OP_READ, 0x0, 8, 0x2000000);
+	prep_io(2, VFN_BDEV_OP_WRITE, 0x0, 8, 0x1000000);
+	prep_io(3, VFN_BDEV_OP_WRITE, 0x100, 8, 0x3000000);
+	prep_io(4, VFN_BDEV_OP_WRITE, 0x10, 8, 0x1010000);
+
+	for (int i = 0; i < 5; i++)
+		assert(vfn_bdev_add(&q, &ios[i]) == 0);
+
+	ok1(sqdb == 0);
+
+	ok1(vfn_bdev_unplug(&q) == 0);
+	ok1(q.commands == 3 && q.merged == 2 && !q.nplugged);
+
+	/* one doorbell write for the batch */
+	ok1(sqdb == 3 && sqs[1].stats.doorbells == 1);
+
+	ok1(sqes[0].opcode == VFN_BDEV_OP_WRITE && le64_to_cpu(sqes[0].rw.slba) == 0x0);
+	ok1(le16_to_cpu(sqes[0].rw.nlb) == 23 && le64_to_cpu(sqes[0].dptr.prp1) == 0x1000000);
+
+	prplist = rqs[0].page.vaddr;
+	ok1(le64_to_cpu(sqes[0].dptr.prp2) == rqs[0].page.iova);
+	ok1(le64_to_cpu(prplist[0]) == 0x1001000 && le64_to_cpu(prplist[22]) == 0x1017000);
+
+	ok1(le64_to_cpu(sqes[1].rw.slba) == 0x100 && le16_to_cpu(sqes[1].rw.nlb) == 7);
+	ok1(sqes[2].opcode == VFN_BDEV_OP_READ && le16_to_cpu(sqes[2].rw.nlb) == 7);
+
+	/* out of request trackers */
+	ok1(!nvme_rq_acquire(&sqs[1]));
+
+	post_cqe(&cq, 0, 1, 0);
+	post_cqe(&cq, 1, 1, 1);
+	post_cqe(&cq, 2, 1, 2);
+
+	/* every merged i/o is completed */
+	ok1(vfn_bdev_poll(&q, 8) == 3 && ncompleted == 5 && !nfailed);
+
+	/*
+	 * Page aligned (but not contiguous) buffers are merged into an iovec;
+	 * unaligned buffers are not.
+	 */
+	prep_io(0, VFN_BDEV_OP_WRITE, 0x200, 1, 0x4000000);
+	prep_io(1, VFN_BDEV_OP_WRITE, 0x201, 1, 0x5000000);
+	prep_io(2, VFN_BDEV_OP_WRITE, 0x202, 1, 0x6000800);
+	prep_io(3, VFN_BDEV_OP_WRITE, 0x203, 1, 0x7000000);
+
+	for (int i = 0; i < 4; i++)
+		assert(vfn_bdev_add(&q, &ios[i]) == 0);
+
+	/* hold a tracker back; two commands fit and the third must wait */
+	rq = nvme_rq_acquire(&sqs[1]);
+	assert(rq);
+
+	ok1(vfn_bdev_unplug(&q) == -1 && errno == EBUSY);
+	ok1(q.commands == 5 && q.merged == 3 && q.nplugged == 1 && q.plug[0] == &ios[3]);
+	ok1(sqdb == 5 && sqs[1].stats.doorbells == 2);
+
+	ok1(le64_to_cpu(sqes[3].dptr.prp1) == 0x4000000 &&
+	    le64_to_cpu(sqes[3].dptr.prp2) == 0x5000000);
+	ok1(le16_to_cpu(sqes[3].rw.nlb) == 1 && le64_to_cpu(sqes[4].dptr.prp1) == 0x6000800);
+
+	post_cqe(&cq, 3, 1, sqes[3].cid);
+	ok1(vfn_bdev_poll(&q, 8) == 1 && ncompleted == 7);
+
+	nvme_rq_release(rq);
+
+	ok1(vfn_bdev_unplug(&q) == 0 && !q.nplugged && sqdb == 6);
+
+	/* the second write did not merge with the unaligned buffer */
+	ok1(le64_to_cpu(sqes[5].rw.slba) == 0x203);
+
+	post_cqe(&cq, 4, 1, sqes[4].cid);
+	post_cqe(&cq, 5, 1, sqes[5].cid);
+	assert(vfn_bdev_poll(&q, 8) == 2);
+
+	/* adjacent writes with different placement hints are not merged */
+	prep_io(0, VFN_BDEV_OP_WRITE, 0x300, 1, 0x8000000);
+	prep_io(1, VFN_BDEV_OP_WRITE, 0x301, 1, 0x8001000);
+	ios[0].dtype = ios[1].dtype = NVME_DIR_TYPE_FDP;
+	ios[1].dspec = 0x1;
+
+	for (int i = 0; i < 2; i++)
+		assert(vfn_bdev_add(&q, &ios[i]) == 0);
+
+	ok1(vfn_bdev_unplug(&q) == 0 && q.commands == 8 && q.merged == 3);
+	ok1(le32_to_cpu(sqes[6].cdw12) >> 20 == NVME_DIR_TYPE_FDP && !sqes[6].rw.dspec);
+	ok1(le64_to_cpu(sqes[7].rw.slba) == 0x301 && le16_to_cpu(sqes[7].rw.dspec) == 0x1);
+
+	return exit_status();
+}
@@ -0,0 +1,271 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/cmb: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/pci_regs.h>
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "iommu/iova.h"
+
+#include "types.h"
+
+/* the pci bus address of the cmb */
+static int nvme_cmb_bus_addr(struct nvme_ctrl *ctrl, uint64_t *addr)
+{
+	off_t bar = PCI_BASE_ADDRESS_0 + 4 * ctrl->cmb.bir;
+	uint32_t lo, hi = 0;
+
+	if (vfio_pci_read_config(&ctrl->pci, &lo, sizeof(lo), bar) < 0)
+		return -1;
+
+	if ((lo & PCI_BASE_ADDRESS_MEM_TYPE_MASK) == PCI_BASE_ADDRESS_MEM_TYPE_64 &&
+	    vfio_pci_read_config(&ctrl->pci, &hi, sizeof(hi), bar + 4) < 0)
+		return -1;
+
+	*addr = ((uint64_t)hi << 32 | (lo & PCI_BASE_ADDRESS_MEM_MASK)) + ctrl->cmb.ofst;
+
+	return 0;
+}
+
+/*
+ * Find a 4k aligned base for @len bytes outside of all iova ranges, preferring
+ * the highest hole. Zero is never chosen.
+ */
+static int nvme_cmb_find_hole(struct iommu_iova_range *ranges, int nranges, uint64_t len,
+			      uint64_t *iova)
+{
+	for (int i = nranges; i >= 0; i--) {
+		uint64_t lo = i ? ranges[i - 1].last + 1 : 0;
+		uint64_t hi = i < nranges ? ranges[i].start - 1 : UINT64_MAX;
+		uint64_t base;
+
+		/* no hole above a range ending at the top, or between adjacent ranges */
+		if ((i && ranges[i - 1].last == UINT64_MAX) || (i < nranges && !ranges[i].start) ||
+		    lo > hi)
+			continue;
+
+		if (lo > UINT64_MAX - 4095)
+			continue;
+
+		base = max_t(uint64_t, ALIGN_UP(lo, 4096), 4096);
+
+		if (base > hi || hi - base < len - 1)
+			continue;
+
+		*iova = base;
+
+		return 0;
+	}
+
+	errno = ENOSPC;
+	return -1;
+}
+
+/* choose the address at which the controller (and its peers) address the cmb */
+static int nvme_cmb_set_iova(struct nvme_ctrl *ctrl, uint64_t cap, unsigned long flags)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+
+	if (!NVME_FIELD_GET(cap, CAP_CMBS)) {
+		/* without CMBMSC, the cmb is addressed by the pci bus address */
+		if (nvme_cmb_bus_addr(ctrl, &ctrl->cmb.iova))
+			return -1;
+
+		/* make the bus address valid in the iommu domain of peers as well */
+		if (flags & NVME_CMB_F_P2P &&
+		    iommu_map_vaddr(ctx, ctrl->cmb.vaddr, ctrl->cmb.len, &ctrl->cmb.iova,
+				    IOMMU_MAP_FIXED_IOVA)) {
+			log_debug("could not map cmb at its bus address\n");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (flags & NVME_CMB_F_P2P) {
+		/* the controller decodes the iova on its own; peers go through the iommu */
+		if (iommu_map_vaddr(ctx, ctrl->cmb.vaddr, ctrl->cmb.len, &ctrl->cmb.iova, 0)) {
+			log_debug("could not map cmb\n");
+			return -1;
+		}
+	} else {
+		struct iommu_iova_range *ranges;
+		int nranges;
+
+		nranges = iommu_get_iova_ranges(ctx, &ranges);
+		if (nranges <= 0) {
+			log_debug("no iova ranges\n");
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		/* choose a base address that is guaranteed not to be involved in dma */
+		if (nvme_cmb_find_hole(ranges, nranges, ctrl->cmb.len, &ctrl->cmb.iova)) {
+			log_debug("no hole in the iova space for the cmb\n");
+			return -1;
+		}
+	}
+
+	mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC,
+			cpu_to_le64(ctrl->cmb.iova | NVME_CMBMSC_CMSE | NVME_CMBMSC_CRE));
+
+	return 0;
+}
+
+int nvme_cmb_init(struct nvme_ctrl *ctrl, unsigned long flags)
+{
+	uint32_t cmbloc;
+	uint64_t cap, szu;
+
+	if (ctrl->cmb.vaddr) {
+		if (flags & NVME_CMB_F_P2P && !ctrl->cmb.p2p) {
+			log_debug("cmb already initialized without p2p\n");
+
+			errno = EBUSY;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	cap = ctrl->reg.cap;
+
+	/* the cmb registers must be explicitly enabled if CAP.CMBS is set */
+	if (NVME_FIELD_GET(cap, CAP_CMBS)) {
+		mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC, cpu_to_le64(NVME_CMBMSC_CRE));
+
+		/* the registers read as zero until enabled; refresh the cached values */
+		ctrl->reg.cmbsz = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBSZ));
+		ctrl->reg.cmbloc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBLOC));
+	}
+
+	ctrl->cmb.sz = ctrl->reg.cmbsz;
+	if (!NVME_FIELD_GET(ctrl->cmb.sz, CMBSZ_SZ)) {
+		log_debug("controller has no cmb\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	cmbloc = ctrl->reg.cmbloc;
+
+	szu = 1ULL << (12 + 4 * NVME_FIELD_GET(ctrl->cmb.sz, CMBSZ_SZU));
+
+	ctrl->cmb.len = szu * NVME_FIELD_GET(ctrl->cmb.sz, CMBSZ_SZ);
+	ctrl->cmb.ofst = szu * NVME_FIELD_GET(cmbloc, CMBLOC_OFST);
+	ctrl->cmb.bir = NVME_FIELD_GET(cmbloc, CMBLOC_BIR);
+
+	ctrl->cmb.vaddr = vfio_pci_map_bar_wc(&ctrl->pci, ctrl->cmb.bir, ctrl->cmb.len,
+					      ctrl->cmb.ofst, PROT_READ | PROT_WRITE);
+	if (!ctrl->cmb.vaddr) {
+		log_debug("could not map cmb\n");
+		return -1;
+	}
+
+	if (nvme_cmb_set_iova(ctrl, cap, flags))
+		goto unmap;
+
+	ctrl->cmb.p2p = !!(flags & NVME_CMB_F_P2P);
+
+	ctrl->cmb.range = (struct iommu_iova_range) {
+		.start = ctrl->cmb.iova,
+		.last = ctrl->cmb.iova + ctrl->cmb.len - 1,
+	};
+
+	ctrl->cmb.alloc = znew_t(struct iova_allocator, 1);
+
+	/* few and large allocations; no need for per-thread caching */
+	iova_allocator_init(ctrl->cmb.alloc, &ctrl->cmb.range, 1, false);
+
+	return 0;
+
+unmap:
+	vfio_pci_unmap_bar(&ctrl->pci, ctrl->cmb.bir, ctrl->cmb.vaddr, ctrl->cmb.len,
+			   ctrl->cmb.ofst);
+
+	ctrl->cmb.vaddr = NULL;
+
+	return -1;
+}
+
+static inline size_t __cmb_len(struct nvme_ctrl *ctrl, size_t len)
+{
+	return ALIGN_UP(len, max_t(size_t, __VFN_PAGESIZE, __mps_to_pagesize(ctrl->config.mps)));
+}
+
+int nvme_cmb_alloc(struct nvme_ctrl *ctrl, size_t len, void **vaddr, uint64_t *iova)
+{
+	uint64_t _iova;
+
+	if (nvme_cmb_init(ctrl, 0))
+		return -1;
+
+	if (iova_alloc(ctrl->cmb.alloc, __cmb_len(ctrl, len), &_iova)) {
+		log_debug("insufficient space in cmb\n");
+
+		errno = ENOMEM;
+		return -1;
+	}
+
+	*vaddr = ctrl->cmb.vaddr + (_iova - ctrl->cmb.iova);
+	*iova = _iova;
+
+	return 0;
+}
+
+void nvme_cmb_free(struct nvme_ctrl *ctrl, void *vaddr, size_t len)
+{
+	uint64_t iova = ctrl->cmb.iova + (uint64_t)(vaddr - ctrl->cmb.vaddr);
+
+	iova_release(ctrl->cmb.alloc, iova, __cmb_len(ctrl, len));
+}
+
+void nvme_cmb_close(struct nvme_ctrl *ctrl)
+{
+	if (!ctrl->cmb.vaddr)
+		return;
+
+	if (ctrl->cmb.p2p && iommu_unmap_vaddr(__iommu_ctx(ctrl), ctrl->cmb.vaddr, NULL))
+		log_debug("could not unmap cmb\n");
+
+	iova_allocator_destroy(ctrl->cmb.alloc);
+	free(ctrl->cmb.alloc);
+
+	vfio_pci_unmap_bar(&ctrl->pci, ctrl->cmb.bir, ctrl->cmb.vaddr, ctrl->cmb.len,
+			   ctrl->cmb.ofst);
+
+	memset(&ctrl->cmb, 0x0, sizeof(ctrl->cmb));
+}
@@ -21,12 +21,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
 
+#include <linux/pci_regs.h>
 #include <linux/vfio.h>
 
 #include <vfn/support.h>
@@ -42,26 +45,308 @@
 #include "ccan/time/time.h"
 
 #include "types.h"
+#include "mock.h"
+#include "qmem.h"
 
-#define cqhdbl(doorbells, qid, dstrd) \
-	(doorbells + (2 * qid + 1) * (4 << dstrd))
+#define cqhdbl(doorbells, qid, stride) \
+	(doorbells + (2 * qid + 1) * (stride))
 
-#define sqtdbl(doorbells, qid, dstrd) \
-	(doorbells + (2 * qid) * (4 << dstrd))
+#define sqtdbl(doorbells, qid, stride) \
+	(doorbells + (2 * qid) * (stride))
 
 enum nvme_ctrl_feature_flags {
 	NVME_CTRL_F_ADMINISTRATIVE = 1 << 0,
 };
 
-static int nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+/* preferred numa node of the memory of queue @qid (or -1) */
+static inline int __queue_node(struct nvme_ctrl *ctrl, int qid)
+{
+	return ctrl->numa.qnodes ? ctrl->numa.qnodes[qid] : ctrl->numa.node;
+}
+
+/*
+ * Queue memory (rings and prp list pages) is carved out of the most recently
+ * set up region (see nvme_queue_mem_reserve()) while it has room, and mapped
+ * separately otherwise. Carved areas are aligned to the controller page size
+ * (queues must be page aligned) and a region is released with the last queue
+ * carved from it. Regions of queue pairs that may be leased to other processes
+ * are backed by a memfd (see nvme_export_ioqpair()).
+ */
+struct nvme_queue_mem {
+	void *vaddr;
+	uint64_t iova;
+	size_t len, used;
+	int node, refs;
+
+	/* memfd backing the region if it may be shared (see NVME_IOSQ_F_SHARED) */
+	int fd;
+
+	struct nvme_queue_mem *next;
+};
+
+static inline size_t __queue_mem_align(struct nvme_ctrl *ctrl, size_t len)
+{
+	return ALIGN_UP(len, __mps_to_pagesize(ctrl->config.mps));
+}
+
+/* take a region of at least @len bytes on @node from the recycled regions */
+static struct nvme_queue_mem *__queue_mem_reuse(struct nvme_ctrl *ctrl, size_t len, int node,
+						bool shared)
+{
+	for (struct nvme_queue_mem **p = &ctrl->qmem_pool; *p; p = &(*p)->next) {
+		struct nvme_queue_mem *qmem = *p;
+
+		if (qmem->node != node || qmem->len < len || (qmem->fd >= 0) != shared)
+			continue;
+
+		*p = qmem->next;
+
+		qmem->used = 0;
+
+		return qmem;
+	}
+
+	return NULL;
+}
+
+/* back a region with a memfd, such that it can be mapped by another process */
+static int __queue_mem_alloc_shared(struct nvme_ctrl *ctrl, struct nvme_queue_mem *qmem)
+{
+	qmem->fd = memfd_create("vfn-queue-mem", MFD_CLOEXEC);
+	if (qmem->fd < 0) {
+		log_debug("could not create memfd\n");
+		return -1;
+	}
+
+	if (ftruncate(qmem->fd, (off_t)qmem->len)) {
+		log_debug("could not size memfd\n");
+		goto close_fd;
+	}
+
+	qmem->vaddr = mmap(NULL, qmem->len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   qmem->fd, 0);
+	if (qmem->vaddr == MAP_FAILED) {
+		log_debug("could not map memfd\n");
+		goto close_fd;
+	}
+
+	if (pgbind(qmem->vaddr, qmem->len, qmem->node))
+		log_debug("could not bind queue memory to node %d\n", qmem->node);
+
+	if (iommu_map_vaddr_file(__iommu_ctx(ctrl), qmem->vaddr, qmem->len, qmem->fd, 0,
+				 &qmem->iova, 0x0)) {
+		log_debug("failed to map vaddr\n");
+		goto unmap;
+	}
+
+	return 0;
+
+unmap:
+	munmap(qmem->vaddr, qmem->len);
+close_fd:
+	log_fatal_if(close(qmem->fd), "close: %s\n", strerror(errno));
+
+	return -1;
+}
+
+static void __queue_mem_free(struct nvme_ctrl *ctrl, struct nvme_queue_mem *qmem)
+{
+	if (qmem->fd < 0) {
+		iommu_free(__iommu_ctx(ctrl), qmem->vaddr, qmem->len);
+		goto out;
+	}
+
+	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), qmem->vaddr, NULL))
+		log_debug("failed to unmap vaddr\n");
+
+	munmap(qmem->vaddr, qmem->len);
+	log_fatal_if(close(qmem->fd), "close: %s\n", strerror(errno));
+
+out:
+	free(qmem);
+}
+
+/* set up a region of @len bytes on @node to carve the next queues from */
+static int nvme_queue_mem_reserve(struct nvme_ctrl *ctrl, size_t len, int node, bool shared)
+{
+	struct nvme_queue_mem *qmem = __queue_mem_reuse(ctrl, len, node, shared);
+
+	if (qmem)
+		goto out;
+
+	qmem = znew_t(struct nvme_queue_mem, 1);
+
+	qmem->len = len;
+	qmem->node = node;
+	qmem->fd = -1;
+
+	if (shared) {
+		if (__queue_mem_alloc_shared(ctrl, qmem)) {
+			free(qmem);
+			return -1;
+		}
+
+		goto out;
+	}
+
+	if (iommu_alloc_node(__iommu_ctx(ctrl), len, node, &qmem->vaddr, &qmem->iova)) {
+		log_debug("could not allocate queue memory; mapping queues separately\n");
+
+		free(qmem);
+		return -1;
+	}
+
+out:
+	qmem->next = ctrl->qmem;
+	ctrl->qmem = qmem;
+
+	return 0;
+}
+
+static void __queue_mem_release(struct nvme_ctrl *ctrl, struct nvme_queue_mem *qmem)
+{
+	struct nvme_queue_mem **p = &ctrl->qmem;
+
+	while (*p != qmem)
+		p = &(*p)->next;
+
+	*p = qmem->next;
+
+	/* keep the region mapped for queues created later */
+	if (ctrl->qmem_recycle) {
+		qmem->next = ctrl->qmem_pool;
+		ctrl->qmem_pool = qmem;
+
+		return;
+	}
+
+	__queue_mem_free(ctrl, qmem);
+}
+
+static void __queue_mem_drain(struct nvme_ctrl *ctrl)
+{
+	struct nvme_queue_mem *qmem;
+
+	while ((qmem = ctrl->qmem_pool)) {
+		ctrl->qmem_pool = qmem->next;
+
+		__queue_mem_free(ctrl, qmem);
+	}
+}
+
+void nvme_queue_mem_recycle(struct nvme_ctrl *ctrl, bool enable)
+{
+	if (enable) {
+		ctrl->qmem_recycle++;
+		return;
+	}
+
+	/* still enabled by another user */
+	if (ctrl->qmem_recycle && --ctrl->qmem_recycle)
+		return;
+
+	__queue_mem_drain(ctrl);
+}
+
+/*
+ * Stop carving queues out of the current region (queues created later are
+ * mapped individually) and release it if nothing was carved from it.
+ */
+static void nvme_queue_mem_seal(struct nvme_ctrl *ctrl)
+{
+	struct nvme_queue_mem *qmem = ctrl->qmem;
+
+	if (!qmem)
+		return;
+
+	if (!qmem->refs) {
+		__queue_mem_release(ctrl, qmem);
+		return;
+	}
+
+	qmem->used = qmem->len;
+}
+
+static ssize_t nvme_queue_mem_alloc(struct nvme_ctrl *ctrl, int node, unsigned int n, size_t sz,
+				    void **vaddr, uint64_t *iova)
+{
+	struct nvme_queue_mem *qmem = ctrl->qmem;
+	size_t len = __queue_mem_align(ctrl, (size_t)n * sz);
+	ssize_t ret;
+
+	if (qmem && node == qmem->node && qmem->used + len <= qmem->len) {
+		*vaddr = qmem->vaddr + qmem->used;
+		*iova = qmem->iova + qmem->used;
+
+		/* iommu_alloc() memory may be recycled */
+		memset(*vaddr, 0x0, len);
+
+		qmem->used += len;
+		qmem->refs++;
+
+		return (ssize_t)len;
+	}
+
+	ret = pgmapn(vaddr, n, sz);
+	if (ret < 0)
+		return -1;
+
+	if (pgbind(*vaddr, (size_t)ret, node))
+		log_debug("could not bind queue memory to node %d\n", node);
+
+	if (iommu_map_vaddr(__iommu_ctx(ctrl), *vaddr, (size_t)ret, iova, 0x0)) {
+		log_debug("failed to map vaddr\n");
+
+		pgunmap(*vaddr, (size_t)ret);
+		return -1;
+	}
+
+	return ret;
+}
+
+static void nvme_queue_mem_free(struct nvme_ctrl *ctrl, void *vaddr)
 {
-	struct nvme_cq *cq = &ctrl->cq[qid];
-	uint64_t cap;
-	uint8_t dstrd;
 	size_t len;
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
-	dstrd = NVME_FIELD_GET(cap, CAP_DSTRD);
+	for (struct nvme_queue_mem *qmem = ctrl->qmem; qmem; qmem = qmem->next) {
+		if (vaddr < qmem->vaddr || vaddr >= qmem->vaddr + qmem->len)
+			continue;
+
+		if (--qmem->refs == 0)
+			__queue_mem_release(ctrl, qmem);
+
+		return;
+	}
+
+	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), vaddr, &len))
+		log_debug("failed to unmap vaddr\n");
+
+	pgunmap(vaddr, len);
+}
+
+int nvme_queue_mem_find(struct nvme_ctrl *ctrl, void *vaddr, int *fd, size_t *offset)
+{
+	for (struct nvme_queue_mem *qmem = ctrl->qmem; qmem; qmem = qmem->next) {
+		if (vaddr < qmem->vaddr || vaddr >= qmem->vaddr + qmem->len)
+			continue;
+
+		if (qmem->fd < 0)
+			break;
+
+		*fd = qmem->fd;
+		*offset = (size_t)(vaddr - qmem->vaddr);
+
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static int nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+{
+	struct nvme_cq *cq = &ctrl->cq[qid];
+	uint32_t stride = ctrl->reg.dbstride;
 
 	if (qid && qid > ctrl->config.ncqa + 1) {
 		log_debug("qid %d invalid; max qid is %d\n", qid, ctrl->config.ncqa + 1);
@@ -83,38 +368,97 @@ static int nvme_configure_cq(struct nvme_ctrl *ctrl, int qid, int qsize, int vec
 	*cq = (struct nvme_cq) {
 		.id = qid,
 		.qsize = qsize,
-		.doorbell = cqhdbl(ctrl->doorbells, qid, dstrd),
+		.doorbell = cqhdbl(ctrl->doorbells, qid, stride),
 		.vector = vector,
+		.efd = -1,
+		.poll.opts = ctrl->opts.cq_poll,
+		.nsqs = ctrl->opts.nsqr + 2,
+		.sqs = ctrl->sq,
 	};
 
 	if (ctrl->dbbuf.doorbells) {
-		cq->dbbuf.doorbell = cqhdbl(ctrl->dbbuf.doorbells, qid, dstrd);
-		cq->dbbuf.eventidx = cqhdbl(ctrl->dbbuf.eventidxs, qid, dstrd);
+		cq->dbbuf.doorbell = cqhdbl(ctrl->dbbuf.doorbells, qid, stride);
+		cq->dbbuf.eventidx = cqhdbl(ctrl->dbbuf.eventidxs, qid, stride);
 	}
 
-	len = pgmapn(&cq->vaddr, qsize, 1 << NVME_CQES);
+	if (nvme_queue_mem_alloc(ctrl, __queue_node(ctrl, qid), (unsigned int)qsize,
+				 1 << NVME_CQES, &cq->vaddr, &cq->iova) < 0)
+		return -1;
 
-	if (iommu_map_vaddr(__iommu_ctx(ctrl), cq->vaddr, len, &cq->iova, 0x0)) {
-		log_debug("failed to map vaddr\n");
+	return 0;
+}
 
-		pgunmap(cq->vaddr, len);
-		return -1;
+static void nvme_cq_set_irq_mode(struct nvme_cq *cq, bool irq, void *opaque)
+{
+	struct nvme_ctrl *ctrl = opaque;
+
+	/* coalescing only adds latency when waiting on the interrupt */
+	if (nvme_set_irq_vector_coalescing(ctrl, (uint16_t)cq->vector, !irq))
+		log_debug("failed to %s coalescing for vector %d\n", irq ? "disable" : "enable",
+			  cq->vector);
+}
+
+static void nvme_configure_cq_irq(struct nvme_ctrl *ctrl, struct nvme_cq *cq)
+{
+	int efd;
+
+	/* the emulated controller does not interrupt */
+	if (ctrl->mock)
+		return;
+
+	/*
+	 * A vector has a single trigger; wiring a second eventfd would steal it
+	 * from the queue that owns it (and discarding either queue disables it).
+	 */
+	for (int qid = 0; qid < ctrl->opts.ncqr + 2; qid++) {
+		struct nvme_cq *other = &ctrl->cq[qid];
+
+		if (other != cq && other->vaddr && other->efd >= 0 &&
+		    other->vector == cq->vector) {
+			log_info("vector %d is shared with cq %d; cq %d will be polled\n",
+				 cq->vector, other->id, cq->id);
+			return;
+		}
 	}
 
-	return 0;
+	efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd < 0) {
+		log_debug("failed to create eventfd\n");
+		return;
+	}
+
+	/* not fatal; nvme_cq_wait_hybrid() falls back to polling */
+	if (vfio_set_irq_range(&ctrl->pci.dev, &efd, cq->vector, 1)) {
+		log_info("failed to set irq for vector %d; cq %d will be polled\n",
+			 cq->vector, cq->id);
+
+		close(efd);
+		return;
+	}
+
+	cq->efd = efd;
+
+	if (cq->poll.opts.coalesce) {
+		cq->poll.set_irq_mode = nvme_cq_set_irq_mode;
+		cq->poll.opaque = ctrl;
+	}
 }
 
 static void nvme_discard_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq)
 {
-	size_t len;
-
 	if (!cq->vaddr)
 		return;
 
-	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), cq->vaddr, &len))
-		log_debug("failed to unmap vaddr\n");
+	nvme_queue_mem_free(ctrl, cq->vaddr);
+
+	if (cq->efd >= 0) {
+		int efd = -1;
 
-	pgunmap(cq->vaddr, len);
+		if (vfio_set_irq_range(&ctrl->pci.dev, &efd, cq->vector, 1))
+			log_debug("failed to disable irq\n");
+
+		close(cq->efd);
+	}
 
 	if (ctrl->dbbuf.doorbells) {
 		__STORE_PTR(uint32_t *, cq->dbbuf.doorbell, 0);
@@ -124,16 +468,67 @@ static void nvme_discard_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq)
 	memset(cq, 0x0, sizeof(*cq));
 }
 
+/*
+ * Number of extra prp list pages to provision per I/O submission queue, such
+ * that this many maximum sized (or, if the controller does not limit the
+ * transfer size, NVME_PRP_POOL_UNLIMITED_XFER sized) transfers can be in
+ * flight at a time.
+ */
+#define NVME_PRP_POOL_CMDS 8
+#define NVME_PRP_POOL_UNLIMITED_XFER (8ULL << 20)
+
+static int nvme_prp_pool_size(struct nvme_ctrl *ctrl, int qid, int qsize)
+{
+	size_t pagesize = __mps_to_pagesize(ctrl->config.mps);
+	size_t nentries = pagesize >> 3, mdts = ctrl->config.mdts, prps;
+
+	if (!qid)
+		return 0;
+
+	if (!mdts)
+		mdts = NVME_PRP_POOL_UNLIMITED_XFER;
+
+	/* list entries of an unaligned transfer (prp1 is not in the list) */
+	prps = mdts / pagesize;
+	if (prps <= nentries)
+		return 0;
+
+	/* each chained list page gives up an entry for the next page pointer */
+	return (int)((prps - 2) / (nentries - 1) * (size_t)min(qsize - 1, NVME_PRP_POOL_CMDS));
+}
+
+static int nvme_configure_sq_bufs(struct nvme_ctrl *ctrl, struct nvme_sq *sq, size_t buf_size)
+{
+	size_t len;
+
+	buf_size = ALIGN_UP(buf_size, __mps_to_pagesize(ctrl->config.mps));
+	len = buf_size * (size_t)(sq->qsize - 1);
+
+	if (iommu_alloc_node(__iommu_ctx(ctrl), len, __queue_node(ctrl, sq->id), &sq->bufs.vaddr,
+			     &sq->bufs.iova)) {
+		log_debug("failed to allocate data buffers\n");
+		return -1;
+	}
+
+	sq->bufs.len = len;
+
+	for (int i = 0; i < sq->qsize - 1; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+
+		rq->buf.vaddr = sq->bufs.vaddr + i * buf_size;
+		rq->buf.iova = sq->bufs.iova + i * buf_size;
+		rq->buf.len = buf_size;
+	}
+
+	return 0;
+}
+
 static int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
-			     struct nvme_cq *cq, unsigned long UNUSED flags)
+			     struct nvme_cq *cq, unsigned long flags, size_t buf_size)
 {
 	struct nvme_sq *sq = &ctrl->sq[qid];
-	uint64_t cap;
-	uint8_t dstrd;
-	ssize_t len;
-
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
-	dstrd = NVME_FIELD_GET(cap, CAP_DSTRD);
+	uint32_t stride = ctrl->reg.dbstride;
+	int npool;
 
 	if (qid && qid > ctrl->config.nsqa + 1) {
 		log_debug("qid %d invalid; max qid is %d\n", qid, ctrl->config.nsqa + 1);
@@ -155,31 +550,50 @@ static int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 	*sq = (struct nvme_sq) {
 		.id = qid,
 		.qsize = qsize,
-		.doorbell = sqtdbl(ctrl->doorbells, qid, dstrd),
+		.doorbell = sqtdbl(ctrl->doorbells, qid, stride),
 		.cq = cq,
 	};
 
 	if (ctrl->dbbuf.doorbells) {
-		sq->dbbuf.doorbell = sqtdbl(ctrl->dbbuf.doorbells, qid, dstrd);
-		sq->dbbuf.eventidx = sqtdbl(ctrl->dbbuf.eventidxs, qid, dstrd);
+		sq->dbbuf.doorbell = sqtdbl(ctrl->dbbuf.doorbells, qid, stride);
+		sq->dbbuf.eventidx = sqtdbl(ctrl->dbbuf.eventidxs, qid, stride);
 	}
 
 	/*
 	 * Use ctrl->config.mps instead of host page size, as we have the
 	 * opportunity to pack the allocations.
 	 */
-	len = pgmapn(&sq->pages.vaddr, qsize, __mps_to_pagesize(ctrl->config.mps));
+	npool = nvme_prp_pool_size(ctrl, qid, qsize);
 
-	if (len < 0)
+	if (nvme_queue_mem_alloc(ctrl, __queue_node(ctrl, qid), (unsigned int)(qsize + npool),
+				 __mps_to_pagesize(ctrl->config.mps), &sq->pages.vaddr,
+				 &sq->pages.iova) < 0)
 		return -1;
 
-	if (iommu_map_vaddr(__iommu_ctx(ctrl), sq->pages.vaddr, len, &sq->pages.iova, 0x0)) {
-		log_debug("failed to map vaddr\n");
-		goto unmap_pages;
+	if (npool) {
+		sq->prp_pages = znew_t(struct nvme_prp_page, npool);
+		sq->nprp_pages = npool;
+
+		for (int i = 0; i < npool; i++) {
+			struct nvme_prp_page *page = &sq->prp_pages[i];
+			size_t ofst = (size_t)(qsize + i) << __mps_to_pageshift(ctrl->config.mps);
+
+			page->vaddr = sq->pages.vaddr + ofst;
+			page->iova = sq->pages.iova + ofst;
+
+			if (i > 0)
+				page->next = &sq->prp_pages[i - 1];
+		}
+
+		sq->prp_top = __nvme_prp_top_set(sq, 0, &sq->prp_pages[npool - 1]);
 	}
 
-	sq->rqs = znew_t(struct nvme_rq, qsize - 1);
-	sq->rq_top = &sq->rqs[qsize - 2];
+	/*
+	 * A spare (never acquired) tracker keeps command identifiers masked by
+	 * the queue size in bounds (see NVME_QUEUE_POW2_DEFINE()).
+	 */
+	sq->rqs = znew_aligned_t(struct nvme_rq, qsize);
+	sq->rq_top = __nvme_rq_top_set(sq, 0, &sq->rqs[qsize - 2]);
 
 	for (int i = 0; i < qsize - 1; i++) {
 		struct nvme_rq *rq = &sq->rqs[i];
@@ -194,48 +608,68 @@ static int nvme_configure_sq(struct nvme_ctrl *ctrl, int qid, int qsize,
 			rq->rq_next = &sq->rqs[i - 1];
 	}
 
-	len = pgmapn(&sq->vaddr, qsize, 1 << NVME_SQES);
-	if (len < 0)
+	if (buf_size && nvme_configure_sq_bufs(ctrl, sq, buf_size))
 		goto free_sq_rqs;
 
-	if (iommu_map_vaddr(__iommu_ctx(ctrl), sq->vaddr, len, &sq->iova, 0x0)) {
-		log_debug("failed to map vaddr\n");
-		goto unmap_sq;
+	if (flags & NVME_IOSQ_F_CMB) {
+		if (nvme_cmb_init(ctrl, 0))
+			goto free_sq_bufs;
+
+		if (!NVME_FIELD_GET(ctrl->cmb.sz, CMBSZ_SQS)) {
+			log_debug("controller does not support submission queues in the cmb\n");
+
+			errno = ENOTSUP;
+			goto free_sq_bufs;
+		}
+
+		if (nvme_cmb_alloc(ctrl, (size_t)qsize << NVME_SQES, &sq->vaddr, &sq->iova))
+			goto free_sq_bufs;
+
+		sq->flags |= NVME_SQ_F_CMB;
+
+		return 0;
 	}
 
+	if (nvme_queue_mem_alloc(ctrl, __queue_node(ctrl, qid), (unsigned int)qsize,
+				 1 << NVME_SQES, &sq->vaddr, &sq->iova) < 0)
+		goto free_sq_bufs;
+
 	return 0;
 
-unmap_sq:
-	pgunmap(sq->vaddr, len);
+free_sq_bufs:
+	if (sq->bufs.vaddr)
+		iommu_free(__iommu_ctx(ctrl), sq->bufs.vaddr, sq->bufs.len);
 free_sq_rqs:
 	free(sq->rqs);
-unmap_pages:
-	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), sq->pages.vaddr, (size_t *)&len))
-		log_debug("failed to unmap vaddr\n");
+	free(sq->prp_pages);
 
-	pgunmap(sq->pages.vaddr, len);
+	nvme_queue_mem_free(ctrl, sq->pages.vaddr);
 
 	return -1;
 }
 
 static void nvme_discard_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq)
 {
-	size_t len;
-
 	if (!sq->vaddr)
 		return;
 
-	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), sq->vaddr, &len))
-		log_debug("failed to unmap vaddr\n");
+	/* do not leave a held back doorbell write behind */
+	if (sq->cq && sq->cq->dbc_sq == sq)
+		sq->cq->dbc_sq = NULL;
+
+	if (sq->flags & NVME_SQ_F_CMB)
+		nvme_cmb_free(ctrl, sq->vaddr, (size_t)sq->qsize << NVME_SQES);
+	else
+		nvme_queue_mem_free(ctrl, sq->vaddr);
 
-	pgunmap(sq->vaddr, len);
+	if (sq->bufs.vaddr)
+		iommu_free(__iommu_ctx(ctrl), sq->bufs.vaddr, sq->bufs.len);
 
 	free(sq->rqs);
+	free(sq->prp_pages);
+	free(sq->lat);
 
-	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), sq->pages.vaddr, &len))
-		log_debug("failed to unmap vaddr\n");
-
-	pgunmap(sq->pages.vaddr, len);
+	nvme_queue_mem_free(ctrl, sq->pages.vaddr);
 
 	if (ctrl->dbbuf.doorbells) {
 		__STORE_PTR(uint32_t *, sq->dbbuf.doorbell, 0);
@@ -257,7 +691,7 @@ static int nvme_configure_adminq(struct nvme_ctrl *ctrl, unsigned long sq_flags)
 		return -1;
 	}
 
-	if (nvme_configure_sq(ctrl, NVME_AQ, NVME_AQ_QSIZE, cq, sq_flags)) {
+	if (nvme_configure_sq(ctrl, NVME_AQ, NVME_AQ_QSIZE, cq, sq_flags, 0)) {
 		log_debug("failed to configure admin submission queue\n");
 		goto discard_cq;
 	}
@@ -284,25 +718,72 @@ static int __admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe)
 	return nvme_sync(ctrl, ctrl->adminq.sq, sqe, NULL, 0, NULL);
 }
 
-int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+/*
+ * Issue @n admin commands, keeping as many of them in flight as the admin queue
+ * allows, and wait for all of them. If @buf is given, command i transfers @len
+ * bytes at @buf + i * @len. Futures of commands that were never submitted are
+ * left zeroed (i.e., not done).
+ */
+static int __admin_pipeline(struct nvme_ctrl *ctrl, union nvme_cmd *cmds,
+			    struct nvme_future *futures, int n, void *buf, size_t len)
 {
-	struct nvme_cq *cq = &ctrl->cq[qid];
-	union nvme_cmd cmd;
+	int i, waited = 0, ret = 0, err = 0;
 
-	uint16_t qflags = NVME_Q_PC;
-	uint16_t iv = 0;
+	for (i = 0; i < n; i++) {
+		void *vaddr = buf ? buf + (size_t)i * len : NULL;
 
-	if (nvme_configure_cq(ctrl, qid, qsize, vector)) {
-		log_debug("could not configure io completion queue\n");
-		return -1;
+		while (nvme_admin_async(ctrl, &cmds[i], vaddr, vaddr ? len : 0, &futures[i])) {
+			if (errno != EBUSY || waited == i) {
+				log_debug("could not submit admin command\n");
+
+				ret = -1;
+				err = errno;
+
+				goto wait;
+			}
+
+			nvme_future_wait(&futures[waited++]);
+		}
 	}
 
-	if (vector != -1) {
-		qflags |= NVME_CQ_IEN;
-		iv = (uint16_t)vector;
+wait:
+	if (nvme_future_wait_all(futures, i) && !ret) {
+		ret = -1;
+		err = errno;
 	}
 
-	cmd.create_cq = (struct nvme_cmd_create_cq) {
+	if (ret)
+		errno = err;
+
+	return ret;
+}
+
+static inline bool __future_ok(struct nvme_future *future)
+{
+	return future->done && nvme_cqe_ok(&future->cqe);
+}
+
+static int __prep_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector,
+		       union nvme_cmd *cmd)
+{
+	struct nvme_cq *cq = &ctrl->cq[qid];
+
+	uint16_t qflags = NVME_Q_PC;
+	uint16_t iv = 0;
+
+	if (nvme_configure_cq(ctrl, qid, qsize, vector)) {
+		log_debug("could not configure io completion queue\n");
+		return -1;
+	}
+
+	if (vector != -1) {
+		qflags |= NVME_CQ_IEN;
+		iv = (uint16_t)vector;
+
+		nvme_configure_cq_irq(ctrl, cq);
+	}
+
+	cmd->create_cq = (struct nvme_cmd_create_cq) {
 		.opcode = NVME_ADMIN_CREATE_CQ,
 		.prp1   = cpu_to_le64(cq->iova),
 		.qid    = cpu_to_le16((uint16_t)qid),
@@ -311,6 +792,16 @@ int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
 		.iv     = cpu_to_le16(iv),
 	};
 
+	return 0;
+}
+
+int nvme_create_iocq(struct nvme_ctrl *ctrl, int qid, int qsize, int vector)
+{
+	union nvme_cmd cmd;
+
+	if (__prep_iocq(ctrl, qid, qsize, vector, &cmd))
+		return -1;
+
 	return __admin(ctrl, &cmd);
 }
 
@@ -328,26 +819,75 @@ int nvme_delete_iocq(struct nvme_ctrl *ctrl, int qid)
 	return __admin(ctrl, &cmd);
 }
 
-int nvme_create_iosq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq *cq,
-		     unsigned long flags)
+static int __qprio(struct nvme_ctrl *ctrl, unsigned long flags, uint16_t *qflags)
+{
+	switch (flags & NVME_IOSQ_F_QPRIO_MASK) {
+	case NVME_IOSQ_F_QPRIO_URGENT:
+		*qflags = NVME_SQ_QPRIO_URGENT;
+		break;
+	case NVME_IOSQ_F_QPRIO_HIGH:
+		*qflags = NVME_SQ_QPRIO_HIGH;
+		break;
+	case 0:
+		/* the field is ignored with round robin arbitration */
+		if (!ctrl->config.wrr) {
+			*qflags = 0x0;
+			break;
+		}
+
+		/* fallthrough */
+	case NVME_IOSQ_F_QPRIO_MEDIUM:
+		*qflags = NVME_SQ_QPRIO_MEDIUM;
+		break;
+	case NVME_IOSQ_F_QPRIO_LOW:
+		*qflags = NVME_SQ_QPRIO_LOW;
+		break;
+	default:
+		log_debug("invalid queue priority class\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int __prep_iosq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq *cq,
+		       unsigned long flags, size_t buf_size, union nvme_cmd *cmd)
 {
 	struct nvme_sq *sq = &ctrl->sq[qid];
-	union nvme_cmd cmd;
+	uint16_t qprio;
+
+	if (__qprio(ctrl, flags, &qprio))
+		return -1;
 
-	if (nvme_configure_sq(ctrl, qid, qsize, cq, flags)) {
+	if (nvme_configure_sq(ctrl, qid, qsize, cq, flags, buf_size)) {
 		log_debug("could not configure io submission queue\n");
 		return -1;
 	}
 
-	cmd.create_sq = (struct nvme_cmd_create_sq) {
+	sq->qprio = qprio;
+
+	cmd->create_sq = (struct nvme_cmd_create_sq) {
 		.opcode = NVME_ADMIN_CREATE_SQ,
 		.prp1   = cpu_to_le64(sq->iova),
 		.qid    = cpu_to_le16((uint16_t)qid),
 		.qsize  = cpu_to_le16((uint16_t)(qsize - 1)),
-		.qflags = cpu_to_le16(NVME_Q_PC),
+		.qflags = cpu_to_le16(NVME_Q_PC | sq->qprio),
 		.cqid   = cpu_to_le16((uint16_t)cq->id),
 	};
 
+	return 0;
+}
+
+int nvme_create_iosq_buf(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq *cq,
+			 unsigned long flags, size_t buf_size)
+{
+	union nvme_cmd cmd;
+
+	if (__prep_iosq(ctrl, qid, qsize, cq, flags, buf_size, &cmd))
+		return -1;
+
 	return __admin(ctrl, &cmd);
 }
 
@@ -365,18 +905,60 @@ int nvme_delete_iosq(struct nvme_ctrl *ctrl, int qid)
 	return __admin(ctrl, &cmd);
 }
 
+int nvme_create_iosq(struct nvme_ctrl *ctrl, int qid, int qsize, struct nvme_cq *cq,
+		     unsigned long flags)
+{
+	return nvme_create_iosq_buf(ctrl, qid, qsize, cq, flags, 0);
+}
+
+static size_t nvme_ioqpair_mem_size(struct nvme_ctrl *ctrl, int qsize, unsigned long flags)
+{
+	size_t npages = (size_t)(qsize + nvme_prp_pool_size(ctrl, 1, qsize));
+	size_t len;
+
+	len = __queue_mem_align(ctrl, (size_t)qsize << NVME_CQES);
+	len += npages * __mps_to_pagesize(ctrl->config.mps);
+
+	if (!(flags & NVME_IOSQ_F_CMB))
+		len += __queue_mem_align(ctrl, (size_t)qsize << NVME_SQES);
+
+	return ALIGN_UP(len, __VFN_PAGESIZE);
+}
+
 int nvme_create_ioqpair(struct nvme_ctrl *ctrl, int qid, int qsize, int vector, unsigned long flags)
 {
+	bool shared = flags & NVME_IOSQ_F_SHARED;
+
+	if (shared && (flags & NVME_IOSQ_F_CMB || qsize < 2)) {
+		log_debug("shared queue pairs must be in host memory\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* carve both rings and the prp list pages out of a single mapping */
+	if (qsize >= 2 && nvme_queue_mem_reserve(ctrl, nvme_ioqpair_mem_size(ctrl, qsize, flags),
+						 __queue_node(ctrl, qid), shared) && shared) {
+		log_debug("could not allocate shared queue memory\n");
+		return -1;
+	}
+
 	if (nvme_create_iocq(ctrl, qid, qsize, vector)) {
 		log_debug("could not create io completion queue\n");
+
+		nvme_queue_mem_seal(ctrl);
 		return -1;
 	}
 
 	if (nvme_create_iosq(ctrl, qid, qsize, &ctrl->cq[qid], flags)) {
 		log_debug("could not create io submission queue\n");
+
+		nvme_queue_mem_seal(ctrl);
 		return -1;
 	}
 
+	nvme_queue_mem_seal(ctrl);
+
 	return 0;
 }
 
@@ -395,25 +977,163 @@ int nvme_delete_ioqpair(struct nvme_ctrl *ctrl, int qid)
 	return 0;
 }
 
+int nvme_set_queue_numa_node(struct nvme_ctrl *ctrl, int qid, int node)
+{
+	if (!ctrl->numa.qnodes || qid < 0 || qid > max(ctrl->opts.nsqr, ctrl->opts.ncqr) + 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctrl->numa.qnodes[qid] = node < 0 ? -1 : node;
+
+	return 0;
+}
+
+int nvme_create_ioqpairs(struct nvme_ctrl *ctrl, int nqueues, int qsize, unsigned long flags,
+			 struct nvme_ioqpair_info *info)
+{
+	struct vfio_device *dev = &ctrl->pci.dev;
+	__autofree int *cpus = NULL, *efds = NULL;
+	__autofree union nvme_cmd *cmds = NULL;
+	__autofree struct nvme_future *cqs = NULL, *sqs = NULL;
+	int ncpus, numa_node;
+
+	/* the queues would share a single region; lease them one by one */
+	if (flags & NVME_IOSQ_F_SHARED) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nqueues < 1 || (!ctrl->mock && nqueues + 1 > (int)dev->irq_info.count)) {
+		log_debug("cannot assign %d vectors; device supports %u\n", nqueues + 1,
+			  dev->irq_info.count);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	ncpus = pci_device_get_local_cpus(ctrl->pci.bdf, &cpus);
+	if (ncpus < 0) {
+		log_debug("could not get local cpus\n");
+		ncpus = 0;
+	}
+
+	numa_node = pci_device_get_numa_node(ctrl->pci.bdf);
+
+	/*
+	 * Enable all vectors up front (without triggers); the individual
+	 * vectors are then wired to eventfds as the completion queues are
+	 * created.
+	 */
+	efds = new_t(int, nqueues + 1);
+	for (int i = 0; i < nqueues + 1; i++)
+		efds[i] = -1;
+
+	if (!ctrl->mock && vfio_set_irq(dev, efds, nqueues + 1))
+		log_debug("failed to enable vectors\n");
+
+	/*
+	 * Back the rings and prp list pages of all the queues with a single
+	 * (hugepage backed, see iommu_alloc()) mapping. If that fails, queues
+	 * are mapped individually.
+	 */
+	nvme_queue_mem_reserve(ctrl, (size_t)nqueues * nvme_ioqpair_mem_size(ctrl, qsize, flags),
+			       ctrl->numa.node, false);
+
+	cmds = new_t(union nvme_cmd, nqueues);
+	cqs = znew_t(struct nvme_future, nqueues);
+	sqs = znew_t(struct nvme_future, nqueues);
+
+	/*
+	 * Create all completion queues and then all submission queues, keeping
+	 * the admin queue busy instead of waiting for each command in turn.
+	 */
+	for (int i = 0; i < nqueues; i++) {
+		if (__prep_iocq(ctrl, i + 1, qsize, i + 1, &cmds[i]))
+			goto delete;
+	}
+
+	if (__admin_pipeline(ctrl, cmds, cqs, nqueues, NULL, 0)) {
+		log_debug("could not create io completion queues\n");
+		goto delete;
+	}
+
+	for (int i = 0; i < nqueues; i++) {
+		if (__prep_iosq(ctrl, i + 1, qsize, &ctrl->cq[i + 1], flags, 0, &cmds[i]))
+			goto delete;
+	}
+
+	nvme_queue_mem_seal(ctrl);
+
+	if (__admin_pipeline(ctrl, cmds, sqs, nqueues, NULL, 0)) {
+		log_debug("could not create io submission queues\n");
+		goto delete;
+	}
+
+	for (int qid = 1; qid <= nqueues; qid++) {
+		info[qid - 1] = (struct nvme_ioqpair_info) {
+			.qid = qid,
+			.vector = qid,
+			.efd = nvme_cq_get_fd(&ctrl->cq[qid]),
+			.cpu = ncpus ? cpus[(qid - 1) % ncpus] : -1,
+			.numa_node = numa_node,
+		};
+	}
+
+	return 0;
+
+delete:
+	nvme_queue_mem_seal(ctrl);
+
+	for (int i = nqueues - 1; i >= 0; i--) {
+		if (__future_ok(&sqs[i]) && nvme_delete_iosq(ctrl, i + 1))
+			log_debug("could not delete io submission queue %d\n", i + 1);
+
+		if (__future_ok(&cqs[i]) && nvme_delete_iocq(ctrl, i + 1))
+			log_debug("could not delete io completion queue %d\n", i + 1);
+	}
+
+	return -1;
+}
+
+/*
+ * Controllers are often ready within a few register reads, so spin briefly
+ * before falling back to sleeping with exponential backoff (capped, such that
+ * readiness is still detected promptly during multi-second resets).
+ */
+#define NVME_WAIT_RDY_SPIN_NSEC 1000
+#define NVME_WAIT_RDY_MAX_SLEEP_USEC 10000
+
 static int nvme_wait_rdy(struct nvme_ctrl *ctrl, unsigned short rdy)
 {
 	uint64_t cap;
 	uint32_t csts;
 	unsigned long timeout_ms;
-	struct timeabs deadline;
+	struct timeabs start, now, deadline;
+	struct timerel spin = time_from_nsec(NVME_WAIT_RDY_SPIN_NSEC);
+	useconds_t delay = 1;
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	cap = ctrl->reg.cap;
 	timeout_ms = 500 * (NVME_FIELD_GET(cap, CAP_TO) + 1);
-	deadline = timeabs_add(time_now(), time_from_msec(timeout_ms));
+	start = time_now();
+	deadline = timeabs_add(start, time_from_msec(timeout_ms));
 
 	do {
-		if (time_after(time_now(), deadline)) {
+		now = time_now();
+
+		if (time_after(now, deadline)) {
 			log_debug("timed out\n");
 
 			errno = ETIMEDOUT;
 			return -1;
 		}
 
+		if (time_greater(time_between(now, start), spin)) {
+			__usleep(delay);
+
+			delay = min_t(useconds_t, delay * 2, NVME_WAIT_RDY_MAX_SLEEP_USEC);
+		}
+
 		csts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS));
 	} while (NVME_FIELD_GET(csts, CSTS_RDY) != rdy);
 
@@ -426,12 +1146,21 @@ int nvme_enable(struct nvme_ctrl *ctrl)
 	uint32_t cc;
 	uint64_t cap;
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	cap = ctrl->reg.cap;
 	css = NVME_FIELD_GET(cap, CAP_CSS);
 
+	ctrl->config.wrr = false;
+
+	if (ctrl->opts.arb.wrr) {
+		if (NVME_FIELD_GET(cap, CAP_AMS) & NVME_CAP_AMS_WRRU)
+			ctrl->config.wrr = true;
+		else
+			log_info("weighted round robin arbitration not supported\n");
+	}
+
 	cc =
 		NVME_FIELD_SET(ctrl->config.mps, CC_MPS) |
-		NVME_FIELD_SET(NVME_CC_AMS_RR,	 CC_AMS) |
+		NVME_FIELD_SET(ctrl->config.wrr ? NVME_CC_AMS_WRRU : NVME_CC_AMS_RR, CC_AMS) |
 		NVME_FIELD_SET(NVME_CC_SHN_NONE, CC_SHN) |
 		NVME_FIELD_SET(NVME_SQES,        CC_IOSQES) |
 		NVME_FIELD_SET(NVME_CQES,        CC_IOCQES) |
@@ -451,14 +1180,130 @@ int nvme_enable(struct nvme_ctrl *ctrl)
 
 int nvme_reset(struct nvme_ctrl *ctrl)
 {
+	struct nvme_stats_ctrl *stats = nvme_stats_ctrl(ctrl);
 	uint32_t cc;
 
+	if (stats) {
+		__nvme_stats_write_begin(&stats->seq);
+		stats->resets++;
+		__nvme_stats_write_end(&stats->seq);
+	}
+
 	cc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CC));
 	mmio_write32(ctrl->regs + NVME_REG_CC, cpu_to_le32(cc & 0xfe));
 
+	/* the host memory buffer is disabled along with the controller */
+	ctrl->hmb.enabled = false;
+
 	return nvme_wait_rdy(ctrl, 0);
 }
 
+static inline bool nvme_ctrl_responding(struct nvme_ctrl *ctrl)
+{
+	/* all ones if the device is not responding */
+	return le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS)) != 0xffffffff;
+}
+
+static int nvme_reset_subsystem(struct nvme_ctrl *ctrl)
+{
+	uint64_t cap;
+
+	cap = ctrl->reg.cap;
+	if (!NVME_FIELD_GET(cap, CAP_NSSRS)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	mmio_write32(ctrl->regs + NVME_REG_NSSR, cpu_to_le32(NVME_NSSR_NSSRC));
+
+	ctrl->hmb.enabled = false;
+
+	/* registers read as all ones (i.e., CSTS.RDY set) until the reset completes */
+	if (nvme_wait_rdy(ctrl, 0))
+		return -1;
+
+	/* write one to clear */
+	mmio_write32(ctrl->regs + NVME_REG_CSTS, cpu_to_le32(NVME_FIELD_SET(1, CSTS_NSSRO)));
+
+	return 0;
+}
+
+static int nvme_reset_function(struct nvme_ctrl *ctrl)
+{
+	if (vfio_pci_reset(&ctrl->pci))
+		return -1;
+
+	ctrl->hmb.enabled = false;
+
+	/* the controller comes up disabled, but may take a while to get there */
+	return nvme_wait_rdy(ctrl, 0);
+}
+
+int nvme_reset_escalate(struct nvme_ctrl *ctrl, enum nvme_reset_type type)
+{
+	switch (type) {
+	case NVME_RESET_CONTROLLER:
+		return nvme_reset(ctrl) ? -1 : NVME_RESET_CONTROLLER;
+	case NVME_RESET_FUNCTION:
+		return nvme_reset_function(ctrl) ? -1 : NVME_RESET_FUNCTION;
+	case NVME_RESET_SUBSYSTEM:
+		return nvme_reset_subsystem(ctrl) ? -1 : NVME_RESET_SUBSYSTEM;
+	case NVME_RESET_AUTO:
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nvme_ctrl_responding(ctrl)) {
+		if (!nvme_reset(ctrl))
+			return NVME_RESET_CONTROLLER;
+
+		log_info("controller reset failed; trying function level reset\n");
+	}
+
+	if (ctrl->pci.dev.device_info.flags & VFIO_DEVICE_FLAGS_RESET) {
+		if (!nvme_reset_function(ctrl))
+			return NVME_RESET_FUNCTION;
+
+		log_info("function level reset failed\n");
+	}
+
+	/* the subsystem reset also affects other controllers; it is the last resort */
+	if (nvme_ctrl_responding(ctrl)) {
+		log_info("trying nvm subsystem reset\n");
+
+		if (!nvme_reset_subsystem(ctrl))
+			return NVME_RESET_SUBSYSTEM;
+	}
+
+	log_debug("could not reset controller\n");
+
+	errno = ENODEV;
+	return -1;
+}
+
+/*
+ * Check if the controller is disabled and healthy, such that it can be
+ * configured and enabled without a reset.
+ */
+static bool nvme_ctrl_idle(struct nvme_ctrl *ctrl)
+{
+	uint32_t cc, csts;
+
+	cc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CC));
+	csts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS));
+
+	/* all ones if the device is not responding */
+	if (csts == 0xffffffff)
+		return false;
+
+	if (NVME_FIELD_GET(csts, CSTS_CFS) || NVME_FIELD_GET(csts, CSTS_SHST))
+		return false;
+
+	return !NVME_FIELD_GET(cc, CC_EN) && !NVME_FIELD_GET(csts, CSTS_RDY);
+}
+
 static int nvme_init_dbconfig(struct nvme_ctrl *ctrl)
 {
 	uint64_t prp1, prp2;
@@ -486,48 +1331,33 @@ static int nvme_init_dbconfig(struct nvme_ctrl *ctrl)
 		return -1;
 
 	if (!(ctrl->opts.quirks & NVME_QUIRK_BROKEN_DBBUF)) {
-		uint64_t cap;
-		uint8_t dstrd;
-
-		cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
-		dstrd = NVME_FIELD_GET(cap, CAP_DSTRD);
+		uint32_t stride = ctrl->reg.dbstride;
 
-		ctrl->adminq.cq->dbbuf.doorbell = cqhdbl(ctrl->dbbuf.doorbells, NVME_AQ, dstrd);
-		ctrl->adminq.cq->dbbuf.eventidx = cqhdbl(ctrl->dbbuf.eventidxs, NVME_AQ, dstrd);
+		ctrl->adminq.cq->dbbuf.doorbell = cqhdbl(ctrl->dbbuf.doorbells, NVME_AQ, stride);
+		ctrl->adminq.cq->dbbuf.eventidx = cqhdbl(ctrl->dbbuf.eventidxs, NVME_AQ, stride);
 
-		ctrl->adminq.sq->dbbuf.doorbell = sqtdbl(ctrl->dbbuf.doorbells, NVME_AQ, dstrd);
-		ctrl->adminq.sq->dbbuf.eventidx = sqtdbl(ctrl->dbbuf.eventidxs, NVME_AQ, dstrd);
+		ctrl->adminq.sq->dbbuf.doorbell = sqtdbl(ctrl->dbbuf.doorbells, NVME_AQ, stride);
+		ctrl->adminq.sq->dbbuf.eventidx = sqtdbl(ctrl->dbbuf.eventidxs, NVME_AQ, stride);
 	}
 
 	return 0;
 }
 
-int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts)
+static int __nvme_open_pci(struct nvme_ctrl *ctrl, const char *bdf)
 {
+	struct pci_device_info info;
 	unsigned long long classcode;
-	uint64_t cap;
-	uint8_t mpsmin, mpsmax;
-	uint16_t oacs;
-	ssize_t len;
-	void *vaddr;
-	int ret;
-
-	union nvme_cmd cmd = {};
-	struct nvme_cqe cqe;
-
-	if (opts)
-		memcpy(&ctrl->opts, opts, sizeof(*opts));
-	else
-		memcpy(&ctrl->opts, &nvme_ctrl_opts_default, sizeof(*opts));
 
-	if (pci_device_info_get_ull(bdf, "class", &classcode)) {
+	if (!pci_device_lookup(bdf, &info)) {
+		classcode = info.classcode;
+	} else if (pci_device_info_get_ull(bdf, "class", &classcode)) {
 		log_debug("could not get device class code\n");
 		return -1;
 	}
 
 	log_info("pci class code is 0x%06llx\n", classcode);
 
-	if ((classcode & 0xffff00) != 0x010800) {
+	if ((classcode & PCI_CLASS_NVME_MASK) != PCI_CLASS_NVME) {
 		log_debug("%s is not an NVMe device\n", bdf);
 		errno = EINVAL;
 		return -1;
@@ -545,7 +1375,65 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 		return -1;
 	}
 
-	cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	return 0;
+}
+
+/*
+ * Cache the immutable registers such that queue creation, controller reset and
+ * recovery do not incur (slow) uncached reads of the bar.
+ */
+static void nvme_read_regs(struct nvme_ctrl *ctrl)
+{
+	ctrl->reg.cap = le64_to_cpu(mmio_read64(ctrl->regs + NVME_REG_CAP));
+	ctrl->reg.vs = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_VS));
+	ctrl->reg.cmbloc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBLOC));
+	ctrl->reg.cmbsz = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CMBSZ));
+
+	/* the register is reserved if the controller has no pmr */
+	ctrl->reg.pmrcap = 0;
+	if (NVME_FIELD_GET(ctrl->reg.cap, CAP_PMRS))
+		ctrl->reg.pmrcap = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_PMRCAP));
+
+	ctrl->reg.dbstride = 4U << (unsigned int)NVME_FIELD_GET(ctrl->reg.cap, CAP_DSTRD);
+}
+
+static int __nvme_open(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts)
+{
+	uint64_t cap;
+	uint8_t mpsmin, mpsmax;
+
+	if (opts)
+		memcpy(&ctrl->opts, opts, sizeof(*opts));
+	else
+		memcpy(&ctrl->opts, &nvme_ctrl_opts_default, sizeof(*opts));
+
+	ctrl->mock = NULL;
+
+	memset(&ctrl->hmb, 0x0, sizeof(ctrl->hmb));
+	memset(&ctrl->power, 0x0, sizeof(ctrl->power));
+
+	if (nvme_mock_bdf(bdf)) {
+		if (nvme_mock_open(ctrl, bdf))
+			return -1;
+	} else if (__nvme_open_pci(ctrl, bdf)) {
+		return -1;
+	}
+
+	switch (ctrl->opts.numa_policy) {
+	case NVME_NUMA_DEVICE:
+		ctrl->numa.node = pci_device_get_numa_node(bdf);
+		break;
+	case NVME_NUMA_NODE:
+		ctrl->numa.node = ctrl->opts.numa_node;
+		break;
+	default:
+		ctrl->numa.node = -1;
+		break;
+	}
+
+	nvme_read_regs(ctrl);
+
+	cap = ctrl->reg.cap;
 	mpsmin = NVME_FIELD_GET(cap, CAP_MPSMIN);
 	mpsmax = NVME_FIELD_GET(cap, CAP_MPSMAX);
 
@@ -562,21 +1450,349 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 
 	ctrl->config.mqes = NVME_FIELD_GET(cap, CAP_MQES);
 
-	if (nvme_reset(ctrl)) {
-		log_debug("could not reset controller\n");
+	return 0;
+}
+
+static inline uint8_t __id_ns_lbaf(void *id)
+{
+	uint8_t flbas = *(uint8_t *)(id + NVME_IDENTIFY_NS_FLBAS);
+
+	return (uint8_t)(NVME_FIELD_GET(flbas, ID_NS_FLBAS_LO) |
+			 NVME_FIELD_GET(flbas, ID_NS_FLBAS_HI) << 4);
+}
+
+/*
+ * Limit in logical blocks of commands that do not transfer data (but whose
+ * size is limited by mdts unless otherwise reported); nlb is a zeroes based 16
+ * bit value.
+ */
+static uint32_t __nlb_limit(size_t limit, struct nvme_ns *ns, size_t max)
+{
+	if (!limit)
+		return (uint32_t)max;
+
+	return (uint32_t)clamp_t(size_t, limit >> ns->lbads, 1, 0x10000);
+}
+
+static void nvme_parse_ns(struct nvme_ctrl *ctrl, uint32_t nsid, void *id)
+{
+	struct nvme_ns *ns = &ctrl->ns[nsid - 1];
+	uint8_t flbas, dps, nlbaf, lbaf;
+	size_t lbasz, max;
+	uint32_t fmt;
+
+	flbas = *(uint8_t *)(id + NVME_IDENTIFY_NS_FLBAS);
+	dps = *(uint8_t *)(id + NVME_IDENTIFY_NS_DPS);
+	nlbaf = *(uint8_t *)(id + NVME_IDENTIFY_NS_NLBAF);
+
+	lbaf = __id_ns_lbaf(id);
+
+	if (lbaf > nlbaf) {
+		log_debug("nsid %" PRIu32 " has invalid lba format %u\n", nsid, lbaf);
+		return;
+	}
+
+	fmt = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_NS_LBAF + 4 * lbaf));
+
+	*ns = (struct nvme_ns) {
+		.nsze = le64_to_cpu(*(leint64_t *)(id + NVME_IDENTIFY_NS_NSZE)),
+		.lbads = (uint8_t)NVME_FIELD_GET(fmt, ID_NS_LBAF_LBADS),
+		.ms = (uint16_t)NVME_FIELD_GET(fmt, ID_NS_LBAF_MS),
+		.extended = NVME_FIELD_GET(flbas, ID_NS_FLBAS_MSET),
+		.pi = (uint8_t)NVME_FIELD_GET(dps, ID_NS_DPS_PIT),
+		.pi_first = NVME_FIELD_GET(dps, ID_NS_DPS_FIRST),
+		.endgid = le16_to_cpu(*(leint16_t *)(id + NVME_IDENTIFY_NS_ENDGID)),
+	};
+
+	if (!ns->nsze || ns->lbads < 9)
+		return;
+
+	/* nlb is a zeroes based 16 bit value */
+	max = 0x10000;
+
+	if (ctrl->config.mdts) {
+		lbasz = (1ULL << ns->lbads) + (ns->extended ? ns->ms : 0);
+		max = min_t(size_t, max, ctrl->config.mdts / lbasz);
+	}
+
+	ns->max_nlb = (uint32_t)max;
+	ns->nsid = nsid;
+
+	if (ctrl->config.oncs & NVME_IDENTIFY_CTRL_ONCS_WRITE_ZEROES)
+		ns->max_wz_nlb = __nlb_limit(ctrl->config.wzsl, ns, max);
+
+	if (ctrl->config.oncs & NVME_IDENTIFY_CTRL_ONCS_VERIFY)
+		ns->max_verify_nlb = __nlb_limit(ctrl->config.vsl, ns, max);
+}
+
+/* the protection information format (nvm command set specific) */
+static void nvme_parse_ns_nvm(struct nvme_ns *ns, uint8_t lbaf, void *id)
+{
+	uint32_t elbaf = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_NS_NVM_ELBAF + 4 * lbaf));
+
+	ns->pif = (uint8_t)NVME_FIELD_GET(elbaf, ID_NS_NVM_ELBAF_PIF);
+	ns->sts = (uint8_t)NVME_FIELD_GET(elbaf, ID_NS_NVM_ELBAF_STS);
+}
+
+/*
+ * Identify the nvm command set specific namespace data of the namespaces with
+ * protection information enabled, reusing the buffers of the (now parsed)
+ * Identify Namespace commands. Controllers that do not support it (prior to
+ * NVMe 2.0) only support the 16b guard format, which is the default.
+ */
+static void nvme_scan_ns_nvm(struct nvme_ctrl *ctrl, union nvme_cmd *cmds,
+			     struct nvme_future *futures, uint32_t *nsids, int n, void *vaddr)
+{
+	__autofree uint8_t *lbafs = new_t(uint8_t, n);
+	int m = 0;
+
+	for (int i = 0; i < n; i++) {
+		void *id = vaddr + (size_t)i * NVME_IDENTIFY_DATA_SIZE;
+		struct nvme_ns *ns = nvme_ns_get(ctrl, nsids[i]);
+
+		if (!ns || !ns->pi)
+			continue;
+
+		/* compact the commands; buffer j is reused for command j */
+		lbafs[m] = __id_ns_lbaf(id);
+		nsids[m] = nsids[i];
+
+		cmds[m++].identify = (struct nvme_cmd_identify) {
+			.opcode = NVME_ADMIN_IDENTIFY,
+			.nsid = cpu_to_le32(nsids[i]),
+			.cns = NVME_IDENTIFY_CNS_CS_NS,
+			.csi = NVME_CSI_NVM,
+		};
+	}
+
+	if (!m)
+		return;
+
+	memset(futures, 0x0, (size_t)m * sizeof(*futures));
+
+	if (__admin_pipeline(ctrl, cmds, futures, m, vaddr, NVME_IDENTIFY_DATA_SIZE))
+		log_debug("could not identify nvm command set specific namespace data\n");
+
+	for (int i = 0; i < m; i++) {
+		if (__future_ok(&futures[i]))
+			nvme_parse_ns_nvm(&ctrl->ns[nsids[i] - 1], lbafs[i],
+					  vaddr + (size_t)i * NVME_IDENTIFY_DATA_SIZE);
+	}
+}
+
+int nvme_scan_ns(struct nvme_ctrl *ctrl)
+{
+	__autofree union nvme_cmd *cmds = NULL;
+	__autofree struct nvme_future *futures = NULL;
+	__autofree uint32_t *nsids = NULL;
+	union nvme_cmd cmd;
+	ssize_t len;
+	void *vaddr;
+	int n = 0, ret = 0;
+
+	if (!ctrl->nns)
+		return 0;
+
+	memset(ctrl->ns, 0x0, (size_t)ctrl->nns * sizeof(*ctrl->ns));
+
+	nsids = new_t(uint32_t, ctrl->nns);
+
+	len = pgmap(&vaddr, NVME_IDENTIFY_DATA_SIZE);
+	if (len < 0)
 		return -1;
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.cns = NVME_IDENTIFY_CNS_NS_ACTIVE_LIST,
+	};
+
+	if (nvme_admin(ctrl, &cmd, vaddr, (size_t)len, NULL)) {
+		log_debug("could not get active namespace list; trying all namespaces\n");
+
+		for (int i = 0; i < ctrl->nns; i++)
+			nsids[n++] = (uint32_t)i + 1;
+	} else {
+		for (int i = 0; i < NVME_IDENTIFY_DATA_SIZE / 4; i++) {
+			uint32_t nsid = le32_to_cpu(((leint32_t *)vaddr)[i]);
+
+			/* the list is in increasing order and zero terminated */
+			if (!nsid || nsid > (uint32_t)ctrl->nns)
+				break;
+
+			nsids[n++] = nsid;
+		}
 	}
 
-	/* map admin queue doorbells */
-	ctrl->doorbells = vfio_pci_map_bar(&ctrl->pci, 0, 0x1000, 0x1000, PROT_WRITE);
+	pgunmap(vaddr, (size_t)len);
+
+	if (!n)
+		return 0;
+
+	cmds = znew_t(union nvme_cmd, n);
+	futures = znew_t(struct nvme_future, n);
+
+	len = pgmapn(&vaddr, (unsigned int)n, NVME_IDENTIFY_DATA_SIZE);
+	if (len < 0)
+		return -1;
+
+	/* map the buffers once instead of for each command */
+	if (iommu_map_vaddr(__iommu_ctx(ctrl), vaddr, (size_t)len, NULL, 0x0)) {
+		log_debug("failed to map vaddr\n");
+
+		pgunmap(vaddr, (size_t)len);
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		cmds[i].identify = (struct nvme_cmd_identify) {
+			.opcode = NVME_ADMIN_IDENTIFY,
+			.nsid = cpu_to_le32(nsids[i]),
+			.cns = NVME_IDENTIFY_CNS_NS,
+		};
+	}
+
+	if (__admin_pipeline(ctrl, cmds, futures, n, vaddr, NVME_IDENTIFY_DATA_SIZE))
+		ret = -1;
+
+	for (int i = 0; i < n; i++) {
+		if (__future_ok(&futures[i]))
+			nvme_parse_ns(ctrl, nsids[i], vaddr + (size_t)i * NVME_IDENTIFY_DATA_SIZE);
+	}
+
+	nvme_scan_ns_nvm(ctrl, cmds, futures, nsids, n, vaddr);
+
+	if (iommu_unmap_vaddr(__iommu_ctx(ctrl), vaddr, NULL))
+		log_debug("failed to unmap vaddr\n");
+
+	pgunmap(vaddr, (size_t)len);
+
+	return ret;
+}
+
+/*
+ * Start resetting the controller (unless it may be reattached as is). Returns
+ * true if nvme_wait_rdy() must be called to complete the reset.
+ */
+static bool __nvme_begin_reset(struct nvme_ctrl *ctrl)
+{
+	uint32_t cc;
+
+	if (ctrl->opts.reattach && nvme_ctrl_idle(ctrl)) {
+		log_info("controller is idle; skipping reset\n");
+		return false;
+	}
+
+	cc = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CC));
+	mmio_write32(ctrl->regs + NVME_REG_CC, cpu_to_le32(cc & 0xfe));
+
+	return true;
+}
+
+static void nvme_init_power(struct nvme_ctrl *ctrl, void *id)
+{
+	ctrl->power.npsds = *(uint8_t *)(id + NVME_IDENTIFY_CTRL_NPSS) + 1;
+	ctrl->power.apsta = *(uint8_t *)(id + NVME_IDENTIFY_CTRL_APSTA) & 0x1;
+	ctrl->power.psds = znew_t(struct nvme_psd, ctrl->power.npsds);
+
+	for (int i = 0; i < ctrl->power.npsds; i++) {
+		void *psd = id + NVME_IDENTIFY_CTRL_PSD + i * NVME_PSD_SIZE;
+		uint8_t flags = *(uint8_t *)(psd + NVME_PSD_FLAGS);
+		uint32_t mp = le16_to_cpu(*(leint16_t *)(psd + NVME_PSD_MP));
+
+		ctrl->power.psds[i] = (struct nvme_psd) {
+			/* in units of 0.0001 W if MXPS is set; 0.01 W otherwise */
+			.mp_uw = mp * (flags & NVME_PSD_FLAGS_MXPS ? 100 : 10000),
+			.enlat_us = le32_to_cpu(*(leint32_t *)(psd + NVME_PSD_ENLAT)),
+			.exlat_us = le32_to_cpu(*(leint32_t *)(psd + NVME_PSD_EXLAT)),
+			.nonop = !!(flags & NVME_PSD_FLAGS_NOPS),
+		};
+	}
+}
+
+/*
+ * Size limits of the commands that do not transfer data, from the nvm command
+ * set specific identify controller data structure. Controllers that do not
+ * support it (prior to NVMe 2.0) report none of them.
+ */
+static void nvme_init_nvm_limits(struct nvme_ctrl *ctrl, void *vaddr, size_t len)
+{
+	size_t mpsmin = (size_t)__mps_to_pagesize(NVME_FIELD_GET(ctrl->reg.cap, CAP_MPSMIN));
+	uint8_t vsl, wzsl;
+	union nvme_cmd cmd = {};
+
+	if (!(ctrl->config.oncs & (NVME_IDENTIFY_CTRL_ONCS_DSM |
+				   NVME_IDENTIFY_CTRL_ONCS_WRITE_ZEROES |
+				   NVME_IDENTIFY_CTRL_ONCS_VERIFY)))
+		return;
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.cns = NVME_IDENTIFY_CNS_CS_CTRL,
+		.csi = NVME_CSI_NVM,
+	};
+
+	if (nvme_admin(ctrl, &cmd, vaddr, len, NULL)) {
+		log_debug("could not identify nvm command set limits\n");
+		return;
+	}
+
+	vsl = *(uint8_t *)(vaddr + NVME_IDENTIFY_CTRL_NVM_VSL);
+	wzsl = *(uint8_t *)(vaddr + NVME_IDENTIFY_CTRL_NVM_WZSL);
+
+	/* in units of the minimum memory page size, as a power of two (capped; nlb is 16 bit) */
+	ctrl->config.vsl = vsl ? mpsmin << min_t(uint8_t, vsl, 32) : 0;
+	ctrl->config.wzsl = wzsl ? mpsmin << min_t(uint8_t, wzsl, 32) : 0;
+
+	ctrl->config.dmrl = *(uint8_t *)(vaddr + NVME_IDENTIFY_CTRL_NVM_DMRL);
+	ctrl->config.dmrsl = le32_to_cpu(*(leint32_t *)(vaddr + NVME_IDENTIFY_CTRL_NVM_DMRSL));
+	ctrl->config.dmsl = le64_to_cpu(*(leint64_t *)(vaddr + NVME_IDENTIFY_CTRL_NVM_DMSL));
+}
+
+static void nvme_init_bounce(struct nvme_ctrl *ctrl)
+{
+	size_t len = NVME_BOUNCE_SLOTS * NVME_BOUNCE_SLOT_SIZE;
+
+	/* not fatal; nvme_sync() maps payloads ephemerally without it */
+	if (iommu_alloc_node(__iommu_ctx(ctrl), len, ctrl->numa.node, &ctrl->bounce.vaddr,
+			     &ctrl->bounce.iova)) {
+		log_debug("could not allocate bounce buffers\n");
+
+		memset(&ctrl->bounce, 0x0, sizeof(ctrl->bounce));
+		return;
+	}
+
+	ctrl->bounce.free = (uint32_t)((1ULL << NVME_BOUNCE_SLOTS) - 1);
+}
+
+static int __nvme_setup(struct nvme_ctrl *ctrl)
+{
+	uint64_t cap;
+	uint16_t oacs;
+	uint32_t dw0, nn;
+	uint8_t mdts;
+	ssize_t len;
+	void *vaddr;
+	int ret;
+
+	union nvme_cmd cmd[2] = {};
+	struct nvme_future futures[2];
+
+	/* map admin queue doorbells (the emulated controller has them set up) */
+	if (!ctrl->mock)
+		ctrl->doorbells = vfio_pci_map_bar(&ctrl->pci, 0, 0x1000, 0x1000, PROT_WRITE);
+
 	if (!ctrl->doorbells) {
 		log_debug("could not map doorbells\n");
 		return -1;
 	}
 
 	/* +2 because nsqr/ncqr are zero-based values and do not account for the admin queue */
-	ctrl->sq = znew_t(struct nvme_sq, ctrl->opts.nsqr + 2);
-	ctrl->cq = znew_t(struct nvme_cq, ctrl->opts.ncqr + 2);
+	ctrl->sq = znew_aligned_t(struct nvme_sq, ctrl->opts.nsqr + 2);
+	ctrl->cq = znew_aligned_t(struct nvme_cq, ctrl->opts.ncqr + 2);
+
+	ctrl->numa.qnodes = new_t(int, max(ctrl->opts.nsqr, ctrl->opts.ncqr) + 2);
+	for (int i = 0; i < max(ctrl->opts.nsqr, ctrl->opts.ncqr) + 2; i++)
+		ctrl->numa.qnodes[i] = ctrl->numa.node;
 
 	if (nvme_configure_adminq(ctrl, 0x0)) {
 		log_debug("could not configure admin queue\n");
@@ -588,47 +1804,134 @@ int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_op
 		return -1;
 	}
 
+	nvme_init_bounce(ctrl);
+
 	if (ctrl->flags & NVME_CTRL_F_ADMINISTRATIVE)
 		return 0;
 
-	cmd = (union nvme_cmd) {
+	len = pgmap(&vaddr, NVME_IDENTIFY_DATA_SIZE);
+	if (len < 0)
+		return -1;
+
+	/* the two commands are independent; keep them in flight together */
+	cmd[0] = (union nvme_cmd) {
 		.opcode = NVME_ADMIN_SET_FEATURES,
 	};
 
-	cmd.features.fid = NVME_FEAT_FID_NUM_QUEUES;
-	cmd.features.cdw11 = cpu_to_le32(
+	cmd[0].features.fid = NVME_FEAT_FID_NUM_QUEUES;
+	cmd[0].features.cdw11 = cpu_to_le32(
 		NVME_FIELD_SET(ctrl->opts.nsqr, FEAT_NRQS_NSQR) |
 		NVME_FIELD_SET(ctrl->opts.ncqr, FEAT_NRQS_NCQR));
 
-	if (nvme_admin(ctrl, &cmd, NULL, 0, &cqe)) {
+	cmd[1].identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.cns = NVME_IDENTIFY_CNS_CTRL,
+	};
+
+	ret = nvme_admin_async(ctrl, &cmd[0], NULL, 0, &futures[0]);
+	if (ret) {
 		log_debug("could not set number of queues\n");
-		return -1;
+		goto out;
 	}
 
-	ctrl->config.nsqa = min_t(int, ctrl->opts.nsqr,
-				  NVME_FIELD_GET(le32_to_cpu(cqe.dw0), FEAT_NRQS_NSQR));
-	ctrl->config.ncqa = min_t(int, ctrl->opts.ncqr,
-				  NVME_FIELD_GET(le32_to_cpu(cqe.dw0), FEAT_NRQS_NCQR));
+	ret = nvme_admin_async(ctrl, &cmd[1], vaddr, len, &futures[1]);
+	if (ret) {
+		log_debug("could not identify\n");
 
-	len = pgmap(&vaddr, NVME_IDENTIFY_DATA_SIZE);
-	if (len < 0)
-		return -1;
+		nvme_future_wait(&futures[0]);
+		goto out;
+	}
 
-	cmd.identify = (struct nvme_cmd_identify) {
-		.opcode = NVME_ADMIN_IDENTIFY,
-		.cns = NVME_IDENTIFY_CNS_CTRL,
-	};
+	ret = nvme_future_wait(&futures[0]);
+	if (ret) {
+		log_debug("could not set number of queues\n");
+
+		nvme_future_wait(&futures[1]);
+		goto out;
+	}
 
-	ret = nvme_admin(ctrl, &cmd, vaddr, len, NULL);
+	dw0 = le32_to_cpu(futures[0].cqe.dw0);
+
+	ctrl->config.nsqa = min_t(int, ctrl->opts.nsqr, NVME_FIELD_GET(dw0, FEAT_NRQS_NSQR));
+	ctrl->config.ncqa = min_t(int, ctrl->opts.ncqr, NVME_FIELD_GET(dw0, FEAT_NRQS_NCQR));
+
+	ret = nvme_future_wait(&futures[1]);
 	if (ret) {
 		log_debug("could not identify\n");
 		goto out;
 	}
 
 	oacs = le16_to_cpu(*(leint16_t *)(vaddr + NVME_IDENTIFY_CTRL_OACS));
+	ctrl->config.sgls = le32_to_cpu(*(leint32_t *)(vaddr + NVME_IDENTIFY_CTRL_SGLS));
+
+	cap = ctrl->reg.cap;
+
+	mdts = *(uint8_t *)(vaddr + NVME_IDENTIFY_CTRL_MDTS);
+	if (mdts) {
+		size_t mpsmin = (size_t)__mps_to_pagesize(NVME_FIELD_GET(cap, CAP_MPSMIN));
+
+		ctrl->config.mdts = mpsmin << mdts;
+	}
+
+	nn = le32_to_cpu(*(leint32_t *)(vaddr + NVME_IDENTIFY_CTRL_NN));
+
+	ctrl->hmb.pre = (size_t)le32_to_cpu(*(leint32_t *)(vaddr + NVME_IDENTIFY_CTRL_HMPRE))
+		<< NVME_HMB_UNIT_SHIFT;
+	ctrl->hmb.min = (size_t)le32_to_cpu(*(leint32_t *)(vaddr + NVME_IDENTIFY_CTRL_HMMIN))
+		<< NVME_HMB_UNIT_SHIFT;
+	ctrl->hmb.minds = (size_t)le32_to_cpu(*(leint32_t *)(vaddr + NVME_IDENTIFY_CTRL_HMMINDS))
+		<< NVME_HMB_UNIT_SHIFT;
+	ctrl->hmb.maxd = le16_to_cpu(*(leint16_t *)(vaddr + NVME_IDENTIFY_CTRL_HMMAXD));
+
+	ctrl->config.lpa = *(uint8_t *)(vaddr + NVME_IDENTIFY_CTRL_LPA);
+	ctrl->config.oncs = le16_to_cpu(*(leint16_t *)(vaddr + NVME_IDENTIFY_CTRL_ONCS));
+	ctrl->config.fuses = le16_to_cpu(*(leint16_t *)(vaddr + NVME_IDENTIFY_CTRL_FUSES));
+
+	/* zeroes based */
+	ctrl->config.acwu = le16_to_cpu(*(leint16_t *)(vaddr + NVME_IDENTIFY_CTRL_ACWU)) + 1u;
+
+	nvme_init_power(ctrl, vaddr);
+
+	/* the identify controller data is parsed; reuse the buffer */
+	nvme_init_nvm_limits(ctrl, vaddr, (size_t)len);
 
-	if (oacs & NVME_IDENTIFY_CTRL_OACS_DBCONFIG)
+	ctrl->nns = (int)min_t(uint32_t, nn, NVME_NS_CACHE_MAX);
+	ctrl->ns = znew_t(struct nvme_ns, ctrl->nns ? ctrl->nns : 1);
+
+	if (oacs & NVME_IDENTIFY_CTRL_OACS_DBCONFIG) {
 		ret = nvme_init_dbconfig(ctrl);
+		if (ret)
+			goto out;
+	}
+
+	if (ctrl->config.wrr) {
+		struct nvme_arb_opts *arb = &ctrl->opts.arb;
+
+		ret = nvme_set_arbitration(ctrl, arb->ab, arb->lpw, arb->mpw, arb->hpw);
+		if (ret) {
+			log_debug("could not set arbitration\n");
+			goto out;
+		}
+	}
+
+	ret = nvme_set_power_policy(ctrl, &ctrl->opts.power);
+	if (ret) {
+		if (errno != ENOTSUP) {
+			log_debug("could not apply power state policy\n");
+			goto out;
+		}
+
+		log_info("power state policy not supported by controller\n");
+		ret = 0;
+	}
+
+	/* not fatal; the controller works without it, only slower */
+	if (ctrl->hmb.pre && ctrl->opts.hmb_max && nvme_hmb_enable(ctrl, ctrl->opts.hmb_max))
+		log_info("could not set up host memory buffer\n");
+
+	/* not fatal; i/o can still be issued without the cache */
+	if (nvme_scan_ns(ctrl))
+		log_debug("could not identify namespaces\n");
 
 out:
 	pgunmap(vaddr, len);
@@ -636,8 +1939,135 @@ out:
 	return ret;
 }
 
+int nvme_init(struct nvme_ctrl *ctrl, const char *bdf, const struct nvme_ctrl_opts *opts)
+{
+	if (__nvme_open(ctrl, bdf, opts))
+		return -1;
+
+	if (__nvme_begin_reset(ctrl) && nvme_wait_rdy(ctrl, 0)) {
+		log_debug("could not reset controller\n");
+		return -1;
+	}
+
+	return __nvme_setup(ctrl);
+}
+
+struct nvme_init_many_arg {
+	struct nvme_ctrl *ctrl;
+	pthread_t thread;
+	bool opened, started;
+	int err;
+};
+
+static void *nvme_init_many_thread(void *opaque)
+{
+	struct nvme_init_many_arg *arg = opaque;
+
+	arg->err = __nvme_setup(arg->ctrl) ? (errno ? errno : EIO) : 0;
+
+	return NULL;
+}
+
+int nvme_init_many(struct nvme_ctrl *ctrls, const char * const *bdfs, int n,
+		   const struct nvme_ctrl_opts *opts)
+{
+	__autofree struct nvme_init_many_arg *args = NULL;
+	int err = 0;
+
+	if (n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	args = znew_t(struct nvme_init_many_arg, n);
+
+	/*
+	 * Opening devices modifies the shared iommu context, so do that (and
+	 * start the resets) serially.
+	 */
+	for (int i = 0; i < n; i++) {
+		args[i].ctrl = &ctrls[i];
+
+		if (__nvme_open(&ctrls[i], bdfs[i], opts)) {
+			log_debug("could not open %s\n", bdfs[i]);
+
+			args[i].err = errno ? errno : EIO;
+			continue;
+		}
+
+		args[i].opened = true;
+		args[i].started = __nvme_begin_reset(&ctrls[i]);
+	}
+
+	/* the controllers reset in parallel; this waits for the slowest */
+	for (int i = 0; i < n; i++) {
+		if (!args[i].err && args[i].started && nvme_wait_rdy(&ctrls[i], 0)) {
+			log_debug("could not reset %s\n", bdfs[i]);
+
+			args[i].err = errno ? errno : EIO;
+		}
+
+		args[i].started = false;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (args[i].err)
+			continue;
+
+		if (pthread_create(&args[i].thread, NULL, nvme_init_many_thread, &args[i])) {
+			log_debug("could not create thread; initializing %s serially\n", bdfs[i]);
+
+			nvme_init_many_thread(&args[i]);
+			continue;
+		}
+
+		args[i].started = true;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (args[i].started)
+			pthread_join(args[i].thread, NULL);
+
+		if (args[i].err && !err)
+			err = args[i].err;
+	}
+
+	if (!err)
+		return 0;
+
+	/* including those that were opened but failed to reset or initialize */
+	for (int i = 0; i < n; i++) {
+		if (args[i].opened)
+			nvme_close(&ctrls[i]);
+	}
+
+	errno = err;
+	return -1;
+}
+
 void nvme_close(struct nvme_ctrl *ctrl)
 {
+	bool mock = ctrl->mock;
+
+	nvme_health_disable(ctrl);
+	nvme_stats_unexport(ctrl);
+
+	/* the controller must let go of the buffer while the admin queue is up */
+	nvme_hmb_disable(ctrl);
+
+	/* stop the emulation before the queue memory goes away */
+	if (mock)
+		nvme_mock_close(ctrl);
+
+	nvme_unregister_buffers(ctrl);
+
+	if (ctrl->bounce.vaddr)
+		iommu_free(__iommu_ctx(ctrl), ctrl->bounce.vaddr,
+			   NVME_BOUNCE_SLOTS * NVME_BOUNCE_SLOT_SIZE);
+
+	free(ctrl->ns);
+	free(ctrl->power.psds);
+
 	for (int i = 0; i < ctrl->opts.nsqr + 2; i++)
 		nvme_discard_sq(ctrl, &ctrl->sq[i]);
 
@@ -648,8 +2078,19 @@ void nvme_close(struct nvme_ctrl *ctrl)
 
 	free(ctrl->cq);
 
+	free(ctrl->numa.qnodes);
+
+	ctrl->qmem_recycle = 0;
+	__queue_mem_drain(ctrl);
+
+	nvme_cmb_close(ctrl);
+	nvme_pmr_disable(ctrl);
+
+	if (mock)
+		return;
+
 	vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->regs, 0x1000, 0);
 	vfio_pci_unmap_bar(&ctrl->pci, 0, ctrl->doorbells, 0x1000, 0x1000);
 
-	//vfio_close(ctrl->pci.vfio);
+	vfio_pci_close(&ctrl->pci);
 }
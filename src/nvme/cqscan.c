@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/cqscan: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+#include <vfn/support/atomic.h>
+#include <vfn/support/compiler.h>
+#include <vfn/support/endian.h>
+#include <vfn/support/log.h>
+#include <vfn/nvme/types.h>
+
+#include "ccan/array_size/array_size.h"
+
+#include "cqscan.h"
+
+static int cq_scan_scalar(const struct nvme_cqe *cqes, int phase, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((le16_to_cpu(LOAD(cqes[i].sfp)) & 0x1) == phase)
+			break;
+	}
+
+	return i;
+}
+
+static bool cq_scan_always_supported(void)
+{
+	return true;
+}
+
+#if defined(__x86_64__)
+/*
+ * The phase tag is bit 16 of the fourth dword of each 16 byte entry. Gather
+ * the fourth dword of four entries into one vector and move the phase tags
+ * into the sign bits so they can be extracted with movemask.
+ */
+static int cq_scan_sse2(const struct nvme_cqe *cqes, int phase, int n)
+{
+	unsigned int invert = phase ? 0xf : 0x0;
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		const __m128i *p = (const __m128i *)&cqes[i];
+		__m128i lo, hi, dw3;
+		unsigned int valid;
+
+		lo = _mm_unpackhi_epi32(_mm_loadu_si128(&p[0]), _mm_loadu_si128(&p[1]));
+		hi = _mm_unpackhi_epi32(_mm_loadu_si128(&p[2]), _mm_loadu_si128(&p[3]));
+		dw3 = _mm_unpackhi_epi64(lo, hi);
+
+		valid = _mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(dw3, 15))) ^ invert;
+		if (valid != 0xf)
+			return i + __builtin_ctz(~valid);
+	}
+
+	return i + cq_scan_scalar(&cqes[i], phase, n - i);
+}
+
+static __attribute__((target("avx2"))) int cq_scan_avx2(const struct nvme_cqe *cqes, int phase,
+							  int n)
+{
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	unsigned int invert = phase ? 0xff : 0x0;
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		const __m256i *p = (const __m256i *)&cqes[i];
+		__m256i lo, hi, dw3;
+		unsigned int valid;
+
+		/* each 128 bit lane holds one entry; gather the fourth dwords */
+		lo = _mm256_unpackhi_epi32(_mm256_loadu_si256(&p[0]), _mm256_loadu_si256(&p[1]));
+		hi = _mm256_unpackhi_epi32(_mm256_loadu_si256(&p[2]), _mm256_loadu_si256(&p[3]));
+		dw3 = _mm256_permutevar8x32_epi32(_mm256_unpackhi_epi64(lo, hi), order);
+
+		valid = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(dw3, 15))) ^ invert;
+		if (valid != 0xff)
+			return i + __builtin_ctz(~valid);
+	}
+
+	return i + cq_scan_sse2(&cqes[i], phase, n - i);
+}
+
+static bool cq_scan_avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static int cq_scan_neon(const struct nvme_cqe *cqes, int phase, int n)
+{
+	const uint32x4_t vphase = vdupq_n_u32((uint32_t)phase);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		/* deinterleave; val[3] holds the fourth dword of each entry */
+		uint32x4x4_t v = vld4q_u32((const uint32_t *)&cqes[i]);
+		uint32x4_t tags = vandq_u32(vshrq_n_u32(v.val[3], 16), vdupq_n_u32(0x1));
+		uint64_t invalid;
+
+		invalid = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(vceqq_u32(tags, vphase))), 0);
+		if (invalid)
+			return i + (__builtin_ctzll(invalid) >> 4);
+	}
+
+	return i + cq_scan_scalar(&cqes[i], phase, n - i);
+}
+#endif
+
+/* ordered by preference */
+const struct nvme_cq_scan_backend nvme_cq_scan_backends[] = {
+#if defined(__x86_64__)
+	{"avx2", cq_scan_avx2, cq_scan_avx2_supported},
+	{"sse2", cq_scan_sse2, cq_scan_always_supported},
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	{"neon", cq_scan_neon, cq_scan_always_supported},
+#endif
+	{"scalar", cq_scan_scalar, cq_scan_always_supported},
+};
+
+const int nvme_cq_scan_nbackends = ARRAY_SIZE(nvme_cq_scan_backends);
+
+nvme_cq_scan_fn __nvme_cq_scan_fn = cq_scan_scalar;
+
+static void __attribute__((constructor)) init_cq_scan(void)
+{
+	const char *name = getenv("VFN_CQ_SCAN");
+
+	for (int i = 0; i < nvme_cq_scan_nbackends; i++) {
+		const struct nvme_cq_scan_backend *b = &nvme_cq_scan_backends[i];
+
+		if (name && strcmp(name, b->name))
+			continue;
+
+		if (!b->supported())
+			continue;
+
+		log_debug("using %s phase scanner\n", b->name);
+
+		__nvme_cq_scan_fn = b->scan;
+
+		return;
+	}
+
+	log_debug("no matching phase scanner; using scalar\n");
+}
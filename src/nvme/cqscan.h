@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * A phase scanner returns the number of leading entries in @cqes (at most @n)
+ * that have a phase tag different from @phase (i.e., are valid).
+ */
+typedef int (*nvme_cq_scan_fn)(const struct nvme_cqe *cqes, int phase, int n);
+
+struct nvme_cq_scan_backend {
+	const char *name;
+	nvme_cq_scan_fn scan;
+	bool (*supported)(void);
+};
+
+extern const struct nvme_cq_scan_backend nvme_cq_scan_backends[];
+extern const int nvme_cq_scan_nbackends;
+
+extern nvme_cq_scan_fn __nvme_cq_scan_fn;
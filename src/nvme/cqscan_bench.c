@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "vfn/support/ticks.h"
+
+#include "cqscan.c"
+
+#define QSIZE 1024
+#define ITERATIONS 100000
+
+static struct nvme_cqe cqes[QSIZE] __attribute__((aligned(64)));
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	for (int i = 0; i < QSIZE; i++)
+		cqes[i].sfp = cpu_to_le16(0x1);
+
+	printf("%-8s %6s %12s %12s\n", "backend", "depth", "ticks/cqe", "ns/cqe");
+
+	for (int b = 0; b < nvme_cq_scan_nbackends; b++) {
+		const struct nvme_cq_scan_backend *backend = &nvme_cq_scan_backends[b];
+
+		if (!backend->supported())
+			continue;
+
+		for (int depth = 4; depth <= QSIZE; depth <<= 2) {
+			uint64_t start, ticks;
+			volatile int sink = 0;
+
+			start = get_ticks();
+
+			for (int i = 0; i < ITERATIONS; i++)
+				sink += backend->scan(cqes, 0, depth);
+
+			ticks = get_ticks() - start;
+
+			if (sink != depth * ITERATIONS)
+				fprintf(stderr, "%s: invalid scan result\n", backend->name);
+
+			printf("%-8s %6d %12.3f %12.3f\n", backend->name, depth,
+			       (double)ticks / ITERATIONS / depth,
+			       (double)ticks * 1e9 / (double)get_ticks_freq() / ITERATIONS / depth);
+		}
+	}
+
+	return 0;
+}
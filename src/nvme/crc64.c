@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/crc64: " fmt
+
+#include <byteswap.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+# include <sys/auxv.h>
+# include <asm/hwcap.h>
+#endif
+
+#include <vfn/support/atomic.h>
+#include <vfn/support/compiler.h>
+#include <vfn/support/endian.h>
+#include <vfn/support/log.h>
+
+#include "ccan/array_size/array_size.h"
+
+#include "crc64.h"
+#include "crc64table.h"
+
+static uint64_t crc64_table(uint64_t crc, const unsigned char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = (crc >> 8) ^ crc64_nvme_table[0][(crc & 0xff) ^ buf[i]];
+
+	return crc;
+}
+
+static uint64_t crc64_slice8(uint64_t crc, const unsigned char *buf, size_t len)
+{
+	uint64_t v;
+
+	for (; len >= 8; buf += 8, len -= 8) {
+		memcpy(&v, buf, sizeof(v));
+
+		crc ^= le64_to_cpu((leint64_t __force)v);
+
+		crc = crc64_nvme_table[7][crc & 0xff] ^
+			crc64_nvme_table[6][(crc >> 8) & 0xff] ^
+			crc64_nvme_table[5][(crc >> 16) & 0xff] ^
+			crc64_nvme_table[4][(crc >> 24) & 0xff] ^
+			crc64_nvme_table[3][(crc >> 32) & 0xff] ^
+			crc64_nvme_table[2][(crc >> 40) & 0xff] ^
+			crc64_nvme_table[1][(crc >> 48) & 0xff] ^
+			crc64_nvme_table[0][crc >> 56];
+	}
+
+	return crc64_table(crc, buf, len);
+}
+
+static bool crc64_always_supported(void)
+{
+	return true;
+}
+
+/*
+ * The folding implementations keep four 128 bit accumulators, each folded
+ * forward by 512 bits (carry-less multiplication by x^d mod P) and xor'ed with
+ * the next block at that position. The accumulators are then folded into one
+ * and the remaining 128 bits (which are congruent to the message modulo P) are
+ * reduced with the tables, along with any tail shorter than a block.
+ */
+#if defined(__x86_64__)
+static inline __attribute__((target("pclmul"))) __m128i crc64_fold_pclmul(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+static __attribute__((target("pclmul"))) uint64_t crc64_pclmul(uint64_t crc,
+							      const unsigned char *buf,
+							      size_t len)
+{
+	const __m128i k128 = _mm_loadu_si128((const __m128i *)crc64_nvme_fold128);
+	const __m128i k512 = _mm_loadu_si128((const __m128i *)crc64_nvme_fold512);
+	__m128i x0, x1, x2, x3;
+	unsigned char tail[16];
+
+	if (len < 64)
+		return crc64_slice8(crc, buf, len);
+
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buf),
+			   _mm_cvtsi64_si128((long long)crc));
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+
+	for (buf += 64, len -= 64; len >= 64; buf += 64, len -= 64) {
+		x0 = _mm_xor_si128(crc64_fold_pclmul(x0, k512),
+				   _mm_loadu_si128((const __m128i *)buf));
+		x1 = _mm_xor_si128(crc64_fold_pclmul(x1, k512),
+				   _mm_loadu_si128((const __m128i *)(buf + 16)));
+		x2 = _mm_xor_si128(crc64_fold_pclmul(x2, k512),
+				   _mm_loadu_si128((const __m128i *)(buf + 32)));
+		x3 = _mm_xor_si128(crc64_fold_pclmul(x3, k512),
+				   _mm_loadu_si128((const __m128i *)(buf + 48)));
+	}
+
+	x1 = _mm_xor_si128(crc64_fold_pclmul(x0, k128), x1);
+	x2 = _mm_xor_si128(crc64_fold_pclmul(x1, k128), x2);
+	x3 = _mm_xor_si128(crc64_fold_pclmul(x2, k128), x3);
+
+	for (; len >= 16; buf += 16, len -= 16)
+		x3 = _mm_xor_si128(crc64_fold_pclmul(x3, k128),
+				   _mm_loadu_si128((const __m128i *)buf));
+
+	_mm_storeu_si128((__m128i *)tail, x3);
+
+	return crc64_slice8(crc64_slice8(0, tail, sizeof(tail)), buf, len);
+}
+
+static bool crc64_pclmul_supported(void)
+{
+	return __builtin_cpu_supports("pclmul");
+}
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline __attribute__((target("+crypto"))) uint64x2_t crc64_fold_pmull(uint64x2_t x,
+									      poly64x2_t k)
+{
+	poly128_t lo = vmull_p64((poly64_t)vgetq_lane_u64(x, 0), vgetq_lane_p64(k, 0));
+	poly128_t hi = vmull_high_p64(vreinterpretq_p64_u64(x), k);
+
+	return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+}
+
+static inline uint64x2_t crc64_load_neon(const unsigned char *buf)
+{
+	return vreinterpretq_u64_u8(vld1q_u8(buf));
+}
+
+static __attribute__((target("+crypto"))) uint64_t crc64_pmull(uint64_t crc,
+							      const unsigned char *buf,
+							      size_t len)
+{
+	const poly64x2_t k128 = vreinterpretq_p64_u64(vld1q_u64(crc64_nvme_fold128));
+	const poly64x2_t k512 = vreinterpretq_p64_u64(vld1q_u64(crc64_nvme_fold512));
+	uint64x2_t x0, x1, x2, x3;
+	unsigned char tail[16];
+
+	if (len < 64)
+		return crc64_slice8(crc, buf, len);
+
+	x0 = veorq_u64(crc64_load_neon(buf), vcombine_u64(vcreate_u64(crc), vcreate_u64(0)));
+	x1 = crc64_load_neon(buf + 16);
+	x2 = crc64_load_neon(buf + 32);
+	x3 = crc64_load_neon(buf + 48);
+
+	for (buf += 64, len -= 64; len >= 64; buf += 64, len -= 64) {
+		x0 = veorq_u64(crc64_fold_pmull(x0, k512), crc64_load_neon(buf));
+		x1 = veorq_u64(crc64_fold_pmull(x1, k512), crc64_load_neon(buf + 16));
+		x2 = veorq_u64(crc64_fold_pmull(x2, k512), crc64_load_neon(buf + 32));
+		x3 = veorq_u64(crc64_fold_pmull(x3, k512), crc64_load_neon(buf + 48));
+	}
+
+	x1 = veorq_u64(crc64_fold_pmull(x0, k128), x1);
+	x2 = veorq_u64(crc64_fold_pmull(x1, k128), x2);
+	x3 = veorq_u64(crc64_fold_pmull(x2, k128), x3);
+
+	for (; len >= 16; buf += 16, len -= 16)
+		x3 = veorq_u64(crc64_fold_pmull(x3, k128), crc64_load_neon(buf));
+
+	vst1q_u8(tail, vreinterpretq_u8_u64(x3));
+
+	return crc64_slice8(crc64_slice8(0, tail, sizeof(tail)), buf, len);
+}
+
+static bool crc64_pmull_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+#endif
+
+/* ordered by preference */
+const struct nvme_crc64_backend nvme_crc64_backends[] = {
+#if defined(__x86_64__)
+	{"pclmul", crc64_pclmul, crc64_pclmul_supported},
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	{"pmull", crc64_pmull, crc64_pmull_supported},
+#endif
+	{"slice8", crc64_slice8, crc64_always_supported},
+	{"table", crc64_table, crc64_always_supported},
+};
+
+const int nvme_crc64_nbackends = ARRAY_SIZE(nvme_crc64_backends);
+
+nvme_crc64_fn __nvme_crc64_fn = crc64_slice8;
+
+static void __attribute__((constructor)) init_crc64(void)
+{
+	const char *name = getenv("VFN_CRC64");
+
+	for (int i = 0; i < nvme_crc64_nbackends; i++) {
+		const struct nvme_crc64_backend *b = &nvme_crc64_backends[i];
+
+		if (name && strcmp(name, b->name))
+			continue;
+
+		if (!b->supported())
+			continue;
+
+		log_debug("using %s crc64\n", b->name);
+
+		__nvme_crc64_fn = b->update;
+
+		return;
+	}
+
+	log_debug("no matching crc64 implementation; using slice8\n");
+}
+
+uint64_t nvme_crc64(uint64_t crc, const unsigned char *buffer, size_t len)
+{
+	return __nvme_crc64_fn(crc, buffer, len) ^ (uint64_t)~0;
+}
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * A crc64 implementation updates the (non-inverted) crc state @crc with @len
+ * bytes from @buf.
+ */
+typedef uint64_t (*nvme_crc64_fn)(uint64_t crc, const unsigned char *buf, size_t len);
+
+struct nvme_crc64_backend {
+	const char *name;
+	nvme_crc64_fn update;
+	bool (*supported)(void);
+};
+
+extern const struct nvme_crc64_backend nvme_crc64_backends[];
+extern const int nvme_crc64_nbackends;
+
+extern nvme_crc64_fn __nvme_crc64_fn;
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "vfn/support/ticks.h"
+
+#include "crc64.h"
+
+#define ITERATIONS 20000
+
+static unsigned char buf[4096] __attribute__((aligned(64)));
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	for (int i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = (unsigned char)i;
+
+	printf("%-8s %6s %12s %12s\n", "backend", "len", "ticks/byte", "GB/s");
+
+	for (int b = 0; b < nvme_crc64_nbackends; b++) {
+		const struct nvme_crc64_backend *backend = &nvme_crc64_backends[b];
+
+		if (!backend->supported())
+			continue;
+
+		for (size_t len = 16; len <= sizeof(buf); len <<= 2) {
+			volatile uint64_t sink = 0;
+			uint64_t start, ticks;
+			double ns;
+
+			start = get_ticks();
+
+			for (int i = 0; i < ITERATIONS; i++)
+				sink ^= backend->update(~0ULL, buf, len);
+
+			ticks = get_ticks() - start;
+			ns = (double)ticks * 1e9 / (double)get_ticks_freq();
+
+			printf("%-8s %6zu %12.3f %12.3f\n", backend->name, len,
+			       (double)ticks / ITERATIONS / (double)len,
+			       (double)len * ITERATIONS / ns);
+		}
+	}
+
+	return 0;
+}
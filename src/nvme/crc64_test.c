@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ccan/tap/tap.h"
+
+#include "vfn/support.h"
+
+#include "crc64.h"
+
+#define BUFSIZE 8192
+
+static unsigned char buf[BUFSIZE + 16];
+
+/* the byte-at-a-time table implementation is the reference */
+static uint64_t reference(uint64_t crc, const unsigned char *p, size_t len)
+{
+	return nvme_crc64_backends[nvme_crc64_nbackends - 1].update(crc, p, len);
+}
+
+int main(void)
+{
+	const unsigned char check[] = "123456789";
+
+	plan_tests(3 * nvme_crc64_nbackends);
+
+	for (int i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = (unsigned char)(i * 131 + (i >> 8));
+
+	for (int b = 0; b < nvme_crc64_nbackends; b++) {
+		const struct nvme_crc64_backend *backend = &nvme_crc64_backends[b];
+		bool ok = true;
+		uint64_t crc;
+
+		if (!backend->supported()) {
+			skip(3, "%s not supported", backend->name);
+			continue;
+		}
+
+		/* CRC-64/NVME check value */
+		ok1((backend->update(~0ULL, check, 9) ^ ~0ULL) == 0xae8b14860a799888ULL);
+
+		/* all lengths around the block sizes at every alignment */
+		for (size_t len = 0; len < 300 && ok; len++) {
+			for (size_t ofst = 0; ofst < 16; ofst++) {
+				if (backend->update(~0ULL, buf + ofst, len) !=
+				    reference(~0ULL, buf + ofst, len))
+					ok = false;
+			}
+		}
+
+		ok(ok, "%s matches table for short buffers", backend->name);
+
+		/* chained updates */
+		crc = backend->update(0x1234, buf, 4096);
+		crc = backend->update(crc, buf + 4096, BUFSIZE - 4096);
+
+		ok(crc == reference(0x1234, buf, BUFSIZE), "%s chains", backend->name);
+	}
+
+	return exit_status();
+}
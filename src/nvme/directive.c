@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/directive: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+static void __prep_dir(union nvme_cmd *cmd, uint8_t opcode, uint32_t nsid, uint8_t dtype,
+		       uint8_t doper, uint16_t dspec, uint32_t cdw12, size_t len)
+{
+	*cmd = (union nvme_cmd) {
+		.opcode = opcode,
+		.nsid = cpu_to_le32(nsid),
+		.cdw11 = cpu_to_le32(NVME_FIELD_SET(doper, DIR_DOPER) |
+				     NVME_FIELD_SET(dtype, DIR_DTYPE) |
+				     NVME_FIELD_SET(dspec, DIR_DSPEC)),
+		.cdw12 = cpu_to_le32(cdw12),
+	};
+
+	/* number of dwords, zeroes based */
+	if (len)
+		cmd->cdw10 = cpu_to_le32((uint32_t)(len >> 2) - 1);
+}
+
+int nvme_dir_send(struct nvme_ctrl *ctrl, uint32_t nsid, uint8_t dtype, uint8_t doper,
+		  uint16_t dspec, uint32_t cdw12, void *buf, size_t len)
+{
+	union nvme_cmd cmd;
+
+	__prep_dir(&cmd, NVME_ADMIN_DIR_SEND, nsid, dtype, doper, dspec, cdw12, len);
+
+	return nvme_admin(ctrl, &cmd, buf, len, NULL);
+}
+
+int nvme_dir_recv(struct nvme_ctrl *ctrl, uint32_t nsid, uint8_t dtype, uint8_t doper,
+		  uint16_t dspec, uint32_t cdw12, void *buf, size_t len, struct nvme_cqe *cqe)
+{
+	union nvme_cmd cmd;
+
+	__prep_dir(&cmd, NVME_ADMIN_DIR_RECV, nsid, dtype, doper, dspec, cdw12, len);
+
+	return nvme_admin(ctrl, &cmd, buf, len, cqe);
+}
+
+int nvme_dir_identify(struct nvme_ctrl *ctrl, uint32_t nsid, struct nvme_dir_info *info)
+{
+	__autofree void *buf = zmalloc(NVME_DIR_IDENTIFY_SIZE);
+
+	if (nvme_dir_recv(ctrl, nsid, NVME_DIR_TYPE_IDENTIFY, NVME_DIR_IDENTIFY_PARAMS, 0, 0,
+			  buf, NVME_DIR_IDENTIFY_SIZE, NULL))
+		return -1;
+
+	/* only the first 32 directive types are defined */
+	*info = (struct nvme_dir_info) {
+		.supported = le32_to_cpu(*(leint32_t *)(buf + NVME_DIR_IDENTIFY_SUPPORTED)),
+		.enabled = le32_to_cpu(*(leint32_t *)(buf + NVME_DIR_IDENTIFY_ENABLED)),
+		.persistent = le32_to_cpu(*(leint32_t *)(buf + NVME_DIR_IDENTIFY_PERSISTENT)),
+	};
+
+	return 0;
+}
+
+int nvme_dir_enable(struct nvme_ctrl *ctrl, uint32_t nsid, uint8_t dtype, bool enable)
+{
+	uint32_t cdw12 = NVME_FIELD_SET(enable ? 1 : 0, DIR_ENDIR) |
+		NVME_FIELD_SET(dtype, DIR_TDTYPE);
+
+	if (dtype == NVME_DIR_TYPE_IDENTIFY || dtype == NVME_DIR_TYPE_FDP) {
+		log_debug("directive type %" PRIu8 " cannot be enabled per namespace\n", dtype);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	return nvme_dir_send(ctrl, nsid, NVME_DIR_TYPE_IDENTIFY, NVME_DIR_IDENTIFY_ENABLE, 0,
+			     cdw12, NULL, 0);
+}
+
+int nvme_streams_get_params(struct nvme_ctrl *ctrl, uint32_t nsid,
+			    struct nvme_streams_params *params)
+{
+	uint8_t buf[NVME_DIR_STREAMS_SIZE] = {};
+
+	if (nvme_dir_recv(ctrl, nsid, NVME_DIR_TYPE_STREAMS, NVME_DIR_STREAMS_PARAMS, 0, 0,
+			  buf, sizeof(buf), NULL))
+		return -1;
+
+	*params = (struct nvme_streams_params) {
+		.msl = le16_to_cpu(*(leint16_t *)(buf + NVME_DIR_STREAMS_MSL)),
+		.nssa = le16_to_cpu(*(leint16_t *)(buf + NVME_DIR_STREAMS_NSSA)),
+		.nsso = le16_to_cpu(*(leint16_t *)(buf + NVME_DIR_STREAMS_NSSO)),
+		.sws = le32_to_cpu(*(leint32_t *)(buf + NVME_DIR_STREAMS_SWS)),
+		.sgs = le16_to_cpu(*(leint16_t *)(buf + NVME_DIR_STREAMS_SGS)),
+		.nsa = le16_to_cpu(*(leint16_t *)(buf + NVME_DIR_STREAMS_NSA)),
+		.nso = le16_to_cpu(*(leint16_t *)(buf + NVME_DIR_STREAMS_NSO)),
+	};
+
+	return 0;
+}
+
+int nvme_streams_alloc(struct nvme_ctrl *ctrl, uint32_t nsid, uint16_t nsr)
+{
+	struct nvme_cqe cqe;
+
+	if (nvme_dir_recv(ctrl, nsid, NVME_DIR_TYPE_STREAMS, NVME_DIR_STREAMS_ALLOC, 0, nsr,
+			  NULL, 0, &cqe))
+		return -1;
+
+	return le32_to_cpu(cqe.dw0) & 0xffff;
+}
+
+int nvme_fdp_get_config(struct nvme_ctrl *ctrl, uint16_t endgid, struct nvme_fdp_config *config)
+{
+	struct nvme_cqe cqe;
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_GET_FEATURES,
+	};
+	uint32_t dw0;
+
+	cmd.features.fid = NVME_FEAT_FID_FDP;
+	cmd.features.cdw11 = cpu_to_le32(endgid);
+
+	if (nvme_admin(ctrl, &cmd, NULL, 0, &cqe))
+		return -1;
+
+	dw0 = le32_to_cpu(cqe.dw0);
+
+	*config = (struct nvme_fdp_config) {
+		.enabled = NVME_FIELD_GET(dw0, FEAT_FDP_FDPE),
+		.index = (uint8_t)NVME_FIELD_GET(dw0, FEAT_FDP_FDPCIDX),
+	};
+
+	return 0;
+}
+
+int nvme_fdp_get_ruhs(struct nvme_ctrl *ctrl, struct nvme_sq *sq, uint32_t nsid,
+		      struct nvme_ruhs *ruhs, int max)
+{
+	__autofree void *buf = NULL;
+	union nvme_cmd cmd;
+	size_t len;
+	int n;
+
+	if (max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = NVME_RUHS_DESC + (size_t)max * NVME_RUHSD_SIZE;
+	buf = zmalloc(len);
+
+	cmd = (union nvme_cmd) {
+		.opcode = NVME_NVM_IO_MGMT_RECV,
+		.nsid = cpu_to_le32(nsid),
+		.cdw10 = cpu_to_le32(NVME_FIELD_SET(NVME_IO_MGMT_MO_RUHS, IO_MGMT_MO)),
+		.cdw11 = cpu_to_le32((uint32_t)(len >> 2) - 1),
+	};
+
+	if (nvme_sync(ctrl, sq, &cmd, buf, len, NULL))
+		return -1;
+
+	n = min_t(int, max, le16_to_cpu(*(leint16_t *)(buf + NVME_RUHS_NRUHSD)));
+
+	for (int i = 0; i < n; i++) {
+		void *desc = buf + NVME_RUHS_DESC + i * NVME_RUHSD_SIZE;
+
+		ruhs[i] = (struct nvme_ruhs) {
+			.pid = le16_to_cpu(*(leint16_t *)(desc + NVME_RUHSD_PID)),
+			.ruhid = le16_to_cpu(*(leint16_t *)(desc + NVME_RUHSD_RUHID)),
+			.earutr = le32_to_cpu(*(leint32_t *)(desc + NVME_RUHSD_EARUTR)),
+			.ruamw = le64_to_cpu(*(leint64_t *)(desc + NVME_RUHSD_RUAMW)),
+		};
+	}
+
+	return n;
+}
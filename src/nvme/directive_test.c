@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "directive.c"
+
+static union nvme_cmd last;
+static size_t lastlen;
+
+int nvme_admin(struct nvme_ctrl *ctrl UNUSED, union nvme_cmd *sqe, void *buf, size_t len,
+	       struct nvme_cqe *cqe_copy)
+{
+	uint32_t dw0 = 0;
+
+	last = *sqe;
+	lastlen = len;
+
+	if (sqe->opcode == NVME_ADMIN_DIR_RECV && len == NVME_DIR_IDENTIFY_SIZE) {
+		/* identify and streams supported; streams enabled */
+		*(uint8_t *)(buf + NVME_DIR_IDENTIFY_SUPPORTED) = 0x3;
+		*(uint8_t *)(buf + NVME_DIR_IDENTIFY_ENABLED) = 0x2;
+	} else if (sqe->opcode == NVME_ADMIN_DIR_RECV && buf) {
+		*(leint16_t *)(buf + NVME_DIR_STREAMS_NSSA) = cpu_to_le16(16);
+		*(leint32_t *)(buf + NVME_DIR_STREAMS_SWS) = cpu_to_le32(32);
+	}
+
+	/* streams allocated */
+	if (sqe->opcode == NVME_ADMIN_DIR_RECV && !buf)
+		dw0 = min_t(uint32_t, le32_to_cpu(sqe->cdw12), 8);
+
+	/* fdp enabled with configuration 2 */
+	if (sqe->opcode == NVME_ADMIN_GET_FEATURES)
+		dw0 = 0x201;
+
+	if (cqe_copy)
+		*cqe_copy = (struct nvme_cqe) { .dw0 = cpu_to_le32(dw0) };
+
+	return 0;
+}
+
+int nvme_sync(struct nvme_ctrl *ctrl UNUSED, struct nvme_sq *sq UNUSED, union nvme_cmd *sqe,
+	      void *buf, size_t len, struct nvme_cqe *cqe_copy UNUSED)
+{
+	void *desc = buf + NVME_RUHS_DESC;
+
+	last = *sqe;
+	lastlen = len;
+
+	*(leint16_t *)(buf + NVME_RUHS_NRUHSD) = cpu_to_le16(4);
+
+	for (int i = 0; i < 4 && NVME_RUHS_DESC + (i + 1) * NVME_RUHSD_SIZE <= (int)len; i++) {
+		*(leint16_t *)(desc + NVME_RUHSD_PID) = cpu_to_le16((uint16_t)i);
+		*(leint16_t *)(desc + NVME_RUHSD_RUHID) = cpu_to_le16((uint16_t)(i + 8));
+		*(leint64_t *)(desc + NVME_RUHSD_RUAMW) = cpu_to_le64(0x1000);
+
+		desc += NVME_RUHSD_SIZE;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {};
+	struct nvme_dir_info info;
+	struct nvme_streams_params params;
+	struct nvme_fdp_config config;
+	struct nvme_ruhs ruhs[2];
+	union nvme_cmd cmd = {};
+
+	plan_tests(14);
+
+	ok1(nvme_dir_identify(&ctrl, 1, &info) == 0);
+	ok1(info.supported == 0x3 && info.enabled == 0x2 && !info.persistent);
+	ok1(last.opcode == NVME_ADMIN_DIR_RECV && le32_to_cpu(last.nsid) == 1 &&
+	    le32_to_cpu(last.cdw10) == 0x3ff && le32_to_cpu(last.cdw11) == 0x1);
+
+	/* enable streams */
+	ok1(nvme_dir_enable(&ctrl, 1, NVME_DIR_TYPE_STREAMS, true) == 0);
+	ok1(last.opcode == NVME_ADMIN_DIR_SEND && le32_to_cpu(last.cdw11) == 0x1 &&
+	    le32_to_cpu(last.cdw12) == 0x101 && !lastlen);
+
+	ok1(nvme_dir_enable(&ctrl, 1, NVME_DIR_TYPE_FDP, true) == -1 && errno == EINVAL);
+
+	ok1(nvme_streams_get_params(&ctrl, 1, &params) == 0);
+	ok1(params.nssa == 16 && params.sws == 32 && le32_to_cpu(last.cdw11) == 0x101);
+
+	ok1(nvme_streams_alloc(&ctrl, 1, 32) == 8 && le32_to_cpu(last.cdw11) == 0x103);
+
+	ok1(nvme_fdp_get_config(&ctrl, 1, &config) == 0 && config.enabled && config.index == 2);
+
+	/* the controller reports more handles than fit */
+	ok1(nvme_fdp_get_ruhs(&ctrl, NULL, 1, ruhs, 2) == 2);
+	ok1(last.opcode == NVME_NVM_IO_MGMT_RECV && le32_to_cpu(last.cdw10) == 0x1 &&
+	    le32_to_cpu(last.cdw11) == (NVME_RUHS_DESC + 2 * NVME_RUHSD_SIZE) / 4 - 1);
+	ok1(ruhs[1].pid == 1 && ruhs[1].ruhid == 9 && ruhs[1].ruamw == 0x1000);
+
+	/* placement hints */
+	nvme_rw_set_directive(&cmd, NVME_DIR_TYPE_FDP, 3);
+	nvme_rw_set_directive(&cmd, NVME_DIR_TYPE_STREAMS, 5);
+	ok1(le32_to_cpu(cmd.cdw12) == 0x100000 && le32_to_cpu(cmd.cdw13) == 0x50000);
+
+	return exit_status();
+}
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/fixed: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/trace.h>
+#include <vfn/nvme.h>
+
+#include "prpfill.h"
+
+static void __unmap_bufs(struct nvme_ctrl *ctrl, struct nvme_fixed_buf *bufs, int n)
+{
+	void **vaddrs = znew_t(void *, n);
+	int nunmap = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (bufs[i].do_unmap)
+			vaddrs[nunmap++] = bufs[i].vaddr;
+	}
+
+	if (nunmap)
+		log_fatal_if(iommu_unmap_vaddrs(__iommu_ctx(ctrl), vaddrs, nunmap),
+			     "iommu_unmap_vaddrs\n");
+
+	free(vaddrs);
+}
+
+/* number of pages spanned by the buffer */
+static inline size_t __nprps(struct nvme_fixed_buf *buf, int pageshift)
+{
+	size_t pagesize = 1 << pageshift;
+
+	return ALIGN_UP((buf->iova & (pagesize - 1)) + buf->len, pagesize) >> pageshift;
+}
+
+int nvme_register_buffers(struct nvme_ctrl *ctrl, const struct iovec *iov, int n)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	size_t pagesize = 1 << pageshift, nprps = 0, ofst = 0;
+	struct nvme_fixed_buf *bufs;
+	struct iovec *map_iov;
+	uint64_t *map_iovas;
+	int i, nmap = 0;
+
+	if (ctrl->fixed.bufs) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (n < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bufs = znew_t(struct nvme_fixed_buf, n);
+	map_iov = znew_t(struct iovec, n);
+	map_iovas = znew_t(uint64_t, n);
+
+	for (i = 0; i < n; i++) {
+		struct nvme_fixed_buf *buf = &bufs[i];
+
+		if (!iov[i].iov_base || !iov[i].iov_len) {
+			log_debug("invalid buffer %d\n", i);
+
+			errno = EINVAL;
+			goto free;
+		}
+
+		buf->vaddr = iov[i].iov_base;
+		buf->len = iov[i].iov_len;
+
+		if (!iommu_translate_vaddr(ctx, buf->vaddr, &buf->iova)) {
+			map_iov[nmap++] = iov[i];
+			buf->do_unmap = true;
+		}
+	}
+
+	/* map everything that is not already mapped in one go */
+	if (nmap && iommu_map_vaddrs(ctx, map_iov, nmap, map_iovas, 0x0)) {
+		log_debug("failed to map buffers\n");
+		goto free;
+	}
+
+	for (i = 0, nmap = 0; i < n; i++) {
+		if (bufs[i].do_unmap)
+			bufs[i].iova = map_iovas[nmap++];
+
+		nprps += __nprps(&bufs[i], pageshift);
+	}
+
+	ctrl->fixed.len = ALIGN_UP(nprps * sizeof(leint64_t), __VFN_PAGESIZE);
+
+	if (iommu_alloc_node(ctx, ctrl->fixed.len, ctrl->numa.node, &ctrl->fixed.vaddr,
+			     &ctrl->fixed.iova)) {
+		log_debug("failed to allocate prp lists\n");
+		goto unmap;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct nvme_fixed_buf *buf = &bufs[i];
+		size_t count = __nprps(buf, pageshift);
+
+		buf->prps = ctrl->fixed.vaddr + ofst;
+		buf->prps_iova = ctrl->fixed.iova + ofst;
+
+		__nvme_prp_fill_fn(buf->prps, ALIGN_DOWN(buf->iova, pagesize), pageshift,
+				   (int)count);
+
+		ofst += count * sizeof(leint64_t);
+	}
+
+	ctrl->fixed.bufs = bufs;
+	ctrl->fixed.nbufs = n;
+
+	free(map_iov);
+	free(map_iovas);
+
+	return 0;
+
+unmap:
+	__unmap_bufs(ctrl, bufs, n);
+free:
+	free(map_iov);
+	free(map_iovas);
+	free(bufs);
+
+	return -1;
+}
+
+void nvme_unregister_buffers(struct nvme_ctrl *ctrl)
+{
+	if (!ctrl->fixed.bufs)
+		return;
+
+	__unmap_bufs(ctrl, ctrl->fixed.bufs, ctrl->fixed.nbufs);
+
+	iommu_free(__iommu_ctx(ctrl), ctrl->fixed.vaddr, ctrl->fixed.len);
+
+	free(ctrl->fixed.bufs);
+
+	memset(&ctrl->fixed, 0x0, sizeof(ctrl->fixed));
+}
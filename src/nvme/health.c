@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/health: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "types.h"
+
+struct nvme_health_cache {
+	/* log page buffer; mapped for the lifetime of the cache */
+	void *vaddr;
+
+	struct nvme_future future;
+	bool inflight;
+
+	/* refresh interval and time of the next refresh in ticks */
+	uint64_t interval, due;
+
+	/* serializes nvme_health_process() */
+	bool busy;
+
+	/* odd while @health is being written */
+	uint32_t seq;
+	struct nvme_health health;
+};
+
+static void __health_parse(struct nvme_health *h, void *log)
+{
+	*h = (struct nvme_health) {
+		.critical_warning = *(uint8_t *)(log + NVME_SMART_CRIT_WARN),
+		.temperature = le16_to_cpu(*(leint16_t *)(log + NVME_SMART_TEMP)),
+		.avail_spare = *(uint8_t *)(log + NVME_SMART_AVAIL_SPARE),
+		.spare_thresh = *(uint8_t *)(log + NVME_SMART_SPARE_THRESH),
+		.percent_used = *(uint8_t *)(log + NVME_SMART_PERCENT_USED),
+		.data_units_read = le64_to_cpu(*(leint64_t *)(log + NVME_SMART_DATA_UNITS_READ)),
+		.data_units_written =
+			le64_to_cpu(*(leint64_t *)(log + NVME_SMART_DATA_UNITS_WRITTEN)),
+		.host_reads = le64_to_cpu(*(leint64_t *)(log + NVME_SMART_HOST_READS)),
+		.host_writes = le64_to_cpu(*(leint64_t *)(log + NVME_SMART_HOST_WRITES)),
+		.ctrl_busy_time = le64_to_cpu(*(leint64_t *)(log + NVME_SMART_CTRL_BUSY_TIME)),
+		.power_cycles = le64_to_cpu(*(leint64_t *)(log + NVME_SMART_POWER_CYCLES)),
+		.power_on_hours = le64_to_cpu(*(leint64_t *)(log + NVME_SMART_POWER_ON_HOURS)),
+		.unsafe_shutdowns =
+			le64_to_cpu(*(leint64_t *)(log + NVME_SMART_UNSAFE_SHUTDOWNS)),
+		.media_errors = le64_to_cpu(*(leint64_t *)(log + NVME_SMART_MEDIA_ERRORS)),
+		.num_err_log_entries =
+			le64_to_cpu(*(leint64_t *)(log + NVME_SMART_NUM_ERR_LOG_ENTRIES)),
+		.updated = get_ticks(),
+	};
+}
+
+static void __health_publish(struct nvme_health_cache *cache)
+{
+	struct nvme_health h;
+
+	__health_parse(&h, cache->vaddr);
+
+	__atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	cache->health = h;
+
+	__atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Read the log page without retaining asynchronous events, such that a
+ * SMART / Health Status event is unmasked again by the refresh it triggers.
+ */
+static int __health_submit(struct nvme_ctrl *ctrl, struct nvme_health_cache *cache)
+{
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_GET_LOG_PAGE,
+		.nsid = cpu_to_le32(0xffffffff),
+	};
+
+	cmd.log.lid = NVME_LOG_LID_SMART;
+	cmd.log.numdl = cpu_to_le16((NVME_SMART_SIZE >> 2) - 1);
+
+	atomic_store_release(&ctrl->health.stale, false);
+
+	if (nvme_admin_async(ctrl, &cmd, cache->vaddr, NVME_SMART_SIZE, &cache->future))
+		return -1;
+
+	cache->inflight = true;
+
+	return 0;
+}
+
+int nvme_health_enable(struct nvme_ctrl *ctrl, uint64_t interval_us)
+{
+	struct nvme_health_cache *cache = ctrl->health.cache;
+	uint64_t iova;
+
+	if (cache) {
+		cache->interval = ns_to_ticks(interval_us * 1000);
+		cache->due = get_ticks() + cache->interval;
+
+		return 0;
+	}
+
+	cache = znew_t(struct nvme_health_cache, 1);
+
+	if (iommu_alloc_node(__iommu_ctx(ctrl), NVME_SMART_SIZE, ctrl->numa.node, &cache->vaddr,
+			     &iova)) {
+		log_debug("could not allocate log page buffer\n");
+		goto free;
+	}
+
+	if (__health_submit(ctrl, cache) || nvme_future_wait(&cache->future)) {
+		log_debug("could not read smart / health information log page\n");
+		goto release;
+	}
+
+	cache->inflight = false;
+	cache->interval = ns_to_ticks(interval_us * 1000);
+	cache->due = get_ticks() + cache->interval;
+
+	__health_publish(cache);
+
+	atomic_store_release(&ctrl->health.cache, cache);
+
+	return 0;
+
+release:
+	iommu_free(__iommu_ctx(ctrl), cache->vaddr, NVME_SMART_SIZE);
+free:
+	free(cache);
+
+	return -1;
+}
+
+void nvme_health_disable(struct nvme_ctrl *ctrl)
+{
+	struct nvme_health_cache *cache = ctrl->health.cache;
+
+	if (!cache)
+		return;
+
+	/* the controller must be done with the buffer */
+	if (cache->inflight)
+		nvme_future_wait(&cache->future);
+
+	ctrl->health.cache = NULL;
+
+	iommu_free(__iommu_ctx(ctrl), cache->vaddr, NVME_SMART_SIZE);
+	free(cache);
+}
+
+int nvme_health_process(struct nvme_ctrl *ctrl)
+{
+	struct nvme_health_cache *cache = ctrl->health.cache;
+	uint64_t now;
+	int ret = 0;
+
+	if (!cache) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (atomic_xchg(&cache->busy, true))
+		return 0;
+
+	nvme_admin_process(ctrl);
+
+	now = get_ticks();
+
+	if (cache->inflight && atomic_load_acquire(&cache->future.done)) {
+		cache->inflight = false;
+		cache->due = now + cache->interval;
+
+		if (nvme_future_wait(&cache->future)) {
+			log_debug("refresh failed\n");
+			ret = -1;
+		} else {
+			__health_publish(cache);
+			ret = 1;
+		}
+	}
+
+	if (!cache->inflight && ret >= 0 && (atomic_load_acquire(&ctrl->health.stale) ||
+					     (cache->interval && now >= cache->due))) {
+		/* the admin queue is full; try again on the next call */
+		if (__health_submit(ctrl, cache) && errno != EBUSY)
+			ret = -1;
+	}
+
+	atomic_store_release(&cache->busy, false);
+
+	return ret;
+}
+
+int nvme_health_get(struct nvme_ctrl *ctrl, struct nvme_health *health)
+{
+	struct nvme_health_cache *cache = atomic_load_acquire(&ctrl->health.cache);
+	uint32_t seq;
+
+	if (!cache) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (;;) {
+		seq = __atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		*health = cache->health;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&cache->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	return 0;
+}
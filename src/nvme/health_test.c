@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "health.c"
+
+int iommu_alloc_node(struct iommu_ctx *ctx UNUSED, size_t len, int node UNUSED, void **vaddr,
+		     uint64_t *iova)
+{
+	if (pgmap(vaddr, len) < 0)
+		return -1;
+
+	*iova = (uint64_t)*vaddr;
+
+	return 0;
+}
+
+void iommu_free(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len)
+{
+	pgunmap(vaddr, len);
+}
+
+/* the refresh in flight; completed by nvme_admin_process() */
+static union nvme_cmd last;
+static void *pending_buf;
+static struct nvme_future *pending;
+static int ncmds;
+static bool fail;
+
+int nvme_admin_async(struct nvme_ctrl *ctrl UNUSED, union nvme_cmd *sqe, void *buf,
+		     size_t len UNUSED, struct nvme_future *future)
+{
+	*future = (struct nvme_future) {};
+
+	last = *sqe;
+	pending_buf = buf;
+	pending = future;
+	ncmds++;
+
+	return 0;
+}
+
+int nvme_admin_process(struct nvme_ctrl *ctrl UNUSED)
+{
+	if (!pending)
+		return 0;
+
+	/* the temperature and the number of power cycles move in lockstep */
+	*(leint16_t *)(pending_buf + NVME_SMART_TEMP) = cpu_to_le16((uint16_t)(300 + ncmds));
+	*(leint64_t *)(pending_buf + NVME_SMART_POWER_CYCLES) = cpu_to_le64((uint64_t)ncmds);
+
+	if (fail)
+		pending->cqe.sfp = cpu_to_le16(NVME_SC_INVALID_FIELD << 1);
+
+	atomic_store_release(&pending->done, true);
+	pending = NULL;
+
+	return 1;
+}
+
+int nvme_future_wait(struct nvme_future *future)
+{
+	while (!atomic_load_acquire(&future->done))
+		nvme_admin_process(NULL);
+
+	if (!nvme_cqe_ok(&future->cqe)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct nvme_ctrl ctrl;
+static bool stop;
+
+static void *reader(void *opaque)
+{
+	int *mismatches = opaque;
+	struct nvme_health h;
+
+	while (!atomic_load_acquire(&stop)) {
+		nvme_health_get(&ctrl, &h);
+
+		if (h.temperature != 300 + h.power_cycles)
+			(*mismatches)++;
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct nvme_health h;
+	pthread_t thread;
+	int mismatches = 0;
+
+	plan_tests(12);
+
+	ok1(nvme_health_get(&ctrl, &h) == -1 && errno == EINVAL);
+
+	/* filled by the first read */
+	ok1(nvme_health_enable(&ctrl, 0) == 0 && ncmds == 1);
+	ok1(last.opcode == NVME_ADMIN_GET_LOG_PAGE && last.log.lid == NVME_LOG_LID_SMART &&
+	    le32_to_cpu(last.nsid) == 0xffffffff && le16_to_cpu(last.log.numdl) == 127);
+	ok1(nvme_health_get(&ctrl, &h) == 0 && h.temperature == 301 && h.updated);
+
+	/* no interval; nothing to do until invalidated */
+	ok1(nvme_health_process(&ctrl) == 0 && nvme_health_process(&ctrl) == 0 && ncmds == 1);
+
+	/* as by a smart / health status event */
+	ctrl.health.stale = true;
+
+	ok1(nvme_health_process(&ctrl) == 0 && ncmds == 2 && !ctrl.health.stale);
+	ok1(nvme_health_process(&ctrl) == 1 && nvme_health_get(&ctrl, &h) == 0 &&
+	    h.temperature == 302);
+
+	/* a failed refresh keeps the last good copy */
+	ok1(nvme_health_enable(&ctrl, 1) == 0);
+
+	fail = true;
+	__usleep(10);
+
+	ok1(nvme_health_process(&ctrl) == 0 && nvme_health_process(&ctrl) == -1 &&
+	    errno == EIO && nvme_health_get(&ctrl, &h) == 0 && h.temperature == 302);
+
+	/* readers always see a consistent copy */
+	fail = false;
+
+	assert(pthread_create(&thread, NULL, reader, &mismatches) == 0);
+
+	for (int i = 0; i < 10000; i++) {
+		ctrl.health.stale = true;
+
+		nvme_health_process(&ctrl);
+	}
+
+	atomic_store_release(&stop, true);
+	pthread_join(thread, NULL);
+
+	ok1(!mismatches && ncmds > 1000);
+
+	nvme_health_disable(&ctrl);
+
+	ok1(!ctrl.health.cache);
+	ok1(nvme_health_get(&ctrl, &h) == -1 && errno == EINVAL);
+
+	return exit_status();
+}
@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/hmb: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* chunks are carved out of (at least) 2M hugepages */
+#define NVME_HMB_CHUNK_SIZE (2ULL << 20)
+
+/* the descriptor list is kept within a single page */
+#define NVME_HMB_MAX_DESCS (int)(__VFN_PAGESIZE / NVME_HMB_DESC_SIZE)
+
+struct nvme_hmb_chunk {
+	void *vaddr;
+	uint64_t iova;
+	size_t len;
+};
+
+static void nvme_hmb_free(struct nvme_ctrl *ctrl)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+
+	for (int i = 0; i < ctrl->hmb.nchunks; i++)
+		iommu_free(ctx, ctrl->hmb.chunks[i].vaddr, ctrl->hmb.chunks[i].len);
+
+	if (ctrl->hmb.descs)
+		iommu_free(ctx, ctrl->hmb.descs, __VFN_PAGESIZE);
+
+	free(ctrl->hmb.chunks);
+
+	ctrl->hmb.chunks = NULL;
+	ctrl->hmb.nchunks = 0;
+	ctrl->hmb.descs = NULL;
+	ctrl->hmb.len = 0;
+}
+
+static int nvme_hmb_alloc(struct nvme_ctrl *ctrl, size_t len)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+	size_t mps = __mps_to_pagesize(ctrl->config.mps);
+	size_t chunk = max_t(size_t, NVME_HMB_CHUNK_SIZE, ALIGN_UP(ctrl->hmb.minds, mps));
+	int maxd = NVME_HMB_MAX_DESCS, n;
+
+	if (ctrl->hmb.maxd)
+		maxd = min_t(int, maxd, ctrl->hmb.maxd);
+
+	/* use larger chunks if the controller limits the number of descriptors */
+	if ((len + chunk - 1) / chunk > (size_t)maxd)
+		chunk = ALIGN_UP((len + (size_t)maxd - 1) / (size_t)maxd, NVME_HMB_CHUNK_SIZE);
+
+	n = (int)((len + chunk - 1) / chunk);
+
+	if (iommu_alloc_node(ctx, __VFN_PAGESIZE, ctrl->numa.node, &ctrl->hmb.descs,
+			     &ctrl->hmb.descs_iova)) {
+		log_debug("could not allocate descriptor list\n");
+
+		ctrl->hmb.descs = NULL;
+		return -1;
+	}
+
+	memset(ctrl->hmb.descs, 0x0, __VFN_PAGESIZE);
+
+	ctrl->hmb.chunks = znew_t(struct nvme_hmb_chunk, n);
+
+	for (int i = 0; i < n; i++) {
+		struct nvme_hmb_chunk *c = &ctrl->hmb.chunks[i];
+		void *desc = ctrl->hmb.descs + i * NVME_HMB_DESC_SIZE;
+
+		/* the last chunk holds the remainder */
+		c->len = min_t(size_t, chunk, ALIGN_UP(len - ctrl->hmb.len, mps));
+
+		if (iommu_alloc_node(ctx, c->len, ctrl->numa.node, &c->vaddr, &c->iova)) {
+			log_debug("could not allocate chunk %d of %zu bytes\n", i, c->len);
+
+			/*
+			 * Settle for what is allocated if the controller can make do
+			 * with it; with no minimum size (hmb.min is zero), that still
+			 * requires at least one chunk to hand to the controller.
+			 */
+			if (ctrl->hmb.nchunks && ctrl->hmb.len >= ctrl->hmb.min)
+				break;
+
+			nvme_hmb_free(ctrl);
+			return -1;
+		}
+
+		*(leint64_t *)(desc + NVME_HMB_DESC_BADD) = cpu_to_le64(c->iova);
+		*(leint32_t *)(desc + NVME_HMB_DESC_BSIZE) = cpu_to_le32((uint32_t)(c->len / mps));
+
+		ctrl->hmb.nchunks++;
+		ctrl->hmb.len += c->len;
+	}
+
+	return 0;
+}
+
+static int nvme_hmb_set(struct nvme_ctrl *ctrl, bool enable, bool mr)
+{
+	size_t mps = __mps_to_pagesize(ctrl->config.mps);
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+
+	cmd.features.fid = NVME_FEAT_FID_HOST_MEM_BUF;
+	cmd.features.cdw11 = cpu_to_le32(NVME_FIELD_SET(enable ? 1 : 0, FEAT_HMB_EHM) |
+					 NVME_FIELD_SET(mr ? 1 : 0, FEAT_HMB_MR));
+
+	if (enable) {
+		cmd.features.cdw12 = cpu_to_le32((uint32_t)(ctrl->hmb.len / mps));
+		cmd.features.cdw13 = cpu_to_le32((uint32_t)ctrl->hmb.descs_iova);
+		cmd.features.cdw14 = cpu_to_le32((uint32_t)(ctrl->hmb.descs_iova >> 32));
+		cmd.features.cdw15 = cpu_to_le32((uint32_t)ctrl->hmb.nchunks);
+	}
+
+	return nvme_admin(ctrl, &cmd, NULL, 0, NULL);
+}
+
+int nvme_hmb_enable(struct nvme_ctrl *ctrl, size_t len)
+{
+	bool mr = ctrl->hmb.nchunks > 0;
+
+	if (ctrl->hmb.enabled)
+		return 0;
+
+	if (!mr) {
+		if (!ctrl->hmb.pre) {
+			log_debug("controller does not use a host memory buffer\n");
+
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		if (!len || len > ctrl->hmb.pre)
+			len = ctrl->hmb.pre;
+
+		if (len < ctrl->hmb.min) {
+			log_debug("%zu bytes is less than the minimum size (%zu bytes)\n", len,
+				  ctrl->hmb.min);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (nvme_hmb_alloc(ctrl, len))
+			return -1;
+	}
+
+	if (nvme_hmb_set(ctrl, true, mr)) {
+		log_debug("could not enable host memory buffer\n");
+
+		/* the controller may hold on to memory that it was given before */
+		if (!mr)
+			nvme_hmb_free(ctrl);
+
+		return -1;
+	}
+
+	ctrl->hmb.enabled = true;
+
+	log_info("host memory buffer of %zu bytes in %d chunks\n", ctrl->hmb.len,
+		 ctrl->hmb.nchunks);
+
+	return 0;
+}
+
+void nvme_hmb_disable(struct nvme_ctrl *ctrl)
+{
+	if (!ctrl->hmb.nchunks)
+		return;
+
+	if (ctrl->hmb.enabled && nvme_hmb_set(ctrl, false, false)) {
+		/* the controller may still write to it; never reuse the memory */
+		log_error("could not disable host memory buffer; leaking it\n");
+
+		free(ctrl->hmb.chunks);
+
+		ctrl->hmb.chunks = NULL;
+		ctrl->hmb.nchunks = 0;
+		ctrl->hmb.descs = NULL;
+		ctrl->hmb.len = 0;
+		ctrl->hmb.enabled = false;
+
+		return;
+	}
+
+	ctrl->hmb.enabled = false;
+
+	nvme_hmb_free(ctrl);
+}
@@ -0,0 +1,467 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/lease: " fmt
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "qmem.h"
+
+#define NVME_LEASE_MAGIC 0x766e716c /* "vnql" */
+
+/* the doorbells are mapped as a single page (see nvme_init()) */
+#define NVME_LEASE_DB_OFFSET 0x1000
+#define NVME_LEASE_DB_SIZE 0x1000
+
+/*
+ * Sent along with the memfd backing the queue memory, the vfio device file and
+ * (if the completion queue is interrupt driven) the eventfd, in that order.
+ * The namespace cache follows in a message of its own.
+ */
+struct nvme_lease_msg {
+	uint32_t magic;
+	uint16_t qid, qsize;
+	int32_t vector;
+	uint32_t nfds;
+
+	/* offsets in the memfd and i/o virtual addresses */
+	uint64_t sq_off, sq_iova;
+	uint64_t cq_off, cq_iova;
+	uint64_t pages_off, pages_iova;
+	int32_t nprp_pages;
+
+	/* offsets of the doorbell page in the device file and of the doorbells in it */
+	uint64_t db_off;
+	uint32_t sqtdbl, cqhdbl;
+
+	/* where the queues were left */
+	uint16_t sq_tail, sq_ptail, sq_head, sq_qprio;
+	uint16_t cq_head, cq_phead;
+	int32_t cq_phase;
+
+	/* doorbell policies and wait policy */
+	int32_t sq_db_batch, cq_db_lazy;
+	uint64_t sq_dbc_max;
+	struct nvme_cq_poll_opts cq_poll;
+
+	__typeof__(((struct nvme_ctrl *)NULL)->config) config;
+	int32_t nns;
+};
+
+static int __rqs_free(struct nvme_sq *sq)
+{
+	int n = 0;
+
+	for (struct nvme_rq *rq = __nvme_rq_top(sq, sq->rq_top); rq; rq = rq->rq_next)
+		n++;
+
+	return n;
+}
+
+int nvme_export_ioqpair(struct nvme_ctrl *ctrl, int qid, int sockfd)
+{
+	struct nvme_sq *sq;
+	struct nvme_cq *cq;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} u = {};
+	struct nvme_lease_msg msg;
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg), };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+	};
+	struct cmsghdr *cmsg;
+	size_t sq_off, cq_off, pages_off, nslen;
+	int fds[3], fd;
+
+	if (qid < 1 || qid > ctrl->config.nsqa + 1 || qid > ctrl->config.ncqa + 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sq = &ctrl->sq[qid];
+	cq = &ctrl->cq[qid];
+
+	if (!sq->vaddr || sq->cq != cq) {
+		log_debug("no queue pair with qid %d\n", qid);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the doorbells must be reached through the device file */
+	if (ctrl->mock || ctrl->dbbuf.doorbells || sq->bufs.vaddr || sq->flags & NVME_SQ_F_CMB) {
+		log_debug("queue pair %d cannot be leased\n", qid);
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (nvme_queue_mem_find(ctrl, sq->vaddr, &fds[0], &sq_off) ||
+	    nvme_queue_mem_find(ctrl, cq->vaddr, &fd, &cq_off) || fd != fds[0] ||
+	    nvme_queue_mem_find(ctrl, sq->pages.vaddr, &fd, &pages_off) || fd != fds[0]) {
+		log_debug("queue pair %d is not in shared memory\n", qid);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__rqs_free(sq) != sq->qsize - 1) {
+		log_debug("queue pair %d is busy\n", qid);
+
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* the peer continues from the tail last written */
+	if (cq->dbc_sq)
+		__nvme_cq_flush_dbc(cq);
+
+	fds[1] = ctrl->pci.dev.fd;
+	fds[2] = cq->efd;
+
+	msg = (struct nvme_lease_msg) {
+		.magic = NVME_LEASE_MAGIC,
+		.qid = (uint16_t)qid,
+		.qsize = (uint16_t)sq->qsize,
+		.vector = cq->vector,
+		.nfds = cq->efd >= 0 ? 3 : 2,
+
+		.sq_off = sq_off,
+		.sq_iova = sq->iova,
+		.cq_off = cq_off,
+		.cq_iova = cq->iova,
+		.pages_off = pages_off,
+		.pages_iova = sq->pages.iova,
+		.nprp_pages = sq->nprp_pages,
+
+		.db_off = ctrl->pci.bar_region_info[0].offset + NVME_LEASE_DB_OFFSET,
+		.sqtdbl = (uint32_t)(sq->doorbell - ctrl->doorbells),
+		.cqhdbl = (uint32_t)(cq->doorbell - ctrl->doorbells),
+
+		.sq_tail = sq->tail,
+		.sq_ptail = sq->ptail,
+		.sq_head = sq->head,
+		.sq_qprio = sq->qprio,
+		.cq_head = cq->head,
+		.cq_phead = cq->phead,
+		.cq_phase = cq->phase,
+
+		.sq_db_batch = sq->db_batch,
+		.sq_dbc_max = sq->dbc.max,
+		.cq_db_lazy = cq->db_lazy,
+		.cq_poll = cq->poll.opts,
+
+		.config = ctrl->config,
+		.nns = ctrl->nns,
+	};
+
+	mh.msg_controllen = CMSG_SPACE(msg.nfds * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(msg.nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, msg.nfds * sizeof(int));
+
+	if (sendmsg(sockfd, &mh, 0) != sizeof(msg)) {
+		log_debug("could not send queue pair\n");
+		return -1;
+	}
+
+	nslen = (size_t)ctrl->nns * sizeof(*ctrl->ns);
+
+	if (nslen && send(sockfd, ctrl->ns, nslen, 0) != (ssize_t)nslen) {
+		log_debug("could not send namespace cache\n");
+		return -1;
+	}
+
+	/* the queue pair now belongs to the peer */
+	sq->rq_top = 0;
+
+	return 0;
+}
+
+static void __close_fds(int *fds, int n)
+{
+	for (int i = 0; i < n; i++)
+		log_fatal_if(close(fds[i]), "close: %s\n", strerror(errno));
+}
+
+/* receive the description and the file descriptors */
+static int __recv_msg(int sockfd, struct nvme_lease_msg *msg, int *fds)
+{
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} u = {};
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg), };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t len;
+	int nfds;
+
+	len = recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	if (len < 0) {
+		log_debug("could not receive queue pair\n");
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		log_debug("no file descriptors received\n");
+
+		errno = EPROTO;
+		return -1;
+	}
+
+	nfds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+	memcpy(fds, CMSG_DATA(cmsg), (size_t)min(nfds, 3) * sizeof(int));
+
+	if (len != sizeof(*msg) || msg->magic != NVME_LEASE_MAGIC || (int)msg->nfds != nfds ||
+	    msg->qsize < 2) {
+		log_debug("bad queue pair description\n");
+
+		__close_fds(fds, min(nfds, 3));
+
+		errno = EPROTO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void __setup_cq(struct nvme_qpair_lease *lease, struct nvme_lease_msg *msg,
+		       void *doorbells, int efd)
+{
+	struct nvme_cq *cq = lease->cq;
+
+	*cq = (struct nvme_cq) {
+		.vaddr = lease->mem + msg->cq_off,
+		.iova = msg->cq_iova,
+		.id = msg->qid,
+		.qsize = msg->qsize,
+		.doorbell = doorbells + msg->cqhdbl,
+		.vector = msg->vector,
+		.efd = efd,
+		.nsqs = msg->qid + 1,
+		.sqs = lease->ctrl.sq,
+		.head = msg->cq_head,
+		.phead = msg->cq_phead,
+		.phase = msg->cq_phase,
+		.db_lazy = msg->cq_db_lazy,
+		.poll.opts = msg->cq_poll,
+	};
+}
+
+static void __setup_sq(struct nvme_qpair_lease *lease, struct nvme_lease_msg *msg,
+		       void *doorbells)
+{
+	struct nvme_sq *sq = lease->sq;
+	int pageshift = __mps_to_pageshift(msg->config.mps);
+
+	*sq = (struct nvme_sq) {
+		.cq = lease->cq,
+		.vaddr = lease->mem + msg->sq_off,
+		.iova = msg->sq_iova,
+		.pages.vaddr = lease->mem + msg->pages_off,
+		.pages.iova = msg->pages_iova,
+		.qsize = msg->qsize,
+		.id = msg->qid,
+		.doorbell = doorbells + msg->sqtdbl,
+		.tail = msg->sq_tail,
+		.ptail = msg->sq_ptail,
+		.head = msg->sq_head,
+		.db_batch = msg->sq_db_batch,
+
+		/* coalescing is tuned again on the first doorbell write */
+		.dbc.max = msg->sq_dbc_max,
+		.dbc.window = msg->sq_dbc_max,
+		.dbc.batch = msg->qsize / 2,
+		.qprio = msg->sq_qprio,
+	};
+
+	/* the list pages follow those of the trackers (as laid out by the exporter) */
+	if (msg->nprp_pages > 0) {
+		sq->prp_pages = znew_t(struct nvme_prp_page, msg->nprp_pages);
+		sq->nprp_pages = msg->nprp_pages;
+
+		for (int i = 0; i < msg->nprp_pages; i++) {
+			struct nvme_prp_page *page = &sq->prp_pages[i];
+			size_t ofst = (size_t)(sq->qsize + i) << pageshift;
+
+			page->vaddr = sq->pages.vaddr + ofst;
+			page->iova = sq->pages.iova + ofst;
+
+			if (i > 0)
+				page->next = &sq->prp_pages[i - 1];
+		}
+
+		sq->prp_top = __nvme_prp_top_set(sq, 0, &sq->prp_pages[msg->nprp_pages - 1]);
+	}
+
+	sq->rqs = znew_aligned_t(struct nvme_rq, sq->qsize);
+	sq->rq_top = __nvme_rq_top_set(sq, 0, &sq->rqs[sq->qsize - 2]);
+
+	for (int i = 0; i < sq->qsize - 1; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+
+		rq->sq = sq;
+		rq->cid = (uint16_t)i;
+
+		rq->page.vaddr = sq->pages.vaddr + ((size_t)i << pageshift);
+		rq->page.iova = sq->pages.iova + ((size_t)i << pageshift);
+
+		if (i > 0)
+			rq->rq_next = &sq->rqs[i - 1];
+	}
+}
+
+int nvme_attach_ioqpair(struct nvme_qpair_lease *lease, struct iommu_ctx *ctx, int sockfd)
+{
+	struct nvme_lease_msg msg;
+	struct nvme_ctrl *ctrl;
+	void *doorbells;
+	uint64_t qlen, plen;
+	struct stat sb;
+	size_t nslen;
+	int fds[3];
+
+	memset(lease, 0x0, sizeof(*lease));
+
+	if (__recv_msg(sockfd, &msg, fds))
+		return -1;
+
+	if (fstat(fds[0], &sb)) {
+		log_debug("could not stat queue memory\n");
+		goto close_fds;
+	}
+
+	lease->len = (size_t)sb.st_size;
+
+	qlen = (uint64_t)msg.qsize << NVME_SQES;
+	plen = (uint64_t)(msg.qsize + max(msg.nprp_pages, 0)) << __mps_to_pageshift(msg.config.mps);
+
+	if (msg.sq_off + qlen > lease->len || msg.cq_off + qlen > lease->len ||
+	    msg.pages_off + plen > lease->len || msg.sqtdbl >= NVME_LEASE_DB_SIZE ||
+	    msg.cqhdbl >= NVME_LEASE_DB_SIZE) {
+		log_debug("queue pair is out of bounds\n");
+
+		errno = EPROTO;
+		goto close_fds;
+	}
+
+	lease->mem = mmap(NULL, lease->len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  fds[0], 0);
+	if (lease->mem == MAP_FAILED) {
+		log_debug("could not map queue memory\n");
+		goto close_fds;
+	}
+
+	doorbells = mmap(NULL, NVME_LEASE_DB_SIZE, PROT_WRITE, MAP_SHARED, fds[1],
+			 (off_t)msg.db_off);
+	if (doorbells == MAP_FAILED) {
+		log_debug("could not map doorbells\n");
+		goto unmap_mem;
+	}
+
+	/* the mappings stay valid */
+	__close_fds(fds, 2);
+
+	ctrl = &lease->ctrl;
+
+	ctrl->pci.dev.fd = -1;
+	ctrl->pci.dev.ctx = ctx;
+	ctrl->doorbells = doorbells;
+	ctrl->config = msg.config;
+
+	/* completion queue entries are looked up by the submission queue identifier */
+	ctrl->sq = znew_aligned_t(struct nvme_sq, msg.qid + 1);
+	ctrl->cq = znew_aligned_t(struct nvme_cq, msg.qid + 1);
+
+	lease->qid = msg.qid;
+	lease->sq = &ctrl->sq[msg.qid];
+	lease->cq = &ctrl->cq[msg.qid];
+
+	__setup_cq(lease, &msg, doorbells, msg.nfds == 3 ? fds[2] : -1);
+	__setup_sq(lease, &msg, doorbells);
+
+	if (msg.nns > 0) {
+		nslen = (size_t)msg.nns * sizeof(*ctrl->ns);
+
+		ctrl->ns = znew_t(struct nvme_ns, msg.nns);
+		ctrl->nns = msg.nns;
+
+		if (recv(sockfd, ctrl->ns, nslen, MSG_WAITALL) != (ssize_t)nslen) {
+			log_debug("could not receive namespace cache\n");
+
+			nvme_detach_ioqpair(lease);
+			return -1;
+		}
+	}
+
+	return 0;
+
+unmap_mem:
+	munmap(lease->mem, lease->len);
+close_fds:
+	__close_fds(fds, (int)msg.nfds);
+
+	return -1;
+}
+
+void nvme_detach_ioqpair(struct nvme_qpair_lease *lease)
+{
+	struct nvme_ctrl *ctrl = &lease->ctrl;
+
+	if (lease->cq->efd >= 0)
+		log_fatal_if(close(lease->cq->efd), "close: %s\n", strerror(errno));
+
+	free(lease->sq->rqs);
+	free(lease->sq->prp_pages);
+	free(lease->sq->lat);
+
+	munmap(ctrl->doorbells, NVME_LEASE_DB_SIZE);
+	munmap(lease->mem, lease->len);
+
+	free(ctrl->ns);
+	free(ctrl->sq);
+	free(ctrl->cq);
+
+	memset(lease, 0x0, sizeof(*lease));
+}
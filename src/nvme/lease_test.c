@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+
+#include "ccan/tap/tap.h"
+
+#include "lease.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+#define QSIZE 8
+#define NPRP 2
+
+/* submission queue, completion queue and pages following each other in the memfd */
+#define SQ_OFF 0x0
+#define CQ_OFF 0x1000
+#define PAGES_OFF 0x2000
+#define MEM_LEN (PAGES_OFF + ((QSIZE + NPRP) << 12))
+
+/* doorbell offsets of queue pair 1 (stride of 4 bytes) */
+#define SQTDBL 0x8
+#define CQHDBL 0xc
+
+static int memfd;
+static void *mem;
+
+int nvme_queue_mem_find(struct nvme_ctrl *ctrl UNUSED, void *vaddr, int *fd, size_t *offset)
+{
+	if (vaddr < mem || vaddr >= mem + MEM_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*fd = memfd;
+	*offset = (size_t)(vaddr - mem);
+
+	return 0;
+}
+
+static struct nvme_ctrl ctrl;
+static struct nvme_sq sqs[2];
+static struct nvme_cq cqs[2];
+static struct nvme_rq rqs[QSIZE - 1];
+static struct nvme_ns ns = { .nsid = 1, .lbads = 12, };
+
+static void setup(void)
+{
+	int devfd;
+
+	memfd = memfd_create("lease-test-mem", MFD_CLOEXEC);
+	assert(memfd >= 0 && ftruncate(memfd, MEM_LEN) == 0);
+
+	mem = mmap(NULL, MEM_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	assert(mem != MAP_FAILED);
+
+	/* stands in for the vfio device file; bar 0 at offset 0 */
+	devfd = memfd_create("lease-test-dev", MFD_CLOEXEC);
+	assert(devfd >= 0 && ftruncate(devfd, 0x2000) == 0);
+
+	ctrl.pci.dev.fd = devfd;
+	ctrl.doorbells = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, devfd, 0x1000);
+	assert(ctrl.doorbells != MAP_FAILED);
+
+	ctrl.config.nsqa = ctrl.config.ncqa = 0;
+	ctrl.sq = sqs;
+	ctrl.cq = cqs;
+	ctrl.ns = &ns;
+	ctrl.nns = 1;
+
+	cqs[1] = (struct nvme_cq) {
+		.vaddr = mem + CQ_OFF,
+		.iova = 0xc0000,
+		.id = 1,
+		.qsize = QSIZE,
+		.doorbell = ctrl.doorbells + CQHDBL,
+		.efd = -1,
+		.nsqs = 2,
+		.sqs = sqs,
+		.db_lazy = 2,
+	};
+
+	sqs[1] = (struct nvme_sq) {
+		.cq = &cqs[1],
+		.vaddr = mem + SQ_OFF,
+		.iova = 0x50000,
+		.pages.vaddr = mem + PAGES_OFF,
+		.pages.iova = 0x100000,
+		.nprp_pages = NPRP,
+		.qsize = QSIZE,
+		.id = 1,
+		.doorbell = ctrl.doorbells + SQTDBL,
+		.rqs = rqs,
+	};
+	sqs[1].rq_top = __nvme_rq_top_set(&sqs[1], 0, &rqs[QSIZE - 2]);
+
+	for (int i = 0; i < QSIZE - 1; i++) {
+		rqs[i] = (struct nvme_rq) { .sq = &sqs[1], .cid = (uint16_t)i, };
+
+		if (i > 0)
+			rqs[i].rq_next = &rqs[i - 1];
+	}
+}
+
+static void test_export_errors(int sockfd)
+{
+	errno = 0;
+	ok1(nvme_export_ioqpair(&ctrl, 2, sockfd) == -1 && errno == EINVAL);
+
+	ctrl.config.nsqa = ctrl.config.ncqa = 1;
+
+	/* not in shared memory */
+	sqs[1].vaddr = rqs;
+	errno = 0;
+	ok1(nvme_export_ioqpair(&ctrl, 1, sockfd) == -1 && errno == EINVAL);
+	sqs[1].vaddr = mem + SQ_OFF;
+
+	sqs[1].bufs.vaddr = mem;
+	errno = 0;
+	ok1(nvme_export_ioqpair(&ctrl, 1, sockfd) == -1 && errno == ENOTSUP);
+	sqs[1].bufs.vaddr = NULL;
+
+	/* a request in flight */
+	sqs[1].rq_top = __nvme_rq_top_set(&sqs[1], 0, &rqs[QSIZE - 3]);
+	errno = 0;
+	ok1(nvme_export_ioqpair(&ctrl, 1, sockfd) == -1 && errno == EBUSY);
+	sqs[1].rq_top = __nvme_rq_top_set(&sqs[1], 0, &rqs[QSIZE - 2]);
+}
+
+static void test_lease(int expfd, int attfd)
+{
+	struct nvme_qpair_lease lease;
+	union nvme_cmd cmd = {};
+	struct nvme_cqe *cqe;
+	struct nvme_rq *rq;
+
+	/* pick up where the exporter left off */
+	sqs[1].tail = sqs[1].ptail = 3;
+	sqs[1].head = 3;
+	cqs[1].head = cqs[1].phead = 3;
+
+	ok1(nvme_export_ioqpair(&ctrl, 1, expfd) == 0);
+	ok1(__nvme_rq_top(&sqs[1], sqs[1].rq_top) == NULL);
+
+	ok1(nvme_attach_ioqpair(&lease, NULL, attfd) == 0);
+	ok1(lease.qid == 1);
+	ok1(lease.ctrl.nns == 1 && lease.ctrl.ns[0].lbads == 12);
+	ok1(lease.ctrl.config.nsqa == 1);
+	ok1(lease.sq->iova == 0x50000 && lease.cq->iova == 0xc0000);
+	ok1(lease.sq->tail == 3 && lease.cq->head == 3 && lease.cq->db_lazy == 2);
+	ok1(lease.cq->efd == -1);
+
+	/* the prp list pages follow the tracker pages */
+	ok1(lease.sq->nprp_pages == NPRP);
+	ok1(__nvme_prp_top(lease.sq, lease.sq->prp_top)->iova ==
+	    0x100000 + ((QSIZE + NPRP - 1) << 12));
+	ok1(lease.sq->rqs[1].page.iova == 0x100000 + (1 << 12));
+
+	rq = nvme_rq_acquire(lease.sq);
+	ok1(rq != NULL && rq->sq == lease.sq);
+
+	cmd.identify.opcode = 0x6;
+	nvme_rq_exec(rq, &cmd);
+
+	/* the exporter (i.e., the device) sees the command and the doorbell */
+	ok1(((union nvme_cmd *)(mem + SQ_OFF))[3].cid == cpu_to_le16(rq->cid));
+	ok1(le32_to_cpu(mmio_read32(ctrl.doorbells + SQTDBL)) == 4);
+
+	((struct nvme_cqe *)(mem + CQ_OFF))[3] = (struct nvme_cqe) {
+		.sqid = cpu_to_le16(1),
+		.sqhd = cpu_to_le16(4),
+		.cid = cpu_to_le16(rq->cid),
+		.sfp = cpu_to_le16(0x1),
+	};
+
+	cqe = nvme_cq_get_cqe(lease.cq);
+	ok1(cqe != NULL && nvme_cq_rq_from_cqe(lease.cq, cqe) == rq);
+	ok1(lease.sq->head == 4);
+
+	nvme_cq_commit_head(lease.cq);
+	ok1(le32_to_cpu(mmio_read32(ctrl.doorbells + CQHDBL)) == 4);
+
+	nvme_rq_release(rq);
+
+	nvme_detach_ioqpair(&lease);
+	ok1(lease.sq == NULL && lease.mem == NULL);
+}
+
+static void test_attach_errors(int expfd, int attfd)
+{
+	struct nvme_qpair_lease lease;
+	uint32_t junk = 0xdeadbeef;
+
+	ok1(send(expfd, &junk, sizeof(junk), 0) == sizeof(junk));
+
+	errno = 0;
+	ok1(nvme_attach_ioqpair(&lease, NULL, attfd) == -1 && errno == EPROTO);
+}
+
+int main(void)
+{
+	int sv[2];
+
+	plan_tests(25);
+
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+
+	setup();
+
+	test_export_errors(sv[0]);
+	test_lease(sv[0], sv[1]);
+	test_attach_errors(sv[0], sv[1]);
+
+	close(sv[0]);
+	close(sv[1]);
+
+	return exit_status();
+}
@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/logpage: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+struct nvme_log_slot {
+	struct nvme_future future;
+	void *vaddr;
+	uint64_t offset;
+	size_t len;
+};
+
+int nvme_log_reader_init(struct nvme_log_reader *reader, struct nvme_ctrl *ctrl, size_t chunk,
+			 int depth)
+{
+	size_t stride = ALIGN_UP(chunk, __VFN_PAGESIZE);
+	uint64_t iova;
+
+	if (!chunk || chunk & 0x3 || depth <= 0 ||
+	    (ctrl->config.mdts && chunk > ctrl->config.mdts)) {
+		log_debug("invalid chunk size %zu or depth %d\n", chunk, depth);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	*reader = (struct nvme_log_reader) {
+		.ctrl = ctrl,
+		.len = stride * (size_t)depth,
+		.chunk = chunk,
+		.depth = depth,
+	};
+
+	if (iommu_alloc_node(__iommu_ctx(ctrl), reader->len, ctrl->numa.node, &reader->vaddr,
+			     &iova)) {
+		log_debug("could not allocate buffer ring\n");
+		return -1;
+	}
+
+	reader->slots = znew_t(struct nvme_log_slot, depth);
+
+	for (int i = 0; i < depth; i++)
+		reader->slots[i].vaddr = reader->vaddr + (size_t)i * stride;
+
+	return 0;
+}
+
+void nvme_log_reader_fini(struct nvme_log_reader *reader)
+{
+	/* the buffers must not be released under the feet of the controller */
+	for (; reader->inflight; reader->inflight--) {
+		nvme_future_wait(&reader->slots[reader->head].future);
+
+		reader->head = (reader->head + 1) % reader->depth;
+	}
+
+	iommu_free(__iommu_ctx(reader->ctrl), reader->vaddr, reader->len);
+	free(reader->slots);
+
+	memset(reader, 0x0, sizeof(*reader));
+}
+
+/* submit commands for the following chunks into the free slots */
+static void __log_refill(struct nvme_log_reader *reader)
+{
+	while (!reader->err && reader->inflight < reader->depth && reader->next < reader->end) {
+		int i = (reader->head + reader->inflight) % reader->depth;
+		struct nvme_log_slot *slot = &reader->slots[i];
+		union nvme_cmd cmd = reader->cmd;
+		uint32_t numd;
+
+		slot->offset = reader->next;
+		slot->len = (size_t)min_t(uint64_t, reader->chunk, reader->end - reader->next);
+
+		/* number of dwords, zeroes based */
+		numd = (uint32_t)(slot->len >> 2) - 1;
+
+		cmd.log.numdl = cpu_to_le16((uint16_t)(numd & 0xffff));
+		cmd.log.numdu = cpu_to_le16((uint16_t)(numd >> 16));
+		cmd.log.lpol = cpu_to_le32((uint32_t)slot->offset);
+		cmd.log.lpou = cpu_to_le32((uint32_t)(slot->offset >> 32));
+
+		if (nvme_admin_async(reader->ctrl, &cmd, slot->vaddr, slot->len, &slot->future)) {
+			/* the admin queue is full; try again on the next poll */
+			if (errno == EBUSY)
+				return;
+
+			reader->err = errno;
+			return;
+		}
+
+		reader->next += slot->len;
+		reader->inflight++;
+	}
+}
+
+int nvme_log_reader_start(struct nvme_log_reader *reader, union nvme_cmd *cmd, uint64_t offset,
+			  uint64_t len, nvme_log_cb cb, void *opaque)
+{
+	if (reader->inflight || reader->next < reader->end) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (!len || len & 0x3 || offset & 0x3 || offset + len < offset) {
+		log_debug("invalid log page range (offset %" PRIu64 " len %" PRIu64 ")\n",
+			  offset, len);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((offset || len > reader->chunk) &&
+	    !(reader->ctrl->config.lpa & NVME_IDENTIFY_CTRL_LPA_EDLP)) {
+		log_debug("controller does not support extended data for get log page\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	reader->cmd = *cmd;
+	reader->cmd.opcode = NVME_ADMIN_GET_LOG_PAGE;
+
+	reader->next = offset;
+	reader->end = offset + len;
+	reader->head = 0;
+	reader->err = 0;
+	reader->cb = cb;
+	reader->opaque = opaque;
+
+	__log_refill(reader);
+
+	/* otherwise, the error is reported by nvme_log_reader_poll() */
+	if (reader->err && !reader->inflight) {
+		reader->next = reader->end;
+
+		errno = reader->err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nvme_log_reader_poll(struct nvme_log_reader *reader)
+{
+	nvme_admin_process(reader->ctrl);
+
+	/* deliver in log order; later chunks wait in their slots */
+	while (reader->inflight) {
+		struct nvme_log_slot *slot = &reader->slots[reader->head];
+
+		if (!atomic_load_acquire(&slot->future.done))
+			break;
+
+		reader->head = (reader->head + 1) % reader->depth;
+		reader->inflight--;
+
+		if (nvme_future_wait(&slot->future)) {
+			if (!reader->err)
+				reader->err = errno;
+
+			continue;
+		}
+
+		if (reader->err)
+			continue;
+
+		if (reader->cb(reader->opaque, slot->offset, slot->vaddr, slot->len))
+			reader->err = ECANCELED;
+	}
+
+	__log_refill(reader);
+
+	if (reader->inflight)
+		return 0;
+
+	if (reader->err) {
+		/* abandon the rest of the read */
+		reader->next = reader->end;
+
+		errno = reader->err;
+		return -1;
+	}
+
+	return reader->next == reader->end ? 1 : 0;
+}
+
+int nvme_log_read(struct nvme_log_reader *reader, union nvme_cmd *cmd, uint64_t offset,
+		  uint64_t len, nvme_log_cb cb, void *opaque)
+{
+	int ret;
+
+	if (nvme_log_reader_start(reader, cmd, offset, len, cb, opaque))
+		return -1;
+
+	while (!(ret = nvme_log_reader_poll(reader)))
+		;
+
+	return ret < 0 ? -1 : 0;
+}
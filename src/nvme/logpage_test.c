@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "logpage.c"
+
+#define CHUNK 8192
+
+int iommu_alloc_node(struct iommu_ctx *ctx UNUSED, size_t len, int node UNUSED, void **vaddr,
+		     uint64_t *iova)
+{
+	if (pgmap(vaddr, len) < 0)
+		return -1;
+
+	*iova = (uint64_t)*vaddr;
+
+	return 0;
+}
+
+void iommu_free(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len)
+{
+	pgunmap(vaddr, len);
+}
+
+/* commands in flight, completed in reverse order by nvme_admin_process() */
+static struct {
+	union nvme_cmd cmd;
+	void *buf;
+	size_t len;
+	struct nvme_future *future;
+} pending[8];
+static int npending, maxpending, nbusy;
+static uint64_t fail_offset = UINT64_MAX;
+
+static uint64_t __lpo(union nvme_cmd *cmd)
+{
+	return (uint64_t)le32_to_cpu(cmd->log.lpou) << 32 | le32_to_cpu(cmd->log.lpol);
+}
+
+int nvme_admin_async(struct nvme_ctrl *ctrl UNUSED, union nvme_cmd *sqe, void *buf, size_t len,
+		     struct nvme_future *future)
+{
+	if (nbusy) {
+		nbusy--;
+
+		errno = EBUSY;
+		return -1;
+	}
+
+	*future = (struct nvme_future) {};
+
+	pending[npending].cmd = *sqe;
+	pending[npending].buf = buf;
+	pending[npending].len = len;
+	pending[npending].future = future;
+
+	maxpending = max(maxpending, ++npending);
+
+	return 0;
+}
+
+int nvme_admin_process(struct nvme_ctrl *ctrl UNUSED)
+{
+	int n = npending;
+
+	while (npending) {
+		union nvme_cmd *cmd = &pending[--npending].cmd;
+		struct nvme_future *future = pending[npending].future;
+
+		/* every byte of the log is its chunk number */
+		memset(pending[npending].buf, (int)(__lpo(cmd) / CHUNK), pending[npending].len);
+
+		if (__lpo(cmd) == fail_offset)
+			future->cqe.sfp = cpu_to_le16(NVME_SC_INVALID_FIELD << 1);
+
+		atomic_store_release(&future->done, true);
+	}
+
+	return n;
+}
+
+int nvme_future_wait(struct nvme_future *future)
+{
+	if (!nvme_cqe_ok(&future->cqe)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint64_t expected, nbytes;
+static int nchunks, mismatches, stop_after = -1;
+
+static int chunk_cb(void *opaque UNUSED, uint64_t offset, void *buf, size_t len)
+{
+	if (offset != expected || ((uint8_t *)buf)[len - 1] != (uint8_t)(offset / CHUNK))
+		mismatches++;
+
+	expected = offset + len;
+	nbytes += len;
+
+	return ++nchunks == stop_after;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {};
+	struct nvme_log_reader reader;
+	union nvme_cmd cmd = {};
+
+	plan_tests(12);
+
+	ctrl.config.mdts = 4 * CHUNK;
+
+	ok1(nvme_log_reader_init(&reader, &ctrl, 6, 4) == -1 && errno == EINVAL);
+	ok1(nvme_log_reader_init(&reader, &ctrl, 8 * CHUNK, 4) == -1 && errno == EINVAL);
+	ok1(nvme_log_reader_init(&reader, &ctrl, CHUNK, 3) == 0);
+
+	/* telemetry host-initiated; create telemetry data */
+	cmd.log.lid = 0x07;
+	cmd.log.lsp = 0x1;
+
+	ok1(nvme_log_reader_start(&reader, &cmd, 0, 2 * CHUNK, chunk_cb, NULL) == -1 &&
+	    errno == ENOTSUP);
+
+	ctrl.config.lpa = NVME_IDENTIFY_CTRL_LPA_EDLP;
+
+	/* ten chunks (the last one short) with at most three commands in flight */
+	ok1(nvme_log_read(&reader, &cmd, 0, 9 * CHUNK + 4096, chunk_cb, NULL) == 0);
+	ok1(nchunks == 10 && nbytes == 9 * CHUNK + 4096 && !mismatches && maxpending == 3);
+	ok1(pending[0].cmd.opcode == NVME_ADMIN_GET_LOG_PAGE && pending[0].cmd.log.lid == 0x07 &&
+	    pending[0].cmd.log.lsp == 0x1);
+
+	/* the last command read 1024 dwords at offset 72k */
+	ok1(__lpo(&pending[0].cmd) == 9 * CHUNK && le16_to_cpu(pending[0].cmd.log.numdl) == 1023);
+
+	/* an admin queue that is full for a while only delays the read */
+	expected = 2 * CHUNK;
+	nbusy = 2;
+
+	ok1(nvme_log_read(&reader, &cmd, 2 * CHUNK, 4 * CHUNK, chunk_cb, NULL) == 0 &&
+	    expected == 6 * CHUNK && !mismatches);
+
+	/* chunks after a failure are not delivered */
+	expected = nchunks = 0;
+	fail_offset = CHUNK;
+
+	ok1(nvme_log_read(&reader, &cmd, 0, 4 * CHUNK, chunk_cb, NULL) == -1 && errno == EIO &&
+	    nchunks == 1);
+
+	/* the callback stops the read */
+	expected = nchunks = 0;
+	fail_offset = UINT64_MAX;
+	stop_after = 2;
+
+	ok1(nvme_log_read(&reader, &cmd, 0, 8 * CHUNK, chunk_cb, NULL) == -1 &&
+	    errno == ECANCELED && nchunks == 2);
+
+	/* the reader is ready for the next read */
+	stop_after = -1;
+	expected = nchunks = 0;
+
+	ok1(nvme_log_read(&reader, &cmd, 0, CHUNK, chunk_cb, NULL) == 0 && nchunks == 1);
+
+	nvme_log_reader_fini(&reader);
+
+	return exit_status();
+}
@@ -0,0 +1,922 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/mock: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/support/timer.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
+#include "ccan/str/str.h"
+
+#include "iommu/context.h"
+
+#include "types.h"
+#include "mock.h"
+
+/* number of i/o queue pairs supported */
+#define NVME_MOCK_NQUEUES 64
+
+/* maximum queue entries supported (zeroes based) */
+#define NVME_MOCK_MQES 1023
+
+/* commands executed but not yet completed (power of two) */
+#define NVME_MOCK_INFLIGHT 4096
+
+/* commands fetched from a submission queue before moving on to the next */
+#define NVME_MOCK_BURST 32
+
+/* the emulation thread sleeps between polls after this many idle polls */
+#define NVME_MOCK_IDLE_POLLS 100000
+#define NVME_MOCK_IDLE_USEC 50
+
+/* controller memory page size (CAP.MPSMIN and CAP.MPSMAX are zero) */
+#define NVME_MOCK_PAGESIZE 0x1000
+
+/* controller registers followed by the doorbells (CAP.DSTRD is zero) */
+#define NVME_MOCK_REGS_SIZE 0x1000
+#define NVME_MOCK_BAR_SIZE (2 * NVME_MOCK_REGS_SIZE)
+
+#define NVME_MOCK_NSZE_DEFAULT (1ULL << 21)
+#define NVME_MOCK_LBADS_DEFAULT 12
+
+#define NVME_MOCK_VS 0x00010400
+
+struct nvme_mock_sq {
+	union nvme_cmd *vaddr;
+	uint16_t qsize, head, cqid;
+
+	/* last tail doorbell value seen */
+	uint16_t db;
+};
+
+struct nvme_mock_cq {
+	struct nvme_cqe *vaddr;
+	uint16_t qsize, tail, phase;
+
+	/* last head doorbell value seen */
+	uint16_t db;
+};
+
+struct nvme_mock_cpl {
+	/* nanoseconds */
+	uint64_t due;
+
+	uint16_t cqid;
+	struct nvme_cqe cqe;
+};
+
+struct nvme_mock {
+	void *regs, *doorbells;
+
+	pthread_t thread;
+	bool stop;
+
+	/* configuration */
+	uint64_t latency_ns;
+	uint64_t interval_ns;
+	uint64_t nsze;
+	uint8_t lbads;
+
+	/* last value of CC acted upon */
+	uint32_t cc;
+	bool enabled;
+
+	struct nvme_mock_sq sqs[NVME_MOCK_NQUEUES + 1];
+	struct nvme_mock_cq cqs[NVME_MOCK_NQUEUES + 1];
+	int maxqid;
+
+	/* shadow doorbells and event indices (see __mock_dbconfig()) */
+	uint32_t *dbbuf_dbs, *dbbuf_eis;
+
+	/* completions, in the order they are posted */
+	struct nvme_mock_cpl *cpls;
+	unsigned int cpl_head, cpl_tail;
+
+	/* due time of the last i/o completion (for the iops limit) */
+	uint64_t last_due;
+
+	uint64_t ncmds;
+};
+
+/*
+ * The emulated controller sits behind an identity mapping IOMMU: I/O virtual
+ * addresses are process virtual addresses.
+ */
+static struct iommu_ctx __mock_ctx;
+static pthread_once_t __mock_ctx_once = PTHREAD_ONCE_INIT;
+
+static int __mock_dma_map(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len UNUSED,
+			  uint64_t *iova, unsigned long flags)
+{
+	if (flags & IOMMU_MAP_FIXED_IOVA && *iova != (uint64_t)vaddr) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*iova = (uint64_t)vaddr;
+
+	return 0;
+}
+
+static int __mock_dma_unmap(struct iommu_ctx *ctx UNUSED, uint64_t iova UNUSED,
+			    size_t len UNUSED)
+{
+	return 0;
+}
+
+static int __mock_dma_unmap_all(struct iommu_ctx *ctx UNUSED)
+{
+	return 0;
+}
+
+static void __mock_ctx_init(void)
+{
+	iommu_ctx_init(&__mock_ctx);
+
+	__mock_ctx.iova_ranges[0] = (struct iommu_iova_range) {
+		.start = NVME_MOCK_PAGESIZE,
+		.last = UINT64_MAX,
+	};
+
+	__mock_ctx.ops = (struct iommu_ctx_ops) {
+		.dma_map = __mock_dma_map,
+		.dma_unmap = __mock_dma_unmap,
+		.dma_unmap_all = __mock_dma_unmap_all,
+	};
+}
+
+static inline void *__vaddr(uint64_t iova)
+{
+	return (void *)(uintptr_t)iova;
+}
+
+static inline void *__sqtdbl(struct nvme_mock *mock, int qid)
+{
+	return mock->doorbells + (2 * qid) * 4;
+}
+
+static inline void *__cqhdbl(struct nvme_mock *mock, int qid)
+{
+	return mock->doorbells + (2 * qid + 1) * 4;
+}
+
+/*
+ * Read doorbell @idx, from the shadow doorbell buffer if configured and
+ * otherwise from the register. Any change is acknowledged in the event index
+ * with the value before it, such that the host does not have to write the
+ * register as long as the controller keeps up (see nvme_try_dbbuf()).
+ */
+static uint16_t __mock_doorbell(struct nvme_mock *mock, int idx, uint16_t *last, uint16_t qsize)
+{
+	uint16_t v;
+
+	if (mock->dbbuf_dbs)
+		v = (uint16_t)__LOAD_PTR(uint32_t *, &mock->dbbuf_dbs[idx]);
+	else
+		v = (uint16_t)le32_to_cpu(mmio_read32(mock->doorbells + idx * 4));
+
+	/* do not read queue entries before the doorbell */
+	dma_rmb();
+
+	if (v != *last && v < qsize) {
+		*last = v;
+
+		if (mock->dbbuf_eis)
+			__STORE_PTR(uint32_t *, &mock->dbbuf_eis[idx], (v + qsize - 1u) % qsize);
+	}
+
+	return *last;
+}
+
+static void __mock_pad(void *dst, const char *s, size_t len)
+{
+	memset(dst, ' ', len);
+	memcpy(dst, s, min_t(size_t, strlen(s), len));
+}
+
+/* copy @len bytes (zeroes if @buf is NULL) to the host; PRPs only, no lists */
+static int __mock_write_data(union nvme_cmd *cmd, const void *buf, size_t len)
+{
+	uint64_t prp1 = le64_to_cpu(cmd->dptr.prp1), prp2 = le64_to_cpu(cmd->dptr.prp2);
+	size_t n;
+
+	if (NVME_FIELD_GET(cmd->flags, CMD_FLAGS_PSDT) != NVME_CMD_FLAGS_PSDT_PRP || !prp1)
+		return -1;
+
+	n = min_t(size_t, len, NVME_MOCK_PAGESIZE - (prp1 & (NVME_MOCK_PAGESIZE - 1)));
+
+	if (len - n > NVME_MOCK_PAGESIZE || (len > n && !prp2))
+		return -1;
+
+	if (buf) {
+		memcpy(__vaddr(prp1), buf, n);
+
+		if (len > n)
+			memcpy(__vaddr(prp2), buf + n, len - n);
+	} else {
+		memset(__vaddr(prp1), 0x0, n);
+
+		if (len > n)
+			memset(__vaddr(prp2), 0x0, len - n);
+	}
+
+	return 0;
+}
+
+static int __mock_identify(struct nvme_mock *mock, union nvme_cmd *cmd)
+{
+	uint8_t id[NVME_IDENTIFY_DATA_SIZE] = {};
+	uint32_t nsid = le32_to_cpu(cmd->nsid);
+
+	switch (cmd->identify.cns) {
+	case NVME_IDENTIFY_CNS_CTRL:
+		__mock_pad(id + NVME_IDENTIFY_CTRL_SN, "libvfn-mock", 20);
+		__mock_pad(id + NVME_IDENTIFY_CTRL_MN, "libvfn emulated controller", 40);
+		__mock_pad(id + NVME_IDENTIFY_CTRL_FR, "1.0", 8);
+
+		/* 128k */
+		id[NVME_IDENTIFY_CTRL_MDTS] = 5;
+
+		*(leint32_t *)(id + NVME_IDENTIFY_CTRL_VER) = cpu_to_le32(NVME_MOCK_VS);
+		*(leint16_t *)(id + NVME_IDENTIFY_CTRL_OACS) =
+			cpu_to_le16(NVME_IDENTIFY_CTRL_OACS_DBCONFIG);
+		id[NVME_IDENTIFY_CTRL_LPA] = NVME_IDENTIFY_CTRL_LPA_EDLP;
+
+		id[NVME_IDENTIFY_CTRL_SQES] = NVME_SQES << 4 | NVME_SQES;
+		id[NVME_IDENTIFY_CTRL_CQES] = NVME_CQES << 4 | NVME_CQES;
+
+		*(leint32_t *)(id + NVME_IDENTIFY_CTRL_NN) = cpu_to_le32(1);
+		*(leint16_t *)(id + NVME_IDENTIFY_CTRL_ONCS) =
+			cpu_to_le16(NVME_IDENTIFY_CTRL_ONCS_DSM |
+				    NVME_IDENTIFY_CTRL_ONCS_WRITE_ZEROES |
+				    NVME_IDENTIFY_CTRL_ONCS_VERIFY);
+
+		/* compares always match; 64k atomic compare and write unit */
+		*(leint16_t *)(id + NVME_IDENTIFY_CTRL_FUSES) =
+			cpu_to_le16(NVME_IDENTIFY_CTRL_FUSES_CMP_WRITE);
+		*(leint16_t *)(id + NVME_IDENTIFY_CTRL_ACWU) =
+			cpu_to_le16((uint16_t)((1u << (16 - mock->lbads)) - 1));
+
+		break;
+
+	case NVME_IDENTIFY_CNS_NS:
+		if (nsid != 1)
+			return NVME_SC_INVALID_NS;
+
+		*(leint64_t *)(id + NVME_IDENTIFY_NS_NSZE) = cpu_to_le64(mock->nsze);
+		*(leint64_t *)(id + NVME_IDENTIFY_NS_NCAP) = cpu_to_le64(mock->nsze);
+		*(leint64_t *)(id + NVME_IDENTIFY_NS_NUSE) = cpu_to_le64(mock->nsze);
+
+		*(leint32_t *)(id + NVME_IDENTIFY_NS_LBAF) =
+			cpu_to_le32(NVME_FIELD_SET(mock->lbads, ID_NS_LBAF_LBADS));
+
+		break;
+
+	case NVME_IDENTIFY_CNS_NS_ACTIVE_LIST:
+		if (nsid < 1)
+			*(leint32_t *)id = cpu_to_le32(1);
+
+		break;
+
+	case NVME_IDENTIFY_CNS_CS_NS:
+		if (nsid != 1)
+			return NVME_SC_INVALID_NS;
+
+		/* fallthrough */
+	case NVME_IDENTIFY_CNS_CS_CTRL:
+		if (cmd->identify.csi != NVME_CSI_NVM)
+			return NVME_SC_INVALID_FIELD;
+
+		break;
+
+	default:
+		return NVME_SC_INVALID_FIELD;
+	}
+
+	if (__mock_write_data(cmd, id, sizeof(id)))
+		return NVME_SC_INVALID_FIELD;
+
+	return 0;
+}
+
+static int __mock_features(struct nvme_mock *mock UNUSED, union nvme_cmd *cmd, uint32_t *dw0)
+{
+	uint32_t cdw11 = le32_to_cpu(cmd->features.cdw11);
+	uint32_t nsqr, ncqr;
+
+	switch (cmd->features.fid) {
+	case NVME_FEAT_FID_NUM_QUEUES:
+		nsqr = NVME_FIELD_GET(cdw11, FEAT_NRQS_NSQR);
+		ncqr = NVME_FIELD_GET(cdw11, FEAT_NRQS_NCQR);
+
+		if (cmd->opcode == NVME_ADMIN_SET_FEATURES && (nsqr == 0xffff || ncqr == 0xffff))
+			return NVME_SC_INVALID_FIELD;
+
+		*dw0 = NVME_FIELD_SET(NVME_MOCK_NQUEUES - 1, FEAT_NRQS_NSQR) |
+			NVME_FIELD_SET(NVME_MOCK_NQUEUES - 1, FEAT_NRQS_NCQR);
+
+		return 0;
+
+	case NVME_FEAT_FID_ARBITRATION:
+	case NVME_FEAT_FID_IRQ_COALESCE:
+	case NVME_FEAT_FID_IRQ_CONFIG:
+		/* accepted and ignored; the controller does not interrupt */
+		return 0;
+	}
+
+	return NVME_SC_INVALID_FIELD;
+}
+
+static int __mock_create_cq(struct nvme_mock *mock, union nvme_cmd *cmd)
+{
+	uint16_t qid = le16_to_cpu(cmd->create_cq.qid);
+	uint32_t qsize = le16_to_cpu(cmd->create_cq.qsize) + 1u;
+	uint64_t prp1 = le64_to_cpu(cmd->create_cq.prp1);
+
+	if (!qid || qid > NVME_MOCK_NQUEUES || mock->cqs[qid].vaddr)
+		return NVME_SC_INVALID_QID;
+
+	if (qsize < 2 || qsize > NVME_MOCK_MQES + 1)
+		return NVME_SC_INVALID_QSIZE;
+
+	if (!(le16_to_cpu(cmd->create_cq.qflags) & NVME_Q_PC) || !prp1 ||
+	    prp1 & (NVME_MOCK_PAGESIZE - 1))
+		return NVME_SC_INVALID_FIELD;
+
+	mock->cqs[qid] = (struct nvme_mock_cq) {
+		.vaddr = __vaddr(prp1),
+		.qsize = (uint16_t)qsize,
+		.phase = 1,
+	};
+
+	mock->maxqid = max_t(int, mock->maxqid, qid);
+
+	return 0;
+}
+
+static int __mock_create_sq(struct nvme_mock *mock, union nvme_cmd *cmd)
+{
+	uint16_t qid = le16_to_cpu(cmd->create_sq.qid);
+	uint16_t cqid = le16_to_cpu(cmd->create_sq.cqid);
+	uint32_t qsize = le16_to_cpu(cmd->create_sq.qsize) + 1u;
+	uint64_t prp1 = le64_to_cpu(cmd->create_sq.prp1);
+
+	if (!qid || qid > NVME_MOCK_NQUEUES || mock->sqs[qid].vaddr)
+		return NVME_SC_INVALID_QID;
+
+	/* completion queue invalid */
+	if (!cqid || cqid > NVME_MOCK_NQUEUES || !mock->cqs[cqid].vaddr)
+		return NVME_SC_INVALID_FIELD;
+
+	if (qsize < 2 || qsize > NVME_MOCK_MQES + 1)
+		return NVME_SC_INVALID_QSIZE;
+
+	if (!(le16_to_cpu(cmd->create_sq.qflags) & NVME_Q_PC) || !prp1 ||
+	    prp1 & (NVME_MOCK_PAGESIZE - 1))
+		return NVME_SC_INVALID_FIELD;
+
+	mock->sqs[qid] = (struct nvme_mock_sq) {
+		.vaddr = __vaddr(prp1),
+		.qsize = (uint16_t)qsize,
+		.cqid = cqid,
+	};
+
+	mock->maxqid = max_t(int, mock->maxqid, qid);
+
+	return 0;
+}
+
+static int __mock_delete_q(struct nvme_mock *mock, union nvme_cmd *cmd)
+{
+	uint16_t qid = le16_to_cpu(cmd->delete_q.qid);
+
+	if (!qid || qid > NVME_MOCK_NQUEUES)
+		return NVME_SC_INVALID_QID;
+
+	if (cmd->opcode == NVME_ADMIN_DELETE_SQ) {
+		if (!mock->sqs[qid].vaddr)
+			return NVME_SC_INVALID_QID;
+
+		memset(&mock->sqs[qid], 0x0, sizeof(mock->sqs[qid]));
+	} else {
+		if (!mock->cqs[qid].vaddr)
+			return NVME_SC_INVALID_QID;
+
+		memset(&mock->cqs[qid], 0x0, sizeof(mock->cqs[qid]));
+	}
+
+	/* the doorbells of a queue start out at zero when it is created again */
+	mmio_write32(__sqtdbl(mock, qid), cpu_to_le32(0));
+	mmio_write32(__cqhdbl(mock, qid), cpu_to_le32(0));
+
+	return 0;
+}
+
+/*
+ * Switch to the shadow doorbells, seeding them (and the event indices) with
+ * the doorbell register values of the queues that already exist.
+ */
+static int __mock_dbconfig(struct nvme_mock *mock, union nvme_cmd *cmd)
+{
+	uint64_t prp1 = le64_to_cpu(cmd->dptr.prp1), prp2 = le64_to_cpu(cmd->dptr.prp2);
+
+	if (!prp1 || !prp2 || (prp1 | prp2) & (NVME_MOCK_PAGESIZE - 1))
+		return NVME_SC_INVALID_FIELD;
+
+	mock->dbbuf_dbs = __vaddr(prp1);
+	mock->dbbuf_eis = __vaddr(prp2);
+
+	for (int idx = 0; idx < 2 * (mock->maxqid + 1); idx++) {
+		uint16_t qsize = idx & 1 ? mock->cqs[idx / 2].qsize : mock->sqs[idx / 2].qsize;
+		uint32_t v = le32_to_cpu(mmio_read32(mock->doorbells + idx * 4));
+
+		if (!qsize)
+			continue;
+
+		__STORE_PTR(uint32_t *, &mock->dbbuf_dbs[idx], v);
+		__STORE_PTR(uint32_t *, &mock->dbbuf_eis[idx], (v + qsize - 1u) % qsize);
+	}
+
+	return 0;
+}
+
+/* returns the status, or -1 for commands that are held (i.e., never complete) */
+static int __mock_admin(struct nvme_mock *mock, union nvme_cmd *cmd, uint32_t *dw0)
+{
+	uint32_t numd;
+
+	switch (cmd->opcode) {
+	case NVME_ADMIN_IDENTIFY:
+		return __mock_identify(mock, cmd);
+
+	case NVME_ADMIN_SET_FEATURES:
+	case NVME_ADMIN_GET_FEATURES:
+		return __mock_features(mock, cmd, dw0);
+
+	case NVME_ADMIN_CREATE_CQ:
+		return __mock_create_cq(mock, cmd);
+
+	case NVME_ADMIN_CREATE_SQ:
+		return __mock_create_sq(mock, cmd);
+
+	case NVME_ADMIN_DELETE_SQ:
+	case NVME_ADMIN_DELETE_CQ:
+		return __mock_delete_q(mock, cmd);
+
+	case NVME_ADMIN_DBCONFIG:
+		return __mock_dbconfig(mock, cmd);
+
+	case NVME_ADMIN_GET_LOG_PAGE:
+		/* all log pages read as zeroes */
+		numd = (uint32_t)le16_to_cpu(cmd->log.numdu) << 16 | le16_to_cpu(cmd->log.numdl);
+
+		if (__mock_write_data(cmd, NULL, ((size_t)numd + 1) * 4))
+			return NVME_SC_INVALID_FIELD;
+
+		return 0;
+
+	case NVME_ADMIN_ABORT:
+		/* command not aborted */
+		*dw0 = 1;
+
+		return 0;
+
+	case NVME_ADMIN_ASYNC_EVENT:
+		/* there are no events */
+		return -1;
+	}
+
+	return NVME_SC_INVALID_OPCODE;
+}
+
+/* commands are checked, but no data is transferred */
+static int __mock_io(struct nvme_mock *mock, union nvme_cmd *cmd)
+{
+	uint32_t nsid = le32_to_cpu(cmd->nsid);
+	uint64_t slba, nlb;
+
+	switch (cmd->opcode) {
+	case NVME_NVM_FLUSH:
+		if (nsid != 1 && nsid != 0xffffffff)
+			return NVME_SC_INVALID_NS;
+
+		return 0;
+
+	case NVME_NVM_READ:
+	case NVME_NVM_WRITE:
+	case NVME_NVM_COMPARE:
+	case NVME_NVM_WRITE_ZEROES:
+	case NVME_NVM_VERIFY:
+		if (nsid != 1)
+			return NVME_SC_INVALID_NS;
+
+		slba = le64_to_cpu(cmd->rw.slba);
+		nlb = le16_to_cpu(cmd->rw.nlb) + 1ull;
+
+		if (slba >= mock->nsze || nlb > mock->nsze - slba)
+			return NVME_SC_LBA_RANGE;
+
+		return 0;
+
+	case NVME_NVM_DSM:
+		if (nsid != 1)
+			return NVME_SC_INVALID_NS;
+
+		return 0;
+	}
+
+	return NVME_SC_INVALID_OPCODE;
+}
+
+static inline bool __mock_cpls_full(struct nvme_mock *mock)
+{
+	return mock->cpl_tail - mock->cpl_head == NVME_MOCK_INFLIGHT;
+}
+
+/*
+ * Execute a command and queue its completion. I/O commands complete after the
+ * configured latency, and no sooner than the configured interval after the
+ * previous i/o completion; admin commands complete immediately (behind any
+ * completions already queued).
+ */
+static void __mock_exec(struct nvme_mock *mock, int qid, union nvme_cmd *cmd, uint64_t now)
+{
+	struct nvme_mock_sq *sq = &mock->sqs[qid];
+	uint64_t due = now;
+	uint32_t dw0 = 0;
+	int sc;
+
+	if (qid == NVME_AQ) {
+		sc = __mock_admin(mock, cmd, &dw0);
+		if (sc < 0)
+			return;
+	} else {
+		sc = __mock_io(mock, cmd);
+
+		due = max_t(uint64_t, now + mock->latency_ns, mock->last_due + mock->interval_ns);
+		mock->last_due = due;
+	}
+
+	mock->cpls[mock->cpl_tail++ & (NVME_MOCK_INFLIGHT - 1)] = (struct nvme_mock_cpl) {
+		.due = due,
+		.cqid = sq->cqid,
+		.cqe = {
+			.dw0 = cpu_to_le32(dw0),
+			.sqhd = cpu_to_le16(sq->head),
+			.sqid = cpu_to_le16((uint16_t)qid),
+			.cid = cmd->cid,
+			.sfp = cpu_to_le16((uint16_t)(sc << 1)),
+		},
+	};
+
+	mock->ncmds++;
+}
+
+static bool __mock_fetch(struct nvme_mock *mock, int qid, uint64_t now)
+{
+	struct nvme_mock_sq *sq = &mock->sqs[qid];
+	uint16_t tail;
+	int n = 0;
+
+	if (!sq->vaddr)
+		return false;
+
+	tail = __mock_doorbell(mock, 2 * qid, &sq->db, sq->qsize);
+
+	while (sq->head != tail && n < NVME_MOCK_BURST && !__mock_cpls_full(mock)) {
+		union nvme_cmd cmd = sq->vaddr[sq->head];
+
+		sq->head = (uint16_t)((sq->head + 1) % sq->qsize);
+
+		__mock_exec(mock, qid, &cmd, now);
+
+		/* the queue may have been deleted by the command */
+		if (!sq->vaddr)
+			return true;
+
+		n++;
+	}
+
+	return n > 0;
+}
+
+static void __mock_post_cqe(struct nvme_mock_cq *cq, struct nvme_cqe *cqe)
+{
+	struct nvme_cqe *dst = &cq->vaddr[cq->tail];
+
+	dst->qw0 = cqe->qw0;
+	dst->sqhd = cqe->sqhd;
+	dst->sqid = cqe->sqid;
+	dst->cid = cqe->cid;
+
+	/* the phase tag makes the entry valid; write it last */
+	dma_wmb();
+
+	__STORE_PTR(uint16_t *, &dst->sfp, cqe->sfp | cpu_to_le16(cq->phase));
+
+	cq->tail = (uint16_t)((cq->tail + 1) % cq->qsize);
+	if (!cq->tail)
+		cq->phase ^= 1;
+}
+
+/* post due completions in order, stalling on the first full completion queue */
+static bool __mock_post(struct nvme_mock *mock, uint64_t now)
+{
+	bool posted = false;
+
+	while (mock->cpl_head != mock->cpl_tail) {
+		struct nvme_mock_cpl *cpl = &mock->cpls[mock->cpl_head & (NVME_MOCK_INFLIGHT - 1)];
+		struct nvme_mock_cq *cq = &mock->cqs[cpl->cqid];
+
+		if (cpl->due > now)
+			break;
+
+		if (cq->vaddr) {
+			uint16_t head = __mock_doorbell(mock, 2 * cpl->cqid + 1, &cq->db,
+							cq->qsize);
+
+			if ((cq->tail + 1) % cq->qsize == head)
+				break;
+
+			__mock_post_cqe(cq, &cpl->cqe);
+		}
+
+		mock->cpl_head++;
+		posted = true;
+	}
+
+	return posted;
+}
+
+static void __mock_reset(struct nvme_mock *mock)
+{
+	memset(mock->sqs, 0x0, sizeof(mock->sqs));
+	memset(mock->cqs, 0x0, sizeof(mock->cqs));
+
+	mock->maxqid = 0;
+	mock->dbbuf_dbs = mock->dbbuf_eis = NULL;
+	mock->cpl_head = mock->cpl_tail = 0;
+
+	memset(mock->doorbells, 0x0, NVME_MOCK_REGS_SIZE);
+
+	mock->enabled = false;
+}
+
+static bool __mock_enable(struct nvme_mock *mock)
+{
+	uint32_t aqa = le32_to_cpu(mmio_read32(mock->regs + NVME_REG_AQA));
+	uint64_t asq = le64_to_cpu(mmio_read64(mock->regs + NVME_REG_ASQ));
+	uint64_t acq = le64_to_cpu(mmio_read64(mock->regs + NVME_REG_ACQ));
+	uint32_t asqs = NVME_FIELD_GET(aqa, AQA_ASQS) + 1u;
+	uint32_t acqs = NVME_FIELD_GET(aqa, AQA_ACQS) + 1u;
+
+	if (!asq || !acq || (asq | acq) & (NVME_MOCK_PAGESIZE - 1) || asqs < 2 || acqs < 2) {
+		log_debug("invalid admin queue configuration\n");
+		return false;
+	}
+
+	mock->sqs[NVME_AQ] = (struct nvme_mock_sq) {
+		.vaddr = __vaddr(asq),
+		.qsize = (uint16_t)asqs,
+	};
+
+	mock->cqs[NVME_AQ] = (struct nvme_mock_cq) {
+		.vaddr = __vaddr(acq),
+		.qsize = (uint16_t)acqs,
+		.phase = 1,
+	};
+
+	mock->last_due = 0;
+	mock->enabled = true;
+
+	return true;
+}
+
+/* act on changes to CC; returns true if CC changed */
+static bool __mock_regs(struct nvme_mock *mock)
+{
+	uint32_t cc = le32_to_cpu(mmio_read32(mock->regs + NVME_REG_CC));
+	uint32_t csts = 0;
+
+	if (cc == mock->cc)
+		return false;
+
+	mock->cc = cc;
+
+	if (NVME_FIELD_GET(cc, CC_EN) && !mock->enabled) {
+		if (!__mock_enable(mock))
+			csts |= NVME_FIELD_SET(1, CSTS_CFS);
+	} else if (!NVME_FIELD_GET(cc, CC_EN) && mock->enabled) {
+		__mock_reset(mock);
+	}
+
+	if (mock->enabled)
+		csts |= NVME_FIELD_SET(1, CSTS_RDY);
+
+	if (NVME_FIELD_GET(cc, CC_SHN))
+		csts |= NVME_FIELD_SET(NVME_CSTS_SHST_COMPLETE, CSTS_SHST);
+
+	mmio_write32(mock->regs + NVME_REG_CSTS, cpu_to_le32(csts));
+
+	return true;
+}
+
+static void *nvme_mock_thread(void *opaque)
+{
+	struct nvme_mock *mock = opaque;
+	unsigned int idle = 0;
+
+	while (!atomic_load_acquire(&mock->stop)) {
+		uint64_t now = ticks_to_ns(get_ticks());
+		bool busy = __mock_regs(mock);
+
+		if (mock->enabled) {
+			for (int qid = 0; qid <= mock->maxqid; qid++)
+				busy |= __mock_fetch(mock, qid, now);
+
+			busy |= __mock_post(mock, now);
+		}
+
+		if (busy || mock->cpl_head != mock->cpl_tail) {
+			idle = 0;
+			continue;
+		}
+
+		if (idle < NVME_MOCK_IDLE_POLLS)
+			idle++;
+		else
+			usleep(NVME_MOCK_IDLE_USEC);
+	}
+
+	return NULL;
+}
+
+bool nvme_mock_bdf(const char *bdf)
+{
+	return streq(bdf, "mock") || strstarts(bdf, "mock:");
+}
+
+static int __mock_parse(struct nvme_mock *mock, const char *bdf)
+{
+	__autofree char *args = NULL;
+	char *tok, *save;
+
+	mock->nsze = NVME_MOCK_NSZE_DEFAULT;
+	mock->lbads = NVME_MOCK_LBADS_DEFAULT;
+
+	if (!strstarts(bdf, "mock:"))
+		return 0;
+
+	args = strdup(bdf + strlen("mock:"));
+	if (!args)
+		backtrace_abort();
+
+	for (tok = strtok_r(args, ":", &save); tok; tok = strtok_r(NULL, ":", &save)) {
+		char *val = strchr(tok, '='), *end;
+		unsigned long long v;
+
+		if (!val)
+			goto invalid;
+
+		*val++ = '\0';
+
+		errno = 0;
+		v = strtoull(val, &end, 0);
+		if (errno || end == val || *end)
+			goto invalid;
+
+		if (streq(tok, "latency_usec")) {
+			if (__builtin_mul_overflow(v, 1000, &mock->latency_ns))
+				goto invalid;
+		} else if (streq(tok, "iops")) {
+			mock->interval_ns = v ? NS_PER_SEC / v : 0;
+		} else if (streq(tok, "nsze")) {
+			if (!v)
+				goto invalid;
+
+			mock->nsze = v;
+		} else if (streq(tok, "lbads")) {
+			if (v < 9 || v > (unsigned int)__VFN_PAGESHIFT)
+				goto invalid;
+
+			mock->lbads = (uint8_t)v;
+		} else {
+			goto invalid;
+		}
+	}
+
+	return 0;
+
+invalid:
+	log_error("invalid mock controller option '%s'\n", tok);
+
+	errno = EINVAL;
+	return -1;
+}
+
+int nvme_mock_open(struct nvme_ctrl *ctrl, const char *bdf)
+{
+	struct nvme_mock *mock;
+	uint64_t cap;
+	int ret;
+
+	mock = znew_t(struct nvme_mock, 1);
+
+	if (__mock_parse(mock, bdf))
+		goto free_mock;
+
+	if (pgmap(&mock->regs, NVME_MOCK_BAR_SIZE) < 0) {
+		log_debug("could not allocate register space\n");
+		goto free_mock;
+	}
+
+	mock->doorbells = mock->regs + NVME_MOCK_REGS_SIZE;
+	mock->cpls = znew_t(struct nvme_mock_cpl, NVME_MOCK_INFLIGHT);
+
+	cap =
+		NVME_FIELD_SET(NVME_MOCK_MQES, CAP_MQES) |
+		NVME_FIELD_SET(1,              CAP_TO) |
+		NVME_FIELD_SET(1ULL,           CAP_CSS);
+
+	mmio_lh_write64(mock->regs + NVME_REG_CAP, cpu_to_le64(cap));
+	mmio_write32(mock->regs + NVME_REG_VS, cpu_to_le32(NVME_MOCK_VS));
+
+	ret = pthread_create(&mock->thread, NULL, nvme_mock_thread, mock);
+	if (ret) {
+		log_debug("could not create emulation thread\n");
+
+		errno = ret;
+		goto unmap;
+	}
+
+	pthread_once(&__mock_ctx_once, __mock_ctx_init);
+
+	ctrl->pci.bdf = bdf;
+	ctrl->pci.dev.fd = -1;
+	ctrl->pci.dev.ctx = &__mock_ctx;
+
+	ctrl->regs = mock->regs;
+	ctrl->doorbells = mock->doorbells;
+	ctrl->mock = mock;
+
+	log_info("emulating controller (latency %" PRIu64 " ns, interval %" PRIu64 " ns)\n",
+		 mock->latency_ns, mock->interval_ns);
+
+	return 0;
+
+unmap:
+	free(mock->cpls);
+	pgunmap(mock->regs, NVME_MOCK_BAR_SIZE);
+free_mock:
+	free(mock);
+
+	return -1;
+}
+
+void nvme_mock_close(struct nvme_ctrl *ctrl)
+{
+	struct nvme_mock *mock = ctrl->mock;
+
+	atomic_store_release(&mock->stop, true);
+	pthread_join(mock->thread, NULL);
+
+	log_info("executed %" PRIu64 " commands\n", mock->ncmds);
+
+	free(mock->cpls);
+	pgunmap(mock->regs, NVME_MOCK_BAR_SIZE);
+	free(mock);
+
+	ctrl->mock = NULL;
+	ctrl->regs = ctrl->doorbells = NULL;
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Software emulated controller, selected by giving nvme_init() a pseudo device
+ * identifier of the form "mock[:key=value[:key=value...]]" (see nvme_init()).
+ */
+bool nvme_mock_bdf(const char *bdf);
+
+/*
+ * Set up the emulated controller; on success, @ctrl->regs and
+ * @ctrl->doorbells are valid and the emulation is running.
+ */
+int nvme_mock_open(struct nvme_ctrl *ctrl, const char *bdf);
+
+/* stop the emulation and release the register space */
+void nvme_mock_close(struct nvme_ctrl *ctrl);
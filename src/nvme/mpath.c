@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/mpath: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/support/atomic.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/pci.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/container_of/container_of.h"
+
+#include "types.h"
+
+#define NVME_SCT_PATH 0x3
+#define NVME_STATUS_DNR (1 << 14)
+
+/*
+ * Whether the command should be retried on another path. Commands aborted
+ * because their queue was deleted (nvme_recover()) or because they timed out
+ * indicate a controller problem rather than a problem with the command.
+ */
+static bool __path_error(struct nvme_cqe *cqe)
+{
+	uint16_t status = le16_to_cpu(cqe->sfp) >> 1;
+	uint16_t sct = (status >> 8) & 0x7, sc = status & 0xff;
+
+	if (!status || status & NVME_STATUS_DNR)
+		return false;
+
+	if (sct == NVME_SCT_PATH)
+		return true;
+
+	return sct == 0x0 && (sc == NVME_SC_ABORT_SQ_DELETION || sc == NVME_SC_ABORT_REQ);
+}
+
+int vfn_mpath_open(struct vfn_mpath *mp, struct nvme_ctrl **ctrls, int n, uint32_t nsid,
+		   int policy)
+{
+	if (n < 1 || n > VFN_MPATH_MAX_PATHS || policy < VFN_MPATH_ROUND_ROBIN ||
+	    policy > VFN_MPATH_NUMA) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(mp, 0x0, sizeof(*mp));
+
+	for (int i = 0; i < n; i++) {
+		struct vfn_bdev *bdev = &mp->paths[i].bdev;
+		struct nvme_ns *ns;
+
+		if (vfn_bdev_open(bdev, ctrls[i], nsid))
+			return -1;
+
+		ns = bdev->ns;
+
+		if (i && (ns->nsze != mp->paths[0].bdev.ns->nsze ||
+			  ns->lbads != mp->paths[0].bdev.ns->lbads)) {
+			log_debug("nsid %"PRIu32" does not match on path %d\n", nsid, i);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		mp->paths[i].node = ctrls[i]->pci.bdf ?
+			pci_device_get_numa_node(ctrls[i]->pci.bdf) : -1;
+	}
+
+	mp->npaths = n;
+	mp->policy = policy;
+
+	return 0;
+}
+
+void vfn_mpath_set_path_state(struct vfn_mpath *mp, int path, bool live)
+{
+	assert(path >= 0 && path < mp->npaths);
+
+	atomic_store_release(&mp->paths[path].failed, !live);
+}
+
+void vfn_mpath_queue_init(struct vfn_mpath_queue *q, struct vfn_mpath *mp,
+			  struct nvme_sq **sqs)
+{
+	unsigned int cpu, node;
+
+	memset(q, 0x0, sizeof(*q));
+
+	q->mp = mp;
+	q->node = getcpu(&cpu, &node) ? -1 : (int)node;
+
+	for (int i = 0; i < mp->npaths; i++)
+		vfn_bdev_queue_init(&q->paths[i].q, &mp->paths[i].bdev, sqs[i]);
+}
+
+static inline bool __path_usable(struct vfn_mpath_queue *q, int path, unsigned int tried)
+{
+	return !(tried & (1u << path)) && !atomic_load_acquire(&q->mp->paths[path].failed);
+}
+
+/* round robin over the usable paths (on @node, unless @node is -1) */
+static int __select_rr(struct vfn_mpath_queue *q, unsigned int tried, int node)
+{
+	struct vfn_mpath *mp = q->mp;
+
+	for (int i = 0; i < mp->npaths; i++) {
+		int path = (int)((q->next + (unsigned int)i) % (unsigned int)mp->npaths);
+
+		if (!__path_usable(q, path, tried))
+			continue;
+
+		if (node >= 0 && mp->paths[path].node != node)
+			continue;
+
+		q->next = (unsigned int)path + 1;
+
+		return path;
+	}
+
+	return -1;
+}
+
+static int __select(struct vfn_mpath_queue *q, unsigned int tried)
+{
+	struct vfn_mpath *mp = q->mp;
+	int path = -1;
+
+	switch (mp->policy) {
+	case VFN_MPATH_QUEUE_DEPTH:
+		for (int i = 0; i < mp->npaths; i++) {
+			if (!__path_usable(q, i, tried))
+				continue;
+
+			if (path < 0 || q->paths[i].inflight < q->paths[path].inflight)
+				path = i;
+		}
+
+		return path;
+
+	case VFN_MPATH_NUMA:
+		if (q->node >= 0) {
+			path = __select_rr(q, tried, q->node);
+			if (path >= 0)
+				return path;
+		}
+
+		/* fallthrough */
+	default:
+		return __select_rr(q, tried, -1);
+	}
+}
+
+static void __mpath_complete(struct vfn_bdev_io *io, struct nvme_cqe *cqe);
+
+static int __add(struct vfn_mpath_queue *q, struct vfn_mpath_io *mio)
+{
+	int path = __select(q, mio->tried);
+
+	if (path < 0) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	mio->q = q;
+	mio->path = path;
+	mio->io.cb = __mpath_complete;
+
+	if (vfn_bdev_add(&q->paths[path].q, &mio->io))
+		return -1;
+
+	mio->tried |= 1u << path;
+	q->paths[path].inflight++;
+
+	return 0;
+}
+
+static void __mpath_complete(struct vfn_bdev_io *io, struct nvme_cqe *cqe)
+{
+	struct vfn_mpath_io *mio = container_of(io, struct vfn_mpath_io, io);
+	struct vfn_mpath_queue *q = mio->q;
+
+	q->paths[mio->path].inflight--;
+
+	if (__path_error(cqe)) {
+		if (!atomic_xchg(&q->mp->paths[mio->path].failed, true))
+			log_info("path %d failed (status 0x%"PRIx16")\n", mio->path,
+				 (uint16_t)(le16_to_cpu(cqe->sfp) >> 1));
+
+		/* picked up by the next vfn_mpath_unplug() or vfn_mpath_poll() */
+		if (!__add(q, mio)) {
+			q->failovers++;
+			return;
+		}
+	}
+
+	io->cb = mio->cb;
+	io->cb(io, cqe);
+}
+
+int vfn_mpath_add(struct vfn_mpath_queue *q, struct vfn_mpath_io *mio)
+{
+	mio->cb = mio->io.cb;
+	mio->tried = 0;
+
+	if (__add(q, mio)) {
+		mio->io.cb = mio->cb;
+		return -1;
+	}
+
+	return 0;
+}
+
+int vfn_mpath_unplug(struct vfn_mpath_queue *q)
+{
+	int ret = 0;
+
+	for (int i = 0; i < q->mp->npaths; i++) {
+		if (q->paths[i].q.nplugged && vfn_bdev_unplug(&q->paths[i].q))
+			ret = -1;
+	}
+
+	if (ret)
+		errno = EBUSY;
+
+	return ret;
+}
+
+int vfn_mpath_poll(struct vfn_mpath_queue *q, int budget)
+{
+	int n = 0;
+
+	for (int i = 0; i < q->mp->npaths; i++)
+		n += vfn_bdev_poll(&q->paths[i].q, budget);
+
+	/* submit the i/os that failed over; on EBUSY they are retried by the next poll */
+	vfn_mpath_unplug(q);
+
+	return n;
+}
@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "mpath.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+int pci_device_get_numa_node(const char *bdf UNUSED)
+{
+	return -1;
+}
+
+#define NPATHS 2
+#define QSIZE 8
+
+/* path related status: asymmetric access inaccessible */
+#define STATUS_ANA_INACCESSIBLE (0x3 << 8 | 0x2)
+
+struct path {
+	struct nvme_ns ns;
+	struct nvme_ctrl ctrl;
+	struct nvme_sq sqs[2];
+	struct nvme_cq cq;
+	struct nvme_rq rqs[QSIZE - 1];
+	uint32_t sqdb, cqdb;
+
+	uint16_t cqtail;
+};
+
+static struct path paths[NPATHS];
+
+static int ncompleted, nfailed;
+
+static void complete_cb(struct vfn_bdev_io *io UNUSED, struct nvme_cqe *cqe)
+{
+	if (nvme_cqe_ok(cqe))
+		ncompleted++;
+	else
+		nfailed++;
+}
+
+static void init_path(struct path *p)
+{
+	p->ns = (struct nvme_ns) { .nsid = 1, .nsze = 0x100000, .lbads = 12, .max_nlb = 64 };
+	p->ctrl = (struct nvme_ctrl) { .ns = &p->ns, .nns = 1 };
+
+	p->cq = (struct nvme_cq) { .qsize = QSIZE, .doorbell = &p->cqdb, .nsqs = 2,
+				   .sqs = p->sqs };
+	p->sqs[1] = (struct nvme_sq) {
+		.id = 1, .qsize = QSIZE, .doorbell = &p->sqdb, .cq = &p->cq, .rqs = p->rqs,
+	};
+
+	assert(pgmap(&p->cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&p->sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = QSIZE - 2; i >= 0; i--) {
+		p->rqs[i].sq = &p->sqs[1];
+		p->rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&p->rqs[i]);
+	}
+}
+
+/* complete the command in submission queue slot @idx of path @p */
+static void complete(struct path *p, uint16_t idx, uint16_t status)
+{
+	union nvme_cmd *sqe = p->sqs[1].vaddr + (idx << NVME_SQES);
+	struct nvme_cqe *cqe = p->cq.vaddr + (p->cqtail++ << NVME_CQES);
+
+	cqe->sqid = cpu_to_le16(1);
+	cqe->cid = sqe->cid;
+	cqe->sfp = cpu_to_le16((uint16_t)(status << 1 | 0x1));
+}
+
+static struct vfn_mpath_io mios[8];
+
+static void prep_io(int i, uint64_t slba)
+{
+	mios[i] = (struct vfn_mpath_io) {
+		.io = {
+			.op = VFN_BDEV_OP_READ, .slba = slba, .nlb = 1, .iova = 0x1000000,
+			.cb = complete_cb,
+		},
+	};
+}
+
+int main(void)
+{
+	struct nvme_ctrl *ctrls[NPATHS + 1];
+	struct nvme_sq *sqs[NPATHS];
+	struct nvme_ns other;
+	struct nvme_ctrl ctrl;
+	struct vfn_mpath mp;
+	struct vfn_mpath_queue q;
+
+	plan_tests(20);
+
+	for (int i = 0; i < NPATHS; i++) {
+		init_path(&paths[i]);
+
+		ctrls[i] = &paths[i].ctrl;
+		sqs[i] = &paths[i].sqs[1];
+	}
+
+	/* a namespace of another size is not the same namespace */
+	other = (struct nvme_ns) { .nsid = 1, .nsze = 0x200000, .lbads = 12, .max_nlb = 64 };
+	ctrl = (struct nvme_ctrl) { .ns = &other, .nns = 1 };
+	ctrls[NPATHS] = &ctrl;
+
+	ok1(vfn_mpath_open(&mp, ctrls, NPATHS + 1, 1, VFN_MPATH_ROUND_ROBIN) == -1 &&
+	    errno == EINVAL);
+	ok1(vfn_mpath_open(&mp, ctrls, NPATHS, 1, VFN_MPATH_NUMA + 1) == -1 && errno == EINVAL);
+	ok1(vfn_mpath_open(&mp, ctrls, NPATHS, 1, VFN_MPATH_ROUND_ROBIN) == 0);
+
+	vfn_mpath_queue_init(&q, &mp, sqs);
+
+	/* round robin; the i/os are not adjacent, so they are not merged */
+	for (int i = 0; i < 4; i++) {
+		prep_io(i, (uint64_t)i * 0x10);
+		assert(vfn_mpath_add(&q, &mios[i]) == 0);
+	}
+
+	ok1(mios[0].path == 0 && mios[1].path == 1 && mios[2].path == 0 && mios[3].path == 1);
+
+	ok1(vfn_mpath_unplug(&q) == 0);
+	ok1(paths[0].sqdb == 2 && paths[1].sqdb == 2);
+	ok1(q.paths[0].inflight == 2 && q.paths[1].inflight == 2);
+
+	/* a path error on the first path fails the i/o over to the second path */
+	complete(&paths[0], 0, STATUS_ANA_INACCESSIBLE);
+	complete(&paths[0], 1, 0x0);
+
+	ok1(vfn_mpath_poll(&q, 8) == 2);
+	ok1(ncompleted == 1 && !nfailed && q.failovers == 1 && mp.paths[0].failed);
+	ok1(mios[0].path == 1 && paths[1].sqdb == 3 && q.paths[1].inflight == 3);
+
+	/* the failed path is not selected */
+	prep_io(4, 0x100);
+	ok1(vfn_mpath_add(&q, &mios[4]) == 0 && mios[4].path == 1);
+	vfn_mpath_unplug(&q);
+
+	complete(&paths[1], 0, 0x0);
+	complete(&paths[1], 1, 0x0);
+	complete(&paths[1], 2, 0x0);
+
+	/* no other live path; the error is reported */
+	complete(&paths[1], 3, STATUS_ANA_INACCESSIBLE);
+
+	ok1(vfn_mpath_poll(&q, 8) == 4);
+	ok1(ncompleted == 4 && nfailed == 1 && q.failovers == 1 && mp.paths[1].failed);
+	ok1(mios[4].io.cb == complete_cb);
+
+	prep_io(5, 0x200);
+	ok1(vfn_mpath_add(&q, &mios[5]) == -1 && errno == ENODEV);
+
+	/* errors that should not be retried are reported right away */
+	vfn_mpath_set_path_state(&mp, 0, true);
+	vfn_mpath_set_path_state(&mp, 1, true);
+
+	prep_io(5, 0x200);
+	assert(vfn_mpath_add(&q, &mios[5]) == 0 && mios[5].path == 0);
+	vfn_mpath_unplug(&q);
+
+	complete(&paths[0], 2, NVME_SC_INVALID_FIELD);
+	ok1(vfn_mpath_poll(&q, 8) == 1 && nfailed == 2 && !mp.paths[0].failed);
+
+	/* queue depth; the second path is busier */
+	mp.policy = VFN_MPATH_QUEUE_DEPTH;
+
+	prep_io(6, 0x300);
+	prep_io(7, 0x400);
+
+	q.paths[1].inflight = 2;
+	ok1(vfn_mpath_add(&q, &mios[6]) == 0 && mios[6].path == 0);
+	ok1(vfn_mpath_add(&q, &mios[7]) == 0 && mios[7].path == 0);
+
+	/* numa; only the second path is local */
+	mp.policy = VFN_MPATH_NUMA;
+	mp.paths[0].node = 0;
+	mp.paths[1].node = 1;
+	q.node = 1;
+
+	prep_io(5, 0x500);
+	ok1(vfn_mpath_add(&q, &mios[5]) == 0 && mios[5].path == 1);
+
+	/* fall back to a remote path */
+	vfn_mpath_set_path_state(&mp, 1, false);
+
+	prep_io(4, 0x600);
+	ok1(vfn_mpath_add(&q, &mios[4]) == 0 && mios[4].path == 0);
+
+	return exit_status();
+}
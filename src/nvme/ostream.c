@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/ostream: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+int nvme_ostream_init(struct nvme_ostream *os, struct nvme_sq *sq, nvme_ostream_cb cb,
+		      void *opaque)
+{
+	uint32_t nslots;
+
+	if (sq->qsize < 2) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* at least the queue depth; a power of two to index by masking */
+	nslots = 1U << (32 - __builtin_clz((uint32_t)sq->qsize - 1));
+
+	memset(os, 0x0, sizeof(*os));
+
+	os->sq = sq;
+	os->cb = cb;
+	os->opaque = opaque;
+
+	os->slots = znew_t(struct nvme_ostream_slot, nslots);
+	os->mask = nslots - 1;
+
+	return 0;
+}
+
+void nvme_ostream_destroy(struct nvme_ostream *os)
+{
+	free(os->slots);
+
+	memset(os, 0x0, sizeof(*os));
+}
+
+void __nvme_ostream_complete(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg)
+{
+	struct nvme_ostream *os = arg;
+	struct nvme_ostream_slot *slot = &os->slots[rq->seq & os->mask];
+	uint32_t head = os->head;
+
+	slot->cqe = *cqe;
+	slot->done = true;
+
+	/* an earlier command is still outstanding */
+	if (rq->seq != head)
+		return;
+
+	while (head != os->next && (slot = &os->slots[head & os->mask])->done) {
+		struct nvme_ostream_slot copy = *slot;
+
+		/* the callback may submit to the stream and reuse the slot */
+		slot->done = false;
+		os->head = ++head;
+
+		if (copy.cb)
+			copy.cb(head - 1, &copy.cqe, copy.arg);
+
+		head = os->head;
+	}
+
+	if (os->cb)
+		os->cb(os, os->head, os->opaque);
+}
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "ostream.c"
+
+#include "types.h"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+#define SQSIZE 4
+#define CQSIZE 64
+
+static uint32_t sqdb, cqdb;
+static struct nvme_sq sqs[2];
+static struct nvme_cq cq;
+static struct nvme_rq rqs[SQSIZE - 1];
+static uint16_t cqtail;
+
+static struct nvme_ostream os;
+
+/* delivery order and watermarks reported */
+static uint32_t delivered[16], watermarks[16];
+static int ndelivered, nwatermarks;
+
+static union nvme_cmd cmd;
+
+static void io_cb(uint32_t seq, struct nvme_cqe *cqe, void *arg)
+{
+	delivered[ndelivered++] = seq;
+
+	/* the status of each command is delivered with it */
+	assert((le16_to_cpu(cqe->sfp) >> 1) == (uint16_t)(uintptr_t)arg);
+}
+
+static void resubmit_cb(uint32_t seq, struct nvme_cqe *cqe, void *arg)
+{
+	io_cb(seq, cqe, arg);
+
+	nvme_ostream_submit(&os, nvme_rq_acquire(&sqs[1]), &cmd, io_cb, NULL);
+}
+
+static void watermark_cb(struct nvme_ostream *s UNUSED, uint32_t watermark, void *opaque UNUSED)
+{
+	watermarks[nwatermarks++] = watermark;
+}
+
+/* complete the command with sequence number @seq */
+static int complete(uint32_t seq, uint16_t status)
+{
+	struct nvme_cqe *cqe = cq.vaddr + (cqtail++ << NVME_CQES);
+	int i;
+
+	for (i = 0; i < SQSIZE - 1; i++)
+		if (rqs[i].seq == seq && rqs[i].cb)
+			break;
+
+	assert(i < SQSIZE - 1);
+
+	cqe->sqid = cpu_to_le16(1);
+	cqe->cid = rqs[i].cid;
+	cqe->sfp = cpu_to_le16((uint16_t)(status << 1 | 0x1));
+
+	return nvme_cq_process(&cq, 1);
+}
+
+static int64_t submit(nvme_ostream_io_cb cb, uint16_t status)
+{
+	struct nvme_rq *rq = nvme_rq_acquire(&sqs[1]);
+	int64_t seq;
+
+	assert(rq);
+
+	seq = nvme_ostream_submit(&os, rq, &cmd, cb, (void *)(uintptr_t)status);
+	if (seq < 0)
+		nvme_rq_release(rq);
+
+	return seq;
+}
+
+int main(void)
+{
+	plan_tests(9);
+
+	cq = (struct nvme_cq) {
+		.qsize = CQSIZE,
+		.doorbell = &cqdb,
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = SQSIZE,
+		.doorbell = &sqdb,
+		.cq = &cq,
+		.rqs = rqs,
+	};
+	sqs[1].rq_top = __nvme_rq_top_set(&sqs[1], 0, &rqs[SQSIZE - 2]);
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = 0; i < SQSIZE - 1; i++) {
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+
+		if (i > 0)
+			rqs[i].rq_next = &rqs[i - 1];
+	}
+
+	ok1(nvme_ostream_init(&os, &sqs[1], watermark_cb, NULL) == 0 && os.mask == SQSIZE - 1);
+
+	ok1(submit(io_cb, 0) == 0 && submit(io_cb, NVME_SC_INVALID_FIELD) == 1 &&
+	    submit(io_cb, 0) == 2);
+
+	/* held back until the oldest command completes; the tracker is released */
+	ok1(complete(2, 0) == 1 && complete(1, NVME_SC_INVALID_FIELD) == 1);
+	ok1(!ndelivered && !nwatermarks && nvme_ostream_watermark(&os) == 0 &&
+	    __nvme_rq_top(&sqs[1], sqs[1].rq_top));
+
+	/* trackers are free, but the reorder buffer is full */
+	ok1(submit(io_cb, 0) == 3 && complete(3, 0) == 1);
+	ok1(submit(io_cb, 0) == -1 && errno == EBUSY);
+
+	/* the whole prefix is delivered in order */
+	ok1(complete(0, 0) == 1 && ndelivered == 4 && delivered[0] == 0 && delivered[1] == 1 &&
+	    delivered[2] == 2 && delivered[3] == 3);
+	ok1(nwatermarks == 1 && watermarks[0] == 4 && nvme_ostream_watermark(&os) == 4);
+
+	/* submissions from the in-order callback get the next sequence number */
+	ok1(submit(resubmit_cb, 0) == 4 && complete(4, 0) == 1 && os.next == 6 &&
+	    complete(5, 0) == 1 && ndelivered == 6 && watermarks[2] == 6);
+
+	nvme_ostream_destroy(&os);
+
+	return exit_status();
+}
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/pi: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "crc64.h"
+#include "types.h"
+
+/* CRC-16 T10-DIF (polynomial 0x8bb7, not reflected) */
+static const uint16_t crc16_t10dif_table[256] = {
+	0x0000, 0x8bb7, 0x9cd9, 0x176e, 0xb205, 0x39b2, 0x2edc, 0xa56b,
+	0xefbd, 0x640a, 0x7364, 0xf8d3, 0x5db8, 0xd60f, 0xc161, 0x4ad6,
+	0x54cd, 0xdf7a, 0xc814, 0x43a3, 0xe6c8, 0x6d7f, 0x7a11, 0xf1a6,
+	0xbb70, 0x30c7, 0x27a9, 0xac1e, 0x0975, 0x82c2, 0x95ac, 0x1e1b,
+	0xa99a, 0x222d, 0x3543, 0xbef4, 0x1b9f, 0x9028, 0x8746, 0x0cf1,
+	0x4627, 0xcd90, 0xdafe, 0x5149, 0xf422, 0x7f95, 0x68fb, 0xe34c,
+	0xfd57, 0x76e0, 0x618e, 0xea39, 0x4f52, 0xc4e5, 0xd38b, 0x583c,
+	0x12ea, 0x995d, 0x8e33, 0x0584, 0xa0ef, 0x2b58, 0x3c36, 0xb781,
+	0xd883, 0x5334, 0x445a, 0xcfed, 0x6a86, 0xe131, 0xf65f, 0x7de8,
+	0x373e, 0xbc89, 0xabe7, 0x2050, 0x853b, 0x0e8c, 0x19e2, 0x9255,
+	0x8c4e, 0x07f9, 0x1097, 0x9b20, 0x3e4b, 0xb5fc, 0xa292, 0x2925,
+	0x63f3, 0xe844, 0xff2a, 0x749d, 0xd1f6, 0x5a41, 0x4d2f, 0xc698,
+	0x7119, 0xfaae, 0xedc0, 0x6677, 0xc31c, 0x48ab, 0x5fc5, 0xd472,
+	0x9ea4, 0x1513, 0x027d, 0x89ca, 0x2ca1, 0xa716, 0xb078, 0x3bcf,
+	0x25d4, 0xae63, 0xb90d, 0x32ba, 0x97d1, 0x1c66, 0x0b08, 0x80bf,
+	0xca69, 0x41de, 0x56b0, 0xdd07, 0x786c, 0xf3db, 0xe4b5, 0x6f02,
+	0x3ab1, 0xb106, 0xa668, 0x2ddf, 0x88b4, 0x0303, 0x146d, 0x9fda,
+	0xd50c, 0x5ebb, 0x49d5, 0xc262, 0x6709, 0xecbe, 0xfbd0, 0x7067,
+	0x6e7c, 0xe5cb, 0xf2a5, 0x7912, 0xdc79, 0x57ce, 0x40a0, 0xcb17,
+	0x81c1, 0x0a76, 0x1d18, 0x96af, 0x33c4, 0xb873, 0xaf1d, 0x24aa,
+	0x932b, 0x189c, 0x0ff2, 0x8445, 0x212e, 0xaa99, 0xbdf7, 0x3640,
+	0x7c96, 0xf721, 0xe04f, 0x6bf8, 0xce93, 0x4524, 0x524a, 0xd9fd,
+	0xc7e6, 0x4c51, 0x5b3f, 0xd088, 0x75e3, 0xfe54, 0xe93a, 0x628d,
+	0x285b, 0xa3ec, 0xb482, 0x3f35, 0x9a5e, 0x11e9, 0x0687, 0x8d30,
+	0xe232, 0x6985, 0x7eeb, 0xf55c, 0x5037, 0xdb80, 0xccee, 0x4759,
+	0x0d8f, 0x8638, 0x9156, 0x1ae1, 0xbf8a, 0x343d, 0x2353, 0xa8e4,
+	0xb6ff, 0x3d48, 0x2a26, 0xa191, 0x04fa, 0x8f4d, 0x9823, 0x1394,
+	0x5942, 0xd2f5, 0xc59b, 0x4e2c, 0xeb47, 0x60f0, 0x779e, 0xfc29,
+	0x4ba8, 0xc01f, 0xd771, 0x5cc6, 0xf9ad, 0x721a, 0x6574, 0xeec3,
+	0xa415, 0x2fa2, 0x38cc, 0xb37b, 0x1610, 0x9da7, 0x8ac9, 0x017e,
+	0x1f65, 0x94d2, 0x83bc, 0x080b, 0xad60, 0x26d7, 0x31b9, 0xba0e,
+	0xf0d8, 0x7b6f, 0x6c01, 0xe7b6, 0x42dd, 0xc96a, 0xde04, 0x55b3,
+};
+
+struct pi_layout {
+	size_t bs;
+
+	/* distance between consecutive logical blocks and their metadata */
+	size_t data_stride, meta_stride;
+	unsigned char *meta;
+
+	/* offset of the tuple in the metadata; the guard covers any bytes before it */
+	size_t tuple_ofst;
+
+	uint64_t reftag_mask;
+};
+
+static uint16_t crc16_t10dif(uint16_t crc, const unsigned char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = (uint16_t)(crc << 8) ^ crc16_t10dif_table[((crc >> 8) ^ buf[i]) & 0xff];
+
+	return crc;
+}
+
+static int pi_layout(struct nvme_pi *pi, struct pi_layout *l)
+{
+	struct nvme_ns *ns = pi->ns;
+	size_t tuple_size;
+
+	if (!ns || !ns->pi) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	switch (ns->pif) {
+	case NVME_PI_FORMAT_16B:
+		tuple_size = sizeof(struct nvme_crc16_pi_tuple);
+		l->reftag_mask = 0xffffffff;
+
+		break;
+
+	case NVME_PI_FORMAT_64B:
+		if (ns->sts) {
+			log_debug("storage tags are not supported\n");
+
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		tuple_size = sizeof(struct nvme_crc64_pi_tuple);
+		l->reftag_mask = 0xffffffffffff;
+
+		break;
+
+	default:
+		log_debug("unsupported protection information format %u\n", ns->pif);
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (ns->ms < tuple_size || (!ns->extended && !pi->meta)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	l->bs = 1ULL << ns->lbads;
+	l->tuple_ofst = ns->pi_first ? 0 : ns->ms - tuple_size;
+
+	if (ns->extended) {
+		l->data_stride = l->meta_stride = l->bs + ns->ms;
+		l->meta = (unsigned char *)pi->data + l->bs;
+	} else {
+		l->data_stride = l->bs;
+		l->meta_stride = ns->ms;
+		l->meta = pi->meta;
+	}
+
+	return 0;
+}
+
+static inline uint64_t pi_reftag(struct nvme_pi *pi, struct pi_layout *l, uint32_t i)
+{
+	/* type 3 reference tags are opaque */
+	if (pi->ns->pi == 3)
+		return pi->reftag & l->reftag_mask;
+
+	return (pi->reftag + i) & l->reftag_mask;
+}
+
+/* the guard covers the data and any metadata bytes preceding the tuple */
+static inline uint16_t pi_guard16(struct pi_layout *l, const unsigned char *data,
+				  const unsigned char *meta)
+{
+	return crc16_t10dif(crc16_t10dif(0, data, l->bs), meta, l->tuple_ofst);
+}
+
+static inline uint64_t pi_guard64(struct pi_layout *l, const unsigned char *data,
+				  const unsigned char *meta)
+{
+	return __nvme_crc64_fn(__nvme_crc64_fn(~0ULL, data, l->bs), meta, l->tuple_ofst) ^ ~0ULL;
+}
+
+static inline void pi_put48(uint8_t *p, uint64_t v)
+{
+	for (int i = 5; i >= 0; i--, v >>= 8)
+		p[i] = (uint8_t)v;
+}
+
+static inline uint64_t pi_get48(const uint8_t *p)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < 6; i++)
+		v = v << 8 | p[i];
+
+	return v;
+}
+
+int nvme_pi_generate(struct nvme_pi *pi)
+{
+	struct pi_layout l;
+
+	if (pi_layout(pi, &l))
+		return -1;
+
+	for (uint32_t i = 0; i < pi->nlb; i++) {
+		unsigned char *data = (unsigned char *)pi->data + i * l.data_stride;
+		unsigned char *meta = l.meta + i * l.meta_stride;
+		void *tuple = meta + l.tuple_ofst;
+
+		if (pi->ns->pif == NVME_PI_FORMAT_16B) {
+			struct nvme_crc16_pi_tuple t = {
+				.guard = cpu_to_be16(pi_guard16(&l, data, meta)),
+				.apptag = cpu_to_be16(pi->apptag),
+				.reftag = cpu_to_be32((uint32_t)pi_reftag(pi, &l, i)),
+			};
+
+			memcpy(tuple, &t, sizeof(t));
+		} else {
+			struct nvme_crc64_pi_tuple t = {
+				.guard = cpu_to_be64(pi_guard64(&l, data, meta)),
+				.apptag = cpu_to_be16(pi->apptag),
+			};
+
+			pi_put48(t.sr, pi_reftag(pi, &l, i));
+
+			memcpy(tuple, &t, sizeof(t));
+		}
+	}
+
+	return 0;
+}
+
+int nvme_pi_verify(struct nvme_pi *pi)
+{
+	struct pi_layout l;
+
+	if (pi_layout(pi, &l))
+		return -1;
+
+	for (uint32_t i = 0; i < pi->nlb; i++) {
+		unsigned char *data = (unsigned char *)pi->data + i * l.data_stride;
+		unsigned char *meta = l.meta + i * l.meta_stride;
+		void *tuple = meta + l.tuple_ofst;
+		uint64_t reftag;
+		uint16_t apptag;
+		bool guard_ok;
+
+		if (pi->ns->pif == NVME_PI_FORMAT_16B) {
+			struct nvme_crc16_pi_tuple t;
+
+			memcpy(&t, tuple, sizeof(t));
+
+			apptag = be16_to_cpu(t.apptag);
+			reftag = be32_to_cpu(t.reftag);
+
+			guard_ok = !(pi->checks & NVME_PI_CHECK_GUARD) ||
+				be16_to_cpu(t.guard) == pi_guard16(&l, data, meta);
+		} else {
+			struct nvme_crc64_pi_tuple t;
+
+			memcpy(&t, tuple, sizeof(t));
+
+			apptag = be16_to_cpu(t.apptag);
+			reftag = pi_get48(t.sr);
+
+			guard_ok = !(pi->checks & NVME_PI_CHECK_GUARD) ||
+				be64_to_cpu(t.guard) == pi_guard64(&l, data, meta);
+		}
+
+		/* escape values disable checking of the logical block */
+		if (apptag == 0xffff && (pi->ns->pi != 3 || reftag == l.reftag_mask))
+			continue;
+
+		if (!guard_ok)
+			pi->err = NVME_PI_CHECK_GUARD;
+		else if (pi->checks & NVME_PI_CHECK_APP && (apptag ^ pi->apptag) & pi->appmask)
+			pi->err = NVME_PI_CHECK_APP;
+		else if (pi->checks & NVME_PI_CHECK_REF && reftag != pi_reftag(pi, &l, i))
+			pi->err = NVME_PI_CHECK_REF;
+		else
+			continue;
+
+		pi->err_block = i;
+
+		errno = EILSEQ;
+		return -1;
+	}
+
+	return 0;
+}
+
+void nvme_pi_prep_rw(struct nvme_pi *pi, union nvme_cmd *cmd)
+{
+	uint16_t control = le16_to_cpu(cmd->rw.control);
+
+	cmd->rw.control = cpu_to_le16((uint16_t)(control | pi->checks << 10));
+
+	cmd->rw.reftag = cpu_to_le32((uint32_t)pi->reftag);
+	cmd->rw.apptag = cpu_to_le16(pi->apptag);
+	cmd->rw.appmask = cpu_to_le16(pi->appmask);
+
+	/* the upper bits of the 48b reference tag */
+	if (pi->ns->pif == NVME_PI_FORMAT_64B)
+		cmd->rw.cdw3 = cpu_to_le32((uint32_t)(pi->reftag >> 32) & 0xffff);
+}
+
+bool nvme_pi_complete(struct nvme_pi *pi, struct nvme_cqe *cqe)
+{
+	uint16_t status;
+
+	if (!nvme_cqe_ok(cqe))
+		return false;
+
+	if (!nvme_pi_verify(pi))
+		return true;
+
+	if (errno != EILSEQ)
+		status = NVME_SC_INVALID_FIELD;
+	else if (pi->err == NVME_PI_CHECK_GUARD)
+		status = NVME_SC_GUARD_CHECK;
+	else if (pi->err == NVME_PI_CHECK_APP)
+		status = NVME_SC_APPTAG_CHECK;
+	else
+		status = NVME_SC_REFTAG_CHECK;
+
+	/* keep the phase tag */
+	cqe->sfp = cpu_to_le16((uint16_t)((le16_to_cpu(cqe->sfp) & 0x1) | status << 1));
+
+	return false;
+}
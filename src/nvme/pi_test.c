@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ccan/tap/tap.h"
+
+#include <vfn/nvme.h>
+
+#include "types.h"
+
+#define NLB 4
+#define LBASZ 4096
+
+static unsigned char data[NLB * (LBASZ + 16)];
+static unsigned char meta[NLB * 16];
+
+static struct nvme_ns ns16 = {
+	.nsid = 1, .lbads = 12, .ms = 8, .extended = true, .pi = 1,
+	.pif = NVME_PI_FORMAT_16B,
+};
+
+static struct nvme_ns ns64 = {
+	.nsid = 2, .lbads = 12, .ms = 16, .pi = 1, .pif = NVME_PI_FORMAT_64B,
+};
+
+static void test_crc16(void)
+{
+	struct nvme_pi pi = {
+		.ns = &ns16, .data = data, .nlb = NLB, .reftag = 0x12345678,
+		.apptag = 0xabcd, .appmask = 0xffff,
+		.checks = NVME_PI_CHECK_GUARD | NVME_PI_CHECK_APP | NVME_PI_CHECK_REF,
+	};
+	struct nvme_crc16_pi_tuple t;
+
+	memset(data, 0xff, sizeof(data));
+
+	ok1(nvme_pi_generate(&pi) == 0);
+
+	/* the tuple of the second block follows its data */
+	memcpy(&t, data + (LBASZ + 8) + LBASZ, sizeof(t));
+
+	ok1(be16_to_cpu(t.guard) == 0x8b5d);
+	ok1(be16_to_cpu(t.apptag) == 0xabcd);
+	ok1(be32_to_cpu(t.reftag) == 0x12345679);
+
+	ok1(nvme_pi_verify(&pi) == 0);
+
+	data[2 * (LBASZ + 8) + 17] ^= 0x1;
+	ok1(nvme_pi_verify(&pi) == -1 && errno == EILSEQ);
+	ok1(pi.err == NVME_PI_CHECK_GUARD && pi.err_block == 2);
+	data[2 * (LBASZ + 8) + 17] ^= 0x1;
+
+	pi.apptag = 0xabce;
+	ok1(nvme_pi_verify(&pi) == -1 && pi.err == NVME_PI_CHECK_APP && pi.err_block == 0);
+
+	/* only the masked bits are checked */
+	pi.appmask = 0xfff0;
+	ok1(nvme_pi_verify(&pi) == 0);
+
+	pi.reftag++;
+	ok1(nvme_pi_verify(&pi) == -1 && pi.err == NVME_PI_CHECK_REF && pi.err_block == 0);
+
+	pi.checks &= ~NVME_PI_CHECK_REF;
+	ok1(nvme_pi_verify(&pi) == 0);
+}
+
+static void test_crc64(void)
+{
+	struct nvme_pi pi = {
+		.ns = &ns64, .data = data, .meta = meta, .nlb = NLB, .reftag = 0xfedcba987654,
+		.checks = NVME_PI_CHECK_GUARD | NVME_PI_CHECK_REF,
+	};
+	struct nvme_crc64_pi_tuple t;
+
+	memset(data, 0x0, sizeof(data));
+
+	ok1(nvme_pi_generate(&pi) == 0);
+
+	memcpy(&t, meta, sizeof(t));
+
+	/* the guard of 4KiB of zeroes (from the NVMe specification) */
+	ok1(be64_to_cpu(t.guard) == 0x6482d367eb22b64eULL);
+	ok1(t.sr[0] == 0xfe && t.sr[5] == 0x54);
+
+	/* the reference tag is incremented for each block */
+	memcpy(&t, meta + 3 * 16, sizeof(t));
+	ok1(t.sr[5] == 0x57);
+
+	ok1(nvme_pi_verify(&pi) == 0);
+
+	data[LBASZ * 3 + 100] = 0x1;
+	ok1(nvme_pi_verify(&pi) == -1 && pi.err == NVME_PI_CHECK_GUARD && pi.err_block == 3);
+
+	/* an application tag of 0xffff disables checking */
+	memcpy(&t, meta + 3 * 16, sizeof(t));
+	t.apptag = cpu_to_be16(0xffff);
+	memcpy(meta + 3 * 16, &t, sizeof(t));
+
+	ok1(nvme_pi_verify(&pi) == 0);
+}
+
+static void test_invalid(void)
+{
+	struct nvme_ns ns = ns64;
+	struct nvme_pi pi = { .ns = &ns, .data = data, .meta = meta, .nlb = 1 };
+
+	ns.sts = 8;
+	ok1(nvme_pi_generate(&pi) == -1 && errno == ENOTSUP);
+
+	ns.sts = 0;
+	ns.pif = NVME_PI_FORMAT_32B;
+	ok1(nvme_pi_generate(&pi) == -1 && errno == ENOTSUP);
+
+	ns.pif = NVME_PI_FORMAT_64B;
+	ns.ms = 8;
+	ok1(nvme_pi_generate(&pi) == -1 && errno == EINVAL);
+
+	ns.ms = 16;
+	ns.pi = 0;
+	ok1(nvme_pi_verify(&pi) == -1 && errno == EINVAL);
+}
+
+static void test_complete(void)
+{
+	struct nvme_pi pi = {
+		.ns = &ns64, .data = data, .meta = meta, .nlb = 1, .reftag = 7,
+		.checks = NVME_PI_CHECK_REF,
+	};
+	struct nvme_cqe cqe = { .sfp = cpu_to_le16(0x1) };
+
+	memset(meta, 0x0, sizeof(meta));
+
+	ok1(!nvme_pi_complete(&pi, &cqe));
+	ok1(le16_to_cpu(cqe.sfp) == (NVME_SC_REFTAG_CHECK << 1 | 0x1));
+
+	/* failed commands are not verified */
+	cqe.sfp = cpu_to_le16(0x4 << 1);
+	ok1(!nvme_pi_complete(&pi, &cqe) && le16_to_cpu(cqe.sfp) == 0x4 << 1);
+
+	ok1(nvme_pi_generate(&pi) == 0);
+
+	cqe.sfp = 0;
+	ok1(nvme_pi_complete(&pi, &cqe) && cqe.sfp == 0);
+}
+
+int main(void)
+{
+	plan_tests(27);
+
+	test_crc16();
+	test_crc64();
+	test_invalid();
+	test_complete();
+
+	return exit_status();
+}
@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/pmr: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+#include "ccan/time/time.h"
+
+#include "types.h"
+
+#define NVME_PMR_POLL_USEC 1000
+
+static int nvme_pmr_wait_rdy(struct nvme_ctrl *ctrl, uint32_t pmrcap)
+{
+	unsigned long unit_ms, timeout_ms;
+	struct timeabs deadline;
+	uint32_t pmrsts;
+
+	unit_ms = NVME_FIELD_GET(pmrcap, PMRCAP_PMRTU) == NVME_PMRTU_MINUTES ? 60000 : 500;
+	timeout_ms = unit_ms * max_t(unsigned long, NVME_FIELD_GET(pmrcap, PMRCAP_PMRTO), 1);
+
+	deadline = timeabs_add(time_now(), time_from_msec(timeout_ms));
+
+	for (;;) {
+		pmrsts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_PMRSTS));
+
+		if (NVME_FIELD_GET(pmrsts, PMRSTS_ERR) || NVME_FIELD_GET(pmrsts, PMRSTS_HSTS)) {
+			log_debug("pmr error (pmrsts 0x%x)\n", pmrsts);
+
+			errno = EIO;
+			return -1;
+		}
+
+		if (!NVME_FIELD_GET(pmrsts, PMRSTS_NRDY))
+			return 0;
+
+		if (time_after(time_now(), deadline)) {
+			log_debug("timed out\n");
+
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		__usleep(NVME_PMR_POLL_USEC);
+	}
+}
+
+int nvme_pmr_enable(struct nvme_ctrl *ctrl)
+{
+	uint32_t pmrcap;
+	uint64_t cap;
+
+	if (ctrl->pmr.vaddr)
+		return 0;
+
+	cap = ctrl->reg.cap;
+	if (!NVME_FIELD_GET(cap, CAP_PMRS)) {
+		log_debug("controller has no pmr\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	pmrcap = ctrl->reg.pmrcap;
+
+	ctrl->pmr.wbm = NVME_FIELD_GET(pmrcap, PMRCAP_PMRWBM);
+	if (!(ctrl->pmr.wbm & (NVME_PMRWBM_READ_PMR | NVME_PMRWBM_READ_PMRSTS))) {
+		log_debug("no supported pmr write barrier mechanism\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	ctrl->pmr.bir = NVME_FIELD_GET(pmrcap, PMRCAP_BIR);
+	ctrl->pmr.len = ctrl->pci.bar_region_info[ctrl->pmr.bir].size;
+
+	mmio_write32(ctrl->regs + NVME_REG_PMRCTL, cpu_to_le32(NVME_PMRCTL_EN));
+
+	if (nvme_pmr_wait_rdy(ctrl, pmrcap))
+		goto disable;
+
+	/* the pmr spans the entire bar */
+	ctrl->pmr.vaddr = vfio_pci_map_bar_wc(&ctrl->pci, ctrl->pmr.bir, ctrl->pmr.len, 0,
+					      PROT_READ | PROT_WRITE);
+	if (!ctrl->pmr.vaddr) {
+		log_debug("could not map pmr\n");
+		goto disable;
+	}
+
+	return 0;
+
+disable:
+	mmio_write32(ctrl->regs + NVME_REG_PMRCTL, cpu_to_le32(0));
+
+	return -1;
+}
+
+void nvme_pmr_persist(struct nvme_ctrl *ctrl)
+{
+	/* drain write-combining buffers and order the stores before the read */
+	mb();
+
+	/* the read completes only when prior writes are persistent */
+	if (ctrl->pmr.wbm & NVME_PMRWBM_READ_PMRSTS)
+		mmio_read32(ctrl->regs + NVME_REG_PMRSTS);
+	else
+		mmio_read32(ctrl->pmr.vaddr);
+}
+
+void nvme_pmr_disable(struct nvme_ctrl *ctrl)
+{
+	if (!ctrl->pmr.vaddr)
+		return;
+
+	vfio_pci_unmap_bar(&ctrl->pci, ctrl->pmr.bir, ctrl->pmr.vaddr, ctrl->pmr.len, 0);
+
+	mmio_write32(ctrl->regs + NVME_REG_PMRCTL, cpu_to_le32(0));
+
+	memset(&ctrl->pmr, 0x0, sizeof(ctrl->pmr));
+}
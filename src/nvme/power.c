@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/power: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+int nvme_get_power_states(struct nvme_ctrl *ctrl, const struct nvme_psd **psds)
+{
+	*psds = ctrl->power.psds;
+
+	return ctrl->power.npsds;
+}
+
+int nvme_apst_build(const struct nvme_psd *psds, int n, uint32_t max_latency_us,
+		    struct nvme_apst_entry table[NVME_APST_ENTRIES])
+{
+	struct nvme_apst_entry target = {};
+	int nentries = 0;
+
+	memset(table, 0x0, NVME_APST_ENTRIES * sizeof(*table));
+
+	/* from the deepest state up; each state steps down to the next acceptable one */
+	for (int ps = min(n, NVME_APST_ENTRIES) - 1; ps >= 0; ps--) {
+		uint64_t latency_us;
+
+		if (target.itpt_ms) {
+			table[ps] = target;
+			nentries++;
+		}
+
+		if (!psds[ps].nonop || psds[ps].exlat_us > max_latency_us)
+			continue;
+
+		latency_us = (uint64_t)psds[ps].enlat_us + psds[ps].exlat_us;
+
+		target = (struct nvme_apst_entry) {
+			.itps = (uint8_t)ps,
+			.itpt_ms = (uint32_t)clamp_t(uint64_t, (latency_us + 19) / 20, 1,
+						     NVME_FEAT_APST_ITPT_MASK),
+		};
+	}
+
+	return nentries;
+}
+
+static int __set_apst(struct nvme_ctrl *ctrl, const struct nvme_apst_entry *table, bool enable)
+{
+	leint64_t data[NVME_APST_ENTRIES] = {};
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+
+	for (int i = 0; i < NVME_APST_ENTRIES; i++)
+		data[i] = cpu_to_le64(NVME_FIELD_SET((uint64_t)table[i].itps, FEAT_APST_ITPS) |
+				      NVME_FIELD_SET((uint64_t)table[i].itpt_ms, FEAT_APST_ITPT));
+
+	cmd.features.fid = NVME_FEAT_FID_APST;
+	cmd.features.cdw11 = cpu_to_le32(NVME_FIELD_SET(enable ? 1 : 0, FEAT_APST_APSTE));
+
+	return nvme_admin(ctrl, &cmd, data, sizeof(data), NULL);
+}
+
+int nvme_set_apst(struct nvme_ctrl *ctrl, uint32_t max_latency_us)
+{
+	struct nvme_apst_entry table[NVME_APST_ENTRIES];
+	int n;
+
+	if (!ctrl->power.apsta) {
+		log_debug("autonomous power state transitions not supported\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	n = nvme_apst_build(ctrl->power.psds, ctrl->power.npsds, max_latency_us, table);
+	if (!n)
+		log_info("no power state with an exit latency of at most %" PRIu32 " us\n",
+			 max_latency_us);
+
+	return __set_apst(ctrl, table, n > 0);
+}
+
+int nvme_set_power_state(struct nvme_ctrl *ctrl, uint8_t ps)
+{
+	struct nvme_apst_entry table[NVME_APST_ENTRIES] = {};
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+
+	if (ps >= ctrl->power.npsds) {
+		log_debug("power state %" PRIu8 " invalid; max is %d\n", ps, ctrl->power.npsds - 1);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* otherwise, the controller is free to leave the state when idle */
+	if (ctrl->power.apsta && __set_apst(ctrl, table, false))
+		return -1;
+
+	cmd.features.fid = NVME_FEAT_FID_POWER_MGMT;
+	cmd.features.cdw11 = cpu_to_le32(NVME_FIELD_SET(ps, FEAT_PM_PS));
+
+	return nvme_admin(ctrl, &cmd, NULL, 0, NULL);
+}
+
+int nvme_set_power_policy(struct nvme_ctrl *ctrl, const struct nvme_power_opts *opts)
+{
+	switch (opts->policy) {
+	case NVME_POWER_DEFAULT:
+		return 0;
+	case NVME_POWER_APST:
+		return nvme_set_apst(ctrl, opts->max_latency_us);
+	case NVME_POWER_PIN:
+		return nvme_set_power_state(ctrl, opts->ps);
+	default:
+		break;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+int nvme_get_power_info(struct nvme_ctrl *ctrl, struct nvme_power_info *info)
+{
+	leint64_t data[NVME_APST_ENTRIES];
+	struct nvme_cqe cqe;
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_GET_FEATURES,
+	};
+
+	memset(info, 0x0, sizeof(*info));
+
+	cmd.features.fid = NVME_FEAT_FID_POWER_MGMT;
+
+	if (nvme_admin(ctrl, &cmd, NULL, 0, &cqe))
+		return -1;
+
+	info->ps = (uint8_t)NVME_FIELD_GET(le32_to_cpu(cqe.dw0), FEAT_PM_PS);
+
+	if (!ctrl->power.apsta)
+		return 0;
+
+	cmd = (union nvme_cmd) {
+		.opcode = NVME_ADMIN_GET_FEATURES,
+	};
+
+	cmd.features.fid = NVME_FEAT_FID_APST;
+
+	if (nvme_admin(ctrl, &cmd, data, sizeof(data), &cqe))
+		return -1;
+
+	info->apste = NVME_FIELD_GET(le32_to_cpu(cqe.dw0), FEAT_APST_APSTE);
+
+	for (int i = 0; i < NVME_APST_ENTRIES; i++) {
+		uint64_t v = le64_to_cpu(data[i]);
+
+		info->apst[i] = (struct nvme_apst_entry) {
+			.itps = (uint8_t)NVME_FIELD_GET(v, FEAT_APST_ITPS),
+			.itpt_ms = (uint32_t)NVME_FIELD_GET(v, FEAT_APST_ITPT),
+		};
+	}
+
+	return 0;
+}
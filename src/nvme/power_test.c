@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "power.c"
+
+static union nvme_cmd admin[4];
+static leint64_t apst[NVME_APST_ENTRIES];
+static int nadmin;
+
+int nvme_admin(struct nvme_ctrl *ctrl UNUSED, union nvme_cmd *sqe, void *buf, size_t len,
+	       struct nvme_cqe *cqe_copy)
+{
+	admin[nadmin++] = *sqe;
+
+	if (sqe->opcode == NVME_ADMIN_SET_FEATURES && buf)
+		memcpy(apst, buf, len);
+
+	if (sqe->opcode == NVME_ADMIN_GET_FEATURES) {
+		/* the controller is in power state 3 with transitions enabled */
+		uint32_t dw0 = sqe->features.fid == NVME_FEAT_FID_POWER_MGMT ? 3 : 1;
+
+		*cqe_copy = (struct nvme_cqe) { .dw0 = cpu_to_le32(dw0) };
+
+		if (buf)
+			memcpy(buf, apst, len);
+	}
+
+	return 0;
+}
+
+static const struct nvme_psd psds[] = {
+	{ .mp_uw = 8000000, .enlat_us = 0,     .exlat_us = 0 },
+	{ .mp_uw = 6000000, .enlat_us = 0,     .exlat_us = 0 },
+	{ .mp_uw = 4000000, .enlat_us = 0,     .exlat_us = 0 },
+	{ .mp_uw = 50000,   .enlat_us = 2000,  .exlat_us = 2000,  .nonop = true },
+	{ .mp_uw = 5000,    .enlat_us = 10000, .exlat_us = 40000, .nonop = true },
+};
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {};
+	struct nvme_apst_entry table[NVME_APST_ENTRIES];
+	struct nvme_power_info info;
+
+	plan_tests(17);
+
+	/* states step down to the next acceptable non-operational state */
+	ok1(nvme_apst_build(psds, 5, 100000, table) == 4);
+	ok1(table[0].itps == 3 && table[0].itpt_ms == 200 && table[2].itps == 3);
+	ok1(table[3].itps == 4 && table[3].itpt_ms == 2500 && !table[4].itpt_ms);
+
+	/* the deepest state exits too slowly */
+	ok1(nvme_apst_build(psds, 5, 5000, table) == 3);
+	ok1(table[2].itps == 3 && !table[3].itpt_ms && !table[4].itpt_ms);
+
+	ok1(nvme_apst_build(psds, 5, 100, table) == 0);
+
+	ctrl.power.psds = (struct nvme_psd *)psds;
+	ctrl.power.npsds = 5;
+
+	ok1(nvme_set_apst(&ctrl, 5000) == -1 && errno == ENOTSUP && !nadmin);
+
+	ctrl.power.apsta = true;
+
+	ok1(nvme_set_apst(&ctrl, 5000) == 0 && nadmin == 1);
+	ok1(admin[0].features.fid == NVME_FEAT_FID_APST &&
+	    le32_to_cpu(admin[0].features.cdw11) == 1);
+	ok1(le64_to_cpu(apst[0]) == (3 << 3 | 200 << 8) && !apst[3]);
+
+	/* no acceptable state disables the transitions */
+	nadmin = 0;
+
+	ok1(nvme_set_apst(&ctrl, 100) == 0 && !le32_to_cpu(admin[0].features.cdw11));
+
+	/* pinning disables the transitions first */
+	nadmin = 0;
+
+	ok1(nvme_set_power_state(&ctrl, 5) == -1 && errno == EINVAL && !nadmin);
+	ok1(nvme_set_power_state(&ctrl, 1) == 0 && nadmin == 2);
+	ok1(admin[0].features.fid == NVME_FEAT_FID_APST && !le32_to_cpu(admin[0].features.cdw11));
+	ok1(admin[1].features.fid == NVME_FEAT_FID_POWER_MGMT &&
+	    le32_to_cpu(admin[1].features.cdw11) == 1);
+
+	/* the current configuration is read back */
+	nvme_set_apst(&ctrl, 100000);
+	nadmin = 0;
+
+	ok1(nvme_get_power_info(&ctrl, &info) == 0 && nadmin == 2);
+	ok1(info.ps == 3 && info.apste && info.apst[3].itps == 4 && info.apst[3].itpt_ms == 2500);
+
+	return exit_status();
+}
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/prpfill: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+#include <vfn/support/atomic.h>
+#include <vfn/support/compiler.h>
+#include <vfn/support/endian.h>
+#include <vfn/support/log.h>
+
+#include "ccan/array_size/array_size.h"
+
+#include "prpfill.h"
+
+static void prp_fill_scalar(leint64_t *prps, uint64_t iova, int pageshift, int n)
+{
+	for (int i = 0; i < n; i++)
+		prps[i] = cpu_to_le64(iova + ((uint64_t)i << pageshift));
+}
+
+static bool prp_fill_always_supported(void)
+{
+	return true;
+}
+
+/*
+ * The vector fillers keep a vector of consecutive page addresses and advance
+ * all lanes by the vector width (in pages) on each store. They rely on the
+ * host being little endian, such that no byte swapping is required.
+ */
+#if defined(__x86_64__)
+static void prp_fill_sse2(leint64_t *prps, uint64_t iova, int pageshift, int n)
+{
+	uint64_t pagesize = 1ULL << pageshift;
+	__m128i addr = _mm_set_epi64x((long long)(iova + pagesize), (long long)iova);
+	__m128i step = _mm_set1_epi64x((long long)(pagesize << 1));
+	int i = 0;
+
+	for (; i + 2 <= n; i += 2) {
+		_mm_storeu_si128((__m128i *)&prps[i], addr);
+		addr = _mm_add_epi64(addr, step);
+	}
+
+	prp_fill_scalar(&prps[i], iova + ((uint64_t)i << pageshift), pageshift, n - i);
+}
+
+static __attribute__((target("avx2"))) void prp_fill_avx2(leint64_t *prps, uint64_t iova,
+							   int pageshift, int n)
+{
+	uint64_t pagesize = 1ULL << pageshift;
+	__m256i addr = _mm256_add_epi64(_mm256_set1_epi64x((long long)iova),
+					_mm256_setr_epi64x(0, (long long)pagesize,
+							   (long long)(pagesize << 1),
+							   (long long)(pagesize * 3)));
+	__m256i step = _mm256_set1_epi64x((long long)(pagesize << 2));
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		_mm256_storeu_si256((__m256i *)&prps[i], addr);
+		addr = _mm256_add_epi64(addr, step);
+	}
+
+	prp_fill_sse2(&prps[i], iova + ((uint64_t)i << pageshift), pageshift, n - i);
+}
+
+static bool prp_fill_avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static __attribute__((target("avx512f"))) void prp_fill_avx512(leint64_t *prps, uint64_t iova,
+								int pageshift, int n)
+{
+	const __m512i lanes = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+	uint64_t pagesize = 1ULL << pageshift;
+	__m512i addr, step;
+	int i = 0;
+
+	addr = _mm512_add_epi64(_mm512_set1_epi64((long long)iova),
+				_mm512_sll_epi64(lanes, _mm_cvtsi32_si128(pageshift)));
+	step = _mm512_set1_epi64((long long)(pagesize << 3));
+
+	for (; i + 8 <= n; i += 8) {
+		_mm512_storeu_si512((void *)&prps[i], addr);
+		addr = _mm512_add_epi64(addr, step);
+	}
+
+	/* masked store of the remainder */
+	if (i < n)
+		_mm512_mask_storeu_epi64((void *)&prps[i], (__mmask8)((1u << (n - i)) - 1), addr);
+}
+
+static bool prp_fill_avx512_supported(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static void prp_fill_neon(leint64_t *prps, uint64_t iova, int pageshift, int n)
+{
+	uint64_t pagesize = 1ULL << pageshift;
+	uint64x2_t addr = vcombine_u64(vcreate_u64(iova), vcreate_u64(iova + pagesize));
+	uint64x2_t step = vdupq_n_u64(pagesize << 1);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		vst1q_u64((uint64_t *)&prps[i], addr);
+		addr = vaddq_u64(addr, step);
+		vst1q_u64((uint64_t *)&prps[i + 2], addr);
+		addr = vaddq_u64(addr, step);
+	}
+
+	prp_fill_scalar(&prps[i], iova + ((uint64_t)i << pageshift), pageshift, n - i);
+}
+#endif
+
+/* ordered by preference */
+const struct nvme_prp_fill_backend nvme_prp_fill_backends[] = {
+#if defined(__x86_64__)
+	{"avx512", prp_fill_avx512, prp_fill_avx512_supported},
+	{"avx2", prp_fill_avx2, prp_fill_avx2_supported},
+	{"sse2", prp_fill_sse2, prp_fill_always_supported},
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	{"neon", prp_fill_neon, prp_fill_always_supported},
+#endif
+	{"scalar", prp_fill_scalar, prp_fill_always_supported},
+};
+
+const int nvme_prp_fill_nbackends = ARRAY_SIZE(nvme_prp_fill_backends);
+
+nvme_prp_fill_fn __nvme_prp_fill_fn = prp_fill_scalar;
+
+static void __attribute__((constructor)) init_prp_fill(void)
+{
+	const char *name = getenv("VFN_PRP_FILL");
+
+	for (int i = 0; i < nvme_prp_fill_nbackends; i++) {
+		const struct nvme_prp_fill_backend *b = &nvme_prp_fill_backends[i];
+
+		if (name && strcmp(name, b->name))
+			continue;
+
+		if (!b->supported())
+			continue;
+
+		log_debug("using %s prp list filler\n", b->name);
+
+		__nvme_prp_fill_fn = b->fill;
+
+		return;
+	}
+
+	log_debug("no matching prp list filler; using scalar\n");
+}
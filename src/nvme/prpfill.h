@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * A prp list filler stores the @n page addresses starting at @iova, in steps of
+ * (1 << @pageshift), into @prps.
+ */
+typedef void (*nvme_prp_fill_fn)(leint64_t *prps, uint64_t iova, int pageshift, int n);
+
+struct nvme_prp_fill_backend {
+	const char *name;
+	nvme_prp_fill_fn fill;
+	bool (*supported)(void);
+};
+
+extern const struct nvme_prp_fill_backend nvme_prp_fill_backends[];
+extern const int nvme_prp_fill_nbackends;
+
+extern nvme_prp_fill_fn __nvme_prp_fill_fn;
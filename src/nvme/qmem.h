@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Look up the shared queue memory region (see NVME_IOSQ_F_SHARED) that @vaddr
+ * was carved from; on success, @fd is the memfd backing the region and
+ * @offset is the offset of @vaddr in it. Fails with EINVAL if @vaddr is not in
+ * a shared region.
+ */
+int nvme_queue_mem_find(struct nvme_ctrl *ctrl, void *vaddr, int *fd, size_t *offset);
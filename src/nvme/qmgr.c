@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/qmgr: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+#include "ccan/time/time.h"
+
+int nvme_qmgr_init(struct nvme_qmgr *qmgr, struct nvme_ctrl *ctrl, int qsize,
+		   unsigned long flags)
+{
+	if (qsize < 2) {
+		log_debug("qsize must be at least 2\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(qmgr, 0x0, sizeof(*qmgr));
+
+	qmgr->ctrl = ctrl;
+	qmgr->qsize = qsize;
+	qmgr->flags = flags;
+
+	/* the number of queues granted is zero-based */
+	qmgr->maxqid = min_t(int, ctrl->config.nsqa, ctrl->config.ncqa) + 1;
+	qmgr->managed = znew_t(bool, qmgr->maxqid + 1);
+
+	nvme_queue_mem_recycle(ctrl, true);
+
+	return 0;
+}
+
+void nvme_qmgr_destroy(struct nvme_qmgr *qmgr)
+{
+	for (int qid = 1; qid <= qmgr->maxqid; qid++) {
+		if (!qmgr->managed[qid])
+			continue;
+
+		if (nvme_delete_ioqpair(qmgr->ctrl, qid))
+			log_debug("could not delete queue pair %d\n", qid);
+	}
+
+	nvme_queue_mem_recycle(qmgr->ctrl, false);
+
+	free(qmgr->managed);
+
+	memset(qmgr, 0x0, sizeof(*qmgr));
+}
+
+struct nvme_sq *nvme_qmgr_grow(struct nvme_qmgr *qmgr)
+{
+	struct nvme_ctrl *ctrl = qmgr->ctrl;
+
+	for (int qid = 1; qid <= qmgr->maxqid; qid++) {
+		if (ctrl->sq[qid].vaddr || ctrl->cq[qid].vaddr)
+			continue;
+
+		if (nvme_create_ioqpair(ctrl, qid, qmgr->qsize, -1, qmgr->flags)) {
+			log_debug("could not create queue pair %d\n", qid);
+			return NULL;
+		}
+
+		qmgr->managed[qid] = true;
+		qmgr->nqueues++;
+
+		return &ctrl->sq[qid];
+	}
+
+	errno = ENOSPC;
+	return NULL;
+}
+
+/* number of request trackers not on the free stack (the spare is never on it) */
+static int __inflight(struct nvme_sq *sq)
+{
+	struct nvme_rq *rq = __nvme_rq_top(sq, atomic_load_acquire(&sq->rq_top));
+	int nfree = 0;
+
+	for (; rq; rq = rq->rq_next)
+		nfree++;
+
+	return sq->qsize - 1 - nfree;
+}
+
+static int __drain(struct nvme_sq *sq, struct timespec *ts)
+{
+	uint64_t timeout = UINT64_MAX;
+
+	if (ts) {
+		struct timerel rel = { .ts = *ts };
+
+		timeout = get_ticks() + ns_to_ticks(time_to_nsec(rel));
+	}
+
+	while (__inflight(sq)) {
+		if (nvme_cq_process(sq->cq, sq->qsize))
+			continue;
+
+		if (get_ticks() >= timeout) {
+			log_debug("sq %d did not drain (%d in flight)\n", sq->id, __inflight(sq));
+
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int nvme_qmgr_shrink(struct nvme_qmgr *qmgr, struct nvme_sq *sq, struct timespec *ts)
+{
+	int qid = sq->id;
+
+	if (qid < 1 || qid > qmgr->maxqid || !qmgr->managed[qid] ||
+	    sq != &qmgr->ctrl->sq[qid]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__drain(sq, ts))
+		return -1;
+
+	/* still managed; the caller may try again */
+	if (nvme_delete_ioqpair(qmgr->ctrl, qid)) {
+		log_debug("could not delete queue pair %d\n", qid);
+		return -1;
+	}
+
+	qmgr->managed[qid] = false;
+	qmgr->nqueues--;
+
+	return 0;
+}
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "qmgr.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+#define NQUEUES 3
+#define QSIZE 4
+
+static struct nvme_sq sqs[NQUEUES + 1];
+static struct nvme_cq cqs[NQUEUES + 1];
+static uint32_t doorbells[2 * (NQUEUES + 1)];
+static int ncreated, ndeleted, recycle;
+static bool fail_delete;
+
+/* stand-ins for the controller; queue pairs are set up as nvme_configure_sq() does */
+int nvme_create_ioqpair(struct nvme_ctrl *ctrl UNUSED, int qid, int qsize, int vector UNUSED,
+			unsigned long flags UNUSED)
+{
+	struct nvme_sq *sq = &sqs[qid];
+	struct nvme_cq *cq = &cqs[qid];
+
+	*cq = (struct nvme_cq) {
+		.id = qid,
+		.qsize = qsize,
+		.doorbell = &doorbells[2 * qid],
+		.nsqs = NQUEUES + 1,
+		.sqs = sqs,
+	};
+
+	*sq = (struct nvme_sq) {
+		.id = qid,
+		.qsize = qsize,
+		.doorbell = &doorbells[2 * qid + 1],
+		.cq = cq,
+	};
+
+	assert(pgmap(&cq->vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sq->vaddr, __VFN_PAGESIZE) > 0);
+
+	sq->rqs = znew_t(struct nvme_rq, qsize);
+	sq->rq_top = __nvme_rq_top_set(sq, 0, &sq->rqs[qsize - 2]);
+
+	for (int i = 0; i < qsize - 1; i++) {
+		sq->rqs[i].sq = sq;
+		sq->rqs[i].cid = (uint16_t)i;
+
+		if (i > 0)
+			sq->rqs[i].rq_next = &sq->rqs[i - 1];
+	}
+
+	ncreated++;
+
+	return 0;
+}
+
+int nvme_delete_ioqpair(struct nvme_ctrl *ctrl UNUSED, int qid)
+{
+	if (fail_delete) {
+		errno = EIO;
+		return -1;
+	}
+
+	pgunmap(sqs[qid].vaddr, __VFN_PAGESIZE);
+	pgunmap(cqs[qid].vaddr, __VFN_PAGESIZE);
+	free(sqs[qid].rqs);
+
+	memset(&sqs[qid], 0x0, sizeof(sqs[qid]));
+	memset(&cqs[qid], 0x0, sizeof(cqs[qid]));
+
+	ndeleted++;
+
+	return 0;
+}
+
+void nvme_queue_mem_recycle(struct nvme_ctrl *ctrl UNUSED, bool enable)
+{
+	recycle += enable ? 1 : -1;
+}
+
+static int ncompleted;
+
+static void complete_cb(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe UNUSED, void *arg UNUSED)
+{
+	ncompleted++;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {
+		.sq = sqs,
+		.cq = cqs,
+		.config = { .nsqa = NQUEUES - 1, .ncqa = NQUEUES },
+	};
+	struct timespec ts = { .tv_nsec = 1000000 };
+	struct nvme_qmgr qmgr;
+	struct nvme_sq *sq[NQUEUES + 1];
+	struct nvme_rq *rq;
+	union nvme_cmd cmd = {};
+	struct nvme_cqe *cqe;
+
+	plan_tests(12);
+
+	ok1(nvme_qmgr_init(&qmgr, &ctrl, 1, 0x0) == -1 && errno == EINVAL);
+	ok1(nvme_qmgr_init(&qmgr, &ctrl, QSIZE, 0x0) == 0 && recycle == 1 &&
+	    qmgr.maxqid == NQUEUES);
+
+	/* queue identifiers in use are skipped */
+	sqs[2].vaddr = (void *)0x1;
+
+	sq[0] = nvme_qmgr_grow(&qmgr);
+	sq[1] = nvme_qmgr_grow(&qmgr);
+
+	ok1(sq[0] == &sqs[1] && sq[1] == &sqs[3] && qmgr.nqueues == 2);
+	ok1(!nvme_qmgr_grow(&qmgr) && errno == ENOSPC);
+
+	sqs[2].vaddr = NULL;
+
+	/* only queues created by the manager are deleted by it */
+	ok1(nvme_qmgr_shrink(&qmgr, &sqs[2], NULL) == -1 && errno == EINVAL);
+
+	/* a command in flight is completed before the queue pair is deleted */
+	rq = nvme_rq_acquire(sq[1]);
+	nvme_rq_submit(rq, &cmd, complete_cb, NULL);
+	nvme_sq_update_tail(sq[1]);
+
+	ok1(__inflight(sq[1]) == 1);
+
+	cqe = sq[1]->cq->vaddr;
+	cqe->sqid = cpu_to_le16(3);
+	cqe->cid = rq->cid;
+	cqe->sfp = cpu_to_le16(0x1);
+
+	ok1(nvme_qmgr_shrink(&qmgr, sq[1], &ts) == 0 && ncompleted == 1);
+	ok1(ndeleted == 1 && !sqs[3].vaddr && qmgr.nqueues == 1);
+
+	/* a tracker that is never released times out the drain */
+	rq = nvme_rq_acquire(sq[0]);
+
+	ok1(nvme_qmgr_shrink(&qmgr, sq[0], &ts) == -1 && errno == ETIMEDOUT &&
+	    sqs[1].vaddr && qmgr.nqueues == 1);
+
+	nvme_rq_release(rq);
+
+	/* a queue pair that could not be deleted stays managed */
+	fail_delete = true;
+
+	ok1(nvme_qmgr_shrink(&qmgr, sq[0], &ts) == -1 && errno == EIO && qmgr.managed[1] &&
+	    qmgr.nqueues == 1 && ndeleted == 1);
+
+	fail_delete = false;
+
+	/* freed identifiers are handed out again */
+	ok1(nvme_qmgr_grow(&qmgr) == &sqs[2] && qmgr.nqueues == 2);
+
+	nvme_qmgr_destroy(&qmgr);
+
+	ok1(ndeleted == 3 && ncreated == 3 && !recycle && !sqs[1].vaddr && !sqs[2].vaddr);
+
+	return exit_status();
+}
@@ -0,0 +1,314 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/qos: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/support/timer.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* keep sums of tokens and refills from overflowing */
+#define QOS_TOKENS_MAX (INT64_MAX / 2)
+
+static int64_t __tokens(uint64_t a, uint64_t b)
+{
+	uint64_t v;
+
+	if (__builtin_mul_overflow(a, b, &v) || v > QOS_TOKENS_MAX)
+		return QOS_TOKENS_MAX;
+
+	return (int64_t)v;
+}
+
+void nvme_qos_init(struct nvme_qos *qos, struct nvme_ctrl *ctrl, struct nvme_sq *sq)
+{
+	memset(qos, 0x0, sizeof(*qos));
+
+	qos->ctrl = ctrl;
+	qos->sq = sq;
+}
+
+void nvme_qos_tenant_set_limits(struct nvme_qos_tenant *t, const struct nvme_qos_limits *limits)
+{
+	struct nvme_qos_limits l = limits ? *limits : (struct nvme_qos_limits) {};
+	uint64_t burst_ns = (uint64_t)(l.burst_usec ? l.burst_usec : NVME_QOS_BURST_USEC_DEFAULT)
+		* 1000;
+
+	t->quantum = l.quantum ? l.quantum : NVME_QOS_QUANTUM_DEFAULT;
+
+	t->iops.rate = l.iops;
+	t->iops.depth = __tokens(burst_ns, l.iops);
+	t->iops.tokens = min_t(int64_t, t->iops.tokens, t->iops.depth);
+
+	t->bps.rate = l.bps;
+	t->bps.depth = __tokens(burst_ns, l.bps);
+	t->bps.tokens = min_t(int64_t, t->bps.tokens, t->bps.depth);
+}
+
+void nvme_qos_tenant_init(struct nvme_qos_tenant *t, struct nvme_qos *qos,
+			  const struct nvme_qos_limits *limits)
+{
+	memset(t, 0x0, sizeof(*t));
+
+	t->qos = qos;
+
+	nvme_qos_tenant_set_limits(t, limits);
+
+	t->iops.tokens = t->iops.depth;
+	t->bps.tokens = t->bps.depth;
+}
+
+static void __activate(struct nvme_qos *qos, struct nvme_qos_tenant *t)
+{
+	t->active = true;
+	t->next = NULL;
+
+	if (qos->tail)
+		qos->tail->next = t;
+	else
+		qos->head = t;
+
+	qos->tail = t;
+	qos->nactive++;
+}
+
+static struct nvme_qos_tenant *__pop(struct nvme_qos *qos)
+{
+	struct nvme_qos_tenant *t = qos->head;
+
+	qos->head = t->next;
+	if (!qos->head)
+		qos->tail = NULL;
+
+	t->active = false;
+	qos->nactive--;
+
+	return t;
+}
+
+void nvme_qos_enqueue(struct nvme_qos_tenant *t, struct nvme_qos_io *io)
+{
+	io->next = NULL;
+
+	if (t->tail)
+		t->tail->next = io;
+	else
+		t->head = io;
+
+	t->tail = io;
+
+	if (!t->active)
+		__activate(t->qos, t);
+}
+
+static void __refill(struct nvme_qos_tenant *t, uint64_t now)
+{
+	uint64_t elapsed = now - t->last;
+
+	t->last = now;
+
+	if (t->iops.rate)
+		t->iops.tokens = min_t(int64_t, t->iops.depth,
+				       t->iops.tokens + __tokens(elapsed, t->iops.rate));
+
+	if (t->bps.rate)
+		t->bps.tokens = min_t(int64_t, t->bps.depth,
+				      t->bps.tokens + __tokens(elapsed, t->bps.rate));
+}
+
+static inline int64_t __bps_cost(struct nvme_qos_io *io)
+{
+	return __tokens(io->len, NS_PER_SEC);
+}
+
+/*
+ * An i/o is admitted if its cost is covered, or if the bucket is full (such
+ * that i/os costing more than the depth get through); the bucket may then go
+ * into debt.
+ */
+static inline bool __admit(struct nvme_qos_tenant *t, struct nvme_qos_io *io)
+{
+	if (t->iops.rate && t->iops.tokens < min_t(int64_t, NS_PER_SEC, t->iops.depth))
+		return false;
+
+	if (t->bps.rate && t->bps.tokens < min_t(int64_t, __bps_cost(io), t->bps.depth))
+		return false;
+
+	return true;
+}
+
+static inline void __charge(struct nvme_qos_tenant *t, struct nvme_qos_io *io)
+{
+	if (t->iops.rate)
+		t->iops.tokens -= NS_PER_SEC;
+
+	if (t->bps.rate)
+		t->bps.tokens -= __bps_cost(io);
+}
+
+static void __fail(struct nvme_rq *rq, struct nvme_qos_io *io)
+{
+	struct nvme_cqe cqe = {
+		.cid = rq->cid,
+		.sfp = cpu_to_le16(NVME_SC_INVALID_FIELD << 1),
+	};
+
+	io->cb(rq, &cqe, io->opaque);
+
+	nvme_rq_release(rq);
+}
+
+/*
+ * Dispatch the i/os of the tenant at the head of the list until its deficit,
+ * its tokens, the budget or the request trackers run out. Returns the number
+ * of i/os dispatched or -1 if out of request trackers.
+ */
+static int __turn(struct nvme_qos *qos, struct nvme_qos_tenant *t, int budget)
+{
+	struct nvme_qos_io *io;
+	struct nvme_rq *rq;
+	int n = 0;
+
+	if (!t->credited) {
+		t->deficit += t->quantum;
+		t->credited = true;
+	}
+
+	while ((io = t->head) && n < budget) {
+		if (io->len > t->deficit) {
+			/* next turn */
+			t->credited = false;
+			break;
+		}
+
+		if (!__admit(t, io)) {
+			t->throttled++;
+			break;
+		}
+
+		rq = nvme_rq_acquire(qos->sq);
+		if (!rq)
+			return n ? n : -1;
+
+		t->head = io->next;
+		if (!t->head)
+			t->tail = NULL;
+
+		t->deficit -= io->len;
+		__charge(t, io);
+
+		if (io->len && nvme_rq_map(qos->ctrl, rq, &io->cmd, io->iova, io->len)) {
+			log_debug("could not map i/o\n");
+
+			__fail(rq, io);
+			continue;
+		}
+
+		nvme_rq_submit(rq, &io->cmd, io->cb, io->opaque);
+
+		t->dispatched++;
+		n++;
+	}
+
+	return n;
+}
+
+static int __dispatch(struct nvme_qos *qos, int budget, uint64_t now)
+{
+	struct nvme_qos_tenant *t, *next, *parked = NULL, **ptail = &parked;
+	int n = 0;
+
+	while (n < budget && qos->head) {
+		int ret;
+
+		t = qos->head;
+
+		__refill(t, now);
+
+		ret = __turn(qos, t, budget - n);
+		if (ret < 0)
+			break;
+
+		n += ret;
+
+		if (!t->head) {
+			/* an idle tenant does not keep its deficit */
+			t->deficit = 0;
+			t->credited = false;
+
+			__pop(qos);
+
+			continue;
+		}
+
+		/* rate limited; skip the tenant for the rest of the batch */
+		if (!__admit(t, t->head)) {
+			*ptail = __pop(qos);
+			ptail = &t->next;
+			t->next = NULL;
+
+			/* not to be activated by nvme_qos_enqueue() meanwhile */
+			t->active = true;
+
+			continue;
+		}
+
+		/* budget exhausted mid-turn; the tenant continues next time */
+		if (n == budget && t->credited)
+			break;
+
+		__activate(qos, __pop(qos));
+	}
+
+	for (t = parked; t; t = next) {
+		next = t->next;
+
+		__activate(qos, t);
+	}
+
+	if (n) {
+		qos->dispatched += (uint64_t)n;
+		qos->batches++;
+
+		nvme_sq_update_tail(qos->sq);
+	}
+
+	return n;
+}
+
+int nvme_qos_dispatch(struct nvme_qos *qos, int budget)
+{
+	return __dispatch(qos, budget, ticks_to_ns(get_ticks()));
+}
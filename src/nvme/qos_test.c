@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/* count doorbell writes regardless of the build configuration */
+#define NVME_QSTATS
+
+#include "ccan/tap/tap.h"
+
+#include "qos.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+#define SQSIZE 8
+#define CQSIZE 64
+
+static uint32_t sqdb, cqdb;
+static struct nvme_sq sqs[2];
+static struct nvme_cq cq;
+static struct nvme_rq rqs[SQSIZE - 1];
+static uint16_t cqtail, sqhead;
+
+static int ncompleted[3];
+
+/* order of dispatch, by tenant */
+static int order[16];
+
+static void complete_cb(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe UNUSED, void *arg)
+{
+	ncompleted[(int)(uintptr_t)arg]++;
+}
+
+/* complete all posted commands */
+static int complete_all(void)
+{
+	union nvme_cmd *sqes = sqs[1].vaddr;
+
+	for (; sqhead != sqs[1].tail; sqhead = (uint16_t)((sqhead + 1) % SQSIZE)) {
+		struct nvme_cqe *cqe = cq.vaddr + (cqtail++ << NVME_CQES);
+
+		cqe->sqid = cpu_to_le16(1);
+		cqe->cid = sqes[sqhead].cid;
+		cqe->sfp = cpu_to_le16(0x1);
+	}
+
+	return nvme_cq_process(&cq, CQSIZE);
+}
+
+static struct nvme_qos_io ios[16];
+
+static void prep_io(int i, int tenant, size_t len)
+{
+	ios[i] = (struct nvme_qos_io) {
+		.cmd = { .opcode = 0x2, .nsid = cpu_to_le32(1), .cdw10 = cpu_to_le32(i) },
+		.iova = 0x1000000 + (uint64_t)i * 0x10000,
+		.len = len,
+		.cb = complete_cb,
+		.opaque = (void *)(uintptr_t)tenant,
+	};
+}
+
+/* record the tenants of the commands posted since @from */
+static void record(int from, int n)
+{
+	union nvme_cmd *sqes = sqs[1].vaddr;
+
+	for (int i = 0; i < n; i++) {
+		uint32_t idx = le32_to_cpu(sqes[(from + i) % SQSIZE].cdw10);
+
+		order[i] = (int)(uintptr_t)ios[idx].opaque;
+	}
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = { .config.mps = 0 };
+	struct nvme_qos_limits limits;
+	struct nvme_qos_tenant t[3];
+	struct nvme_qos qos;
+	uint64_t now = 1000000000;
+	int from;
+
+	plan_tests(17);
+
+	cq = (struct nvme_cq) { .qsize = CQSIZE, .doorbell = &cqdb, .nsqs = 2, .sqs = sqs };
+	sqs[1] = (struct nvme_sq) {
+		.id = 1, .qsize = SQSIZE, .doorbell = &sqdb, .cq = &cq, .rqs = rqs,
+	};
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = SQSIZE - 2; i >= 0; i--) {
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&rqs[i]);
+	}
+
+	nvme_qos_init(&qos, &ctrl, &sqs[1]);
+
+	/* the second tenant has twice the quantum of the first */
+	nvme_qos_tenant_init(&t[0], &qos, &(struct nvme_qos_limits) { .quantum = 0x1000 });
+	nvme_qos_tenant_init(&t[1], &qos, &(struct nvme_qos_limits) { .quantum = 0x2000 });
+
+	for (int i = 0; i < 6; i++) {
+		prep_io(i, 0, 0x1000);
+		nvme_qos_enqueue(&t[0], &ios[i]);
+
+		prep_io(6 + i, 1, 0x1000);
+		nvme_qos_enqueue(&t[1], &ios[6 + i]);
+	}
+
+	ok1(__dispatch(&qos, 6, now) == 6);
+
+	/* one doorbell write for the batch */
+	ok1(sqdb == 6 && sqs[1].stats.doorbells == 1 && qos.batches == 1);
+
+	record(0, 6);
+	ok1(order[0] == 0 && order[1] == 1 && order[2] == 1 && order[3] == 0 && order[4] == 1 &&
+	    order[5] == 1);
+	ok1(t[0].dispatched == 2 && t[1].dispatched == 4);
+
+	/* the data pointer is set up on dispatch */
+	ok1(le64_to_cpu(((union nvme_cmd *)sqs[1].vaddr)[0].dptr.prp1) == ios[0].iova);
+
+	/* one request tracker left */
+	ok1(__dispatch(&qos, 6, now) == 1 && sqdb == 7);
+
+	ok1(complete_all() == 7 && ncompleted[0] == 3 && ncompleted[1] == 4);
+
+	/* the second tenant continues its turn and is done; then the first */
+	from = sqs[1].tail;
+	ok1(__dispatch(&qos, 8, now) == 5);
+	record(from, 5);
+	ok1(order[0] == 1 && order[1] == 1 && order[2] == 0 && order[3] == 0 && order[4] == 0);
+	ok1(qos.nactive == 0 && !t[0].deficit && !t[1].deficit);
+
+	ok1(complete_all() == 5 && ncompleted[0] == 6 && ncompleted[1] == 6);
+
+	/* one i/o per millisecond with a bucket depth of one i/o */
+	limits = (struct nvme_qos_limits) { .iops = 1000, .burst_usec = 1000 };
+	nvme_qos_tenant_init(&t[2], &qos, &limits);
+
+	for (int i = 0; i < 3; i++) {
+		prep_io(i, 2, 0x1000);
+		nvme_qos_enqueue(&t[2], &ios[i]);
+	}
+
+	ok1(__dispatch(&qos, 8, now) == 1 && t[2].throttled == 1);
+	ok1(__dispatch(&qos, 8, now + 500000) == 0 && sqs[1].stats.doorbells == 4);
+	ok1(__dispatch(&qos, 8, now + 1000000) == 1 && t[2].dispatched == 2);
+
+	/* an unlimited tenant is not held up by a throttled tenant */
+	prep_io(3, 0, 0x1000);
+	nvme_qos_enqueue(&t[0], &ios[3]);
+
+	ok1(__dispatch(&qos, 8, now + 1000002) == 1 && t[0].dispatched == 7);
+
+	/* raising the limit lets the backlog through */
+	limits.iops = 1000000;
+	nvme_qos_tenant_set_limits(&t[2], &limits);
+
+	ok1(__dispatch(&qos, 8, now + 1010000) == 1 && t[2].dispatched == 3 && !qos.nactive);
+
+	ok1(complete_all() == 4 && ncompleted[2] == 3);
+
+	return exit_status();
+}
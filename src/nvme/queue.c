@@ -22,40 +22,107 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <poll.h>
+
 #include <sys/mman.h>
 
 #include <linux/vfio.h>
 
+#include <vfn/support/atomic.h>
 #include <vfn/support/barrier.h>
 #include <vfn/support/compiler.h>
 #include <vfn/support/endian.h>
+#include <vfn/support/log.h>
+#include <vfn/support/mem.h>
 #include <vfn/support/mmio.h>
 #include <vfn/support/ticks.h>
 #include <vfn/trace.h>
 #include <vfn/nvme/types.h>
 #include <vfn/nvme/queue.h>
 
+#include "ccan/minmax/minmax.h"
 #include "ccan/time/time.h"
 
-void nvme_cq_get_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n)
+#include "cqscan.h"
+
+#define NVME_CQ_REAP_BATCH_MAX 32
+
+int __nvme_cq_scan(struct nvme_cq *cq, int max)
 {
-	struct nvme_cqe *cqe;
+	struct nvme_cqe *cqes = cq->vaddr;
+	int n, m;
 
-	do {
-		cqe = nvme_cq_get_cqe(cq);
-		if (!cqe)
-			continue;
+	/* scan up to the end of the ring */
+	n = __nvme_cq_scan_fn(&cqes[cq->head], cq->phase, min_t(int, max, cq->qsize - cq->head));
+	if (n < cq->qsize - cq->head || n == max)
+		return n;
+
+	/* entries after the wrap carry the inverted phase */
+	m = __nvme_cq_scan_fn(cqes, cq->phase ^ 0x1, min_t(int, max - n, cq->head));
+
+	return n + m;
+}
+
+/* entries are held back for at most this many doorbell write times */
+#define NVME_SQ_DBC_COST_FACTOR 4
+
+void nvme_sq_set_db_coalesce(struct nvme_sq *sq, unsigned int max_ns)
+{
+	uint64_t max = max_ns ? max_t(uint64_t, ns_to_ticks(max_ns), 1) : 0;
+
+	if (!max && sq->cq && sq->cq->dbc_sq == sq)
+		__nvme_cq_flush_dbc(sq->cq);
+
+	memset(&sq->dbc, 0x0, sizeof(sq->dbc));
+
+	/* until the first doorbell write is measured */
+	sq->dbc.max = sq->dbc.window = max;
+	sq->dbc.batch = max_t(int, sq->qsize / 2, 1);
+	sq->dbc.last = get_ticks();
+}
+
+void __nvme_sq_dbc_tune(struct nvme_sq *sq, uint64_t cost)
+{
+	uint64_t window;
+
+	sq->dbc.cost = sq->dbc.cost ? (7 * sq->dbc.cost + cost) / 8 : cost;
+
+	window = min_t(uint64_t, NVME_SQ_DBC_COST_FACTOR * sq->dbc.cost, sq->dbc.max);
 
-		n--;
+	sq->dbc.window = window;
+
+	/* the number of entries expected to be posted within the window */
+	if (sq->dbc.gap)
+		sq->dbc.batch = (int)min_t(uint64_t, window / sq->dbc.gap + 1,
+					   (uint64_t)max_t(int, sq->qsize / 2, 1));
+	else
+		sq->dbc.batch = max_t(int, sq->qsize / 2, 1);
+}
 
-		if (cqes)
-			memcpy(cqes++, cqe, sizeof(*cqe));
+static inline int __reap(struct nvme_cq *cq, struct nvme_cqe **cqes, int n)
+{
+	struct nvme_cqe *batch[NVME_CQ_REAP_BATCH_MAX];
+	int reaped;
+
+	reaped = nvme_cq_reap_batch(cq, batch, min_t(int, n, NVME_CQ_REAP_BATCH_MAX));
+
+	if (*cqes) {
+		for (int i = 0; i < reaped; i++)
+			memcpy((*cqes)++, batch[i], sizeof(struct nvme_cqe));
+	}
+
+	return reaped;
+}
+
+void nvme_cq_get_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n)
+{
+	do {
+		n -= __reap(cq, &cqes, n);
 	} while (n > 0);
 }
 
 int nvme_cq_wait_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n, struct timespec *ts)
 {
-	struct nvme_cqe *cqe;
 	struct timerel rel;
 	uint64_t timeout;
 	int m = n;
@@ -68,17 +135,10 @@ int nvme_cq_wait_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n, struct t
 
 	rel.ts = *ts;
 
-	timeout = get_ticks() + time_to_usec(rel) * (__vfn_ticks_freq / 1000000ULL);
+	timeout = get_ticks() + ns_to_ticks(time_to_nsec(rel));
 
 	do {
-		cqe = nvme_cq_get_cqe(cq);
-		if (!cqe)
-			continue;
-
-		m--;
-
-		if (cqes)
-			memcpy(cqes++, cqe, sizeof(*cqe));
+		m -= __reap(cq, &cqes, m);
 	} while (m > 0 && get_ticks() < timeout);
 
 	if (m > 0)
@@ -86,3 +146,251 @@ int nvme_cq_wait_cqes(struct nvme_cq *cq, struct nvme_cqe *cqes, int n, struct t
 
 	return n - m;
 }
+
+static inline bool __cq_ready(struct nvme_cq *cq)
+{
+	struct nvme_cqe *cqe = nvme_cq_head(cq);
+
+	return (le16_to_cpu(LOAD(cqe->sfp)) & 0x1) != cq->phase;
+}
+
+static inline uint64_t __usec_to_ticks(uint64_t usec)
+{
+	return ns_to_ticks(usec * 1000);
+}
+
+/* number of consecutive waits in the other mode before switching modes */
+#define NVME_CQ_POLL_MODE_HYSTERESIS 8
+
+static void __poll_mode(struct nvme_cq *cq, bool blocked)
+{
+	struct nvme_cq_poll *poll = &cq->poll;
+
+	if (!poll->set_irq_mode)
+		return;
+
+	if (blocked == poll->irq) {
+		poll->streak = 0;
+		return;
+	}
+
+	if (++poll->streak < NVME_CQ_POLL_MODE_HYSTERESIS)
+		return;
+
+	poll->irq = blocked;
+	poll->streak = 0;
+
+	poll->set_irq_mode(cq, poll->irq, poll->opaque);
+}
+
+static int __wait(struct nvme_cq *cq, uint64_t spin, struct timespec *ts)
+{
+	struct nvme_cq_poll_stats *stats = &cq->poll.stats;
+	struct pollfd pfd = { .fd = cq->efd, .events = POLLIN };
+	uint64_t start, now, blocked, deadline = UINT64_MAX;
+	uint64_t v;
+
+	/* the entries waited for may not have been submitted yet */
+	if (cq->dbc_sq)
+		__nvme_cq_flush_dbc(cq);
+
+	start = now = get_ticks();
+
+	if (ts) {
+		struct timerel rel = { .ts = *ts };
+
+		deadline = now + ns_to_ticks(time_to_nsec(rel));
+	}
+
+	/* with no eventfd; spin until the deadline */
+	if (cq->efd < 0)
+		spin = UINT64_MAX;
+
+	do {
+		if (__cq_ready(cq)) {
+			stats->spin_ticks += get_ticks() - start;
+			stats->nspin++;
+
+			__poll_mode(cq, false);
+
+			return 0;
+		}
+
+		now = get_ticks();
+	} while (now - start < spin && now < deadline);
+
+	stats->spin_ticks += now - start;
+
+	if (cq->efd < 0)
+		goto timeout;
+
+	blocked = now;
+
+	do {
+		int timeout = -1, ret;
+
+		/* arm; completions reaped by polling left the counter non-zero */
+		if (read(cq->efd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+			goto error;
+
+		if (__cq_ready(cq)) {
+			stats->block_ticks += get_ticks() - blocked;
+			stats->nblock++;
+
+			__poll_mode(cq, true);
+
+			return 0;
+		}
+
+		if (ts) {
+			if (now >= deadline)
+				break;
+
+			timeout = (int)(ticks_to_ns(deadline - now) / 1000000) + 1;
+		}
+
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR)
+			goto error;
+
+		now = get_ticks();
+	} while (1);
+
+	stats->block_ticks += now - blocked;
+
+timeout:
+	errno = ETIMEDOUT;
+	return -1;
+
+error:
+	stats->block_ticks += get_ticks() - blocked;
+
+	return -1;
+}
+
+int nvme_cq_wait_hybrid(struct nvme_cq *cq, unsigned int spin_usec, struct timespec *ts)
+{
+	return __wait(cq, __usec_to_ticks(spin_usec), ts);
+}
+
+/* weight of a new sample in the moving average of inter-completion times */
+#define NVME_CQ_POLL_MEAN_SHIFT 3
+
+static uint64_t __poll_spin(struct nvme_cq_poll *poll, uint64_t now)
+{
+	uint64_t max = __usec_to_ticks(poll->opts.spin_usec);
+	uint64_t expected;
+
+	if (!poll->opts.adaptive || !poll->mean)
+		return max;
+
+	expected = poll->last + poll->mean;
+
+	/* overdue; the completion may be imminent */
+	if (now >= expected)
+		return max;
+
+	/* too far away; do not burn cycles and block right away */
+	if (expected - now > max)
+		return 0;
+
+	/* spin past the expected completion time by half the mean */
+	return min_t(uint64_t, max, expected - now + poll->mean / 2);
+}
+
+static void __poll_update(struct nvme_cq_poll *poll, uint64_t now)
+{
+	if (poll->last) {
+		int64_t delta = (int64_t)(now - poll->last) - (int64_t)poll->mean;
+
+		poll->mean = (uint64_t)((int64_t)poll->mean + (delta >> NVME_CQ_POLL_MEAN_SHIFT));
+	}
+
+	poll->last = now;
+}
+
+int nvme_cq_wait(struct nvme_cq *cq, struct timespec *ts)
+{
+	struct nvme_cq_poll *poll = &cq->poll;
+	int ret;
+
+	ret = __wait(cq, __poll_spin(poll, get_ticks()), ts);
+	if (ret)
+		return ret;
+
+	if (poll->opts.adaptive)
+		__poll_update(poll, get_ticks());
+
+	return 0;
+}
+
+int nvme_mpsq_init(struct nvme_mpsq *mpsq, struct nvme_sq *sq)
+{
+	if (sq->tail != sq->ptail) {
+		log_debug("sq %d has unsubmitted entries\n", sq->id);
+
+		errno = EBUSY;
+		return -1;
+	}
+
+	mpsq->sq = sq;
+	mpsq->ready = znew_t(uint64_t, sq->qsize);
+
+	mpsq->reserved = sq->tail;
+	mpsq->published = sq->tail;
+	mpsq->busy = false;
+
+	return 0;
+}
+
+void nvme_mpsq_fini(struct nvme_mpsq *mpsq)
+{
+	free(mpsq->ready);
+	mpsq->ready = NULL;
+}
+
+static inline bool __mpsq_ready(struct nvme_mpsq *mpsq, uint64_t ticket)
+{
+	return atomic_load_acquire(&mpsq->ready[ticket % (uint64_t)mpsq->sq->qsize]) == ticket + 1;
+}
+
+void nvme_mpsq_publish(struct nvme_mpsq *mpsq)
+{
+	struct nvme_sq *sq = mpsq->sq;
+	uint64_t from, to;
+
+	for (;;) {
+		/*
+		 * Order the ready mark (or the release of the publisher role
+		 * below) with the checks. Either this thread sees the entry of
+		 * a producer that failed to become publisher, or that producer
+		 * sees the role released.
+		 */
+		mb();
+
+		from = atomic_load_acquire(&mpsq->published);
+
+		if (!__mpsq_ready(mpsq, from))
+			return;
+
+		if (atomic_xchg(&mpsq->busy, true))
+			return;
+
+		/* the published counter only moves while holding the role */
+		from = mpsq->published;
+
+		for (to = from; to - from < (uint64_t)sq->qsize - 1 && __mpsq_ready(mpsq, to); to++)
+			;
+
+		if (to != from) {
+			__nvme_qstat_add(sq, posted, to - from);
+
+			sq->tail = (uint16_t)(to % (uint64_t)sq->qsize);
+			nvme_sq_flush_tail(sq);
+
+			atomic_store_release(&mpsq->published, to);
+		}
+
+		atomic_store_release(&mpsq->busy, false);
+	}
+}
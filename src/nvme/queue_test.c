@@ -0,0 +1,636 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/* exercise the queue counters regardless of the build configuration */
+#define NVME_QSTATS
+
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+#include "ccan/tap/tap.h"
+
+#include "vfn/support.h"
+
+#include "queue.c"
+
+#define QSIZE 8
+
+static void post_cqes(struct nvme_cq *cq, int from, int n, int phase)
+{
+	struct nvme_cqe *cqes = cq->vaddr;
+
+	for (int i = 0; i < n; i++) {
+		int idx = (from + i) % cq->qsize;
+
+		cqes[idx].cid = (uint16_t)idx;
+		cqes[idx].sfp = cpu_to_le16((uint16_t)phase);
+	}
+}
+
+static void *irq_thread(void *opaque)
+{
+	struct nvme_cq *cq = opaque;
+
+	usleep(20000);
+
+	post_cqes(cq, 0, 1, 1);
+
+	if (eventfd_write(cq->efd, 1))
+		abort();
+
+	return NULL;
+}
+
+static int irq_mode_switches;
+
+static void set_irq_mode(struct nvme_cq *cq UNUSED, bool irq UNUSED, void *opaque UNUSED)
+{
+	irq_mode_switches++;
+}
+
+static bool scan_backend_ok(const struct nvme_cq_scan_backend *backend)
+{
+	static struct nvme_cqe cqes[64] __attribute__((aligned(64)));
+
+	for (int phase = 0; phase < 2; phase++) {
+		for (int run = 0; run <= 64; run++) {
+			for (int i = 0; i < 64; i++)
+				cqes[i].sfp = cpu_to_le16((uint16_t)(i < run ? !phase : phase));
+
+			for (int n = 0; n <= 64; n++) {
+				if (backend->scan(cqes, phase, n) != min_t(int, run, n))
+					return false;
+
+				/* unaligned start */
+				if (n < 64 && backend->scan(&cqes[1], phase, n) !=
+				    min_t(int, max_t(int, run - 1, 0), n))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static void test_qstats(void)
+{
+	uint32_t db, shadow, eventidx;
+	union nvme_cmd cmds[2] = {};
+	struct nvme_sq_stats sqs;
+	struct nvme_cq_stats cqs;
+	struct nvme_sq sq = {
+		.qsize = QSIZE,
+		.doorbell = &db,
+	};
+	struct nvme_cq cq = {
+		.qsize = QSIZE,
+		.doorbell = &db,
+		.efd = -1,
+	};
+	struct nvme_cqe *batch[QSIZE];
+
+	assert(pgmap(&sq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+
+	nvme_sq_post(&sq, &cmds[0]);
+	nvme_sq_post_batch(&sq, cmds, 2);
+	nvme_sq_update_tail(&sq);
+
+	/* tail unchanged; no doorbell write */
+	nvme_sq_update_tail(&sq);
+
+	/* the shadow doorbell eventidx has not been passed; the write is elided */
+	shadow = 0;
+	eventidx = 8;
+	sq.dbbuf = (struct nvme_dbbuf) { .doorbell = &shadow, .eventidx = &eventidx };
+
+	nvme_sq_post(&sq, &cmds[0]);
+	nvme_sq_update_tail(&sq);
+
+	nvme_sq_get_stats(&sq, &sqs);
+	ok1(sqs.posted == 4 && sqs.doorbells == 1 && sqs.dbbuf_skips == 1);
+
+	ok1(!nvme_cq_get_cqe(&cq));
+
+	post_cqes(&cq, 0, 3, 1);
+	ok1(nvme_cq_reap_batch(&cq, batch, QSIZE) == 3);
+	ok1(!nvme_cq_reap_batch(&cq, batch, QSIZE));
+	nvme_cq_update_head(&cq);
+
+	post_cqes(&cq, 3, 1, 1);
+	ok1(nvme_cq_get_cqe(&cq) != NULL);
+
+	nvme_cq_get_stats(&cq, &cqs);
+	ok1(cqs.reaped == 4 && cqs.empty_polls == 2 && cqs.head_updates == 1 &&
+	    cqs.doorbells == 1 && cqs.dbbuf_skips == 0);
+}
+
+static void test_db_policy(void)
+{
+	uint32_t db = 0, shadow = 0, eventidx = 0;
+	union nvme_cmd cmds[4] = {};
+	struct nvme_sq sq = {
+		.qsize = QSIZE,
+		.doorbell = &db,
+	};
+	struct nvme_cq cq = {
+		.qsize = QSIZE,
+		.doorbell = &db,
+		.efd = -1,
+	};
+
+	assert(pgmap(&sq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+
+	/* tail doorbell writes are deferred until three entries are pending */
+	nvme_sq_set_db_batch(&sq, 3);
+
+	nvme_sq_post_batch(&sq, cmds, 2);
+	nvme_sq_update_tail(&sq);
+	ok1(db == 0 && sq.stats.deferred == 1);
+
+	nvme_sq_post(&sq, &cmds[0]);
+	nvme_sq_update_tail(&sq);
+	ok1(db == 3 && sq.stats.doorbells == 1);
+
+	nvme_sq_exec(&sq, &cmds[0]);
+	ok1(db == 4);
+
+	/* the controller is polling the shadow doorbell; never deferred */
+	eventidx = 8;
+	sq.dbbuf = (struct nvme_dbbuf) { .doorbell = &shadow, .eventidx = &eventidx };
+
+	nvme_sq_post(&sq, &cmds[0]);
+	nvme_sq_update_tail(&sq);
+	ok1(shadow == 5 && db == 4 && sq.stats.dbbuf_skips == 1);
+
+	/* eventidx passed; defer, then cover the whole range when flushing */
+	eventidx = 5;
+
+	nvme_sq_post(&sq, &cmds[0]);
+	nvme_sq_update_tail(&sq);
+	ok1(shadow == 5 && sq.stats.deferred == 2);
+
+	nvme_sq_flush_tail(&sq);
+	ok1(shadow == 6 && db == 6);
+
+	/* head doorbell is written every four entries */
+	nvme_cq_set_lazy_head(&cq, 4);
+
+	post_cqes(&cq, 0, 6, 1);
+
+	for (int i = 0; i < 6; i++) {
+		assert(nvme_cq_get_cqe(&cq));
+		nvme_cq_update_head(&cq);
+	}
+
+	ok1(cq.stats.doorbells == 1 && cq.stats.deferred == 5 && cq.phead == 4);
+
+	/* half the queue has been consumed */
+	nvme_cq_set_lazy_head(&cq, 16);
+
+	post_cqes(&cq, 6, 2, 1);
+	post_cqes(&cq, 0, 2, 0);
+
+	for (int i = 0; i < 4; i++)
+		assert(nvme_cq_get_cqe(&cq));
+
+	nvme_cq_update_head(&cq);
+	ok1(cq.stats.doorbells == 2 && cq.phead == 2);
+
+	/* deferred across a batch, committed once */
+	nvme_cq_set_lazy_head(&cq, QSIZE);
+
+	post_cqes(&cq, 2, 3, 0);
+
+	for (int i = 0; i < 3; i++) {
+		assert(nvme_cq_get_cqe(&cq));
+		nvme_cq_update_head(&cq);
+	}
+
+	ok1(cq.stats.doorbells == 2 && cq.head == 5);
+
+	nvme_cq_commit_head(&cq);
+	nvme_cq_commit_head(&cq);
+	ok1(cq.stats.doorbells == 3 && cq.phead == 5 && db == 5);
+}
+
+static void test_db_coalesce(void)
+{
+	uint32_t sqdb = 0, cqdb = 0;
+	union nvme_cmd cmd = {};
+	struct nvme_cqe *batch[QSIZE];
+	struct nvme_cq cq = {
+		.qsize = QSIZE,
+		.doorbell = &cqdb,
+		.efd = -1,
+	};
+	struct nvme_sq sq = {
+		.cq = &cq,
+		.qsize = QSIZE,
+		.doorbell = &sqdb,
+	};
+
+	assert(pgmap(&sq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+
+	nvme_sq_set_db_coalesce(&sq, 1000000000);
+	ok1(sq.dbc.max && sq.dbc.batch == QSIZE / 2);
+
+	/* held back until the completion queue is polled */
+	nvme_sq_exec(&sq, &cmd);
+	ok1(sqdb == 0 && cq.dbc_sq == &sq && sq.stats.deferred == 1);
+
+	ok1(!nvme_cq_get_cqe(&cq));
+	ok1(sqdb == 1 && !cq.dbc_sq && sq.dbc.deadline == 0);
+
+	/* written when the pending entry threshold is reached */
+	sq.dbc.window = sq.dbc.max;
+	sq.dbc.batch = 3;
+
+	for (int i = 0; i < 3; i++) {
+		nvme_sq_post(&sq, &cmd);
+		nvme_sq_update_tail(&sq);
+	}
+
+	ok1(sqdb == 4 && sq.stats.deferred == 3);
+
+	/* written when the deadline has expired */
+	sq.dbc.window = 0;
+	sq.dbc.batch = QSIZE;
+
+	nvme_sq_exec(&sq, &cmd);
+	ok1(sqdb == 5);
+
+	/* reaping writes it too */
+	sq.dbc.window = sq.dbc.max;
+	sq.dbc.batch = QSIZE;
+
+	nvme_sq_exec(&sq, &cmd);
+	ok1(sqdb == 5 && nvme_cq_reap_batch(&cq, batch, QSIZE) == 0 && sqdb == 6);
+
+	/* held back a few doorbell write times, at most the maximum */
+	sq.dbc.max = 1000;
+	sq.dbc.cost = 0;
+	sq.dbc.gap = 10;
+
+	__nvme_sq_dbc_tune(&sq, 100);
+	ok1(sq.dbc.cost == 100 && sq.dbc.window == 400 && sq.dbc.batch == QSIZE / 2);
+
+	/* the threshold is the number of entries expected within the window */
+	sq.dbc.gap = 200;
+	__nvme_sq_dbc_tune(&sq, 100);
+	ok1(sq.dbc.batch == 3);
+
+	/* sporadic submissions are not held back */
+	sq.dbc.gap = 1000;
+	__nvme_sq_dbc_tune(&sq, 100);
+	ok1(sq.dbc.batch == 1);
+
+	sq.dbc.max = 200;
+	__nvme_sq_dbc_tune(&sq, 100);
+	ok1(sq.dbc.window == 200);
+
+	/* disabling writes a held back doorbell */
+	nvme_sq_set_db_coalesce(&sq, 1000000000);
+
+	nvme_sq_exec(&sq, &cmd);
+	ok1(sqdb == 6 && cq.dbc_sq == &sq);
+
+	nvme_sq_set_db_coalesce(&sq, 0);
+	ok1(sqdb == 7 && !cq.dbc_sq && !sq.dbc.max);
+
+	/* the tail wrapped */
+	nvme_sq_exec(&sq, &cmd);
+	ok1(sqdb == 0 && sq.ptail == 0);
+}
+
+static void test_sq_space(void)
+{
+	uint32_t db = 0;
+	struct nvme_sq sqs[2] = {};
+	struct nvme_cq cq = {
+		.qsize = QSIZE,
+		.efd = -1,
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+	union nvme_cmd cmd = {};
+	struct nvme_cqe *cqe;
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = QSIZE,
+		.doorbell = &db,
+		.cq = &cq,
+	};
+
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+
+	ok1(nvme_sq_space(&sqs[1]) == QSIZE - 1);
+
+	for (int i = 0; i < QSIZE - 1; i++)
+		assert(nvme_sq_try_post(&sqs[1], &cmd) == 0);
+
+	nvme_sq_flush_tail(&sqs[1]);
+
+	/* no room until the controller reports having fetched entries */
+	ok1(nvme_sq_try_exec(&sqs[1], &cmd) == -1 && errno == EBUSY && db == QSIZE - 1);
+
+	cqe = cq.vaddr;
+	cqe->sqid = cpu_to_le16(1);
+	cqe->sqhd = cpu_to_le16(3);
+	cqe->sfp = cpu_to_le16(0x1);
+
+	ok1(nvme_cq_get_cqe(&cq) == cqe && sqs[1].head == 3);
+	ok1(nvme_sq_space(&sqs[1]) == 3);
+
+	ok1(nvme_sq_try_exec(&sqs[1], &cmd) == 0 && db == 0 && sqs[1].stats.doorbells == 2 &&
+	    nvme_sq_space(&sqs[1]) == 2);
+
+	/* an out of range submission queue identifier is not tracked */
+	cqe++;
+	cqe->sqid = cpu_to_le16(2);
+	cqe->sqhd = cpu_to_le16(1);
+	cqe->sfp = cpu_to_le16(0x1);
+
+	ok1(nvme_cq_get_cqe(&cq) == cqe && sqs[1].head == 3);
+}
+
+#define MPSQ_THREADS 4
+#define MPSQ_POSTS 8
+
+static struct nvme_mpsq mpsq;
+
+static void *mpsq_thread(void *opaque)
+{
+	uint16_t base = (uint16_t)(uintptr_t)opaque;
+
+	for (int i = 0; i < MPSQ_POSTS; i++) {
+		union nvme_cmd cmd = { .cid = (uint16_t)(base + i) };
+
+		nvme_mpsq_post(&mpsq, &cmd);
+	}
+
+	return NULL;
+}
+
+static void test_mpsq(void)
+{
+	uint32_t db = 0;
+	struct nvme_sq sq = {
+		.qsize = 64,
+		.doorbell = &db,
+	};
+	bool seen[MPSQ_THREADS * MPSQ_POSTS] = {};
+	pthread_t threads[MPSQ_THREADS];
+	union nvme_cmd *sqes, *a, *b, fused[2] = {};
+	uint64_t ta, tb, doorbells;
+	int nseen = 0;
+
+	assert(pgmap(&sq.vaddr, __VFN_PAGESIZE) > 0);
+	sqes = sq.vaddr;
+
+	ok1(nvme_mpsq_init(&mpsq, &sq) == 0);
+
+	/* committed out of order; published once the earlier entry is ready */
+	a = nvme_mpsq_reserve(&mpsq, &ta);
+	b = nvme_mpsq_reserve(&mpsq, &tb);
+	ok1(ta == 0 && tb == 1 && a == &sqes[0] && b == &sqes[1]);
+
+	nvme_mpsq_commit(&mpsq, tb);
+	ok1(sq.tail == 0 && db == 0);
+
+	nvme_mpsq_commit(&mpsq, ta);
+	ok1(sq.tail == 2 && db == 2 && sq.stats.doorbells == 1 && sq.stats.posted == 2);
+
+	/* concurrent producers */
+	for (int i = 0; i < MPSQ_THREADS; i++)
+		assert(pthread_create(&threads[i], NULL, mpsq_thread,
+				      (void *)(uintptr_t)(i * MPSQ_POSTS)) == 0);
+
+	for (int i = 0; i < MPSQ_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	ok1(sq.tail == 34 && db == 34 && mpsq.published == 34);
+
+	for (int i = 2; i < 34; i++) {
+		if (sqes[i].cid < MPSQ_THREADS * MPSQ_POSTS && !seen[sqes[i].cid]) {
+			seen[sqes[i].cid] = true;
+			nseen++;
+		}
+	}
+
+	ok1(nseen == MPSQ_THREADS * MPSQ_POSTS);
+
+	/* fused pairs are adjacent and submitted by the same doorbell write */
+	doorbells = sq.stats.doorbells;
+	a = nvme_mpsq_reserve(&mpsq, &ta);
+
+	fused[0].cid = 100;
+	fused[1].cid = 101;
+	nvme_mpsq_post_fused(&mpsq, fused);
+	ok1(sq.tail == 34 && sqes[35].cid == 100 && sqes[36].cid == 101);
+
+	nvme_mpsq_commit(&mpsq, ta);
+	ok1(sq.tail == 37 && db == 37 && sq.stats.doorbells == doorbells + 1);
+
+	nvme_mpsq_fini(&mpsq);
+
+	/* pending entries */
+	sq.tail++;
+	ok1(nvme_mpsq_init(&mpsq, &sq) == -1 && errno == EBUSY);
+}
+
+int main(void)
+{
+	struct nvme_cqe *batch[QSIZE], copy[QSIZE];
+	struct nvme_cq cq = {
+		.qsize = QSIZE,
+		.efd = -1,
+	};
+	pthread_t thread;
+	uint64_t max;
+	struct nvme_sq sq = {
+		.qsize = QSIZE,
+	};
+	union nvme_cmd cmds[4] = {}, *sqes;
+
+	plan_tests(81 + nvme_cq_scan_nbackends);
+
+	for (int i = 0; i < nvme_cq_scan_nbackends; i++) {
+		const struct nvme_cq_scan_backend *backend = &nvme_cq_scan_backends[i];
+
+		if (!backend->supported()) {
+			skip(1, "%s not supported", backend->name);
+			continue;
+		}
+
+		ok(scan_backend_ok(backend), "%s phase scan", backend->name);
+	}
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+
+	/* empty queue */
+	ok1(nvme_cq_reap_batch(&cq, batch, QSIZE) == 0);
+	ok1(cq.head == 0);
+
+	/* partial run */
+	post_cqes(&cq, 0, 3, 1);
+
+	ok1(nvme_cq_reap_batch(&cq, batch, QSIZE) == 3);
+	ok1(batch[0]->cid == 0 && batch[2]->cid == 2);
+	ok1(cq.head == 3 && cq.phase == 0);
+
+	/* bounded by max */
+	post_cqes(&cq, 3, 4, 1);
+
+	ok1(nvme_cq_reap_batch(&cq, batch, 2) == 2);
+	ok1(batch[0]->cid == 3 && batch[1]->cid == 4);
+	ok1(cq.head == 5);
+
+	/* wrap around; entries after the wrap carry the inverted phase */
+	post_cqes(&cq, 7, 1, 1);
+	post_cqes(&cq, 0, 2, 0);
+
+	ok1(nvme_cq_reap_batch(&cq, batch, QSIZE) == 5);
+	ok1(batch[2]->cid == 7 && batch[3]->cid == 0 && batch[4]->cid == 1);
+	ok1(cq.head == 2 && cq.phase == 1);
+
+	/* nothing valid after the run */
+	ok1(nvme_cq_reap_batch(&cq, batch, QSIZE) == 0);
+
+	/* exact reaping with copy */
+	post_cqes(&cq, 2, 4, 0);
+
+	nvme_cq_get_cqes(&cq, copy, 4);
+	ok1(copy[0].cid == 2 && copy[3].cid == 5);
+	ok1(cq.head == 6);
+
+	/* wait with timeout; only two available */
+	post_cqes(&cq, 6, 2, 0);
+
+	ok1(nvme_cq_wait_cqes(&cq, copy, 4, &(struct timespec) {.tv_nsec = 1000000}) == 2);
+	ok1(errno == ETIMEDOUT);
+	ok1(cq.head == 0 && cq.phase == 0);
+
+	/* hybrid wait without an eventfd spins until the timeout */
+	ok1(nvme_cq_wait_hybrid(&cq, 10, &(struct timespec) {.tv_nsec = 1000000}) == -1 &&
+	    errno == ETIMEDOUT);
+
+	post_cqes(&cq, 0, 1, 1);
+	ok1(nvme_cq_wait_hybrid(&cq, 10, NULL) == 0 && cq.head == 0);
+	post_cqes(&cq, 0, 1, 0);
+
+	/* a stale eventfd count does not satisfy the wait */
+	cq.efd = eventfd(0, EFD_NONBLOCK);
+	assert(cq.efd >= 0);
+
+	eventfd_write(cq.efd, 1);
+	ok1(nvme_cq_wait_hybrid(&cq, 0, &(struct timespec) {.tv_nsec = 5000000}) == -1 &&
+	    errno == ETIMEDOUT);
+
+	/* blocks on the eventfd until the "interrupt" */
+	pthread_create(&thread, NULL, irq_thread, &cq);
+	ok1(nvme_cq_wait_hybrid(&cq, 0, NULL) == 0);
+	pthread_join(thread, NULL);
+
+	ok1(cq.poll.stats.nblock == 1 && cq.poll.stats.block_ticks > 0);
+
+	/* adaptive policy */
+	memset(&cq.poll, 0x0, sizeof(cq.poll));
+	cq.poll.opts = (struct nvme_cq_poll_opts) { .spin_usec = 100, .adaptive = true };
+
+	ok1(nvme_cq_wait(&cq, NULL) == 0 && cq.poll.stats.nspin == 1);
+	ok1(cq.poll.last && !cq.poll.mean);
+
+	max = __usec_to_ticks(100);
+	ok1(__poll_spin(&cq.poll, cq.poll.last) == max);
+
+	for (int i = 1; i <= 64; i++)
+		__poll_update(&cq.poll, cq.poll.last + 10 * max);
+
+	/* next completion far away; block right away */
+	ok1(cq.poll.mean > 9 * max && cq.poll.mean <= 10 * max);
+	ok1(__poll_spin(&cq.poll, cq.poll.last + 1) == 0);
+
+	/* next completion is close; spin a bit past the expected time */
+	cq.poll.mean = max / 4;
+	ok1(__poll_spin(&cq.poll, cq.poll.last) == max / 4 + max / 8);
+
+	/* non-adaptive policy always spins for the full budget */
+	cq.poll.opts.adaptive = false;
+	ok1(__poll_spin(&cq.poll, cq.poll.last + 1) == max);
+
+	/* switching between polling and interrupt mode has hysteresis */
+	cq.poll.set_irq_mode = set_irq_mode;
+
+	for (int i = 0; i < NVME_CQ_POLL_MODE_HYSTERESIS - 1; i++)
+		__poll_mode(&cq, true);
+
+	__poll_mode(&cq, false);
+	__poll_mode(&cq, true);
+	ok1(!cq.poll.irq && irq_mode_switches == 0);
+
+	for (int i = 0; i < NVME_CQ_POLL_MODE_HYSTERESIS - 1; i++)
+		__poll_mode(&cq, true);
+
+	ok1(cq.poll.irq && irq_mode_switches == 1);
+
+	for (int i = 0; i < NVME_CQ_POLL_MODE_HYSTERESIS; i++)
+		__poll_mode(&cq, false);
+
+	ok1(!cq.poll.irq && irq_mode_switches == 2);
+
+	close(cq.efd);
+
+	/* batched submission, split at the wrap point */
+	assert(pgmap(&sq.vaddr, __VFN_PAGESIZE) > 0);
+	sqes = sq.vaddr;
+
+	for (int i = 0; i < 4; i++)
+		cmds[i].cid = (uint16_t)(0x10 + i);
+
+	nvme_sq_post_batch(&sq, cmds, 3);
+	ok1(sqes[0].cid == 0x10 && sqes[2].cid == 0x12 && sq.tail == 3);
+
+	sq.tail = 6;
+	nvme_sq_post_batch(&sq, cmds, 4);
+	ok1(sqes[6].cid == 0x10 && sqes[7].cid == 0x11);
+	ok1(sqes[0].cid == 0x12 && sqes[1].cid == 0x13);
+	ok1(sq.tail == 2);
+
+	/* queue counters */
+	test_qstats();
+
+	/* doorbell policies */
+	test_db_policy();
+
+	/* automatic doorbell coalescing */
+	test_db_coalesce();
+
+	/* submission queue flow control */
+	test_sq_space();
+
+	/* multi-producer submission */
+	test_mpsq();
+
+	return exit_status();
+}
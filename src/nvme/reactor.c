@@ -0,0 +1,473 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/reactor: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/trace.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#define NVME_REACTOR_BATCH 32
+#define NVME_REACTOR_BATCH_MAX 64
+#define NVME_REACTOR_RING_MAX (1u << 20)
+
+struct nvme_reactor_consumer {
+	struct nvme_reactor_cqe *ring;
+	uint32_t mask;
+	int idx;
+
+	/* producer (reaper) */
+	uint32_t tail __cacheline_aligned;
+	uint32_t head_cache;
+
+	/* consumer */
+	uint32_t head __cacheline_aligned;
+};
+
+struct nvme_reactor_queue {
+	struct nvme_cq *cq;
+
+	/* bitmap of consumers routed from this queue */
+	uint64_t consumers;
+};
+
+struct nvme_reactor_route {
+	struct nvme_sq *sq;
+	struct nvme_reactor_consumer *consumer;
+};
+
+struct nvme_reactor {
+	struct nvme_reactor_opts opts;
+
+	struct nvme_reactor_queue *queues;
+	int nqueues;
+
+	struct nvme_reactor_consumer *consumers[NVME_REACTOR_MAX_CONSUMERS];
+	int nconsumers;
+
+	/* indexed by submission queue identifier */
+	struct nvme_reactor_route *routes;
+	int nroutes;
+
+	pthread_t thread;
+	bool running, stop;
+
+	struct nvme_reactor_stats stats;
+};
+
+struct nvme_reactor *nvme_reactor_create(const struct nvme_reactor_opts *opts)
+{
+	struct nvme_reactor *reactor;
+
+	if (opts && (opts->batch < 0 || opts->batch > NVME_REACTOR_BATCH_MAX)) {
+		log_debug("invalid batch size %d\n", opts->batch);
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	reactor = znew_t(struct nvme_reactor, 1);
+
+	reactor->opts = opts ? *opts : (struct nvme_reactor_opts) { .cpu = -1 };
+
+	if (!reactor->opts.batch)
+		reactor->opts.batch = NVME_REACTOR_BATCH;
+
+	return reactor;
+}
+
+void nvme_reactor_destroy(struct nvme_reactor *reactor)
+{
+	if (!reactor)
+		return;
+
+	nvme_reactor_stop(reactor);
+
+	for (int i = 0; i < reactor->nqueues; i++)
+		reactor->queues[i].cq->reactor = false;
+
+	for (int i = 0; i < reactor->nconsumers; i++) {
+		free(reactor->consumers[i]->ring);
+		free(reactor->consumers[i]);
+	}
+
+	free(reactor->queues);
+	free(reactor->routes);
+	free(reactor);
+}
+
+int nvme_reactor_add_cq(struct nvme_reactor *reactor, struct nvme_cq *cq)
+{
+	if (reactor->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	for (int i = 0; i < reactor->nqueues; i++) {
+		if (reactor->queues[i].cq == cq) {
+			errno = EEXIST;
+			return -1;
+		}
+	}
+
+	/* the timer wheel is not disarmed from the consumer threads */
+	if (cq->tmo) {
+		log_debug("cq %d has command timeouts enabled\n", cq->id);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	reactor->queues = reallocn(reactor->queues, (unsigned int)reactor->nqueues + 1,
+				   sizeof(*reactor->queues));
+	if (!reactor->queues)
+		backtrace_abort();
+
+	reactor->queues[reactor->nqueues++] = (struct nvme_reactor_queue) { .cq = cq };
+
+	cq->reactor = true;
+
+	return 0;
+}
+
+struct nvme_reactor_consumer *nvme_reactor_add_consumer(struct nvme_reactor *reactor,
+							 unsigned int nentries)
+{
+	struct nvme_reactor_consumer *consumer;
+	uint32_t size = 1;
+
+	if (reactor->running) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	if (reactor->nconsumers == NVME_REACTOR_MAX_CONSUMERS) {
+		log_debug("too many consumers\n");
+
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	if (!nentries || nentries > NVME_REACTOR_RING_MAX) {
+		log_debug("invalid ring size %u\n", nentries);
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	while (size < nentries)
+		size <<= 1;
+
+	consumer = znew_aligned_t(struct nvme_reactor_consumer, 1);
+
+	consumer->ring = znew_t(struct nvme_reactor_cqe, size);
+	consumer->mask = size - 1;
+	consumer->idx = reactor->nconsumers;
+
+	reactor->consumers[reactor->nconsumers++] = consumer;
+
+	return consumer;
+}
+
+int nvme_reactor_route(struct nvme_reactor *reactor, struct nvme_sq *sq,
+		       struct nvme_reactor_consumer *consumer)
+{
+	struct nvme_reactor_queue *queue = NULL;
+
+	if (reactor->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	for (int i = 0; i < reactor->nqueues; i++) {
+		if (reactor->queues[i].cq == sq->cq) {
+			queue = &reactor->queues[i];
+			break;
+		}
+	}
+
+	if (!queue) {
+		log_debug("cq of sq %d is not owned by the reactor\n", sq->id);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (sq->id >= reactor->nroutes) {
+		reactor->routes = reallocn(reactor->routes, (unsigned int)sq->id + 1,
+					   sizeof(*reactor->routes));
+		if (!reactor->routes)
+			backtrace_abort();
+
+		memset(&reactor->routes[reactor->nroutes], 0x0,
+		       (size_t)(sq->id + 1 - reactor->nroutes) * sizeof(*reactor->routes));
+
+		reactor->nroutes = sq->id + 1;
+	}
+
+	reactor->routes[sq->id] = (struct nvme_reactor_route) {
+		.sq = sq,
+		.consumer = consumer,
+	};
+
+	queue->consumers |= 1ULL << consumer->idx;
+
+	return 0;
+}
+
+static inline uint32_t __ring_space(struct nvme_reactor_consumer *consumer, uint32_t want)
+{
+	uint32_t size = consumer->mask + 1;
+
+	if (size - (consumer->tail - consumer->head_cache) < want)
+		consumer->head_cache = atomic_load_acquire(&consumer->head);
+
+	return size - (consumer->tail - consumer->head_cache);
+}
+
+static int __reactor_reap(struct nvme_reactor *reactor, struct nvme_reactor_queue *queue)
+{
+	struct nvme_cqe *cqes[NVME_REACTOR_BATCH_MAX];
+	struct nvme_cq *cq = queue->cq;
+	uint32_t space = (uint32_t)reactor->opts.batch;
+	int n, routed = 0;
+
+	for (uint64_t m = queue->consumers; m; m &= m - 1)
+		space = min(space, __ring_space(reactor->consumers[__builtin_ctzll(m)], space));
+
+	if (!space) {
+		/* only count a stall if there is something to reap */
+		if ((le16_to_cpu(LOAD(nvme_cq_head(cq)->sfp)) & 0x1) != cq->phase)
+			reactor->stats.stalls++;
+
+		return 0;
+	}
+
+	n = nvme_cq_reap_batch(cq, cqes, (int)space);
+	if (!n)
+		return 0;
+
+	for (int i = 0; i < n; i++) {
+		uint16_t sqid = le16_to_cpu(cqes[i]->sqid);
+		struct nvme_reactor_consumer *consumer = NULL;
+		struct nvme_reactor_cqe *rec;
+		struct nvme_sq *sq = NULL;
+
+		if (sqid < reactor->nroutes) {
+			sq = reactor->routes[sqid].sq;
+			consumer = reactor->routes[sqid].consumer;
+		}
+
+		/* room was only reserved for consumers routed from this queue */
+		if (!consumer || sq->cq != cq) {
+			log_debug("discarding unrouted completion (sqid %" PRIu16 ")\n", sqid);
+
+			reactor->stats.unrouted++;
+			continue;
+		}
+
+		rec = &consumer->ring[consumer->tail & consumer->mask];
+
+		rec->rq = __nvme_rq_from_cqe(sq, cqes[i]);
+		rec->cqe = *cqes[i];
+
+		/* verify in the reaping thread, before the consumer sees the completion */
+		if (rec->rq->pi)
+			nvme_pi_complete(rec->rq->pi, &rec->cqe);
+
+		atomic_store_release(&consumer->tail, consumer->tail + 1);
+
+		routed++;
+	}
+
+	nvme_cq_update_head(cq);
+
+	reactor->stats.reaped += (uint64_t)routed;
+
+	return routed;
+}
+
+int nvme_reactor_poll(struct nvme_reactor *reactor)
+{
+	int n = 0;
+
+	for (int i = 0; i < reactor->nqueues; i++)
+		n += __reactor_reap(reactor, &reactor->queues[i]);
+
+	return n;
+}
+
+void nvme_reactor_get_stats(struct nvme_reactor *reactor, struct nvme_reactor_stats *stats)
+{
+	*stats = reactor->stats;
+}
+
+static void *reactor_thread(void *opaque)
+{
+	struct nvme_reactor *reactor = opaque;
+
+	while (!atomic_load_acquire(&reactor->stop)) {
+		if (!nvme_reactor_poll(reactor) && reactor->opts.idle_usec)
+			usleep(reactor->opts.idle_usec);
+	}
+
+	return NULL;
+}
+
+int nvme_reactor_start(struct nvme_reactor *reactor)
+{
+	pthread_attr_t attr;
+	int ret;
+
+	if (reactor->running) {
+		errno = EALREADY;
+		return -1;
+	}
+
+	pthread_attr_init(&attr);
+
+	if (reactor->opts.cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(reactor->opts.cpu, &set);
+
+		ret = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		if (ret) {
+			log_debug("could not set affinity to cpu %d\n", reactor->opts.cpu);
+			goto out;
+		}
+	}
+
+	reactor->stop = false;
+
+	ret = pthread_create(&reactor->thread, &attr, reactor_thread, reactor);
+	if (ret) {
+		log_debug("could not create reaper thread\n");
+		goto out;
+	}
+
+	reactor->running = true;
+
+out:
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+void nvme_reactor_stop(struct nvme_reactor *reactor)
+{
+	if (!reactor->running)
+		return;
+
+	atomic_store_release(&reactor->stop, true);
+
+	pthread_join(reactor->thread, NULL);
+
+	reactor->running = false;
+}
+
+int nvme_reactor_consume(struct nvme_reactor_consumer *consumer, struct nvme_reactor_cqe *out,
+			 int max)
+{
+	uint32_t head = consumer->head;
+	uint32_t n = atomic_load_acquire(&consumer->tail) - head;
+
+	if (max <= 0)
+		return 0;
+
+	n = min(n, (uint32_t)max);
+
+	for (uint32_t i = 0; i < n; i++)
+		out[i] = consumer->ring[(head + i) & consumer->mask];
+
+	atomic_store_release(&consumer->head, head + n);
+
+	return (int)n;
+}
+
+int nvme_reactor_process(struct nvme_reactor_consumer *consumer, int budget)
+{
+	struct nvme_reactor_cqe recs[NVME_REACTOR_BATCH_MAX];
+	struct nvme_sq *sq = NULL;
+	int n, processed = 0;
+
+	while (processed < budget) {
+		n = nvme_reactor_consume(consumer, recs,
+					 min_t(int, budget - processed, NVME_REACTOR_BATCH_MAX));
+		if (!n)
+			break;
+
+		for (int i = 0; i < n; i++) {
+			struct nvme_rq *rq = recs[i].rq;
+			nvme_rq_cb cb = rq->cb;
+
+			/* a duplicate or spurious entry for an idle tracker */
+			if (!cb) {
+				log_errorrl(1, (uintptr_t)rq->sq,
+					    "completion for idle cid %" PRIu16 " on sq %d\n",
+					    recs[i].cqe.cid, rq->sq->id);
+
+				continue;
+			}
+
+			if (rq->sq != sq) {
+				if (sq)
+					nvme_sq_update_tail(sq);
+
+				sq = rq->sq;
+			}
+
+			/* a callback that resubmits the request sets a new cb */
+			rq->cb = NULL;
+
+			cb(rq, &recs[i].cqe, rq->cb_arg);
+
+			if (!rq->cb)
+				nvme_rq_release(rq);
+		}
+
+		processed += n;
+	}
+
+	if (sq)
+		nvme_sq_update_tail(sq);
+
+	return processed;
+}
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+
+#include "ccan/tap/tap.h"
+
+#include "reactor.c"
+
+static uint32_t cqdb, sqdb;
+
+static struct nvme_cq cq = {
+	.id = 1,
+	.qsize = 8,
+	.doorbell = &cqdb,
+};
+
+static struct nvme_rq rqs[2][4];
+
+static struct nvme_sq sqs[2] = {
+	{ .id = 1, .qsize = 8, .doorbell = &sqdb, .cq = &cq, .rqs = rqs[0] },
+	{ .id = 2, .qsize = 8, .doorbell = &sqdb, .cq = &cq, .rqs = rqs[1] },
+};
+
+static void post_cqe(uint16_t sqid, uint16_t cid)
+{
+	static uint16_t idx;
+	static int phase = 1;
+	struct nvme_cqe *cqe = cq.vaddr + (idx << NVME_CQES);
+
+	cqe->sqid = cpu_to_le16(sqid);
+	cqe->cid = cid;
+
+	/* make the entry visible last; the reaper may be running */
+	atomic_store_release(&cqe->sfp, cpu_to_le16((uint16_t)phase));
+
+	if (++idx == cq.qsize) {
+		idx = 0;
+		phase ^= 0x1;
+	}
+}
+
+static int ncompleted;
+
+static void complete_cb(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe UNUSED, void *arg UNUSED)
+{
+	ncompleted++;
+}
+
+int main(void)
+{
+	struct nvme_reactor_consumer *c1, *c2;
+	struct nvme_reactor_cqe recs[4];
+	struct nvme_reactor_stats stats;
+	struct nvme_reactor *reactor;
+	struct nvme_timeout tmo = {};
+	struct nvme_cq tcq = { .id = 3 };
+	union nvme_cmd cmd = {};
+	int n = 0;
+
+	plan_tests(22);
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[0].vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 4; j++) {
+			rqs[i][j].sq = &sqs[i];
+			rqs[i][j].cid = (uint16_t)j;
+		}
+	}
+
+	ok1(!nvme_reactor_create(&(struct nvme_reactor_opts) { .batch = 65 }) && errno == EINVAL);
+
+	reactor = nvme_reactor_create(NULL);
+	assert(reactor);
+
+	c1 = nvme_reactor_add_consumer(reactor, 4);
+	c2 = nvme_reactor_add_consumer(reactor, 2);
+	ok1(c1 && c2);
+
+	/* the completion queue must be owned by the reactor before routing */
+	ok1(nvme_reactor_route(reactor, &sqs[0], c1) == -1 && errno == EINVAL);
+
+	/* deadlines would not be disarmed on completion */
+	tcq.tmo = &tmo;
+	ok1(nvme_reactor_add_cq(reactor, &tcq) == -1 && errno == EINVAL);
+
+	ok1(nvme_reactor_add_cq(reactor, &cq) == 0 && cq.reactor);
+	ok1(nvme_reactor_route(reactor, &sqs[0], c1) == 0);
+	ok1(nvme_reactor_route(reactor, &sqs[1], c2) == 0);
+
+	/* completions are routed by submission queue */
+	post_cqe(1, 0);
+	post_cqe(2, 3);
+	ok1(nvme_reactor_poll(reactor) == 2 && cq.head == 2 && cqdb == 2);
+
+	ok1(nvme_reactor_consume(c1, recs, 4) == 1 && recs[0].rq == &rqs[0][0]);
+	ok1(nvme_reactor_consume(c2, recs, 4) == 1 && recs[0].rq == &rqs[1][3]);
+	ok1(nvme_reactor_consume(c1, recs, 4) == 0);
+
+	/* back-pressure; reaping stops while the ring of c2 (two entries) is full */
+	post_cqe(2, 0);
+	post_cqe(2, 1);
+	post_cqe(2, 2);
+	ok1(nvme_reactor_poll(reactor) == 2 && cq.head == 4);
+	ok1(nvme_reactor_poll(reactor) == 0 && cq.head == 4);
+
+	nvme_reactor_get_stats(reactor, &stats);
+	ok1(stats.reaped == 4 && stats.stalls == 1);
+
+	ok1(nvme_reactor_consume(c2, recs, 1) == 1 && recs[0].cqe.cid == 0);
+	ok1(nvme_reactor_poll(reactor) == 1 && cq.head == 5);
+
+	/* completion callbacks; trackers are released to their queue */
+	nvme_rq_submit(&rqs[1][1], &cmd, complete_cb, NULL);
+	nvme_rq_submit(&rqs[1][2], &cmd, complete_cb, NULL);
+	ok1(nvme_reactor_process(c2, 8) == 2 && ncompleted == 2);
+	ok1(__nvme_rq_top(&sqs[1], sqs[1].rq_top) == &rqs[1][2] && rqs[1][2].rq_next == &rqs[1][1]);
+
+	/* completions for idle trackers are skipped */
+	post_cqe(2, 3);
+	ok1(nvme_reactor_poll(reactor) == 1);
+	ok1(nvme_reactor_process(c2, 8) == 1 && ncompleted == 2);
+
+	/* unrouted completions are discarded */
+	post_cqe(5, 0);
+	ok1(nvme_reactor_poll(reactor) == 0 && cq.head == 7 && reactor->stats.unrouted == 1);
+
+	/* reaper thread */
+	ok1(nvme_reactor_start(reactor) == 0);
+
+	/* the remaining free completion queue entries; more than fit in the ring */
+	for (int i = 0; i < 6; i++)
+		post_cqe(1, (uint16_t)(i % 4));
+
+	while (n < 6) {
+		int m = nvme_reactor_consume(c1, recs, 4);
+
+		for (int i = 0; i < m; i++)
+			assert(recs[i].cqe.cid == (n + i) % 4);
+
+		n += m;
+	}
+
+	nvme_reactor_destroy(reactor);
+
+	return exit_status();
+}
@@ -0,0 +1,333 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/readahead: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
+#include "ccan/time/time.h"
+
+#include "types.h"
+
+struct nvme_readahead_slot {
+	struct nvme_readahead *ra;
+	void *vaddr;
+	uint64_t iova;
+
+	/* chunk last read into the slot */
+	uint64_t slba;
+	size_t len;
+	bool done, failed;
+};
+
+int nvme_readahead_init(struct nvme_readahead *ra, struct nvme_ctrl *ctrl, struct nvme_sq **sqs,
+			int nsqs, size_t chunk, int depth)
+{
+	size_t stride = ALIGN_UP(chunk, __VFN_PAGESIZE);
+
+	if (nsqs <= 0 || !chunk || depth <= 0 ||
+	    (ctrl->config.mdts && chunk > ctrl->config.mdts)) {
+		log_debug("invalid number of queues %d, chunk size %zu or depth %d\n", nsqs, chunk,
+			  depth);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	*ra = (struct nvme_readahead) {
+		.window = max_t(int, 1, depth / 4),
+		.adaptive = true,
+		.ctrl = ctrl,
+		.nsqs = nsqs,
+		.len = stride * (size_t)depth,
+		.chunk = chunk,
+		.depth = depth,
+		.dir = 1,
+	};
+
+	if (iommu_alloc_node(__iommu_ctx(ctrl), ra->len, ctrl->numa.node, &ra->vaddr, &ra->iova)) {
+		log_debug("could not allocate buffer ring\n");
+		return -1;
+	}
+
+	ra->sqs = znew_t(struct nvme_sq *, nsqs);
+	memcpy(ra->sqs, sqs, (size_t)nsqs * sizeof(*sqs));
+
+	ra->slots = znew_t(struct nvme_readahead_slot, depth);
+
+	for (int i = 0; i < depth; i++) {
+		ra->slots[i].ra = ra;
+		ra->slots[i].vaddr = ra->vaddr + (size_t)i * stride;
+		ra->slots[i].iova = ra->iova + (size_t)i * stride;
+	}
+
+	return 0;
+}
+
+static void __ra_reap(struct nvme_readahead *ra)
+{
+	for (int i = 0; i < ra->nsqs; i++)
+		nvme_cq_process(ra->sqs[i]->cq, ra->sqs[i]->qsize);
+}
+
+void nvme_readahead_fini(struct nvme_readahead *ra)
+{
+	/* the buffers must not be released under the feet of the controller */
+	while (ra->inflight)
+		__ra_reap(ra);
+
+	iommu_free(__iommu_ctx(ra->ctrl), ra->vaddr, ra->len);
+	free(ra->slots);
+	free(ra->sqs);
+
+	memset(ra, 0x0, sizeof(*ra));
+}
+
+/* move the window one step in the current direction, given the bandwidth of an epoch */
+static void __ra_step(struct nvme_readahead *ra, uint64_t bw)
+{
+	int step = max_t(int, 1, ra->window / 8);
+
+	/*
+	 * Keep going while the bandwidth improves and turn around when it
+	 * drops. If it did not change, the same is had with fewer reads in
+	 * flight.
+	 */
+	if (bw + bw / 16 < ra->bw)
+		ra->dir = -ra->dir;
+	else if (bw <= ra->bw + ra->bw / 16)
+		ra->dir = -1;
+
+	ra->bw = bw;
+	ra->window = clamp_t(int, ra->window + ra->dir * step, 1, ra->depth);
+}
+
+static void __ra_adapt(struct nvme_readahead *ra, size_t len)
+{
+	uint64_t now, ticks;
+
+	ra->epoch_bytes += len;
+
+	if (++ra->epoch_n < ra->window)
+		return;
+
+	now = get_ticks();
+	ticks = max_t(uint64_t, now - ra->epoch_start, 1);
+
+	/* only compared to each other, so the unit does not matter */
+	__ra_step(ra, (ra->epoch_bytes << 10) / ticks);
+
+	ra->epoch_start = now;
+	ra->epoch_bytes = 0;
+	ra->epoch_n = 0;
+}
+
+static void __ra_complete(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *arg)
+{
+	struct nvme_readahead_slot *slot = arg;
+	struct nvme_readahead *ra = slot->ra;
+
+	slot->done = true;
+	ra->inflight--;
+
+	if (!nvme_cqe_ok(cqe)) {
+		log_debug("read of slba 0x%" PRIx64 " failed (sfp 0x%" PRIx16 ")\n", slot->slba,
+			  le16_to_cpu(cqe->sfp));
+
+		slot->failed = true;
+
+		/* stop reading ahead; the chunks before it are still handed out */
+		if (!ra->err)
+			ra->err = EIO;
+
+		return;
+	}
+
+	if (ra->adaptive)
+		__ra_adapt(ra, slot->len);
+}
+
+/* acquire a tracker from the next submission queue that has one */
+static struct nvme_rq *__ra_acquire(struct nvme_readahead *ra)
+{
+	for (int n = 0; n < ra->nsqs; n++) {
+		struct nvme_sq *sq = ra->sqs[ra->next_sq];
+
+		ra->next_sq = (ra->next_sq + 1) % ra->nsqs;
+
+		if (__nvme_rq_top(sq, sq->rq_top))
+			return nvme_rq_acquire(sq);
+	}
+
+	return NULL;
+}
+
+/* submit reads for the following chunks into the free slots */
+static void __ra_refill(struct nvme_readahead *ra)
+{
+	int window = min_t(int, ra->window, ra->depth);
+
+	while (!ra->err && ra->inflight < window && ra->held + ra->queued < ra->depth &&
+	       ra->next < ra->end) {
+		int i = (ra->tail + ra->held + ra->queued) % ra->depth;
+		struct nvme_readahead_slot *slot = &ra->slots[i];
+		uint64_t nlb = min_t(uint64_t, ra->chunk >> ra->ns->lbads, ra->end - ra->next);
+		union nvme_cmd cmd;
+		struct nvme_rq *rq;
+
+		/* all queues are full; try again on the next call */
+		rq = __ra_acquire(ra);
+		if (!rq)
+			break;
+
+		slot->slba = ra->next;
+		slot->len = (size_t)nlb << ra->ns->lbads;
+		slot->done = slot->failed = false;
+
+		if (nvme_ns_prep_rw(ra->ns, &cmd, NVME_NVM_READ, slot->slba, slot->len) ||
+		    nvme_rq_map_prp(ra->ctrl, rq, &cmd, slot->iova, slot->len)) {
+			nvme_rq_release(rq);
+
+			/* the prp list page pool is exhausted; try again later as well */
+			if (errno != EBUSY)
+				ra->err = errno;
+
+			break;
+		}
+
+		nvme_rq_submit(rq, &cmd, __ra_complete, slot);
+
+		ra->next += nlb;
+		ra->queued++;
+		ra->inflight++;
+	}
+
+	for (int i = 0; i < ra->nsqs; i++)
+		nvme_sq_update_tail(ra->sqs[i]);
+}
+
+int nvme_readahead_start(struct nvme_readahead *ra, uint32_t nsid, uint64_t slba, uint64_t nlb)
+{
+	struct nvme_ns *ns = nvme_ns_get(ra->ctrl, nsid);
+
+	if (ra->inflight || ra->held) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (!ns || ra->chunk & ((1ULL << ns->lbads) - 1) || ra->chunk < (1ULL << ns->lbads) ||
+	    (ra->chunk >> ns->lbads) > ns->max_nlb) {
+		log_debug("chunk size %zu is invalid for nsid %" PRIu32 "\n", ra->chunk, nsid);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!nlb || slba >= ns->nsze || nlb > ns->nsze - slba) {
+		log_debug("invalid range (slba 0x%" PRIx64 " nlb %" PRIu64 ")\n", slba, nlb);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* chunks read ahead of an earlier read are dropped */
+	ra->ns = ns;
+	ra->tail = ra->queued = 0;
+	ra->next = slba;
+	ra->end = slba + nlb;
+	ra->err = 0;
+
+	ra->epoch_start = get_ticks();
+	ra->epoch_bytes = 0;
+	ra->epoch_n = 0;
+
+	__ra_refill(ra);
+
+	if (ra->err && !ra->queued) {
+		ra->next = ra->end;
+
+		errno = ra->err;
+		return -1;
+	}
+
+	return 0;
+}
+
+ssize_t nvme_readahead_next(struct nvme_readahead *ra, void **buf)
+{
+	struct nvme_readahead_slot *slot;
+
+	__ra_reap(ra);
+	__ra_refill(ra);
+
+	if (!ra->queued) {
+		if (ra->err) {
+			errno = ra->err;
+			return -1;
+		}
+
+		if (ra->next == ra->end) {
+			errno = ENODATA;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/* hand out in order; later chunks wait in their slots */
+	slot = &ra->slots[(ra->tail + ra->held) % ra->depth];
+
+	if (!slot->done)
+		return 0;
+
+	if (slot->failed) {
+		errno = EIO;
+		return -1;
+	}
+
+	ra->queued--;
+	ra->held++;
+
+	*buf = slot->vaddr;
+
+	return (ssize_t)slot->len;
+}
+
+void nvme_readahead_release(struct nvme_readahead *ra)
+{
+	if (!ra->held)
+		return;
+
+	ra->tail = (ra->tail + 1) % ra->depth;
+	ra->held--;
+
+	__ra_refill(ra);
+}
@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "readahead.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+int iommu_alloc_node(struct iommu_ctx *ctx UNUSED, size_t len, int node UNUSED, void **vaddr,
+		     uint64_t *iova)
+{
+	if (pgmap(vaddr, len) < 0)
+		return -1;
+
+	*iova = (uint64_t)*vaddr;
+
+	return 0;
+}
+
+void iommu_free(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len)
+{
+	pgunmap(vaddr, len);
+}
+
+#define SQSIZE 4
+#define CQSIZE 64
+#define CHUNK 4096
+#define DEPTH 4
+
+static uint32_t doorbells[3];
+static struct nvme_sq sqs[3];
+static struct nvme_cq cq;
+static struct nvme_rq rqs[3][SQSIZE - 1];
+static uint16_t cqtail;
+
+static struct nvme_readahead ra;
+
+/* complete the read of the chunk starting at @slba */
+static void complete(uint64_t slba, uint16_t status)
+{
+	struct nvme_cqe *cqe = cq.vaddr + (cqtail++ << NVME_CQES);
+
+	for (int q = 1; q < 3; q++) {
+		for (int i = 0; i < SQSIZE - 1; i++) {
+			struct nvme_rq *rq = &rqs[q][i];
+			struct nvme_readahead_slot *slot = rq->cb_arg;
+
+			if (!rq->cb || slot->slba != slba)
+				continue;
+
+			cqe->sqid = cpu_to_le16((uint16_t)q);
+			cqe->cid = rq->cid;
+			cqe->sfp = cpu_to_le16((uint16_t)(status << 1 | 0x1));
+
+			return;
+		}
+	}
+
+	assert(false);
+}
+
+/* starting lba of the command last posted to @sq */
+static uint64_t last_slba(struct nvme_sq *sq)
+{
+	union nvme_cmd *cmd = sq->vaddr + (((sq->tail + sq->qsize - 1) % sq->qsize) << NVME_SQES);
+
+	return le64_to_cpu(cmd->rw.slba);
+}
+
+static void test_step(void)
+{
+	struct nvme_readahead r = { .window = 8, .depth = 64, .dir = 1 };
+
+	/* grow while the bandwidth improves */
+	__ra_step(&r, 100);
+	__ra_step(&r, 200);
+
+	ok1(r.window == 10 && r.dir == 1);
+
+	/* back off when it does not, and turn around when it drops */
+	__ra_step(&r, 201);
+	__ra_step(&r, 100);
+
+	ok1(r.window == 10 && r.dir == 1);
+
+	/* bounded by the ring */
+	r.window = 63;
+	__ra_step(&r, 1000);
+
+	ok1(r.window == 64);
+}
+
+int main(void)
+{
+	struct nvme_ns ns = { .nsid = 1, .nsze = 64, .lbads = 9, .max_nlb = 256 };
+	struct nvme_ctrl ctrl = { .ns = &ns, .nns = 1 };
+	struct nvme_sq *rsqs[] = { &sqs[1], &sqs[2] };
+	void *buf[3];
+
+	plan_tests(14);
+
+	cq = (struct nvme_cq) {
+		.qsize = CQSIZE,
+		.doorbell = &doorbells[0],
+		.nsqs = 3,
+		.sqs = sqs,
+	};
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int q = 1; q < 3; q++) {
+		sqs[q] = (struct nvme_sq) {
+			.id = q,
+			.qsize = SQSIZE,
+			.doorbell = &doorbells[q],
+			.cq = &cq,
+			.rqs = rqs[q],
+		};
+		sqs[q].rq_top = __nvme_rq_top_set(&sqs[q], 0, &rqs[q][SQSIZE - 2]);
+
+		assert(pgmap(&sqs[q].vaddr, __VFN_PAGESIZE) > 0);
+
+		for (int i = 0; i < SQSIZE - 1; i++) {
+			rqs[q][i].sq = &sqs[q];
+			rqs[q][i].cid = (uint16_t)i;
+
+			if (i > 0)
+				rqs[q][i].rq_next = &rqs[q][i - 1];
+		}
+	}
+
+	ok1(nvme_readahead_init(&ra, &ctrl, rsqs, 2, 0, DEPTH) == -1 && errno == EINVAL);
+	ok1(nvme_readahead_init(&ra, &ctrl, rsqs, 2, CHUNK, DEPTH) == 0 && ra.window == 1 &&
+	    ra.adaptive);
+
+	ok1(nvme_readahead_start(&ra, 2, 0, 8) == -1 && errno == EINVAL &&
+	    nvme_readahead_start(&ra, 1, 60, 8) == -1 && errno == EINVAL);
+
+	/* three full chunks and a short one, round-robin over the queues */
+	ra.adaptive = false;
+	ra.window = 3;
+
+	ok1(nvme_readahead_start(&ra, 1, 0, 28) == 0 && ra.inflight == 3 &&
+	    sqs[1].tail == 2 && sqs[2].tail == 1 && last_slba(&sqs[1]) == 16 &&
+	    last_slba(&sqs[2]) == 8 && doorbells[1] == 2 && doorbells[2] == 1);
+
+	/* handed out in order, in the buffers of the ring */
+	complete(8, 0);
+
+	ok1(nvme_readahead_next(&ra, &buf[0]) == 0);
+
+	complete(0, 0);
+
+	ok1(nvme_readahead_next(&ra, &buf[0]) == CHUNK && buf[0] == ra.vaddr &&
+	    nvme_readahead_next(&ra, &buf[1]) == CHUNK && buf[1] == ra.vaddr + CHUNK);
+
+	/* the last chunk went into the free slot */
+	ok1(ra.held == 2 && ra.inflight == 2 && last_slba(&sqs[2]) == 24 &&
+	    nvme_readahead_next(&ra, &buf[2]) == 0);
+
+	/* a failed read ends the stream */
+	complete(16, NVME_SC_INVALID_FIELD);
+	complete(24, 0);
+
+	ok1(nvme_readahead_next(&ra, &buf[2]) == -1 && errno == EIO && !ra.inflight);
+	ok1(nvme_readahead_start(&ra, 1, 0, 8) == -1 && errno == EBUSY);
+
+	nvme_readahead_release(&ra);
+	nvme_readahead_release(&ra);
+
+	/* a new read starts over in the ring and ends with the range */
+	ok1(nvme_readahead_start(&ra, 1, 32, 8) == 0 && ra.inflight == 1);
+
+	complete(32, 0);
+
+	ok1(nvme_readahead_next(&ra, &buf[0]) == CHUNK && buf[0] == ra.vaddr &&
+	    nvme_readahead_next(&ra, &buf[1]) == -1 && errno == ENODATA);
+
+	nvme_readahead_release(&ra);
+	nvme_readahead_fini(&ra);
+
+	test_step();
+
+	return exit_status();
+}
@@ -0,0 +1,603 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/recover: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "types.h"
+
+/* an outstanding command captured before the reset */
+struct recover_cmd {
+	struct nvme_rq *rq;
+	union nvme_cmd cmd;
+
+	/* @cmd holds the command as posted */
+	bool intact;
+
+	/* posted without a completion callback (see __tag_posted()) */
+	bool posted;
+};
+
+/* an outstanding admin command, failed once the admin queue is reset */
+struct recover_admin {
+	struct nvme_rq *rq;
+	nvme_rq_cb cb;
+	void *cb_arg;
+};
+
+/* never written entries; a Flush must specify a namespace */
+static inline bool __sqe_unused(union nvme_cmd *sqe)
+{
+	return !sqe->opcode && !sqe->nsid;
+}
+
+/* placeholder callbacks of the trackers tagged by __tag_posted() */
+static void __posted_done(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe UNUSED,
+			  void *opaque UNUSED)
+{
+}
+
+static void __posted(struct nvme_rq *rq, struct nvme_cqe *cqe UNUSED, void *opaque UNUSED)
+{
+	/* completed before the reset; the tracker stays with its owner */
+	rq->cb = __posted_done;
+}
+
+static void __mark_free(bool *free, struct nvme_rq *rq)
+{
+	for (; rq; rq = rq->rq_next)
+		free[rq->cid] = true;
+}
+
+/*
+ * Commands posted without a completion callback (nvme_rq_post(), nvme_rq_exec())
+ * are waited for by polling the completion queue, so their trackers cannot be
+ * told apart from idle ones by the callback. Tag the trackers of @sq that are
+ * neither free nor cached with a placeholder callback, such that draining the
+ * completion queue tells which of them completed and __capture() finds the
+ * others.
+ */
+static void __tag_posted(struct nvme_sq *sq)
+{
+	int n = sq->qsize - 1, ncaches = 0;
+	__autofree bool *free = znew_t(bool, n);
+	__autofree struct nvme_rq_cache **caches = new_t(struct nvme_rq_cache *, n);
+
+	__mark_free(free, __nvme_rq_top(sq, sq->rq_top));
+
+	for (int i = 0; i < n; i++) {
+		struct nvme_rq_cache *cache = sq->rqs[i].cache;
+		int j;
+
+		if (!cache)
+			continue;
+
+		for (j = 0; j < ncaches && caches[j] != cache; j++)
+			;
+
+		if (j < ncaches)
+			continue;
+
+		caches[ncaches++] = cache;
+
+		__mark_free(free, cache->free);
+		__mark_free(free, atomic_load_acquire(&cache->remote));
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+
+		if (!rq->cb && !free[i]) {
+			rq->cb = __posted;
+			rq->cb_arg = NULL;
+		}
+	}
+}
+
+/*
+ * Capture the commands outstanding (request trackers with a completion
+ * callback, or tagged by __tag_posted()) on @sq and return the number captured.
+ *
+ * The ring holds the last qsize commands posted, so scanning it backwards from
+ * the tail finds the most recent posting of each command identifier first. An
+ * outstanding command whose entry was since overwritten (the controller fetched
+ * it and the slot was reused) is not found and cannot be resubmitted.
+ */
+static int __capture(struct nvme_sq *sq, struct recover_cmd *cap)
+{
+	struct nvme_timeout *tmo = sq->cq->tmo;
+	__autofree int *slot = new_t(int, sq->qsize - 1);
+	int n = 0;
+
+	for (int i = 0; i < sq->qsize - 1; i++)
+		slot[i] = -1;
+
+	for (int i = 1; i <= sq->qsize; i++) {
+		int idx = (sq->tail + sq->qsize - i) % sq->qsize;
+		union nvme_cmd *sqe = sq->vaddr + (idx << NVME_SQES);
+
+		if (__sqe_unused(sqe) || sqe->cid >= sq->qsize - 1 || slot[sqe->cid] != -1)
+			continue;
+
+		slot[sqe->cid] = idx;
+	}
+
+	for (int i = 0; i < sq->qsize - 1; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+		bool posted = rq->cb == __posted;
+
+		if (!rq->cb)
+			continue;
+
+		/* the completion was drained; the owner polls for it in vain */
+		if (rq->cb == __posted_done) {
+			log_info("sqid %d cid %d completed without a callback to deliver it to\n",
+				 sq->id, i);
+
+			rq->cb = NULL;
+			continue;
+		}
+
+		/* acquired but never posted (or its entry was overwritten) */
+		if (posted && slot[i] == -1) {
+			rq->cb = NULL;
+			continue;
+		}
+
+		cap[n] = (struct recover_cmd) { .rq = rq, .posted = posted };
+
+		/* a command that timed out is held until it completes; never resubmit it */
+		if (slot[i] != -1 && (posted || !(tmo && !rq->tmo_pprev))) {
+			cap[n].cmd = *(union nvme_cmd *)(sq->vaddr + (slot[i] << NVME_SQES));
+			cap[n].intact = true;
+		}
+
+		n++;
+	}
+
+	return n;
+}
+
+static void __resubmit(struct recover_cmd *c)
+{
+	struct nvme_rq *rq = c->rq;
+	struct nvme_timeout *tmo = rq->sq->cq->tmo;
+
+	/* the owner polls for the completion; no deadline is tracked */
+	if (c->posted) {
+		rq->cb = NULL;
+	} else if (tmo) {
+		__nvme_timeout_del(tmo, rq);
+
+		rq->tmo_expires = (get_ticks() >> tmo->shift) + tmo->timeout;
+		__nvme_timeout_add(tmo, rq);
+	}
+
+	nvme_sq_post(rq->sq, &c->cmd);
+}
+
+/* complete the command like nvme_cq_process() would */
+static void __fail(struct recover_cmd *c)
+{
+	struct nvme_rq *rq = c->rq;
+	struct nvme_timeout *tmo = rq->sq->cq->tmo;
+	struct nvme_cqe cqe = {
+		.sqid = cpu_to_le16((uint16_t)rq->sq->id),
+		.cid = rq->cid,
+		.sfp = cpu_to_le16(NVME_SC_ABORT_SQ_DELETION << 1),
+	};
+	nvme_rq_cb cb = rq->cb;
+
+	/* nothing to complete it to; the owner must stop polling for it */
+	if (c->posted) {
+		log_info("sqid %d cid %" PRIu16 " posted without a callback is not resubmitted\n",
+			 rq->sq->id, rq->cid);
+
+		rq->cb = NULL;
+		return;
+	}
+
+	if (tmo)
+		__nvme_timeout_del(tmo, rq);
+
+	/* a callback that resubmits the request sets a new cb */
+	rq->cb = NULL;
+
+	cb(rq, &cqe, rq->cb_arg);
+
+	if (!rq->cb)
+		nvme_rq_release(rq);
+}
+
+static void __reset_cq(struct nvme_cq *cq)
+{
+	memset(cq->vaddr, 0x0, (size_t)cq->qsize << NVME_CQES);
+
+	cq->head = cq->phead = 0;
+	cq->phase = 0;
+}
+
+static void __reset_sq(struct nvme_sq *sq)
+{
+	memset(sq->vaddr, 0x0, (size_t)sq->qsize << NVME_SQES);
+
+	sq->tail = sq->ptail = sq->head = 0;
+}
+
+/*
+ * Admin commands are not recovered. The outstanding ones (trackers with a
+ * completion callback) are captured in @cap, to be failed once the controller
+ * is enabled again (and then released); the others (asynchronous
+ * event requests) are returned to the free list. Returns the number captured.
+ */
+static int __reset_adminq(struct nvme_ctrl *ctrl, struct recover_admin *cap)
+{
+	struct nvme_sq *sq = ctrl->adminq.sq;
+	struct nvme_cq *cq = ctrl->adminq.cq;
+	__autofree bool *free = znew_t(bool, sq->qsize - 1);
+	uint32_t aqa;
+	int n = 0;
+
+	/* keep waiters reaping the queue out while it is reset */
+	nvme_cq_lock(cq);
+
+	__mark_free(free, __nvme_rq_top(sq, sq->rq_top));
+
+	for (int i = 0; i < sq->qsize - 1; i++) {
+		struct nvme_rq *rq = &sq->rqs[i];
+
+		if (rq->cb) {
+			cap[n++] = (struct recover_admin) {
+				.rq = rq, .cb = rq->cb, .cb_arg = rq->cb_arg,
+			};
+
+			rq->cb = NULL;
+		} else if (!free[i]) {
+			nvme_rq_reset(rq);
+			nvme_rq_release_atomic(rq);
+		}
+	}
+
+	__reset_cq(cq);
+	__reset_sq(sq);
+
+	nvme_cq_unlock(cq);
+
+	aqa = (uint32_t)sq->qsize - 1;
+	aqa |= aqa << 16;
+
+	mmio_write32(ctrl->regs + NVME_REG_AQA, cpu_to_le32(aqa));
+	mmio_hl_write64(ctrl->regs + NVME_REG_ASQ, cpu_to_le64(sq->iova));
+	mmio_hl_write64(ctrl->regs + NVME_REG_ACQ, cpu_to_le64(cq->iova));
+
+	return n;
+}
+
+/* complete the admin command like the admin queue reaper would */
+static void __fail_admin(struct recover_admin *c)
+{
+	struct nvme_cqe cqe = {
+		.cid = c->rq->cid,
+		.sfp = cpu_to_le16(NVME_SC_ABORT_SQ_DELETION << 1),
+	};
+
+	c->cb(c->rq, &cqe, c->cb_arg);
+
+	if (!c->rq->cb)
+		nvme_rq_release_atomic(c->rq);
+}
+
+/* the reset disables the controller memory space; enable it at the same address */
+static void __cmb(struct nvme_ctrl *ctrl)
+{
+	if (!ctrl->cmb.vaddr || !NVME_FIELD_GET(ctrl->reg.cap, CAP_CMBS))
+		return;
+
+	mmio_hl_write64(ctrl->regs + NVME_REG_CMBMSC,
+			cpu_to_le64(ctrl->cmb.iova | NVME_CMBMSC_CMSE | NVME_CMBMSC_CRE));
+}
+
+static int __set_nrqs(struct nvme_ctrl *ctrl)
+{
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+	struct nvme_cqe cqe;
+	uint32_t dw0;
+
+	cmd.features.fid = NVME_FEAT_FID_NUM_QUEUES;
+	cmd.features.cdw11 = cpu_to_le32(
+		NVME_FIELD_SET(ctrl->opts.nsqr, FEAT_NRQS_NSQR) |
+		NVME_FIELD_SET(ctrl->opts.ncqr, FEAT_NRQS_NCQR));
+
+	if (nvme_admin(ctrl, &cmd, NULL, 0, &cqe))
+		return -1;
+
+	dw0 = le32_to_cpu(cqe.dw0);
+
+	/* the queues to be re-created must still be available */
+	if ((int)NVME_FIELD_GET(dw0, FEAT_NRQS_NSQR) < ctrl->config.nsqa ||
+	    (int)NVME_FIELD_GET(dw0, FEAT_NRQS_NCQR) < ctrl->config.ncqa) {
+		log_debug("controller allocated fewer queues than before\n");
+
+		errno = ENOSPC;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* re-enable the shadow doorbells with the same (zeroed) buffers */
+static int __dbconfig(struct nvme_ctrl *ctrl)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+	uint64_t prp1, prp2;
+	union nvme_cmd cmd;
+
+	memset(ctrl->dbbuf.doorbells, 0x0, __VFN_PAGESIZE);
+	memset(ctrl->dbbuf.eventidxs, 0x0, __VFN_PAGESIZE);
+
+	if (!iommu_translate_vaddr(ctx, ctrl->dbbuf.doorbells, &prp1) ||
+	    !iommu_translate_vaddr(ctx, ctrl->dbbuf.eventidxs, &prp2)) {
+		log_debug("doorbell buffers are not mapped\n");
+
+		errno = EFAULT;
+		return -1;
+	}
+
+	cmd = (union nvme_cmd) {
+		.opcode = NVME_ADMIN_DBCONFIG,
+		.dptr.prp1 = cpu_to_le64(prp1),
+		.dptr.prp2 = cpu_to_le64(prp2),
+	};
+
+	return nvme_admin(ctrl, &cmd, NULL, 0, NULL);
+}
+
+/* hand the host memory buffer back to the controller with its contents retained */
+static int __hmb(struct nvme_ctrl *ctrl)
+{
+	size_t mps = __mps_to_pagesize(ctrl->config.mps);
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+
+	cmd.features.fid = NVME_FEAT_FID_HOST_MEM_BUF;
+	cmd.features.cdw11 = cpu_to_le32(NVME_FIELD_SET(1, FEAT_HMB_EHM) |
+					 NVME_FIELD_SET(1, FEAT_HMB_MR));
+	cmd.features.cdw12 = cpu_to_le32((uint32_t)(ctrl->hmb.len / mps));
+	cmd.features.cdw13 = cpu_to_le32((uint32_t)ctrl->hmb.descs_iova);
+	cmd.features.cdw14 = cpu_to_le32((uint32_t)(ctrl->hmb.descs_iova >> 32));
+	cmd.features.cdw15 = cpu_to_le32((uint32_t)ctrl->hmb.nchunks);
+
+	return nvme_admin(ctrl, &cmd, NULL, 0, NULL);
+}
+
+static int __create_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq)
+{
+	union nvme_cmd cmd;
+	uint16_t qflags = NVME_Q_PC;
+	uint16_t iv = 0;
+
+	if (cq->vector != -1) {
+		qflags |= NVME_CQ_IEN;
+		iv = (uint16_t)cq->vector;
+	}
+
+	cmd.create_cq = (struct nvme_cmd_create_cq) {
+		.opcode = NVME_ADMIN_CREATE_CQ,
+		.prp1   = cpu_to_le64(cq->iova),
+		.qid    = cpu_to_le16((uint16_t)cq->id),
+		.qsize  = cpu_to_le16((uint16_t)(cq->qsize - 1)),
+		.qflags = cpu_to_le16(qflags),
+		.iv     = cpu_to_le16(iv),
+	};
+
+	return nvme_admin(ctrl, &cmd, NULL, 0, NULL);
+}
+
+static int __create_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq)
+{
+	union nvme_cmd cmd;
+
+	cmd.create_sq = (struct nvme_cmd_create_sq) {
+		.opcode = NVME_ADMIN_CREATE_SQ,
+		.prp1   = cpu_to_le64(sq->iova),
+		.qid    = cpu_to_le16((uint16_t)sq->id),
+		.qsize  = cpu_to_le16((uint16_t)(sq->qsize - 1)),
+		.qflags = cpu_to_le16(NVME_Q_PC | sq->qprio),
+		.cqid   = cpu_to_le16((uint16_t)sq->cq->id),
+	};
+
+	return nvme_admin(ctrl, &cmd, NULL, 0, NULL);
+}
+
+/*
+ * Bring the controller back up with the existing queue memory. The admin
+ * commands outstanding when the admin queue was reset are captured in @admin.
+ */
+static int __restart(struct nvme_ctrl *ctrl, struct recover_admin *admin, int *nadmin)
+{
+	int nsqs = ctrl->opts.nsqr + 2, ncqs = ctrl->opts.ncqr + 2;
+	uint32_t csts;
+
+	csts = le32_to_cpu(mmio_read32(ctrl->regs + NVME_REG_CSTS));
+
+	/* all ones if the device is not responding */
+	if (csts == 0xffffffff)
+		log_info("controller is not responding; resetting\n");
+	else if (NVME_FIELD_GET(csts, CSTS_CFS))
+		log_info("controller fatal status; resetting\n");
+
+	if (nvme_reset_escalate(ctrl, NVME_RESET_AUTO) < 0) {
+		log_debug("could not reset controller\n");
+		return -1;
+	}
+
+	/* before the queues in the controller memory buffer are referenced */
+	__cmb(ctrl);
+
+	*nadmin = __reset_adminq(ctrl, admin);
+
+	if (nvme_enable(ctrl)) {
+		log_debug("could not enable controller\n");
+		return -1;
+	}
+
+	if (__set_nrqs(ctrl)) {
+		log_debug("could not set number of queues\n");
+		return -1;
+	}
+
+	/* features are reset along with the controller */
+	if (ctrl->config.wrr) {
+		struct nvme_arb_opts *arb = &ctrl->opts.arb;
+
+		if (nvme_set_arbitration(ctrl, arb->ab, arb->lpw, arb->mpw, arb->hpw)) {
+			log_debug("could not set arbitration\n");
+			return -1;
+		}
+	}
+
+	if (ctrl->dbbuf.doorbells && __dbconfig(ctrl)) {
+		log_debug("could not configure doorbell buffers\n");
+		return -1;
+	}
+
+	if (nvme_set_power_policy(ctrl, &ctrl->opts.power))
+		log_info("could not apply power state policy\n");
+
+	/* not fatal; the controller works without it, only slower */
+	ctrl->hmb.enabled = false;
+
+	if (ctrl->hmb.nchunks) {
+		if (__hmb(ctrl))
+			log_info("could not re-enable host memory buffer\n");
+		else
+			ctrl->hmb.enabled = true;
+	}
+
+	for (int qid = 1; qid < ncqs; qid++) {
+		struct nvme_cq *cq = &ctrl->cq[qid];
+
+		if (!cq->vaddr)
+			continue;
+
+		__reset_cq(cq);
+
+		if (__create_cq(ctrl, cq)) {
+			log_debug("could not create io completion queue %d\n", qid);
+			return -1;
+		}
+	}
+
+	for (int qid = 1; qid < nsqs; qid++) {
+		struct nvme_sq *sq = &ctrl->sq[qid];
+
+		if (!sq->vaddr)
+			continue;
+
+		__reset_sq(sq);
+
+		if (__create_sq(ctrl, sq)) {
+			log_debug("could not create io submission queue %d\n", qid);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int nvme_recover(struct nvme_ctrl *ctrl, enum nvme_recover_policy policy)
+{
+	int nsqs = ctrl->opts.nsqr + 2, ncqs = ctrl->opts.ncqr + 2;
+	__autofree struct recover_cmd *cap = NULL;
+	__autofree struct recover_admin *admin = NULL;
+	int ncap = 0, nadmin = 0, total = 0, ret, err;
+
+	for (int qid = 1; qid < nsqs; qid++) {
+		if (ctrl->sq[qid].vaddr)
+			__tag_posted(&ctrl->sq[qid]);
+	}
+
+	/* commands that the controller completed need not be recovered */
+	for (int qid = 1; qid < ncqs; qid++) {
+		struct nvme_cq *cq = &ctrl->cq[qid];
+
+		if (cq->vaddr)
+			__nvme_cq_process(cq, cq->qsize);
+	}
+
+	for (int qid = 1; qid < nsqs; qid++) {
+		if (ctrl->sq[qid].vaddr)
+			total += ctrl->sq[qid].qsize - 1;
+	}
+
+	if (total) {
+		cap = new_t(struct recover_cmd, total);
+
+		for (int qid = 1; qid < nsqs; qid++) {
+			if (ctrl->sq[qid].vaddr)
+				ncap += __capture(&ctrl->sq[qid], &cap[ncap]);
+		}
+	}
+
+	log_info("recovering controller with %d outstanding commands\n", ncap);
+
+	admin = new_t(struct recover_admin, ctrl->adminq.sq->qsize - 1);
+
+	ret = __restart(ctrl, admin, &nadmin);
+	err = errno;
+
+	for (int i = 0; i < nadmin; i++)
+		__fail_admin(&admin[i]);
+
+	for (int i = 0; i < ncap; i++) {
+		if (!ret && policy == NVME_RECOVER_RESUBMIT && cap[i].intact)
+			__resubmit(&cap[i]);
+		else
+			__fail(&cap[i]);
+	}
+
+	for (int qid = 1; qid < nsqs; qid++) {
+		if (ctrl->sq[qid].vaddr)
+			nvme_sq_flush_tail(&ctrl->sq[qid]);
+	}
+
+	if (ret)
+		errno = err;
+
+	return ret;
+}
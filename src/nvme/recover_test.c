@@ -0,0 +1,315 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "recover.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int nvme_set_errno_from_cqe(struct nvme_cqe *cqe)
+{
+	errno = le16_to_cpu(cqe->sfp) >> 1 ? EIO : 0;
+
+	return errno ? -1 : 0;
+}
+
+static int nresets, nenables;
+
+int nvme_reset_escalate(struct nvme_ctrl *ctrl UNUSED, enum nvme_reset_type type UNUSED)
+{
+	nresets++;
+
+	return NVME_RESET_CONTROLLER;
+}
+
+int nvme_enable(struct nvme_ctrl *ctrl UNUSED)
+{
+	nenables++;
+
+	return 0;
+}
+
+static int npower;
+
+int nvme_set_power_policy(struct nvme_ctrl *ctrl UNUSED,
+			  const struct nvme_power_opts *opts UNUSED)
+{
+	npower++;
+
+	return 0;
+}
+
+static union nvme_cmd admin[8];
+static int nadmin;
+
+int nvme_admin(struct nvme_ctrl *ctrl UNUSED, union nvme_cmd *sqe, void *buf UNUSED,
+	       size_t len UNUSED, struct nvme_cqe *cqe_copy)
+{
+	admin[nadmin++] = *sqe;
+
+	/* one i/o queue pair allocated */
+	if (cqe_copy)
+		*cqe_copy = (struct nvme_cqe) { .dw0 = 0 };
+
+	return 0;
+}
+
+int nvme_admin_process(struct nvme_ctrl *ctrl UNUSED)
+{
+	return 0;
+}
+
+static uint8_t arb[4];
+static int narb;
+
+int nvme_set_arbitration(struct nvme_ctrl *ctrl UNUSED, uint8_t ab, uint8_t lpw, uint8_t mpw,
+			 uint8_t hpw)
+{
+	arb[0] = ab;
+	arb[1] = lpw;
+	arb[2] = mpw;
+	arb[3] = hpw;
+
+	narb++;
+
+	return 0;
+}
+
+static int ncompleted, nfailed, nresubmit;
+static uint16_t status[8];
+
+static void complete_cb(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg UNUSED)
+{
+	status[rq->cid] = le16_to_cpu(cqe->sfp) >> 1;
+
+	if (!status[rq->cid]) {
+		ncompleted++;
+		return;
+	}
+
+	nfailed++;
+
+	/* resubmit from the callback */
+	if (nresubmit) {
+		union nvme_cmd cmd = { .opcode = 0x2, .nsid = cpu_to_le32(1) };
+
+		nresubmit--;
+
+		nvme_rq_submit(rq, &cmd, complete_cb, NULL);
+	}
+}
+
+static uint16_t admin_status;
+
+static void admin_cb(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *arg UNUSED)
+{
+	admin_status = le16_to_cpu(cqe->sfp) >> 1;
+}
+
+static int nfree(struct nvme_sq *sq)
+{
+	int n = 0;
+
+	for (struct nvme_rq *rq = __nvme_rq_top(sq, sq->rq_top); rq; rq = rq->rq_next)
+		n++;
+
+	return n;
+}
+
+static void post_cqe(struct nvme_cq *cq, uint16_t idx, uint16_t sqid, uint16_t cid)
+{
+	struct nvme_cqe *cqe = cq->vaddr + (idx << NVME_CQES);
+
+	cqe->sqid = cpu_to_le16(sqid);
+	cqe->cid = cid;
+	cqe->sfp = cpu_to_le16(0x1);
+}
+
+static void init_sq(struct nvme_sq *sq, int id, int qsize, struct nvme_cq *cq, uint32_t *db)
+{
+	*sq = (struct nvme_sq) { .id = id, .qsize = qsize, .doorbell = db, .cq = cq };
+
+	sq->rqs = znew_t(struct nvme_rq, qsize - 1);
+
+	assert(pgmap(&sq->vaddr, __VFN_PAGESIZE) > 0);
+	sq->iova = (uint64_t)sq->vaddr;
+
+	for (int i = qsize - 2; i >= 0; i--) {
+		sq->rqs[i].sq = sq;
+		sq->rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&sq->rqs[i]);
+	}
+}
+
+static void init_cq(struct nvme_cq *cq, int id, int qsize, struct nvme_sq *sqs, uint32_t *db)
+{
+	*cq = (struct nvme_cq) {
+		.id = id, .qsize = qsize, .doorbell = db, .vector = -1, .nsqs = 2, .sqs = sqs,
+	};
+
+	assert(pgmap(&cq->vaddr, __VFN_PAGESIZE) > 0);
+	cq->iova = (uint64_t)cq->vaddr;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = { .opts = { .nsqr = 0, .ncqr = 0 } };
+	uint32_t db[4] = {};
+	struct nvme_sq sqs[2];
+	struct nvme_cq cqs[2];
+	struct nvme_rq *rq[7], *arq;
+	union nvme_cmd *sqes;
+	uint32_t aqa;
+
+	plan_tests(26);
+
+	assert(pgmap(&ctrl.regs, __VFN_PAGESIZE) > 0);
+
+	init_cq(&cqs[0], 0, 4, sqs, &db[1]);
+	init_cq(&cqs[1], 1, 8, sqs, &db[3]);
+	init_sq(&sqs[0], 0, 4, &cqs[0], &db[0]);
+	init_sq(&sqs[1], 1, 8, &cqs[1], &db[2]);
+
+	ctrl.sq = sqs;
+	ctrl.cq = cqs;
+	ctrl.adminq.sq = &sqs[0];
+	ctrl.adminq.cq = &cqs[0];
+
+	sqes = sqs[1].vaddr;
+
+	/* an asynchronous event request holds an admin tracker */
+	assert(nvme_rq_acquire(&sqs[0]));
+
+	/* and an admin command is outstanding */
+	arq = nvme_rq_acquire(&sqs[0]);
+	nvme_rq_submit(arq, &(union nvme_cmd) { .opcode = NVME_ADMIN_GET_LOG_PAGE }, admin_cb,
+		       NULL);
+
+	for (int i = 0; i < 7; i++) {
+		union nvme_cmd cmd = {
+			.opcode = 0x2, .nsid = cpu_to_le32(1), .cdw10 = cpu_to_le32((uint32_t)i),
+		};
+
+		rq[i] = nvme_rq_acquire(&sqs[1]);
+
+		/* the fifth and seventh are polled for; the sixth is never posted */
+		if (i < 4)
+			nvme_rq_submit(rq[i], &cmd, complete_cb, NULL);
+		else if (i != 5)
+			nvme_rq_post(rq[i], &cmd);
+	}
+
+	nvme_sq_flush_tail(&sqs[1]);
+
+	/* the first and seventh completed, but the completions were not yet processed */
+	post_cqe(&cqs[1], 0, 1, rq[0]->cid);
+	post_cqe(&cqs[1], 1, 1, rq[6]->cid);
+
+	/* the entry of the third command was overwritten after it was fetched */
+	sqes[2].cid = 6;
+
+	ok1(nvme_recover(&ctrl, NVME_RECOVER_RESUBMIT) == 0);
+	ok1(nresets == 1 && nenables == 1 && npower == 1);
+
+	aqa = le32_to_cpu(mmio_read32(ctrl.regs + NVME_REG_AQA));
+	ok1(aqa == (3 | 3 << 16));
+	ok1(le64_to_cpu(mmio_read64(ctrl.regs + NVME_REG_ASQ)) == sqs[0].iova);
+
+	/* set features, then the queues are re-created with the same memory */
+	ok1(nadmin == 3 && admin[0].opcode == NVME_ADMIN_SET_FEATURES);
+	ok1(admin[1].opcode == NVME_ADMIN_CREATE_CQ &&
+	    le64_to_cpu(admin[1].create_cq.prp1) == cqs[1].iova &&
+	    le16_to_cpu(admin[1].create_cq.qflags) == NVME_Q_PC);
+	ok1(admin[2].opcode == NVME_ADMIN_CREATE_SQ &&
+	    le64_to_cpu(admin[2].create_sq.prp1) == sqs[1].iova &&
+	    le16_to_cpu(admin[2].create_sq.cqid) == 1);
+
+	/* the outstanding admin command is failed; all admin trackers are free again */
+	ok1(admin_status == NVME_SC_ABORT_SQ_DELETION);
+	ok1(nfree(&sqs[0]) == 3 && !sqs[0].tail && !cqs[0].head);
+
+	/* the completed command is delivered; the overwritten one is failed */
+	ok1(ncompleted == 1 && nfailed == 1 && status[rq[2]->cid] == NVME_SC_ABORT_SQ_DELETION);
+
+	/* the intact commands are posted again from the start of the ring */
+	ok1(sqs[1].tail == 3 && db[2] == 3 && !cqs[1].head && !cqs[1].phase);
+	ok1(sqes[0].cid == rq[1]->cid && le32_to_cpu(sqes[0].cdw10) == 1);
+	ok1(sqes[1].cid == rq[3]->cid && le32_to_cpu(sqes[1].cdw10) == 3);
+	ok1(rq[1]->cb && rq[3]->cb && !rq[2]->cb);
+
+	/* the polled for command is posted again; the completed one is not */
+	ok1(sqes[2].cid == rq[4]->cid && le32_to_cpu(sqes[2].cdw10) == 4 && !rq[4]->cb &&
+	    !rq[5]->cb && !rq[6]->cb);
+
+	/* the failed tracker was released */
+	ok1(nvme_rq_acquire(&sqs[1]) == rq[2]);
+	nvme_rq_release(rq[2]);
+
+	/*
+	 * Fail everything; a callback may resubmit to the re-created queue.
+	 * With weighted round robin arbitration, the weights are restored and
+	 * the queue is re-created with its priority class.
+	 */
+	nadmin = 0;
+	nfailed = 0;
+	nresubmit = 1;
+
+	ctrl.config.wrr = true;
+	ctrl.opts.arb = (struct nvme_arb_opts) { .wrr = true, .ab = 0x7, .hpw = 0xff, .lpw = 0x1 };
+	sqs[1].qprio = NVME_SQ_QPRIO_HIGH;
+
+	ok1(nvme_recover(&ctrl, NVME_RECOVER_FAIL) == 0);
+	ok1(nfailed == 2 && nresets == 2);
+	ok1(sqs[1].tail == 1 && db[2] == 1 && (rq[1]->cb != NULL) != (rq[3]->cb != NULL));
+	ok1(!rq[4]->cb && nfree(&sqs[1]) == 3);
+
+	ok1(nadmin == 3 && narb == 1 && arb[0] == 0x7 && arb[1] == 0x1 && !arb[2] &&
+	    arb[3] == 0xff);
+	ok1(le16_to_cpu(admin[2].create_sq.qflags) == (NVME_Q_PC | NVME_SQ_QPRIO_HIGH));
+
+	/* the host memory buffer is handed back with its contents retained */
+	nadmin = 0;
+
+	ctrl.config.wrr = false;
+	ctrl.hmb.enabled = true;
+	ctrl.hmb.len = 4 << 20;
+	ctrl.hmb.nchunks = 2;
+	ctrl.hmb.descs_iova = 0x12345000;
+
+	/* and the controller memory space is enabled at the same address */
+	ctrl.reg.cap = NVME_FIELD_SET(1ULL, CAP_CMBS);
+	ctrl.cmb.vaddr = sqes;
+	ctrl.cmb.iova = 0x80000000;
+
+	ok1(nvme_recover(&ctrl, NVME_RECOVER_FAIL) == 0);
+	ok1(le64_to_cpu(mmio_read64(ctrl.regs + NVME_REG_CMBMSC)) == (0x80000000 | 0x3));
+	ok1(nadmin == 4 && admin[1].features.fid == NVME_FEAT_FID_HOST_MEM_BUF &&
+	    le32_to_cpu(admin[1].features.cdw11) == 0x3 &&
+	    le32_to_cpu(admin[1].features.cdw12) == 1024);
+	ok1(le32_to_cpu(admin[1].features.cdw13) == 0x12345000 &&
+	    le32_to_cpu(admin[1].features.cdw15) == 2 && ctrl.hmb.enabled);
+
+	return exit_status();
+}
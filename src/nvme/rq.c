@@ -35,86 +35,504 @@
 #include <vfn/vfio.h>
 #include <vfn/nvme.h>
 
+#include "ccan/compiler/compiler.h"
 #include "ccan/minmax/minmax.h"
 
 #include "iommu/context.h"
 
-static inline int __map_first(leint64_t *prp1, leint64_t *prplist, uint64_t iova, size_t len,
-			      int pageshift)
+#include "prpfill.h"
+#include "types.h"
+
+/* shorter runs of prp list entries are not worth an indirect call */
+#define PRP_FILL_MIN 8
+
+/*
+ * Cursor for appending entries to the prp list of a request tracker. The list
+ * starts out in the prp list page of the tracker and is chained into extra list
+ * pages from the pool of the submission queue as it grows.
+ */
+struct prp_cursor {
+	struct nvme_rq *rq;
+
+	leint64_t *list;
+
+	/* next free entry in the current list page and entries per page */
+	int idx, nentries;
+
+	/* number of entries (not counting prp1) */
+	int count;
+};
+
+static inline void __prp_init(struct prp_cursor *c, struct nvme_rq *rq, int pageshift)
 {
-	size_t pagesize = 1 << pageshift;
-	int max_prps = 1 << (pageshift - 3);
+	/* a tracker may be remapped without being released */
+	if (rq->prp_chain)
+		__nvme_rq_release_prp_chain(rq);
 
-	/* number of prps required to map the buffer */
-	int prpcount = 1;
+	rq->prp_cache.len = 0;
 
-	*prp1 = cpu_to_le64(iova);
+	*c = (struct prp_cursor) {
+		.rq = rq,
+		.list = rq->page.vaddr,
+		.nentries = 1 << (pageshift - 3),
+	};
+}
 
-	/* account for what is covered with the first prp */
-	len -= min_t(size_t, len, pagesize - (iova & (pagesize - 1)));
+static int __prp_chain(struct prp_cursor *c)
+{
+	struct nvme_sq *sq = c->rq->sq;
+	uint64_t top = atomic_load_acquire(&sq->prp_top);
+	struct nvme_prp_page *page;
+	leint64_t *list;
+
+	do {
+		page = __nvme_prp_top(sq, top);
+		if (!page) {
+			log_debug("no prp list pages available for chaining\n");
+
+			errno = EBUSY;
+			return -1;
+		}
+	} while (!atomic_cmpxchg(&sq->prp_top, top,
+				 __nvme_prp_top_set(sq, top + __NVME_TOP_GEN, page->next)));
 
-	/* any residual just adds more prps */
-	if (len)
-		prpcount += (int)ALIGN_UP(len, pagesize) >> pageshift;
+	page->next = c->rq->prp_chain;
+	c->rq->prp_chain = page;
 
-	if (prpcount > 1 && !ALIGNED(iova, pagesize))
-		/* align down to simplify loop below */
-		iova = ALIGN_DOWN(iova, pagesize);
+	list = page->vaddr;
 
-	if (prpcount > max_prps) {
-		errno = EINVAL;
-		return 0;
+	/* the last entry of a full list page points to the next list page */
+	list[0] = c->list[c->nentries - 1];
+	c->list[c->nentries - 1] = cpu_to_le64(page->iova);
+
+	c->list = list;
+	c->idx = 1;
+
+	return 0;
+}
+
+/* append @n prp list entries for the pages starting at @iova */
+static inline int __prp_push(struct prp_cursor *c, uint64_t iova, int n, int pageshift)
+{
+	while (n) {
+		leint64_t *list;
+		int k;
+
+		if (unlikely(c->idx == c->nentries) && __prp_chain(c))
+			return -1;
+
+		k = min(n, c->nentries - c->idx);
+		list = &c->list[c->idx];
+
+		if (k < PRP_FILL_MIN) {
+			for (int i = 0; i < k; i++)
+				list[i] = cpu_to_le64(iova + ((uint64_t)i << pageshift));
+		} else {
+			__nvme_prp_fill_fn(list, iova, pageshift, k);
+		}
+
+		c->idx += k;
+		c->count += k;
+
+		iova += (uint64_t)k << pageshift;
+		n -= k;
 	}
 
-	/*
-	 * Map the remaining parts of the buffer into prp2/prplist. iova will be
-	 * aligned from the above, which simplifies this.
-	 */
-	for (int i = 1; i < prpcount; i++)
-		prplist[i - 1] = cpu_to_le64(iova + ((uint64_t)i << pageshift));
+	return 0;
+}
 
-	/*
-	 * prpcount may be zero if the buffer length was less than the page
-	 * size, so clamp it to 1 in that case.
-	 */
-	return clamp_t(int, prpcount, 1, prpcount);
+static inline void __prp_finish(struct nvme_rq *rq, union nvme_cmd *cmd, int count)
+{
+	if (count == 1)
+		cmd->dptr.prp2 = ((leint64_t *)rq->page.vaddr)[0];
+	else if (count > 1)
+		cmd->dptr.prp2 = cpu_to_le64(rq->page.iova);
+	else
+		cmd->dptr.prp2 = 0x0;
 }
 
-static inline int __map_aligned(leint64_t *prplist, int prpcount, uint64_t iova, int pageshift)
+static inline int __map_first(struct prp_cursor *c, leint64_t *prp1, uint64_t iova, size_t len,
+			      int pageshift)
 {
 	size_t pagesize = 1 << pageshift;
 
+	*prp1 = cpu_to_le64(iova);
+
+	/* account for what is covered with the first prp */
+	len -= min_t(size_t, len, pagesize - (iova & (pagesize - 1)));
+
+	if (!len)
+		return 0;
+
+	/* any residual just adds more prps, starting at the next page boundary */
+	return __prp_push(c, ALIGN_DOWN(iova, pagesize) + pagesize,
+			  (int)(ALIGN_UP(len, pagesize) >> pageshift), pageshift);
+}
+
+static inline int __map_aligned(struct prp_cursor *c, int prpcount, uint64_t iova, int pageshift)
+{
 	/*
 	 * __map_aligned is used exclusively for mapping into the prplist
 	 * entries where addresses must be page size aligned.
 	 */
-	assert(ALIGNED(iova, pagesize));
-
-	for (int i = 0; i < prpcount; i++)
-		prplist[i] = cpu_to_le64(iova + ((uint64_t)i << pageshift));
+	assert(ALIGNED(iova, 1ULL << pageshift));
 
-	return prpcount;
+	return __prp_push(c, iova, prpcount, pageshift);
 }
 
 int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, uint64_t iova,
 		    size_t len)
 {
-	int prpcount;
-	leint64_t *prplist = rq->page.vaddr;
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	struct prp_cursor c;
+
+	/*
+	 * The list in the prp list page still holds the entries for the buffer
+	 * that it was last built for, which is also good for any prefix of it.
+	 */
+	if (len <= rq->prp_cache.len && iova == rq->prp_cache.iova) {
+		size_t pagesize = 1 << pageshift;
+
+		len -= min_t(size_t, len, pagesize - (iova & (pagesize - 1)));
+
+		cmd->dptr.prp1 = cpu_to_le64(iova);
+
+		if (len > pagesize)
+			cmd->dptr.prp2 = cpu_to_le64(rq->page.iova);
+		else if (len)
+			cmd->dptr.prp2 = cpu_to_le64(ALIGN_DOWN(iova, pagesize) + pagesize);
+		else
+			cmd->dptr.prp2 = 0x0;
+
+		return 0;
+	}
+
+	__prp_init(&c, rq, pageshift);
+
+	if (__map_first(&c, &cmd->dptr.prp1, iova, len, pageshift)) {
+		if (rq->prp_chain)
+			__nvme_rq_release_prp_chain(rq);
+
+		return -1;
+	}
+
+	/* with a chained list, the last entry in the page is not a data page */
+	if (!rq->prp_chain) {
+		rq->prp_cache.iova = iova;
+		rq->prp_cache.len = len;
+	}
+
+	__prp_finish(rq, cmd, c.count);
+
+	return 0;
+}
+
+static inline bool __sgl_supported(struct nvme_ctrl *ctrl, struct nvme_rq *rq)
+{
+	/* sgls are not supported for admin commands on pcie */
+	return rq->sq->id && (ctrl->config.sgls & NVME_SGLS_SUPPORT_MASK);
+}
+
+static inline int __sgld_data_block(struct nvme_ctrl *ctrl, struct nvme_sgld *sgld,
+				    uint64_t iova, size_t len)
+{
+	if (len > UINT32_MAX) {
+		log_error("data block too large (%zu)\n", len);
+		return -1;
+	}
 
-	prpcount = __map_first(&cmd->dptr.prp1, prplist, iova, len,
-			       __mps_to_pageshift(ctrl->config.mps));
-	if (!prpcount) {
+	if ((ctrl->config.sgls & NVME_SGLS_SUPPORT_MASK) == NVME_SGLS_SUPPORTED_DWORD &&
+	    !(ALIGNED(iova, 4) && ALIGNED(len, 4))) {
+		log_error("data block must be dword aligned\n");
+		return -1;
+	}
+
+	*sgld = (struct nvme_sgld) {
+		.addr = cpu_to_le64(iova),
+		.len = cpu_to_le32((uint32_t)len),
+		.type = NVME_SGLD_TYPE_DATA_BLOCK << NVME_SGLD_TYPE_SHIFT,
+	};
+
+	return 0;
+}
+
+static inline void __set_psdt(union nvme_cmd *cmd, uint8_t psdt)
+{
+	cmd->flags &= (uint8_t)~(NVME_CMD_FLAGS_PSDT_MASK << NVME_CMD_FLAGS_PSDT_SHIFT);
+	cmd->flags |= (uint8_t)(psdt << NVME_CMD_FLAGS_PSDT_SHIFT);
+}
+
+int nvme_rq_map_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq UNUSED, union nvme_cmd *cmd,
+		    uint64_t iova, size_t len)
+{
+	if (__sgld_data_block(ctrl, &cmd->dptr.sgl, iova, len)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (prpcount == 2)
-		cmd->dptr.prp2 = prplist[0];
-	else if (prpcount > 2)
-		cmd->dptr.prp2 = cpu_to_le64(rq->page.iova);
-	else
-		cmd->dptr.prp2 = 0x0;
+	__set_psdt(cmd, NVME_CMD_FLAGS_PSDT_SGL_MPTR_CONTIG);
+
+	return 0;
+}
+
+int nvme_rq_mapv_sgl(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		     struct iovec *iov, int niov)
+{
+	struct nvme_sgld *seg = rq->page.vaddr;
+	int max_sglds = (int)(__mps_to_pagesize(ctrl->config.mps) / sizeof(struct nvme_sgld));
+
+	if (niov == 1)
+		return nvme_rq_map_sgl(ctrl, rq, cmd, (uint64_t)iov->iov_base, iov->iov_len);
+
+	/* the descriptors overwrite any cached prp list */
+	rq->prp_cache.len = 0;
+
+	if (niov > max_sglds) {
+		log_error("too many sgl descriptors required\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < niov; i++) {
+		if (__sgld_data_block(ctrl, &seg[i], (uint64_t)iov[i].iov_base, iov[i].iov_len)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	cmd->dptr.sgl = (struct nvme_sgld) {
+		.addr = cpu_to_le64(rq->page.iova),
+		.len = cpu_to_le32((uint32_t)(niov * sizeof(struct nvme_sgld))),
+		.type = NVME_SGLD_TYPE_LAST_SEGMENT << NVME_SGLD_TYPE_SHIFT,
+	};
+
+	__set_psdt(cmd, NVME_CMD_FLAGS_PSDT_SGL_MPTR_CONTIG);
+
+	return 0;
+}
+
+int nvme_rq_map(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, uint64_t iova,
+		size_t len)
+{
+	if (__sgl_supported(ctrl, rq))
+		return nvme_rq_map_sgl(ctrl, rq, cmd, iova, len);
+
+	return nvme_rq_map_prp(ctrl, rq, cmd, iova, len);
+}
+
+int nvme_rq_mapv(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+		 struct iovec *iov, int niov)
+{
+	if (__sgl_supported(ctrl, rq))
+		return nvme_rq_mapv_sgl(ctrl, rq, cmd, iov, niov);
+
+	return nvme_rq_mapv_prp(ctrl, rq, cmd, iov, niov);
+}
+
+/*
+ * Claim the tracker page for a descriptor list of @len bytes and point the data
+ * pointer at it. The page is aligned, so a single prp entry always suffices.
+ */
+static void *__rq_desc_page(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+			    size_t len)
+{
+	if (len > __mps_to_pagesize(ctrl->config.mps)) {
+		log_debug("too many ranges\n");
+
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (rq->prp_chain)
+		__nvme_rq_release_prp_chain(rq);
+
+	/* the descriptors overwrite any cached prp list */
+	rq->prp_cache.len = 0;
+
+	cmd->dptr.prp1 = cpu_to_le64(rq->page.iova);
+
+	return rq->page.vaddr;
+}
+
+static inline bool __range_ok(struct nvme_ns *ns, uint64_t slba, uint64_t nlb, uint64_t max)
+{
+	return nlb && nlb <= max && slba < ns->nsze && nlb <= ns->nsze - slba;
+}
+
+int nvme_rq_prep_copy(struct nvme_ctrl *ctrl, struct nvme_rq *rq, struct nvme_ns *ns,
+		      union nvme_cmd *cmd, uint64_t sdlba, const struct nvme_rq_copy_range *ranges,
+		      int nr, enum nvme_copy_format fmt)
+{
+	size_t descsz;
+	void *descs;
+
+	switch (fmt) {
+	case NVME_COPY_FORMAT_0:
+		descsz = sizeof(struct nvme_copy_desc_fmt0);
+		break;
+
+	case NVME_COPY_FORMAT_1:
+		descsz = sizeof(struct nvme_copy_desc_fmt1);
+		break;
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the number of ranges is a zeroes based 8 bit value */
+	if (nr < 1 || nr > 256) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(cmd, 0x0, sizeof(*cmd));
+
+	descs = __rq_desc_page(ctrl, rq, cmd, (size_t)nr * descsz);
+	if (!descs)
+		return -1;
+
+	for (int i = 0; i < nr; i++) {
+		const struct nvme_rq_copy_range *r = &ranges[i];
+
+		if (!__range_ok(ns, r->slba, r->nlb, 0x10000)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (fmt == NVME_COPY_FORMAT_0) {
+			struct nvme_copy_desc_fmt0 *d = descs + (size_t)i * descsz;
+
+			*d = (struct nvme_copy_desc_fmt0) {
+				.slba = cpu_to_le64(r->slba),
+				.nlb = cpu_to_le16((uint16_t)(r->nlb - 1)),
+				.elbt = cpu_to_le32((uint32_t)r->reftag),
+				.elbat = cpu_to_le16(r->apptag),
+				.elbatm = cpu_to_le16(r->appmask),
+			};
+		} else {
+			struct nvme_copy_desc_fmt1 *d = descs + (size_t)i * descsz;
+
+			*d = (struct nvme_copy_desc_fmt1) {
+				.slba = cpu_to_le64(r->slba),
+				.nlb = cpu_to_le16((uint16_t)(r->nlb - 1)),
+				.elbat = cpu_to_le16(r->apptag),
+				.elbatm = cpu_to_le16(r->appmask),
+			};
+
+			/* the 48b reference tag in the low bytes (no storage tag) */
+			for (int b = 0; b < 6; b++)
+				d->elbt[b] = (uint8_t)(r->reftag >> (8 * b));
+		}
+	}
+
+	cmd->opcode = NVME_NVM_COPY;
+	cmd->nsid = cpu_to_le32(ns->nsid);
+	cmd->cdw10 = cpu_to_le32((uint32_t)sdlba);
+	cmd->cdw11 = cpu_to_le32((uint32_t)(sdlba >> 32));
+	cmd->cdw12 = cpu_to_le32((uint32_t)(nr - 1) | (uint32_t)fmt << 8);
+
+	return 0;
+}
+
+int nvme_rq_prep_dsm(struct nvme_ctrl *ctrl, struct nvme_rq *rq, struct nvme_ns *ns,
+		     union nvme_cmd *cmd, const struct nvme_rq_dsm_range *ranges, int nr,
+		     uint32_t attrs)
+{
+	struct nvme_dsm_desc *descs;
+
+	/* the number of ranges is a zeroes based 8 bit value */
+	if (nr < 1 || nr > 256) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(cmd, 0x0, sizeof(*cmd));
+
+	descs = __rq_desc_page(ctrl, rq, cmd, (size_t)nr * sizeof(*descs));
+	if (!descs)
+		return -1;
+
+	for (int i = 0; i < nr; i++) {
+		const struct nvme_rq_dsm_range *r = &ranges[i];
+
+		if (!__range_ok(ns, r->slba, r->nlb, UINT32_MAX)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		descs[i] = (struct nvme_dsm_desc) {
+			.cattr = cpu_to_le32(r->cattr),
+			.nlb = cpu_to_le32(r->nlb),
+			.slba = cpu_to_le64(r->slba),
+		};
+	}
+
+	cmd->opcode = NVME_NVM_DSM;
+	cmd->nsid = cpu_to_le32(ns->nsid);
+	cmd->cdw10 = cpu_to_le32((uint32_t)(nr - 1));
+	cmd->cdw11 = cpu_to_le32(attrs);
+
+	return 0;
+}
+
+int nvme_rq_map_own_buf(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
+			size_t len)
+{
+	if (!rq->buf.vaddr || len > rq->buf.len) {
+		log_debug("request has no data buffer or buffer is too small\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	return nvme_rq_map_prp(ctrl, rq, cmd, rq->buf.iova, len);
+}
+
+int nvme_rq_map_fixed(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd, int idx,
+		      size_t ofst, size_t len)
+{
+	struct nvme_fixed_buf *buf = nvme_fixed_buf_get(ctrl, idx);
+	int pageshift = __mps_to_pageshift(ctrl->config.mps);
+	size_t pagesize = 1 << pageshift, rem;
+	uint64_t iova, list, first, nprps;
+
+	if (!buf || ofst > buf->len || len > buf->len - ofst) {
+		log_debug("invalid registered buffer range\n");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	iova = buf->iova + ofst;
+
+	if (__sgl_supported(ctrl, rq))
+		return nvme_rq_map_sgl(ctrl, rq, cmd, iova, len);
+
+	/* what is not covered by the first prp */
+	rem = len - min_t(size_t, len, pagesize - (iova & (pagesize - 1)));
+
+	if (rem <= pagesize) {
+		cmd->dptr.prp1 = cpu_to_le64(iova);
+		cmd->dptr.prp2 = rem ? cpu_to_le64(ALIGN_DOWN(iova, pagesize) + pagesize) : 0x0;
+
+		return 0;
+	}
+
+	/* the entry of the page following the one holding the start of the range */
+	first = ((ALIGN_DOWN(iova, pagesize) - ALIGN_DOWN(buf->iova, pagesize)) >> pageshift) + 1;
+	nprps = ALIGN_UP(rem, pagesize) >> pageshift;
+
+	list = buf->prps_iova + first * sizeof(leint64_t);
+
+	/* a list crossing a page boundary would have to be chained */
+	if (ALIGN_DOWN(list, pagesize) !=
+	    ALIGN_DOWN(list + (nprps - 1) * sizeof(leint64_t), pagesize))
+		return nvme_rq_map_prp(ctrl, rq, cmd, iova, len);
+
+	cmd->dptr.prp1 = cpu_to_le64(iova);
+	cmd->dptr.prp2 = cpu_to_le64(list);
 
 	return 0;
 }
@@ -122,16 +540,17 @@ int nvme_rq_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *
 int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *cmd,
 		     struct iovec *iov, int niov)
 {
-	int prpcount, _prpcount;
-	leint64_t *prplist = rq->page.vaddr;
 	uint64_t iova = (uint64_t)iov->iov_base;
 	size_t len = iov->iov_len;
 	int pageshift = __mps_to_pageshift(ctrl->config.mps);
 	size_t pagesize = 1 << pageshift;
-	int max_prps = 1 << (pageshift - 3);
+	struct prp_cursor c;
+
+	__prp_init(&c, rq, pageshift);
 
 	/* map the first segment */
-	prpcount = __map_first(&cmd->dptr.prp1, prplist, iova, len, pageshift);
+	if (__map_first(&c, &cmd->dptr.prp1, iova, len, pageshift))
+		goto err;
 
 	/*
 	 * At this point, one of three conditions must hold:
@@ -143,8 +562,8 @@ int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd
 	 * If none holds, the buffer(s) within the iovec cannot be mapped given
 	 * the PRP alignment requirements.
 	 */
-	if (!(prpcount == 1 || niov == 1 || ALIGNED(iova + len, pagesize))) {
-		log_error("iov[0].iov_base/len invalid\n");
+	if (!(c.count == 0 || niov == 1 || ALIGNED(iova + len, pagesize))) {
+		log_errorrl(1, (uintptr_t)rq->sq, "iov[0].iov_base/len invalid\n");
 
 		goto invalid;
 	}
@@ -154,45 +573,259 @@ int nvme_rq_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd
 		iova = (uint64_t)iov[i].iov_base;
 		len = iov[i].iov_len;
 
-		_prpcount = max_t(int, 1, (int)len >> pageshift);
-
-		if (prpcount + _prpcount > max_prps) {
-			log_error("too many prps required\n");
-
-			goto invalid;
-		}
-
-
 		if (!ALIGNED(iova, pagesize)) {
-			log_error("unaligned iov[%u].iov_base (0x%"PRIx64")\n", i, iova);
+			log_errorrl(1, (uintptr_t)rq->sq,
+				    "unaligned iov[%u].iov_base (0x%"PRIx64")\n", i, iova);
 
 			goto invalid;
 		}
 
 		/* all entries but the last must have a page size aligned len */
 		if (i < niov - 1 && !ALIGNED(len, pagesize)) {
-			log_error("unaligned iov[%u].len (%zu)\n", i, len);
+			log_errorrl(1, (uintptr_t)rq->sq, "unaligned iov[%u].len (%zu)\n", i, len);
 
 			goto invalid;
 		}
 
-		prpcount += __map_aligned(&prplist[prpcount - 1], _prpcount, iova, pageshift);
+		if (__map_aligned(&c, max_t(int, 1, (int)(len >> pageshift)), iova, pageshift))
+			goto err;
 	}
 
-	if (prpcount == 2)
-		cmd->dptr.prp2 = prplist[0];
-	else if (prpcount > 2)
-		cmd->dptr.prp2 = cpu_to_le64(rq->page.iova);
-	else
-		cmd->dptr.prp2 = 0x0;
+	__prp_finish(rq, cmd, c.count);
 
 	return 0;
 
 invalid:
 	errno = EINVAL;
+err:
+	if (rq->prp_chain)
+		__nvme_rq_release_prp_chain(rq);
+
 	return -1;
 }
 
+int nvme_rq_cache_init(struct nvme_rq_cache *cache, struct nvme_sq *sq, int n)
+{
+	struct nvme_rq *rq;
+	int i;
+
+	cache->sq = sq;
+	cache->free = NULL;
+	cache->remote = NULL;
+
+	for (i = 0; i < n; i++) {
+		rq = nvme_rq_acquire_atomic(sq);
+		if (!rq)
+			break;
+
+		rq->cache = cache;
+
+		rq->rq_next = cache->free;
+		cache->free = rq;
+	}
+
+	return i;
+}
+
+static void nvme_rq_cache_drain(struct nvme_rq *rq)
+{
+	struct nvme_rq *next;
+
+	for (; rq; rq = next) {
+		next = rq->rq_next;
+
+		rq->cache = NULL;
+		nvme_rq_release_atomic(rq);
+	}
+}
+
+void nvme_rq_cache_fini(struct nvme_rq_cache *cache)
+{
+	nvme_rq_cache_drain(cache->free);
+	nvme_rq_cache_drain(atomic_xchg(&cache->remote, NULL));
+
+	cache->free = NULL;
+}
+
+int nvme_sq_set_latency_tracking(struct nvme_sq *sq, bool enable)
+{
+	if (!enable) {
+		free(sq->lat);
+		sq->lat = NULL;
+
+		return 0;
+	}
+
+	if (sq->lat)
+		return 0;
+
+	sq->lat = calloc(1, sizeof(*sq->lat));
+	if (!sq->lat)
+		return -1;
+
+	/* stale timestamps of commands posted while tracking was disabled */
+	for (int i = 0; sq->rqs && i < sq->qsize - 1; i++)
+		sq->rqs[i].tsubmit = 0;
+
+	return 0;
+}
+
+int nvme_sq_get_latency(struct nvme_sq *sq, struct nvme_sq_latency *lat)
+{
+	if (!sq->lat) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*lat = *sq->lat;
+
+	return 0;
+}
+
+#define NVME_CQ_PROCESS_BATCH 64
+
+/* submission queues seen in a batch of completions */
+static inline int __sq_group_add(struct nvme_sq **groups, int ngroups, struct nvme_sq *sq)
+{
+	/* completions typically arrive in runs from the same queue */
+	for (int i = ngroups - 1; i >= 0; i--) {
+		if (groups[i] == sq)
+			return ngroups;
+	}
+
+	groups[ngroups] = sq;
+
+	return ngroups + 1;
+}
+
+int __nvme_cq_process(struct nvme_cq *cq, int budget)
+{
+	struct nvme_cqe *cqes[NVME_CQ_PROCESS_BATCH];
+	struct nvme_sq *groups[NVME_CQ_PROCESS_BATCH];
+	int n, ngroups, processed = 0;
+	uint64_t now;
+
+	while (processed < budget) {
+		n = nvme_cq_reap_batch(cq, cqes, min_t(int, budget - processed,
+						       NVME_CQ_PROCESS_BATCH));
+		if (!n)
+			break;
+
+		ngroups = 0;
+
+		/* taken lazily; one timestamp for the whole batch */
+		now = 0;
+
+		for (int i = 0; i < n; i++) {
+			struct nvme_rq *rq = nvme_cq_rq_from_cqe(cq, cqes[i]);
+			struct nvme_cqe *cqe = cqes[i], copy;
+			nvme_rq_cb cb = rq->cb;
+
+			/* a duplicate or spurious entry for an idle tracker */
+			if (!cb) {
+				log_errorrl(1, (uintptr_t)rq->sq,
+					    "completion for idle cid %" PRIu16 " on sq %d\n",
+					    cqe->cid, rq->sq->id);
+
+				continue;
+			}
+
+			ngroups = __sq_group_add(groups, ngroups, rq->sq);
+
+			if (cq->tmo)
+				__nvme_timeout_del(cq->tmo, rq);
+
+			/* posted before tracking was enabled if not stamped */
+			if (rq->sq->lat && rq->tsubmit) {
+				if (!now)
+					now = get_ticks();
+
+				__nvme_sq_latency_add(rq->sq->lat, now - rq->tsubmit);
+
+				rq->tsubmit = 0;
+			}
+
+			/* verification may rewrite the status; leave the queue entry as is */
+			if (rq->pi) {
+				copy = *cqe;
+				cqe = &copy;
+
+				nvme_pi_complete(rq->pi, cqe);
+			}
+
+			/* a callback that resubmits the request sets a new cb */
+			rq->cb = NULL;
+
+			cb(rq, cqe, rq->cb_arg);
+
+			if (!rq->cb)
+				nvme_rq_release(rq);
+		}
+
+		/* flush resubmissions once per submission queue */
+		for (int g = 0; g < ngroups; g++)
+			nvme_sq_update_tail(groups[g]);
+
+		processed += n;
+	}
+
+	if (!processed)
+		return 0;
+
+	nvme_cq_update_head(cq);
+
+	return processed;
+}
+
+int nvme_cq_process(struct nvme_cq *cq, int budget)
+{
+	int processed = __nvme_cq_process(cq, budget);
+
+	/* checked even when idle; stuck commands do not complete */
+	if (cq->tmo)
+		nvme_timeout_check(cq->tmo);
+
+	return processed;
+}
+
+int nvme_cq_process_shared(struct nvme_cq *cq, int budget)
+{
+	int processed;
+
+	if (!nvme_cq_trylock(cq))
+		return 0;
+
+	processed = nvme_cq_process(cq, budget);
+
+	nvme_cq_unlock(cq);
+
+	return processed;
+}
+
+int nvme_cq_steal(struct nvme_cq *const *cqs, int ncqs, int budget)
+{
+	/* rotate the starting point such that stealers spread over the peers */
+	static __thread unsigned int next;
+
+	for (int i = 0; i < ncqs; i++) {
+		unsigned int idx = (next + (unsigned int)i) % (unsigned int)ncqs;
+		int processed;
+
+		/* do not bounce the lock cache line of idle queues */
+		if (!nvme_cq_pending(cqs[idx]))
+			continue;
+
+		processed = nvme_cq_process_shared(cqs[idx], budget);
+		if (processed) {
+			next = idx + 1;
+
+			return processed;
+		}
+	}
+
+	return 0;
+}
+
 int nvme_rq_wait(struct nvme_rq *rq, struct nvme_cqe *cqe_copy, struct timespec *ts)
 {
 	struct nvme_cq *cq = rq->sq->cq;
@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+
+#include "rq.c"
+
+#define QSIZE 1024
+#define ITERATIONS 1000000
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+static uint32_t doorbell;
+
+static struct nvme_rq rqs[QSIZE];
+
+static struct nvme_sq sq = {
+	.id = 1,
+	.qsize = QSIZE,
+	.doorbell = &doorbell,
+	.rqs = rqs,
+};
+
+static struct nvme_cq cq = {
+	.id = 1,
+	.qsize = QSIZE,
+	.doorbell = &doorbell,
+};
+
+static void report(const char *name, uint64_t ticks, unsigned long ops)
+{
+	printf("%-32s %12.3f %12.3f\n", name, (double)ticks / ops,
+	       (double)ticks * 1e9 / (double)get_ticks_freq() / ops);
+}
+
+static void bench_sq_post(void)
+{
+	union nvme_cmd cmd = {};
+	uint64_t start;
+
+	start = get_ticks();
+
+	for (int i = 0; i < ITERATIONS; i++)
+		nvme_sq_post(&sq, &cmd);
+
+	report("nvme_sq_post", get_ticks() - start, ITERATIONS);
+}
+
+static void bench_cq_get_cqe(void)
+{
+	struct nvme_cqe *cqes = cq.vaddr;
+	uint64_t ticks = 0, start;
+	unsigned long n = 0;
+
+	for (int pass = 0; pass < ITERATIONS / QSIZE; pass++) {
+		/* entries posted in this pass carry the inverse of the expected phase */
+		for (int i = 0; i < QSIZE; i++)
+			cqes[i].sfp = cpu_to_le16((uint16_t)!cq.phase);
+
+		start = get_ticks();
+
+		while (nvme_cq_get_cqe(&cq))
+			n++;
+
+		ticks += get_ticks() - start;
+	}
+
+	report("nvme_cq_get_cqe", ticks, n);
+}
+
+static void rq_stack_init(void)
+{
+	sq.rq_top = 0;
+
+	for (int i = QSIZE - 2; i >= 0; i--) {
+		rqs[i].sq = &sq;
+		rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&rqs[i]);
+	}
+}
+
+static void bench_rq_acquire(void)
+{
+	uint64_t start;
+
+	rq_stack_init();
+
+	start = get_ticks();
+
+	for (int i = 0; i < ITERATIONS; i++)
+		nvme_rq_release(nvme_rq_acquire(&sq));
+
+	report("nvme_rq_acquire/release", get_ticks() - start, ITERATIONS);
+}
+
+static void *rq_acquire_atomic_thread(void *opaque)
+{
+	uint64_t *ticks = opaque, start;
+
+	start = get_ticks();
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		struct nvme_rq *rq;
+
+		while (!(rq = nvme_rq_acquire_atomic(&sq)))
+			;
+
+		nvme_rq_release_atomic(rq);
+	}
+
+	*ticks = get_ticks() - start;
+
+	return NULL;
+}
+
+static void bench_rq_acquire_atomic(int nthreads)
+{
+	pthread_t threads[8];
+	uint64_t ticks[8], sum = 0;
+	char name[64];
+
+	rq_stack_init();
+
+	for (int i = 0; i < nthreads; i++)
+		assert(pthread_create(&threads[i], NULL, rq_acquire_atomic_thread, &ticks[i]) == 0);
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		sum += ticks[i];
+	}
+
+	snprintf(name, sizeof(name), "nvme_rq_acquire/release_atomic/%d", nthreads);
+
+	/* average per operation as seen by each thread */
+	report(name, sum / (uint64_t)nthreads, ITERATIONS);
+}
+
+static void *rq_cache_thread(void *opaque)
+{
+	uint64_t *ticks = opaque, start;
+	struct nvme_rq_cache cache;
+
+	assert(nvme_rq_cache_init(&cache, &sq, QSIZE / 8) == QSIZE / 8);
+
+	start = get_ticks();
+
+	for (int i = 0; i < ITERATIONS; i++)
+		nvme_rq_cache_release(nvme_rq_cache_acquire(&cache));
+
+	*ticks = get_ticks() - start;
+
+	nvme_rq_cache_fini(&cache);
+
+	return NULL;
+}
+
+static void bench_rq_cache(int nthreads)
+{
+	pthread_t threads[8];
+	uint64_t ticks[8], sum = 0;
+	char name[64];
+
+	rq_stack_init();
+
+	for (int i = 0; i < nthreads; i++)
+		assert(pthread_create(&threads[i], NULL, rq_cache_thread, &ticks[i]) == 0);
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		sum += ticks[i];
+	}
+
+	snprintf(name, sizeof(name), "nvme_rq_cache_acquire/release/%d", nthreads);
+
+	report(name, sum / (uint64_t)nthreads, ITERATIONS);
+}
+
+static void bench_map_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq)
+{
+	union nvme_cmd cmd;
+	uint64_t start;
+	char name[64];
+
+	for (size_t len = 0x1000; len <= 0x80000; len <<= 2) {
+		start = get_ticks();
+
+		for (int i = 0; i < ITERATIONS / 10; i++)
+			nvme_rq_map_prp(ctrl, rq, &cmd, 0x1000000, len);
+
+		snprintf(name, sizeof(name), "nvme_rq_map_prp/%zuk", len >> 10);
+		report(name, get_ticks() - start, ITERATIONS / 10);
+
+		/* alternate between buffers to defeat the prp list cache */
+		start = get_ticks();
+
+		for (int i = 0; i < ITERATIONS / 10; i++)
+			nvme_rq_map_prp(ctrl, rq, &cmd, 0x1000000 + ((uint64_t)(i & 1) << 24), len);
+
+		snprintf(name, sizeof(name), "nvme_rq_map_prp/%zuk/uncached", len >> 10);
+		report(name, get_ticks() - start, ITERATIONS / 10);
+	}
+}
+
+static void bench_mapv_prp(struct nvme_ctrl *ctrl, struct nvme_rq *rq)
+{
+	struct iovec iov[32];
+	union nvme_cmd cmd;
+	uint64_t start;
+	char name[64];
+
+	for (int i = 0; i < 32; i++) {
+		iov[i].iov_base = (void *)(0x1000000 + ((uintptr_t)i << 13));
+		iov[i].iov_len = 0x1000;
+	}
+
+	for (int niov = 1; niov <= 32; niov <<= 1) {
+		start = get_ticks();
+
+		for (int i = 0; i < ITERATIONS / 10; i++)
+			nvme_rq_mapv_prp(ctrl, rq, &cmd, iov, niov);
+
+		snprintf(name, sizeof(name), "nvme_rq_mapv_prp/%dx4k", niov);
+		report(name, get_ticks() - start, ITERATIONS / 10);
+	}
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	struct nvme_ctrl ctrl = {
+		.config.mps = 0,
+	};
+
+	struct nvme_rq rq = { .sq = &sq };
+
+	assert(pgmap(&sq.vaddr, QSIZE << NVME_SQES) > 0);
+	assert(pgmap(&cq.vaddr, QSIZE << NVME_CQES) > 0);
+	assert(pgmap(&rq.page.vaddr, __VFN_PAGESIZE) > 0);
+
+	rq.page.iova = 0x8000000;
+
+	printf("%-32s %12s %12s\n", "operation", "ticks/op", "ns/op");
+
+	bench_sq_post();
+	bench_cq_get_cqe();
+	bench_rq_acquire();
+
+	for (int n = 1; n <= 8; n <<= 1)
+		bench_rq_acquire_atomic(n);
+
+	for (int n = 1; n <= 8; n <<= 1)
+		bench_rq_cache(n);
+
+	bench_map_prp(&ctrl, &rq);
+	bench_mapv_prp(&ctrl, &rq);
+
+	return 0;
+}
@@ -16,6 +16,11 @@
  * more details.
  */
 
+/* exercise the queue counters regardless of the build configuration */
+#define NVME_QSTATS
+
+#include <pthread.h>
+
 #include "ccan/tap/tap.h"
 
 #include "rq.c"
@@ -40,18 +45,788 @@ int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *
 	return 0;
 }
 
+static int ncompleted;
+
+static void complete_cb(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe UNUSED, void *arg)
+{
+	int *completed = arg;
+
+	(*completed)++;
+}
+
+static void resubmit_cb(struct nvme_rq *rq, struct nvme_cqe *cqe UNUSED, void *arg UNUSED)
+{
+	union nvme_cmd cmd = {};
+
+	ncompleted++;
+
+	nvme_rq_submit(rq, &cmd, complete_cb, &ncompleted);
+}
+
+static void post_cqe(struct nvme_cq *cq, uint16_t idx, uint16_t sqid, uint16_t cid)
+{
+	struct nvme_cqe *cqe = cq->vaddr + (idx << NVME_CQES);
+
+	cqe->sqid = cpu_to_le16(sqid);
+	cqe->cid = cid;
+	cqe->sfp = cpu_to_le16(0x1);
+}
+
+static void test_cq_process(void)
+{
+	uint32_t sqdb = 0, cqdb = 0;
+	struct nvme_sq sqs[2] = {};
+	struct nvme_rq rqs[4] = {};
+	struct nvme_cq cq = {
+		.qsize = 8,
+		.doorbell = &cqdb,
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+	union nvme_cmd cmd = {};
+	int completed = 0;
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = 8,
+		.doorbell = &sqdb,
+		.cq = &cq,
+		.rqs = rqs,
+	};
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = 0; i < 4; i++) {
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+	}
+
+	ok1(nvme_cq_process(&cq, 8) == 0);
+
+	/* the rq stack starts out empty */
+	ok1(!nvme_rq_acquire(&sqs[1]) && errno == EBUSY && sqs[1].stats.busy == 1);
+
+	/* submit the trackers directly */
+	nvme_rq_submit(&rqs[0], &cmd, complete_cb, &completed);
+	nvme_rq_submit(&rqs[1], &cmd, resubmit_cb, NULL);
+	nvme_rq_submit(&rqs[2], &cmd, complete_cb, &completed);
+	nvme_sq_update_tail(&sqs[1]);
+
+	post_cqe(&cq, 0, 1, 0);
+	post_cqe(&cq, 1, 1, 1);
+	post_cqe(&cq, 2, 1, 2);
+
+	/* budget limits the number of completions processed */
+	ok1(nvme_cq_process(&cq, 1) == 1 && completed == 1 && cqdb == 1);
+	ok1(__nvme_rq_top(&sqs[1], sqs[1].rq_top) == &rqs[0]);
+
+	ok1(nvme_cq_process(&cq, 8) == 2 && completed == 2 && ncompleted == 1);
+	ok1(cq.head == 3 && cqdb == 3);
+
+	/* resubmitted from the callback; not released and tail doorbell written */
+	ok1(__nvme_rq_top(&sqs[1], sqs[1].rq_top) == &rqs[2] && rqs[2].rq_next == &rqs[0]);
+	ok1(rqs[1].cb == complete_cb && sqdb == 4);
+
+	/* a duplicate entry for a released tracker is consumed and skipped */
+	post_cqe(&cq, 3, 1, 0);
+
+	ok1(nvme_cq_process(&cq, 8) == 1 && completed == 2 && cq.head == 4 &&
+	    __nvme_rq_top(&sqs[1], sqs[1].rq_top) == &rqs[2] && rqs[2].rq_next == &rqs[0]);
+}
+
+static void test_latency(void)
+{
+	uint32_t sqdb = 0, cqdb = 0;
+	struct nvme_sq sqs[2] = {};
+	struct nvme_rq rqs[4] = {};
+	struct nvme_cq cq = {
+		.qsize = 8,
+		.doorbell = &cqdb,
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+	struct nvme_sq_latency lat;
+	union nvme_cmd cmd = {};
+	uint64_t start;
+	bool sane = true;
+	int completed = 0;
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = 8,
+		.doorbell = &sqdb,
+		.cq = &cq,
+		.rqs = rqs,
+	};
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = 0; i < 4; i++) {
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+	}
+
+	/* linear up to the sub-bucket count, then four buckets per power of two */
+	ok1(nvme_lat_hist_bucket(3) == 3 && nvme_lat_hist_bucket(4) == 4 &&
+	    nvme_lat_hist_bucket(9) == 8 && nvme_lat_hist_bucket(10) == 9 &&
+	    nvme_lat_hist_bucket(UINT64_MAX) == NVME_LAT_HIST_BUCKETS - 1);
+
+	for (uint64_t ns = 0; ns < 1 << 20; ns++) {
+		unsigned int idx = nvme_lat_hist_bucket(ns);
+
+		if (nvme_lat_hist_lower(idx) > ns || nvme_lat_hist_lower(idx + 1) <= ns)
+			sane = false;
+	}
+
+	ok1(sane);
+
+	ok1(nvme_sq_get_latency(&sqs[1], &lat) == -1 && errno == ENOENT);
+
+	/* posted before tracking was enabled */
+	nvme_rq_submit(&rqs[0], &cmd, complete_cb, &completed);
+	rqs[0].tsubmit = 1;
+
+	ok1(nvme_sq_set_latency_tracking(&sqs[1], true) == 0 && !rqs[0].tsubmit);
+
+	nvme_rq_submit(&rqs[1], &cmd, complete_cb, &completed);
+	nvme_rq_post_batch((struct nvme_rq *[]) { &rqs[2] }, &cmd, 1);
+	rqs[2].cb = complete_cb;
+	rqs[2].cb_arg = &completed;
+	nvme_sq_update_tail(&sqs[1]);
+
+	ok1(rqs[1].tsubmit && rqs[2].tsubmit);
+
+	start = get_ticks();
+	while (ticks_to_ns(get_ticks() - start) < 2000)
+		;
+
+	post_cqe(&cq, 0, 1, 0);
+	post_cqe(&cq, 1, 1, 1);
+	post_cqe(&cq, 2, 1, 2);
+
+	ok1(nvme_cq_process(&cq, 8) == 3 && completed == 3);
+
+	/* the batch shares a single completion timestamp */
+	ok1(nvme_sq_get_latency(&sqs[1], &lat) == 0 && lat.count == 2 &&
+	    lat.max_ns >= 2000 && lat.sum_ns >= 4000);
+	ok1(lat.buckets[nvme_lat_hist_bucket(lat.max_ns)] >= 1 && !rqs[1].tsubmit);
+
+	ok1(nvme_sq_set_latency_tracking(&sqs[1], false) == 0 &&
+	    nvme_sq_get_latency(&sqs[1], &lat) == -1 && errno == ENOENT);
+}
+
+static void test_shared_cq(void)
+{
+	uint32_t sqdb[3] = {}, cqdb = 0;
+	struct nvme_sq sqs[3] = {};
+	struct nvme_rq rqs[3][2] = {};
+	struct nvme_cq cq = {
+		.qsize = 8,
+		.doorbell = &cqdb,
+		.nsqs = 3,
+		.sqs = sqs,
+	};
+	static const uint16_t order[4][3] = {
+		/* sqid, cid, sqhd */
+		{ 1, 0, 1 }, { 2, 0, 1 }, { 1, 1, 2 }, { 2, 1, 2 },
+	};
+	union nvme_cmd cmd = {};
+	struct nvme_cqe *cqes;
+	int completed = 0;
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	cqes = cq.vaddr;
+
+	for (int i = 1; i < 3; i++) {
+		sqs[i] = (struct nvme_sq) {
+			.id = i,
+			.qsize = 8,
+			.doorbell = &sqdb[i],
+			.cq = &cq,
+			.rqs = rqs[i],
+		};
+
+		assert(pgmap(&sqs[i].vaddr, __VFN_PAGESIZE) > 0);
+
+		for (int j = 0; j < 2; j++) {
+			rqs[i][j].sq = &sqs[i];
+			rqs[i][j].cid = (uint16_t)j;
+		}
+
+		nvme_rq_submit(&rqs[i][0], &cmd, complete_cb, &completed);
+		nvme_rq_submit(&rqs[i][1], &cmd, resubmit_cb, NULL);
+		nvme_sq_update_tail(&sqs[i]);
+	}
+
+	/* interleaved completions from both submission queues */
+	for (int i = 0; i < 4; i++) {
+		cqes[i].sqid = cpu_to_le16(order[i][0]);
+		cqes[i].cid = order[i][1];
+		cqes[i].sqhd = cpu_to_le16(order[i][2]);
+		cqes[i].sfp = cpu_to_le16(0x1);
+	}
+
+	ok1(nvme_cq_rq_from_cqe(&cq, &cqes[2]) == &rqs[1][1]);
+
+	ok1(nvme_cq_process(&cq, 8) == 4 && completed == 2 && cqdb == 4);
+
+	/* head tracked per submission queue */
+	ok1(sqs[1].head == 2 && sqs[2].head == 2);
+	ok1(nvme_sq_space(&sqs[1]) == 6);
+
+	/* resubmissions flushed with a single doorbell write per queue */
+	ok1(sqdb[1] == 3 && sqdb[2] == 3 &&
+	    sqs[1].stats.doorbells == 2 && sqs[2].stats.doorbells == 2);
+}
+
+#define STEAL_QSIZE 64
+
+static int steal_counts[STEAL_QSIZE];
+static int steal_total;
+
+static void steal_cb(struct nvme_rq *rq, struct nvme_cqe *cqe UNUSED, void *arg UNUSED)
+{
+	/* serialized by the completion queue lock */
+	steal_counts[rq->cid]++;
+	steal_total++;
+}
+
+static void *steal_thread(void *opaque)
+{
+	struct nvme_cq *cq = opaque;
+
+	while (atomic_load_acquire(&steal_total) < STEAL_QSIZE - 1)
+		nvme_cq_steal(&cq, 1, 1);
+
+	return NULL;
+}
+
+static void steal_setup(struct nvme_cq *cq, struct nvme_sq *sqs, struct nvme_rq *rqs,
+			uint32_t *sqdb, uint32_t *cqdb, int nrqs)
+{
+	*cq = (struct nvme_cq) {
+		.qsize = STEAL_QSIZE,
+		.doorbell = cqdb,
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = STEAL_QSIZE,
+		.doorbell = sqdb,
+		.cq = cq,
+		.rqs = rqs,
+	};
+
+	assert(pgmap(&cq->vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = 0; i < nrqs; i++) {
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+	}
+}
+
+static void test_cq_steal(void)
+{
+	uint32_t sqdb[2] = {}, cqdb[2] = {};
+	struct nvme_sq sqs[2][2] = {};
+	struct nvme_rq rqs[2][STEAL_QSIZE] = {};
+	struct nvme_cq cqs[2], *peers[2] = { &cqs[0], &cqs[1] };
+	union nvme_cmd cmd = {};
+	pthread_t threads[4];
+	int completed = 0;
+	bool once = true;
+
+	for (int i = 0; i < 2; i++)
+		steal_setup(&cqs[i], sqs[i], rqs[i], &sqdb[i], &cqdb[i], STEAL_QSIZE);
+
+	nvme_rq_submit(&rqs[1][0], &cmd, complete_cb, &completed);
+	nvme_rq_submit(&rqs[1][1], &cmd, complete_cb, &completed);
+	nvme_sq_update_tail(&sqs[1][1]);
+
+	post_cqe(&cqs[1], 0, 1, 0);
+	post_cqe(&cqs[1], 1, 1, 1);
+
+	ok1(!nvme_cq_pending(&cqs[0]) && nvme_cq_pending(&cqs[1]));
+
+	/* the owner is processing the queue */
+	nvme_cq_lock(&cqs[1]);
+
+	ok1(nvme_cq_steal(peers, 2, 8) == 0 && nvme_cq_process_shared(&cqs[1], 8) == 0);
+	ok1(!completed && cqs[1].head == 0);
+
+	nvme_cq_unlock(&cqs[1]);
+
+	/* idle peers are skipped */
+	ok1(nvme_cq_steal(peers, 2, 8) == 2 && completed == 2 && cqdb[1] == 2);
+	ok1(!cqs[1].lock && !nvme_cq_pending(&cqs[1]) && nvme_cq_steal(peers, 2, 8) == 0);
+
+	/* several stealers racing for a single queue process each completion once */
+	for (int i = 0; i < STEAL_QSIZE - 1; i++) {
+		nvme_rq_submit(&rqs[0][i], &cmd, steal_cb, NULL);
+		post_cqe(&cqs[0], (uint16_t)i, 1, (uint16_t)i);
+	}
+
+	nvme_sq_update_tail(&sqs[0][1]);
+
+	for (int i = 0; i < 4; i++)
+		assert(pthread_create(&threads[i], NULL, steal_thread, &cqs[0]) == 0);
+
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < STEAL_QSIZE - 1; i++)
+		once &= steal_counts[i] == 1;
+
+	ok1(once && steal_total == STEAL_QSIZE - 1);
+	ok1(cqs[0].head == STEAL_QSIZE - 1 && cqdb[0] == STEAL_QSIZE - 1 && !cqs[0].lock);
+}
+
+static void test_tmpl(void)
+{
+	struct nvme_ctrl ctrl = {};
+	struct nvme_ns ns = { .nsid = 2, .lbads = 9 };
+	struct nvme_cq cq = {};
+	struct nvme_sq sq = { .id = 1, .qsize = 4, .cq = &cq };
+	struct nvme_rq rq = { .sq = &sq, .cid = 3 };
+	struct nvme_cmd_tmpl tmpl;
+	union nvme_cmd *sqes;
+	int completed = 0;
+
+	assert(pgmap(&sq.vaddr, __VFN_PAGESIZE) > 0);
+	sqes = sq.vaddr;
+
+	nvme_cmd_tmpl_init(&tmpl, &ns, NVME_NVM_WRITE);
+	nvme_rw_set_directive(&tmpl.cmd, NVME_DIR_TYPE_STREAMS, 7);
+
+	ok1(ALIGNED((uintptr_t)&tmpl, 64) && tmpl.cmd.rw.nsid == cpu_to_le32(2));
+
+	/* patched in place; the invariant fields are kept */
+	ok1(nvme_rq_submit_tmpl(&ctrl, &rq, &tmpl, 0x10, 8, 0x1000000, complete_cb,
+				&completed) == 0);
+	ok1(sqes[0].rw.opcode == NVME_NVM_WRITE && sqes[0].cid == 3 &&
+	    le64_to_cpu(sqes[0].rw.slba) == 0x10 && le16_to_cpu(sqes[0].rw.nlb) == 7);
+	ok1(le16_to_cpu(sqes[0].rw.dspec) == 7 && le64_to_cpu(sqes[0].dptr.prp1) == 0x1000000 &&
+	    !sqes[0].dptr.prp2);
+	ok1(sq.tail == 1 && rq.cb == complete_cb && rq.cb_arg == &completed);
+
+	/* write-combined queues are posted from a copy */
+	sq.flags = NVME_SQ_F_CMB;
+
+	ok1(nvme_rq_post_tmpl(&ctrl, &rq, &tmpl, 0x20, 1, 0x1000000) == 0);
+	ok1(sq.tail == 2 && le64_to_cpu(sqes[1].rw.slba) == 0x20 && !sqes[1].rw.nlb);
+
+	sq.flags = 0;
+
+	/* timestamped for latency tracking like nvme_rq_post() */
+	ok1(nvme_sq_set_latency_tracking(&sq, true) == 0 && !rq.tsubmit);
+	ok1(nvme_rq_post_tmpl(&ctrl, &rq, &tmpl, 0x30, 1, 0x1000000) == 0 && rq.tsubmit);
+	ok1(nvme_sq_set_latency_tracking(&sq, false) == 0);
+
+	/* a failed mapping does not post anything */
+	ctrl.config.sgls = NVME_SGLS_SUPPORTED;
+
+	ok1(nvme_rq_post_tmpl(&ctrl, &rq, &tmpl, 0x0, UINT32_MAX, 0x1000000) == -1 &&
+	    sq.tail == 3);
+}
+
+NVME_QUEUE_POW2_DEFINE(q8, 8);
+
+/* the power-of-two variants track the generic functions */
+static void test_pow2(void)
+{
+	struct nvme_sq sqs[2] = {};
+	struct nvme_rq rqs[8] = {};
+	struct nvme_cq cq = {
+		.qsize = 8,
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+	struct nvme_cq ref = {
+		.qsize = 8,
+	};
+	struct nvme_cqe *batch[8], *rbatch[8], *cqes;
+	union nvme_cmd cmd = {};
+	bool same = true;
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = 8,
+		.cq = &cq,
+		.rqs = rqs,
+	};
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	ref.vaddr = cqes = cq.vaddr;
+
+	for (int i = 0; i < 11; i++)
+		nvme_sq_post_q8(&sqs[1], &cmd);
+
+	ok1(sqs[1].tail == 3);
+
+	/* two laps of single and batched reaps, crossing the wrap */
+	for (int lap = 0, from = 0; lap < 4; lap++) {
+		int n = lap % 2 ? 5 : 3;
+
+		for (int i = 0; i < n; i++) {
+			uint16_t idx = (uint16_t)((from + i) % 8);
+
+			/* entries after the wrap carry the inverted phase */
+			post_cqe(&cq, idx, 1, 0);
+			cqes[idx].sfp = cpu_to_le16((uint16_t)(!cq.phase ^ (from + i >= 8)));
+		}
+
+		if (lap % 2) {
+			same &= nvme_cq_reap_batch_q8(&cq, batch, 8) == n;
+			same &= nvme_cq_reap_batch(&ref, rbatch, 8) == n;
+			same &= !memcmp(batch, rbatch, sizeof(*batch) * (size_t)n);
+		} else {
+			for (int i = 0; i < n; i++)
+				same &= nvme_cq_get_cqe_q8(&cq) == nvme_cq_get_cqe(&ref);
+		}
+
+		same &= !nvme_cq_get_cqe_q8(&cq) && cq.head == ref.head && cq.phase == ref.phase;
+
+		from = (from + n) % 8;
+	}
+
+	ok1(same);
+	ok1(cq.head == 0 && cq.phase == 0);
+
+	/* command identifiers are masked into range; the last tracker is the spare */
+	cqes[0].cid = 7;
+	ok1(nvme_cq_rq_from_cqe_q8(&cq, &cqes[0]) == &rqs[7]);
+
+	cqes[0].cid = 10;
+	ok1(nvme_cq_rq_from_cqe_q8(&cq, &cqes[0]) == &rqs[2]);
+}
+
+static void *release_thread(void *opaque)
+{
+	nvme_rq_release(opaque);
+
+	return NULL;
+}
+
+static void test_rq_cache(void)
+{
+	struct nvme_rq rqs[4] = {};
+	struct nvme_sq sq = { .id = 1, .rqs = rqs };
+	struct nvme_rq_cache cache;
+	struct nvme_rq *a, *b, *c;
+	pthread_t thread;
+
+	for (int i = 3; i >= 0; i--) {
+		rqs[i].sq = &sq;
+		rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&rqs[i]);
+	}
+
+	/* three trackers move to the cache, one stays on the queue */
+	ok1(nvme_rq_cache_init(&cache, &sq, 3) == 3 && __nvme_rq_top(&sq, sq.rq_top) == &rqs[3]);
+
+	a = nvme_rq_cache_acquire(&cache);
+	b = nvme_rq_cache_acquire(&cache);
+	c = nvme_rq_cache_acquire(&cache);
+	ok1(a && b && c && a->cache == &cache);
+	ok1(!nvme_rq_cache_acquire(&cache) && errno == EBUSY);
+
+	/* released on another thread; reclaimed through the remote list */
+	assert(pthread_create(&thread, NULL, release_thread, b) == 0);
+	pthread_join(thread, NULL);
+	ok1(cache.remote == b && !cache.free);
+	ok1(nvme_rq_cache_acquire(&cache) == b && !cache.remote);
+
+	/* released locally */
+	nvme_rq_cache_release(a);
+	nvme_rq_release(c);
+	ok1(cache.free == a && cache.remote == c && __nvme_rq_top(&sq, sq.rq_top) == &rqs[3]);
+
+	/* outstanding tracker returned before fini; all end up on the queue */
+	nvme_rq_cache_release(b);
+	nvme_rq_cache_fini(&cache);
+
+	for (int i = 0; i < 4; i++)
+		ok1(nvme_rq_acquire(&sq) && !rqs[i].cache);
+
+	ok1(!nvme_rq_acquire(&sq));
+}
+
+static bool prp_fill_backend_ok(const struct nvme_prp_fill_backend *backend)
+{
+	static leint64_t prps[72];
+
+	for (int pageshift = 12; pageshift <= 16; pageshift += 4) {
+		for (int n = 0; n <= 64; n++) {
+			uint64_t iova = 0x1000000 + ((uint64_t)n << pageshift);
+
+			for (int i = 0; i < 72; i++)
+				prps[i] = cpu_to_le64(~0ULL);
+
+			/* unaligned start */
+			backend->fill(&prps[1], iova, pageshift, n);
+
+			if (prps[0] != cpu_to_le64(~0ULL) || prps[n + 1] != cpu_to_le64(~0ULL))
+				return false;
+
+			for (int i = 0; i < n; i++) {
+				if (le64_to_cpu(prps[i + 1]) != iova + ((uint64_t)i << pageshift))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static void test_prp_chain(void)
+{
+	struct nvme_ctrl ctrl = {
+		.config.mps = 0,
+	};
+
+	struct nvme_prp_page pages[2] = {};
+	struct nvme_sq sq = { .id = 1, .prp_pages = pages };
+	struct nvme_rq rq = { .sq = &sq };
+	leint64_t *prplist, *chain[2];
+	union nvme_cmd cmd;
+
+	assert(pgmap((void **)&prplist, __VFN_PAGESIZE) > 0);
+
+	rq.page.vaddr = prplist;
+	rq.page.iova = 0x8000000;
+
+	for (int i = 0; i < 2; i++) {
+		assert(pgmap((void **)&chain[i], __VFN_PAGESIZE) > 0);
+
+		pages[i].vaddr = chain[i];
+		pages[i].iova = 0x9000000 + ((uint64_t)i << 12);
+	}
+
+	sq.prp_top = __nvme_prp_top_set(&sq, 0, &pages[0]);
+
+	/* 513 list entries; the last one goes to a chained list page */
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 514 * 0x1000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x8000000);
+	ok1(le64_to_cpu(prplist[510]) == 0x1000000 + 511 * 0x1000);
+	ok1(le64_to_cpu(prplist[511]) == 0x9000000);
+	ok1(le64_to_cpu(chain[0][0]) == 0x1000000 + 512 * 0x1000);
+	ok1(le64_to_cpu(chain[0][1]) == 0x1000000 + 513 * 0x1000);
+	ok1(rq.prp_chain == &pages[0] && !__nvme_prp_top(&sq, sq.prp_top));
+
+	/* released with the tracker */
+	nvme_rq_release(&rq);
+	ok1(!rq.prp_chain && __nvme_prp_top(&sq, sq.prp_top) == &pages[0]);
+
+	/* pool exhausted; pages taken so far are returned */
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 1025 * 0x1000) == -1 && errno == EBUSY);
+	ok1(!rq.prp_chain && __nvme_prp_top(&sq, sq.prp_top) == &pages[0]);
+
+	/* two chained pages */
+	pages[0].next = &pages[1];
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 1025 * 0x1000) == 0);
+	ok1(le64_to_cpu(chain[0][511]) == 0x9001000);
+	ok1(le64_to_cpu(chain[1][0]) == 0x1000000 + 1023 * 0x1000);
+	ok1(le64_to_cpu(chain[1][1]) == 0x1000000 + 1024 * 0x1000);
+
+	/* remapping returns the chain */
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 0x2000) == 0);
+	ok1(!rq.prp_chain && __nvme_prp_top(&sq, sq.prp_top));
+}
+
+static void test_prp_cache(void)
+{
+	struct nvme_ctrl ctrl = {
+		.config.mps = 0,
+	};
+
+	struct nvme_sq sq = { .id = 1 };
+	struct nvme_rq rq = { .sq = &sq };
+	struct iovec iov[2];
+	leint64_t *prplist;
+	union nvme_cmd cmd;
+
+	assert(pgmap((void **)&prplist, __VFN_PAGESIZE) > 0);
+
+	rq.page.vaddr = prplist;
+	rq.page.iova = 0x8000000;
+
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 0x4000) == 0);
+	ok1(rq.prp_cache.iova == 0x1000000 && rq.prp_cache.len == 0x4000);
+
+	/* same buffer; the list is not rebuilt */
+	prplist[2] = cpu_to_le64(0xdead000);
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 0x4000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x8000000 && le64_to_cpu(prplist[2]) == 0xdead000);
+
+	/* prefix */
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 0x2000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x1001000);
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 0x800) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x0);
+
+	/* longer or different buffers rebuild the list */
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x1000000, 0x5000) == 0);
+	ok1(le64_to_cpu(prplist[2]) == 0x1003000 && rq.prp_cache.len == 0x5000);
+	ok1(nvme_rq_map_prp(&ctrl, &rq, &cmd, 0x2000000, 0x3000) == 0);
+	ok1(le64_to_cpu(prplist[0]) == 0x2001000 && rq.prp_cache.iova == 0x2000000);
+
+	/* other users of the prp list page invalidate it */
+	iov[0] = (struct iovec) {.iov_base = (void *)0x2000000, .iov_len = 0x1000};
+	iov[1] = (struct iovec) {.iov_base = (void *)0x3000000, .iov_len = 0x1000};
+	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == 0 && !rq.prp_cache.len);
+}
+
+static void test_copy_dsm(void)
+{
+	struct nvme_ctrl ctrl = {
+		.config.mps = 0,
+	};
+
+	struct nvme_ns ns = { .nsid = 1, .nsze = 0x100000, .lbads = 12 };
+	struct nvme_sq sq = { .id = 1 };
+	struct nvme_rq rq = { .sq = &sq };
+	struct nvme_rq_copy_range cr[129];
+	struct nvme_rq_dsm_range dr[257];
+	struct nvme_copy_desc_fmt0 *d0;
+	struct nvme_copy_desc_fmt1 *d1;
+	struct nvme_dsm_desc *dd;
+	union nvme_cmd cmd;
+	void *page;
+
+	assert(pgmap(&page, __VFN_PAGESIZE) > 0);
+
+	rq.page.vaddr = page;
+	rq.page.iova = 0x8000000;
+
+	for (int i = 0; i < 129; i++)
+		cr[i] = (struct nvme_rq_copy_range) {
+			.slba = (uint64_t)i * 8, .nlb = 8, .reftag = 0x123456789a, .apptag = 0xbeef,
+		};
+
+	for (int i = 0; i < 257; i++)
+		dr[i] = (struct nvme_rq_dsm_range) { .slba = (uint64_t)i * 16, .nlb = 16 };
+
+	/* a full page of format 0 descriptors */
+	rq.prp_cache.len = 0x4000;
+	ok1(nvme_rq_prep_copy(&ctrl, &rq, &ns, &cmd, 0x2000, cr, 128, NVME_COPY_FORMAT_0) == 0);
+	ok1(cmd.opcode == NVME_NVM_COPY && le32_to_cpu(cmd.cdw10) == 0x2000);
+	ok1(le32_to_cpu(cmd.cdw12) == 127 && le64_to_cpu(cmd.dptr.prp1) == 0x8000000);
+	ok1(!rq.prp_cache.len);
+
+	d0 = (struct nvme_copy_desc_fmt0 *)page + 127;
+	ok1(le64_to_cpu(d0->slba) == 127 * 8 && le16_to_cpu(d0->nlb) == 7);
+	ok1(le32_to_cpu(d0->elbt) == 0x3456789a && le16_to_cpu(d0->elbat) == 0xbeef);
+
+	ok1(nvme_rq_prep_copy(&ctrl, &rq, &ns, &cmd, 0x2000, cr, 129, NVME_COPY_FORMAT_0) == -1);
+
+	ok1(nvme_rq_prep_copy(&ctrl, &rq, &ns, &cmd, 0x2000, cr, 2, NVME_COPY_FORMAT_1) == 0);
+	ok1(le32_to_cpu(cmd.cdw12) == (1 | NVME_COPY_FORMAT_1 << 8));
+
+	d1 = (struct nvme_copy_desc_fmt1 *)page + 1;
+	ok1(le64_to_cpu(d1->slba) == 8 && d1->elbt[0] == 0x9a && d1->elbt[4] == 0x12);
+
+	/* ranges beyond the namespace */
+	cr[0].slba = ns.nsze - 4;
+	ok1(nvme_rq_prep_copy(&ctrl, &rq, &ns, &cmd, 0x2000, cr, 1, NVME_COPY_FORMAT_0) == -1);
+
+	ok1(nvme_rq_prep_dsm(&ctrl, &rq, &ns, &cmd, dr, 256, NVME_DSM_AD) == 0);
+	ok1(cmd.opcode == NVME_NVM_DSM && le32_to_cpu(cmd.cdw10) == 255);
+	ok1(le32_to_cpu(cmd.cdw11) == NVME_DSM_AD);
+
+	dd = (struct nvme_dsm_desc *)page + 255;
+	ok1(le64_to_cpu(dd->slba) == 255 * 16 && le32_to_cpu(dd->nlb) == 16);
+
+	ok1(nvme_rq_prep_dsm(&ctrl, &rq, &ns, &cmd, dr, 257, NVME_DSM_AD) == -1);
+
+	pgunmap(page, __VFN_PAGESIZE);
+}
+
+static void test_map_fixed(void)
+{
+	struct nvme_fixed_buf buf = {
+		.vaddr = (void *)0x1000000,
+		.iova = 0x1000000,
+		.len = 0x400000,
+		.prps_iova = 0x9000000,
+	};
+
+	struct nvme_ctrl ctrl = {
+		.config.mps = 0,
+		.fixed.bufs = &buf,
+		.fixed.nbufs = 1,
+	};
+
+	struct nvme_sq sq = { .id = 1 };
+	struct nvme_rq rq = { .sq = &sq };
+	leint64_t *prplist;
+	union nvme_cmd cmd;
+
+	assert(pgmap((void **)&prplist, __VFN_PAGESIZE) > 0);
+
+	rq.page.vaddr = prplist;
+	rq.page.iova = 0x8000000;
+
+	ok1(nvme_rq_map_fixed(&ctrl, &rq, &cmd, 0, 0x0, 0x1000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x1000000 && le64_to_cpu(cmd.dptr.prp2) == 0x0);
+
+	ok1(nvme_rq_map_fixed(&ctrl, &rq, &cmd, 0, 0x0, 0x2000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x1001000);
+
+	/* the registered prp list is referred to directly */
+	ok1(nvme_rq_map_fixed(&ctrl, &rq, &cmd, 0, 0x10, 0x2000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x1000010 && le64_to_cpu(cmd.dptr.prp2) == 0x9000008);
+
+	ok1(nvme_rq_map_fixed(&ctrl, &rq, &cmd, 0, 0x1000, 0x4000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x1001000 && le64_to_cpu(cmd.dptr.prp2) == 0x9000010);
+
+	/* entries 510 to 513 cross a page of the registered list */
+	ok1(nvme_rq_map_fixed(&ctrl, &rq, &cmd, 0, 0x1fd000, 0x5000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x8000000 && le64_to_cpu(prplist[0]) == 0x11fe000);
+
+	/* out of range */
+	ok1(nvme_rq_map_fixed(&ctrl, &rq, &cmd, 0, 0x3ff000, 0x2000) == -1 && errno == EINVAL);
+	ok1(nvme_rq_map_fixed(&ctrl, &rq, &cmd, 1, 0x0, 0x1000) == -1 && errno == EINVAL);
+
+	/* sgl data block */
+	ctrl.config.sgls = NVME_SGLS_SUPPORTED;
+	ok1(nvme_rq_map_fixed(&ctrl, &rq, &cmd, 0, 0x1004, 0x10000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.sgl.addr) == 0x1001004);
+	ok1(le32_to_cpu(cmd.dptr.sgl.len) == 0x10000);
+}
+
 int main(void)
 {
 	struct nvme_ctrl ctrl = {
 		.config.mps = 0,
 	};
 
-	struct nvme_rq rq;
+	struct nvme_sq sq = { .id = 1 };
+	struct nvme_rq rq = { .sq = &sq };
+	struct nvme_sgld *sgld;
 	union nvme_cmd cmd;
 	leint64_t *prplist;
 	struct iovec iov[8];
 
-	plan_tests(89);
+	plan_tests(230 + nvme_prp_fill_nbackends);
+
+	for (int i = 0; i < nvme_prp_fill_nbackends; i++) {
+		const struct nvme_prp_fill_backend *backend = &nvme_prp_fill_backends[i];
+
+		if (!backend->supported()) {
+			skip(1, "%s not supported", backend->name);
+			continue;
+		}
+
+		ok(prp_fill_backend_ok(backend), "%s prp list fill", backend->name);
+	}
 
 	assert(pgmap((void **)&prplist, __VFN_PAGESIZE) > 0);
 
@@ -332,5 +1107,109 @@ int main(void)
 	iov[1] = (struct iovec) {.iov_base = (void *)0x1001000, .iov_len = __max_prps * 0x1000};
 	ok1(nvme_rq_mapv_prp(&ctrl, &rq, &cmd, iov, 2) == -1);
 
+	/*
+	 * Request tracker data buffer
+	 */
+
+	rq.buf.vaddr = NULL;
+	ok1(nvme_rq_map_own_buf(&ctrl, &rq, &cmd, 0x1000) == -1 && errno == EINVAL);
+
+	rq.buf.vaddr = (void *)0x1000000;
+	rq.buf.iova = 0x2000000;
+	rq.buf.len = 0x2000;
+
+	ok1(nvme_rq_map_own_buf(&ctrl, &rq, &cmd, 0x2001) == -1 && errno == EINVAL);
+
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	ok1(nvme_rq_map_own_buf(&ctrl, &rq, &cmd, 0x2000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x2000000);
+	ok1(le64_to_cpu(cmd.dptr.prp2) == 0x2001000);
+
+	/*
+	 * Scatter Gather Lists
+	 */
+
+	sgld = (struct nvme_sgld *)prplist;
+
+	memset(&cmd, 0x0, sizeof(cmd));
+	ok1(nvme_rq_map_sgl(&ctrl, &rq, &cmd, 0x1000004, 0x2000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.sgl.addr) == 0x1000004);
+	ok1(le32_to_cpu(cmd.dptr.sgl.len) == 0x2000);
+	ok1(cmd.dptr.sgl.type == NVME_SGLD_TYPE_DATA_BLOCK << NVME_SGLD_TYPE_SHIFT);
+	ok1(((cmd.flags >> NVME_CMD_FLAGS_PSDT_SHIFT) & NVME_CMD_FLAGS_PSDT_MASK) ==
+	    NVME_CMD_FLAGS_PSDT_SGL_MPTR_CONTIG);
+
+	/* unaligned middle segments are fine */
+	memset((void *)prplist, 0x0, __VFN_PAGESIZE);
+	iov[0] = (struct iovec) {.iov_base = (void *)0x1000004, .iov_len = 0x10};
+	iov[1] = (struct iovec) {.iov_base = (void *)0x2000008, .iov_len = 0x1004};
+	iov[2] = (struct iovec) {.iov_base = (void *)0x3000000, .iov_len = 0x200};
+	ok1(nvme_rq_mapv_sgl(&ctrl, &rq, &cmd, iov, 3) == 0);
+	ok1(le64_to_cpu(cmd.dptr.sgl.addr) == 0x8000000);
+	ok1(le32_to_cpu(cmd.dptr.sgl.len) == 3 * sizeof(struct nvme_sgld));
+	ok1(cmd.dptr.sgl.type == NVME_SGLD_TYPE_LAST_SEGMENT << NVME_SGLD_TYPE_SHIFT);
+	ok1(le64_to_cpu(sgld[1].addr) == 0x2000008 && le32_to_cpu(sgld[1].len) == 0x1004);
+	ok1(le64_to_cpu(sgld[2].addr) == 0x3000000 && le32_to_cpu(sgld[2].len) == 0x200);
+
+	/* dword alignment requirement */
+	ctrl.config.sgls = NVME_SGLS_SUPPORTED_DWORD;
+	iov[1].iov_base = (void *)0x2000006;
+	ok1(nvme_rq_mapv_sgl(&ctrl, &rq, &cmd, iov, 3) == -1 && errno == EINVAL);
+
+	/* automatic selection */
+	cmd.flags = 0x0;
+	ctrl.config.sgls = 0x0;
+	ok1(nvme_rq_map(&ctrl, &rq, &cmd, 0x1000000, 0x1000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x1000000 && cmd.flags == 0x0);
+
+	ctrl.config.sgls = NVME_SGLS_SUPPORTED;
+	ok1(nvme_rq_mapv(&ctrl, &rq, &cmd, iov, 3) == 0);
+	ok1(cmd.dptr.sgl.type == NVME_SGLD_TYPE_LAST_SEGMENT << NVME_SGLD_TYPE_SHIFT);
+
+	/* never for admin commands */
+	sq.id = 0;
+	cmd.flags = 0x0;
+	ok1(nvme_rq_map(&ctrl, &rq, &cmd, 0x1000000, 0x1000) == 0);
+	ok1(le64_to_cpu(cmd.dptr.prp1) == 0x1000000 && cmd.flags == 0x0);
+
+	/* too many descriptors */
+	ok1(nvme_rq_mapv_sgl(&ctrl, &rq, &cmd, iov, __VFN_PAGESIZE / 16 + 1) == -1);
+
+	/*
+	 * Completion processing
+	 */
+
+	test_cq_process();
+	test_latency();
+	test_shared_cq();
+	test_cq_steal();
+	test_tmpl();
+	test_pow2();
+
+	/*
+	 * Per-thread request tracker caches
+	 */
+
+	test_rq_cache();
+
+	/*
+	 * Chained prp lists
+	 */
+
+	test_prp_chain();
+	test_prp_cache();
+
+	/*
+	 * Copy and Dataset Management
+	 */
+
+	test_copy_dsm();
+
+	/*
+	 * Registered buffers
+	 */
+
+	test_map_fixed();
+
 	return exit_status();
 }
@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/rxring: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "types.h"
+
+struct nvme_rxring_write {
+	struct nvme_rxring *rx;
+
+	nvme_rq_cb cb;
+	void *arg;
+
+	uint16_t bids[NVME_RXRING_SEGS_MAX];
+	int nbids;
+
+	struct nvme_rxring_write *next;
+};
+
+#ifdef HAVE_IO_URING_PBUF_RING
+static int __register(struct nvme_rxring *rx, unsigned int op, void *arg)
+{
+	return (int)syscall(__NR_io_uring_register, rx->uring_fd, op, arg, 1);
+}
+
+/* hand buffer @bid to the kernel */
+static void __provide(struct nvme_rxring *rx, uint16_t bid)
+{
+	struct io_uring_buf_ring *br = rx->br;
+	struct io_uring_buf *buf = &br->bufs[rx->tail & (rx->nbufs - 1)];
+
+	buf->addr = (uintptr_t)nvme_rxring_buf(rx, bid);
+	buf->len = (uint32_t)rx->buf_size;
+	buf->bid = bid;
+
+	rx->tail++;
+
+	/* publish the entry */
+	atomic_store_release(&br->tail, rx->tail);
+}
+
+int nvme_rxring_init(struct nvme_rxring *rx, struct nvme_ctrl *ctrl, int uring_fd, uint16_t bgid,
+		     unsigned int nbufs, size_t buf_size)
+{
+	struct io_uring_buf_reg reg = {};
+	size_t len;
+
+	if (!nbufs || nbufs > 32768 || nbufs & (nbufs - 1) || !buf_size || buf_size & 0x3 ||
+	    buf_size > UINT32_MAX) {
+		log_debug("invalid number of buffers %u or buffer size %zu\n", nbufs, buf_size);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	*rx = (struct nvme_rxring) {
+		.buf_size = buf_size,
+		.nbufs = nbufs,
+		.bgid = bgid,
+		.ctrl = ctrl,
+		.uring_fd = uring_fd,
+		.br_len = ALIGN_UP(nbufs * sizeof(struct io_uring_buf), __VFN_PAGESIZE),
+	};
+
+	len = nbufs * buf_size;
+
+	if (iommu_alloc_node(__iommu_ctx(ctrl), len, ctrl->numa.node, &rx->vaddr, &rx->iova)) {
+		log_debug("could not allocate receive buffers\n");
+		return -1;
+	}
+
+	if (pgmap(&rx->br, rx->br_len) < 0) {
+		log_debug("could not allocate buffer ring\n");
+		goto free_bufs;
+	}
+
+	reg.ring_addr = (uintptr_t)rx->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+
+	if (__register(rx, IORING_REGISTER_PBUF_RING, &reg)) {
+		log_debug("could not register buffer ring\n");
+		goto unmap_ring;
+	}
+
+	rx->refs = znew_t(uint16_t, nbufs);
+	rx->writes = znew_t(struct nvme_rxring_write, nbufs);
+
+	for (unsigned int i = 0; i < nbufs; i++) {
+		rx->writes[i].rx = rx;
+		rx->writes[i].next = rx->free;
+		rx->free = &rx->writes[i];
+
+		__provide(rx, (uint16_t)i);
+	}
+
+	return 0;
+
+unmap_ring:
+	pgunmap(rx->br, rx->br_len);
+free_bufs:
+	iommu_free(__iommu_ctx(ctrl), rx->vaddr, len);
+
+	return -1;
+}
+
+void nvme_rxring_fini(struct nvme_rxring *rx)
+{
+	struct io_uring_buf_reg reg = { .bgid = rx->bgid };
+
+	if (__register(rx, IORING_UNREGISTER_PBUF_RING, &reg))
+		log_debug("could not unregister buffer ring\n");
+
+	pgunmap(rx->br, rx->br_len);
+	iommu_free(__iommu_ctx(rx->ctrl), rx->vaddr, rx->nbufs * rx->buf_size);
+
+	free(rx->writes);
+	free(rx->refs);
+
+	memset(rx, 0x0, sizeof(*rx));
+}
+
+int nvme_rxring_recv(struct nvme_rxring *rx, uint32_t cqe_flags)
+{
+	uint16_t bid;
+
+	if (!(cqe_flags & IORING_CQE_F_BUFFER)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	bid = (uint16_t)(cqe_flags >> IORING_CQE_BUFFER_SHIFT);
+
+	if (bid >= rx->nbufs || rx->refs[bid]) {
+		log_debug("buffer %" PRIu16 " is not owned by the kernel\n", bid);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	rx->refs[bid] = 1;
+
+	return bid;
+}
+
+void nvme_rxring_put(struct nvme_rxring *rx, uint16_t bid)
+{
+	assert(rx->refs[bid]);
+
+	if (--rx->refs[bid])
+		return;
+
+	__provide(rx, bid);
+	rx->recycled++;
+}
+#else
+int nvme_rxring_init(struct nvme_rxring *rx UNUSED, struct nvme_ctrl *ctrl UNUSED,
+		     int uring_fd UNUSED, uint16_t bgid UNUSED, unsigned int nbufs UNUSED,
+		     size_t buf_size UNUSED)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+void nvme_rxring_fini(struct nvme_rxring *rx UNUSED)
+{
+}
+
+int nvme_rxring_recv(struct nvme_rxring *rx UNUSED, uint32_t cqe_flags UNUSED)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+void nvme_rxring_put(struct nvme_rxring *rx UNUSED, uint16_t bid UNUSED)
+{
+}
+#endif
+
+static void __rxring_complete(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg)
+{
+	struct nvme_rxring_write *w = arg;
+	struct nvme_rxring *rx = w->rx;
+
+	w->cb(rq, cqe, w->arg);
+
+	/* the controller is done reading the buffers */
+	for (int i = 0; i < w->nbids; i++)
+		nvme_rxring_put(rx, w->bids[i]);
+
+	w->next = rx->free;
+	rx->free = w;
+}
+
+int nvme_rxring_write(struct nvme_rxring *rx, struct nvme_rq *rq, struct nvme_ns *ns,
+		      uint64_t slba, const struct nvme_rxring_seg *segs, int nsegs, nvme_rq_cb cb,
+		      void *arg)
+{
+	struct iovec iov[NVME_RXRING_SEGS_MAX];
+	struct nvme_rxring_write *w = rx->free;
+	union nvme_cmd cmd;
+	size_t len = 0;
+
+	if (nsegs <= 0 || nsegs > NVME_RXRING_SEGS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!w) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	for (int i = 0; i < nsegs; i++) {
+		const struct nvme_rxring_seg *seg = &segs[i];
+
+		if (seg->bid >= rx->nbufs || !rx->refs[seg->bid] || !seg->len ||
+		    seg->offset > rx->buf_size || seg->len > rx->buf_size - seg->offset) {
+			log_debug("invalid segment %d (bid %" PRIu16 " offset %" PRIu32 " len %"
+				  PRIu32 ")\n", i, seg->bid, seg->offset, seg->len);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		/* by i/o virtual address; the buffers are contiguous in the iommu */
+		iov[i].iov_base = (void *)(uintptr_t)(rx->iova + (uint64_t)seg->bid * rx->buf_size +
+						      seg->offset);
+		iov[i].iov_len = seg->len;
+
+		len += seg->len;
+	}
+
+	if (nvme_ns_prep_rw(ns, &cmd, NVME_NVM_WRITE, slba, len))
+		return -1;
+
+	if (nvme_rq_mapv(rx->ctrl, rq, &cmd, iov, nsegs)) {
+		log_debug("could not map segments\n");
+		return -1;
+	}
+
+	rx->free = w->next;
+
+	w->cb = cb;
+	w->arg = arg;
+	w->nbids = nsegs;
+
+	for (int i = 0; i < nsegs; i++) {
+		w->bids[i] = segs[i].bid;
+		rx->refs[segs[i].bid]++;
+	}
+
+	nvme_rq_submit(rq, &cmd, __rxring_complete, w);
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "rxring.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+int iommu_alloc_node(struct iommu_ctx *ctx UNUSED, size_t len, int node UNUSED, void **vaddr,
+		     uint64_t *iova)
+{
+	if (pgmap(vaddr, len) < 0)
+		return -1;
+
+	/* distinct from the virtual address */
+	*iova = (uint64_t)*vaddr + 0x100000000;
+
+	return 0;
+}
+
+void iommu_free(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len)
+{
+	pgunmap(vaddr, len);
+}
+
+#define NTESTS 9
+
+#define SQSIZE 4
+#define NBUFS 8
+
+static uint32_t doorbells[2];
+static struct nvme_sq sqs[2];
+static struct nvme_cq cq;
+static struct nvme_rq rqs[SQSIZE - 1];
+
+static int written;
+
+static void write_cb(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe UNUSED, void *arg)
+{
+	struct nvme_rxring *rx = arg;
+
+	/* the buffers are still referenced by the write while the callback runs */
+	if (rx->refs[2] && rx->refs[3])
+		written++;
+}
+
+int main(void)
+{
+	struct nvme_ns ns = { .nsid = 1, .nsze = 64, .lbads = 9, .max_nlb = 256 };
+	struct nvme_ctrl ctrl = { .ns = &ns, .nns = 1 };
+	struct io_uring_params p = {};
+	struct io_uring_buf_ring *br;
+	struct nvme_rxring rx;
+	struct nvme_rq *rq;
+	struct nvme_cqe *cqe;
+	union nvme_cmd *cmd;
+	int fd;
+
+	struct nvme_rxring_seg segs[] = {
+		{ .bid = 2, .offset = 512, .len = 3584 },
+		{ .bid = 3, .offset = 0, .len = 512 },
+	};
+
+	plan_tests(NTESTS);
+
+	cq = (struct nvme_cq) {
+		.qsize = 4,
+		.doorbell = &doorbells[0],
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = SQSIZE,
+		.doorbell = &doorbells[1],
+		.cq = &cq,
+		.rqs = rqs,
+	};
+	sqs[1].rq_top = __nvme_rq_top_set(&sqs[1], 0, &rqs[SQSIZE - 2]);
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = 0; i < SQSIZE - 1; i++) {
+		assert(pgmap(&rqs[i].page.vaddr, __VFN_PAGESIZE) > 0);
+
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+
+		if (i > 0)
+			rqs[i].rq_next = &rqs[i - 1];
+	}
+
+	fd = (int)syscall(__NR_io_uring_setup, 4, &p);
+	if (fd < 0) {
+		skip(NTESTS, "io_uring not available (%s)", strerror(errno));
+
+		return exit_status();
+	}
+
+	ok1(nvme_rxring_init(&rx, &ctrl, fd, 1, 3, 4096) == -1 && errno == EINVAL);
+
+	if (nvme_rxring_init(&rx, &ctrl, fd, 1, NBUFS, 4096)) {
+		skip(NTESTS - 1, "provided buffer rings not available (%s)", strerror(errno));
+
+		return exit_status();
+	}
+
+	/* all buffers start out with the kernel */
+	br = rx.br;
+
+	ok1(br->tail == NBUFS && br->bufs[2].addr == (uintptr_t)nvme_rxring_buf(&rx, 2) &&
+	    br->bufs[2].len == 4096 && br->bufs[2].bid == 2);
+
+	ok1(nvme_rxring_recv(&rx, 0) == -1 && errno == ENOBUFS);
+	ok1(nvme_rxring_recv(&rx, IORING_CQE_F_BUFFER | 2 << IORING_CQE_BUFFER_SHIFT) == 2 &&
+	    nvme_rxring_recv(&rx, IORING_CQE_F_BUFFER | 2 << IORING_CQE_BUFFER_SHIFT) == -1 &&
+	    errno == EINVAL);
+
+	rq = nvme_rq_acquire(&sqs[1]);
+	assert(rq);
+
+	/* only buffers owned by the application may be written */
+	ok1(nvme_rxring_write(&rx, rq, &ns, 8, segs, 2, write_cb, &rx) == -1 && errno == EINVAL);
+
+	assert(nvme_rxring_recv(&rx, IORING_CQE_F_BUFFER | 3 << IORING_CQE_BUFFER_SHIFT) == 3);
+
+	/* a payload straddling two buffers, mapped by i/o virtual address */
+	cmd = sqs[1].vaddr;
+
+	ok1(nvme_rxring_write(&rx, rq, &ns, 8, segs, 2, write_cb, &rx) == 0 &&
+	    cmd->rw.opcode == NVME_NVM_WRITE && le16_to_cpu(cmd->rw.nlb) == 7 &&
+	    le64_to_cpu(cmd->dptr.prp1) == rx.iova + 2 * 4096 + 512 &&
+	    le64_to_cpu(cmd->dptr.prp2) == rx.iova + 3 * 4096 &&
+	    rx.refs[2] == 2 && rx.refs[3] == 2);
+
+	/* the buffers stay with the write after the application lets go */
+	nvme_rxring_put(&rx, 2);
+	nvme_rxring_put(&rx, 3);
+
+	ok1(rx.refs[2] == 1 && !rx.recycled && br->tail == NBUFS);
+
+	cqe = cq.vaddr;
+	cqe->sqid = cpu_to_le16(1);
+	cqe->cid = rq->cid;
+	cqe->sfp = cpu_to_le16(0x1);
+
+	ok1(nvme_cq_process(&cq, 4) == 1 && written == 1);
+	ok1(!rx.refs[2] && !rx.refs[3] && rx.recycled == 2 && br->tail == NBUFS + 2 &&
+	    br->bufs[NBUFS & (NBUFS - 1)].bid == 2 && rx.free);
+
+	nvme_rxring_fini(&rx);
+	close(fd);
+
+	return exit_status();
+}
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/stats: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+/* the header and the controller block precede the queue blocks */
+static size_t __stats_len(uint32_t nqueues)
+{
+	return (size_t)(nqueues + 2) * NVME_STATS_BLOCK_SIZE;
+}
+
+int nvme_stats_export(struct nvme_ctrl *ctrl, const char *path)
+{
+	struct nvme_stats_header *hdr;
+	uint32_t nqueues;
+	size_t len;
+	int fd;
+
+	if (ctrl->stats.base) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* the admin queue and every i/o queue the controller granted */
+	nqueues = (uint32_t)ctrl->config.nsqa + 2;
+	len = __stats_len(nqueues);
+
+	if (path)
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	else
+		fd = memfd_create("vfn-stats", MFD_CLOEXEC);
+
+	if (fd < 0) {
+		log_debug("could not create statistics segment\n");
+		return -1;
+	}
+
+	if (ftruncate(fd, (off_t)len)) {
+		log_debug("could not size statistics segment\n");
+		goto close_fd;
+	}
+
+	hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		log_debug("could not map statistics segment\n");
+		goto close_fd;
+	}
+
+	hdr->version = NVME_STATS_VERSION;
+	hdr->nqueues = nqueues;
+	hdr->block_size = (uint32_t)NVME_STATS_BLOCK_SIZE;
+	hdr->ticks_freq = get_ticks_freq();
+
+	if (ctrl->pci.bdf)
+		strncpy(hdr->name, ctrl->pci.bdf, sizeof(hdr->name) - 1);
+
+	ctrl->stats.base = hdr;
+	ctrl->stats.len = len;
+	ctrl->stats.fd = fd;
+	ctrl->stats.nqueues = (int)nqueues;
+
+	for (uint32_t qid = 0; qid < nqueues; qid++)
+		nvme_stats_queue(ctrl, (int)qid)->qid = qid;
+
+	/* readers check the magic last; publish it once the segment is set up */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(hdr->magic, NVME_STATS_MAGIC, sizeof(hdr->magic));
+
+	return fd;
+
+close_fd:
+	log_fatal_if(close(fd), "close: %s\n", strerror(errno));
+
+	return -1;
+}
+
+void nvme_stats_unexport(struct nvme_ctrl *ctrl)
+{
+	if (!ctrl->stats.base)
+		return;
+
+	munmap(ctrl->stats.base, ctrl->stats.len);
+	log_fatal_if(close(ctrl->stats.fd), "close: %s\n", strerror(errno));
+
+	memset(&ctrl->stats, 0x0, sizeof(ctrl->stats));
+}
+
+int nvme_stats_open(struct nvme_stats_reader *reader, int fd)
+{
+	const struct nvme_stats_header *hdr;
+	struct stat sb;
+	size_t len;
+
+	if (fstat(fd, &sb)) {
+		log_debug("could not stat statistics segment\n");
+		return -1;
+	}
+
+	if ((size_t)sb.st_size < __stats_len(0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = (size_t)sb.st_size;
+
+	hdr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		log_debug("could not map statistics segment\n");
+		return -1;
+	}
+
+	if (memcmp(hdr->magic, NVME_STATS_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != NVME_STATS_VERSION) {
+		log_debug("bad statistics segment magic or version\n");
+		goto unmap;
+	}
+
+	/* the layout is described by the header; a newer writer may use larger blocks */
+	if (hdr->block_size < NVME_STATS_BLOCK_SIZE || hdr->block_size % 8 ||
+	    (uint64_t)(hdr->nqueues + 2) * hdr->block_size > len) {
+		log_debug("bad statistics segment layout\n");
+		goto unmap;
+	}
+
+	reader->hdr = hdr;
+	reader->len = len;
+
+	return 0;
+
+unmap:
+	munmap((void *)hdr, len);
+
+	errno = EINVAL;
+	return -1;
+}
+
+void nvme_stats_close(struct nvme_stats_reader *reader)
+{
+	munmap((void *)reader->hdr, reader->len);
+
+	memset(reader, 0x0, sizeof(*reader));
+}
+
+/* take a consistent copy of a block of @n counters (the first being the sequence count) */
+static void __read_block(const uint64_t *src, uint64_t *dst, size_t n)
+{
+	uint64_t seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&src[0], __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		for (size_t i = 1; i < n; i++)
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&src[0], __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	dst[0] = seq;
+}
+
+static const void *__block(struct nvme_stats_reader *reader, uint32_t idx)
+{
+	return (const char *)reader->hdr + (size_t)idx * reader->hdr->block_size;
+}
+
+void nvme_stats_read_ctrl(struct nvme_stats_reader *reader, struct nvme_stats_ctrl *ctrl)
+{
+	__read_block(__block(reader, 1), (uint64_t *)ctrl, sizeof(*ctrl) / sizeof(uint64_t));
+}
+
+int nvme_stats_read_queue(struct nvme_stats_reader *reader, int qid, struct nvme_stats_queue *q)
+{
+	if (qid < 0 || (uint32_t)qid >= reader->hdr->nqueues) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	__read_block(__block(reader, (uint32_t)qid + 2), (uint64_t *)q,
+		     sizeof(*q) / sizeof(uint64_t));
+
+	return 0;
+}
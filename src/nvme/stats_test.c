@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+
+#include "ccan/str/str.h"
+#include "ccan/tap/tap.h"
+
+#include "stats.c"
+
+#include "types.h"
+
+static struct nvme_stats_reader reader;
+static bool stop;
+
+static void *scraper(void *opaque)
+{
+	int *mismatches = opaque;
+	struct nvme_stats_queue q;
+
+	while (!atomic_load_acquire(&stop)) {
+		nvme_stats_read_queue(&reader, 1, &q);
+
+		/* updated together by nvme_stats_sync_queue() */
+		if (q.posted != q.reaped || q.sq_doorbells != q.posted)
+			(*mismatches)++;
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {};
+	struct nvme_cq cq = {};
+	struct nvme_sq sq = { .cq = &cq };
+	struct nvme_cqe cqe = {};
+	struct nvme_stats_ctrl c;
+	struct nvme_stats_queue q, *wq;
+	struct nvme_sq_latency lat = {};
+	char path[] = "/tmp/vfn-stats-XXXXXX";
+	pthread_t thread;
+	int fd, mismatches = 0;
+
+	plan_tests(13);
+
+	ctrl.pci.bdf = "0000:01:00.0";
+	ctrl.config.nsqa = 1;
+
+	ok1(!nvme_stats_queue(&ctrl, 0) && !nvme_stats_ctrl(&ctrl));
+
+	fd = nvme_stats_export(&ctrl, NULL);
+
+	ok1(fd >= 0 && nvme_stats_export(&ctrl, NULL) == -1 && errno == EBUSY);
+	ok1(nvme_stats_open(&reader, fd) == 0 && reader.hdr->nqueues == 3 &&
+	    streq(reader.hdr->name, "0000:01:00.0") && reader.hdr->ticks_freq == get_ticks_freq());
+
+	/* one block per queue identifier */
+	ok1(nvme_stats_queue(&ctrl, 2) && !nvme_stats_queue(&ctrl, 3) &&
+	    nvme_stats_read_queue(&reader, 3, &q) == -1 && errno == EINVAL);
+
+	wq = nvme_stats_queue(&ctrl, 1);
+
+	nvme_stats_submitted(wq, 3);
+
+	/* about a microsecond, a second and forever */
+	nvme_stats_completed(wq, &cqe, ns_to_ticks(1500));
+	nvme_stats_completed(wq, &cqe, ns_to_ticks(1000000000));
+
+	cqe.sfp = cpu_to_le16(NVME_SC_INVALID_FIELD << 1);
+	nvme_stats_completed(wq, &cqe, UINT64_MAX / 2);
+
+	ok1(nvme_stats_read_queue(&reader, 1, &q) == 0 && q.qid == 1 && !(q.seq & 1) &&
+	    q.submitted == 3 && q.completed == 3 && q.errors == 1);
+	ok1(q.latency_ns[10] == 1 && q.latency_ns[29] == 1 &&
+	    q.latency_ns[NVME_STATS_HIST_BUCKETS - 1] == 1);
+
+	/* asynchronous events and resets are counted by the library */
+	nvme_stats_ctrl(&ctrl)->aens = 2;
+	nvme_stats_read_ctrl(&reader, &c);
+
+	ok1(c.aens == 2 && !c.resets);
+
+	/* scrapers always see a consistent copy */
+	assert(pthread_create(&thread, NULL, scraper, &mismatches) == 0);
+
+	for (int i = 0; i < 100000; i++) {
+		sq.stats.posted = sq.stats.doorbells = cq.stats.reaped = (uint64_t)i;
+
+		nvme_stats_sync_queue(wq, &sq);
+	}
+
+	atomic_store_release(&stop, true);
+	pthread_join(thread, NULL);
+
+	ok1(!mismatches && nvme_stats_read_queue(&reader, 1, &q) == 0 && q.reaped == 99999);
+
+	/* the latency histogram recorded by the library */
+	lat.count = 1;
+	lat.sum_ns = lat.max_ns = 1500;
+	lat.buckets[nvme_lat_hist_bucket(1500)] = 1;
+	sq.lat = &lat;
+
+	nvme_stats_sync_queue(wq, &sq);
+
+	ok1(nvme_stats_read_queue(&reader, 1, &q) == 0 && q.lat_count == 1 &&
+	    q.lat_max_ns == 1500 && q.lat_hist[nvme_lat_hist_bucket(1500)] == 1);
+
+	nvme_stats_close(&reader);
+	nvme_stats_unexport(&ctrl);
+
+	ok1(!nvme_stats_queue(&ctrl, 1) && fcntl(fd, F_GETFD) == -1 && errno == EBADF);
+
+	/* a file is left in place for scrapers to find */
+	assert(close(mkstemp(path)) == 0);
+
+	ok1(nvme_stats_export(&ctrl, path) >= 0);
+	nvme_stats_unexport(&ctrl);
+
+	fd = open(path, O_RDONLY);
+
+	ok1(nvme_stats_open(&reader, fd) == 0 && reader.hdr->nqueues == 3);
+	nvme_stats_close(&reader);
+	close(fd);
+
+	/* anything else is rejected */
+	assert(ftruncate(fd = memfd_create("junk", 0), 4096) == 0);
+
+	ok1(nvme_stats_open(&reader, fd) == -1 && errno == EINVAL);
+
+	close(fd);
+	unlink(path);
+
+	return exit_status();
+}
@@ -0,0 +1,370 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/timeout: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+/* Abort completion dword 0, bit 0: the command was not aborted */
+#define NVME_ABORT_NOT_ABORTED 0x1
+
+int nvme_timeout_init(struct nvme_timeout *tmo, struct nvme_ctrl *ctrl, struct nvme_cq *cq,
+		      unsigned int timeout_ms)
+{
+	uint64_t jiffy;
+
+	if (!cq->id || cq->reactor || !timeout_ms) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(tmo, 0x0, sizeof(*tmo));
+
+	tmo->ctrl = ctrl;
+	tmo->cq = cq;
+
+	/* the largest power of two number of ticks not exceeding a millisecond */
+	jiffy = max_t(uint64_t, get_ticks_freq() / MS_PER_SEC, 1);
+	tmo->shift = (unsigned int)(63 - __builtin_clzll(jiffy));
+
+	/* round up and account for the partially elapsed jiffy at submission */
+	tmo->timeout = ((uint64_t)timeout_ms * jiffy + (1ULL << tmo->shift) - 1) >> tmo->shift;
+	tmo->timeout++;
+
+	tmo->clk = get_ticks() >> tmo->shift;
+
+	cq->tmo = tmo;
+
+	return 0;
+}
+
+/* a timed out command, held until the controller completes it */
+struct nvme_timeout_held {
+	struct nvme_timeout *tmo;
+	struct nvme_rq *rq;
+
+	/* the completion callback of the command */
+	nvme_rq_cb cb;
+	void *cb_arg;
+
+	/* the late completion, delivered once the Abort command completed */
+	struct nvme_cqe cqe;
+	bool completed;
+
+	/* no admin tracker was available; retried on the next check */
+	bool abort_pending;
+	bool aborting;
+
+	/* written by __abort_complete() on the thread reaping the admin queue */
+	bool abort_done, abort_failed;
+
+	/* one for the held tracker and one for the Abort command in flight */
+	int refs;
+
+	struct nvme_timeout_held *next, **pprev;
+};
+
+static void __held_put(struct nvme_timeout_held *h)
+{
+	if (!atomic_dec_fetch(&h->refs))
+		free(h);
+}
+
+static void __held_unlink(struct nvme_timeout_held *h)
+{
+	if (h->next)
+		h->next->pprev = h->pprev;
+
+	*h->pprev = h->next;
+	h->pprev = NULL;
+
+	h->tmo->nheld--;
+}
+
+/* account for the Abort command of @h once it completed; true if none is in flight */
+static bool __held_reap_abort(struct nvme_timeout *tmo, struct nvme_timeout_held *h)
+{
+	if (h->aborting && atomic_load_acquire(&h->abort_done)) {
+		h->aborting = false;
+		tmo->aborting--;
+
+		if (h->abort_failed)
+			tmo->abort_failed++;
+	}
+
+	return !h->aborting;
+}
+
+/* the late completion (or the failure on reset) of a timed out command */
+static void __held_complete(struct nvme_rq *rq, struct nvme_cqe *cqe, void *opaque)
+{
+	struct nvme_timeout_held *h = opaque;
+	nvme_rq_cb cb = h->cb;
+	void *cb_arg = h->cb_arg;
+	struct nvme_cqe copy;
+
+	if (!h->completed) {
+		log_debug("sqid %d cid %" PRIu16 " completed after timing out\n", rq->sq->id,
+			  rq->cid);
+
+		h->cqe = *cqe;
+		h->completed = true;
+	}
+
+	/* an Abort command in flight could hit a resubmission with the same cid */
+	if (h->pprev && !__held_reap_abort(h->tmo, h)) {
+		rq->cb = __held_complete;
+		return;
+	}
+
+	copy = h->cqe;
+
+	if (h->pprev)
+		__held_unlink(h);
+
+	__held_put(h);
+
+	/* the controller is done with the command; it may be resubmitted */
+	cb(rq, &copy, cb_arg);
+}
+
+/* hand the late completion held back to the callback, like nvme_cq_process() would */
+static void __held_deliver(struct nvme_timeout_held *h)
+{
+	struct nvme_rq *rq = h->rq;
+
+	rq->cb = NULL;
+
+	__held_complete(rq, &h->cqe, h);
+
+	if (!rq->cb)
+		nvme_rq_release(rq);
+
+	nvme_sq_update_tail(rq->sq);
+}
+
+static void __abort_complete(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *opaque)
+{
+	struct nvme_timeout_held *h = opaque;
+
+	if (!nvme_cqe_ok(cqe)) {
+		log_debug("abort failed\n");
+
+		h->abort_failed = true;
+	} else if (le32_to_cpu(cqe->dw0) & NVME_ABORT_NOT_ABORTED) {
+		log_debug("command was not aborted\n");
+
+		h->abort_failed = true;
+	}
+
+	atomic_store_release(&h->abort_done, true);
+
+	__held_put(h);
+}
+
+static void __abort(struct nvme_timeout *tmo, struct nvme_timeout_held *h)
+{
+	struct nvme_sq *asq = tmo->ctrl->adminq.sq;
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_ABORT,
+		.cdw10 = cpu_to_le32((uint32_t)h->rq->sq->id | (uint32_t)h->rq->cid << 16),
+	};
+	struct nvme_rq *rq;
+
+	rq = nvme_rq_acquire_atomic(asq);
+	if (!rq) {
+		h->abort_pending = true;
+		return;
+	}
+
+	h->abort_pending = false;
+	h->aborting = true;
+
+	atomic_inc(&h->refs);
+
+	tmo->aborting++;
+
+	/* completed on whichever thread reaps the admin queue */
+	nvme_cq_lock(asq->cq);
+
+	nvme_rq_submit(rq, &cmd, __abort_complete, h);
+	nvme_sq_flush_tail(asq);
+
+	nvme_cq_unlock(asq->cq);
+}
+
+static void __expire(struct nvme_timeout *tmo, struct nvme_rq *rq)
+{
+	struct nvme_timeout_held *h = znew_t(struct nvme_timeout_held, 1);
+
+	log_debug("sqid %d cid %" PRIu16 " timed out; aborting\n", rq->sq->id, rq->cid);
+
+	tmo->expired++;
+
+	*h = (struct nvme_timeout_held) {
+		.tmo = tmo,
+		.rq = rq,
+		.cb = rq->cb,
+		.cb_arg = rq->cb_arg,
+		.refs = 1,
+		.next = tmo->held,
+		.pprev = &tmo->held,
+	};
+
+	if (tmo->held)
+		tmo->held->pprev = &h->next;
+
+	tmo->held = h;
+	tmo->nheld++;
+
+	/* not handed back to the callback until the controller completes the command */
+	rq->cb = __held_complete;
+	rq->cb_arg = h;
+
+	__abort(tmo, h);
+}
+
+static int __nvme_timeout_advance(struct nvme_timeout *tmo, uint64_t clk)
+{
+	const uint64_t mask = NVME_TIMEOUT_WHEEL_SIZE - 1;
+	struct nvme_rq *rq, *next;
+	int nexpired = 0;
+
+	while (tmo->clk < clk) {
+		uint64_t idx;
+
+		/* nothing armed; catch up in one step */
+		if (!tmo->armed) {
+			tmo->clk = clk;
+			break;
+		}
+
+		idx = ++tmo->clk & mask;
+
+		/* cascade the next second level slot into the first level */
+		if (!idx) {
+			uint64_t idx1 = (tmo->clk >> NVME_TIMEOUT_WHEEL_BITS) & mask;
+
+			rq = tmo->wheel[1][idx1];
+			tmo->wheel[1][idx1] = NULL;
+
+			for (; rq; rq = next) {
+				next = rq->tmo_next;
+
+				tmo->armed--;
+				__nvme_timeout_add(tmo, rq);
+			}
+		}
+
+		rq = tmo->wheel[0][idx];
+		tmo->wheel[0][idx] = NULL;
+
+		for (; rq; rq = next) {
+			next = rq->tmo_next;
+
+			rq->tmo_pprev = NULL;
+			tmo->armed--;
+
+			__expire(tmo, rq);
+
+			nexpired++;
+		}
+	}
+
+	return nexpired;
+}
+
+/* reap the Abort commands, deliver the late completions held back and retry aborts */
+static void __nvme_timeout_poll(struct nvme_timeout *tmo)
+{
+	struct nvme_timeout_held *h, *next;
+
+	if (tmo->aborting)
+		nvme_admin_process(tmo->ctrl);
+
+	for (h = tmo->held; h; h = next) {
+		next = h->next;
+
+		if (!__held_reap_abort(tmo, h))
+			continue;
+
+		if (h->completed)
+			__held_deliver(h);
+		else if (h->abort_pending)
+			__abort(tmo, h);
+	}
+}
+
+void nvme_timeout_fini(struct nvme_timeout *tmo)
+{
+	struct nvme_timeout_held *h;
+
+	for (int level = 0; level < 2; level++) {
+		for (int i = 0; i < NVME_TIMEOUT_WHEEL_SIZE; i++) {
+			struct nvme_rq *rq = tmo->wheel[level][i];
+
+			for (; rq; rq = rq->tmo_next)
+				rq->tmo_pprev = NULL;
+
+			tmo->wheel[level][i] = NULL;
+		}
+	}
+
+	tmo->armed = 0;
+	tmo->cq->tmo = NULL;
+
+	/* the others stay held until the controller completes them */
+	while ((h = tmo->held)) {
+		__held_unlink(h);
+
+		if (h->completed)
+			__held_deliver(h);
+	}
+}
+
+int nvme_timeout_check(struct nvme_timeout *tmo)
+{
+	uint64_t clk = get_ticks() >> tmo->shift;
+
+	if (tmo->nheld)
+		__nvme_timeout_poll(tmo);
+
+	if (clk == tmo->clk)
+		return 0;
+
+	return __nvme_timeout_advance(tmo, clk);
+}
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include "ccan/tap/tap.h"
+
+#include "timeout.c"
+
+#define NRQS 512
+#define NARQS 4
+
+static struct nvme_sq asq;
+static struct nvme_rq arqs[NARQS];
+
+static union nvme_cmd aborts[NRQS];
+static int naborts;
+static uint32_t abort_dw0;
+static bool abort_hold;
+
+/* the controller completes the Abort commands posted to the admin queue */
+int nvme_admin_process(struct nvme_ctrl *ctrl UNUSED)
+{
+	static int head;
+	int n = 0;
+
+	if (abort_hold)
+		return 0;
+
+	for (; head != asq.tail; head = (head + 1) % asq.qsize) {
+		union nvme_cmd *sqe = asq.vaddr + (head << NVME_SQES);
+		struct nvme_rq *rq = &arqs[sqe->cid];
+		struct nvme_cqe cqe = { .dw0 = cpu_to_le32(abort_dw0), .cid = sqe->cid };
+		nvme_rq_cb cb = rq->cb;
+
+		aborts[naborts++] = *sqe;
+
+		rq->cb = NULL;
+		cb(rq, &cqe, rq->cb_arg);
+
+		if (!rq->cb)
+			nvme_rq_release_atomic(rq);
+
+		n++;
+	}
+
+	return n;
+}
+
+static struct nvme_timeout tmo;
+static int delivered[NRQS];
+static uint16_t status[NRQS];
+
+static void complete_cb(struct nvme_rq *rq, struct nvme_cqe *cqe, void *arg UNUSED)
+{
+	delivered[rq->cid]++;
+	status[rq->cid] = le16_to_cpu(cqe->sfp) >> 1;
+}
+
+/* post a completion for @rq like nvme_cq_process() would */
+static void complete(struct nvme_rq *rq, uint16_t sc)
+{
+	struct nvme_cqe cqe = { .cid = rq->cid, .sfp = cpu_to_le16(sc << 1) };
+	nvme_rq_cb cb = rq->cb;
+
+	rq->cb = NULL;
+	cb(rq, &cqe, rq->cb_arg);
+
+	if (!rq->cb)
+		nvme_rq_release(rq);
+}
+
+static void arm(struct nvme_rq *rq, uint64_t expires)
+{
+	rq->cb = complete_cb;
+	rq->tmo_expires = expires;
+
+	__nvme_timeout_add(&tmo, rq);
+}
+
+static uint64_t expires[NRQS];
+static bool held[NRQS];
+
+/* held no earlier than the deadline and no later than the step taking it */
+static int advance(struct nvme_rq *rqs, uint64_t clk, bool *exact)
+{
+	uint64_t prev = tmo.clk;
+	int n = __nvme_timeout_advance(&tmo, clk);
+
+	for (int i = 0; i < NRQS; i++) {
+		if (held[i] || rqs[i].cb != __held_complete)
+			continue;
+
+		held[i] = true;
+
+		if (expires[i] <= prev || expires[i] > tmo.clk)
+			*exact = false;
+	}
+
+	/* only a few admin trackers; the others are retried */
+	__nvme_timeout_poll(&tmo);
+
+	return n;
+}
+
+static void test_wheel(struct nvme_rq *rqs)
+{
+	bool exact = true, done = true;
+	int n = 0;
+
+	/* start just before a second level boundary */
+	tmo.clk = 4090;
+
+	for (int i = 0; i < NRQS; i++) {
+		/* advance as we go, such that deadlines are armed at different times */
+		if (i % 64 == 63)
+			n += advance(rqs, tmo.clk + 7, &exact);
+
+		/* within the first and second level and beyond the wheel */
+		expires[i] = tmo.clk + 1 + (uint64_t)rand() % (i % 3 ? 3 * 4096 : 64);
+		arm(&rqs[i], expires[i]);
+
+		/* disarm every eighth command right away */
+		if (i % 8 == 0)
+			__nvme_timeout_del(&tmo, &rqs[i]);
+	}
+
+	while (tmo.armed)
+		n += advance(rqs, tmo.clk + (uint64_t)rand() % 100, &exact);
+
+	while (tmo.aborting || naborts < n)
+		__nvme_timeout_poll(&tmo);
+
+	for (int i = 0; i < NRQS; i++) {
+		if (held[i] == !(i % 8) || delivered[i])
+			exact = false;
+
+		if (held[i])
+			complete(&rqs[i], NVME_SC_ABORT_REQ);
+
+		if (delivered[i] != !!held[i] || (held[i] && status[i] != NVME_SC_ABORT_REQ))
+			done = false;
+	}
+
+	ok1(exact);
+	ok1(n == NRQS - NRQS / 8 && naborts == n && tmo.expired == (uint64_t)n);
+	ok1(done && !tmo.nheld && !tmo.held);
+}
+
+int main(void)
+{
+	static uint32_t doorbells[2];
+	struct nvme_cq cq = { .id = 1 };
+	struct nvme_cq acq = { .id = 0 };
+	static struct nvme_rq rqs[NRQS];
+	struct nvme_sq sq = {
+		.id = 3, .qsize = NRQS + 1, .cq = &cq, .doorbell = &doorbells[1], .rqs = rqs,
+	};
+	struct nvme_ctrl ctrl = { .adminq = { .sq = &asq, .cq = &acq } };
+	union nvme_cmd cmd = {};
+	uint64_t expires;
+
+	plan_tests(25);
+
+	asq = (struct nvme_sq) {
+		.id = 0,
+		.qsize = NARQS + 1,
+		.doorbell = &doorbells[0],
+		.cq = &acq,
+		.rqs = arqs,
+	};
+	asq.rq_top = __nvme_rq_top_set(&asq, 0, &arqs[NARQS - 1]);
+
+	assert(pgmap(&asq.vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = 0; i < NARQS; i++) {
+		arqs[i].sq = &asq;
+		arqs[i].cid = (uint16_t)i;
+
+		if (i > 0)
+			arqs[i].rq_next = &arqs[i - 1];
+	}
+
+	for (int i = 0; i < NRQS; i++) {
+		rqs[i].sq = &sq;
+		rqs[i].cid = (uint16_t)i;
+	}
+
+	ok1(nvme_timeout_init(&tmo, &ctrl, &acq, 10) == -1 && errno == EINVAL);
+	ok1(nvme_timeout_init(&tmo, &ctrl, &cq, 0) == -1 && errno == EINVAL);
+
+	/* the reactor does not disarm deadlines */
+	cq.reactor = true;
+	ok1(nvme_timeout_init(&tmo, &ctrl, &cq, 10) == -1 && errno == EINVAL);
+	cq.reactor = false;
+	ok1(nvme_timeout_init(&tmo, &ctrl, &cq, 10) == 0 && cq.tmo == &tmo);
+
+	/* a jiffy is at most a millisecond */
+	ok1((1ULL << tmo.shift) <= max_t(uint64_t, get_ticks_freq() / MS_PER_SEC, 1));
+	ok1(tmo.timeout >= 11);
+
+	/* deadlines are armed on submission */
+	assert(pgmap(&sq.vaddr, __VFN_PAGESIZE * 8) > 0);
+
+	nvme_rq_submit(&rqs[0], &cmd, complete_cb, NULL);
+	ok1(tmo.armed == 1 && rqs[0].tmo_pprev);
+
+	expires = rqs[0].tmo_expires;
+	ok1(expires >= tmo.clk + tmo.timeout);
+
+	ok1(__nvme_timeout_advance(&tmo, expires - 1) == 0 && !tmo.nheld);
+
+	/* held, and the Abort is submitted without waiting for it */
+	ok1(__nvme_timeout_advance(&tmo, expires) == 1 && tmo.nheld == 1 && tmo.aborting == 1);
+	ok1(rqs[0].cb == __held_complete && !delivered[0] && !naborts && !tmo.armed);
+
+	/* the controller reports that the command was not aborted */
+	abort_dw0 = NVME_ABORT_NOT_ABORTED;
+
+	__nvme_timeout_poll(&tmo);
+	ok1(naborts == 1 && aborts[0].opcode == NVME_ADMIN_ABORT &&
+	    le32_to_cpu(aborts[0].cdw10) == 3);
+	ok1(!tmo.aborting && tmo.abort_failed == 1 &&
+	    __nvme_rq_top(&asq, asq.rq_top) == &arqs[NARQS - 1]);
+
+	/* still owned by the controller; held until the late completion */
+	ok1(rqs[0].cb == __held_complete && !delivered[0] && tmo.nheld == 1);
+
+	complete(&rqs[0], NVME_SC_ABORT_REQ);
+	ok1(delivered[0] == 1 && status[0] == NVME_SC_ABORT_REQ && !tmo.nheld &&
+	    __nvme_rq_top(&sq, sq.rq_top) == &rqs[0]);
+
+	/* the late completion is held back until the Abort completes */
+	abort_dw0 = 0;
+	abort_hold = true;
+
+	arm(&rqs[1], tmo.clk + 1);
+	__nvme_timeout_advance(&tmo, tmo.clk + 1);
+	__nvme_timeout_poll(&tmo);
+
+	complete(&rqs[1], NVME_SC_ABORT_REQ);
+	ok1(!delivered[1] && rqs[1].cb == __held_complete && tmo.aborting == 1);
+
+	abort_hold = false;
+
+	__nvme_timeout_poll(&tmo);
+	ok1(delivered[1] == 1 && status[1] == NVME_SC_ABORT_REQ && !tmo.nheld &&
+	    tmo.abort_failed == 1 && __nvme_rq_top(&sq, sq.rq_top) == &rqs[1]);
+
+	/* no admin tracker available; the Abort is retried on the next check */
+	asq.rq_top = 0;
+
+	arm(&rqs[2], tmo.clk + 1);
+	__nvme_timeout_advance(&tmo, tmo.clk + 1);
+	ok1(naborts == 2 && !tmo.aborting && tmo.nheld == 1);
+
+	asq.rq_top = __nvme_rq_top_set(&asq, 0, &arqs[NARQS - 1]);
+
+	__nvme_timeout_poll(&tmo);
+	__nvme_timeout_poll(&tmo);
+	ok1(naborts == 3 && !tmo.aborting && !delivered[2]);
+
+	complete(&rqs[2], NVME_SC_ABORT_REQ);
+	ok1(delivered[2] == 1 && !tmo.nheld);
+
+	/* completed but waiting for the Abort; handed back when tracking stops */
+	abort_hold = true;
+
+	arm(&rqs[3], tmo.clk + 1);
+	__nvme_timeout_advance(&tmo, tmo.clk + 1);
+	complete(&rqs[3], NVME_SC_ABORT_REQ);
+
+	nvme_timeout_fini(&tmo);
+	ok1(delivered[3] == 1 && !tmo.nheld && !cq.tmo);
+
+	/* the Abort completing later drops the last reference */
+	abort_hold = false;
+
+	ok1(nvme_admin_process(&ctrl) == 1 && __nvme_rq_top(&asq, asq.rq_top) == &arqs[NARQS - 1]);
+
+	naborts = 0;
+	tmo.expired = 0;
+	memset(delivered, 0x0, sizeof(delivered));
+
+	assert(nvme_timeout_init(&tmo, &ctrl, &cq, 10) == 0);
+
+	test_wheel(rqs);
+
+	nvme_timeout_fini(&tmo);
+
+	return exit_status();
+}
@@ -18,30 +18,52 @@
 
 enum nvme_constants {
 	NVME_IDENTIFY_DATA_SIZE		= 4096,
+
+	/* nvme_sync() bounces payloads of up to NVME_BOUNCE_SLOT_SIZE bytes */
+	NVME_BOUNCE_SLOTS		= 16,
+	NVME_BOUNCE_SLOT_SIZE		= 0x4000,
 };
 
 enum nvme_reg {
 	NVME_REG_CAP			= 0x0000,
+	NVME_REG_VS			= 0x0008,
 	NVME_REG_CC			= 0x0014,
 	NVME_REG_CSTS			= 0x001c,
+	NVME_REG_NSSR			= 0x0020,
 	NVME_REG_AQA			= 0x0024,
 	NVME_REG_ASQ			= 0x0028,
 	NVME_REG_ACQ			= 0x0030,
+	NVME_REG_CMBLOC			= 0x0038,
+	NVME_REG_CMBSZ			= 0x003c,
+	NVME_REG_CMBMSC			= 0x0050,
+	NVME_REG_PMRCAP			= 0x0e00,
+	NVME_REG_PMRCTL			= 0x0e04,
+	NVME_REG_PMRSTS			= 0x0e08,
 };
 
 enum nvme_cap {
 	NVME_CAP_MQES_SHIFT		= 0,
 	NVME_CAP_MQES_MASK		= 0xffff,
+	NVME_CAP_AMS_SHIFT		= 17,
+	NVME_CAP_AMS_MASK		= 0x3,
 	NVME_CAP_TO_SHIFT		= 24,
 	NVME_CAP_TO_MASK		= 0xff,
 	NVME_CAP_DSTRD_SHIFT		= 32,
 	NVME_CAP_DSTRD_MASK		= 0xf,
+	NVME_CAP_NSSRS_SHIFT		= 36,
+	NVME_CAP_NSSRS_MASK		= 0x1,
 	NVME_CAP_CSS_SHIFT		= 37,
 	NVME_CAP_CSS_MASK		= 0xff,
 	NVME_CAP_MPSMIN_SHIFT		= 48,
 	NVME_CAP_MPSMIN_MASK		= 0xf,
 	NVME_CAP_MPSMAX_SHIFT		= 52,
 	NVME_CAP_MPSMAX_MASK		= 0xf,
+	NVME_CAP_PMRS_SHIFT		= 56,
+	NVME_CAP_PMRS_MASK		= 0x1,
+	NVME_CAP_CMBS_SHIFT		= 57,
+	NVME_CAP_CMBS_MASK		= 0x1,
+
+	NVME_CAP_AMS_WRRU		= 1 << 0,
 
 	NVME_CAP_CSS_CSI		= 1 << 6,
 	NVME_CAP_CSS_ADMIN		= 1 << 7,
@@ -65,6 +87,7 @@ enum nvme_cc {
 
 	NVME_CC_SHN_NONE		= 0,
 	NVME_CC_AMS_RR			= 0,
+	NVME_CC_AMS_WRRU		= 1,
 	NVME_CC_CSS_CSI			= 6,
 	NVME_CC_CSS_ADMIN		= 7,
 	NVME_CC_CSS_NVM			= 0,
@@ -73,17 +96,127 @@ enum nvme_cc {
 enum nvme_csts {
 	NVME_CSTS_RDY_SHIFT		= 0,
 	NVME_CSTS_RDY_MASK		= 0x1,
+	NVME_CSTS_CFS_SHIFT		= 1,
+	NVME_CSTS_CFS_MASK		= 0x1,
+	NVME_CSTS_SHST_SHIFT		= 2,
+	NVME_CSTS_SHST_MASK		= 0x3,
+	NVME_CSTS_NSSRO_SHIFT		= 4,
+	NVME_CSTS_NSSRO_MASK		= 0x1,
+
+	NVME_CSTS_SHST_COMPLETE		= 2,
+};
+
+enum nvme_aqa {
+	NVME_AQA_ASQS_SHIFT		= 0,
+	NVME_AQA_ASQS_MASK		= 0xfff,
+	NVME_AQA_ACQS_SHIFT		= 16,
+	NVME_AQA_ACQS_MASK		= 0xfff,
+};
+
+/* "NVMe" */
+#define NVME_NSSR_NSSRC 0x4e564d65
+
+enum nvme_cmbloc {
+	NVME_CMBLOC_BIR_SHIFT		= 0,
+	NVME_CMBLOC_BIR_MASK		= 0x7,
+	NVME_CMBLOC_OFST_SHIFT		= 12,
+	NVME_CMBLOC_OFST_MASK		= 0xfffff,
+};
+
+enum nvme_cmbsz {
+	NVME_CMBSZ_SQS_SHIFT		= 0,
+	NVME_CMBSZ_SQS_MASK		= 0x1,
+	NVME_CMBSZ_SZU_SHIFT		= 8,
+	NVME_CMBSZ_SZU_MASK		= 0xf,
+	NVME_CMBSZ_SZ_SHIFT		= 12,
+	NVME_CMBSZ_SZ_MASK		= 0xfffff,
+};
+
+enum nvme_cmbmsc {
+	NVME_CMBMSC_CRE			= 1 << 0,
+	NVME_CMBMSC_CMSE		= 1 << 1,
+};
+
+enum nvme_pmrcap {
+	NVME_PMRCAP_BIR_SHIFT		= 5,
+	NVME_PMRCAP_BIR_MASK		= 0x7,
+	NVME_PMRCAP_PMRTU_SHIFT		= 8,
+	NVME_PMRCAP_PMRTU_MASK		= 0x3,
+	NVME_PMRCAP_PMRWBM_SHIFT	= 10,
+	NVME_PMRCAP_PMRWBM_MASK		= 0xf,
+	NVME_PMRCAP_PMRTO_SHIFT		= 16,
+	NVME_PMRCAP_PMRTO_MASK		= 0xff,
+
+	/* write barrier mechanisms */
+	NVME_PMRWBM_READ_PMR		= 1 << 0,
+	NVME_PMRWBM_READ_PMRSTS		= 1 << 1,
+
+	/* timeout units */
+	NVME_PMRTU_500MS		= 0,
+	NVME_PMRTU_MINUTES		= 1,
+};
+
+enum nvme_pmrctl {
+	NVME_PMRCTL_EN			= 1 << 0,
+};
+
+enum nvme_pmrsts {
+	NVME_PMRSTS_ERR_SHIFT		= 0,
+	NVME_PMRSTS_ERR_MASK		= 0xff,
+	NVME_PMRSTS_NRDY_SHIFT		= 8,
+	NVME_PMRSTS_NRDY_MASK		= 0x1,
+	NVME_PMRSTS_HSTS_SHIFT		= 9,
+	NVME_PMRSTS_HSTS_MASK		= 0x7,
 };
 
 enum nvme_feat {
+	NVME_FEAT_ARB_AB_SHIFT		= 0,
+	NVME_FEAT_ARB_AB_MASK		= 0x7,
+	NVME_FEAT_ARB_LPW_SHIFT		= 8,
+	NVME_FEAT_ARB_LPW_MASK		= 0xff,
+	NVME_FEAT_ARB_MPW_SHIFT		= 16,
+	NVME_FEAT_ARB_MPW_MASK		= 0xff,
+	NVME_FEAT_ARB_HPW_SHIFT		= 24,
+	NVME_FEAT_ARB_HPW_MASK		= 0xff,
 	NVME_FEAT_NRQS_NSQR_SHIFT	= 0,
 	NVME_FEAT_NRQS_NSQR_MASK	= 0xffff,
 	NVME_FEAT_NRQS_NCQR_SHIFT	= 16,
 	NVME_FEAT_NRQS_NCQR_MASK	= 0xffff,
+	NVME_FEAT_IRQC_THR_SHIFT	= 0,
+	NVME_FEAT_IRQC_THR_MASK		= 0xff,
+	NVME_FEAT_IRQC_TIME_SHIFT	= 8,
+	NVME_FEAT_IRQC_TIME_MASK	= 0xff,
+	NVME_FEAT_IVC_IV_SHIFT		= 0,
+	NVME_FEAT_IVC_IV_MASK		= 0xffff,
+	NVME_FEAT_IVC_CD_SHIFT		= 16,
+	NVME_FEAT_IVC_CD_MASK		= 0x1,
+	NVME_FEAT_HMB_EHM_SHIFT		= 0,
+	NVME_FEAT_HMB_EHM_MASK		= 0x1,
+	NVME_FEAT_HMB_MR_SHIFT		= 1,
+	NVME_FEAT_HMB_MR_MASK		= 0x1,
+	NVME_FEAT_PM_PS_SHIFT		= 0,
+	NVME_FEAT_PM_PS_MASK		= 0x1f,
+	NVME_FEAT_APST_APSTE_SHIFT	= 0,
+	NVME_FEAT_APST_APSTE_MASK	= 0x1,
+	NVME_FEAT_APST_ITPS_SHIFT	= 3,
+	NVME_FEAT_APST_ITPS_MASK	= 0x1f,
+	NVME_FEAT_APST_ITPT_SHIFT	= 8,
+	NVME_FEAT_APST_ITPT_MASK	= 0xffffff,
+	NVME_FEAT_FDP_FDPE_SHIFT	= 0,
+	NVME_FEAT_FDP_FDPE_MASK		= 0x1,
+	NVME_FEAT_FDP_FDPCIDX_SHIFT	= 8,
+	NVME_FEAT_FDP_FDPCIDX_MASK	= 0xff,
 };
 
 enum nvme_fid {
+	NVME_FEAT_FID_ARBITRATION	= 0x01,
+	NVME_FEAT_FID_POWER_MGMT	= 0x02,
 	NVME_FEAT_FID_NUM_QUEUES	= 0x07,
+	NVME_FEAT_FID_IRQ_COALESCE	= 0x08,
+	NVME_FEAT_FID_IRQ_CONFIG	= 0x09,
+	NVME_FEAT_FID_APST		= 0x0c,
+	NVME_FEAT_FID_HOST_MEM_BUF	= 0x0d,
+	NVME_FEAT_FID_FDP		= 0x1d,
 };
 
 enum nvme_admin_opcode {
@@ -91,20 +224,296 @@ enum nvme_admin_opcode {
 	NVME_ADMIN_CREATE_SQ            = 0x01,
 	NVME_ADMIN_DELETE_CQ		= 0x04,
 	NVME_ADMIN_CREATE_CQ            = 0x05,
+	NVME_ADMIN_GET_LOG_PAGE		= 0x02,
 	NVME_ADMIN_IDENTIFY		= 0x06,
+	NVME_ADMIN_ABORT		= 0x08,
 	NVME_ADMIN_SET_FEATURES         = 0x09,
+	NVME_ADMIN_GET_FEATURES		= 0x0a,
 	NVME_ADMIN_ASYNC_EVENT          = 0x0c,
+	NVME_ADMIN_DIR_SEND		= 0x19,
+	NVME_ADMIN_DIR_RECV		= 0x1a,
 	NVME_ADMIN_DBCONFIG		= 0x7c,
 };
 
+enum nvme_nvm_opcode {
+	NVME_NVM_FLUSH			= 0x00,
+	NVME_NVM_WRITE			= 0x01,
+	NVME_NVM_READ			= 0x02,
+	NVME_NVM_COMPARE		= 0x05,
+	NVME_NVM_WRITE_ZEROES		= 0x08,
+	NVME_NVM_DSM			= 0x09,
+	NVME_NVM_VERIFY			= 0x0c,
+	NVME_NVM_IO_MGMT_RECV		= 0x12,
+	NVME_NVM_COPY			= 0x19,
+};
+
+enum nvme_status {
+	NVME_SC_INVALID_OPCODE		= 0x001,
+	NVME_SC_INVALID_FIELD		= 0x002,
+	NVME_SC_FUSED_FAIL		= 0x005,
+	NVME_SC_FUSED_MISSING		= 0x006,
+	NVME_SC_ABORT_REQ		= 0x007,
+	NVME_SC_ABORT_SQ_DELETION	= 0x008,
+	NVME_SC_INVALID_NS		= 0x00b,
+	NVME_SC_LBA_RANGE		= 0x080,
+	NVME_SC_INVALID_QID		= 0x101,
+	NVME_SC_INVALID_QSIZE		= 0x102,
+	NVME_SC_GUARD_CHECK		= 0x282,
+	NVME_SC_APPTAG_CHECK		= 0x283,
+	NVME_SC_REFTAG_CHECK		= 0x284,
+	NVME_SC_COMPARE_FAILED		= 0x285,
+};
+
 enum nvme_identify_cns {
+	NVME_IDENTIFY_CNS_NS		= 0x00,
 	NVME_IDENTIFY_CNS_CTRL		= 0x01,
+	NVME_IDENTIFY_CNS_NS_ACTIVE_LIST = 0x02,
+	NVME_IDENTIFY_CNS_CS_NS		= 0x05,
+	NVME_IDENTIFY_CNS_CS_CTRL	= 0x06,
+};
+
+enum nvme_csi {
+	NVME_CSI_NVM			= 0x00,
+	NVME_CSI_ZNS			= 0x02,
 };
 
 enum nvme_identify_ctrl_offset {
+	NVME_IDENTIFY_CTRL_SN		= 0x004,
+	NVME_IDENTIFY_CTRL_MN		= 0x018,
+	NVME_IDENTIFY_CTRL_FR		= 0x040,
+	NVME_IDENTIFY_CTRL_MDTS		= 0x04d,
+	NVME_IDENTIFY_CTRL_VER		= 0x050,
 	NVME_IDENTIFY_CTRL_OACS		= 0x100,
+	NVME_IDENTIFY_CTRL_LPA		= 0x105,
+	NVME_IDENTIFY_CTRL_NPSS		= 0x107,
+	NVME_IDENTIFY_CTRL_APSTA	= 0x109,
+	NVME_IDENTIFY_CTRL_HMPRE	= 0x110,
+	NVME_IDENTIFY_CTRL_HMMIN	= 0x114,
+	NVME_IDENTIFY_CTRL_HMMINDS	= 0x14c,
+	NVME_IDENTIFY_CTRL_HMMAXD	= 0x150,
+	NVME_IDENTIFY_CTRL_SQES		= 0x200,
+	NVME_IDENTIFY_CTRL_CQES		= 0x201,
+	NVME_IDENTIFY_CTRL_NN		= 0x204,
+	NVME_IDENTIFY_CTRL_ONCS		= 0x208,
+	NVME_IDENTIFY_CTRL_FUSES	= 0x20a,
+	NVME_IDENTIFY_CTRL_ACWU		= 0x214,
+	NVME_IDENTIFY_CTRL_SGLS		= 0x218,
+	NVME_IDENTIFY_CTRL_PSD		= 0x800,
+};
+
+enum nvme_dir_fields {
+	NVME_DIR_DOPER_SHIFT		= 0,
+	NVME_DIR_DOPER_MASK		= 0xff,
+	NVME_DIR_DTYPE_SHIFT		= 8,
+	NVME_DIR_DTYPE_MASK		= 0xff,
+	NVME_DIR_DSPEC_SHIFT		= 16,
+	NVME_DIR_DSPEC_MASK		= 0xffff,
+
+	/* directive send, identify, enable directive (cdw12) */
+	NVME_DIR_ENDIR_SHIFT		= 0,
+	NVME_DIR_ENDIR_MASK		= 0x1,
+	NVME_DIR_TDTYPE_SHIFT		= 8,
+	NVME_DIR_TDTYPE_MASK		= 0xff,
+
+	/* directive type of read/write commands (cdw12 bits 23:20) */
+	NVME_RW_CONTROL_DTYPE_SHIFT	= 4,
+	NVME_RW_CONTROL_DTYPE_MASK	= 0xf,
+};
+
+enum nvme_rw_control {
+	/* write zeroes, deallocate (cdw12 bit 25) */
+	NVME_RW_CONTROL_DEAC		= 1 << 9,
+};
+
+enum nvme_dir_doper {
+	NVME_DIR_IDENTIFY_PARAMS	= 0x01,
+	NVME_DIR_IDENTIFY_ENABLE	= 0x01,
+	NVME_DIR_STREAMS_PARAMS		= 0x01,
+	NVME_DIR_STREAMS_ALLOC		= 0x03,
+	NVME_DIR_STREAMS_RELEASE_ID	= 0x01,
+	NVME_DIR_STREAMS_RELEASE_RES	= 0x02,
+};
+
+/* directive identify return parameters (bitmaps of directive types) */
+enum nvme_dir_identify_offset {
+	NVME_DIR_IDENTIFY_SUPPORTED	= 0x00,
+	NVME_DIR_IDENTIFY_ENABLED	= 0x20,
+	NVME_DIR_IDENTIFY_PERSISTENT	= 0x40,
+	NVME_DIR_IDENTIFY_SIZE		= 0x1000,
+};
+
+/* streams directive return parameters */
+enum nvme_dir_streams_offset {
+	NVME_DIR_STREAMS_MSL		= 0x00,
+	NVME_DIR_STREAMS_NSSA		= 0x02,
+	NVME_DIR_STREAMS_NSSO		= 0x04,
+	NVME_DIR_STREAMS_SWS		= 0x10,
+	NVME_DIR_STREAMS_SGS		= 0x14,
+	NVME_DIR_STREAMS_NSA		= 0x16,
+	NVME_DIR_STREAMS_NSO		= 0x18,
+	NVME_DIR_STREAMS_SIZE		= 0x20,
+};
+
+/* i/o management receive, reclaim unit handle status */
+enum nvme_io_mgmt_fields {
+	NVME_IO_MGMT_MO_SHIFT		= 0,
+	NVME_IO_MGMT_MO_MASK		= 0xff,
+	NVME_IO_MGMT_MO_RUHS		= 0x1,
+};
+
+enum nvme_ruhs_offset {
+	NVME_RUHS_NRUHSD		= 0x0e,
+	NVME_RUHS_DESC			= 0x10,
+
+	NVME_RUHSD_PID			= 0x00,
+	NVME_RUHSD_RUHID		= 0x02,
+	NVME_RUHSD_EARUTR		= 0x04,
+	NVME_RUHSD_RUAMW		= 0x08,
+	NVME_RUHSD_SIZE			= 0x20,
+};
+
+/* power state descriptor */
+enum nvme_psd_offset {
+	NVME_PSD_MP			= 0x00,
+	NVME_PSD_FLAGS			= 0x03,
+	NVME_PSD_ENLAT			= 0x04,
+	NVME_PSD_EXLAT			= 0x08,
+	NVME_PSD_SIZE			= 0x20,
+};
+
+enum nvme_psd_flags {
+	NVME_PSD_FLAGS_MXPS		= 1 << 0,
+	NVME_PSD_FLAGS_NOPS		= 1 << 1,
+};
+
+/* get log page identifiers */
+enum nvme_log_lid {
+	NVME_LOG_LID_SMART		= 0x02,
+};
+
+/* smart / health information log page (128 bit counters are read as 64 bit) */
+enum nvme_smart_log_offset {
+	NVME_SMART_CRIT_WARN		= 0x00,
+	NVME_SMART_TEMP			= 0x01,
+	NVME_SMART_AVAIL_SPARE		= 0x03,
+	NVME_SMART_SPARE_THRESH		= 0x04,
+	NVME_SMART_PERCENT_USED		= 0x05,
+	NVME_SMART_DATA_UNITS_READ	= 0x20,
+	NVME_SMART_DATA_UNITS_WRITTEN	= 0x30,
+	NVME_SMART_HOST_READS		= 0x40,
+	NVME_SMART_HOST_WRITES		= 0x50,
+	NVME_SMART_CTRL_BUSY_TIME	= 0x60,
+	NVME_SMART_POWER_CYCLES		= 0x70,
+	NVME_SMART_POWER_ON_HOURS	= 0x80,
+	NVME_SMART_UNSAFE_SHUTDOWNS	= 0x90,
+	NVME_SMART_MEDIA_ERRORS		= 0xa0,
+	NVME_SMART_NUM_ERR_LOG_ENTRIES	= 0xb0,
+	NVME_SMART_SIZE			= 0x200,
+};
+
+/* asynchronous event request completion (dw0) */
+enum nvme_aer_fields {
+	NVME_AER_TYPE_SHIFT		= 0,
+	NVME_AER_TYPE_MASK		= 0x7,
+	NVME_AER_TYPE_SMART		= 0x1,
+};
+
+/* host memory buffer descriptor entry */
+enum nvme_hmb_desc_offset {
+	NVME_HMB_DESC_BADD		= 0x0,
+	NVME_HMB_DESC_BSIZE		= 0x8,
+	NVME_HMB_DESC_SIZE		= 0x10,
+};
+
+/* host memory buffer sizes in identify controller are in units of 4 KiB */
+#define NVME_HMB_UNIT_SHIFT 12
+
+enum nvme_identify_ns_offset {
+	NVME_IDENTIFY_NS_NSZE		= 0x000,
+	NVME_IDENTIFY_NS_NCAP		= 0x008,
+	NVME_IDENTIFY_NS_NUSE		= 0x010,
+	NVME_IDENTIFY_NS_NLBAF		= 0x019,
+	NVME_IDENTIFY_NS_FLBAS		= 0x01a,
+	NVME_IDENTIFY_NS_DPS		= 0x01d,
+	NVME_IDENTIFY_NS_ENDGID		= 0x066,
+	NVME_IDENTIFY_NS_LBAF		= 0x080,
+};
+
+enum nvme_identify_ns_nvm_offset {
+	NVME_IDENTIFY_NS_NVM_ELBAF	= 0x00c,
+};
+
+enum nvme_identify_ns_zns_offset {
+	NVME_IDENTIFY_NS_ZNS_MAR	= 0x004,
+	NVME_IDENTIFY_NS_ZNS_MOR	= 0x008,
+	NVME_IDENTIFY_NS_ZNS_LBAFE	= 0xb00,
+};
+
+enum nvme_identify_ctrl_zns_offset {
+	NVME_IDENTIFY_CTRL_ZNS_ZASL	= 0x000,
+};
+
+enum nvme_identify_ctrl_nvm_offset {
+	NVME_IDENTIFY_CTRL_NVM_VSL	= 0x000,
+	NVME_IDENTIFY_CTRL_NVM_WZSL	= 0x001,
+	NVME_IDENTIFY_CTRL_NVM_DMRL	= 0x003,
+	NVME_IDENTIFY_CTRL_NVM_DMRSL	= 0x004,
+	NVME_IDENTIFY_CTRL_NVM_DMSL	= 0x008,
+};
+
+enum nvme_zns_constants {
+	/* zone descriptor extensions are not reported */
+	NVME_ZNS_ZONE_DESC_SIZE		= 64,
+	NVME_ZNS_LBAFE_SIZE		= 16,
+
+	NVME_ZNS_ZRA_REPORT		= 0x0,
+	NVME_ZNS_ZRA_PARTIAL		= 1 << 16,
+	NVME_ZNS_ZSA_SELECT_ALL		= 1 << 8,
+};
+
+enum nvme_zns_zone_desc_offset {
+	NVME_ZNS_ZONE_DESC_ZS		= 0x01,
+	NVME_ZNS_ZONE_DESC_ZA		= 0x02,
+	NVME_ZNS_ZONE_DESC_ZCAP		= 0x08,
+	NVME_ZNS_ZONE_DESC_ZSLBA	= 0x10,
+	NVME_ZNS_ZONE_DESC_WP		= 0x18,
+};
+
+enum nvme_identify_ns_fields {
+	NVME_ID_NS_FLBAS_LO_SHIFT	= 0,
+	NVME_ID_NS_FLBAS_LO_MASK	= 0xf,
+	NVME_ID_NS_FLBAS_MSET_SHIFT	= 4,
+	NVME_ID_NS_FLBAS_MSET_MASK	= 0x1,
+	NVME_ID_NS_FLBAS_HI_SHIFT	= 5,
+	NVME_ID_NS_FLBAS_HI_MASK	= 0x3,
+	NVME_ID_NS_DPS_PIT_SHIFT	= 0,
+	NVME_ID_NS_DPS_PIT_MASK		= 0x7,
+	NVME_ID_NS_DPS_FIRST_SHIFT	= 3,
+	NVME_ID_NS_DPS_FIRST_MASK	= 0x1,
+	NVME_ID_NS_LBAF_MS_SHIFT	= 0,
+	NVME_ID_NS_LBAF_MS_MASK		= 0xffff,
+	NVME_ID_NS_LBAF_LBADS_SHIFT	= 16,
+	NVME_ID_NS_LBAF_LBADS_MASK	= 0xff,
+	NVME_ID_NS_NVM_ELBAF_STS_SHIFT	= 0,
+	NVME_ID_NS_NVM_ELBAF_STS_MASK	= 0x7f,
+	NVME_ID_NS_NVM_ELBAF_PIF_SHIFT	= 7,
+	NVME_ID_NS_NVM_ELBAF_PIF_MASK	= 0x3,
 };
 
 enum nvme_identify_ctrl_oacs {
 	NVME_IDENTIFY_CTRL_OACS_DBCONFIG = 1 << 8,
 };
+
+enum nvme_identify_ctrl_lpa {
+	NVME_IDENTIFY_CTRL_LPA_EDLP	= 1 << 2,
+};
+
+enum nvme_identify_ctrl_oncs {
+	NVME_IDENTIFY_CTRL_ONCS_DSM	= 1 << 2,
+	NVME_IDENTIFY_CTRL_ONCS_WRITE_ZEROES = 1 << 3,
+	NVME_IDENTIFY_CTRL_ONCS_VERIFY	= 1 << 7,
+};
+
+enum nvme_identify_ctrl_fuses {
+	NVME_IDENTIFY_CTRL_FUSES_CMP_WRITE = 1 << 0,
+};
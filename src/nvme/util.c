@@ -34,31 +34,31 @@
 #include <vfn/trace.h>
 #include <vfn/nvme.h>
 
-#include "types.h"
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
 
-#include "crc64table.h"
+#include "types.h"
 
-uint64_t nvme_crc64(uint64_t crc, const unsigned char *buffer, size_t len)
+int nvme_set_errno_from_cqe(struct nvme_cqe *cqe)
 {
-	size_t i;
-
-	for (i = 0; i < len; i++)
-		crc = (crc >> 8) ^ crc64_nvme_table[(crc & 0xff) ^ buffer[i]];
+	errno = le16_to_cpu(cqe->sfp) >> 1 ? EIO : 0;
 
-	return crc ^ (uint64_t)~0;
+	return errno ? -1 : 0;
 }
 
-int nvme_set_errno_from_cqe(struct nvme_cqe *cqe)
+static void __aer_post(struct nvme_sq *sq, struct nvme_rq *rq)
 {
-	errno = le16_to_cpu(cqe->sfp) >> 1 ? EIO : 0;
+	union nvme_cmd cmd = { .opcode = NVME_ADMIN_ASYNC_EVENT };
 
-	return errno ? -1 : 0;
+	cmd.cid = rq->cid | NVME_CID_AER;
+
+	/* rq_post overwrites the command identifier, so use sq_post */
+	nvme_sq_post(sq, &cmd);
 }
 
 int nvme_aer(struct nvme_ctrl *ctrl, void *opaque)
 {
 	struct nvme_rq *rq;
-	union nvme_cmd cmd = { .opcode = NVME_ADMIN_ASYNC_EVENT };
 
 	rq = nvme_rq_acquire_atomic(ctrl->adminq.sq);
 	if (!rq) {
@@ -66,78 +66,1130 @@ int nvme_aer(struct nvme_ctrl *ctrl, void *opaque)
 		return -1;
 	}
 
-	cmd.cid = rq->cid | NVME_CID_AER;
 	rq->opaque = opaque;
 
-	/* rq_exec overwrites the command identifier, so use sq_exec */
-	nvme_sq_exec(ctrl->adminq.sq, &cmd);
+	nvme_cq_lock(ctrl->adminq.cq);
+
+	__aer_post(ctrl->adminq.sq, rq);
+	nvme_sq_flush_tail(ctrl->adminq.sq);
+
+	nvme_cq_unlock(ctrl->adminq.cq);
+
+	return 0;
+}
+
+void nvme_aer_set_handler(struct nvme_ctrl *ctrl, nvme_aer_cb cb, void *opaque)
+{
+	nvme_cq_lock(ctrl->adminq.cq);
+
+	ctrl->adminq.aer_cb = cb;
+	ctrl->adminq.aer_opaque = opaque;
+
+	nvme_cq_unlock(ctrl->adminq.cq);
+}
+
+#define NVME_REAP_BATCH 16
+
+/*
+ * Reap @cq (unless another thread is already doing so) and route each
+ * completion to the callback of its request tracker (or, on the admin queue,
+ * to the asynchronous event handler). Waiters never miss a completion reaped
+ * by another thread, since it is delivered to the tracker it belongs to. Like
+ * nvme_cq_process(), the tracker is released when the callback returns unless
+ * the callback resubmitted it.
+ */
+static int __reap(struct nvme_ctrl *ctrl, struct nvme_cq *cq)
+{
+	bool adminq = cq == ctrl->adminq.cq;
+	struct {
+		struct nvme_rq *rq;
+		nvme_rq_cb cb;
+		void *arg;
+		struct nvme_cqe cqe;
+		bool aer;
+	} done[NVME_REAP_BATCH];
+	nvme_aer_cb aer_cb;
+	void *aer_opaque;
+	struct nvme_cqe *cqe;
+	struct nvme_sq *resubmitted = NULL;
+	int n = 0, reaped = 0;
+	bool rearmed = false;
+	uint64_t now = 0;
+
+	/*
+	 * The lock serializes reaping the queue (and posting commands waited for
+	 * by nvme_sync() and friends to the submission queues completing on it);
+	 * completions are dispatched after it is dropped.
+	 */
+	if (!nvme_cq_trylock(cq))
+		return 0;
+
+	aer_cb = ctrl->adminq.aer_cb;
+	aer_opaque = ctrl->adminq.aer_opaque;
+
+	while (n < NVME_REAP_BATCH && (cqe = nvme_cq_get_cqe(cq))) {
+		uint16_t sqid = le16_to_cpu(cqe->sqid), cid = cqe->cid;
+		bool aer = adminq && cid & NVME_CID_AER;
+		struct nvme_sq *sq;
+		struct nvme_rq *rq;
+
+		reaped++;
+
+		if (aer)
+			cid &= ~NVME_CID_AER;
+
+		if ((adminq ? sqid != 0 : sqid > ctrl->config.nsqa + 1) ||
+		    (sq = &cq->sqs[sqid])->cq != cq || cid >= sq->qsize - 1 ||
+		    (!aer && !sq->rqs[cid].cb)) {
+			log_errorrl(1, (uintptr_t)cq,
+				    "SPURIOUS CQE (cq %" PRIu16 " cid %" PRIu16 ")\n", cq->id,
+				    cqe->cid);
+
+			continue;
+		}
+
+		rq = &sq->rqs[cid];
+
+		/* refreshing the health cache reads the log page and unmasks the event */
+		if (aer && NVME_FIELD_GET(le32_to_cpu(cqe->dw0), AER_TYPE) == NVME_AER_TYPE_SMART)
+			atomic_store_release(&ctrl->health.stale, true);
+
+		if (aer) {
+			struct nvme_stats_ctrl *stats = nvme_stats_ctrl(ctrl);
+
+			if (stats) {
+				__nvme_stats_write_begin(&stats->seq);
+				stats->aens++;
+				__nvme_stats_write_end(&stats->seq);
+			}
+
+			if (!aer_cb) {
+				log_debug("no handler; dropping asynchronous event 0x%" PRIx32 "\n",
+					  le32_to_cpu(cqe->dw0));
+
+				nvme_rq_release_atomic(rq);
+
+				continue;
+			}
+
+			/* re-arm before delivery; the event stays masked until handled */
+			__aer_post(sq, rq);
+			rearmed = true;
+		}
+
+		if (!aer) {
+			if (cq->tmo)
+				__nvme_timeout_del(cq->tmo, rq);
+
+			/* posted before tracking was enabled if not stamped */
+			if (sq->lat && rq->tsubmit) {
+				if (!now)
+					now = get_ticks();
+
+				__nvme_sq_latency_add(sq->lat, now - rq->tsubmit);
+
+				rq->tsubmit = 0;
+			}
+		}
+
+		done[n].rq = rq;
+		done[n].cb = rq->cb;
+		done[n].arg = rq->cb_arg;
+		done[n].cqe = *cqe;
+		done[n].aer = aer;
+
+		rq->cb = NULL;
+
+		n++;
+	}
+
+	if (reaped) {
+		if (rearmed)
+			nvme_sq_flush_tail(ctrl->adminq.sq);
+
+		nvme_cq_update_head(cq);
+	}
+
+	nvme_cq_unlock(cq);
+
+	for (int i = 0; i < n; i++) {
+		struct nvme_rq *rq = done[i].rq;
+
+		if (done[i].aer) {
+			aer_cb(ctrl, &done[i].cqe, aer_opaque);
+
+			continue;
+		}
+
+		/* verification may rewrite the status of the copy */
+		if (rq->pi)
+			nvme_pi_complete(rq->pi, &done[i].cqe);
+
+		done[i].cb(rq, &done[i].cqe, done[i].arg);
+
+		if (!rq->cb) {
+			nvme_rq_release_atomic(rq);
+
+			continue;
+		}
+
+		/* resubmitted commands all go to the submission queues of @cq */
+		if (resubmitted && resubmitted != rq->sq) {
+			nvme_cq_lock(cq);
+			nvme_sq_flush_tail(resubmitted);
+			nvme_cq_unlock(cq);
+		}
+
+		resubmitted = rq->sq;
+	}
+
+	if (resubmitted) {
+		nvme_cq_lock(cq);
+		nvme_sq_flush_tail(resubmitted);
+		nvme_cq_unlock(cq);
+	}
+
+	return n;
+}
+
+int nvme_admin_process(struct nvme_ctrl *ctrl)
+{
+	return __reap(ctrl, ctrl->adminq.cq);
+}
+
+/* post a command with a completion callback */
+static void __submit(struct nvme_rq *rq, union nvme_cmd *sqe, nvme_rq_cb cb, void *arg)
+{
+	struct nvme_cq *cq = rq->sq->cq;
+
+	nvme_cq_lock(cq);
+
+	nvme_rq_submit(rq, sqe, cb, arg);
+	nvme_sq_flush_tail(rq->sq);
+
+	nvme_cq_unlock(cq);
+}
+
+struct __sync_wait {
+	struct nvme_cqe cqe;
+	bool done;
+};
+
+static void __sync_complete(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *opaque)
+{
+	struct __sync_wait *wait = opaque;
+
+	wait->cqe = *cqe;
+
+	atomic_store_release(&wait->done, true);
+}
+
+static int __sync_exec(struct nvme_ctrl *ctrl, struct nvme_rq *rq, union nvme_cmd *sqe,
+		       struct nvme_cqe *cqe)
+{
+	struct __sync_wait wait = {};
+
+	__submit(rq, sqe, __sync_complete, &wait);
+
+	while (!atomic_load_acquire(&wait.done))
+		__reap(ctrl, rq->sq->cq);
+
+	*cqe = wait.cqe;
+
+	if (!nvme_cqe_ok(cqe)) {
+		log_debug("cqe status 0x%" PRIx16 "\n",
+			  (uint16_t)((le16_to_cpu(cqe->sfp) >> 1) & 0x7ff));
+
+		return nvme_set_errno_from_cqe(cqe);
+	}
+
+	return 0;
+}
+
+static int __map_payload(struct nvme_ctrl *ctrl, void *buf, size_t len, uint64_t *iova,
+			 bool *do_unmap)
+{
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
+
+	*do_unmap = false;
+
+	if (iommu_translate_vaddr(ctx, buf, iova))
+		return 0;
+
+	if (iommu_map_vaddr(ctx, buf, len, iova, IOMMU_MAP_EPHEMERAL)) {
+		log_debug("failed to map vaddr\n");
+		return -1;
+	}
+
+	*do_unmap = true;
 
 	return 0;
 }
 
+/* take a free bounce slot for a payload of @len bytes */
+static int __bounce_acquire(struct nvme_ctrl *ctrl, size_t len)
+{
+	uint32_t free;
+
+	if (!ctrl->bounce.vaddr || len > NVME_BOUNCE_SLOT_SIZE)
+		return -1;
+
+	free = atomic_load_acquire(&ctrl->bounce.free);
+
+	do {
+		if (!free)
+			return -1;
+	} while (!atomic_cmpxchg(&ctrl->bounce.free, free, free & (free - 1)));
+
+	return __builtin_ctz(free);
+}
+
+static void __bounce_release(struct nvme_ctrl *ctrl, int slot)
+{
+	__atomic_fetch_or(&ctrl->bounce.free, 1U << slot, __ATOMIC_RELEASE);
+}
+
+/*
+ * Bits 1:0 of the opcode give the data transfer direction; commands that do
+ * not specify one are assumed to transfer in both directions.
+ */
+static inline bool __data_in(union nvme_cmd *sqe)
+{
+	return (sqe->opcode & 0x3) != 0x2;
+}
+
+static inline bool __data_out(union nvme_cmd *sqe)
+{
+	return (sqe->opcode & 0x3) != 0x1;
+}
+
 int nvme_sync(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, void *buf,
 	      size_t len, struct nvme_cqe *cqe_copy)
 {
+	struct iommu_ctx *ctx = __iommu_ctx(ctrl);
 	struct nvme_cqe cqe;
 	struct nvme_rq *rq;
 	uint64_t iova;
+	void *bounce = NULL;
 	bool do_unmap = false;
-	int ret = 0;
-
-	if (buf) {
-		struct iommu_ctx *ctx = __iommu_ctx(ctrl);
-
-		if (!iommu_translate_vaddr(ctx, buf, &iova)) {
-			do_unmap = true;
+	int slot = -1, ret = 0;
 
+	/*
+	 * Small payloads that are not already mapped are copied through a
+	 * pre-mapped bounce slot; everything else is mapped for the duration of
+	 * the command.
+	 */
+	if (buf && !iommu_translate_vaddr(ctx, buf, &iova)) {
+		slot = __bounce_acquire(ctrl, len);
+		if (slot < 0) {
 			if (iommu_map_vaddr(ctx, buf, len, &iova, IOMMU_MAP_EPHEMERAL)) {
 				log_debug("failed to map vaddr\n");
 				return -1;
 			}
+
+			do_unmap = true;
+		} else {
+			bounce = ctrl->bounce.vaddr + (size_t)slot * NVME_BOUNCE_SLOT_SIZE;
+			iova = ctrl->bounce.iova + (uint64_t)slot * NVME_BOUNCE_SLOT_SIZE;
+
+			if (__data_in(sqe))
+				memcpy(bounce, buf, len);
 		}
 	}
 
 	rq = nvme_rq_acquire_atomic(sq);
-	if (!rq)
-		return -1;
+	if (!rq) {
+		ret = -1;
+		goto unmap;
+	}
 
 	if (buf) {
 		ret = nvme_rq_map_prp(ctrl, rq, sqe, iova, len);
 		if (ret) {
-			goto release_rq;
+			nvme_rq_release_atomic(rq);
+			goto unmap;
 		}
 	}
 
-	nvme_rq_exec(rq, sqe);
+	/* the tracker is released when the completion is delivered */
+	ret = __sync_exec(ctrl, rq, sqe, &cqe);
 
-	while (nvme_rq_spin(rq, &cqe) < 0) {
-		if (errno == EAGAIN) {
-			log_error("SPURIOUS CQE (cq %" PRIu16 " cid %" PRIu16 ")\n",
-				  rq->sq->cq->id, cqe.cid);
+	if (cqe_copy)
+		memcpy(cqe_copy, &cqe, 1 << NVME_CQES);
 
-			continue;
-		}
+	if (bounce && __data_out(sqe))
+		memcpy(buf, bounce, len);
 
-		ret = -1;
+unmap:
+	if (slot >= 0)
+		__bounce_release(ctrl, slot);
 
-		break;
+	if (do_unmap)
+		log_fatal_if(iommu_unmap_vaddr(ctx, buf, NULL), "iommu_unmap_vaddr\n");
+
+	return ret;
+}
+
+int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
+	       struct nvme_cqe *cqe_copy)
+{
+	return nvme_sync(ctrl, ctrl->adminq.sq, sqe, buf, len, cqe_copy);
+}
+
+/* drop a reference to @future; the last one completes it */
+static void __future_put(struct nvme_future *future)
+{
+	if (--future->pending)
+		return;
+
+	if (future->do_unmap)
+		log_fatal_if(iommu_unmap_vaddr(__iommu_ctx(future->ctrl), future->buf, NULL),
+			     "iommu_unmap_vaddr\n");
+
+	if (future->do_unmap2)
+		log_fatal_if(iommu_unmap_vaddr(__iommu_ctx(future->ctrl), future->buf2, NULL),
+			     "iommu_unmap_vaddr\n");
+
+	atomic_store_release(&future->done, true);
+}
+
+static void __future_complete(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *opaque)
+{
+	struct nvme_future *future = opaque;
+
+	/* keep the first failure */
+	if (nvme_cqe_ok(&future->cqe))
+		future->cqe = *cqe;
+
+	__future_put(future);
+}
+
+int nvme_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, union nvme_cmd *sqe, void *buf,
+	       size_t len, struct nvme_future *future)
+{
+	struct nvme_rq *rq;
+	uint64_t iova;
+
+	*future = (struct nvme_future) {
+		.ctrl = ctrl,
+		.sq = sq,
+		.buf = buf,
+		.pending = 1,
+	};
+
+	if (buf && __map_payload(ctrl, buf, len, &iova, &future->do_unmap))
+		return -1;
+
+	rq = nvme_rq_acquire_atomic(sq);
+	if (!rq)
+		goto unmap;
+
+	if (buf && nvme_rq_map_prp(ctrl, rq, sqe, iova, len)) {
+		nvme_rq_release_atomic(rq);
+		goto unmap;
 	}
 
-	if (cqe_copy)
-		memcpy(cqe_copy, &cqe, 1 << NVME_CQES);
+	__submit(rq, sqe, __future_complete, future);
 
-release_rq:
-	nvme_rq_release_atomic(rq);
+	return 0;
 
-	if (buf && do_unmap)
+unmap:
+	if (future->do_unmap)
 		log_fatal_if(iommu_unmap_vaddr(__iommu_ctx(ctrl), buf, NULL),
 			     "iommu_unmap_vaddr\n");
 
+	return -1;
+}
+
+int nvme_admin_async(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
+		     struct nvme_future *future)
+{
+	return nvme_async(ctrl, ctrl->adminq.sq, sqe, buf, len, future);
+}
+
+static inline uint16_t __cqe_status(struct nvme_cqe *cqe)
+{
+	return (uint16_t)((le16_to_cpu(cqe->sfp) >> 1) & 0x7ff);
+}
+
+/*
+ * When one command of a fused operation fails, the other one is aborted with
+ * the Failed Fused Command status; report the failure that caused it.
+ */
+static void __fused_complete(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *opaque)
+{
+	struct nvme_future *future = opaque;
+
+	if (nvme_cqe_ok(&future->cqe) || (__cqe_status(&future->cqe) == NVME_SC_FUSED_FAIL &&
+					  !nvme_cqe_ok(cqe)))
+		future->cqe = *cqe;
+
+	__future_put(future);
+}
+
+int nvme_compare_write_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+			     uint64_t slba, void *cmp, void *buf, size_t len,
+			     struct nvme_future *future)
+{
+	struct nvme_rq *first, *second;
+	union nvme_cmd cmds[2];
+	uint64_t iova[2];
+
+	if (!(ctrl->config.fuses & NVME_IDENTIFY_CTRL_FUSES_CMP_WRITE) || ns->ms) {
+		log_debug("fused compare and write is not supported\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (nvme_ns_prep_rw(ns, &cmds[0], NVME_NVM_COMPARE, slba, len) ||
+	    nvme_ns_nlb(ns, len) > ctrl->config.acwu) {
+		log_debug("invalid compare and write (slba %" PRIu64 " len %zu)\n", slba, len);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	cmds[1] = cmds[0];
+	cmds[1].rw.opcode = NVME_NVM_WRITE;
+
+	*future = (struct nvme_future) {
+		.ctrl = ctrl,
+		.sq = sq,
+		.buf = cmp,
+		.buf2 = buf,
+		.pending = 2,
+	};
+
+	if (__map_payload(ctrl, cmp, len, &iova[0], &future->do_unmap))
+		return -1;
+
+	if (__map_payload(ctrl, buf, len, &iova[1], &future->do_unmap2))
+		goto unmap;
+
+	first = nvme_rq_acquire_atomic(sq);
+	if (!first)
+		goto unmap;
+
+	second = nvme_rq_acquire_atomic(sq);
+	if (!second) {
+		nvme_rq_release_atomic(first);
+		goto unmap;
+	}
+
+	if (nvme_rq_map_prp(ctrl, first, &cmds[0], iova[0], len) ||
+	    nvme_rq_map_prp(ctrl, second, &cmds[1], iova[1], len)) {
+		nvme_rq_release_atomic(second);
+		nvme_rq_release_atomic(first);
+		goto unmap;
+	}
+
+	/* the cq lock keeps the pair in adjacent submission queue entries */
+	nvme_cq_lock(sq->cq);
+
+	nvme_rq_submit_fused(first, second, cmds, __fused_complete, future);
+	nvme_sq_flush_tail(sq);
+
+	nvme_cq_unlock(sq->cq);
+
+	return 0;
+
+unmap:
+	future->pending = 1;
+	__future_put(future);
+
+	return -1;
+}
+
+int nvme_compare_write(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+		       uint64_t slba, void *cmp, void *buf, size_t len)
+{
+	struct nvme_future future;
+
+	if (nvme_compare_write_async(ctrl, sq, ns, slba, cmp, buf, len, &future))
+		return -1;
+
+	if (nvme_future_wait(&future)) {
+		if (__cqe_status(&future.cqe) == NVME_SC_COMPARE_FAILED)
+			return 1;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int nvme_future_wait(struct nvme_future *future)
+{
+	while (!atomic_load_acquire(&future->done))
+		__reap(future->ctrl, future->sq->cq);
+
+	if (!nvme_cqe_ok(&future->cqe)) {
+		log_debug("cqe status 0x%" PRIx16 "\n",
+			  (uint16_t)(le16_to_cpu(future->cqe.sfp) >> 1));
+
+		return nvme_set_errno_from_cqe(&future->cqe);
+	}
+
+	return 0;
+}
+
+int nvme_future_wait_all(struct nvme_future *futures, int n)
+{
+	int ret = 0, err = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (nvme_future_wait(&futures[i]) && !ret) {
+			ret = -1;
+			err = errno;
+		}
+	}
+
+	if (ret)
+		errno = err;
+
 	return ret;
 }
 
-int nvme_admin(struct nvme_ctrl *ctrl, union nvme_cmd *sqe, void *buf, size_t len,
-	       struct nvme_cqe *cqe_copy)
+/*
+ * Largest transfer that a single command can carry, in whole logical blocks.
+ */
+static size_t __max_xfer(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns)
 {
-	return nvme_sync(ctrl, ctrl->adminq.sq, sqe, buf, len, cqe_copy);
+	size_t max = (size_t)ns->max_nlb << ns->lbads;
+
+	/* sgls are not supported for admin commands on pcie */
+	if (sq->id && (ctrl->config.sgls & NVME_SGLS_SUPPORT_MASK))
+		/* a single data block descriptor */
+		max = ALIGN_DOWN(min_t(size_t, max, UINT32_MAX), 1ULL << ns->lbads);
+
+	return max;
+}
+
+static int nvme_rw_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, uint8_t opcode,
+			 struct nvme_ns *ns, uint64_t slba, void *buf, size_t len,
+			 struct nvme_future *future)
+{
+	size_t max, chunk;
+	uint64_t iova;
+	int err = 0;
+
+	if (ns->ms) {
+		log_debug("namespaces with metadata are not supported\n");
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (!len || len & ((1ULL << ns->lbads) - 1) || slba >= ns->nsze ||
+	    nvme_ns_nlb(ns, len) > ns->nsze - slba) {
+		log_debug("invalid transfer (slba %" PRIu64 " len %zu)\n", slba, len);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	max = __max_xfer(ctrl, sq, ns);
+	if (!max) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*future = (struct nvme_future) {
+		.ctrl = ctrl,
+		.sq = sq,
+		.buf = buf,
+
+		/* held until all commands are posted */
+		.pending = 1,
+	};
+
+	if (__map_payload(ctrl, buf, len, &iova, &future->do_unmap))
+		return -1;
+
+	for (size_t ofst = 0; ofst < len;) {
+		union nvme_cmd cmd;
+		struct nvme_rq *rq;
+
+		chunk = min(len - ofst, max);
+
+		if (nvme_ns_prep_rw(ns, &cmd, opcode, slba + nvme_ns_nlb(ns, ofst), chunk)) {
+			err = errno;
+			break;
+		}
+
+		while (!(rq = nvme_rq_acquire_atomic(sq))) {
+			/* nothing to reap that would free up a tracker */
+			if (future->pending == 1) {
+				err = EBUSY;
+				break;
+			}
+
+			nvme_sq_flush_tail(sq);
+			__reap(ctrl, sq->cq);
+		}
+
+		if (!rq)
+			break;
+
+		if (nvme_rq_map(ctrl, rq, &cmd, iova + ofst, chunk)) {
+			err = errno;
+			nvme_rq_release_atomic(rq);
+
+			/* out of chained prp list pages; wait for some to be returned */
+			if (err == EBUSY && future->pending > 1) {
+				err = 0;
+
+				nvme_sq_flush_tail(sq);
+				__reap(ctrl, sq->cq);
+
+				continue;
+			}
+
+			break;
+		}
+
+		future->pending++;
+
+		nvme_rq_submit(rq, &cmd, __future_complete, future);
+
+		ofst += chunk;
+	}
+
+	nvme_sq_flush_tail(sq);
+
+	__future_put(future);
+
+	if (err) {
+		while (!atomic_load_acquire(&future->done))
+			__reap(ctrl, sq->cq);
+
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nvme_read_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns, uint64_t slba,
+		    void *buf, size_t len, struct nvme_future *future)
+{
+	return nvme_rw_async(ctrl, sq, NVME_NVM_READ, ns, slba, buf, len, future);
+}
+
+int nvme_write_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+		     uint64_t slba, void *buf, size_t len, struct nvme_future *future)
+{
+	return nvme_rw_async(ctrl, sq, NVME_NVM_WRITE, ns, slba, buf, len, future);
+}
+
+int nvme_read(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns, uint64_t slba,
+	      void *buf, size_t len)
+{
+	struct nvme_future future;
+
+	if (nvme_read_async(ctrl, sq, ns, slba, buf, len, &future))
+		return -1;
+
+	return nvme_future_wait(&future);
+}
+
+int nvme_write(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns, uint64_t slba,
+	       void *buf, size_t len)
+{
+	struct nvme_future future;
+
+	if (nvme_write_async(ctrl, sq, ns, slba, buf, len, &future))
+		return -1;
+
+	return nvme_future_wait(&future);
+}
+
+/* the number of dataset management ranges is a zeroes based 8 bit value */
+#define NVME_DSM_MAX_RANGES 256
+
+/*
+ * A region fill in progress on a queue. The remainder of the current range is
+ * kept in @slba and @nlb and the ranges that follow it in @ranges and @nr.
+ */
+struct nvme_fill {
+	struct nvme_ctrl *ctrl;
+	struct nvme_sq *sq;
+	struct nvme_ns *ns;
+	enum nvme_fill_op op;
+	struct nvme_future *future;
+
+	const struct nvme_rq_dsm_range *ranges;
+	int nr;
+
+	uint64_t slba, nlb;
+};
+
+static int __fill_check(struct nvme_ctrl *ctrl, struct nvme_ns *ns, enum nvme_fill_op op,
+			uint64_t slba, uint64_t nlb)
+{
+	bool supported;
+
+	switch (op) {
+	case NVME_FILL_WRITE_ZEROES:
+	case NVME_FILL_WRITE_ZEROES_DEAC:
+		supported = ns->max_wz_nlb > 0;
+		break;
+	case NVME_FILL_VERIFY:
+		supported = ns->max_verify_nlb > 0;
+		break;
+	case NVME_FILL_DEALLOCATE:
+		supported = ctrl->config.oncs & NVME_IDENTIFY_CTRL_ONCS_DSM;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!supported) {
+		log_debug("fill operation %d not supported\n", op);
+
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (!nlb || slba >= ns->nsze || nlb > ns->nsze - slba) {
+		log_debug("invalid region (slba %" PRIu64 " nlb %" PRIu64 ")\n", slba, nlb);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* largest region that a single command covers (0 if not limited) */
+static uint64_t __fill_max(struct nvme_ctrl *ctrl, struct nvme_ns *ns, enum nvme_fill_op op)
+{
+	switch (op) {
+	case NVME_FILL_VERIFY:
+		return ns->max_verify_nlb;
+	case NVME_FILL_DEALLOCATE:
+		if (ctrl->config.dmsl)
+			return ctrl->config.dmsl;
+
+		if (!ctrl->config.dmrsl)
+			return 0;
+
+		return (uint64_t)ctrl->config.dmrsl *
+			(uint64_t)(ctrl->config.dmrl ? ctrl->config.dmrl : NVME_DSM_MAX_RANGES);
+	default:
+		return ns->max_wz_nlb;
+	}
+}
+
+static void __fill_init(struct nvme_fill *f, struct nvme_ctrl *ctrl, struct nvme_sq *sq,
+			struct nvme_ns *ns, enum nvme_fill_op op, uint64_t slba, uint64_t nlb,
+			struct nvme_future *future)
+{
+	*f = (struct nvme_fill) {
+		.ctrl = ctrl,
+		.sq = sq,
+		.ns = ns,
+		.op = op,
+		.future = future,
+		.slba = slba,
+		.nlb = nlb,
+	};
+
+	*future = (struct nvme_future) {
+		.ctrl = ctrl,
+		.sq = sq,
+
+		/* held until all commands are posted */
+		.pending = 1,
+	};
+}
+
+/* take up to @max logical blocks off the front of the remaining region */
+static uint32_t __fill_take(struct nvme_fill *f, uint64_t max, uint64_t *slba)
+{
+	uint32_t n = (uint32_t)min_t(uint64_t, f->nlb, max);
+
+	*slba = f->slba;
+
+	f->slba += n;
+	f->nlb -= n;
+
+	if (!f->nlb && f->nr) {
+		f->slba = f->ranges->slba;
+		f->nlb = f->ranges->nlb;
+
+		f->ranges++;
+		f->nr--;
+	}
+
+	return n;
+}
+
+static int __fill_prep(struct nvme_fill *f, struct nvme_rq *rq, union nvme_cmd *cmd)
+{
+	struct nvme_rq_dsm_range batch[NVME_DSM_MAX_RANGES];
+	struct nvme_ctrl *ctrl = f->ctrl;
+	uint64_t slba, max, total = 0;
+	int n = 0, maxr;
+	uint32_t nlb;
+
+	if (f->op != NVME_FILL_DEALLOCATE) {
+		nlb = __fill_take(f, __fill_max(ctrl, f->ns, f->op), &slba);
+
+		*cmd = (union nvme_cmd) {
+			.opcode = NVME_NVM_WRITE_ZEROES,
+			.nsid = cpu_to_le32(f->ns->nsid),
+		};
+
+		if (f->op == NVME_FILL_VERIFY)
+			cmd->opcode = NVME_NVM_VERIFY;
+
+		cmd->rw.slba = cpu_to_le64(slba);
+		cmd->rw.nlb = cpu_to_le16((uint16_t)(nlb - 1));
+
+		if (f->op == NVME_FILL_WRITE_ZEROES_DEAC)
+			cmd->rw.control = cpu_to_le16(NVME_RW_CONTROL_DEAC);
+
+		return 0;
+	}
+
+	maxr = ctrl->config.dmrl ? min_t(int, ctrl->config.dmrl, NVME_DSM_MAX_RANGES) :
+		NVME_DSM_MAX_RANGES;
+
+	while (f->nlb && n < maxr && (!ctrl->config.dmsl || total < ctrl->config.dmsl)) {
+		max = ctrl->config.dmrsl ? ctrl->config.dmrsl : UINT32_MAX;
+
+		if (ctrl->config.dmsl)
+			max = min_t(uint64_t, max, ctrl->config.dmsl - total);
+
+		nlb = __fill_take(f, max, &slba);
+
+		batch[n++] = (struct nvme_rq_dsm_range) {
+			.slba = slba,
+			.nlb = nlb,
+		};
+
+		total += nlb;
+	}
+
+	return nvme_rq_prep_dsm(ctrl, rq, f->ns, cmd, batch, n, NVME_DSM_AD);
+}
+
+/* post commands until the region is covered or the queue is out of trackers */
+static int __fill_post(struct nvme_fill *f)
+{
+	while (f->nlb) {
+		union nvme_cmd cmd;
+		struct nvme_rq *rq;
+
+		rq = nvme_rq_acquire_atomic(f->sq);
+		if (!rq)
+			return 0;
+
+		if (__fill_prep(f, rq, &cmd)) {
+			nvme_rq_release_atomic(rq);
+			return -1;
+		}
+
+		f->future->pending++;
+
+		nvme_rq_submit(rq, &cmd, __future_complete, f->future);
+	}
+
+	return 0;
+}
+
+static int __fill_async(struct nvme_fill *f)
+{
+	struct nvme_future *future = f->future;
+	int err = 0;
+
+	for (;;) {
+		if (__fill_post(f)) {
+			err = errno;
+			break;
+		}
+
+		if (!f->nlb)
+			break;
+
+		/* nothing to reap that would free up a tracker */
+		if (future->pending == 1) {
+			err = EBUSY;
+			break;
+		}
+
+		nvme_sq_flush_tail(f->sq);
+		__reap(f->ctrl, f->sq->cq);
+	}
+
+	nvme_sq_flush_tail(f->sq);
+
+	__future_put(future);
+
+	if (err) {
+		while (!atomic_load_acquire(&future->done))
+			__reap(f->ctrl, f->sq->cq);
+
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int nvme_fill_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+		    enum nvme_fill_op op, uint64_t slba, uint64_t nlb, struct nvme_future *future)
+{
+	struct nvme_fill f;
+
+	if (__fill_check(ctrl, ns, op, slba, nlb))
+		return -1;
+
+	__fill_init(&f, ctrl, sq, ns, op, slba, nlb, future);
+
+	return __fill_async(&f);
+}
+
+int nvme_deallocate_async(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_ns *ns,
+			  const struct nvme_rq_dsm_range *ranges, int nr,
+			  struct nvme_future *future)
+{
+	struct nvme_fill f;
+
+	if (nr < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		if (__fill_check(ctrl, ns, NVME_FILL_DEALLOCATE, ranges[i].slba, ranges[i].nlb))
+			return -1;
+	}
+
+	__fill_init(&f, ctrl, sq, ns, NVME_FILL_DEALLOCATE, ranges[0].slba, ranges[0].nlb,
+		    future);
+
+	f.ranges = &ranges[1];
+	f.nr = nr - 1;
+
+	return __fill_async(&f);
+}
+
+int nvme_fill(struct nvme_ctrl *ctrl, struct nvme_sq **sqs, int nsqs, struct nvme_ns *ns,
+	      enum nvme_fill_op op, uint64_t slba, uint64_t nlb)
+{
+	__autofree struct nvme_future *futures = NULL;
+	__autofree struct nvme_fill *fills = NULL;
+	uint64_t part, max;
+	int n = 0, err = 0;
+	bool more;
+
+	if (nsqs < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__fill_check(ctrl, ns, op, slba, nlb))
+		return -1;
+
+	/* one part per queue, in whole commands */
+	part = (nlb + (uint64_t)nsqs - 1) / (uint64_t)nsqs;
+
+	max = __fill_max(ctrl, ns, op);
+	if (max)
+		part = ROUND_UP(part, max);
+
+	futures = new_t(struct nvme_future, nsqs);
+	fills = new_t(struct nvme_fill, nsqs);
+
+	for (; n < nsqs && nlb; n++) {
+		uint64_t len = min_t(uint64_t, part, nlb);
+
+		__fill_init(&fills[n], ctrl, sqs[n], ns, op, slba, len, &futures[n]);
+
+		slba += len;
+		nlb -= len;
+	}
+
+	/* round robin, such that no queue waits for the others to drain */
+	do {
+		more = false;
+
+		for (int i = 0; i < n && !err; i++) {
+			struct nvme_fill *f = &fills[i];
+
+			if (!f->nlb)
+				continue;
+
+			if (__fill_post(f)) {
+				err = errno;
+				break;
+			}
+
+			nvme_sq_flush_tail(f->sq);
+
+			if (!f->nlb)
+				continue;
+
+			if (futures[i].pending == 1) {
+				err = EBUSY;
+				break;
+			}
+
+			__reap(ctrl, f->sq->cq);
+
+			more = true;
+		}
+	} while (more && !err);
+
+	for (int i = 0; i < n; i++)
+		__future_put(&futures[i]);
+
+	if (err) {
+		nvme_future_wait_all(futures, n);
+
+		errno = err;
+		return -1;
+	}
+
+	return nvme_future_wait_all(futures, n);
+}
+
+static int __set_features(struct nvme_ctrl *ctrl, uint8_t fid, uint32_t cdw11)
+{
+	union nvme_cmd cmd = {
+		.opcode = NVME_ADMIN_SET_FEATURES,
+	};
+
+	cmd.features.fid = fid;
+	cmd.features.cdw11 = cpu_to_le32(cdw11);
+
+	return nvme_admin(ctrl, &cmd, NULL, 0, NULL);
+}
+
+int nvme_set_arbitration(struct nvme_ctrl *ctrl, uint8_t ab, uint8_t lpw, uint8_t mpw,
+			 uint8_t hpw)
+{
+	return __set_features(ctrl, NVME_FEAT_FID_ARBITRATION,
+			      NVME_FIELD_SET(ab, FEAT_ARB_AB) |
+			      NVME_FIELD_SET(lpw, FEAT_ARB_LPW) |
+			      NVME_FIELD_SET(mpw, FEAT_ARB_MPW) |
+			      NVME_FIELD_SET((uint32_t)hpw, FEAT_ARB_HPW));
+}
+
+int nvme_set_irq_coalescing(struct nvme_ctrl *ctrl, uint8_t time, uint8_t thr)
+{
+	return __set_features(ctrl, NVME_FEAT_FID_IRQ_COALESCE,
+			      NVME_FIELD_SET(thr, FEAT_IRQC_THR) |
+			      NVME_FIELD_SET(time, FEAT_IRQC_TIME));
+}
+
+int nvme_set_irq_vector_coalescing(struct nvme_ctrl *ctrl, uint16_t iv, bool enable)
+{
+	return __set_features(ctrl, NVME_FEAT_FID_IRQ_CONFIG,
+			      NVME_FIELD_SET(iv, FEAT_IVC_IV) |
+			      NVME_FIELD_SET(enable ? 0 : 1, FEAT_IVC_CD));
 }
@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+
+#include "ccan/tap/tap.h"
+
+#include "util.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+static int naen;
+static uint32_t aen;
+
+static void aer_cb(struct nvme_ctrl *ctrl UNUSED, struct nvme_cqe *cqe, void *opaque)
+{
+	naen++;
+	aen = le32_to_cpu(cqe->dw0);
+
+	assert(opaque == &naen);
+}
+
+/* the controller posted completions before the command is submitted */
+static void post_cqe(struct nvme_cq *cq, uint16_t idx, uint16_t cid, uint16_t sc, uint32_t dw0)
+{
+	struct nvme_cqe *cqe = cq->vaddr + (idx << NVME_CQES);
+
+	cqe->dw0 = cpu_to_le32(dw0);
+	cqe->cid = cid;
+	cqe->sfp = cpu_to_le16((uint16_t)(sc << 1 | 0x1));
+}
+
+#define NCMDS 200
+
+static struct nvme_ctrl cctrl;
+static struct nvme_sq csq;
+static struct nvme_cq ccq;
+
+/* complete the commands posted to csq, echoing cdw10 in dw0 */
+static void *controller(void *arg UNUSED)
+{
+	union nvme_cmd *sqes = csq.vaddr;
+	struct nvme_cqe *cqes = ccq.vaddr;
+	uint16_t sqhd = 0, cqt = 0, phase = 0x1;
+
+	for (int n = 0; n < 2 * NCMDS; n++) {
+		struct nvme_cqe *cqe = &cqes[cqt];
+
+		while (sqhd == atomic_load_acquire(&csq.tail))
+			;
+
+		cqe->dw0 = sqes[sqhd].cdw10;
+		cqe->cid = sqes[sqhd].cid;
+		atomic_store_release(&cqe->sfp, cpu_to_le16(phase));
+
+		sqhd = (uint16_t)((sqhd + 1) % csq.qsize);
+
+		if (++cqt == ccq.qsize) {
+			cqt = 0;
+			phase ^= 0x1;
+		}
+	}
+
+	return NULL;
+}
+
+static void *waiter(void *arg)
+{
+	uint32_t base = (uint32_t)(uintptr_t)arg;
+	intptr_t mismatches = 0;
+
+	for (uint32_t i = 0; i < NCMDS; i++) {
+		union nvme_cmd cmd = { .opcode = NVME_ADMIN_IDENTIFY };
+		struct nvme_cqe cqe;
+
+		cmd.cdw10 = cpu_to_le32(base + i);
+
+		if (nvme_admin(&cctrl, &cmd, NULL, 0, &cqe) ||
+		    le32_to_cpu(cqe.dw0) != base + i)
+			mismatches++;
+	}
+
+	return (void *)mismatches;
+}
+
+static void test_concurrent(void)
+{
+	static uint32_t sqdb, cqdb;
+	pthread_t ctrl_thread, threads[2];
+	void *mismatches[2];
+
+	csq = (struct nvme_sq) { .qsize = 8, .doorbell = &sqdb, .cq = &ccq };
+	ccq = (struct nvme_cq) { .qsize = 8, .doorbell = &cqdb, .vector = -1, .nsqs = 1,
+				 .sqs = &csq };
+
+	csq.rqs = znew_t(struct nvme_rq, csq.qsize - 1);
+
+	assert(pgmap(&csq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&ccq.vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = csq.qsize - 2; i >= 0; i--) {
+		csq.rqs[i].sq = &csq;
+		csq.rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&csq.rqs[i]);
+	}
+
+	cctrl.adminq.sq = &csq;
+	cctrl.adminq.cq = &ccq;
+
+	assert(!pthread_create(&ctrl_thread, NULL, controller, NULL));
+
+	for (int i = 0; i < 2; i++)
+		assert(!pthread_create(&threads[i], NULL, waiter, (void *)(uintptr_t)(i << 16)));
+
+	for (int i = 0; i < 2; i++)
+		pthread_join(threads[i], &mismatches[i]);
+
+	pthread_join(ctrl_thread, NULL);
+
+	/* every caller got its own completion, whichever thread reaped it */
+	ok1(!mismatches[0] && !mismatches[1]);
+}
+
+#define NFILLQ 2
+
+static struct nvme_ctrl fctrl;
+static struct nvme_sq fsqs[NFILLQ + 1];
+static struct nvme_cq fcqs[NFILLQ + 1];
+static bool fstop;
+
+/* logical block 0 of the namespace, for compare and write */
+static void *fblock;
+
+/* commands and logical blocks (or dataset management ranges) seen per queue */
+static struct {
+	int ncmds, nranges, ndeac, nfused;
+	uint64_t nlb;
+} fstats[NFILLQ + 1];
+
+/* complete the commands posted to the i/o queues */
+static void *fill_controller(void *arg UNUSED)
+{
+	uint16_t sqhd[NFILLQ + 1] = {}, cqt[NFILLQ + 1] = {}, phase[NFILLQ + 1];
+	uint16_t sc = 0x0;
+
+	for (int q = 1; q <= NFILLQ; q++)
+		phase[q] = 0x1;
+
+	while (!atomic_load_acquire(&fstop)) {
+		for (int q = 1; q <= NFILLQ; q++) {
+			struct nvme_sq *sq = &fsqs[q];
+			struct nvme_cqe *cqe = fcqs[q].vaddr + (cqt[q] << NVME_CQES);
+			union nvme_cmd *sqe = sq->vaddr + (sqhd[q] << NVME_SQES);
+
+			if (sqhd[q] == atomic_load_acquire(&sq->tail))
+				continue;
+
+			fstats[q].ncmds++;
+
+			if (sqe->flags & NVME_CMD_FLAGS_FUSE_MASK)
+				fstats[q].nfused++;
+
+			if ((sqe->flags & NVME_CMD_FLAGS_FUSE_MASK) == NVME_CMD_FUSE_SECOND) {
+				void *data = (void *)le64_to_cpu(sqe->dptr.prp1);
+
+				/* aborted if the compare failed */
+				if (sc)
+					sc = NVME_SC_FUSED_FAIL;
+				else
+					memcpy(fblock, data, __VFN_PAGESIZE);
+			} else if (sqe->opcode == NVME_NVM_COMPARE) {
+				void *data = (void *)le64_to_cpu(sqe->dptr.prp1);
+
+				if (memcmp(fblock, data, __VFN_PAGESIZE))
+					sc = NVME_SC_COMPARE_FAILED;
+			} else if (sqe->opcode == NVME_NVM_DSM) {
+				struct nvme_dsm_desc *descs = (void *)le64_to_cpu(sqe->dptr.prp1);
+				int nr = (int)le32_to_cpu(sqe->cdw10) + 1;
+
+				for (int i = 0; i < nr; i++)
+					fstats[q].nlb += le32_to_cpu(descs[i].nlb);
+
+				fstats[q].nranges += nr;
+			} else {
+				fstats[q].nlb += le16_to_cpu(sqe->rw.nlb) + 1u;
+
+				if (le16_to_cpu(sqe->rw.control) & NVME_RW_CONTROL_DEAC)
+					fstats[q].ndeac++;
+			}
+
+			cqe->sqid = cpu_to_le16((uint16_t)q);
+			cqe->cid = sqe->cid;
+			atomic_store_release(&cqe->sfp,
+					     cpu_to_le16((uint16_t)(sc << 1 | phase[q])));
+
+			if ((sqe->flags & NVME_CMD_FLAGS_FUSE_MASK) != NVME_CMD_FUSE_FIRST)
+				sc = 0x0;
+
+			sqhd[q] = (uint16_t)((sqhd[q] + 1) % sq->qsize);
+
+			if (++cqt[q] == fcqs[q].qsize) {
+				cqt[q] = 0;
+				phase[q] ^= 0x1;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void test_fill(void)
+{
+	static uint32_t sqdbs[NFILLQ + 1], cqdbs[NFILLQ + 1];
+	struct nvme_ns ns = {
+		.nsid = 1, .nsze = 0x1000, .lbads = 12, .max_nlb = 32, .max_wz_nlb = 16,
+	};
+	struct nvme_rq_dsm_range ranges[] = {
+		{ .slba = 0x0, .nlb = 25 },
+		{ .slba = 0x100, .nlb = 5 },
+	};
+	struct nvme_sq *sqs[NFILLQ] = { &fsqs[1], &fsqs[2] };
+	struct nvme_future future;
+	pthread_t ctrl_thread;
+	void *cmp, *buf;
+	int nfree;
+
+	fctrl.config.nsqa = NFILLQ - 1;
+	fctrl.config.oncs = NVME_IDENTIFY_CTRL_ONCS_DSM;
+
+	for (int q = 1; q <= NFILLQ; q++) {
+		fsqs[q] = (struct nvme_sq) {
+			.id = q, .qsize = 4, .doorbell = &sqdbs[q], .cq = &fcqs[q],
+		};
+		fcqs[q] = (struct nvme_cq) {
+			.id = q, .qsize = 4, .doorbell = &cqdbs[q], .vector = -1,
+			.nsqs = NFILLQ + 1, .sqs = fsqs,
+		};
+
+		fsqs[q].rqs = znew_t(struct nvme_rq, fsqs[q].qsize - 1);
+
+		assert(pgmap(&fsqs[q].vaddr, __VFN_PAGESIZE) > 0);
+		assert(pgmap(&fcqs[q].vaddr, __VFN_PAGESIZE) > 0);
+
+		for (int i = fsqs[q].qsize - 2; i >= 0; i--) {
+			struct nvme_rq *rq = &fsqs[q].rqs[i];
+
+			rq->sq = &fsqs[q];
+			rq->cid = (uint16_t)i;
+
+			assert(pgmap(&rq->page.vaddr, __VFN_PAGESIZE) > 0);
+			rq->page.iova = (uint64_t)rq->page.vaddr;
+
+			nvme_rq_release(rq);
+		}
+	}
+
+	assert(!pthread_create(&ctrl_thread, NULL, fill_controller, NULL));
+
+	ok1(nvme_fill_async(&fctrl, &fsqs[1], &ns, NVME_FILL_VERIFY, 0x0, 8, &future) == -1 &&
+	    errno == ENOTSUP);
+	ok1(nvme_fill_async(&fctrl, &fsqs[1], &ns, NVME_FILL_WRITE_ZEROES, 0xff8, 16,
+			    &future) == -1 && errno == EINVAL);
+
+	/* more commands than trackers; split by the write zeroes size limit */
+	ok1(nvme_fill_async(&fctrl, &fsqs[1], &ns, NVME_FILL_WRITE_ZEROES_DEAC, 0x0, 100,
+			    &future) == 0);
+	ok1(nvme_future_wait(&future) == 0);
+	ok1(fstats[1].ncmds == 7 && fstats[1].nlb == 100 && fstats[1].ndeac == 7);
+
+	/* at most two ranges of at most ten blocks per command */
+	fctrl.config.dmrl = 2;
+	fctrl.config.dmrsl = 10;
+	memset(fstats, 0x0, sizeof(fstats));
+
+	ok1(nvme_deallocate_async(&fctrl, &fsqs[1], &ns, ranges, 2, &future) == 0);
+	ok1(nvme_future_wait(&future) == 0);
+	ok1(fstats[1].ncmds == 2 && fstats[1].nranges == 4 && fstats[1].nlb == 30);
+
+	/* split into parts of whole commands; 64 and 36 blocks */
+	memset(fstats, 0x0, sizeof(fstats));
+
+	ok1(nvme_fill(&fctrl, sqs, NFILLQ, &ns, NVME_FILL_WRITE_ZEROES, 0x0, 100) == 0);
+	ok1(fstats[1].ncmds == 4 && fstats[1].nlb == 64 && !fstats[1].ndeac);
+	ok1(fstats[2].ncmds == 3 && fstats[2].nlb == 36);
+
+	/* fused compare and write of block 0 */
+	assert(pgmap(&fblock, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&cmp, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&buf, __VFN_PAGESIZE) > 0);
+
+	memset(buf, 0xab, __VFN_PAGESIZE);
+	memset(fstats, 0x0, sizeof(fstats));
+
+	ok1(nvme_compare_write(&fctrl, &fsqs[1], &ns, 0x0, cmp, buf, 4096) == -1 &&
+	    errno == ENOTSUP);
+
+	fctrl.config.fuses = NVME_IDENTIFY_CTRL_FUSES_CMP_WRITE;
+	fctrl.config.acwu = 1;
+
+	ok1(nvme_compare_write(&fctrl, &fsqs[1], &ns, 0x0, cmp, buf, 8192) == -1 &&
+	    errno == EINVAL);
+
+	/* matches; written */
+	ok1(nvme_compare_write(&fctrl, &fsqs[1], &ns, 0x0, cmp, buf, 4096) == 0);
+	ok1(fstats[1].nfused == 2 && !memcmp(fblock, buf, __VFN_PAGESIZE));
+
+	/* miscompare; the write is aborted, but the compare failure is reported */
+	memset(buf, 0xcd, __VFN_PAGESIZE);
+
+	ok1(nvme_compare_write(&fctrl, &fsqs[1], &ns, 0x0, cmp, buf, 4096) == 1);
+	ok1(fstats[1].nfused == 4 && ((uint8_t *)fblock)[0] == 0xab);
+
+	/* both trackers were released */
+	nfree = 0;
+	for (struct nvme_rq *rq = __nvme_rq_top(&fsqs[1], fsqs[1].rq_top); rq; rq = rq->rq_next)
+		nfree++;
+
+	ok1(nfree == fsqs[1].qsize - 1);
+
+	atomic_store_release(&fstop, true);
+	pthread_join(ctrl_thread, NULL);
+}
+
+int main(void)
+{
+	struct nvme_ctrl ctrl = {};
+	uint32_t sqdb = 0, cqdb = 0;
+	struct nvme_sq sq = { .qsize = 8, .doorbell = &sqdb };
+	struct nvme_cq cq = {
+		.qsize = 8, .doorbell = &cqdb, .vector = -1, .nsqs = 1, .sqs = &sq,
+	};
+	union nvme_cmd cmd = { .opcode = NVME_ADMIN_IDENTIFY }, *sqes;
+	struct nvme_future future;
+	struct nvme_sq_latency lat;
+	struct nvme_cqe cqe;
+
+	plan_tests(34);
+
+	sq.cq = &cq;
+	sq.rqs = znew_t(struct nvme_rq, sq.qsize - 1);
+
+	assert(pgmap(&sq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = sq.qsize - 2; i >= 0; i--) {
+		sq.rqs[i].sq = &sq;
+		sq.rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&sq.rqs[i]);
+	}
+
+	ctrl.adminq.sq = &sq;
+	ctrl.adminq.cq = &cq;
+
+	sqes = sq.vaddr;
+
+	nvme_aer_set_handler(&ctrl, aer_cb, &naen);
+
+	/* cid 0 */
+	ok1(nvme_aer(&ctrl, NULL) == 0 && sq.tail == 1 && sqes[0].cid == NVME_CID_AER);
+
+	/* an event, a spurious completion and then the completion of cid 1 */
+	post_cqe(&cq, 0, NVME_CID_AER, 0x0, 0x10002);
+	post_cqe(&cq, 1, 5, 0x0, 0x0);
+	post_cqe(&cq, 2, 1, 0x0, 0x42);
+
+	ok1(nvme_admin(&ctrl, &cmd, NULL, 0, &cqe) == 0 && le32_to_cpu(cqe.dw0) == 0x42);
+	ok1(naen == 1 && aen == 0x10002 && !ctrl.health.stale);
+
+	/* the request was re-armed with the same tracker */
+	ok1(sqes[2].opcode == NVME_ADMIN_ASYNC_EVENT && sqes[2].cid == NVME_CID_AER);
+	ok1(sq.tail == 3 && le32_to_cpu(sqdb) == 3 && cq.head == 3 && le32_to_cpu(cqdb) == 3);
+	ok1(__nvme_rq_top(&sq, sq.rq_top) == &sq.rqs[1]);
+
+	/* nothing to reap */
+	ok1(nvme_admin_process(&ctrl) == 0);
+
+	/* without a handler, the event is dropped and the tracker released */
+	nvme_aer_set_handler(&ctrl, NULL, NULL);
+
+	/* a smart / health status event invalidates the health cache all the same */
+	post_cqe(&cq, 3, NVME_CID_AER, 0x0, 0x10001);
+
+	ok1(nvme_admin_process(&ctrl) == 0 && naen == 1 &&
+	    __nvme_rq_top(&sq, sq.rq_top) == &sq.rqs[0]);
+	ok1(ctrl.health.stale);
+
+	/* invalid field in command */
+	post_cqe(&cq, 4, 0, 0x2, 0x0);
+
+	errno = 0;
+	ok1(nvme_admin(&ctrl, &cmd, NULL, 0, NULL) == -1 && errno == EIO);
+
+	/* futures are completed by the demultiplexer as well */
+	post_cqe(&cq, 5, 0, 0x0, 0x0);
+
+	ok1(nvme_admin_async(&ctrl, &cmd, NULL, 0, &future) == 0);
+	ok1(nvme_future_wait(&future) == 0 && __nvme_rq_top(&sq, sq.rq_top) == &sq.rqs[0]);
+
+	/* completions delivered by the demultiplexer are tracked for latency */
+	ok1(nvme_sq_set_latency_tracking(&sq, true) == 0);
+
+	post_cqe(&cq, 6, 0, 0x0, 0x0);
+
+	ok1(nvme_admin(&ctrl, &cmd, NULL, 0, NULL) == 0);
+	ok1(nvme_sq_get_latency(&sq, &lat) == 0 && lat.count == 1);
+
+	nvme_sq_set_latency_tracking(&sq, false);
+
+	test_concurrent();
+	test_fill();
+
+	return exit_status();
+}
@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/view: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/userfaultfd.h>
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+struct nvme_view_slot {
+	struct nvme_view *view;
+	void *vaddr;
+	uint64_t iova;
+
+	/* page being read into the slot, and whether on a page fault */
+	size_t idx;
+	bool fault;
+
+	struct nvme_view_slot *next;
+};
+
+static inline bool __test_bit(uint64_t *map, size_t i)
+{
+	return __atomic_load_n(&map[i / 64], __ATOMIC_RELAXED) & (1ULL << (i % 64));
+}
+
+static inline void __set_bit(uint64_t *map, size_t i)
+{
+	__atomic_fetch_or(&map[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+}
+
+static inline bool __test_and_clear_bit(uint64_t *map, size_t i)
+{
+	return __atomic_fetch_and(&map[i / 64], ~(1ULL << (i % 64)), __ATOMIC_RELAXED) &
+		(1ULL << (i % 64));
+}
+
+static int __uffd_open(uint64_t features)
+{
+	struct uffdio_api api = { .api = UFFD_API, .features = features };
+	int fd;
+
+	fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+
+#ifdef UFFD_USER_MODE_ONLY
+	/* unprivileged; faults from within the kernel (e.g. write(2) from the view) fail */
+	if (fd < 0 && errno == EPERM)
+		fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+#endif
+
+	if (fd < 0) {
+		log_debug("could not create userfaultfd\n");
+		return -1;
+	}
+
+	if (ioctl(fd, UFFDIO_API, &api)) {
+		log_debug("userfaultfd api handshake failed\n");
+
+		log_fatal_if(close(fd), "close: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return fd;
+}
+
+int nvme_view_init(struct nvme_view *view, struct nvme_ctrl *ctrl, struct nvme_sq *sq,
+		   uint32_t nsid, uint64_t slba, uint64_t nlb, int depth)
+{
+	struct nvme_ns *ns = nvme_ns_get(ctrl, nsid);
+	size_t nwords;
+
+	struct uffdio_register reg = {
+		.mode = UFFDIO_REGISTER_MODE_MISSING,
+	};
+
+	if (!ns || ns->lbads > (unsigned int)__VFN_PAGESHIFT || depth <= 0 || !nlb ||
+	    slba >= ns->nsze || nlb > ns->nsze - slba ||
+	    (ctrl->config.mdts && __VFN_PAGESIZE > ctrl->config.mdts)) {
+		log_debug("invalid view (nsid %" PRIu32 " slba 0x%" PRIx64 " nlb %" PRIu64
+			  " depth %d)\n", nsid, slba, nlb, depth);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	*view = (struct nvme_view) {
+		.len = ALIGN_UP(nlb << ns->lbads, __VFN_PAGESIZE),
+		.ctrl = ctrl,
+		.ns = ns,
+		.sq = sq,
+		.slba = slba,
+		.nlb = nlb,
+		.stage_len = (size_t)depth << __VFN_PAGESHIFT,
+	};
+
+	view->npages = view->len >> __VFN_PAGESHIFT;
+
+	view->vaddr = mmap(NULL, view->len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			   -1, 0);
+	if (view->vaddr == MAP_FAILED) {
+		log_debug("could not reserve view\n");
+		return -1;
+	}
+
+#ifdef UFFD_FEATURE_POISON
+	view->uffd = __uffd_open(UFFD_FEATURE_POISON);
+	if (view->uffd >= 0)
+		view->poison = true;
+	else
+#endif
+		view->uffd = __uffd_open(0);
+
+	if (view->uffd < 0)
+		goto unmap;
+
+	reg.range.start = (uintptr_t)view->vaddr;
+	reg.range.len = view->len;
+
+	if (ioctl(view->uffd, UFFDIO_REGISTER, &reg)) {
+		log_debug("could not register view with userfaultfd\n");
+		goto close_uffd;
+	}
+
+	if (iommu_alloc_node(__iommu_ctx(ctrl), view->stage_len, ctrl->numa.node, &view->stage,
+			     &view->stage_iova)) {
+		log_debug("could not allocate staging pages\n");
+		goto close_uffd;
+	}
+
+	/* views may be large; do not abort on allocation failure */
+	nwords = (view->npages + 63) / 64;
+
+	view->resident = calloc(nwords, sizeof(uint64_t));
+	view->pending = calloc(nwords, sizeof(uint64_t));
+
+	if (!view->resident || !view->pending) {
+		log_debug("could not allocate page bitmaps\n");
+		goto free_bitmaps;
+	}
+
+	view->slots = znew_t(struct nvme_view_slot, depth);
+
+	for (int i = depth - 1; i >= 0; i--) {
+		struct nvme_view_slot *slot = &view->slots[i];
+
+		slot->view = view;
+		slot->vaddr = view->stage + ((size_t)i << __VFN_PAGESHIFT);
+		slot->iova = view->stage_iova + ((size_t)i << __VFN_PAGESHIFT);
+
+		slot->next = view->free;
+		view->free = slot;
+	}
+
+	return 0;
+
+free_bitmaps:
+	free(view->pending);
+	free(view->resident);
+
+	iommu_free(__iommu_ctx(ctrl), view->stage, view->stage_len);
+close_uffd:
+	log_fatal_if(close(view->uffd), "close: %s\n", strerror(errno));
+unmap:
+	munmap(view->vaddr, view->len);
+
+	return -1;
+}
+
+void nvme_view_fini(struct nvme_view *view)
+{
+	/* the staging pages must not be released under the feet of the controller */
+	while (view->inflight)
+		nvme_cq_process(view->sq->cq, view->sq->qsize);
+
+	log_fatal_if(close(view->uffd), "close: %s\n", strerror(errno));
+	munmap(view->vaddr, view->len);
+
+	iommu_free(__iommu_ctx(view->ctrl), view->stage, view->stage_len);
+
+	free(view->slots);
+	free(view->pending);
+	free(view->resident);
+
+	memset(view, 0x0, sizeof(*view));
+}
+
+static inline uint64_t __page_addr(struct nvme_view *view, size_t idx)
+{
+	return (uintptr_t)view->vaddr + (idx << __VFN_PAGESHIFT);
+}
+
+static int __install(struct nvme_view *view, struct nvme_view_slot *slot)
+{
+	struct uffdio_copy copy = {
+		.dst = __page_addr(view, slot->idx),
+		.src = (uintptr_t)slot->vaddr,
+		.len = __VFN_PAGESIZE,
+	};
+	int ret;
+
+	/* the address space is changing; try again */
+	do {
+		ret = ioctl(view->uffd, UFFDIO_COPY, &copy);
+	} while (ret && errno == EAGAIN);
+
+	/* a prefetched page may still be resident (evicted pages are read again) */
+	if (ret && errno != EEXIST) {
+		log_debug("could not install page %zu\n", slot->idx);
+		return -1;
+	}
+
+	__set_bit(view->resident, slot->idx);
+
+	return 0;
+}
+
+static void __wake(struct nvme_view *view, size_t idx)
+{
+	struct uffdio_range range = {
+		.start = __page_addr(view, idx),
+		.len = __VFN_PAGESIZE,
+	};
+
+	if (ioctl(view->uffd, UFFDIO_WAKE, &range))
+		log_debug("could not wake up threads faulting on page %zu\n", idx);
+}
+
+/* resolve the fault on a page that could not be read */
+static void __fail(struct nvme_view *view, size_t idx)
+{
+	struct uffdio_range range = {
+		.start = __page_addr(view, idx),
+		.len = __VFN_PAGESIZE,
+	};
+	struct uffdio_zeropage zero = { .range = range };
+
+	view->errors++;
+
+#ifdef UFFDIO_POISON
+	if (view->poison) {
+		struct uffdio_poison poison = { .range = range };
+
+		if (!ioctl(view->uffd, UFFDIO_POISON, &poison) || errno == EEXIST)
+			return;
+	}
+#endif
+
+	if (ioctl(view->uffd, UFFDIO_ZEROPAGE, &zero) && errno != EEXIST)
+		log_debug("could not resolve fault on page %zu\n", idx);
+}
+
+static void __view_complete(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *arg)
+{
+	struct nvme_view_slot *slot = arg;
+	struct nvme_view *view = slot->view;
+	bool installed = false;
+
+	view->inflight--;
+
+	__test_and_clear_bit(view->pending, slot->idx);
+
+	/* installing the page (or failing it) wakes up the faulting threads */
+	if (nvme_cqe_ok(cqe))
+		installed = !__install(view, slot);
+	else
+		log_debug("read of page %zu failed (sfp 0x%" PRIx16 ")\n", slot->idx,
+			  le16_to_cpu(cqe->sfp));
+
+	/* threads that faulted on a prefetched page fault again and read it themselves */
+	if (!installed) {
+		if (slot->fault)
+			__fail(view, slot->idx);
+		else
+			__wake(view, slot->idx);
+	}
+
+	slot->next = view->free;
+	view->free = slot;
+}
+
+/* submit the read of page @idx; the caller checked for a free slot and tracker */
+static int __read_page(struct nvme_view *view, size_t idx, bool fault)
+{
+	struct nvme_view_slot *slot = view->free;
+	uint64_t slba, nlb;
+	union nvme_cmd cmd;
+	struct nvme_rq *rq;
+	size_t len;
+
+	slba = view->slba + ((uint64_t)idx << (__VFN_PAGESHIFT - (int)view->ns->lbads));
+	nlb = min_t(uint64_t, __VFN_PAGESIZE >> view->ns->lbads, view->slba + view->nlb - slba);
+	len = (size_t)nlb << view->ns->lbads;
+
+	rq = nvme_rq_acquire(view->sq);
+	if (!rq)
+		return -1;
+
+	if (nvme_ns_prep_rw(view->ns, &cmd, NVME_NVM_READ, slba, len) ||
+	    nvme_rq_map_prp(view->ctrl, rq, &cmd, slot->iova, len)) {
+		nvme_rq_release(rq);
+		return -1;
+	}
+
+	/* the tail of the last page is beyond the view */
+	if (len < __VFN_PAGESIZE)
+		memset(slot->vaddr + len, 0x0, __VFN_PAGESIZE - len);
+
+	view->free = slot->next;
+	slot->idx = idx;
+	slot->fault = fault;
+
+	__set_bit(view->pending, idx);
+
+	nvme_rq_submit(rq, &cmd, __view_complete, slot);
+	view->inflight++;
+
+	return 0;
+}
+
+static inline bool __can_read(struct nvme_view *view)
+{
+	return view->free && __nvme_rq_top(view->sq, view->sq->rq_top);
+}
+
+int nvme_view_serve(struct nvme_view *view, int budget)
+{
+	struct uffd_msg msg;
+	int taken = 0;
+
+	nvme_cq_process(view->sq->cq, view->sq->qsize);
+
+	while (taken < budget && __can_read(view)) {
+		ssize_t ret;
+		size_t idx;
+
+		ret = read(view->uffd, &msg, sizeof(msg));
+		if (ret < 0 && errno == EAGAIN)
+			break;
+
+		if (ret != sizeof(msg)) {
+			log_debug("could not read userfaultfd\n");
+
+			if (ret >= 0)
+				errno = EIO;
+
+			goto error;
+		}
+
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		idx = (size_t)(msg.arg.pagefault.address - (uintptr_t)view->vaddr) >>
+			__VFN_PAGESHIFT;
+
+		taken++;
+
+		/* being read already; installing the page wakes up all faulting threads */
+		if (__test_bit(view->pending, idx))
+			continue;
+
+		/* installed after the fault was queued, or being evicted; fault again */
+		if (__test_bit(view->resident, idx)) {
+			__wake(view, idx);
+			continue;
+		}
+
+		view->faults++;
+
+		/* the faulting thread must not be left waiting */
+		if (__read_page(view, idx, true)) {
+			log_debug("could not submit read of page %zu\n", idx);
+
+			__fail(view, idx);
+		}
+	}
+
+	nvme_sq_update_tail(view->sq);
+
+	return taken;
+
+error:
+	nvme_sq_update_tail(view->sq);
+
+	return -1;
+}
+
+static int __range(struct nvme_view *view, size_t offset, size_t len, size_t *first, size_t *end)
+{
+	if (!len || offset >= view->len || len > view->len - offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*first = offset >> __VFN_PAGESHIFT;
+	*end = ALIGN_UP(offset + len, __VFN_PAGESIZE) >> __VFN_PAGESHIFT;
+
+	return 0;
+}
+
+int nvme_view_prefetch(struct nvme_view *view, size_t offset, size_t len)
+{
+	size_t first, end;
+	int n = 0;
+
+	if (__range(view, offset, len, &first, &end))
+		return -1;
+
+	for (size_t idx = first; idx < end && __can_read(view); idx++) {
+		if (__test_bit(view->resident, idx) || __test_bit(view->pending, idx))
+			continue;
+
+		/* only a hint; try the rest another time */
+		if (__read_page(view, idx, false))
+			break;
+
+		n++;
+	}
+
+	view->prefetched += (uint64_t)n;
+
+	nvme_sq_update_tail(view->sq);
+
+	return n;
+}
+
+int nvme_view_evict(struct nvme_view *view, size_t offset, size_t len)
+{
+	size_t first, end;
+	uint64_t n = 0;
+
+	if (__range(view, offset, len, &first, &end))
+		return -1;
+
+	/*
+	 * Drop the pages before marking them non-resident, such that a page
+	 * marked resident is mapped unless an eviction is in progress.
+	 */
+	if (madvise((void *)__page_addr(view, first), (end - first) << __VFN_PAGESHIFT,
+		    MADV_DONTNEED)) {
+		log_debug("could not drop pages\n");
+		return -1;
+	}
+
+	for (size_t idx = first; idx < end; idx++) {
+		if (__test_and_clear_bit(view->resident, idx))
+			n++;
+	}
+
+	__atomic_fetch_add(&view->evicted, n, __ATOMIC_RELAXED);
+
+	return 0;
+}
@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+
+#include "ccan/tap/tap.h"
+
+#include "view.c"
+
+bool iommu_translate_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr, uint64_t *iova)
+{
+	*iova = (uint64_t)vaddr;
+
+	return true;
+}
+
+int iommu_map_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t len UNUSED,
+		    uint64_t *iova UNUSED, unsigned long flags UNUSED)
+{
+	return 0;
+}
+
+int iommu_unmap_vaddr(struct iommu_ctx *ctx UNUSED, void *vaddr UNUSED, size_t *len UNUSED)
+{
+	return 0;
+}
+
+int iommu_alloc_node(struct iommu_ctx *ctx UNUSED, size_t len, int node UNUSED, void **vaddr,
+		     uint64_t *iova)
+{
+	if (pgmap(vaddr, len) < 0)
+		return -1;
+
+	*iova = (uint64_t)*vaddr;
+
+	return 0;
+}
+
+void iommu_free(struct iommu_ctx *ctx UNUSED, void *vaddr, size_t len)
+{
+	pgunmap(vaddr, len);
+}
+
+#define NTESTS 10
+
+#define SQSIZE 8
+#define CQSIZE 64
+#define DEPTH 4
+
+static uint32_t doorbells[2];
+static struct nvme_sq sqs[2];
+static struct nvme_cq cq;
+static struct nvme_rq rqs[SQSIZE - 1];
+static uint16_t cqtail;
+
+static struct nvme_view view;
+
+/* complete the read of page @idx, filling the staging page with @fill */
+static void complete(size_t idx, uint8_t fill, uint16_t status)
+{
+	struct nvme_cqe *cqe = cq.vaddr + (cqtail++ << NVME_CQES);
+
+	for (int i = 0; i < SQSIZE - 1; i++) {
+		struct nvme_rq *rq = &rqs[i];
+		struct nvme_view_slot *slot = rq->cb_arg;
+
+		if (!rq->cb || slot->idx != idx)
+			continue;
+
+		/* the device only writes the logical blocks in the view */
+		memset(slot->vaddr, fill, min_t(size_t, __VFN_PAGESIZE,
+						(view.nlb << 9) - (idx << __VFN_PAGESHIFT)));
+
+		cqe->sqid = cpu_to_le16(1);
+		cqe->cid = rq->cid;
+		cqe->sfp = cpu_to_le16((uint16_t)(status << 1 | 0x1));
+
+		return;
+	}
+
+	assert(false);
+}
+
+static union nvme_cmd *last_cmd(void)
+{
+	return sqs[1].vaddr + (((sqs[1].tail + SQSIZE - 1) % SQSIZE) << NVME_SQES);
+}
+
+static void *toucher(void *opaque)
+{
+	size_t idx = (uintptr_t)opaque;
+
+	return (void *)(uintptr_t)*(volatile uint8_t *)(view.vaddr + (idx << __VFN_PAGESHIFT));
+}
+
+/* serve until a thread faulting on a page has been taken */
+static int serve_fault(void)
+{
+	int n;
+
+	while (!(n = nvme_view_serve(&view, 8)))
+		;
+
+	return n;
+}
+
+int main(void)
+{
+	struct nvme_ns ns = { .nsid = 1, .nsze = 64, .lbads = 9, .max_nlb = 256 };
+	struct nvme_ctrl ctrl = { .ns = &ns, .nns = 1 };
+	uint64_t lbas = __VFN_PAGESIZE >> 9;
+	pthread_t thread;
+	void *ret;
+
+	plan_tests(NTESTS);
+
+	cq = (struct nvme_cq) {
+		.qsize = CQSIZE,
+		.doorbell = &doorbells[0],
+		.nsqs = 2,
+		.sqs = sqs,
+	};
+
+	sqs[1] = (struct nvme_sq) {
+		.id = 1,
+		.qsize = SQSIZE,
+		.doorbell = &doorbells[1],
+		.cq = &cq,
+		.rqs = rqs,
+	};
+	sqs[1].rq_top = __nvme_rq_top_set(&sqs[1], 0, &rqs[SQSIZE - 2]);
+
+	assert(pgmap(&cq.vaddr, __VFN_PAGESIZE) > 0);
+	assert(pgmap(&sqs[1].vaddr, __VFN_PAGESIZE) > 0);
+
+	for (int i = 0; i < SQSIZE - 1; i++) {
+		rqs[i].sq = &sqs[1];
+		rqs[i].cid = (uint16_t)i;
+
+		if (i > 0)
+			rqs[i].rq_next = &rqs[i - 1];
+	}
+
+	ok1(nvme_view_init(&view, &ctrl, &sqs[1], 1, 60, 8, DEPTH) == -1 && errno == EINVAL);
+
+	/* four full pages and a short one */
+	if (nvme_view_init(&view, &ctrl, &sqs[1], 1, 8, 4 * lbas + 2, DEPTH)) {
+		skip(NTESTS - 1, "userfaultfd not available (%s)", strerror(errno));
+
+		return exit_status();
+	}
+
+	ok1(view.len == 5 * __VFN_PAGESIZE && view.npages == 5);
+
+	/* a touch faults the page in; the faulting thread waits for the read */
+	assert(pthread_create(&thread, NULL, toucher, (void *)1) == 0);
+
+	ok1(serve_fault() == 1 && view.faults == 1 && view.inflight == 1 &&
+	    le64_to_cpu(last_cmd()->rw.slba) == 8 + lbas);
+
+	complete(1, 0xab, 0);
+
+	assert(nvme_view_serve(&view, 8) == 0);
+	pthread_join(thread, &ret);
+
+	ok1((uintptr_t)ret == 0xab && __test_bit(view.resident, 1) && view.free);
+
+	/* read ahead, including the short page at the end */
+	ok1(nvme_view_prefetch(&view, 2 * __VFN_PAGESIZE, 3 * __VFN_PAGESIZE) == 3 &&
+	    le16_to_cpu(last_cmd()->rw.nlb) == 1 && view.prefetched == 3);
+
+	complete(2, 0x02, 0);
+	complete(3, 0x03, 0);
+	complete(4, 0x04, 0);
+
+	assert(nvme_view_serve(&view, 8) == 0);
+
+	/* resident pages do not fault */
+	ok1(*(uint8_t *)(view.vaddr + 3 * __VFN_PAGESIZE) == 0x03 &&
+	    *(uint8_t *)(view.vaddr + 4 * __VFN_PAGESIZE + 1023) == 0x04 &&
+	    *(uint8_t *)(view.vaddr + 4 * __VFN_PAGESIZE + 1024) == 0x0 &&
+	    view.faults == 1);
+
+	ok1(nvme_view_prefetch(&view, 0, 5 * __VFN_PAGESIZE + 1) == -1 && errno == EINVAL);
+
+	/* evicted pages are read again */
+	ok1(nvme_view_evict(&view, __VFN_PAGESIZE, 1) == 0 && view.evicted == 1 &&
+	    !__test_bit(view.resident, 1));
+
+	/* a failed read on a page fault does not leave the faulting thread waiting */
+	if (view.poison) {
+		skip(1, "failed page would be poisoned");
+	} else {
+		assert(pthread_create(&thread, NULL, toucher, (void *)1) == 0);
+
+		serve_fault();
+		complete(1, 0xab, NVME_SC_INVALID_FIELD);
+
+		assert(nvme_view_serve(&view, 8) == 0);
+		pthread_join(thread, &ret);
+
+		ok1((uintptr_t)ret == 0x0 && view.faults == 2 && view.errors == 1 &&
+		    !__test_bit(view.resident, 1));
+	}
+
+	/* a failed prefetch is dropped */
+	assert(nvme_view_prefetch(&view, 0, 1) == 1);
+
+	complete(0, 0xff, NVME_SC_INVALID_FIELD);
+	assert(nvme_view_serve(&view, 8) == 0);
+
+	ok1(!__test_bit(view.resident, 0) && !__test_bit(view.pending, 0) &&
+	    view.inflight == 0 && view.errors == (view.poison ? 0 : 1));
+
+	nvme_view_fini(&view);
+
+	return exit_status();
+}
@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#define log_fmt(fmt) "nvme/zns: " fmt
+
+#include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include <linux/vfio.h>
+
+#include <vfn/support.h>
+#include <vfn/iommu.h>
+#include <vfn/vfio.h>
+#include <vfn/nvme.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "types.h"
+
+static int nvme_zns_identify(struct nvme_ctrl *ctrl, struct nvme_zns *zns, void *id)
+{
+	struct nvme_ns *ns = zns->ns;
+	union nvme_cmd cmd;
+	uint64_t cap, mpsmin;
+	uint8_t flbas, lbaf;
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.nsid = cpu_to_le32(ns->nsid),
+		.cns = NVME_IDENTIFY_CNS_NS,
+	};
+
+	if (nvme_admin(ctrl, &cmd, id, NVME_IDENTIFY_DATA_SIZE, NULL))
+		return -1;
+
+	flbas = *(uint8_t *)(id + NVME_IDENTIFY_NS_FLBAS);
+	lbaf = (uint8_t)(NVME_FIELD_GET(flbas, ID_NS_FLBAS_LO) |
+			 NVME_FIELD_GET(flbas, ID_NS_FLBAS_HI) << 4);
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.nsid = cpu_to_le32(ns->nsid),
+		.cns = NVME_IDENTIFY_CNS_CS_NS,
+		.csi = NVME_CSI_ZNS,
+	};
+
+	if (nvme_admin(ctrl, &cmd, id, NVME_IDENTIFY_DATA_SIZE, NULL)) {
+		log_debug("nsid %" PRIu32 " is not a zoned namespace\n", ns->nsid);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* zeroes based; 0xffffffff (no limit) wraps to 0 */
+	zns->mar = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_NS_ZNS_MAR)) + 1;
+	zns->mor = le32_to_cpu(*(leint32_t *)(id + NVME_IDENTIFY_NS_ZNS_MOR)) + 1;
+	zns->zsze = le64_to_cpu(*(leint64_t *)(id + NVME_IDENTIFY_NS_ZNS_LBAFE +
+					       NVME_ZNS_LBAFE_SIZE * lbaf));
+
+	if (!zns->zsze) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	zns->nzones = (uint32_t)(ns->nsze / zns->zsze);
+	zns->max_append_nlb = ns->max_nlb;
+
+	cmd.identify = (struct nvme_cmd_identify) {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.cns = NVME_IDENTIFY_CNS_CS_CTRL,
+		.csi = NVME_CSI_ZNS,
+	};
+
+	if (nvme_admin(ctrl, &cmd, id, NVME_IDENTIFY_DATA_SIZE, NULL))
+		return -1;
+
+	cap = ctrl->reg.cap;
+	mpsmin = __mps_to_pagesize(NVME_FIELD_GET(cap, CAP_MPSMIN));
+
+	/* the zone append size limit is in units of the minimum memory page size */
+	if (*(uint8_t *)(id + NVME_IDENTIFY_CTRL_ZNS_ZASL)) {
+		uint64_t zasl = mpsmin << *(uint8_t *)(id + NVME_IDENTIFY_CTRL_ZNS_ZASL);
+
+		zns->max_append_nlb = (uint32_t)min_t(uint64_t, zns->max_append_nlb,
+						      zasl >> ns->lbads);
+	}
+
+	return 0;
+}
+
+int nvme_zns_init(struct nvme_ctrl *ctrl, struct nvme_sq *sq, uint32_t nsid,
+		  struct nvme_zns *zns)
+{
+	ssize_t len;
+	void *id;
+	int ret;
+
+	memset(zns, 0x0, sizeof(*zns));
+
+	zns->ns = nvme_ns_get(ctrl, nsid);
+	if (!zns->ns) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = pgmap(&id, NVME_IDENTIFY_DATA_SIZE);
+	if (len < 0)
+		return -1;
+
+	ret = nvme_zns_identify(ctrl, zns, id);
+
+	pgunmap(id, (size_t)len);
+
+	if (ret)
+		return -1;
+
+	zns->zones = znew_t(struct nvme_zone, zns->nzones);
+
+	if (nvme_zns_report(ctrl, sq, zns, 0, zns->nzones)) {
+		log_debug("could not report zones\n");
+
+		nvme_zns_close(zns);
+		return -1;
+	}
+
+	return 0;
+}
+
+void nvme_zns_close(struct nvme_zns *zns)
+{
+	free(zns->zones);
+
+	memset(zns, 0x0, sizeof(*zns));
+}
+
+static void nvme_zns_parse_zone(struct nvme_zns *zns, struct nvme_zone *zone, void *desc)
+{
+	zone->state = *(uint8_t *)(desc + NVME_ZNS_ZONE_DESC_ZS) >> 4;
+	zone->attrs = *(uint8_t *)(desc + NVME_ZNS_ZONE_DESC_ZA);
+	zone->zcap = (uint32_t)le64_to_cpu(*(leint64_t *)(desc + NVME_ZNS_ZONE_DESC_ZCAP));
+	zone->wp = le64_to_cpu(*(leint64_t *)(desc + NVME_ZNS_ZONE_DESC_WP));
+
+	/* the write pointer is not valid for full, read only and offline zones */
+	if (zone->state >= NVME_ZONE_STATE_READ_ONLY)
+		zone->wp = nvme_zns_zslba(zns, zone) + zone->zcap;
+}
+
+static inline void nvme_zns_set_slba(union nvme_cmd *cmd, uint64_t slba)
+{
+	cmd->cdw10 = cpu_to_le32((uint32_t)slba);
+	cmd->cdw11 = cpu_to_le32((uint32_t)(slba >> 32));
+}
+
+int nvme_zns_report(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_zns *zns,
+		    uint64_t slba, uint32_t nzones)
+{
+	uint64_t idx = slba / zns->zsze;
+	size_t len = NVME_BOUNCE_SLOT_SIZE;
+	union nvme_cmd cmd;
+	ssize_t maplen;
+	void *buf;
+	int ret = 0;
+
+	if (idx >= zns->nzones) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nzones = min_t(uint32_t, nzones, (uint32_t)(zns->nzones - idx));
+
+	/* small enough to go through the bounce buffers of nvme_sync() */
+	if (ctrl->config.mdts)
+		len = min_t(size_t, len, ctrl->config.mdts);
+
+	maplen = pgmap(&buf, len);
+	if (maplen < 0)
+		return -1;
+
+	while (nzones) {
+		uint64_t n;
+
+		memset(&cmd, 0x0, sizeof(cmd));
+
+		cmd.opcode = NVME_ZNS_ZONE_MGMT_RECV;
+		cmd.nsid = cpu_to_le32(zns->ns->nsid);
+		cmd.cdw12 = cpu_to_le32((uint32_t)(len >> 2) - 1);
+		cmd.cdw13 = cpu_to_le32(NVME_ZNS_ZRA_REPORT | NVME_ZNS_ZRA_PARTIAL);
+
+		nvme_zns_set_slba(&cmd, idx * zns->zsze);
+
+		if (nvme_sync(ctrl, sq, &cmd, buf, len, NULL)) {
+			ret = -1;
+			break;
+		}
+
+		/* with partial reporting, this is the number of descriptors returned */
+		n = le64_to_cpu(*(leint64_t *)buf);
+		n = min_t(uint64_t, n, len / NVME_ZNS_ZONE_DESC_SIZE - 1);
+		if (!n)
+			break;
+
+		for (uint64_t i = 0; i < n && nzones; i++, nzones--) {
+			void *desc = buf + (i + 1) * NVME_ZNS_ZONE_DESC_SIZE;
+			uint64_t zslba;
+
+			zslba = le64_to_cpu(*(leint64_t *)(desc + NVME_ZNS_ZONE_DESC_ZSLBA));
+
+			idx = zslba / zns->zsze;
+			if (idx >= zns->nzones) {
+				nzones = 0;
+				break;
+			}
+
+			nvme_zns_parse_zone(zns, &zns->zones[idx++], desc);
+		}
+
+		if (idx >= zns->nzones)
+			break;
+	}
+
+	pgunmap(buf, (size_t)maplen);
+
+	return ret;
+}
+
+int nvme_zns_mgmt_send(struct nvme_ctrl *ctrl, struct nvme_sq *sq, struct nvme_zns *zns,
+		       uint64_t zslba, enum nvme_zone_action action, bool all)
+{
+	struct nvme_zone *zone = NULL;
+	union nvme_cmd cmd = {
+		.opcode = NVME_ZNS_ZONE_MGMT_SEND,
+		.nsid = cpu_to_le32(zns->ns->nsid),
+		.cdw13 = cpu_to_le32(action | (all ? NVME_ZNS_ZSA_SELECT_ALL : 0)),
+	};
+
+	if (!all) {
+		zone = nvme_zns_zone(zns, zslba);
+		if (!zone || zslba % zns->zsze) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		nvme_zns_set_slba(&cmd, zslba);
+	}
+
+	if (nvme_sync(ctrl, sq, &cmd, NULL, 0, NULL))
+		return -1;
+
+	if (all)
+		return nvme_zns_report(ctrl, sq, zns, 0, zns->nzones);
+
+	switch (action) {
+	case NVME_ZONE_ACTION_CLOSE:
+		zone->state = NVME_ZONE_STATE_CLOSED;
+		break;
+
+	case NVME_ZONE_ACTION_FINISH:
+		zone->state = NVME_ZONE_STATE_FULL;
+		zone->wp = zslba + zone->zcap;
+		break;
+
+	case NVME_ZONE_ACTION_OPEN:
+		zone->state = NVME_ZONE_STATE_EXPLICITLY_OPEN;
+		break;
+
+	case NVME_ZONE_ACTION_RESET:
+		zone->state = NVME_ZONE_STATE_EMPTY;
+		zone->wp = zslba;
+		break;
+
+	case NVME_ZONE_ACTION_OFFLINE:
+		zone->state = NVME_ZONE_STATE_OFFLINE;
+		break;
+	}
+
+	return 0;
+}
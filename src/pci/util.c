@@ -13,6 +13,8 @@
 #include <byteswap.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -27,12 +29,27 @@
 #include <linux/limits.h>
 
 #include <vfn/support/atomic.h>
+#include <vfn/support/autoptr.h>
 #include <vfn/support/compiler.h>
 #include <vfn/support/log.h>
 #include <vfn/support/io.h>
 #include <vfn/support/mem.h>
+#include <vfn/support/mutex.h>
 #include <vfn/pci/util.h>
 
+static const char *pci_sysfs_devices = "/sys/bus/pci/devices";
+
+static struct {
+	pthread_mutex_t lock;
+
+	/* sorted by bdf; ndevs is -1 if the table must be (re)built */
+	struct pci_device_info *devs;
+	int ndevs;
+} pci_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ndevs = -1,
+};
+
 int pci_unbind(const char *bdf)
 {
 	char *path = NULL;
@@ -50,6 +67,8 @@ int pci_unbind(const char *bdf)
 
 	ret = writeall(path, bdf, strlen(bdf));
 
+	pci_device_cache_invalidate();
+
 out:
 	free(path);
 
@@ -68,6 +87,8 @@ int pci_bind(const char *bdf, const char *driver)
 
 	ret = writeall(path, bdf, strlen(bdf));
 
+	pci_device_cache_invalidate();
+
 	free(path);
 
 	return ret < 0 ? -1 : 0;
@@ -123,6 +144,38 @@ int pci_driver_remove_id(const char *driver, uint16_t vid, uint16_t did)
 	return ret < 0 ? -1 : 0;
 }
 
+int pci_driver_override(const char *bdf, const char *driver)
+{
+	char *path = NULL;
+	ssize_t ret;
+
+	if (asprintf(&path, "/sys/bus/pci/devices/%s/driver_override", bdf) < 0) {
+		log_debug("asprintf failed\n");
+		return -1;
+	}
+
+	/* a newline clears the override */
+	if (driver)
+		ret = writeall(path, driver, strlen(driver));
+	else
+		ret = writeall(path, "\n", 1);
+
+	free(path);
+
+	return ret < 0 ? -1 : 0;
+}
+
+int pci_probe(const char *bdf)
+{
+	ssize_t ret;
+
+	ret = writeall("/sys/bus/pci/drivers_probe", bdf, strlen(bdf));
+
+	pci_device_cache_invalidate();
+
+	return ret < 0 ? -1 : 0;
+}
+
 int pci_device_info_get_ull(const char *bdf, const char *prop, unsigned long long *v)
 {
 	char buf[32], *endptr, *path = NULL;
@@ -150,6 +203,90 @@ out:
 	return errno ? -1 : 0;
 }
 
+static int __parse_cpulist(const char *list, int **cpus)
+{
+	const char *p = list;
+	int n = 0, max = 0;
+	int *v = NULL;
+
+	while (*p && *p != '\n') {
+		unsigned long first, last;
+		char *endptr;
+
+		errno = 0;
+		first = last = strtoul(p, &endptr, 10);
+		if (errno || endptr == p)
+			goto invalid;
+
+		p = endptr;
+
+		if (*p == '-') {
+			last = strtoul(++p, &endptr, 10);
+			if (errno || endptr == p || last < first)
+				goto invalid;
+
+			p = endptr;
+		}
+
+		for (unsigned long cpu = first; cpu <= last; cpu++) {
+			if (n == max) {
+				max = max ? max * 2 : 16;
+				v = reallocn(v, (unsigned int)max, sizeof(int));
+			}
+
+			v[n++] = (int)cpu;
+		}
+
+		if (*p == ',')
+			p++;
+	}
+
+	*cpus = v;
+
+	return n;
+
+invalid:
+	free(v);
+
+	errno = EINVAL;
+	return -1;
+}
+
+int pci_device_get_local_cpus(const char *bdf, int **cpus)
+{
+	__autofree char *path = NULL;
+	char buf[1024];
+	ssize_t ret;
+
+	if (asprintf(&path, "/sys/bus/pci/devices/%s/local_cpulist", bdf) < 0) {
+		log_debug("asprintf failed\n");
+		return -1;
+	}
+
+	ret = readmax(path, buf, sizeof(buf) - 1);
+	if (ret < 0)
+		return -1;
+
+	buf[ret] = '\0';
+
+	return __parse_cpulist(buf, cpus);
+}
+
+int pci_device_get_numa_node(const char *bdf)
+{
+	struct pci_device_info info;
+	unsigned long long v;
+
+	if (!pci_device_lookup(bdf, &info))
+		return info.numa_node;
+
+	if (pci_device_info_get_ull(bdf, "numa_node", &v))
+		return -1;
+
+	/* the kernel reports -1 if the device is not associated with a node */
+	return (int)(long long)v;
+}
+
 char *pci_get_driver(const char *bdf)
 {
 	char *p, *link = NULL, *driver = NULL, *name = NULL;
@@ -196,8 +333,16 @@ out:
 char *pci_get_iommu_group(const char *bdf)
 {
 	char *p, *link = NULL, *group = NULL, *path = NULL;
+	struct pci_device_info info;
 	ssize_t ret;
 
+	if (!pci_device_lookup(bdf, &info) && info.iommu_group >= 0) {
+		if (asprintf(&path, "/dev/vfio/%d", info.iommu_group) < 0)
+			return NULL;
+
+		return path;
+	}
+
 	if (asprintf(&link, "/sys/bus/pci/devices/%s/iommu_group", bdf) < 0) {
 		log_debug("asprintf failed\n");
 		goto out;
@@ -280,3 +425,374 @@ out:
 
 	return vfio_id;
 }
+
+static int __read_ullat(int dfd, const char *name, unsigned long long *v)
+{
+	char buf[32], *endptr;
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	ret = readmaxfd(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (ret < 0)
+		return -1;
+
+	buf[ret] = '\0';
+
+	errno = 0;
+	*v = strtoull(buf, &endptr, 0);
+	if (endptr == buf)
+		errno = EINVAL;
+
+	return errno ? -1 : 0;
+}
+
+/* read the last path component of the symlink @name */
+static int __read_link_baseat(int dfd, const char *name, char *base, size_t len)
+{
+	char target[PATH_MAX], *p;
+	ssize_t ret;
+
+	ret = readlinkat(dfd, name, target, sizeof(target) - 1);
+	if (ret < 0)
+		return -1;
+
+	target[ret] = '\0';
+
+	p = strrchr(target, '/');
+
+	if (snprintf(base, len, "%s", p ? p + 1 : target) >= (int)len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the information of the device @name in the directory @dfd. Returns 1 if
+ * the class code does not match.
+ */
+static int __scan_device(int dfd, const char *name, uint32_t classcode, uint32_t mask,
+			 struct pci_device_info *info)
+{
+	unsigned long long v;
+	char group[16];
+	int ddfd, ret = -1;
+
+	ddfd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ddfd < 0)
+		return -1;
+
+	memset(info, 0x0, sizeof(*info));
+
+	if (__read_ullat(ddfd, "class", &v))
+		goto out;
+
+	info->classcode = (uint32_t)v;
+
+	if ((info->classcode & mask) != (classcode & mask)) {
+		ret = 1;
+		goto out;
+	}
+
+	if (snprintf(info->bdf, sizeof(info->bdf), "%s", name) >= (int)sizeof(info->bdf))
+		goto out;
+
+	if (__read_ullat(ddfd, "vendor", &v))
+		goto out;
+
+	info->vendor = (uint16_t)v;
+
+	if (__read_ullat(ddfd, "device", &v))
+		goto out;
+
+	info->device = (uint16_t)v;
+
+	/* the kernel reports -1 if the device is not associated with a node */
+	info->numa_node = __read_ullat(ddfd, "numa_node", &v) ? -1 : (int)(long long)v;
+
+	info->iommu_group = -1;
+	if (!__read_link_baseat(ddfd, "iommu_group", group, sizeof(group)))
+		info->iommu_group = atoi(group);
+
+	if (__read_link_baseat(ddfd, "driver", info->driver, sizeof(info->driver)))
+		info->driver[0] = '\0';
+
+	ret = 0;
+
+out:
+	close(ddfd);
+
+	return ret;
+}
+
+static int __info_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct pci_device_info *)a)->bdf,
+		      ((const struct pci_device_info *)b)->bdf);
+}
+
+int pci_scan(uint32_t classcode, uint32_t mask, struct pci_device_info **devs)
+{
+	struct pci_device_info *v = NULL;
+	struct dirent *dentry;
+	int n = 0, max = 0;
+	DIR *dp;
+
+	dp = opendir(pci_sysfs_devices);
+	if (!dp) {
+		log_debug("could not open %s\n", pci_sysfs_devices);
+		return -1;
+	}
+
+	while ((dentry = readdir(dp))) {
+		struct pci_device_info info;
+
+		if (dentry->d_name[0] == '.')
+			continue;
+
+		/* skip devices that went away or cannot be read */
+		if (__scan_device(dirfd(dp), dentry->d_name, classcode, mask, &info))
+			continue;
+
+		if (n == max) {
+			struct pci_device_info *tmp;
+
+			max = max ? max * 2 : 16;
+
+			tmp = reallocn(v, (unsigned int)max, sizeof(*v));
+			if (!tmp) {
+				free(v);
+				log_fatal_if(closedir(dp), "closedir");
+
+				errno = ENOMEM;
+				return -1;
+			}
+
+			v = tmp;
+		}
+
+		v[n++] = info;
+	}
+
+	log_fatal_if(closedir(dp), "closedir");
+
+	if (n)
+		qsort(v, (size_t)n, sizeof(*v), __info_cmp);
+
+	*devs = v;
+
+	return n;
+}
+
+int pci_device_lookup(const char *bdf, struct pci_device_info *info)
+{
+	struct pci_device_info key = {}, *dev;
+
+	__autolock(&pci_cache.lock);
+
+	if (pci_cache.ndevs < 0) {
+		int n = pci_scan(PCI_CLASS_NVME, PCI_CLASS_NVME_MASK, &pci_cache.devs);
+
+		if (n < 0)
+			return -1;
+
+		pci_cache.ndevs = n;
+	}
+
+	if (snprintf(key.bdf, sizeof(key.bdf), "%s", bdf) >= (int)sizeof(key.bdf))
+		goto nodev;
+
+	dev = bsearch(&key, pci_cache.devs, (size_t)pci_cache.ndevs, sizeof(key), __info_cmp);
+	if (!dev)
+		goto nodev;
+
+	*info = *dev;
+
+	return 0;
+
+nodev:
+	errno = ENODEV;
+	return -1;
+}
+
+void pci_device_cache_invalidate(void)
+{
+	__autolock(&pci_cache.lock);
+
+	free(pci_cache.devs);
+
+	pci_cache.devs = NULL;
+	pci_cache.ndevs = -1;
+}
+
+/* read a sysfs property of the device as a string */
+static int __read_attr(const char *bdf, const char *name, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t ret;
+
+	if (snprintf(path, sizeof(path), "%s/%s/%s", pci_sysfs_devices, bdf, name) >=
+	    (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	ret = readmax(path, buf, len - 1);
+	if (ret < 0)
+		return -1;
+
+	buf[ret] = '\0';
+
+	return 0;
+}
+
+/* link speeds are reported as e.g. "8.0 GT/s PCIe" or "Unknown" */
+static unsigned int __parse_link_speed(const char *s)
+{
+	unsigned int gts, frac = 0;
+
+	if (sscanf(s, "%u.%1u", &gts, &frac) < 1)
+		return 0;
+
+	return gts * 1000 + frac * 100;
+}
+
+int pci_device_get_link_info(const char *bdf, struct pci_link_info *info)
+{
+	char max_speed[32], speed[32], max_width[16], width[16];
+
+	if (__read_attr(bdf, "max_link_speed", max_speed, sizeof(max_speed)) ||
+	    __read_attr(bdf, "current_link_speed", speed, sizeof(speed)) ||
+	    __read_attr(bdf, "max_link_width", max_width, sizeof(max_width)) ||
+	    __read_attr(bdf, "current_link_width", width, sizeof(width))) {
+		log_debug("could not read link properties of %s\n", bdf);
+		return -1;
+	}
+
+	*info = (struct pci_link_info) {
+		.max_speed = __parse_link_speed(max_speed),
+		.max_width = (unsigned int)strtoul(max_width, NULL, 10),
+		.speed = __parse_link_speed(speed),
+		.width = (unsigned int)strtoul(width, NULL, 10),
+	};
+
+	return 0;
+}
+
+static bool __is_bdf(const char *s)
+{
+	unsigned int domain, bus, dev, fn;
+	int n = 0;
+
+	return sscanf(s, "%x:%x:%x.%x%n", &domain, &bus, &dev, &fn, &n) == 4 && !s[n];
+}
+
+static bool __is_host_bridge(const char *s)
+{
+	unsigned int domain, bus;
+	int n = 0;
+
+	return !strncmp(s, "pci", 3) && sscanf(s + 3, "%x:%x%n", &domain, &bus, &n) == 2 &&
+		!s[3 + n];
+}
+
+/*
+ * Resolve the sysfs device path of @bdf (e.g.,
+ * /sys/devices/pci0000:00/0000:00:01.0/0000:01:00.0) into its components from
+ * the host bridge down to the device itself.
+ */
+static int __get_path(const char *bdf, char (*path)[16], int max)
+{
+	char link[PATH_MAX], resolved[PATH_MAX], *tok, *saveptr;
+	int n = 0;
+
+	if (snprintf(link, sizeof(link), "%s/%s", pci_sysfs_devices, bdf) >= (int)sizeof(link)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (!realpath(link, resolved)) {
+		log_debug("could not resolve %s\n", link);
+		return -1;
+	}
+
+	for (tok = strtok_r(resolved, "/", &saveptr); tok; tok = strtok_r(NULL, "/", &saveptr)) {
+		if (!n && !__is_host_bridge(tok))
+			continue;
+
+		if (n && !__is_bdf(tok)) {
+			log_debug("unexpected component '%s' in device path\n", tok);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (n == max || strlen(tok) >= sizeof(*path)) {
+			errno = E2BIG;
+			return -1;
+		}
+
+		strcpy(path[n++], tok);
+	}
+
+	if (n < 2) {
+		log_debug("%s is not below a host bridge\n", bdf);
+
+		errno = ENOENT;
+		return -1;
+	}
+
+	return n;
+}
+
+int pci_device_get_upstream(const char *bdf, char (*ports)[16], int n)
+{
+	char path[PCI_TOPOLOGY_MAX_DEPTH + 1][16];
+	int len, i;
+
+	len = __get_path(bdf, path, PCI_TOPOLOGY_MAX_DEPTH + 1);
+	if (len < 0)
+		return -1;
+
+	/* nearest first, excluding the device itself */
+	for (i = 0; i < n && i < len - 1; i++)
+		memcpy(ports[i], path[len - 2 - i], sizeof(*ports));
+
+	return i;
+}
+
+int pci_device_common_upstream(const char *a, const char *b, char *port, size_t len)
+{
+	char patha[PCI_TOPOLOGY_MAX_DEPTH + 1][16], pathb[PCI_TOPOLOGY_MAX_DEPTH + 1][16];
+	int na, nb, i;
+
+	na = __get_path(a, patha, PCI_TOPOLOGY_MAX_DEPTH + 1);
+	if (na < 0)
+		return -1;
+
+	nb = __get_path(b, pathb, PCI_TOPOLOGY_MAX_DEPTH + 1);
+	if (nb < 0)
+		return -1;
+
+	for (i = 0; i < na && i < nb && !strcmp(patha[i], pathb[i]); i++)
+		;
+
+	if (!i) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (port && snprintf(port, len, "%s", patha[i - 1]) >= (int)len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return (na - i) + (nb - i);
+}
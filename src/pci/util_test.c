@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <assert.h>
+#include <ftw.h>
+
+#include "ccan/str/str.h"
+#include "ccan/tap/tap.h"
+
+#include "util.c"
+
+static char root[] = "/tmp/pci_util_test.XXXXXX";
+
+static void mkfile(const char *dev, const char *name, const char *contents)
+{
+	__autofree char *path = NULL;
+	FILE *fp;
+
+	assert(asprintf(&path, "%s/%s/%s", root, dev, name) > 0);
+
+	fp = fopen(path, "w");
+	assert(fp);
+
+	fputs(contents, fp);
+	fclose(fp);
+}
+
+static void mklink(const char *dev, const char *name, const char *target)
+{
+	__autofree char *path = NULL;
+
+	assert(asprintf(&path, "%s/%s/%s", root, dev, name) > 0);
+	assert(symlink(target, path) == 0);
+}
+
+static void mkdev(const char *dev, const char *class, const char *numa_node,
+		  const char *group, const char *driver)
+{
+	__autofree char *path = NULL;
+
+	assert(asprintf(&path, "%s/%s", root, dev) > 0);
+	assert(mkdir(path, 0700) == 0);
+
+	mkfile(dev, "class", class);
+	mkfile(dev, "vendor", "0x1b36\n");
+	mkfile(dev, "device", "0x0010\n");
+	mkfile(dev, "numa_node", numa_node);
+
+	if (group)
+		mklink(dev, "iommu_group", group);
+
+	if (driver)
+		mklink(dev, "driver", driver);
+}
+
+static int rm(const char *path, const struct stat *sb UNUSED, int flag UNUSED,
+	      struct FTW *ftw UNUSED)
+{
+	return remove(path);
+}
+
+/* create the device @path (relative to the devices directory) and link it */
+static void mktopo(const char *path)
+{
+	__autofree char *dir = NULL, *link = NULL;
+	const char *bdf = strrchr(path, '/') + 1;
+
+	assert(asprintf(&dir, "%s/devices/%s", root, path) > 0);
+
+	for (char *p = dir + strlen(root) + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		assert(mkdir(dir, 0700) == 0 || errno == EEXIST);
+		*p = '/';
+	}
+
+	assert(mkdir(dir, 0700) == 0);
+
+	assert(asprintf(&link, "devices/%s", path) > 0);
+	mklink("", bdf, link);
+}
+
+int main(void)
+{
+	struct pci_device_info *devs, info;
+	struct pci_link_info link;
+	char ports[4][16], port[16];
+	int *cpus = NULL;
+
+	plan_tests(23);
+
+	ok1(__parse_cpulist("3\n", &cpus) == 1 && cpus[0] == 3);
+	free(cpus);
+
+	ok1(__parse_cpulist("0-3,8-9\n", &cpus) == 6);
+	ok1(cpus[3] == 3 && cpus[4] == 8 && cpus[5] == 9);
+	free(cpus);
+
+	ok1(__parse_cpulist("0-63", &cpus) == 64 && cpus[63] == 63);
+	free(cpus);
+
+	ok1(__parse_cpulist("\n", &cpus) == 0);
+
+	ok1(__parse_cpulist("3-1", &cpus) == -1 && errno == EINVAL);
+	ok1(__parse_cpulist("a", &cpus) == -1 && errno == EINVAL);
+
+	assert(mkdtemp(root));
+	pci_sysfs_devices = root;
+
+	mkdev("0000:02:00.0", "0x010802\n", "1\n", "../../../kernel/iommu_groups/12",
+	      "../../../bus/pci/drivers/vfio-pci");
+	mkdev("0000:01:00.0", "0x010802\n", "-1\n", NULL, NULL);
+	mkdev("0000:00:1f.0", "0x060100\n", "0\n", "../../../kernel/iommu_groups/3", NULL);
+
+	/* only the nvme devices, sorted */
+	ok1(pci_scan(PCI_CLASS_NVME, PCI_CLASS_NVME_MASK, &devs) == 2);
+	ok1(streq(devs[0].bdf, "0000:01:00.0") && streq(devs[1].bdf, "0000:02:00.0"));
+	ok1(devs[0].numa_node == -1 && devs[0].iommu_group == -1 && !devs[0].driver[0]);
+	ok1(devs[1].vendor == 0x1b36 && devs[1].device == 0x0010 && devs[1].classcode == 0x010802 &&
+	    devs[1].numa_node == 1 && devs[1].iommu_group == 12 &&
+	    streq(devs[1].driver, "vfio-pci"));
+	free(devs);
+
+	ok1(pci_device_lookup("0000:02:00.0", &info) == 0 && info.iommu_group == 12);
+	ok1(pci_device_lookup("0000:00:1f.0", &info) == -1 && errno == ENODEV);
+
+	/* the cache is only rebuilt when invalidated */
+	mkdev("0000:03:00.0", "0x010802\n", "0\n", NULL, NULL);
+	ok1(pci_device_lookup("0000:03:00.0", &info) == -1 && errno == ENODEV);
+
+	pci_device_cache_invalidate();
+	ok1(pci_device_lookup("0000:03:00.0", &info) == 0 && info.numa_node == 0);
+
+	pci_device_cache_invalidate();
+
+	/* two devices below a switch, one below another root port and host bridge */
+	mktopo("pci0000:00/0000:00:01.0/0000:01:00.0/0000:02:01.0/0000:13:00.0");
+	mktopo("pci0000:00/0000:00:01.0/0000:01:00.0/0000:02:02.0/0000:14:00.0");
+	mktopo("pci0000:00/0000:00:02.0/0000:15:00.0");
+	mktopo("pci0000:80/0000:80:01.0/0000:81:00.0");
+
+	mkfile("0000:13:00.0", "max_link_speed", "16.0 GT/s PCIe\n");
+	mkfile("0000:13:00.0", "current_link_speed", "2.5 GT/s PCIe\n");
+	mkfile("0000:13:00.0", "max_link_width", "4\n");
+	mkfile("0000:13:00.0", "current_link_width", "1\n");
+
+	ok1(pci_device_get_link_info("0000:13:00.0", &link) == 0 && link.max_speed == 16000 &&
+	    link.speed == 2500 && link.max_width == 4 && link.width == 1);
+	ok1(pci_device_get_link_info("0000:14:00.0", &link) == -1 && errno == ENOENT);
+
+	ok1(pci_device_get_upstream("0000:13:00.0", ports, 4) == 4);
+	ok1(streq(ports[0], "0000:02:01.0") && streq(ports[1], "0000:01:00.0") &&
+	    streq(ports[2], "0000:00:01.0") && streq(ports[3], "pci0000:00"));
+	ok1(pci_device_get_upstream("0000:15:00.0", ports, 4) == 2 &&
+	    streq(ports[1], "pci0000:00"));
+
+	ok1(pci_device_common_upstream("0000:13:00.0", "0000:14:00.0", port, sizeof(port)) == 4 &&
+	    streq(port, "0000:01:00.0"));
+	ok1(pci_device_common_upstream("0000:13:00.0", "0000:15:00.0", port, sizeof(port)) == 6 &&
+	    streq(port, "pci0000:00"));
+	ok1(pci_device_common_upstream("0000:13:00.0", "0000:81:00.0", NULL, 0) == -1 &&
+	    errno == ENOENT);
+
+	assert(nftw(root, rm, 16, FTW_DEPTH | FTW_PHYS) == 0);
+
+	return exit_status();
+}
@@ -9,22 +9,59 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <cpuid.h>
 
 #include "vfn/support/ticks.h"
 
+/* exposed by some kernels; calibrated against a reference clock at boot */
+#define TSC_FREQ_KHZ_PATH "/sys/devices/system/cpu/cpu0/tsc_freq_khz"
+
+static uint64_t __x86_64_get_tsc_freq_sysfs(void)
+{
+	unsigned long long khz;
+	FILE *fp;
+	int ret;
+
+	fp = fopen(TSC_FREQ_KHZ_PATH, "re");
+	if (!fp)
+		return 0;
+
+	ret = fscanf(fp, "%llu", &khz);
+	fclose(fp);
+
+	if (ret != 1)
+		return 0;
+
+	return khz * 1000;
+}
+
 static inline uint64_t __x86_64_get_tsc_freq(void)
 {
 	uint32_t a, b, c, d, maxleaf;
+	uint64_t freq;
 
 	maxleaf = __get_cpuid_max(0, NULL);
 
+	/* tsc/crystal clock ratio and (if enumerated) the crystal clock frequency */
 	if (maxleaf >= 0x15) {
 		__cpuid(0x15, a, b, c, d);
 
-		if (b && c)
-			return c * (b / a);
+		if (a && b && c)
+			return (uint64_t)c * b / a;
+	}
+
+	freq = __x86_64_get_tsc_freq_sysfs();
+	if (freq)
+		return freq;
+
+	/* the tsc runs at the processor base frequency when the crystal is not enumerated */
+	if (maxleaf >= 0x16) {
+		__cpuid(0x16, a, b, c, d);
+
+		if (a & 0xffff)
+			return (uint64_t)(a & 0xffff) * 1000000;
 	}
 
 	return 0;
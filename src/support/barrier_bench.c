@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "vfn/support/barrier.h"
+#include "vfn/support/ticks.h"
+
+#define ITERATIONS 1000000
+
+/* a queue entry, a shadow doorbell and an event index on separate cache lines */
+static volatile uint32_t sqe[16] __attribute__((aligned(64)));
+static volatile uint32_t doorbell __attribute__((aligned(64)));
+static volatile uint32_t eventidx __attribute__((aligned(64)));
+
+/*
+ * The pattern of nvme_try_dbbuf(): write the entry, order it before the
+ * shadow doorbell store and order that store before the event index load.
+ */
+#define DBBUF_LOOP(wbarrier, fbarrier) \
+	({ \
+		uint64_t __start = get_ticks(); \
+		uint32_t __sink = 0; \
+		for (uint32_t i = 0; i < ITERATIONS; i++) { \
+			sqe[i & 15] = i; \
+			wbarrier(); \
+			doorbell = i; \
+			fbarrier(); \
+			__sink += eventidx; \
+		} \
+		(void)__sink; \
+		get_ticks() - __start; \
+	})
+
+/* a single store followed by the barrier under test */
+#define STORE_LOOP(barrier) \
+	({ \
+		uint64_t __start = get_ticks(); \
+		for (uint32_t i = 0; i < ITERATIONS; i++) { \
+			sqe[i & 15] = i; \
+			barrier(); \
+		} \
+		get_ticks() - __start; \
+	})
+
+static void report(const char *name, uint64_t ticks)
+{
+	double ns = (double)ticks * 1e9 / (double)get_ticks_freq();
+
+	printf("%-24s %12.3f %12.3f\n", name, (double)ticks / ITERATIONS, ns / ITERATIONS);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	printf("%-24s %12s %12s\n", "barrier", "ticks/op", "ns/op");
+
+	report("none", STORE_LOOP(barrier));
+	report("wmb", STORE_LOOP(wmb));
+	report("dma_wmb", STORE_LOOP(dma_wmb));
+	report("io_wmb", STORE_LOOP(io_wmb));
+	report("mb", STORE_LOOP(mb));
+	report("dma_mb", STORE_LOOP(dma_mb));
+
+	report("dbbuf (wmb, mb)", DBBUF_LOOP(wmb, mb));
+	report("dbbuf (dma_wmb, dma_mb)", DBBUF_LOOP(dma_wmb, dma_mb));
+
+	return 0;
+}
@@ -10,16 +10,44 @@
  * COPYING and LICENSE files for more information.
  */
 
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <vfn/support/atomic.h>
 #include <vfn/support/log.h>
 
+#define LOG_ASYNC_SLOTS 256
+#define LOG_ASYNC_MSG_LEN 256
+
 struct log_state __log_state;
 
+/*
+ * Bounded multi-producer ring. A slot is free for the producer holding ticket
+ * t when its sequence number is t, and holds a message for the consumer when
+ * it is t + 1; the consumer hands it back for ticket t + LOG_ASYNC_SLOTS.
+ */
+static struct {
+	struct {
+		uint64_t seq;
+		char msg[LOG_ASYNC_MSG_LEN];
+	} slots[LOG_ASYNC_SLOTS];
+
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t dropped;
+
+	pthread_t thread;
+	bool init, stop;
+} __log_ring;
+
 static void __attribute__((constructor)) init_log_level(void)
 {
 	char *buf = getenv("LOGV");
@@ -44,3 +72,119 @@ set_default:
 	__log_state.v = 0;
 #endif
 }
+
+void __log_async(char const *fmt, va_list va)
+{
+	uint64_t t = __atomic_load_n(&__log_ring.head, __ATOMIC_RELAXED);
+	int64_t diff;
+
+	for (;;) {
+		uint64_t seq = atomic_load_acquire(&__log_ring.slots[t % LOG_ASYNC_SLOTS].seq);
+
+		diff = (int64_t)(seq - t);
+
+		if (diff < 0) {
+			/* full; never wait for the background thread */
+			atomic_inc(&__log_ring.dropped);
+			return;
+		}
+
+		/* on failure, t is updated to the current head */
+		if (!diff) {
+			if (atomic_cmpxchg(&__log_ring.head, t, t + 1))
+				break;
+
+			continue;
+		}
+
+		t = __atomic_load_n(&__log_ring.head, __ATOMIC_RELAXED);
+	}
+
+	vsnprintf(__log_ring.slots[t % LOG_ASYNC_SLOTS].msg, LOG_ASYNC_MSG_LEN, fmt, va);
+
+	atomic_store_release(&__log_ring.slots[t % LOG_ASYNC_SLOTS].seq, t + 1);
+}
+
+static bool __log_drain(void)
+{
+	uint64_t t = __log_ring.tail;
+	bool drained = false;
+
+	while (atomic_load_acquire(&__log_ring.slots[t % LOG_ASYNC_SLOTS].seq) == t + 1) {
+		fputs(__log_ring.slots[t % LOG_ASYNC_SLOTS].msg, stderr);
+
+		atomic_store_release(&__log_ring.slots[t % LOG_ASYNC_SLOTS].seq,
+				     t + LOG_ASYNC_SLOTS);
+
+		t++;
+		drained = true;
+	}
+
+	__log_ring.tail = t;
+
+	return drained;
+}
+
+static void *__log_thread(void *opaque __attribute__((unused)))
+{
+	while (!atomic_load_acquire(&__log_ring.stop)) {
+		if (!__log_drain())
+			usleep(1000);
+	}
+
+	return NULL;
+}
+
+int log_async_enable(void)
+{
+	int err;
+
+	if (__log_state.async)
+		return 0;
+
+	/* messages queued after a previous disable are written by the new thread */
+	if (!__log_ring.init) {
+		for (uint64_t i = 0; i < LOG_ASYNC_SLOTS; i++)
+			__log_ring.slots[i].seq = i;
+
+		__log_ring.init = true;
+	}
+
+	__log_ring.stop = false;
+
+	err = pthread_create(&__log_ring.thread, NULL, __log_thread, NULL);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	atomic_store_release(&__log_state.async, true);
+
+	return 0;
+}
+
+void log_async_disable(void)
+{
+	uint64_t dropped;
+
+	if (!__log_state.async)
+		return;
+
+	atomic_store_release(&__log_state.async, false);
+
+	atomic_store_release(&__log_ring.stop, true);
+	pthread_join(__log_ring.thread, NULL);
+
+	/* producers that saw the sink enabled may still be filling their slots */
+	while (atomic_load_acquire(&__log_ring.head) != __log_ring.tail)
+		__log_drain();
+
+	dropped = atomic_xchg(&__log_ring.dropped, 0);
+	if (dropped)
+		fprintf(stderr, "(%" PRIu64 " log messages dropped)\n", dropped);
+}
+
+static void __attribute__((destructor)) fini_log(void)
+{
+	log_async_disable();
+}
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#undef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_INFO
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vfn/support.h"
+
+#include "ccan/tap/tap.h"
+
+#define NTHREADS 4
+#define NMSGS 1000
+
+static int evaluated;
+
+static int side_effect(void)
+{
+	return ++evaluated;
+}
+
+static void *producer(void *opaque)
+{
+	long id = (long)opaque;
+
+	for (int i = 0; i < NMSGS; i++) {
+		log_info("producer %ld message %d\n", id, i);
+
+		/* the ring is smaller than what is produced; let the sink keep up */
+		if (i % 64 == 63)
+			usleep(5000);
+	}
+
+	return NULL;
+}
+
+static int count_lines(FILE *f, const char *needle)
+{
+	char line[256];
+	int n = 0;
+
+	rewind(f);
+
+	while (fgets(line, sizeof(line), f))
+		if (strstr(line, needle))
+			n++;
+
+	return n;
+}
+
+static int dropped(FILE *f)
+{
+	char line[256];
+	int n = 0;
+
+	rewind(f);
+
+	while (fgets(line, sizeof(line), f))
+		sscanf(line, "(%d log messages dropped)", &n);
+
+	return n;
+}
+
+int main(void)
+{
+	pthread_t threads[NTHREADS];
+	FILE *f = tmpfile();
+	int saved = dup(STDERR_FILENO);
+
+	plan_tests(6);
+
+	logv_set(LOG_DEBUG);
+
+	/* logged messages are captured in f */
+	assert(f && saved >= 0);
+	assert(dup2(fileno(f), STDERR_FILENO) == STDERR_FILENO);
+
+	/* above the compiled in level; the arguments are not evaluated */
+	log_debug("debug %d\n", side_effect());
+	log_info("info %d\n", side_effect());
+
+	ok1(evaluated == 1 && !logv(LOG_DEBUG) && logv(LOG_INFO));
+
+	ok1(log_async_enable() == 0 && log_async_enable() == 0);
+
+	for (long i = 0; i < NTHREADS; i++)
+		assert(pthread_create(&threads[i], NULL, producer, (void *)i) == 0);
+
+	for (int i = 0; i < NTHREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	log_async_disable();
+
+	ok1(!__log_state.async);
+
+	/* synchronous again */
+	log_info("sync\n");
+
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+
+	ok1(count_lines(f, "debug") == 0 && count_lines(f, "info 1") == 1);
+
+	/* every message is either written or accounted as dropped */
+	ok1(count_lines(f, "producer") + dropped(f) == NTHREADS * NMSGS);
+	ok1(count_lines(f, "sync") == 1);
+
+	fclose(f);
+
+	return exit_status();
+}
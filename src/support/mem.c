@@ -23,9 +23,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/mempolicy.h>
 
 #include <vfn/support/align.h>
 #include <vfn/support/atomic.h>
@@ -77,6 +81,67 @@ ssize_t pgmap(void **mem, size_t sz)
 	return len;
 }
 
+ssize_t pgmap_huge(void **mem, size_t sz, unsigned int shift)
+{
+	size_t hpsz = 1ULL << shift;
+	ssize_t len = ALIGN_UP(sz, hpsz);
+	void *raw;
+	size_t rawlen;
+
+	*mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (int)(shift << MAP_HUGE_SHIFT), 0, 0);
+	if (*mem != MAP_FAILED)
+		return len;
+
+	log_info("could not map %zu bytes of hugetlb memory; using transparent hugepages\n", len);
+
+	/* over-allocate to align the mapping to the hugepage size */
+	rawlen = len + hpsz;
+
+	raw = mmap(NULL, rawlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	if (raw == MAP_FAILED)
+		return -1;
+
+	*mem = (void *)ALIGN_UP((uintptr_t)raw, hpsz);
+
+	if (*mem > raw)
+		munmap(raw, *mem - raw);
+
+	munmap(*mem + len, (raw + rawlen) - (*mem + len));
+
+	if (madvise(*mem, len, MADV_HUGEPAGE))
+		log_debug("madvise failed\n");
+
+	return len;
+}
+
+#define PGBIND_MAX_NODES 1024
+
+int pgbind(void *mem, size_t len, int node)
+{
+	unsigned long nodemask[PGBIND_MAX_NODES / (8 * sizeof(unsigned long))] = {};
+	const unsigned int bits = 8 * sizeof(unsigned long);
+
+	if (node < 0)
+		return 0;
+
+	if (node >= PGBIND_MAX_NODES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nodemask[(unsigned int)node / bits] = 1UL << ((unsigned int)node % bits);
+
+	/* the kernel only considers the first maxnode - 1 bits */
+	if (syscall(SYS_mbind, mem, len, MPOL_PREFERRED, nodemask, PGBIND_MAX_NODES + 1,
+		    0)) {
+		log_debug("mbind failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 ssize_t pgmapn(void **mem, unsigned int n, size_t sz)
 {
 	if (would_overflow(n, sz)) {
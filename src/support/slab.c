@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ccan/minmax/minmax.h"
+
+#include "vfn/support.h"
+
+#include "slab.h"
+
+#define SLAB_CHUNK_SIZE 0x10000
+
+/* objects moved between a thread cache and the shared free list at a time */
+#define SLAB_BATCH 32
+
+#define SLAB_CACHE_SLOTS 8
+
+struct slab_cache {
+	struct slab *slab;
+
+	void *free;
+	unsigned int n;
+};
+
+struct slab_caches {
+	struct slab_cache caches[SLAB_CACHE_SLOTS];
+};
+
+static __thread struct slab_caches *slab_caches;
+
+static pthread_key_t slab_caches_key;
+static pthread_once_t slab_caches_once = PTHREAD_ONCE_INIT;
+
+static inline void **__next(void *obj)
+{
+	return (void **)obj;
+}
+
+/* objects hold the free list link and are aligned for any member */
+static inline size_t __objsize(struct slab *slab)
+{
+	return ALIGN_UP(max_t(size_t, slab->size, sizeof(void *)), 16);
+}
+
+/* move up to @n objects from the free list at @src to @dst */
+static unsigned int __move(void **dst, void **src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n && *src; i++) {
+		void *obj = *src;
+
+		*src = *__next(obj);
+
+		*__next(obj) = *dst;
+		*dst = obj;
+	}
+
+	return i;
+}
+
+static void __carve(struct slab *slab)
+{
+	size_t objsize = __objsize(slab);
+	void *chunk = xmalloc(SLAB_CHUNK_SIZE);
+
+	if (objsize > SLAB_CHUNK_SIZE)
+		backtrace_abort();
+
+	for (size_t ofst = 0; ofst + objsize <= SLAB_CHUNK_SIZE; ofst += objsize) {
+		void *obj = chunk + ofst;
+
+		*__next(obj) = slab->free;
+		slab->free = obj;
+	}
+}
+
+static void __cache_flush(struct slab_cache *c, unsigned int n)
+{
+	struct slab *slab = c->slab;
+
+	__autolock(&slab->lock);
+
+	c->n -= __move(&slab->free, &c->free, n);
+}
+
+static void slab_caches_destroy(void *opaque)
+{
+	struct slab_caches *caches = opaque;
+
+	for (int i = 0; i < SLAB_CACHE_SLOTS; i++) {
+		if (caches->caches[i].slab)
+			__cache_flush(&caches->caches[i], UINT32_MAX);
+	}
+
+	free(caches);
+
+	/* runs on the exiting thread; later destructors may still free objects */
+	slab_caches = NULL;
+}
+
+static void slab_caches_init_key(void)
+{
+	if (pthread_key_create(&slab_caches_key, slab_caches_destroy))
+		backtrace_abort();
+}
+
+static struct slab_cache *__cache(struct slab *slab)
+{
+	struct slab_cache *c;
+
+	if (!slab_caches) {
+		pthread_once(&slab_caches_once, slab_caches_init_key);
+
+		slab_caches = znew_t(struct slab_caches, 1);
+		pthread_setspecific(slab_caches_key, slab_caches);
+	}
+
+	for (int i = 0; i < SLAB_CACHE_SLOTS; i++) {
+		c = &slab_caches->caches[i];
+
+		if (c->slab == slab)
+			return c;
+	}
+
+	for (int i = 0; i < SLAB_CACHE_SLOTS; i++) {
+		c = &slab_caches->caches[i];
+
+		if (!c->slab)
+			goto out;
+	}
+
+	/* evict another slab */
+	c = &slab_caches->caches[((uintptr_t)slab >> 6) % SLAB_CACHE_SLOTS];
+	__cache_flush(c, UINT32_MAX);
+
+out:
+	c->slab = slab;
+
+	return c;
+}
+
+void *slab_alloc(struct slab *slab)
+{
+	struct slab_cache *c = __cache(slab);
+	void *obj;
+
+	if (!c->free) {
+		__autolock(&slab->lock);
+
+		if (!slab->free)
+			__carve(slab);
+
+		c->n += __move(&c->free, &slab->free, SLAB_BATCH);
+	}
+
+	obj = c->free;
+
+	c->free = *__next(obj);
+	c->n--;
+
+	return obj;
+}
+
+void slab_free(struct slab *slab, void *obj)
+{
+	struct slab_cache *c;
+
+	if (!obj)
+		return;
+
+	c = __cache(slab);
+
+	if (c->n == 2 * SLAB_BATCH)
+		__cache_flush(c, SLAB_BATCH);
+
+	*__next(obj) = c->free;
+	c->free = obj;
+	c->n++;
+}
+
+void slab_free_fn(void *slab, void *obj)
+{
+	slab_free(slab, obj);
+}
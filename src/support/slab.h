@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Fixed-size object allocator.
+ *
+ * Objects are carved out of 64k chunks that are never returned to the system.
+ * Each thread caches free objects of the slabs it uses; the caches are refilled
+ * from and flushed to the shared free list in batches, so allocating and
+ * freeing objects does not take the lock in the common case.
+ *
+ * Slabs are meant to be statically allocated and must not go away while
+ * threads that have used them remain.
+ */
+
+struct slab {
+	size_t size;
+
+	pthread_mutex_t lock;
+	void *free;
+};
+
+#define SLAB_INIT(t) { .size = sizeof(t), .lock = PTHREAD_MUTEX_INITIALIZER, }
+
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *obj);
+
+/* slab_free() with the signature of a deferred free callback (see rcu_free_with()) */
+void slab_free_fn(void *slab, void *obj);
+
+static inline void *slab_zalloc(struct slab *slab)
+{
+	return memset(slab_alloc(slab), 0x0, slab->size);
+}
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ccan/tap/tap.h"
+
+#include "vfn/support.h"
+
+#include "slab.h"
+
+#define NOBJS 1000
+
+struct obj {
+	uint64_t a, b, c;
+};
+
+static struct slab slab = SLAB_INIT(struct obj);
+
+/* freed by the main thread */
+static struct obj *handoff[NOBJS];
+
+static void *alloc_thread(void *opaque)
+{
+	bool *ok = opaque;
+
+	*ok = true;
+
+	for (int i = 0; i < NOBJS; i++) {
+		handoff[i] = slab_zalloc(&slab);
+
+		if (handoff[i]->a || handoff[i]->b || handoff[i]->c)
+			*ok = false;
+
+		handoff[i]->a = (uint64_t)i;
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct obj *objs[NOBJS], *o;
+	bool distinct = true, aligned = true, ok;
+	pthread_t thread;
+
+	plan_tests(5);
+
+	for (int i = 0; i < NOBJS; i++) {
+		objs[i] = slab_alloc(&slab);
+
+		if (!ALIGNED((uintptr_t)objs[i], 16))
+			aligned = false;
+
+		objs[i]->a = (uint64_t)i;
+	}
+
+	for (int i = 0; i < NOBJS; i++) {
+		if (objs[i]->a != (uint64_t)i)
+			distinct = false;
+	}
+
+	ok1(distinct);
+	ok1(aligned);
+
+	/* freed objects are reused */
+	o = objs[NOBJS - 1];
+	slab_free(&slab, o);
+	ok1(slab_alloc(&slab) == o);
+
+	for (int i = 0; i < NOBJS; i++)
+		slab_free(&slab, objs[i]);
+
+	/* objects may be freed by another thread than they were allocated by */
+	pthread_create(&thread, NULL, alloc_thread, &ok);
+	pthread_join(thread, NULL);
+
+	ok1(ok);
+
+	distinct = true;
+
+	for (int i = 0; i < NOBJS; i++) {
+		if (handoff[i]->a != (uint64_t)i)
+			distinct = false;
+
+		slab_free(&slab, handoff[i]);
+	}
+
+	ok1(distinct);
+
+	return exit_status();
+}
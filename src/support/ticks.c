@@ -15,7 +15,11 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
 
 #include "vfn/support/align.h"
 #include "vfn/support/atomic.h"
@@ -27,7 +31,14 @@
 
 #define TICKS_PER_10MHZ 10000000ULL
 
-uint64_t __vfn_ticks_freq;
+/* measured frequencies are shared by processes until the next boot */
+#define TICKS_FREQ_CACHE_DIR "/run/libvfn"
+#define TICKS_FREQ_CACHE TICKS_FREQ_CACHE_DIR "/ticks_freq"
+
+uint64_t __vfn_ticks_freq_cached;
+struct __vfn_ticks_conv __vfn_ticks_to_ns, __vfn_ns_to_ticks;
+
+static pthread_mutex_t calibrate_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static uint64_t measure_ticks_freq(void)
 {
@@ -73,18 +84,114 @@ static uint64_t estimate_ticks_freq(void)
 	return ROUND(get_ticks() - start, TICKS_PER_10MHZ);
 }
 
-static void __attribute__((constructor)) init_ticks_freq(void)
+static uint64_t read_ticks_freq_cache(void)
+{
+	unsigned long long freq;
+	FILE *fp;
+	int ret;
+
+	fp = fopen(TICKS_FREQ_CACHE, "re");
+	if (!fp)
+		return 0;
+
+	ret = fscanf(fp, "%llu", &freq);
+	fclose(fp);
+
+	if (ret != 1)
+		return 0;
+
+	return freq;
+}
+
+static void write_ticks_freq_cache(uint64_t freq)
+{
+	char tmp[] = TICKS_FREQ_CACHE ".XXXXXX";
+	FILE *fp;
+	int fd;
+
+	if (mkdir(TICKS_FREQ_CACHE_DIR, 0755) && errno != EEXIST)
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+
+	/* readers never see a partially written file */
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto unlink;
+	}
+
+	if (fchmod(fd, 0644) || fprintf(fp, "%" PRIu64 "\n", freq) < 0) {
+		fclose(fp);
+		goto unlink;
+	}
+
+	if (fclose(fp) || rename(tmp, TICKS_FREQ_CACHE))
+		goto unlink;
+
+	return;
+
+unlink:
+	log_debug("could not cache tick frequency\n");
+
+	unlink(tmp);
+}
+
+/*
+ * Factor converting from units at @from Hz to units at @to Hz, with the
+ * largest shift (i.e., the best precision) for which the multiplier fits.
+ */
+static struct __vfn_ticks_conv __calc_conv(uint64_t to, uint64_t from)
+{
+	__vfn_u128 mult;
+	unsigned int shift;
+
+	for (shift = 63; shift > 0; shift--) {
+		mult = ((__vfn_u128)to << shift) / from;
+		if (!(mult >> 64))
+			break;
+	}
+
+	return (struct __vfn_ticks_conv) { .mult = (uint64_t)mult, .shift = shift };
+}
+
+uint64_t __vfn_ticks_calibrate(void)
 {
 	uint64_t freq;
 
+	/* concurrent first users wait for a single measurement */
+	pthread_mutex_lock(&calibrate_lock);
+
+	freq = __vfn_ticks_freq_cached;
+	if (freq)
+		goto out;
+
 	freq = get_ticks_freq_arch();
+
 	if (!freq)
+		freq = read_ticks_freq_cache();
+
+	if (!freq) {
 		freq = measure_ticks_freq();
+		if (freq)
+			write_ticks_freq_cache(freq);
+	}
 
 	if (!freq)
 		freq = estimate_ticks_freq();
 
 	log_debug("tick frequency is ~%" PRIu64 " Hz\n", freq);
 
-	__vfn_ticks_freq = freq;
+	__vfn_ticks_to_ns = __calc_conv(NS_PER_SEC, freq);
+	__vfn_ns_to_ticks = __calc_conv(freq, NS_PER_SEC);
+
+	/* publishes the conversion factors as well */
+	atomic_store_release(&__vfn_ticks_freq_cached, freq);
+
+out:
+	pthread_mutex_unlock(&calibrate_lock);
+
+	return freq;
 }
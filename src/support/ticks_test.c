@@ -21,12 +21,13 @@
 #include <unistd.h>
 
 #include "vfn/support/ticks.h"
+#include "vfn/support/timer.h"
 
 #include "ccan/tap/tap.h"
 
 int main(int argc UNUSED, char *argv[] UNUSED)
 {
-	uint64_t tsc_old, tsc_new;
+	uint64_t tsc_old, tsc_new, freq, ns, ticks;
 
 	plan_no_plan();
 
@@ -36,11 +37,20 @@ int main(int argc UNUSED, char *argv[] UNUSED)
 
 	ok1(tsc_new > tsc_old);
 
-	diag("TSC OLD:  %" PRIu64 "\n", tsc_old);
-	diag("TSC NEW:  %" PRIu64 "\n", tsc_new);
-	diag("TSC DIFF: %" PRIu64 "\n", tsc_new - tsc_old);
-	diag("TSC HZ:   %" PRIu64 "\n", __vfn_ticks_freq);
-	diag("%.10f\n", (double)(tsc_new - tsc_old) / __vfn_ticks_freq);
+	/* calibrated once */
+	ok1(get_ticks_freq() && get_ticks_freq() == __vfn_ticks_freq_cached);
+
+	/* fixed-point conversions agree with the frequency */
+	freq = get_ticks_freq();
+	ns = ticks_to_ns(freq);
+	ok1(ns >= NS_PER_SEC - 1 && ns <= NS_PER_SEC);
+
+	ticks = ns_to_ticks(NS_PER_SEC);
+	ok1(ticks >= freq - 1 && ticks <= freq);
+
+	/* no overflow over the full range */
+	ns = (uint64_t)((__vfn_u128)UINT64_MAX * NS_PER_SEC / freq);
+	ok1(ns - ticks_to_ns(UINT64_MAX) <= 2);
 
 	return exit_status();
 }
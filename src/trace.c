@@ -11,24 +11,252 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "ccan/array_size/array_size.h"
+#include "ccan/compiler/compiler.h"
+#include "ccan/minmax/minmax.h"
 
+#include "vfn/support.h"
 #include "vfn/trace.h"
-#include "vfn/support/ticks.h"
 #include "trace.h"
 
+#define TRACE_RING_DEFAULT_SIZE (1 << 16)
+
 __thread const char *__trace_event;
+__thread int __trace_event_id;
+
+bool __trace_ring_enabled;
+
+/*
+ * Per-thread ring buffer. Only the owning thread writes to it (overwriting the
+ * oldest records when full); rings are never freed, such that the records of
+ * exited threads are still available for trace_ring_dump().
+ */
+struct trace_ring {
+	struct trace_ring *next;
+
+	uint32_t tid;
+	uint64_t head;
+
+	struct trace_ring_record records[];
+};
+
+static __thread struct trace_ring *__trace_ring;
+
+static struct trace_ring *trace_rings;
+static pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t trace_ring_size = TRACE_RING_DEFAULT_SIZE;
+static const char *trace_ring_path;
+
+static struct trace_ring *trace_ring_alloc(void)
+{
+	struct trace_ring *ring;
+
+	ring = zmalloc(sizeof(*ring) + trace_ring_size * sizeof(struct trace_ring_record));
+	ring->tid = (uint32_t)syscall(SYS_gettid);
+
+	pthread_mutex_lock(&trace_rings_lock);
+
+	ring->next = trace_rings;
+	trace_rings = ring;
+
+	pthread_mutex_unlock(&trace_rings_lock);
+
+	__trace_ring = ring;
+
+	return ring;
+}
+
+void __trace_ring_emit(const char *fmt, int nargs, uint64_t a0, uint64_t a1, uint64_t a2,
+		       uint64_t a3, uint64_t a4)
+{
+	struct trace_ring *ring = __trace_ring;
+	struct trace_ring_record *r;
+
+	if (unlikely(!ring))
+		ring = trace_ring_alloc();
+
+	r = &ring->records[ring->head & (trace_ring_size - 1)];
+
+	r->ticks = get_ticks();
+	r->fmt = (uintptr_t)fmt;
+	r->event = (uint16_t)__trace_event_id;
+	r->nargs = (uint8_t)nargs;
+	r->tid = ring->tid;
+
+	r->args[0] = a0;
+	r->args[1] = a1;
+	r->args[2] = a2;
+	r->args[3] = a3;
+	r->args[4] = a4;
+
+	/* publish the record to trace_ring_dump() */
+	atomic_store_release(&ring->head, ring->head + 1);
+}
+
+struct trace_ring_fmts {
+	const char **fmts;
+	unsigned int n, cap;
+};
+
+static uint64_t trace_ring_fmt_index(struct trace_ring_fmts *t, const char *fmt)
+{
+	for (unsigned int i = 0; i < t->n; i++) {
+		if (t->fmts[i] == fmt)
+			return i;
+	}
+
+	if (t->n == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 32;
+		t->fmts = reallocn(t->fmts, t->cap, sizeof(*t->fmts));
+	}
+
+	t->fmts[t->n] = fmt;
+
+	return t->n++;
+}
+
+int trace_ring_dump(const char *path)
+{
+	struct trace_ring_header hdr = {
+		.version = TRACE_RING_VERSION,
+		.nevents = (uint32_t)TRACE_NUM_EVENTS,
+		.ticks_freq = get_ticks_freq(),
+	};
+	struct trace_ring_fmts fmts = {};
+	struct trace_ring_record *records = NULL;
+	uint64_t n = 0;
+	FILE *fp;
+	int ret = -1;
+
+	memcpy(hdr.magic, TRACE_RING_MAGIC, sizeof(hdr.magic));
+
+	pthread_mutex_lock(&trace_rings_lock);
+
+	for (struct trace_ring *ring = trace_rings; ring; ring = ring->next)
+		n += min(atomic_load_acquire(&ring->head), trace_ring_size);
+
+	/* snapshot the rings; new rings (or records) after this are not included */
+	records = xmalloc(max(n, (uint64_t)1) * sizeof(*records));
+
+	hdr.nrecords = 0;
+
+	for (struct trace_ring *ring = trace_rings; ring && hdr.nrecords < n; ring = ring->next) {
+		uint64_t head = atomic_load_acquire(&ring->head);
+		uint64_t cnt = min(min(head, trace_ring_size), n - hdr.nrecords);
+
+		for (uint64_t i = head - cnt; i < head; i++) {
+			struct trace_ring_record *r = &records[hdr.nrecords++];
+
+			*r = ring->records[i & (trace_ring_size - 1)];
+			r->fmt = trace_ring_fmt_index(&fmts, (const char *)(uintptr_t)r->fmt);
+		}
+	}
+
+	pthread_mutex_unlock(&trace_rings_lock);
+
+	hdr.nfmts = fmts.n;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		log_debug("could not open %s\n", path);
+		goto out;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto write_error;
+
+	for (int i = 0; i < TRACE_NUM_EVENTS; i++) {
+		const char *name = trace_events[i].name;
+
+		if (fwrite(name, strlen(name) + 1, 1, fp) != 1)
+			goto write_error;
+	}
+
+	for (unsigned int i = 0; i < fmts.n; i++) {
+		if (fwrite(fmts.fmts[i], strlen(fmts.fmts[i]) + 1, 1, fp) != 1)
+			goto write_error;
+	}
+
+	if (hdr.nrecords && fwrite(records, sizeof(*records), hdr.nrecords, fp) != hdr.nrecords)
+		goto write_error;
+
+	if (fclose(fp)) {
+		log_debug("could not write %s\n", path);
+		goto out;
+	}
+
+	ret = 0;
+
+	goto out;
+
+write_error:
+	log_debug("could not write %s\n", path);
+
+	fclose(fp);
+
+	errno = EIO;
+
+out:
+	free(records);
+	free(fmts.fmts);
+
+	return ret;
+}
+
+static void trace_ring_dump_atexit(void)
+{
+	if (trace_ring_dump(trace_ring_path))
+		fprintf(stderr, "could not dump trace ring buffers to %s\n", trace_ring_path);
+}
+
+static void init_trace_ring(void)
+{
+	char *endptr, *path = getenv("VFN_TRACE_RING"), *size = getenv("VFN_TRACE_RING_SIZE");
+
+	if (!path || !*path)
+		return;
+
+	if (size) {
+		unsigned long long v;
+
+		errno = 0;
+		v = strtoull(size, &endptr, 0);
+
+		if (errno || *endptr != '\0' || !v || v > (1ULL << 30))
+			fprintf(stderr, "invalid VFN_TRACE_RING_SIZE; using default\n");
+		else {
+			/* round up to a power of two */
+			trace_ring_size = 1;
+			while (trace_ring_size < v)
+				trace_ring_size <<= 1;
+		}
+	}
+
+	trace_ring_path = path;
+	__trace_ring_enabled = true;
+
+	atexit(trace_ring_dump_atexit);
+}
 
 static void __attribute__((constructor)) init_trace_events(void)
 {
 	char *tok, *buf, *orig = getenv("VFN_TRACE_EVENTS");
 
+	init_trace_ring();
+
 	if (!orig)
 		return;
 
@@ -55,6 +283,116 @@ static void __attribute__((constructor)) init_trace_events(void)
 	free(buf);
 }
 
+#if defined(DEBUG) && defined(TRACE_STATIC_KEYS)
+/* registered guard site tables (one per executable or shared object) */
+struct trace_jump_table {
+	struct trace_jump_table *next;
+
+	const struct trace_jump_entry *start, *stop;
+};
+
+static struct trace_jump_table *trace_jump_tables;
+static pthread_mutex_t trace_jump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int trace_jump_patch(const struct trace_jump_entry *e, bool active)
+{
+	uintptr_t pagesize = (uintptr_t)sysconf(_SC_PAGESIZE), page, end;
+	uint8_t *code = (uint8_t *)(uintptr_t)e->code;
+#if defined(__x86_64__)
+	uint8_t insn[5] = {0x0f, 0x1f, 0x44, 0x00, 0x00};
+
+	if (active) {
+		int32_t rel = (int32_t)((int64_t)e->target - (int64_t)(e->code + sizeof(insn)));
+
+		insn[0] = 0xe9;
+		memcpy(&insn[1], &rel, sizeof(rel));
+	}
+#elif defined(__aarch64__)
+	uint32_t insn = 0xd503201f;
+
+	if (active)
+		insn = 0x14000000 | (((uint32_t)((e->target - e->code) >> 2)) & 0x03ffffff);
+#endif
+
+	if (!memcmp(code, &insn, sizeof(insn)))
+		return 0;
+
+	/* the instruction may cross a page boundary */
+	page = ALIGN_DOWN((uintptr_t)code, pagesize);
+	end = ALIGN_UP((uintptr_t)code + sizeof(insn), pagesize);
+
+	if (mprotect((void *)page, end - page, PROT_READ | PROT_WRITE | PROT_EXEC)) {
+		log_debug("could not make trace guard at %p writable\n", code);
+		return -1;
+	}
+
+	memcpy(code, &insn, sizeof(insn));
+
+	__builtin___clear_cache((char *)code, (char *)code + sizeof(insn));
+
+	if (mprotect((void *)page, end - page, PROT_READ | PROT_EXEC)) {
+		log_debug("could not restore protection of trace guard at %p\n", code);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void trace_jump_patch_table(struct trace_jump_table *table, int event, bool active)
+{
+	for (const struct trace_jump_entry *e = table->start; e < table->stop; e++) {
+		if (event >= 0 && e->event != (uint64_t)event)
+			continue;
+
+		if (e->event >= (uint64_t)TRACE_NUM_EVENTS)
+			continue;
+
+		if (trace_jump_patch(e, event >= 0 ? active : *trace_events[e->event].active))
+			log_debug("could not patch trace guard for %s\n",
+				  trace_events[e->event].name);
+	}
+}
+
+void __trace_jump_register(const struct trace_jump_entry *start,
+			   const struct trace_jump_entry *stop)
+{
+	__autolock(&trace_jump_lock);
+
+	struct trace_jump_table *table;
+
+	if (!start || start == stop)
+		return;
+
+	for (table = trace_jump_tables; table; table = table->next) {
+		if (table->start == start)
+			return;
+	}
+
+	table = znew_t(struct trace_jump_table, 1);
+
+	table->start = start;
+	table->stop = stop;
+	table->next = trace_jump_tables;
+
+	trace_jump_tables = table;
+
+	/* sync with events enabled before the table was registered */
+	trace_jump_patch_table(table, -1, false);
+}
+
+static void trace_jump_set_active(int event, bool active)
+{
+	__autolock(&trace_jump_lock);
+
+	for (struct trace_jump_table *table = trace_jump_tables; table; table = table->next)
+		trace_jump_patch_table(table, event, active);
+}
+#else
+static inline void trace_jump_set_active(int event UNUSED, bool active UNUSED)
+{
+}
+#endif
+
 void trace_set_active(const char *prefix, bool active)
 {
 	size_t len;
@@ -66,8 +404,11 @@ void trace_set_active(const char *prefix, bool active)
 	for (int i = 0; i < TRACE_NUM_EVENTS; i++) {
 		struct trace_event *event = &trace_events[i];
 
-		if (strncmp(prefix, event->name, len) == 0)
+		if (strncmp(prefix, event->name, len) == 0) {
 			*(event->active) = active;
+
+			trace_jump_set_active(i, active);
+		}
 	}
 }
 
@@ -81,7 +422,7 @@ bool __trace_ratelimited(struct trace_ratelimit_state *rs, uint64_t tag, const c
 			fprintf(stderr, "T %s (%d events skipped)\n", event, rs->skipped);
 
 		rs->begin = get_ticks();
-		rs->end = rs->begin + rs->interval * __vfn_ticks_freq;
+		rs->end = rs->begin + rs->interval * get_ticks_freq();
 		rs->skipped = 0;
 		rs->tag = tag;
 
@@ -17,5 +17,3 @@ struct trace_event {
 
 extern struct trace_event trace_events[];
 extern int TRACE_NUM_EVENTS;
-
-void trace_set_active(const char *prefix, bool active);
@@ -0,0 +1,391 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vfn/support.h"
+
+#include "support/slab.h"
+
+#include "rcu.h"
+#include "btree.h"
+
+/* generous; a tree of order 32 with 2^40 keys is less than 11 levels high */
+#define BTREE_MAX_HEIGHT 16
+
+/*
+ * Nodes replaced by a modification. They are still reachable by readers until
+ * the new root is published, so they are only handed to rcu_free_with() after.
+ */
+struct btree_retired {
+	struct btree_node *nodes[2 * BTREE_MAX_HEIGHT];
+	int n;
+};
+
+static struct slab btree_node_slab = SLAB_INIT(struct btree_node);
+
+static inline struct btree_node *node_new(void)
+{
+	return slab_zalloc(&btree_node_slab);
+}
+
+static inline void node_free(struct btree_node *n)
+{
+	slab_free(&btree_node_slab, n);
+}
+
+static inline void retire(struct btree_retired *r, struct btree_node *n)
+{
+	assert(r->n < 2 * BTREE_MAX_HEIGHT);
+
+	r->nodes[r->n++] = n;
+}
+
+static void reclaim(struct btree_retired *r)
+{
+	for (int i = 0; i < r->n; i++)
+		rcu_free_with(r->nodes[i], slab_free_fn, &btree_node_slab);
+}
+
+/* index of the largest key less than or equal to @key, or -1 */
+static inline int __pos(const struct btree_node *n, uint64_t key)
+{
+	int lo = 0, hi = n->nkeys;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (n->keys[mid] <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+static struct btree_node *node_copy(const struct btree_node *n)
+{
+	struct btree_node *m = slab_alloc(&btree_node_slab);
+
+	memcpy(m, n, sizeof(*m));
+
+	return m;
+}
+
+static void node_insert_at(struct btree_node *n, int i, uint64_t key, void *ptr)
+{
+	size_t k = (size_t)(n->nkeys - i);
+
+	memmove(&n->keys[i + 1], &n->keys[i], k * sizeof(n->keys[0]));
+	memmove(&n->vals[i + 1], &n->vals[i], k * sizeof(n->vals[0]));
+
+	n->keys[i] = key;
+	n->vals[i] = ptr;
+	n->nkeys++;
+}
+
+static void node_remove_at(struct btree_node *n, int i)
+{
+	size_t k = (size_t)(n->nkeys - i - 1);
+
+	memmove(&n->keys[i], &n->keys[i + 1], k * sizeof(n->keys[0]));
+	memmove(&n->vals[i], &n->vals[i + 1], k * sizeof(n->vals[0]));
+
+	n->nkeys--;
+}
+
+static struct btree_node *node_split(struct btree_node *n)
+{
+	struct btree_node *right = node_new();
+	int half = n->nkeys / 2;
+
+	right->leaf = n->leaf;
+	right->nkeys = n->nkeys - half;
+
+	memcpy(right->keys, &n->keys[half], (size_t)right->nkeys * sizeof(n->keys[0]));
+	memcpy(right->vals, &n->vals[half], (size_t)right->nkeys * sizeof(n->vals[0]));
+
+	n->nkeys = half;
+
+	return right;
+}
+
+void btree_init(struct btree *tree)
+{
+	tree->root = NULL;
+	tree->height = 0;
+}
+
+void *btree_find_le(struct btree *tree, uint64_t key, uint64_t *found)
+{
+	struct btree_node *n = rcu_dereference(tree->root);
+
+	while (n) {
+		int i = __pos(n, key);
+
+		if (i < 0)
+			return NULL;
+
+		if (n->leaf) {
+			if (found)
+				*found = n->keys[i];
+
+			return n->vals[i];
+		}
+
+		n = n->child[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Insert into a copy of @n. If the copy overflows, it is split and the right
+ * half is returned in @right.
+ */
+static struct btree_node *__insert(struct btree_node *n, uint64_t key, void *val,
+				   struct btree_node **right, struct btree_retired *r)
+{
+	struct btree_node *m = node_copy(n);
+	int i = __pos(n, key);
+
+	retire(r, n);
+
+	if (n->leaf) {
+		node_insert_at(m, i + 1, key, val);
+	} else {
+		struct btree_node *c, *split = NULL;
+
+		/* smaller than any key; goes into the leftmost child */
+		if (i < 0)
+			i = 0;
+
+		c = __insert(n->child[i], key, val, &split, r);
+
+		m->child[i] = c;
+		m->keys[i] = c->keys[0];
+
+		if (split)
+			node_insert_at(m, i + 1, split->keys[0], split);
+	}
+
+	*right = NULL;
+
+	if (m->nkeys == BTREE_ORDER)
+		*right = node_split(m);
+
+	return m;
+}
+
+int btree_insert(struct btree *tree, uint64_t key, void *val)
+{
+	struct btree_retired r = {};
+	struct btree_node *root, *split;
+	uint64_t found;
+
+	if (btree_find_le(tree, key, &found) && found == key) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (!tree->root) {
+		root = node_new();
+
+		root->leaf = true;
+		root->nkeys = 1;
+		root->keys[0] = key;
+		root->vals[0] = val;
+
+		tree->height = 1;
+
+		rcu_assign_pointer(tree->root, root);
+
+		return 0;
+	}
+
+	root = __insert(tree->root, key, val, &split, &r);
+
+	if (split) {
+		struct btree_node *top = node_new();
+
+		top->nkeys = 2;
+		top->keys[0] = root->keys[0];
+		top->child[0] = root;
+		top->keys[1] = split->keys[0];
+		top->child[1] = split;
+
+		root = top;
+
+		tree->height++;
+		assert(tree->height < BTREE_MAX_HEIGHT);
+	}
+
+	rcu_assign_pointer(tree->root, root);
+
+	reclaim(&r);
+
+	return 0;
+}
+
+/* merge children @l and @l + 1 of @m if they are sufficiently empty */
+static void __merge(struct btree_node *m, int l, struct btree_node *fresh,
+		    struct btree_retired *r)
+{
+	struct btree_node *a = m->child[l], *b = m->child[l + 1], *merged;
+
+	if (a->nkeys + b->nkeys >= BTREE_ORDER)
+		return;
+
+	merged = node_copy(a);
+
+	memcpy(&merged->keys[a->nkeys], b->keys, (size_t)b->nkeys * sizeof(b->keys[0]));
+	memcpy(&merged->vals[a->nkeys], b->vals, (size_t)b->nkeys * sizeof(b->vals[0]));
+	merged->nkeys = a->nkeys + b->nkeys;
+
+	/* @fresh was never published and can be freed right away */
+	if (a == fresh)
+		node_free(a);
+	else
+		retire(r, a);
+
+	if (b == fresh)
+		node_free(b);
+	else
+		retire(r, b);
+
+	m->child[l] = merged;
+	node_remove_at(m, l + 1);
+}
+
+/* remove @key from a copy of @n; returns NULL if the copy would be empty */
+static struct btree_node *__remove(struct btree_node *n, uint64_t key, void **val,
+				   struct btree_retired *r)
+{
+	struct btree_node *m = node_copy(n);
+	int i = __pos(n, key);
+
+	retire(r, n);
+
+	if (n->leaf) {
+		*val = n->vals[i];
+		node_remove_at(m, i);
+	} else {
+		struct btree_node *c = __remove(n->child[i], key, val, r);
+
+		if (!c) {
+			node_remove_at(m, i);
+		} else {
+			m->child[i] = c;
+			m->keys[i] = c->keys[0];
+
+			if (c->nkeys < BTREE_ORDER / 4 && m->nkeys > 1)
+				__merge(m, i > 0 ? i - 1 : i, c, r);
+		}
+	}
+
+	if (!m->nkeys) {
+		node_free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+void *btree_remove(struct btree *tree, uint64_t key)
+{
+	struct btree_retired r = {};
+	struct btree_node *root;
+	uint64_t found;
+	void *val;
+
+	if (!btree_find_le(tree, key, &found) || found != key) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	root = __remove(tree->root, key, &val, &r);
+
+	/* collapse interior nodes with a single child (never published) */
+	while (root && !root->leaf && root->nkeys == 1) {
+		struct btree_node *child = root->child[0];
+
+		node_free(root);
+		root = child;
+
+		tree->height--;
+	}
+
+	if (!root)
+		tree->height = 0;
+
+	rcu_assign_pointer(tree->root, root);
+
+	reclaim(&r);
+
+	return val;
+}
+
+static void __for_each(struct btree_node *n, btree_iter_fn fn, void *opaque)
+{
+	for (int i = 0; i < n->nkeys; i++) {
+		if (n->leaf)
+			fn(opaque, n->keys[i], n->vals[i]);
+		else
+			__for_each(n->child[i], fn, opaque);
+	}
+}
+
+void btree_for_each(struct btree *tree, btree_iter_fn fn, void *opaque)
+{
+	struct btree_node *root = rcu_dereference(tree->root);
+
+	if (root)
+		__for_each(root, fn, opaque);
+}
+
+static void __clear(struct btree_node *n, btree_iter_fn fn, void *opaque)
+{
+	for (int i = 0; i < n->nkeys; i++) {
+		if (n->leaf) {
+			if (fn)
+				fn(opaque, n->keys[i], n->vals[i]);
+
+			continue;
+		}
+
+		__clear(n->child[i], fn, opaque);
+	}
+
+	node_free(n);
+}
+
+void btree_clear_with(struct btree *tree, btree_iter_fn fn, void *opaque)
+{
+	struct btree_node *root = tree->root;
+
+	if (!root)
+		return;
+
+	rcu_assign_pointer(tree->root, NULL);
+	tree->height = 0;
+
+	synchronize_rcu();
+
+	__clear(root, fn, opaque);
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Read-mostly ordered index (copy-on-write B+tree).
+ *
+ * Lookups are lock-free and must be done within an rcu read-side critical
+ * section (see rcu.h). Modifications copy the path from the root to the
+ * affected leaf and publish the new root atomically; replaced nodes are freed
+ * with rcu_free(). Writers must be serialized by the caller.
+ */
+
+#ifndef BTREE_ORDER
+#define BTREE_ORDER 32
+#endif
+
+struct btree_node {
+	int nkeys;
+	bool leaf;
+
+	/* for interior nodes, keys[i] is the smallest key in child[i] */
+	uint64_t keys[BTREE_ORDER];
+
+	union {
+		void *vals[BTREE_ORDER];
+		struct btree_node *child[BTREE_ORDER];
+	};
+};
+
+struct btree {
+	struct btree_node *root;
+	int height;
+};
+
+typedef void (*btree_iter_fn)(void *opaque, uint64_t key, void *val);
+
+void btree_init(struct btree *tree);
+void btree_clear_with(struct btree *tree, btree_iter_fn fn, void *opaque);
+
+/* call @fn for each entry in key order; from a read-side section or a writer */
+void btree_for_each(struct btree *tree, btree_iter_fn fn, void *opaque);
+void *btree_find_le(struct btree *tree, uint64_t key, uint64_t *found);
+int btree_insert(struct btree *tree, uint64_t key, void *val);
+void *btree_remove(struct btree *tree, uint64_t key);
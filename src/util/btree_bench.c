@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ccan/compiler/compiler.h"
+
+#include "vfn/support.h"
+
+#include "btree.h"
+#include "rcu.h"
+#include "skiplist.h"
+
+#define LOOKUPS 100000
+
+struct entry {
+	uint64_t key;
+
+	struct skiplist_node list;
+};
+
+static int __cmp(const void *key, const struct skiplist_node *n)
+{
+	struct entry *e = container_of_var(n, e, list);
+	const uint64_t *k = key;
+
+	if (*k < e->key)
+		return -1;
+	else if (*k > e->key)
+		return 1;
+
+	return 0;
+}
+
+static double ns(uint64_t ticks)
+{
+	return (double)ticks * 1e9 / (double)get_ticks_freq() / LOOKUPS;
+}
+
+static void bench(int n)
+{
+	struct entry *entries = znew_t(struct entry, n);
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	uint64_t start, t_insert[2], t_find[2];
+	struct skiplist list;
+	struct btree tree;
+	unsigned long sink = 0;
+
+	skiplist_init(&list);
+	btree_init(&tree);
+
+	srand(1);
+
+	for (int i = 0; i < n; i++)
+		entries[i].key = (uint64_t)i << 12;
+
+	/* insert in random order */
+	for (int i = n - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		uint64_t tmp = entries[i].key;
+
+		entries[i].key = entries[j].key;
+		entries[j].key = tmp;
+	}
+
+	start = get_ticks();
+	for (int i = 0; i < n; i++) {
+		struct skiplist_node *update[SKIPLIST_LEVELS] = {};
+
+		skiplist_find(&list, &entries[i].key, __cmp, update);
+		skiplist_link(&list, &entries[i].list, update);
+	}
+	t_insert[0] = get_ticks() - start;
+
+	start = get_ticks();
+	for (int i = 0; i < n; i++)
+		btree_insert(&tree, entries[i].key, &entries[i]);
+	t_insert[1] = get_ticks() - start;
+
+	/* lookups, taking the lock the skiplist based iova map needs */
+	start = get_ticks();
+	for (int i = 0; i < LOOKUPS; i++) {
+		uint64_t key = (uint64_t)(rand() % n) << 12;
+
+		pthread_mutex_lock(&lock);
+		sink += (uintptr_t)skiplist_find(&list, &key, __cmp, NULL);
+		pthread_mutex_unlock(&lock);
+	}
+	t_find[0] = get_ticks() - start;
+
+	start = get_ticks();
+	for (int i = 0; i < LOOKUPS; i++) {
+		uint64_t key = (uint64_t)(rand() % n) << 12;
+
+		rcu_read_lock();
+		sink += (uintptr_t)btree_find_le(&tree, key, NULL);
+		rcu_read_unlock();
+	}
+	t_find[1] = get_ticks() - start;
+
+	printf("%8d %14.1f %14.1f %14.1f %14.1f\n", n,
+	       (double)t_insert[0] * 1e9 / (double)get_ticks_freq() / n,
+	       (double)t_insert[1] * 1e9 / (double)get_ticks_freq() / n,
+	       ns(t_find[0]), ns(t_find[1]));
+
+	if (!sink)
+		fprintf(stderr, "no lookups succeeded\n");
+
+	skiplist_clear_with(&list, NULL, NULL);
+	btree_clear_with(&tree, NULL, NULL);
+
+	free(entries);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED)
+{
+	printf("average ns per operation\n");
+	printf("%8s %14s %14s %14s %14s\n", "n", "skiplist ins", "btree ins",
+	       "skiplist find", "btree find");
+
+	for (int n = 1000; n <= 1000000; n *= 10)
+		bench(n);
+
+	return 0;
+}
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/tap/tap.h"
+
+#include "vfn/support.h"
+
+#include "btree.c"
+
+#define N 20000
+
+static struct btree tree;
+static uint64_t keys[N];
+static bool stop;
+
+static void shuffle(uint64_t *v, int n)
+{
+	for (int i = n - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		uint64_t tmp = v[i];
+
+		v[i] = v[j];
+		v[j] = tmp;
+	}
+}
+
+static bool check(int from, int to, bool present)
+{
+	for (int i = from; i < to; i++) {
+		uint64_t k = (uint64_t)i * 16, found;
+		void *v;
+
+		rcu_read_lock();
+		v = btree_find_le(&tree, k + 8, &found);
+		rcu_read_unlock();
+
+		if (present && (found != k || v != (void *)(uintptr_t)(k + 1)))
+			return false;
+
+		if (!present && v && found == k)
+			return false;
+	}
+
+	return true;
+}
+
+static void *reader(void *opaque UNUSED)
+{
+	unsigned long bad = 0;
+
+	while (!atomic_load_acquire(&stop)) {
+		/* be nice to the writer on small machines */
+		sched_yield();
+
+		for (int i = 0; i < N; i += 97) {
+			uint64_t k = (uint64_t)i * 16, found;
+			void *v;
+
+			rcu_read_lock();
+			v = btree_find_le(&tree, k, &found);
+			if (v && (uintptr_t)v != found + 1)
+				bad++;
+			rcu_read_unlock();
+		}
+	}
+
+	return (void *)bad;
+}
+
+static void count(void *opaque, uint64_t key UNUSED, void *val UNUSED)
+{
+	(*(int *)opaque)++;
+}
+
+struct order {
+	uint64_t last;
+	int n;
+	bool ok;
+};
+
+static void check_order(void *opaque, uint64_t key, void *val UNUSED)
+{
+	struct order *o = opaque;
+
+	if (o->n++ && key <= o->last)
+		o->ok = false;
+
+	o->last = key;
+}
+
+int main(void)
+{
+	struct order order = { .ok = true, };
+	pthread_t threads[2];
+	bool ok_remove = true;
+	int cleared = 0;
+	void *bad;
+
+	plan_tests(16);
+
+	btree_init(&tree);
+
+	rcu_read_lock();
+	ok1(btree_find_le(&tree, 0, NULL) == NULL);
+	rcu_read_unlock();
+
+	for (int i = 0; i < N; i++)
+		keys[i] = (uint64_t)i * 16;
+
+	shuffle(keys, N);
+
+	for (int t = 0; t < 2; t++)
+		pthread_create(&threads[t], NULL, reader, NULL);
+
+	for (int i = 0; i < N; i++) {
+		if (btree_insert(&tree, keys[i], (void *)(uintptr_t)(keys[i] + 1)))
+			fail("insert %" PRIu64, keys[i]);
+	}
+
+	ok1(check(0, N, true));
+
+	ok1(btree_insert(&tree, 16, (void *)0x1) == -1 && errno == EEXIST);
+	ok1(tree.height > 1 && tree.height < 6);
+
+	/* below the smallest key */
+	ok1(btree_insert(&tree, N * 16 + 32, (void *)0x1) == 0);
+	ok1(btree_remove(&tree, 0) == (void *)0x1);
+
+	rcu_read_lock();
+	ok1(btree_find_le(&tree, 8, NULL) == NULL);
+	rcu_read_unlock();
+
+	ok1(btree_insert(&tree, 0, (void *)0x1) == 0);
+
+	/* remove the upper half in random order */
+	shuffle(keys, N);
+
+	for (int i = 0; i < N; i++) {
+		if (keys[i] < N / 2 * 16)
+			continue;
+
+		if (btree_remove(&tree, keys[i]) != (void *)(uintptr_t)(keys[i] + 1))
+			ok_remove = false;
+	}
+
+	ok1(ok_remove);
+	ok1(check(0, N / 2, true));
+	ok1(check(N / 2, N, false));
+
+	ok1(btree_remove(&tree, 16 * N) == NULL && errno == ENOENT);
+
+	atomic_store_release(&stop, true);
+
+	for (int t = 0; t < 2; t++) {
+		pthread_join(threads[t], &bad);
+		if (bad)
+			fail("reader %d saw %lu inconsistent entries", t, (unsigned long)bad);
+	}
+
+	btree_for_each(&tree, check_order, &order);
+	ok1(order.ok && order.n == N / 2 + 1);
+
+	btree_clear_with(&tree, count, &cleared);
+	ok1(cleared == N / 2 + 1);
+	ok1(tree.root == NULL);
+
+	/* the tree is usable after clearing */
+	ok1(btree_insert(&tree, 42, (void *)0x1) == 0);
+
+	return exit_status();
+}
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later or MIT
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "vfn/support.h"
+
+#include "rcu.h"
+
+/* starts at 1; a reader epoch of 0 means quiescent */
+unsigned long rcu_epoch = 1;
+__thread struct rcu_reader *__rcu_reader;
+
+/* number of deferred frees that triggers a grace period */
+#define RCU_FREE_BATCH 128
+
+static LIST_HEAD(rcu_readers);
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+
+struct rcu_deferred_free {
+	void *ptr;
+
+	void (*fn)(void *opaque, void *ptr);
+	void *opaque;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct rcu_deferred_free frees[RCU_FREE_BATCH];
+	int n;
+} rcu_deferred = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void rcu_unregister_thread(void *opaque)
+{
+	__autolock(&rcu_lock);
+
+	struct rcu_reader *r = opaque;
+
+	atomic_store_release(&r->epoch, 0);
+	r->in_use = false;
+}
+
+static void rcu_init_key(void)
+{
+	if (pthread_key_create(&rcu_key, rcu_unregister_thread))
+		abort();
+}
+
+struct rcu_reader *__rcu_register_thread(void)
+{
+	__autolock(&rcu_lock);
+
+	struct rcu_reader *r;
+
+	pthread_once(&rcu_once, rcu_init_key);
+
+	/* reuse the record of an exited thread if possible */
+	list_for_each(&rcu_readers, r, list) {
+		if (!r->in_use)
+			goto found;
+	}
+
+	r = znew_t(struct rcu_reader, 1);
+	list_add_tail(&rcu_readers, &r->list);
+
+found:
+	r->in_use = true;
+	r->nesting = 0;
+
+	pthread_setspecific(rcu_key, r);
+
+	__rcu_reader = r;
+
+	return r;
+}
+
+void synchronize_rcu(void)
+{
+	__autolock(&rcu_lock);
+
+	struct rcu_reader *r;
+	unsigned long epoch;
+
+	epoch = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+
+	/* wait for readers that entered their critical section before the bump */
+	list_for_each(&rcu_readers, r, list) {
+		unsigned long e;
+
+		while ((e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST)) && e < epoch)
+			sched_yield();
+	}
+}
+
+static void __rcu_free_flush(void)
+{
+	synchronize_rcu();
+
+	for (int i = 0; i < rcu_deferred.n; i++) {
+		struct rcu_deferred_free *f = &rcu_deferred.frees[i];
+
+		if (f->fn)
+			f->fn(f->opaque, f->ptr);
+		else
+			free(f->ptr);
+	}
+
+	rcu_deferred.n = 0;
+}
+
+void rcu_free_with(void *ptr, void (*fn)(void *opaque, void *ptr), void *opaque)
+{
+	__autolock(&rcu_deferred.lock);
+
+	if (!ptr)
+		return;
+
+	rcu_deferred.frees[rcu_deferred.n++] = (struct rcu_deferred_free) {
+		.ptr = ptr,
+		.fn = fn,
+		.opaque = opaque,
+	};
+
+	if (rcu_deferred.n == RCU_FREE_BATCH)
+		__rcu_free_flush();
+}
+
+void rcu_free(void *ptr)
+{
+	rcu_free_with(ptr, NULL, NULL);
+}
+
+void rcu_free_flush(void)
+{
+	__autolock(&rcu_deferred.lock);
+
+	if (rcu_deferred.n)
+		__rcu_free_flush();
+}
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later or MIT */
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All Rights Reserved.
+ *
+ * This library (libvfn) is dual licensed under the GNU Lesser General
+ * Public License version 2.1 or later or the MIT license. See the
+ * COPYING and LICENSE files for more information.
+ */
+
+/*
+ * Minimal epoch-based read-copy-update.
+ *
+ * Readers bracket accesses with rcu_read_lock()/rcu_read_unlock(), which only
+ * touch thread-local state. Writers publish a new version of the data and call
+ * synchronize_rcu() before freeing the old version; this waits for all readers
+ * that may still hold a reference to the old version.
+ *
+ * Alternatively, rcu_free() defers freeing of a pointer until a grace period
+ * has elapsed, amortizing the cost of synchronize_rcu() over many calls.
+ * rcu_free_with() does the same for memory that is not released with free().
+ *
+ * Neither synchronize_rcu() nor rcu_free() may be called from within a
+ * read-side critical section.
+ */
+
+#include "ccan/list/list.h"
+
+struct rcu_reader {
+	/* epoch observed at rcu_read_lock(); 0 when quiescent */
+	unsigned long epoch;
+	int nesting;
+
+	bool in_use;
+	struct list_node list;
+};
+
+extern unsigned long rcu_epoch;
+extern __thread struct rcu_reader *__rcu_reader;
+
+struct rcu_reader *__rcu_register_thread(void);
+
+static inline void rcu_read_lock(void)
+{
+	struct rcu_reader *r = __rcu_reader;
+
+	if (!r)
+		r = __rcu_register_thread();
+
+	if (r->nesting++)
+		return;
+
+	/* the store must be visible before any subsequent load of protected data */
+	__atomic_store_n(&r->epoch, atomic_load_acquire(&rcu_epoch), __ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock(void)
+{
+	struct rcu_reader *r = __rcu_reader;
+
+	if (--r->nesting)
+		return;
+
+	atomic_store_release(&r->epoch, 0);
+}
+
+#define rcu_dereference(p) atomic_load_acquire(&(p))
+#define rcu_assign_pointer(p, v) atomic_store_release(&(p), v)
+
+void synchronize_rcu(void);
+void rcu_free(void *ptr);
+void rcu_free_with(void *ptr, void (*fn)(void *opaque, void *ptr), void *opaque);
+void rcu_free_flush(void);
@@ -40,7 +40,7 @@
 #include "ccan/minmax/minmax.h"
 #include "ccan/str/str.h"
 
-int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count)
+int vfio_set_irq_range(struct vfio_device *dev, int *eventfds, int start, int count)
 {
 	struct vfio_irq_set *irq_set;
 	size_t irq_set_size;
@@ -59,7 +59,7 @@ int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count)
 		.argsz = (uint32_t)irq_set_size,
 		.flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
 		.index = dev->irq_info.index,
-		.start = 0,
+		.start = start,
 		.count = count,
 	};
 
@@ -76,6 +76,11 @@ int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count)
 	return 0;
 }
 
+int vfio_set_irq(struct vfio_device *dev, int *eventfds, int count)
+{
+	return vfio_set_irq_range(dev, eventfds, 0, count);
+}
+
 int vfio_disable_irq(struct vfio_device *dev)
 {
 	struct vfio_irq_set irq_set;
@@ -42,6 +42,7 @@
 #include "ccan/minmax/minmax.h"
 #include "ccan/str/str.h"
 #include "ccan/list/list.h"
+#include "ccan/time/time.h"
 
 #include "iommu/context.h"
 
@@ -64,6 +65,79 @@ static int pci_set_bus_master(struct vfio_pci_device *pci)
 	return 0;
 }
 
+static struct vfio_info_cap_header *vfio_region_info_cap(struct vfio_region_info *info,
+							   uint16_t id)
+{
+	struct vfio_info_cap_header *hdr;
+	uint32_t off;
+
+	if (!(info->flags & VFIO_REGION_INFO_FLAG_CAPS))
+		return NULL;
+
+	for (off = info->cap_offset; off; off = hdr->next) {
+		if (off + sizeof(*hdr) > info->argsz)
+			return NULL;
+
+		hdr = (void *)info + off;
+
+		if (hdr->id == id)
+			return hdr;
+	}
+
+	return NULL;
+}
+
+static int vfio_pci_init_bar_mmap_areas(struct vfio_pci_device *pci, int idx)
+{
+	struct vfio_region_info *info = &pci->bar_region_info[idx];
+	struct vfio_region_info_cap_sparse_mmap *sparse;
+	__autofree struct vfio_region_info *full = NULL;
+	int n;
+
+	pci->nbar_mmap_areas[idx] = 0;
+
+	if (!(info->flags & VFIO_REGION_INFO_FLAG_MMAP) || !info->size)
+		return 0;
+
+	/* the caps did not fit; vfio updated argsz to the required size */
+	if (info->flags & VFIO_REGION_INFO_FLAG_CAPS && info->argsz > sizeof(*info)) {
+		full = zmallocn(1, info->argsz);
+
+		full->argsz = info->argsz;
+		full->index = info->index;
+
+		if (ioctl(pci->dev.fd, VFIO_DEVICE_GET_REGION_INFO, full)) {
+			log_debug("failed to get bar region info capabilities\n");
+			return -1;
+		}
+
+		sparse = (void *)vfio_region_info_cap(full, VFIO_REGION_INFO_CAP_SPARSE_MMAP);
+		if (sparse) {
+			n = (int)min_t(uint32_t, sparse->nr_areas, VFIO_PCI_MAX_MMAP_AREAS);
+
+			if (sparse->nr_areas > VFIO_PCI_MAX_MMAP_AREAS)
+				log_info("bar %d has %u mmap-able areas; only using the first %d\n",
+					 idx, sparse->nr_areas, n);
+
+			memcpy(pci->bar_mmap_areas[idx], sparse->areas,
+			       n * sizeof(struct vfio_region_sparse_mmap_area));
+
+			pci->nbar_mmap_areas[idx] = n;
+
+			return 0;
+		}
+	}
+
+	pci->bar_mmap_areas[idx][0] = (struct vfio_region_sparse_mmap_area) {
+		.offset = 0,
+		.size = info->size,
+	};
+
+	pci->nbar_mmap_areas[idx] = 1;
+
+	return 0;
+}
+
 static int vfio_pci_init_bar(struct vfio_pci_device *pci, int idx)
 {
 	assert(idx < PCI_STD_NUM_BARS);
@@ -78,7 +152,7 @@ static int vfio_pci_init_bar(struct vfio_pci_device *pci, int idx)
 		return -1;
 	}
 
-	return 0;
+	return vfio_pci_init_bar_mmap_areas(pci, idx);
 }
 
 static int vfio_pci_init_irq(struct vfio_pci_device *pci)
@@ -109,6 +183,33 @@ static int vfio_pci_init_irq(struct vfio_pci_device *pci)
 	return 0;
 }
 
+int vfio_pci_get_bar_mmap_areas(struct vfio_pci_device *pci, int idx,
+				const struct vfio_region_sparse_mmap_area **areas)
+{
+	assert(idx < PCI_STD_NUM_BARS);
+
+	*areas = pci->bar_mmap_areas[idx];
+
+	return pci->nbar_mmap_areas[idx];
+}
+
+static bool vfio_pci_bar_mappable(struct vfio_pci_device *pci, int idx, size_t len,
+				  uint64_t offset)
+{
+	for (int i = 0; i < pci->nbar_mmap_areas[idx]; i++) {
+		struct vfio_region_sparse_mmap_area *area = &pci->bar_mmap_areas[idx][i];
+
+		if (offset >= area->offset && offset + len <= area->offset + area->size)
+			return true;
+	}
+
+	log_debug("bar %d range [0x%" PRIx64 "; 0x%zx] is not mmap-able\n", idx, offset, len);
+
+	errno = EINVAL;
+
+	return false;
+}
+
 void *vfio_pci_map_bar(struct vfio_pci_device *pci, int idx, size_t len, uint64_t offset,
 		       int prot)
 {
@@ -117,6 +218,10 @@ void *vfio_pci_map_bar(struct vfio_pci_device *pci, int idx, size_t len, uint64_
 	assert(idx < PCI_STD_NUM_BARS);
 
 	len = min_t(size_t, len, pci->bar_region_info[idx].size - offset);
+
+	if (!vfio_pci_bar_mappable(pci, idx, len, offset))
+		return NULL;
+
 	offset = pci->bar_region_info[idx].offset + offset;
 
 	mem = mmap(NULL, len, prot, MAP_SHARED, pci->dev.fd, offset);
@@ -128,6 +233,43 @@ void *vfio_pci_map_bar(struct vfio_pci_device *pci, int idx, size_t len, uint64_
 	return mem;
 }
 
+void *vfio_pci_map_bar_wc(struct vfio_pci_device *pci, int idx, size_t len, uint64_t offset,
+			  int prot)
+{
+	__autofree char *path = NULL;
+	void *mem;
+	int fd;
+
+	assert(idx < PCI_STD_NUM_BARS);
+
+	len = min_t(size_t, len, pci->bar_region_info[idx].size - offset);
+
+	if (!vfio_pci_bar_mappable(pci, idx, len, offset))
+		return NULL;
+
+	/* vfio maps bars uncached; the sysfs resource file is the only way to get wc */
+	if (asprintf(&path, "/sys/bus/pci/devices/%s/resource%d_wc", pci->bdf, idx) < 0) {
+		log_debug("asprintf failed\n");
+		return NULL;
+	}
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		log_info("write-combining not available for bar %d; mapping uncached\n", idx);
+		return vfio_pci_map_bar(pci, idx, len, offset, prot);
+	}
+
+	mem = mmap(NULL, len, prot, MAP_SHARED, fd, (off_t)offset);
+	close(fd);
+
+	if (mem == MAP_FAILED) {
+		log_info("failed to map bar %d write-combining; mapping uncached\n", idx);
+		return vfio_pci_map_bar(pci, idx, len, offset, prot);
+	}
+
+	return mem;
+}
+
 void vfio_pci_unmap_bar(struct vfio_pci_device *pci, int idx, void *mem, size_t len,
 			uint64_t offset)
 {
@@ -139,13 +281,335 @@ void vfio_pci_unmap_bar(struct vfio_pci_device *pci, int idx, void *mem, size_t
 		log_debug("failed to unmap bar region\n");
 }
 
-int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
+void vfio_pci_memcpy_to_bar(void *dst, const void *src, size_t len)
 {
-	pci->bdf = bdf;
+	size_t n;
 
-	if (!pci->dev.ctx)
-		pci->dev.ctx = iommu_get_default_context();
+	for (; len && !ALIGNED((uintptr_t)dst, 16); dst++, src++, len--)
+		/* memory-mapped region */
+		*(volatile uint8_t __force *)dst = *(const uint8_t *)src;
+
+	n = ALIGN_DOWN(len, 16);
+
+	mmio_stream(dst, src, n);
+
+	for (dst += n, src += n, len -= n; len; dst++, src++, len--)
+		/* memory-mapped region */
+		*(volatile uint8_t __force *)dst = *(const uint8_t *)src;
+
+	wmb();
+}
+
+void vfio_pci_memcpy_from_bar(void *dst, const void *src, size_t len)
+{
+	for (; len && !ALIGNED((uintptr_t)src, 8); dst++, src++, len--)
+		/* memory-mapped region */
+		*(uint8_t *)dst = *(const volatile uint8_t __force *)src;
+
+	for (; len >= 8; dst += 8, src += 8, len -= 8) {
+		/* memory-mapped region */
+		uint64_t v = *(const volatile uint64_t __force *)src;
+
+		memcpy(dst, &v, sizeof(v));
+	}
+
+	for (; len; dst++, src++, len--)
+		/* memory-mapped region */
+		*(uint8_t *)dst = *(const volatile uint8_t __force *)src;
+}
+
+/* the extended configuration space */
+#define VFIO_PCI_CONFIG_MAX 4096
+
+const void *vfio_pci_config_snapshot(struct vfio_pci_device *pci, size_t *len)
+{
+	size_t size = min_t(size_t, pci->config_region_info.size, VFIO_PCI_CONFIG_MAX);
+	ssize_t ret;
+
+	if (pci->config_len)
+		goto out;
+
+	if (!pci->config)
+		pci->config = xmalloc(VFIO_PCI_CONFIG_MAX);
+
+	ret = vfio_pci_read_config(pci, pci->config, size, 0);
+	if (ret < 0) {
+		log_debug("failed to read pci config region\n");
+		return NULL;
+	}
+
+	if (ret < PCI_STD_HEADER_SIZEOF) {
+		log_debug("short read of pci config region\n");
+
+		errno = EIO;
+		return NULL;
+	}
+
+	/* anything beyond the snapshot reads as zero */
+	memset(pci->config + ret, 0x0, VFIO_PCI_CONFIG_MAX - (size_t)ret);
+
+	pci->config_len = (size_t)ret;
+
+out:
+	if (len)
+		*len = pci->config_len;
+
+	return pci->config;
+}
+
+void vfio_pci_config_invalidate(struct vfio_pci_device *pci)
+{
+	pci->config_len = 0;
+}
+
+static inline uint16_t __cfg16(const uint8_t *cfg, int off)
+{
+	uint16_t v;
+
+	memcpy(&v, cfg + off, sizeof(v));
+
+	return le16_to_cpu(v);
+}
+
+static inline uint32_t __cfg32(const uint8_t *cfg, int off)
+{
+	uint32_t v;
+
+	memcpy(&v, cfg + off, sizeof(v));
+
+	return le32_to_cpu(v);
+}
+
+int vfio_pci_find_cap(struct vfio_pci_device *pci, uint8_t id)
+{
+	const uint8_t *cfg;
+	int off, ttl;
+
+	cfg = vfio_pci_config_snapshot(pci, NULL);
+	if (!cfg)
+		return -1;
+
+	if (!(__cfg16(cfg, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+		return 0;
+
+	/* bound the walk in case the list loops */
+	ttl = (PCI_CFG_SPACE_SIZE - PCI_STD_HEADER_SIZEOF) / PCI_CAP_SIZEOF;
+
+	for (off = cfg[PCI_CAPABILITY_LIST] & ~0x3; off >= PCI_STD_HEADER_SIZEOF && ttl--;
+	     off = cfg[off + PCI_CAP_LIST_NEXT] & ~0x3) {
+		if (cfg[off + PCI_CAP_LIST_ID] == id)
+			return off;
+	}
+
+	return 0;
+}
+
+int vfio_pci_find_ext_cap(struct vfio_pci_device *pci, uint16_t id)
+{
+	const uint8_t *cfg;
+	size_t len;
+	int off, ttl;
+
+	cfg = vfio_pci_config_snapshot(pci, &len);
+	if (!cfg)
+		return -1;
+
+	if (len <= PCI_CFG_SPACE_SIZE)
+		return 0;
+
+	ttl = (PCI_CFG_SPACE_EXP_SIZE - PCI_CFG_SPACE_SIZE) / 8;
+
+	for (off = PCI_CFG_SPACE_SIZE; off >= PCI_CFG_SPACE_SIZE && ttl--;) {
+		uint32_t hdr = __cfg32(cfg, off);
+
+		if (hdr == 0x0 || hdr == 0xffffffff)
+			break;
+
+		if (PCI_EXT_CAP_ID(hdr) == id)
+			return off;
+
+		off = (int)PCI_EXT_CAP_NEXT(hdr);
+	}
+
+	return 0;
+}
+
+/* find the capability and return the snapshot */
+static const uint8_t *__get_cap(struct vfio_pci_device *pci, uint16_t id, bool ext, int *off)
+{
+	*off = ext ? vfio_pci_find_ext_cap(pci, id) : vfio_pci_find_cap(pci, (uint8_t)id);
+	if (*off < 0)
+		return NULL;
+
+	if (!*off) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	return pci->config;
+}
+
+int vfio_pci_get_msix_info(struct vfio_pci_device *pci, struct vfio_pci_msix_info *info)
+{
+	const uint8_t *cfg;
+	uint32_t table, pba;
+	int off;
+
+	cfg = __get_cap(pci, PCI_CAP_ID_MSIX, false, &off);
+	if (!cfg)
+		return -1;
+
+	table = __cfg32(cfg, off + PCI_MSIX_TABLE);
+	pba = __cfg32(cfg, off + PCI_MSIX_PBA);
+
+	*info = (struct vfio_pci_msix_info) {
+		.nvec = (__cfg16(cfg, off + PCI_MSIX_FLAGS) & PCI_MSIX_FLAGS_QSIZE) + 1,
+		.table_bir = (int)(table & PCI_MSIX_TABLE_BIR),
+		.table_offset = table & PCI_MSIX_TABLE_OFFSET,
+		.pba_bir = (int)(pba & PCI_MSIX_PBA_BIR),
+		.pba_offset = pba & PCI_MSIX_PBA_OFFSET,
+	};
+
+	return 0;
+}
+
+int vfio_pci_get_link_info(struct vfio_pci_device *pci, struct vfio_pci_link_info *info)
+{
+	const uint8_t *cfg;
+	uint32_t lnkcap;
+	uint16_t lnksta;
+	int off;
+
+	cfg = __get_cap(pci, PCI_CAP_ID_EXP, false, &off);
+	if (!cfg)
+		return -1;
+
+	lnkcap = __cfg32(cfg, off + PCI_EXP_LNKCAP);
+	lnksta = __cfg16(cfg, off + PCI_EXP_LNKSTA);
+
+	*info = (struct vfio_pci_link_info) {
+		.max_speed = (uint8_t)(lnkcap & PCI_EXP_LNKCAP_SLS),
+		.max_width = (uint8_t)((lnkcap & PCI_EXP_LNKCAP_MLW) >> 4),
+		.speed = (uint8_t)(lnksta & PCI_EXP_LNKSTA_CLS),
+		.width = (uint8_t)((lnksta & PCI_EXP_LNKSTA_NLW) >> PCI_EXP_LNKSTA_NLW_SHIFT),
+	};
+
+	return 0;
+}
+
+int vfio_pci_get_acs_info(struct vfio_pci_device *pci, struct vfio_pci_acs_info *info)
+{
+	const uint8_t *cfg;
+	int off;
+
+	cfg = __get_cap(pci, PCI_EXT_CAP_ID_ACS, true, &off);
+	if (!cfg)
+		return -1;
+
+	info->cap = __cfg16(cfg, off + PCI_ACS_CAP);
+	info->ctrl = __cfg16(cfg, off + PCI_ACS_CTRL);
+
+	return 0;
+}
+
+/*
+ * A function must be ready to respond to configuration requests within a second
+ * of a function level reset (PCIe r6.0, section 6.6.2); poll for that with
+ * exponential backoff instead of sleeping for the whole period.
+ */
+#define VFIO_PCI_RESET_READY_MSEC 1000
+#define VFIO_PCI_RESET_MAX_SLEEP_USEC 10000
+
+static int vfio_pci_wait_ready(struct vfio_pci_device *pci)
+{
+	struct timeabs deadline = timeabs_add(time_now(),
+					      time_from_msec(VFIO_PCI_RESET_READY_MSEC));
+	useconds_t delay = 1;
+	uint16_t vid;
+
+	do {
+		if (vfio_pci_read_config(pci, &vid, sizeof(vid), PCI_VENDOR_ID) < 0) {
+			log_debug("failed to read pci config region\n");
+			return -1;
+		}
+
+		/* all ones while the function is not responding */
+		if (vid != 0xffff)
+			return 0;
+
+		__usleep(delay);
+
+		delay = min_t(useconds_t, delay * 2, VFIO_PCI_RESET_MAX_SLEEP_USEC);
+	} while (time_before(time_now(), deadline));
+
+	log_debug("timed out\n");
+
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+int vfio_pci_reset(struct vfio_pci_device *pci)
+{
+	uint16_t pci_cmd;
+
+	if (vfio_reset(&pci->dev)) {
+		log_debug("failed to reset device\n");
+		return -1;
+	}
+
+	vfio_pci_config_invalidate(pci);
+
+	if (vfio_pci_wait_ready(pci))
+		return -1;
+
+	/*
+	 * vfio saves and restores the configuration space (bars, msi-x) around
+	 * the reset; only bus mastering may need to be enabled again.
+	 */
+	if (vfio_pci_read_config(pci, &pci_cmd, sizeof(pci_cmd), PCI_COMMAND) < 0) {
+		log_debug("failed to read pci config region\n");
+		return -1;
+	}
 
+	if (!(pci_cmd & PCI_COMMAND_MASTER) && pci_set_bus_master(pci)) {
+		log_debug("failed to set pci bus master\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Process-wide cache of opened devices, keyed by bdf and iommu context. The
+ * cached state is the device as initialized by __vfio_pci_open(), such that
+ * reopening only requires a copy.
+ */
+struct vfio_pci_handle {
+	struct list_node list;
+
+	char *bdf;
+	int refs;
+
+	struct vfio_pci_device pci;
+};
+
+static LIST_HEAD(vfio_pci_handles);
+static pthread_mutex_t vfio_pci_handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct vfio_pci_handle *vfio_pci_find_handle(struct iommu_ctx *ctx, const char *bdf)
+{
+	struct vfio_pci_handle *h;
+
+	list_for_each(&vfio_pci_handles, h, list) {
+		if (h->pci.dev.ctx == ctx && streq(h->bdf, bdf))
+			return h;
+	}
+
+	return NULL;
+}
+
+static int __vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
+{
 	pci->dev.fd = pci->dev.ctx->ops.get_device_fd(pci->dev.ctx, bdf);
 	if (pci->dev.fd < 0) {
 		log_debug("failed to get device fd\n");
@@ -188,3 +652,97 @@ int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
 
 	return 0;
 }
+
+int vfio_pci_open(struct vfio_pci_device *pci, const char *bdf)
+{
+	struct vfio_pci_handle *h;
+
+	__autolock(&vfio_pci_handles_lock);
+
+	if (!pci->dev.ctx)
+		pci->dev.ctx = iommu_get_default_context();
+
+	h = vfio_pci_find_handle(pci->dev.ctx, bdf);
+	if (h) {
+		*pci = h->pci;
+		pci->bdf = bdf;
+
+		/* the device may have been reset since it was last opened */
+		if (pci_set_bus_master(pci)) {
+			log_debug("failed to set pci bus master\n");
+			return -1;
+		}
+
+		h->refs++;
+
+		return 0;
+	}
+
+	pci->bdf = bdf;
+	pci->config = NULL;
+	pci->config_len = 0;
+
+	if (__vfio_pci_open(pci, bdf)) {
+		if (pci->dev.fd >= 0)
+			log_fatal_if(close(pci->dev.fd), "close\n");
+
+		return -1;
+	}
+
+	h = znew_t(struct vfio_pci_handle, 1);
+
+	h->bdf = strdup(bdf);
+	if (!h->bdf)
+		backtrace_abort();
+
+	h->refs = 1;
+	h->pci = *pci;
+
+	list_add_tail(&vfio_pci_handles, &h->list);
+
+	return 0;
+}
+
+void vfio_pci_close(struct vfio_pci_device *pci)
+{
+	struct vfio_pci_handle *h;
+
+	__autolock(&vfio_pci_handles_lock);
+
+	if (!pci->bdf)
+		return;
+
+	h = vfio_pci_find_handle(pci->dev.ctx, pci->bdf);
+	if (!h) {
+		log_debug("device %s is not open\n", pci->bdf);
+		return;
+	}
+
+	assert(h->refs > 0);
+
+	h->refs--;
+	pci->dev.fd = -1;
+
+	free(pci->config);
+	pci->config = NULL;
+	pci->config_len = 0;
+}
+
+void vfio_pci_cache_flush(void)
+{
+	struct vfio_pci_handle *h, *next;
+
+	__autolock(&vfio_pci_handles_lock);
+
+	list_for_each_safe(&vfio_pci_handles, h, next, list) {
+		if (h->refs)
+			continue;
+
+		log_fatal_if(close(h->pci.dev.fd), "close\n");
+
+		list_del(&h->list);
+
+		free(h->bdf);
+		free(h);
+	}
+}
@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <sys/mman.h>
+
+#include "ccan/tap/tap.h"
+
+#include "pci.c"
+
+struct iommu_ctx *iommu_get_default_context(void)
+{
+	return NULL;
+}
+
+static uint8_t cfg[PCI_CFG_SPACE_EXP_SIZE];
+
+static void put16(int off, uint16_t v)
+{
+	v = cpu_to_le16(v);
+	memcpy(&cfg[off], &v, sizeof(v));
+}
+
+static void put32(int off, uint32_t v)
+{
+	v = cpu_to_le32(v);
+	memcpy(&cfg[off], &v, sizeof(v));
+}
+
+static void put_cap(int off, uint8_t id, uint8_t next)
+{
+	cfg[off + PCI_CAP_LIST_ID] = id;
+	cfg[off + PCI_CAP_LIST_NEXT] = next;
+}
+
+int main(void)
+{
+	struct vfio_pci_device pci = {};
+	struct vfio_pci_msix_info msix;
+	struct vfio_pci_link_info link;
+	struct vfio_pci_acs_info acs;
+	uint16_t v16 = 0x0;
+	const uint8_t *snap;
+	size_t len;
+	int fd;
+
+	plan_tests(12);
+
+	put16(PCI_VENDOR_ID, 0x1b36);
+	put16(PCI_STATUS, PCI_STATUS_CAP_LIST);
+	cfg[PCI_CAPABILITY_LIST] = 0x40;
+
+	put_cap(0x40, PCI_CAP_ID_PM, 0x50);
+
+	put_cap(0x50, PCI_CAP_ID_MSIX, 0x70);
+	put16(0x50 + PCI_MSIX_FLAGS, 63);
+	put32(0x50 + PCI_MSIX_TABLE, 0x2000 | 0x0);
+	put32(0x50 + PCI_MSIX_PBA, 0x3000 | 0x4);
+
+	put_cap(0x70, PCI_CAP_ID_EXP, 0x0);
+	put32(0x70 + PCI_EXP_LNKCAP, 0x4 | 4 << 4);
+	put16(0x70 + PCI_EXP_LNKSTA, 0x3 | 2 << PCI_EXP_LNKSTA_NLW_SHIFT);
+
+	put32(0x100, PCI_EXT_CAP_ID_ERR | 0x1 << 16 | 0x148 << 20);
+	put32(0x148, PCI_EXT_CAP_ID_ACS | 0x1 << 16);
+	put16(0x148 + PCI_ACS_CAP, 0x5f);
+	put16(0x148 + PCI_ACS_CTRL, 0x1d);
+
+	fd = memfd_create("config", 0);
+	assert(fd >= 0);
+	assert(pwrite(fd, cfg, sizeof(cfg), 0) == sizeof(cfg));
+
+	pci.dev.fd = fd;
+	pci.config_region_info.size = sizeof(cfg);
+
+	snap = vfio_pci_config_snapshot(&pci, &len);
+	ok1(snap && len == sizeof(cfg) && !memcmp(snap, cfg, sizeof(cfg)));
+
+	ok1(vfio_pci_find_cap(&pci, PCI_CAP_ID_MSIX) == 0x50 &&
+	    vfio_pci_find_cap(&pci, PCI_CAP_ID_EXP) == 0x70 &&
+	    vfio_pci_find_cap(&pci, PCI_CAP_ID_VNDR) == 0);
+
+	ok1(vfio_pci_get_msix_info(&pci, &msix) == 0 && msix.nvec == 64 && msix.table_bir == 0 &&
+	    msix.table_offset == 0x2000 && msix.pba_bir == 4 && msix.pba_offset == 0x3000);
+
+	ok1(vfio_pci_get_link_info(&pci, &link) == 0 && link.max_speed == 4 &&
+	    link.max_width == 4 && link.speed == 3 && link.width == 2);
+
+	ok1(vfio_pci_find_ext_cap(&pci, PCI_EXT_CAP_ID_ACS) == 0x148 &&
+	    vfio_pci_find_ext_cap(&pci, PCI_EXT_CAP_ID_SRIOV) == 0);
+	ok1(vfio_pci_get_acs_info(&pci, &acs) == 0 && acs.cap == 0x5f && acs.ctrl == 0x1d);
+
+	/* the snapshot is not refreshed by itself */
+	put_cap(0x70, PCI_CAP_ID_EXP, 0x80);
+	put_cap(0x80, PCI_CAP_ID_VNDR, 0x0);
+	assert(pwrite(fd, cfg, sizeof(cfg), 0) == sizeof(cfg));
+
+	ok1(vfio_pci_find_cap(&pci, PCI_CAP_ID_VNDR) == 0);
+
+	/* writes invalidate it */
+	ok1(vfio_pci_write_config(&pci, &v16, sizeof(v16), PCI_COMMAND) == sizeof(v16));
+	ok1(vfio_pci_find_cap(&pci, PCI_CAP_ID_VNDR) == 0x80);
+
+	/* a looping list terminates */
+	put_cap(0x80, PCI_CAP_ID_VNDR, 0x40);
+	assert(pwrite(fd, cfg, sizeof(cfg), 0) == sizeof(cfg));
+	vfio_pci_config_invalidate(&pci);
+
+	ok1(vfio_pci_find_cap(&pci, PCI_CAP_ID_AGP) == 0);
+
+	/* no extended configuration space */
+	pci.config_region_info.size = PCI_CFG_SPACE_SIZE;
+	vfio_pci_config_invalidate(&pci);
+
+	ok1(vfio_pci_find_ext_cap(&pci, PCI_EXT_CAP_ID_ACS) == 0);
+	ok1(vfio_pci_get_acs_info(&pci, &acs) == -1 && errno == ENOENT);
+
+	free(pci.config);
+	close(fd);
+
+	return exit_status();
+}
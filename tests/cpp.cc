@@ -1,11 +1,213 @@
 #include <cstddef>
 #include <cstdint>
+#include <stdexcept>
+#include <type_traits>
 
 #include <sys/types.h>
 
-#include <vfn/nvme.h>
+#include <vfn/nvme.hpp>
+
+namespace nvme = vfn::nvme;
+
+/* handles are a single pointer and cannot be copied */
+static_assert(sizeof(nvme::Request) == sizeof(struct nvme_rq *));
+static_assert(!std::is_copy_constructible_v<nvme::Request>);
+static_assert(std::is_nothrow_move_constructible_v<nvme::Request>);
+static_assert(!std::is_copy_constructible_v<nvme::Controller>);
+static_assert(!std::is_copy_constructible_v<nvme::QueuePair>);
+static_assert(!std::is_copy_constructible_v<nvme::DmaBuffer>);
+
+/* command builders are evaluated at compile time */
+constexpr union nvme_cmd rd = nvme::cmd::read(1, 0x100000010ULL, 8);
+
+static_assert(rd.opcode == 0x02 && rd.nsid == 1);
+static_assert(rd.cdw10 == 0x10 && rd.cdw11 == 0x1 && rd.cdw12 == 7);
+static_assert(nvme::cmd::flush(1).opcode == 0x00);
+static_assert(nvme::cmd::identify(0x1).opcode == 0x06);
+
+#ifdef LIBVFN_HAVE_COROUTINE
+static nvme::Task<int> flush(struct nvme_sq *sq)
+{
+	nvme::Completion res = co_await nvme::CommandAwaiter(nullptr, sq, nvme::cmd::flush(1));
+
+	co_return res.error;
+}
+
+static nvme::Task<> flush_twice(struct nvme_sq *sq, int *status)
+{
+	for (int i = 0; i < 2; i++)
+		status[i] = co_await flush(sq);
+}
+
+static void post_cqe(struct nvme_cq *cq, struct nvme_sq *sq, uint16_t sc)
+{
+	union nvme_cmd *sqe = (union nvme_cmd *)sq->vaddr + cq->head;
+	struct nvme_cqe *cqe = (struct nvme_cqe *)cq->vaddr + cq->head;
+
+	cqe->cid = sqe->cid;
+	cqe->sqid = 0;
+	cqe->sfp = cpu_to_le16((uint16_t)(sc << 1 | !cq->phase));
+}
+
+static int test_coroutine(void)
+{
+	alignas(64) static union nvme_cmd sqes[4];
+	static struct nvme_cqe cqes[4];
+	struct nvme_sq sq = {};
+	struct nvme_cq cq = {};
+	struct nvme_rq rqs[3] = {};
+	uint32_t sqdb = 0, cqdb = 0;
+	int status[2] = { -1, -1 };
+	nvme::Executor exec;
+
+	sq.qsize = cq.qsize = 4;
+	sq.vaddr = sqes;
+	sq.doorbell = &sqdb;
+	sq.cq = &cq;
+	sq.rqs = rqs;
+
+	cq.vaddr = cqes;
+	cq.doorbell = &cqdb;
+	cq.efd = -1;
+	cq.nsqs = 1;
+	cq.sqs = &sq;
+
+	for (int i = 2; i >= 0; i--) {
+		rqs[i].sq = &sq;
+		rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&rqs[i]);
+	}
+
+	exec.attach(&sq, &cq);
+	exec.spawn(flush_twice(&sq, status));
+
+	/* the first command is posted, but the doorbell is written by poll() */
+	if (exec.pending() != 1 || sq.tail != 1 || sqdb != 0)
+		return 1;
+
+	if (exec.poll() != 0 || le32_to_cpu(sqdb) != 1)
+		return 1;
+
+	/* the task is resumed from the reaper and posts the second command */
+	post_cqe(&cq, &sq, 0x0);
+
+	if (exec.poll() != 1 || status[0] != 0 || le32_to_cpu(sqdb) != 2)
+		return 1;
+
+	/* invalid field in command */
+	post_cqe(&cq, &sq, 0x2);
+
+	if (exec.poll() != 1 || status[1] == 0 || exec.pending() != 0)
+		return 1;
+
+	/* both trackers were released */
+	struct nvme_rq *top = __nvme_rq_top(&sq, sq.rq_top);
+
+	return top && top->rq_next && top->rq_next->rq_next ? 0 : 1;
+}
+#endif
+
+/* wrap and phase of the power-of-two fast paths */
+static int test_pow2(void)
+{
+	using Q = nvme::Pow2Queue<4>;
+
+	alignas(64) static union nvme_cmd sqes[4];
+	alignas(64) static struct nvme_cqe cqes[4];
+	struct nvme_sq sq = {};
+	struct nvme_cq cq = {};
+	struct nvme_rq rqs[4] = {};
+	struct nvme_cqe *batch[4];
+	union nvme_cmd c = nvme::cmd::flush(1);
+
+	sq.qsize = cq.qsize = 4;
+	sq.vaddr = sqes;
+	sq.rqs = rqs;
+	sq.cq = &cq;
+
+	cq.vaddr = cqes;
+	cq.efd = -1;
+	cq.nsqs = 1;
+	cq.sqs = &sq;
+
+	for (int i = 0; i < 5; i++)
+		Q::post(&sq, c);
+
+	if (sq.tail != 1)
+		return 1;
+
+	for (int i = 0; i < 3; i++)
+		cqes[i].sfp = cpu_to_le16(0x1);
+
+	if (!Q::get_cqe(&cq) || Q::reap_batch(&cq, batch, 4) != 2 || Q::get_cqe(&cq))
+		return 1;
+
+	/* the phase flips at the wrap */
+	cqes[3].sfp = cpu_to_le16(0x1);
+	cqes[0].sfp = 0;
+	cqes[0].cid = 7;
+
+	if (Q::reap_batch(&cq, batch, 4) != 2 || cq.head != 1 || cq.phase != 1)
+		return 1;
+
+	/* command identifiers are masked into range */
+	return Q::rq_from_cqe(&cq, batch[1]) == &rqs[3] ? 0 : 1;
+}
 
 int main()
 {
-    return 0;
+	struct nvme_sq sq = {};
+	struct nvme_rq rqs[2] = {};
+	union nvme_cmd wr = nvme::cmd::write(1, 0x20, 1);
+
+	sq.qsize = 3;
+	sq.rqs = rqs;
+
+	for (int i = 1; i >= 0; i--) {
+		rqs[i].sq = &sq;
+		rqs[i].cid = (uint16_t)i;
+
+		nvme_rq_release(&rqs[i]);
+	}
+
+	if (le64_to_cpu(wr.rw.slba) != 0x20 || le16_to_cpu(wr.rw.nlb) != 0)
+		return 1;
+
+	/* an empty block range is rejected */
+	try {
+		nvme::cmd::write(1, 0x20, 0);
+		return 1;
+	} catch (const std::invalid_argument &) {
+	}
+
+	{
+		auto rq = nvme::Request::acquire(&sq);
+		auto other = nvme::Request::acquire(&sq);
+
+		if (!rq || !other || nvme::Request::acquire(&sq))
+			return 1;
+
+		/* ownership moves; the moved-from handle does not release */
+		nvme::Request moved = std::move(*rq);
+		if (*rq || !moved)
+			return 1;
+	}
+
+	/* both trackers were released */
+	struct nvme_rq *top = __nvme_rq_top(&sq, sq.rq_top);
+	if (top != &rqs[0] && top != &rqs[1])
+		return 1;
+
+	if (!nvme::Request::acquire(&sq))
+		return 1;
+
+	if (test_pow2())
+		return 1;
+
+#ifdef LIBVFN_HAVE_COROUTINE
+	return test_coroutine();
+#else
+	return 0;
+#endif
 }
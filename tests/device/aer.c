@@ -18,10 +18,11 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <nvme/types.h>
 
-#include "ccan/array_size/array_size.h"
+#include "ccan/compiler/compiler.h"
 #include "ccan/err/err.h"
 #include "ccan/opt/opt.h"
 #include "ccan/tap/tap.h"
@@ -30,9 +31,6 @@
 
 #include "common.h"
 
-#define __foreach(x, arr) \
-	for (typeof(arr[0]) *x = arr; x < &arr[ARRAY_SIZE(arr)]; x++)
-
 static bool aen_received;
 
 static int get_smart_log(void)
@@ -60,7 +58,7 @@ static int get_smart_log(void)
 	return ret;
 }
 
-static void handle_aen(struct nvme_cqe *cqe)
+static void handle_aen(struct nvme_ctrl *ctrl UNUSED, struct nvme_cqe *cqe, void *opaque UNUSED)
 {
 	uint32_t dw0 = le32_to_cpu(cqe->dw0);
 	int type, info, lid;
@@ -83,10 +81,8 @@ static void handle_aen(struct nvme_cqe *cqe)
 static int test_aer(void)
 {
 	union nvme_cmd cmd;
-	struct nvme_rq *rq;
-	struct nvme_cqe cqe, cqes[2];
-	struct timespec timeout = {.tv_sec = 1};
-	int ret;
+	struct nvme_cqe cqe;
+	struct timespec start, now;
 
 	uint32_t temp_thresh;
 
@@ -111,6 +107,8 @@ static int test_aer(void)
 
 	diag("current temperature threshold is %"PRIu32" K", temp_thresh);
 
+	nvme_aer_set_handler(&ctrl, handle_aen, NULL);
+
 	if (nvme_aer(&ctrl, NULL))
 		err(1, "could not post aer");
 
@@ -121,31 +119,21 @@ static int test_aer(void)
 	};
 
 	/*
-	 * We cannot use on the synchronous "oneshot" admin queue helper since
-	 * there is no guarantee that the Set Feature command completes prior to
-	 * the AER being delivered. So drop down a level and handle submission
-	 * and completions on our own.
+	 * The event may be delivered before or after the Set Features command
+	 * completes; either way, nvme_admin() only waits for its own completion
+	 * and hands the event to the handler.
 	 */
+	if (nvme_admin(&ctrl, &cmd, NULL, 0, NULL))
+		err(1, "could not set temperature threshold");
 
-	rq = nvme_rq_acquire(ctrl.adminq.sq);
-	if (!rq)
-		err(1, "could not acquire rq");
-
-	nvme_rq_exec(rq, &cmd);
-
-	ret = nvme_cq_wait_cqes(ctrl.adminq.cq, cqes, 2, &timeout);
-	if (ret < 2 && errno == ETIMEDOUT)
-		err(errno, "not enough completions in time");
-
-	__foreach(_cqe, cqes) {
-		if (_cqe->cid & NVME_CID_AER) {
-			/* clear the AER bit so nvme_rq_from_cqe() can find the rq */
-			_cqe->cid &= ~NVME_CID_AER;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-			handle_aen(_cqe);
-		}
+	while (!aen_received) {
+		nvme_admin_process(&ctrl);
 
-		nvme_rq_release(nvme_rq_from_cqe(&ctrl, _cqe));
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - start.tv_sec > 1)
+			errx(1, "no event in time");
 	}
 
 	assert(aen_received);
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Cache line layout of the queue and request tracker structures.
+ *
+ * Fields written by the submitting thread, fields written by the reaping
+ * thread and read-mostly configuration must not share cache lines. This is
+ * part of the ABI; a failing assertion here means the layout changed.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <vfn/nvme.h>
+
+#define CL __VFN_CACHELINE_SIZE
+
+#define line_of(type, member) (offsetof(type, member) / CL)
+
+/* last byte of @member */
+#define end_of(type, member) \
+	(offsetof(type, member) + sizeof(((type *)0)->member) - 1)
+
+#define same_line(type, a, b) (line_of(type, a) == end_of(type, b) / CL)
+
+/* @member starts on a cache line after the one holding the last byte of @prev */
+#define new_line(type, prev, member) \
+	(offsetof(type, member) % CL == 0 && end_of(type, prev) < offsetof(type, member))
+
+/* submission queue: producer fields and reported head on their own lines */
+static_assert(_Alignof(struct nvme_sq) == CL, "nvme_sq alignment");
+static_assert(sizeof(struct nvme_sq) % CL == 0, "nvme_sq size");
+static_assert(new_line(struct nvme_sq, rqs, tail), "nvme_sq producer line");
+static_assert(same_line(struct nvme_sq, tail, ptail), "nvme_sq tail/ptail");
+static_assert(same_line(struct nvme_sq, tail, rq_top), "nvme_sq tail/rq_top");
+static_assert(new_line(struct nvme_sq, stats, head), "nvme_sq completion line");
+
+/* completion queue: consumer fields on their own line(s) */
+static_assert(_Alignof(struct nvme_cq) == CL, "nvme_cq alignment");
+static_assert(sizeof(struct nvme_cq) % CL == 0, "nvme_cq size");
+static_assert(new_line(struct nvme_cq, sqs, head), "nvme_cq consumer line");
+static_assert(end_of(struct nvme_cq, dbbuf) < offsetof(struct nvme_cq, head), "nvme_cq dbbuf");
+static_assert(same_line(struct nvme_cq, head, phead), "nvme_cq head/phead");
+static_assert(same_line(struct nvme_cq, head, phase), "nvme_cq head/phase");
+
+/* request tracker: hot fields in the first line */
+static_assert(_Alignof(struct nvme_rq) == CL, "nvme_rq alignment");
+static_assert(sizeof(struct nvme_rq) % CL == 0, "nvme_rq size");
+static_assert(same_line(struct nvme_rq, opaque, rq_next), "nvme_rq opaque/rq_next");
+static_assert(same_line(struct nvme_rq, opaque, cache), "nvme_rq opaque/cache");
+static_assert(same_line(struct nvme_rq, opaque, cb_arg), "nvme_rq opaque/cb_arg");
+static_assert(same_line(struct nvme_rq, opaque, cid), "nvme_rq opaque/cid");
+static_assert(same_line(struct nvme_rq, opaque, seq), "nvme_rq opaque/seq");
+
+/* request tracker cache: remote releases on their own line */
+static_assert(new_line(struct nvme_rq_cache, free, remote), "nvme_rq_cache remote line");
+static_assert(sizeof(struct nvme_rq_cache) % CL == 0, "nvme_rq_cache size");
+
+int main(void)
+{
+	return 0;
+}
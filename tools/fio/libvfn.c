@@ -0,0 +1,497 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * fio external ioengine built on libvfn
+ *
+ * Each fio thread gets its own I/O queue pair on a controller that is shared
+ * by all threads using the same device. I/O buffers are allocated and mapped
+ * once (see fio_libvfn_iomem_alloc()), so submitting an io_u only builds the
+ * command and its prp list. Commands are posted by ->queue() and the doorbell
+ * is written once per batch by ->commit(); ->getevents() reaps completions in
+ * batches and writes the head doorbell once per batch.
+ *
+ * The filename is the pci address of the controller, with dots instead of
+ * colons (which fio uses as a filename separator), e.g.,
+ *
+ *	fio --thread=1 --ioengine=external:./build/tools/fio/libvfn-fio.so \
+ *		--filename=0000.01.00.0 --nsid=1 --rw=randread --bs=4k --iodepth=32
+ */
+
+#include <pthread.h>
+
+#include "fio.h"
+#include "optgroup.h"
+
+#include <vfn/nvme.h>
+
+enum {
+	LIBVFN_NVM_WRITE	= 0x01,
+	LIBVFN_NVM_READ		= 0x02,
+	LIBVFN_NVM_FLUSH	= 0x00,
+};
+
+struct libvfn_options {
+	void *pad;
+	unsigned int nsid;
+	unsigned int nqueues;
+};
+
+static struct fio_option options[] = {
+	{
+		.name = "nsid",
+		.lname = "namespace identifier",
+		.type = FIO_OPT_INT,
+		.off1 = offsetof(struct libvfn_options, nsid),
+		.def = "1",
+		.help = "namespace identifier",
+		.category = FIO_OPT_C_ENGINE,
+		.group = FIO_OPT_G_INVALID,
+	},
+	{
+		.name = "nqueues",
+		.lname = "number of i/o queues",
+		.type = FIO_OPT_INT,
+		.off1 = offsetof(struct libvfn_options, nqueues),
+		.def = "63",
+		.help = "number of i/o queue pairs to request from the controller",
+		.category = FIO_OPT_C_ENGINE,
+		.group = FIO_OPT_G_INVALID,
+	},
+	{
+		.name = NULL,
+	},
+};
+
+/* controllers are shared by all threads that use the same device */
+struct libvfn_ctrl {
+	char bdf[32];
+	struct nvme_ctrl ctrl;
+
+	int refs;
+	int next_qid;
+
+	struct libvfn_ctrl *next;
+};
+
+static struct libvfn_ctrl *ctrls;
+static pthread_mutex_t ctrls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct libvfn_thread {
+	struct libvfn_ctrl *lc;
+	struct nvme_ns *ns;
+	struct nvme_sq *sq;
+	struct nvme_cq *cq;
+	int qid;
+
+	/* the iova of td->orig_buffer */
+	uint64_t iova;
+
+	struct nvme_cqe **cqes;
+	struct io_u **events;
+};
+
+static void libvfn_bdf(char *bdf, size_t len, const char *name)
+{
+	int dots = 0;
+
+	snprintf(bdf, len, "%s", name);
+
+	/* DDDD.BB.DD.F to DDDD:BB:DD.F */
+	for (char *p = bdf; *p && dots < 2; p++) {
+		if (*p == '.') {
+			*p = ':';
+			dots++;
+		}
+	}
+}
+
+static struct libvfn_ctrl *libvfn_ctrl_get(const char *name, unsigned int nqueues)
+{
+	struct nvme_ctrl_opts opts = {
+		.nsqr = (int)nqueues - 1,
+		.ncqr = (int)nqueues - 1,
+	};
+	struct libvfn_ctrl *lc;
+	char bdf[32];
+
+	libvfn_bdf(bdf, sizeof(bdf), name);
+
+	pthread_mutex_lock(&ctrls_lock);
+
+	for (lc = ctrls; lc; lc = lc->next) {
+		if (!strcmp(lc->bdf, bdf)) {
+			lc->refs++;
+			goto out;
+		}
+	}
+
+	lc = calloc(1, sizeof(*lc));
+	if (!lc)
+		goto out;
+
+	if (nvme_init(&lc->ctrl, bdf, &opts)) {
+		log_err("libvfn: could not initialize %s: %s\n", bdf, strerror(errno));
+
+		free(lc);
+		lc = NULL;
+
+		goto out;
+	}
+
+	snprintf(lc->bdf, sizeof(lc->bdf), "%s", bdf);
+
+	lc->refs = 1;
+	lc->next_qid = 1;
+	lc->next = ctrls;
+
+	ctrls = lc;
+
+out:
+	pthread_mutex_unlock(&ctrls_lock);
+
+	return lc;
+}
+
+static void libvfn_ctrl_put(struct libvfn_ctrl *lc)
+{
+	struct libvfn_ctrl **p;
+
+	pthread_mutex_lock(&ctrls_lock);
+
+	if (--lc->refs)
+		goto out;
+
+	for (p = &ctrls; *p != lc; p = &(*p)->next)
+		;
+
+	*p = lc->next;
+
+	nvme_close(&lc->ctrl);
+	free(lc);
+
+out:
+	pthread_mutex_unlock(&ctrls_lock);
+}
+
+static int libvfn_alloc_qid(struct libvfn_ctrl *lc)
+{
+	int qid = -1;
+
+	pthread_mutex_lock(&ctrls_lock);
+
+	if (lc->next_qid <= lc->ctrl.config.nsqa + 1 && lc->next_qid <= lc->ctrl.config.ncqa + 1)
+		qid = lc->next_qid++;
+
+	pthread_mutex_unlock(&ctrls_lock);
+
+	return qid;
+}
+
+static void fio_libvfn_cleanup(struct thread_data *td)
+{
+	struct libvfn_thread *lt = td->io_ops_data;
+
+	if (!lt)
+		return;
+
+	if (lt->sq && nvme_delete_ioqpair(&lt->lc->ctrl, lt->qid))
+		log_err("libvfn: could not delete queue pair %d\n", lt->qid);
+
+	if (lt->lc)
+		libvfn_ctrl_put(lt->lc);
+
+	free(lt->cqes);
+	free(lt->events);
+	free(lt);
+
+	td->io_ops_data = NULL;
+}
+
+/*
+ * Attach the controller when the job is set up (before the job threads are
+ * started), such that the size of the namespace is known for the initial file
+ * layout.
+ */
+static int fio_libvfn_setup(struct thread_data *td)
+{
+	struct libvfn_options *o = td->eo;
+	struct libvfn_thread *lt;
+	struct fio_file *f;
+
+	if (!td->o.use_thread) {
+		log_err("libvfn: the controller is shared by all jobs; set thread=1\n");
+		return 1;
+	}
+
+	if (td->o.nr_files != 1) {
+		log_err("libvfn: exactly one device per job is supported\n");
+		return 1;
+	}
+
+	if (td->io_ops_data)
+		return 0;
+
+	lt = calloc(1, sizeof(*lt));
+	if (!lt)
+		return 1;
+
+	td->io_ops_data = lt;
+
+	f = td->files[0];
+
+	lt->lc = libvfn_ctrl_get(f->file_name, o->nqueues);
+	if (!lt->lc)
+		goto err;
+
+	lt->ns = nvme_ns_get(&lt->lc->ctrl, o->nsid);
+	if (!lt->ns) {
+		log_err("libvfn: nsid %u is not an active namespace\n", o->nsid);
+		goto err;
+	}
+
+	f->real_file_size = lt->ns->nsze << lt->ns->lbads;
+	fio_file_set_size_known(f);
+
+	return 0;
+
+err:
+	fio_libvfn_cleanup(td);
+
+	return 1;
+}
+
+static int fio_libvfn_init(struct thread_data *td)
+{
+	struct libvfn_thread *lt = td->io_ops_data;
+	unsigned int depth = td->o.iodepth;
+
+	lt->cqes = calloc(depth, sizeof(*lt->cqes));
+	lt->events = calloc(depth, sizeof(*lt->events));
+	if (!lt->cqes || !lt->events)
+		return 1;
+
+	lt->qid = libvfn_alloc_qid(lt->lc);
+	if (lt->qid < 0) {
+		log_err("libvfn: out of i/o queues (see nqueues)\n");
+		return 1;
+	}
+
+	/* one slot is reserved for the full queue condition */
+	if (nvme_create_ioqpair(&lt->lc->ctrl, lt->qid, (int)depth + 1, -1, 0x0)) {
+		log_err("libvfn: could not create queue pair %d: %s\n", lt->qid,
+			strerror(errno));
+		return 1;
+	}
+
+	lt->sq = &lt->lc->ctrl.sq[lt->qid];
+	lt->cq = &lt->lc->ctrl.cq[lt->qid];
+
+	return 0;
+}
+
+/* allocate and map all io_u buffers once; io_us use offsets into the mapping */
+static int fio_libvfn_iomem_alloc(struct thread_data *td, size_t total_mem)
+{
+	struct libvfn_thread *lt = td->io_ops_data;
+	ssize_t len;
+
+	len = pgmap(&td->orig_buffer, total_mem);
+	if (len < 0)
+		return 1;
+
+	if (iommu_map_vaddr(__iommu_ctx(&lt->lc->ctrl), td->orig_buffer, (size_t)len, &lt->iova,
+			    0x0)) {
+		log_err("libvfn: could not map i/o buffers: %s\n", strerror(errno));
+
+		pgunmap(td->orig_buffer, (size_t)len);
+		td->orig_buffer = NULL;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static void fio_libvfn_iomem_free(struct thread_data *td)
+{
+	struct libvfn_thread *lt = td->io_ops_data;
+
+	if (!td->orig_buffer)
+		return;
+
+	if (iommu_unmap_vaddr(__iommu_ctx(&lt->lc->ctrl), td->orig_buffer, NULL))
+		log_err("libvfn: could not unmap i/o buffers\n");
+
+	pgunmap(td->orig_buffer, td->orig_buffer_size);
+	td->orig_buffer = NULL;
+}
+
+static int fio_libvfn_open_file(struct thread_data *td, struct fio_file *f)
+{
+	return 0;
+}
+
+static int fio_libvfn_close_file(struct thread_data *td, struct fio_file *f)
+{
+	return 0;
+}
+
+/* the size is set by ->setup() */
+static int fio_libvfn_get_file_size(struct thread_data *td, struct fio_file *f)
+{
+	return 0;
+}
+
+static enum fio_q_status fio_libvfn_queue(struct thread_data *td, struct io_u *io_u)
+{
+	struct libvfn_thread *lt = td->io_ops_data;
+	struct nvme_ctrl *ctrl = &lt->lc->ctrl;
+	struct nvme_ns *ns = lt->ns;
+	uint64_t slba = io_u->offset >> ns->lbads;
+	struct nvme_rq *rq;
+	union nvme_cmd cmd;
+	uint64_t iova;
+	int ret;
+
+	fio_ro_check(td, io_u);
+
+	rq = nvme_rq_acquire(lt->sq);
+	if (!rq)
+		return FIO_Q_BUSY;
+
+	iova = lt->iova + (uint64_t)((char *)io_u->xfer_buf - (char *)td->orig_buffer);
+
+	switch (io_u->ddir) {
+	case DDIR_READ:
+	case DDIR_WRITE:
+		ret = nvme_ns_prep_rw(ns, &cmd,
+				      io_u->ddir == DDIR_READ ? LIBVFN_NVM_READ : LIBVFN_NVM_WRITE,
+				      slba, io_u->xfer_buflen);
+		if (!ret)
+			ret = nvme_rq_map_prp(ctrl, rq, &cmd, iova, io_u->xfer_buflen);
+
+		break;
+
+	case DDIR_TRIM: {
+		struct nvme_rq_dsm_range range = {
+			.slba = slba,
+			.nlb = (uint32_t)nvme_ns_nlb(ns, io_u->xfer_buflen),
+		};
+
+		ret = nvme_rq_prep_dsm(ctrl, rq, ns, &cmd, &range, 1, NVME_DSM_AD);
+
+		break;
+	}
+
+	case DDIR_SYNC:
+		memset(&cmd, 0x0, sizeof(cmd));
+
+		cmd.opcode = LIBVFN_NVM_FLUSH;
+		cmd.nsid = cpu_to_le32(ns->nsid);
+
+		ret = 0;
+
+		break;
+
+	default:
+		ret = -1;
+		errno = EINVAL;
+
+		break;
+	}
+
+	if (ret) {
+		nvme_rq_release(rq);
+
+		io_u->error = errno;
+
+		return FIO_Q_COMPLETED;
+	}
+
+	rq->opaque = io_u;
+
+	/* the doorbell is written by ->commit() */
+	nvme_rq_post(rq, &cmd);
+
+	return FIO_Q_QUEUED;
+}
+
+static int fio_libvfn_commit(struct thread_data *td)
+{
+	struct libvfn_thread *lt = td->io_ops_data;
+
+	nvme_sq_flush_tail(lt->sq);
+
+	return 0;
+}
+
+/* completions are polled; @t is not honored */
+static int fio_libvfn_getevents(struct thread_data *td, unsigned int min, unsigned int max,
+				const struct timespec *t)
+{
+	struct libvfn_thread *lt = td->io_ops_data;
+	unsigned int n = 0;
+	int reaped;
+
+	do {
+		reaped = nvme_cq_reap_batch(lt->cq, lt->cqes, (int)(max - n));
+
+		for (int i = 0; i < reaped; i++) {
+			struct nvme_rq *rq = __nvme_rq_from_cqe(lt->sq, lt->cqes[i]);
+			struct io_u *io_u = rq->opaque;
+
+			io_u->error = nvme_cqe_ok(lt->cqes[i]) ? 0 : EIO;
+			lt->events[n++] = io_u;
+
+			nvme_rq_release(rq);
+		}
+
+		if (reaped)
+			nvme_cq_update_head(lt->cq);
+	} while (n < min);
+
+	return (int)n;
+}
+
+static struct io_u *fio_libvfn_event(struct thread_data *td, int event)
+{
+	struct libvfn_thread *lt = td->io_ops_data;
+
+	return lt->events[event];
+}
+
+struct ioengine_ops ioengine = {
+	.name			= "libvfn",
+	.version		= FIO_IOOPS_VERSION,
+	.flags			= FIO_RAWIO | FIO_NOEXTEND | FIO_NODISKUTIL | FIO_MEMALIGN,
+	.setup			= fio_libvfn_setup,
+	.init			= fio_libvfn_init,
+	.cleanup		= fio_libvfn_cleanup,
+	.open_file		= fio_libvfn_open_file,
+	.close_file		= fio_libvfn_close_file,
+	.get_file_size		= fio_libvfn_get_file_size,
+	.queue			= fio_libvfn_queue,
+	.commit			= fio_libvfn_commit,
+	.getevents		= fio_libvfn_getevents,
+	.event			= fio_libvfn_event,
+	.iomem_alloc		= fio_libvfn_iomem_alloc,
+	.iomem_free		= fio_libvfn_iomem_free,
+	.options		= options,
+	.option_struct_size	= sizeof(struct libvfn_options),
+};
@@ -16,6 +16,9 @@
  * GNU General Public License for more details.
  */
 
+#include <pthread.h>
+#include <sys/stat.h>
+
 #include <vfn/support.h>
 #include <vfn/pci.h>
 
@@ -23,69 +26,256 @@
 #include "ccan/opt/opt.h"
 #include "ccan/str/str.h"
 
-static char *bdf = "";
-static bool show_usage, verbose, reset;
+static char *bdf = "", *match = "", *classcode_str = "";
+static bool show_usage, verbose, reset, list, all, new_id;
 
 static struct opt_table opts[] = {
 	OPT_WITHOUT_ARG("-h|--help", opt_set_bool, &show_usage, "show usage"),
 	OPT_WITHOUT_ARG("-v|--verbose", opt_set_bool, &verbose, "verbose"),
 
-	OPT_WITH_ARG("-d|--device BDF", opt_set_charp, opt_show_charp, &bdf, "pci device"),
+	OPT_WITH_ARG("-d|--device BDF[,BDF...]", opt_set_charp, opt_show_charp, &bdf,
+		     "pci device(s)"),
+	OPT_WITHOUT_ARG("-a|--all", opt_set_bool, &all, "all nvme devices"),
+	OPT_WITH_ARG("-m|--match VID:DID", opt_set_charp, opt_show_charp, &match,
+		     "nvme devices with the given vendor and device id"),
+	OPT_WITH_ARG("-c|--class CLASS", opt_set_charp, opt_show_charp, &classcode_str,
+		     "nvme devices with the given class code"),
 	OPT_WITHOUT_ARG("-x|--reset", opt_set_bool, &reset, "reset"),
+	OPT_WITHOUT_ARG("-n|--new-id", opt_set_bool, &new_id,
+			"bind using new_id instead of driver_override"),
+	OPT_WITHOUT_ARG("-l|--list", opt_set_bool, &list, "list nvme devices"),
 
 	OPT_ENDTABLE,
 };
 
-static int do_bind(const char *target)
+struct bind_job {
+	pthread_t thread;
+	char bdf[16];
+	const char *target;
+	int ret;
+};
+
+static bool has_driver_override(const char *dev)
+{
+	__autofree char *path = NULL;
+	struct stat sb;
+
+	if (asprintf(&path, "/sys/bus/pci/devices/%s/driver_override", dev) < 0)
+		err(1, "asprintf");
+
+	return stat(path, &sb) == 0;
+}
+
+static int do_bind(const char *dev, const char *target)
 {
 	unsigned long long vid, did, classcode;
 	__autofree char *driver = NULL;
 
-	if (pci_device_info_get_ull(bdf, "vendor", &vid))
-		err(1, "could not get device vendor id");
+	if (pci_device_info_get_ull(dev, "vendor", &vid)) {
+		warn("%s: could not get device vendor id", dev);
+		return -1;
+	}
 
-	if (pci_device_info_get_ull(bdf, "device", &did))
-		err(1, "could not get device id");
+	if (pci_device_info_get_ull(dev, "device", &did)) {
+		warn("%s: could not get device id", dev);
+		return -1;
+	}
 
-	if (pci_device_info_get_ull(bdf, "class", &classcode))
-		err(1, "could not get device class code");
+	if (pci_device_info_get_ull(dev, "class", &classcode)) {
+		warn("%s: could not get device class code", dev);
+		return -1;
+	}
 
-	if ((classcode & 0xffff00) != 0x010800)
-		errx(1, "%s is not an NVMe device", bdf);
+	if ((classcode & PCI_CLASS_NVME_MASK) != PCI_CLASS_NVME) {
+		warnx("%s is not an NVMe device", dev);
+		return -1;
+	}
 
-	driver = pci_get_driver(bdf);
+	driver = pci_get_driver(dev);
 	if (driver) {
 		if (verbose)
-			printf("device is bound to '%s'; ", driver);
-
-		if (strcmp(driver, target) == 0) {
-			if (verbose)
-				printf("exiting\n");
+			printf("%s: device is bound to '%s'\n", dev, driver);
 
+		if (strcmp(driver, target) == 0)
 			return 0;
-		}
 
 		if (verbose)
-			printf("unbinding\n");
+			printf("%s: unbinding\n", dev);
 
-		if (pci_unbind(bdf))
-			err(1, "could not unbind device");
-
-		if (pci_driver_remove_id(driver, vid, did)) {
-			if (errno != ENODEV)
-				err(1, "could not remove device id from '%s' driver", driver);
+		if (pci_unbind(dev)) {
+			warn("%s: could not unbind device", dev);
+			return -1;
 		}
 	}
 
 	if (verbose)
-		printf("binding to '%s'\n", target);
+		printf("%s: binding to '%s'\n", dev, target);
+
+	/*
+	 * The driver override only affects this device, whereas a new id makes
+	 * the driver pick up all unbound devices with the same id.
+	 */
+	if (!new_id && has_driver_override(dev)) {
+		if (pci_driver_override(dev, target)) {
+			warn("%s: could not set driver override", dev);
+			return -1;
+		}
 
-	if (pci_driver_new_id(target, vid, did)) {
-		if (errno != EEXIST)
-			err(1, "could not add device id to '%s' driver", target);
+		if (pci_probe(dev)) {
+			warn("%s: could not probe device", dev);
+			return -1;
+		}
 
-		if (pci_bind(bdf, target))
-			err(1, "could not bind device to '%s'", target);
+		return 0;
+	}
+
+	if (driver && pci_driver_remove_id(driver, (uint16_t)vid, (uint16_t)did)) {
+		if (errno != ENODEV) {
+			warn("%s: could not remove device id from '%s' driver", dev, driver);
+			return -1;
+		}
+	}
+
+	if (pci_driver_new_id(target, (uint16_t)vid, (uint16_t)did)) {
+		if (errno != EEXIST) {
+			warn("%s: could not add device id to '%s' driver", dev, target);
+			return -1;
+		}
+
+		if (pci_bind(dev, target)) {
+			warn("%s: could not bind device to '%s'", dev, target);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *bind_thread(void *arg)
+{
+	struct bind_job *job = arg;
+
+	job->ret = do_bind(job->bdf, job->target);
+
+	return NULL;
+}
+
+/*
+ * Unbinding waits for the driver to remove the device, which may take a while
+ * for a controller, so do all devices concurrently.
+ */
+static int do_bind_all(struct bind_job *jobs, int n, const char *target)
+{
+	int ret = 0;
+
+	if (n == 1)
+		return do_bind(jobs[0].bdf, target) ? 1 : 0;
+
+	/* new ids are global to the driver; binding devices with the same id would race */
+	if (new_id) {
+		for (int i = 0; i < n; i++) {
+			if (do_bind(jobs[i].bdf, target))
+				ret = 1;
+		}
+
+		return ret;
+	}
+
+	for (int i = 0; i < n; i++) {
+		jobs[i].target = target;
+
+		errno = pthread_create(&jobs[i].thread, NULL, bind_thread, &jobs[i]);
+		if (errno)
+			err(1, "could not create thread");
+	}
+
+	for (int i = 0; i < n; i++) {
+		pthread_join(jobs[i].thread, NULL);
+
+		if (jobs[i].ret)
+			ret = 1;
+	}
+
+	return ret;
+}
+
+/* collect the devices given by --device or matched by --all, --match or --class */
+static int get_devices(struct bind_job **jobs)
+{
+	unsigned long long vid = 0, did = 0, classcode = 0;
+	__autofree struct pci_device_info *devs = NULL;
+	struct bind_job *v;
+	int n, ndevs = 0;
+
+	if (!streq(bdf, "")) {
+		__autofree char *devlist = strdup(bdf);
+		char *tok, *saveptr;
+
+		if (!devlist)
+			err(1, "strdup");
+
+		v = calloc(strcount(bdf, ",") + 1, sizeof(*v));
+		if (!v)
+			err(1, "calloc");
+
+		for (tok = strtok_r(devlist, ",", &saveptr); tok;
+		     tok = strtok_r(NULL, ",", &saveptr)) {
+			if (snprintf(v[ndevs].bdf, sizeof(v[ndevs].bdf), "%s", tok) >=
+			    (int)sizeof(v[ndevs].bdf))
+				errx(1, "invalid device '%s'", tok);
+
+			ndevs++;
+		}
+
+		*jobs = v;
+
+		return ndevs;
+	}
+
+	if (!streq(match, "") && sscanf(match, "%llx:%llx", &vid, &did) != 2)
+		errx(1, "invalid --match parameter '%s'", match);
+
+	if (!streq(classcode_str, "") && sscanf(classcode_str, "%llx", &classcode) != 1)
+		errx(1, "invalid --class parameter '%s'", classcode_str);
+
+	n = pci_scan(PCI_CLASS_NVME, PCI_CLASS_NVME_MASK, &devs);
+	if (n < 0)
+		err(1, "could not scan pci devices");
+
+	v = calloc((size_t)n + 1, sizeof(*v));
+	if (!v)
+		err(1, "calloc");
+
+	for (int i = 0; i < n; i++) {
+		if (!streq(match, "") && (devs[i].vendor != vid || devs[i].device != did))
+			continue;
+
+		if (!streq(classcode_str, "") && devs[i].classcode != classcode)
+			continue;
+
+		memcpy(v[ndevs++].bdf, devs[i].bdf, sizeof(v->bdf));
+	}
+
+	*jobs = v;
+
+	return ndevs;
+}
+
+static int do_list(void)
+{
+	__autofree struct pci_device_info *devs = NULL;
+	int n;
+
+	n = pci_scan(PCI_CLASS_NVME, PCI_CLASS_NVME_MASK, &devs);
+	if (n < 0)
+		err(1, "could not scan pci devices");
+
+	for (int i = 0; i < n; i++) {
+		struct pci_device_info *dev = &devs[i];
+
+		printf("%s %04x:%04x class %06x numa %d iommu group %d driver %s\n", dev->bdf,
+		       dev->vendor, dev->device, dev->classcode, dev->numa_node, dev->iommu_group,
+		       dev->driver[0] ? dev->driver : "(none)");
 	}
 
 	return 0;
@@ -93,17 +283,24 @@ static int do_bind(const char *target)
 
 int main(int argc, char **argv)
 {
+	__autofree struct bind_job *jobs = NULL;
+	int n;
+
 	opt_register_table(opts, NULL);
 	opt_parse(&argc, argv, opt_log_stderr_exit);
 
 	if (show_usage)
 		opt_usage_and_exit(NULL);
 
-	if (streq(bdf, ""))
-		opt_usage_exit_fail("missing --device parameter");
+	if (list)
+		return do_list();
+
+	if (streq(bdf, "") && !all && streq(match, "") && streq(classcode_str, ""))
+		opt_usage_exit_fail("missing --device, --all, --match or --class parameter");
 
-	if (reset)
-		return do_bind("nvme");
+	n = get_devices(&jobs);
+	if (!n)
+		errx(1, "no matching devices");
 
-	return do_bind("vfio-pci");
+	return do_bind_all(jobs, n, reset ? "nvme" : "vfio-pci");
 }
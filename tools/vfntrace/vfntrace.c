@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2022 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vfn/support.h>
+#include <vfn/trace/ring.h>
+
+#include "ccan/err/err.h"
+#include "ccan/minmax/minmax.h"
+#include "ccan/opt/opt.h"
+
+static bool show_usage, raw, nosort;
+
+static struct opt_table opts[] = {
+	OPT_WITHOUT_ARG("-h|--help", opt_set_bool, &show_usage, "show usage"),
+	OPT_WITHOUT_ARG("-r|--raw", opt_set_bool, &raw, "print raw arguments"),
+	OPT_WITHOUT_ARG("-n|--no-sort", opt_set_bool, &nosort,
+			"do not merge threads by timestamp"),
+
+	OPT_ENDTABLE,
+};
+
+static char **read_strtab(FILE *fp, uint32_t n)
+{
+	char **tab = znew_t(char *, n ? n : 1);
+
+	for (uint32_t i = 0; i < n; i++) {
+		size_t len = 0;
+
+		if (getdelim(&tab[i], &len, '\0', fp) < 0)
+			errx(1, "truncated string table");
+	}
+
+	return tab;
+}
+
+static int cmp_records(const void *a, const void *b)
+{
+	const struct trace_ring_record *ra = a, *rb = b;
+
+	if (ra->ticks != rb->ticks)
+		return ra->ticks < rb->ticks ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Format a record using its (printf-style) format string. Arguments were
+ * recorded converted to 64 bits, so the original width is recovered from the
+ * length modifier of each conversion.
+ */
+static void print_formatted(const char *fmt, const struct trace_ring_record *r)
+{
+	char spec[32];
+	int arg = 0;
+
+	for (const char *p = fmt; *p; p++) {
+		const char *start = p;
+		int h = 0, l = 0;
+		uint64_t v;
+		size_t len;
+
+		if (*p != '%') {
+			if (*p != '\n' || p[1] != '\0')
+				putchar(*p);
+
+			continue;
+		}
+
+		if (p[1] == '%') {
+			putchar('%');
+			p++;
+
+			continue;
+		}
+
+		/* flags, width and precision */
+		p++;
+		p += strspn(p, "-+ #0123456789.");
+
+		len = (size_t)(p - start);
+		if (len + 4 > sizeof(spec))
+			errx(1, "unsupported format string '%s'", fmt);
+
+		memcpy(spec, start, len);
+
+		for (;; p++) {
+			if (*p == 'h')
+				h++;
+			else if (*p == 'l' || *p == 'z' || *p == 'j' || *p == 't')
+				l++;
+			else
+				break;
+		}
+
+		if (!*p)
+			errx(1, "invalid format string '%s'", fmt);
+
+		v = arg < r->nargs ? r->args[arg] : 0;
+		arg++;
+
+		switch (*p) {
+		case 'd':
+		case 'i':
+			memcpy(&spec[len], "lld", 4);
+
+			if (l)
+				printf(spec, (long long)v);
+			else if (h == 1)
+				printf(spec, (long long)(int16_t)v);
+			else if (h > 1)
+				printf(spec, (long long)(int8_t)v);
+			else
+				printf(spec, (long long)(int32_t)v);
+
+			break;
+
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			spec[len] = 'l';
+			spec[len + 1] = 'l';
+			spec[len + 2] = *p;
+			spec[len + 3] = '\0';
+
+			if (l)
+				printf(spec, (unsigned long long)v);
+			else if (h == 1)
+				printf(spec, (unsigned long long)(uint16_t)v);
+			else if (h > 1)
+				printf(spec, (unsigned long long)(uint8_t)v);
+			else
+				printf(spec, (unsigned long long)(uint32_t)v);
+
+			break;
+
+		case 'c':
+			putchar((int)(v & 0xff));
+
+			break;
+
+		case 'p':
+			printf("0x%" PRIx64, v);
+
+			break;
+
+		case 's':
+			/* the string is not available offline */
+			printf("<str 0x%" PRIx64 ">", v);
+
+			break;
+
+		default:
+			errx(1, "unsupported conversion '%c' in '%s'", *p, fmt);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_ring_header hdr;
+	struct trace_ring_record *records;
+	char **events, **fmts;
+	uint64_t t0;
+	FILE *fp;
+
+	opt_register_table(opts, NULL);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+
+	if (show_usage || argc != 2) {
+		opt_usage_and_exit("[OPTION...] FILE");
+		return 1;
+	}
+
+	fp = fopen(argv[1], "r");
+	if (!fp)
+		err(1, "could not open %s", argv[1]);
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+		errx(1, "truncated header");
+
+	if (memcmp(hdr.magic, TRACE_RING_MAGIC, sizeof(hdr.magic)))
+		errx(1, "not a libvfn trace file");
+
+	if (hdr.version != TRACE_RING_VERSION)
+		errx(1, "unsupported trace file version %" PRIu32, hdr.version);
+
+	events = read_strtab(fp, hdr.nevents);
+	fmts = read_strtab(fp, hdr.nfmts);
+
+	records = xmalloc(max(hdr.nrecords, (uint64_t)1) * sizeof(*records));
+
+	if (fread(records, sizeof(*records), hdr.nrecords, fp) != hdr.nrecords)
+		errx(1, "truncated records");
+
+	fclose(fp);
+
+	if (!nosort)
+		qsort(records, hdr.nrecords, sizeof(*records), cmp_records);
+
+	t0 = hdr.nrecords ? records[0].ticks : 0;
+
+	for (uint64_t i = 1; i < hdr.nrecords; i++)
+		t0 = min(t0, records[i].ticks);
+
+	for (uint64_t i = 0; i < hdr.nrecords; i++) {
+		struct trace_ring_record *r = &records[i];
+		const char *event = r->event < hdr.nevents ? events[r->event] : "?";
+
+		if (r->fmt >= hdr.nfmts)
+			errx(1, "invalid format string index %" PRIu64, r->fmt);
+
+		printf("%14.3f %7" PRIu32 " %s ",
+		       (double)(r->ticks - t0) * 1e6 / (double)hdr.ticks_freq, r->tid, event);
+
+		if (raw) {
+			printf("fmt %" PRIu64, r->fmt);
+
+			for (int j = 0; j < r->nargs; j++)
+				printf(" 0x%" PRIx64, r->args[j]);
+		} else {
+			print_formatted(fmts[r->fmt], r);
+		}
+
+		putchar('\n');
+	}
+
+	return 0;
+}
@@ -0,0 +1,691 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * This file is part of libvfn.
+ *
+ * Copyright (C) 2023 The libvfn Authors. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+/*
+ * Expose a namespace of a controller driven by libvfn as a ublk block device
+ * (/dev/ublkbN).
+ *
+ * Each ublk hardware queue is served by a thread of its own, polling an io_uring
+ * for requests from the kernel and an NVMe I/O queue pair (with the same
+ * queue identifier) for their completions. Every ublk tag owns a buffer that is
+ * allocated and mapped for DMA up front; the kernel copies the data of the
+ * request to and from it, and the controller reads and writes it directly.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#include <linux/ublk_cmd.h>
+
+#include <vfn/nvme.h>
+
+#include "ccan/compiler/compiler.h"
+#include "ccan/err/err.h"
+#include "ccan/minmax/minmax.h"
+#include "ccan/opt/opt.h"
+#include "ccan/str/str.h"
+
+#ifdef UBLK_U_CMD_ADD_DEV
+#define UBLK_CTRL_OP(op) UBLK_U_CMD_##op
+#define UBLK_IO_OP(op) UBLK_U_IO_##op
+#else
+#define UBLK_CTRL_OP(op) UBLK_CMD_##op
+#define UBLK_IO_OP(op) UBLK_IO_##op
+#endif
+
+/* nvm command set flush opcode */
+#define NVME_NVM_FLUSH 0x00
+
+/* how often a thread waiting for requests checks if it should stop */
+#define VFNUBLK_WAIT_NSEC (100 * 1000 * 1000)
+
+static char *bdf = "";
+static unsigned int nsid = 1, nqueues = 1, depth = 128, max_io_kb = 256;
+static bool show_usage, verbose;
+
+static struct opt_table opts[] = {
+	OPT_WITHOUT_ARG("-h|--help", opt_set_bool, &show_usage, "show usage"),
+	OPT_WITHOUT_ARG("-v|--verbose", opt_set_bool, &verbose, "verbose"),
+
+	OPT_WITH_ARG("-d|--device BDF", opt_set_charp, opt_show_charp, &bdf, "pci device"),
+	OPT_WITH_ARG("-n|--nsid NSID", opt_set_uintval, opt_show_uintval, &nsid,
+		     "namespace identifier"),
+	OPT_WITH_ARG("-q|--queues N", opt_set_uintval, opt_show_uintval, &nqueues,
+		     "number of queues"),
+	OPT_WITH_ARG("-D|--depth N", opt_set_uintval, opt_show_uintval, &depth,
+		     "queue depth"),
+	OPT_WITH_ARG("-m|--max-io KB", opt_set_uintval, opt_show_uintval, &max_io_kb,
+		     "maximum i/o size in KiB (limited by mdts)"),
+
+	OPT_ENDTABLE,
+};
+
+/* a minimal io_uring with 128 byte submission queue entries */
+struct uring {
+	int fd;
+	unsigned int entries;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	void *sqes;
+	struct io_uring_cqe *cqes;
+
+	/* entries queued but not yet submitted */
+	unsigned int pending;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+};
+
+#define URING_SQE_SIZE 128
+
+static int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p = { .flags = IORING_SETUP_SQE128 };
+
+	memset(r, 0x0, sizeof(*r));
+
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->entries = p.sq_entries;
+	r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * URING_SQE_SIZE;
+
+	r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if (r->sq_ring != MAP_FAILED)
+			munmap(r->sq_ring, r->sq_ring_len);
+		if (r->cq_ring != MAP_FAILED)
+			munmap(r->cq_ring, r->cq_ring_len);
+		if (r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqes_len);
+
+		close(r->fd);
+
+		return -1;
+	}
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+
+	return 0;
+}
+
+static void uring_fini(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_len);
+	munmap(r->cq_ring, r->cq_ring_len);
+	munmap(r->sq_ring, r->sq_ring_len);
+
+	close(r->fd);
+}
+
+/* queue a ublk command; submitted by the next uring_enter() */
+static void uring_cmd(struct uring *r, int fd, unsigned int op, const void *cmd, size_t len,
+		      uint64_t user_data)
+{
+	unsigned int tail = *r->sq_tail, idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = r->sqes + idx * URING_SQE_SIZE;
+
+	/* there is never more than one command per tag in flight */
+	assert(tail - atomic_load_acquire(r->sq_head) < r->entries);
+
+	memset(sqe, 0x0, URING_SQE_SIZE);
+
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = op;
+	sqe->user_data = user_data;
+	memcpy(sqe->cmd, cmd, len);
+
+	r->sq_array[idx] = idx;
+	atomic_store_release(r->sq_tail, tail + 1);
+
+	r->pending++;
+}
+
+/* submit queued commands and, if @wait, wait a while for a completion */
+static int uring_enter(struct uring *r, bool wait)
+{
+	struct timespec ts = { .tv_nsec = VFNUBLK_WAIT_NSEC };
+	struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+	unsigned int flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+	long ret;
+
+	if (!r->pending && !wait)
+		return 0;
+
+	ret = syscall(__NR_io_uring_enter, r->fd, r->pending, wait ? 1 : 0, flags, &arg,
+		      sizeof(arg));
+	if (ret < 0) {
+		if (errno == EINTR || errno == ETIME || errno == EBUSY)
+			return 0;
+
+		return -1;
+	}
+
+	r->pending -= (unsigned int)ret;
+
+	return 0;
+}
+
+static struct io_uring_cqe *uring_peek(struct uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == atomic_load_acquire(r->cq_tail))
+		return NULL;
+
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static void uring_advance(struct uring *r)
+{
+	atomic_store_release(r->cq_head, *r->cq_head + 1);
+}
+
+struct ublk_queue;
+
+struct ublk_tag {
+	struct ublk_queue *q;
+	uint16_t tag;
+
+	struct vfn_bdev_io io;
+};
+
+struct ublk_queue {
+	uint16_t id;
+	pthread_t thread;
+	bool failed;
+
+	struct uring ring;
+	struct ublksrv_io_desc *descs;
+	size_t descs_len;
+
+	struct vfn_bdev_queue bq;
+	void *vaddr;
+	uint64_t iova;
+	struct ublk_tag *tags;
+
+	/* ublk commands owned by the kernel */
+	unsigned int cmds;
+
+	/* requests issued to the controller (including plugged i/os) */
+	unsigned int busy;
+};
+
+static struct nvme_ctrl ctrl;
+static struct vfn_bdev bdev;
+static struct ublk_queue *queues;
+static size_t max_io;
+
+static int cdev_fd;
+static struct ublksrv_ctrl_dev_info dev_info;
+
+static pthread_barrier_t ready;
+static bool stopping;
+
+static int ublk_ctrl(int fd, unsigned int op, void *buf, size_t len, uint64_t data)
+{
+	struct ublksrv_ctrl_cmd cmd = {
+		.dev_id = dev_info.dev_id,
+		.queue_id = (uint16_t)-1,
+		.addr = (uint64_t)(uintptr_t)buf,
+		.len = (uint16_t)len,
+		.data = { data },
+	};
+	struct io_uring_cqe *cqe;
+	struct uring r;
+	int ret;
+
+	if (uring_init(&r, 4))
+		return -1;
+
+	uring_cmd(&r, fd, op, &cmd, sizeof(cmd), 0);
+
+	do {
+		if (uring_enter(&r, true)) {
+			uring_fini(&r);
+			return -1;
+		}
+	} while (!(cqe = uring_peek(&r)));
+
+	ret = cqe->res;
+
+	uring_fini(&r);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ublk_commit(struct ublk_queue *q, uint16_t tag, int result)
+{
+	struct ublksrv_io_cmd cmd = {
+		.q_id = q->id,
+		.tag = tag,
+		.result = result,
+		.addr = (uint64_t)(uintptr_t)(q->vaddr + tag * max_io),
+	};
+
+	uring_cmd(&q->ring, cdev_fd, UBLK_IO_OP(COMMIT_AND_FETCH_REQ), &cmd, sizeof(cmd), tag);
+
+	q->cmds++;
+}
+
+static void ublk_io_complete(struct vfn_bdev_io *io, struct nvme_cqe *cqe)
+{
+	struct ublk_tag *t = io->opaque;
+	struct ublk_queue *q = t->q;
+
+	q->busy--;
+
+	if (!nvme_cqe_ok(cqe)) {
+		if (verbose)
+			warnx("queue %u tag %u: i/o failed (sfp 0x%x)", q->id, t->tag,
+			      le16_to_cpu(cqe->sfp));
+
+		ublk_commit(q, t->tag, -EIO);
+		return;
+	}
+
+	ublk_commit(q, t->tag, (int)((size_t)io->nlb << bdev.ns->lbads));
+}
+
+static void ublk_flush_complete(struct nvme_rq *rq UNUSED, struct nvme_cqe *cqe, void *arg)
+{
+	struct ublk_tag *t = arg;
+	struct ublk_queue *q = t->q;
+
+	q->busy--;
+
+	ublk_commit(q, t->tag, nvme_cqe_ok(cqe) ? 0 : -EIO);
+}
+
+static void ublk_handle(struct ublk_queue *q, uint16_t tag)
+{
+	struct ublksrv_io_desc *iod = &q->descs[tag];
+	struct ublk_tag *t = &q->tags[tag];
+	unsigned int shift = bdev.ns->lbads - 9;
+	union nvme_cmd cmd;
+	struct nvme_rq *rq;
+
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_READ:
+	case UBLK_IO_OP_WRITE:
+		t->io = (struct vfn_bdev_io) {
+			.op = ublksrv_get_op(iod) == UBLK_IO_OP_READ ?
+				VFN_BDEV_OP_READ : VFN_BDEV_OP_WRITE,
+			.slba = iod->start_sector >> shift,
+			.nlb = iod->nr_sectors >> shift,
+			.iova = q->iova + tag * max_io,
+			.cb = ublk_io_complete,
+			.opaque = t,
+		};
+
+		/* the plug is full and the queue with it; reap until it drains */
+		while (vfn_bdev_add(&q->bq, &t->io)) {
+			if (errno != EBUSY) {
+				ublk_commit(q, tag, -errno);
+				return;
+			}
+
+			vfn_bdev_poll(&q->bq, (int)depth);
+		}
+
+		q->busy++;
+
+		return;
+
+	case UBLK_IO_OP_FLUSH:
+		/* one tracker per tag, so there is always one to spare */
+		rq = nvme_rq_acquire(q->bq.sq);
+		if (!rq) {
+			ublk_commit(q, tag, -EBUSY);
+			return;
+		}
+
+		cmd = (union nvme_cmd) {
+			.rw.opcode = NVME_NVM_FLUSH,
+			.rw.nsid = cpu_to_le32(bdev.ns->nsid),
+		};
+
+		nvme_rq_submit(rq, &cmd, ublk_flush_complete, t);
+		nvme_sq_update_tail(q->bq.sq);
+
+		q->busy++;
+
+		return;
+
+	default:
+		ublk_commit(q, tag, -EOPNOTSUPP);
+		return;
+	}
+}
+
+static int ublk_queue_setup(struct ublk_queue *q)
+{
+	size_t stride = ALIGN_UP(UBLK_MAX_QUEUE_DEPTH * sizeof(struct ublksrv_io_desc),
+				 (size_t)__VFN_PAGESIZE);
+
+	/* the ublk commands of a queue must be issued by the thread serving it */
+	if (uring_init(&q->ring, depth)) {
+		warn("could not set up io_uring for queue %u", q->id);
+		return -1;
+	}
+
+	q->descs_len = ALIGN_UP(depth * sizeof(struct ublksrv_io_desc), (size_t)__VFN_PAGESIZE);
+	q->descs = mmap(NULL, q->descs_len, PROT_READ, MAP_SHARED | MAP_POPULATE, cdev_fd,
+			(off_t)(UBLKSRV_CMD_BUF_OFFSET + q->id * stride));
+	if (q->descs == MAP_FAILED) {
+		warn("could not map descriptors of queue %u", q->id);
+		goto fini_ring;
+	}
+
+	if (iommu_alloc_node(__iommu_ctx(&ctrl), depth * max_io, ctrl.numa.node, &q->vaddr,
+			     &q->iova)) {
+		warn("could not allocate buffers of queue %u", q->id);
+		goto unmap_descs;
+	}
+
+	q->tags = calloc(depth, sizeof(*q->tags));
+	if (!q->tags)
+		goto free_buffers;
+
+	vfn_bdev_queue_init(&q->bq, &bdev, &ctrl.sq[q->id + 1]);
+
+	for (unsigned int tag = 0; tag < depth; tag++) {
+		struct ublksrv_io_cmd cmd = {
+			.q_id = q->id,
+			.tag = (uint16_t)tag,
+			.addr = (uint64_t)(uintptr_t)(q->vaddr + tag * max_io),
+		};
+
+		q->tags[tag] = (struct ublk_tag) { .q = q, .tag = (uint16_t)tag };
+
+		uring_cmd(&q->ring, cdev_fd, UBLK_IO_OP(FETCH_REQ), &cmd, sizeof(cmd), tag);
+		q->cmds++;
+	}
+
+	if (uring_enter(&q->ring, false)) {
+		warn("could not fetch requests on queue %u", q->id);
+		goto free_tags;
+	}
+
+	return 0;
+
+free_tags:
+	free(q->tags);
+free_buffers:
+	iommu_free(__iommu_ctx(&ctrl), q->vaddr, depth * max_io);
+unmap_descs:
+	munmap(q->descs, q->descs_len);
+fini_ring:
+	uring_fini(&q->ring);
+
+	return -1;
+}
+
+static void *ublk_queue_thread(void *arg)
+{
+	struct ublk_queue *q = arg;
+	struct io_uring_cqe *cqe;
+
+	q->failed = ublk_queue_setup(q) < 0;
+
+	/* the device is started once all queues have fetched (or failed) */
+	pthread_barrier_wait(&ready);
+
+	if (q->failed)
+		return NULL;
+
+	/*
+	 * Requests are fetched again when committed, so the kernel keeps owning
+	 * commands until the device is stopped. Stop when asked to and no
+	 * request is in flight on the controller; closing the ring cancels the
+	 * remaining commands.
+	 */
+	while (q->cmds || q->busy) {
+		if (!q->busy && atomic_load_acquire(&stopping))
+			break;
+
+		/* the completion queue is polled while the controller is busy */
+		if (uring_enter(&q->ring, !q->busy)) {
+			warn("io_uring_enter on queue %u", q->id);
+			break;
+		}
+
+		while ((cqe = uring_peek(&q->ring))) {
+			uint16_t tag = (uint16_t)cqe->user_data;
+			int res = cqe->res;
+
+			uring_advance(&q->ring);
+
+			q->cmds--;
+
+			if (res == UBLK_IO_RES_OK)
+				ublk_handle(q, tag);
+			else if (res != UBLK_IO_RES_ABORT && verbose)
+				warnx("queue %u tag %u: %s", q->id, tag, strerror(-res));
+		}
+
+		if (vfn_bdev_unplug(&q->bq) && errno != EBUSY)
+			warn("could not submit i/o on queue %u", q->id);
+
+		vfn_bdev_poll(&q->bq, (int)depth);
+	}
+
+	uring_fini(&q->ring);
+
+	free(q->tags);
+	iommu_free(__iommu_ctx(&ctrl), q->vaddr, depth * max_io);
+	munmap(q->descs, q->descs_len);
+
+	if (verbose)
+		printf("queue %u: %" PRIu64 " commands, %" PRIu64 " i/os merged\n", q->id,
+		       q->bq.commands, q->bq.merged);
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct nvme_ctrl_opts ctrl_opts = nvme_ctrl_opts_default;
+	struct ublk_params params;
+	char path[32];
+	sigset_t sigs;
+	int ctrl_fd, sig;
+	bool failed = false;
+
+	opt_register_table(opts, NULL);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+
+	if (show_usage)
+		opt_usage_and_exit(NULL);
+
+	if (streq(bdf, ""))
+		opt_usage_exit_fail("missing --device parameter");
+
+	if (!nqueues || nqueues > 64)
+		opt_usage_exit_fail("--queues must be between 1 and 64");
+
+	if (!depth || depth > UBLK_MAX_QUEUE_DEPTH)
+		opt_usage_exit_fail("--depth must be between 1 and %d", UBLK_MAX_QUEUE_DEPTH);
+
+	ctrl_opts.nsqr = ctrl_opts.ncqr = (int)nqueues - 1;
+
+	if (nvme_init(&ctrl, bdf, &ctrl_opts))
+		err(1, "failed to initialize nvme controller");
+
+	if (vfn_bdev_open(&bdev, &ctrl, nsid))
+		err(1, "could not open namespace %u", nsid);
+
+	if (bdev.ns->lbads < 9)
+		errx(1, "logical block size of namespace %u is not supported", nsid);
+
+	/* limited by the controller and by what fits in the prp list page of a tracker */
+	max_io = min_t(size_t, (size_t)max_io_kb << 10, (size_t)bdev.ns->max_nlb << bdev.ns->lbads);
+	if (ctrl.config.mdts)
+		max_io = min_t(size_t, max_io, ctrl.config.mdts);
+
+	max_io = ALIGN_DOWN(max_io, (size_t)__VFN_PAGESIZE);
+	if (max_io < (1ULL << bdev.ns->lbads))
+		errx(1, "maximum i/o size is smaller than the logical block size");
+
+	/* the 1:1 mapping of ublk queues to nvme queue pairs */
+	for (unsigned int i = 0; i < nqueues; i++) {
+		if (nvme_create_ioqpair(&ctrl, (int)i + 1, (int)depth + 1, -1, 0x0))
+			err(1, "could not create i/o queue pair %u", i + 1);
+	}
+
+	ctrl_fd = open("/dev/ublk-control", O_RDWR);
+	if (ctrl_fd < 0)
+		err(1, "could not open /dev/ublk-control");
+
+	dev_info = (struct ublksrv_ctrl_dev_info) {
+		.nr_hw_queues = (uint16_t)nqueues,
+		.queue_depth = (uint16_t)depth,
+		.max_io_buf_bytes = (uint32_t)max_io,
+		.dev_id = (uint32_t)-1,
+#ifdef UBLK_F_CMD_IOCTL_ENCODE
+		.flags = UBLK_F_CMD_IOCTL_ENCODE,
+#endif
+	};
+
+	if (ublk_ctrl(ctrl_fd, UBLK_CTRL_OP(ADD_DEV), &dev_info, sizeof(dev_info), 0))
+		err(1, "could not add ublk device");
+
+	params = (struct ublk_params) {
+		.len = sizeof(params),
+		.types = UBLK_PARAM_TYPE_BASIC,
+		.basic = {
+			.attrs = UBLK_ATTR_VOLATILE_CACHE,
+			.logical_bs_shift = bdev.ns->lbads,
+			.physical_bs_shift = bdev.ns->lbads,
+			.io_opt_shift = bdev.ns->lbads,
+			.io_min_shift = bdev.ns->lbads,
+			.max_sectors = (uint32_t)(max_io >> 9),
+			.dev_sectors = bdev.ns->nsze << (bdev.ns->lbads - 9),
+		},
+	};
+
+	if (ublk_ctrl(ctrl_fd, UBLK_CTRL_OP(SET_PARAMS), &params, sizeof(params), 0)) {
+		warn("could not set ublk device parameters");
+		failed = true;
+		goto del_dev;
+	}
+
+	snprintf(path, sizeof(path), "/dev/ublkc%u", dev_info.dev_id);
+
+	cdev_fd = open(path, O_RDWR);
+	if (cdev_fd < 0) {
+		warn("could not open %s", path);
+		failed = true;
+		goto del_dev;
+	}
+
+	/* only the main thread handles signals */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	queues = calloc(nqueues, sizeof(*queues));
+	if (!queues)
+		err(1, "could not allocate queues");
+
+	pthread_barrier_init(&ready, NULL, nqueues + 1);
+
+	for (unsigned int i = 0; i < nqueues; i++) {
+		queues[i].id = (uint16_t)i;
+
+		if (pthread_create(&queues[i].thread, NULL, ublk_queue_thread, &queues[i]))
+			err(1, "could not create thread for queue %u", i);
+	}
+
+	pthread_barrier_wait(&ready);
+
+	for (unsigned int i = 0; i < nqueues; i++)
+		failed |= queues[i].failed;
+
+	if (failed) {
+		warnx("could not set up all queues");
+		goto stop;
+	}
+
+	if (ublk_ctrl(ctrl_fd, UBLK_CTRL_OP(START_DEV), NULL, 0, (uint64_t)getpid())) {
+		warn("could not start ublk device");
+		failed = true;
+		goto stop;
+	}
+
+	printf("/dev/ublkb%u: %s nsid %u, %u queue(s) of depth %u\n", dev_info.dev_id, bdf, nsid,
+	       nqueues, depth);
+
+	fflush(stdout);
+
+	sigwait(&sigs, &sig);
+
+	if (ublk_ctrl(ctrl_fd, UBLK_CTRL_OP(STOP_DEV), NULL, 0, 0))
+		warn("could not stop ublk device");
+
+stop:
+	atomic_store_release(&stopping, true);
+
+	for (unsigned int i = 0; i < nqueues; i++)
+		pthread_join(queues[i].thread, NULL);
+
+	pthread_barrier_destroy(&ready);
+	free(queues);
+
+	close(cdev_fd);
+
+del_dev:
+	if (ublk_ctrl(ctrl_fd, UBLK_CTRL_OP(DEL_DEV), NULL, 0, 0))
+		warn("could not delete ublk device");
+
+	close(ctrl_fd);
+
+	nvme_close(&ctrl);
+
+	return failed ? 1 : 0;
+}